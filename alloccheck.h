@@ -0,0 +1,25 @@
+#ifndef ALLOCCHECK_H
+#define ALLOCCHECK_H
+
+/* built with -DALLOCCHECK, the heap allocations each thread makes are
+   counted, and ALLOC_CHECK says on stderr when one was made between
+   ALLOC_MARK and there, once the code in between has been through a
+   few times; see alloccheck.c. without it they compile to nothing */
+
+#ifdef ALLOCCHECK
+
+unsigned long alloc_count();
+void alloc_check(unsigned long mark, const char *what, int *seen);
+
+#define ALLOC_MARK() alloc_count()
+#define ALLOC_CHECK(m, what) \
+	do { static int seen_; alloc_check((m), (what), &seen_); } while (0)
+
+#else
+
+#define ALLOC_MARK() 0UL
+#define ALLOC_CHECK(m, what) ((void)(m))
+
+#endif
+
+#endif
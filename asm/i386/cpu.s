@@ -36,6 +36,7 @@
 	.set tim, cpu+44
 	.set lcdc, cpu+48
 	.set snd, cpu+52
+	.set clock, cpu+72
 
 	.set regs, ram
 
@@ -2380,6 +2381,8 @@ opdone:
 	movl %ebp, PC
 	movl 20(%esp), %eax
 	subl %esi, %eax
+	addl %eax, clock
+	adcl $0, clock+4
 	
 	popl %edi
 	popl %esi
@@ -2412,6 +2415,8 @@ cpu_step:
 	call cpu_idle
 	popl %edx
 	popl %edx
+	addl %eax, clock
+	adcl $0, clock+4
 	subl %eax, %edx
 	jnz .Lruncpu
 	ret
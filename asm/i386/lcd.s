@@ -2,16 +2,16 @@
 #include "asmnames.h"
 
 	.set vram, lcd
-	.set buf, scan+512
-	.set pal1, scan+768
-	.set pal2, scan+896
-	.set pal4, scan+1024
-
-	.set bg, scan
-	.set buf, scan+512
-	.set u, scan+1792+24
-	.set v, scan+1792+28
-	.set wx, scan+1792+32
+	.set buf, scan+320
+	.set pal1, scan+1088
+	.set pal2, scan+1216
+	.set pal4, scan+1344
+
+	.set bg, scan+64
+	.set buf, scan+320
+	.set u, scan+24
+	.set v, scan+28
+	.set wx, scan+32
 	
 	.data
 	.balign 4
@@ -208,14 +208,14 @@ bg_scan_color:
 	movl $bg, %esi
 	movl $buf, %edi
 	leal patpix(,%eax,8), %ebp
-	movl (%esi), %eax
+	movzwl (%esi), %eax
 	movl u, %ebx
 	shll $6, %eax
 	movb $-8, %cl
 	addl %ebx, %eax
 	addb %bl, %cl
-	movb 4(%esi), %bl
-	addl $8, %esi
+	movb 2(%esi), %bl
+	addl $4, %esi
 	addb %cl, %ch
 .Lbsc_preloop:	
 	movb (%ebp,%eax), %dl
@@ -229,11 +229,11 @@ bg_scan_color:
 	jb .Lbsc_done
 	subb $8, %ch
 .Lbsc_loop:	
-	movl (%esi), %eax
-	movl 4(%esi), %edx
+	movzwl (%esi), %eax
+	movzwl 2(%esi), %edx
 	shll $6, %eax
 	movb %dl, %dh
-	addl $8, %esi
+	addl $4, %esi
 	movl %edx, %ebx
 	rorl $16, %edx
 	orl %edx, %ebx
@@ -248,9 +248,9 @@ bg_scan_color:
 	jae .Lbsc_loop
 	addb $8, %ch
 	jz .Lbsc_done
-	movl (%esi), %eax
+	movzwl (%esi), %eax
 	shll $6, %eax
-	movb 4(%esi), %bl
+	movb 2(%esi), %bl
 .Lbsc_postloop:	
 	movb (%ebp,%eax), %dl
 	incl %eax
@@ -0,0 +1,41 @@
+#ifndef __ASM_H__
+#define __ASM_H__
+
+/* the kernels in refresh.c, lcd.c, scaler.c and observe.c here, for
+   x86-64 (sse2, and avx2 when the cpu has it) and arm64 (neon);
+   anywhere else the C ones are used as if this weren't here.
+   emscripten turns sse2 into wasm simd128 (-msimd128 -msse2, see
+   Makefile.wasm), so the sse2 ones serve for webassembly too */
+
+#if defined(__x86_64__) || (defined(__wasm_simd128__) && defined(__SSE2__))
+#define SIMD_SSE2
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_AVX2
+#endif
+
+#if defined(SIMD_SSE2) || defined(__aarch64__)
+
+#define ASM_REFRESH_2
+#define ASM_REFRESH_4
+
+#define ASM_REFRESH_2_2X
+#define ASM_REFRESH_4_2X
+
+#define ASM_REFRESH_4_3X
+
+#define ASM_REFRESH_4_4X
+
+#define ASM_REFRESH_YUV
+
+#define ASM_UPDATEPATPIX
+
+#define ASM_SPR_BLEND8
+
+#define ASM_SCALER_EDGES
+
+#define ASM_OBSERVE_ROW
+
+#endif
+
+#endif /* __ASM_H__ */
@@ -0,0 +1,158 @@
+/*
+ * lcd.c
+ *
+ * updatepatpix with sse2 or neon: a tile's rows are decoded two at a
+ * time, each bitplane byte spread over 8 bytes and tested against the
+ * bit each pixel comes from, in both orders at once, so the mirrored
+ * copy costs a second mask rather than a second pass. The flipped
+ * copies upside down are the same rows in the other order.
+ *
+ * spr_blend8 puts a sprite row over the line with compares and
+ * selects, all 8 pixels in one vector: a pixel is drawn where the
+ * sprite isn't 0, unless the background isn't color 0 there and pri
+ * says it stays in front. Both are in the base instruction set (sse2
+ * on x86-64, neon on arm64), so there's nothing to pick at run time.
+ */
+
+#include "defs.h"
+#include "lcd.h"
+#ifdef USE_ASM
+#include "asm.h"
+#endif
+
+#ifdef ASM_SPR_BLEND8
+
+#ifdef SIMD_SSE2
+
+#include <emmintrin.h>
+
+void spr_blend8(byte *dest, byte *src, byte *bg, byte *pri, byte pal)
+{
+	__m128i zero = _mm_setzero_si128(), s, g, keep;
+
+	s = _mm_loadl_epi64((__m128i *)src);
+	g = _mm_and_si128(_mm_loadl_epi64((__m128i *)bg), _mm_set1_epi8(3));
+	/* where the sprite is clear, or the background stays in front */
+	keep = _mm_or_si128(_mm_cmpeq_epi8(s, zero),
+		_mm_andnot_si128(_mm_cmpeq_epi8(g, zero),
+			_mm_loadl_epi64((__m128i *)pri)));
+	_mm_storel_epi64((__m128i *)dest, _mm_or_si128(
+		_mm_and_si128(keep, _mm_loadl_epi64((__m128i *)dest)),
+		_mm_andnot_si128(keep, _mm_or_si128(s, _mm_set1_epi8(pal)))));
+}
+
+#endif /* SIMD_SSE2 */
+
+#ifdef __aarch64__
+
+#include <arm_neon.h>
+
+void spr_blend8(byte *dest, byte *src, byte *bg, byte *pri, byte pal)
+{
+	uint8x8_t s = vld1_u8(src), keep;
+
+	keep = vorr_u8(vceq_u8(s, vdup_n_u8(0)),
+		vand_u8(vtst_u8(vld1_u8(bg), vdup_n_u8(3)), vld1_u8(pri)));
+	vst1_u8(dest, vbsl_u8(keep, vld1_u8(dest), vorr_u8(s, vdup_n_u8(pal))));
+}
+
+#endif /* __aarch64__ */
+
+#endif /* ASM_SPR_BLEND8 */
+
+#ifdef ASM_UPDATEPATPIX
+
+extern byte patpix[4096][8][8];
+extern byte patdirty[1024];
+extern byte anydirty;
+
+
+#ifdef SIMD_SSE2
+
+#include <emmintrin.h>
+
+/* the bitplane bytes of two rows, each copied to all 8 bytes of its
+   half, high half first as _mm_set_epi64x takes them */
+#define ROWS(a, b) ((a) * 0x0101010101010101ULL), ((b) * 0x0101010101010101ULL)
+
+/* 0xff in each byte of v that has m's bit set */
+#define TEST(v, m) _mm_cmpeq_epi8(_mm_and_si128(v, m), m)
+
+static void decodetile(int i)
+{
+	static const byte order[2][16] =
+	{
+		{ 128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1 },
+		{ 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 },
+	};
+	__m128i m0 = _mm_loadu_si128((__m128i *)order[0]);
+	__m128i m1 = _mm_loadu_si128((__m128i *)order[1]);
+	__m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2), lo, hi, a, b;
+	byte *p = lcd.vbank[0] + (i<<4);
+	int j;
+
+	for (j = 0; j < 8; j += 2, p += 4)
+	{
+		lo = _mm_set_epi64x(ROWS(p[2], p[0]));
+		hi = _mm_set_epi64x(ROWS(p[3], p[1]));
+		a = _mm_or_si128(_mm_and_si128(TEST(lo, m0), one), _mm_and_si128(TEST(hi, m0), two));
+		b = _mm_or_si128(_mm_and_si128(TEST(lo, m1), one), _mm_and_si128(TEST(hi, m1), two));
+		_mm_storeu_si128((__m128i *)patpix[i][j], a);
+		_mm_storeu_si128((__m128i *)patpix[i+1024][j], b);
+		_mm_storeu_si128((__m128i *)patpix[i+2048][6-j], _mm_shuffle_epi32(a, 0x4e));
+		_mm_storeu_si128((__m128i *)patpix[i+3072][6-j], _mm_shuffle_epi32(b, 0x4e));
+	}
+	patdirty[i] = 0;
+}
+
+#endif /* SIMD_SSE2 */
+
+
+#ifdef __aarch64__
+
+#include <arm_neon.h>
+
+static void decodetile(int i)
+{
+	static const byte order[2][16] =
+	{
+		{ 128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1 },
+		{ 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 },
+	};
+	uint8x16_t m0 = vld1q_u8(order[0]), m1 = vld1q_u8(order[1]);
+	uint8x16_t one = vdupq_n_u8(1), two = vdupq_n_u8(2), lo, hi, a, b;
+	byte *p = lcd.vbank[0] + (i<<4);
+	int j;
+
+	for (j = 0; j < 8; j += 2, p += 4)
+	{
+		lo = vcombine_u8(vdup_n_u8(p[0]), vdup_n_u8(p[2]));
+		hi = vcombine_u8(vdup_n_u8(p[1]), vdup_n_u8(p[3]));
+		a = vorrq_u8(vandq_u8(vtstq_u8(lo, m0), one), vandq_u8(vtstq_u8(hi, m0), two));
+		b = vorrq_u8(vandq_u8(vtstq_u8(lo, m1), one), vandq_u8(vtstq_u8(hi, m1), two));
+		vst1q_u8(patpix[i][j], a);
+		vst1q_u8(patpix[i+1024][j], b);
+		vst1q_u8(patpix[i+2048][6-j], vextq_u8(a, a, 8));
+		vst1q_u8(patpix[i+3072][6-j], vextq_u8(b, b, 8));
+	}
+	patdirty[i] = 0;
+}
+
+#endif /* __aarch64__ */
+
+
+void updatepatpix()
+{
+	int i;
+
+	if (!anydirty) return;
+	for (i = 0; i < 1024; i++)
+	{
+		if (i == 384) i = 512;
+		if (i == 896) break;
+		if (patdirty[i]) decodetile(i);
+	}
+	anydirty = 0;
+}
+
+#endif /* ASM_UPDATEPATPIX */
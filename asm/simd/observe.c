@@ -0,0 +1,97 @@
+/*
+ * observe.c
+ *
+ * observe_row sixteen pixels at a time, with sse2 or neon. Neon looks
+ * the brightness of all sixteen up at once, the 64 entry table being
+ * four registers for tbl; sse2 has nothing like it, so there the
+ * lookups are plain loads into a row first. Either way the sums into
+ * blocks of two and four are pairwise adds of neighbouring lanes,
+ * widened as they go, and a row is 160 pixels, ten vectors exactly.
+ */
+
+#include "defs.h"
+#include "observe.h"
+#ifdef USE_ASM
+#include "asm.h"
+#endif
+
+#ifdef ASM_OBSERVE_ROW
+
+#ifdef SIMD_SSE2
+
+#include <emmintrin.h>
+
+#define LD(p) _mm_loadu_si128((__m128i *)(p))
+#define ST(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+
+void observe_row(un16 *acc, byte *buf, byte *lum, int shrink)
+{
+	__m128i v, s, lo = _mm_set1_epi16(0xff), lo32 = _mm_set1_epi32(0xffff);
+	__m128i zero = _mm_setzero_si128();
+	byte g[160];
+	int x;
+
+	for (x = 0; x < 160; x++) g[x] = lum[buf[x] & 63];
+	for (x = 0; x < 160; x += 16)
+	{
+		v = LD(g + x);
+		if (shrink == 1)
+		{
+			ST(acc + x, _mm_add_epi16(LD(acc + x), _mm_unpacklo_epi8(v, zero)));
+			ST(acc + x + 8, _mm_add_epi16(LD(acc + x + 8), _mm_unpackhi_epi8(v, zero)));
+			continue;
+		}
+		/* each pair of bytes as one lane of 16 bits, summed */
+		s = _mm_add_epi16(_mm_and_si128(v, lo), _mm_srli_epi16(v, 8));
+		if (shrink == 2)
+		{
+			ST(acc + x / 2, _mm_add_epi16(LD(acc + x / 2), s));
+			continue;
+		}
+		s = _mm_add_epi32(_mm_and_si128(s, lo32), _mm_srli_epi32(s, 16));
+		s = _mm_packs_epi32(s, s);
+		_mm_storel_epi64((__m128i *)(acc + x / 4), _mm_add_epi16(
+			_mm_loadl_epi64((__m128i *)(acc + x / 4)), s));
+	}
+}
+
+#endif /* SIMD_SSE2 */
+
+#ifdef __aarch64__
+
+#include <arm_neon.h>
+
+void observe_row(un16 *acc, byte *buf, byte *lum, int shrink)
+{
+	uint8x16x4_t t;
+	uint8x16_t g;
+	uint16x8_t s;
+	int x;
+
+	t.val[0] = vld1q_u8(lum);
+	t.val[1] = vld1q_u8(lum + 16);
+	t.val[2] = vld1q_u8(lum + 32);
+	t.val[3] = vld1q_u8(lum + 48);
+	for (x = 0; x < 160; x += 16)
+	{
+		g = vqtbl4q_u8(t, vandq_u8(vld1q_u8(buf + x), vdupq_n_u8(63)));
+		if (shrink == 1)
+		{
+			vst1q_u16(acc + x, vaddw_u8(vld1q_u16(acc + x), vget_low_u8(g)));
+			vst1q_u16(acc + x + 8, vaddw_u8(vld1q_u16(acc + x + 8), vget_high_u8(g)));
+			continue;
+		}
+		s = vpaddlq_u8(g);
+		if (shrink == 2)
+		{
+			vst1q_u16(acc + x / 2, vaddq_u16(vld1q_u16(acc + x / 2), s));
+			continue;
+		}
+		vst1_u16(acc + x / 4, vadd_u16(vld1_u16(acc + x / 4),
+			vmovn_u32(vpaddlq_u16(s))));
+	}
+}
+
+#endif /* __aarch64__ */
+
+#endif /* ASM_OBSERVE_ROW */
@@ -0,0 +1,460 @@
+/*
+ * refresh.c
+ *
+ * The refresh kernels in C with vector intrinsics, for the hosts the
+ * i386 asm doesn't run on. Looking the palette up is still done a
+ * pixel at a time, except with avx2, which has gathers; the gain is
+ * mostly in the scaled modes, where the copies of each pixel are made
+ * with shuffles (or neon's interleaving stores) and written a vector
+ * at a time rather than an int at a time. sse2 is always there on
+ * x86-64, and avx2 is used if cpuid says so; arm64 always has neon,
+ * and webassembly gets the sse2 ones as simd128 (see asm.h).
+ * Only the 16 and 32 bit modes are done; the others are rare enough
+ * to be left to the C in refresh.h.
+ *
+ * refresh_yuv, for fb.yuv 2, looks the even pixels and the odd ones up
+ * apart and makes each 4:2:2 pair of one of each a vector at a time,
+ * the chroma averaged with pavgb or vrhadd. Only the unscaled line
+ * needs it: scaled 2 or 4 every pair is of one pixel and is a plain
+ * copy, and 3 is left to the C.
+ */
+
+#include "defs.h"
+#include "refresh.h"
+
+#ifdef ASM_REFRESH_4
+
+
+/* whatever's left of cnt after the vectors; lines are 160 wide, so
+   normally nothing */
+#define TAIL(T, n) { T *d = dest_; T *p = pal_; T c; int i; \
+	for (; cnt > 0; cnt--) \
+		for (c = p[*(src++)], i = 0; i < n; i++) *(d++) = c; }
+
+/* refresh.h's refresh_yuv, for 3x and the end of a line */
+static void yuvtail(void *dest_, byte *src, void *pal_, int cnt, int n,
+	un32 y0, un32 y1)
+{
+	un32a *d = dest_, *pal = pal_;
+	un32 a = 0, c;
+	int i, odd = 0;
+
+	while (cnt--)
+	{
+		c = pal[*(src++)];
+		for (i = 0; i < n; i++, odd ^= 1)
+			if (odd) *(d++) = YUVPAIR(a, c, y0, y1);
+			else a = c;
+	}
+}
+
+
+#ifdef SIMD_SSE2
+
+#include <emmintrin.h>
+
+static __m128i look4(un32a *pal, byte *s)
+{
+	return _mm_set_epi32(pal[s[3]], pal[s[2]], pal[s[1]], pal[s[0]]);
+}
+
+static __m128i look8(un16a *pal, byte *s)
+{
+	return _mm_set_epi16(pal[s[7]], pal[s[6]], pal[s[5]], pal[s[4]],
+		pal[s[3]], pal[s[2]], pal[s[1]], pal[s[0]]);
+}
+
+/* unscaled there's nothing to shuffle, and gcc's own vectorizing of
+   a plain loop does as well as anything by hand; the same for sse2_2 */
+static void sse2_4(void *dest_, byte *src, void *pal_, int cnt)
+{
+	TAIL(un32a, 1)
+}
+
+static void sse2_4_2x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m128i *d = dest_, v;
+
+	for (; cnt >= 4; cnt -= 4, src += 4, d += 2)
+	{
+		v = look4(pal_, src);
+		_mm_storeu_si128(d, _mm_unpacklo_epi32(v, v));
+		_mm_storeu_si128(d + 1, _mm_unpackhi_epi32(v, v));
+	}
+	dest_ = d;
+	TAIL(un32a, 2)
+}
+
+static void sse2_4_3x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m128i *d = dest_, v;
+
+	for (; cnt >= 4; cnt -= 4, src += 4, d += 3)
+	{
+		v = look4(pal_, src);
+		_mm_storeu_si128(d, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+		_mm_storeu_si128(d + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+		_mm_storeu_si128(d + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+	}
+	dest_ = d;
+	TAIL(un32a, 3)
+}
+
+static void sse2_4_4x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m128i *d = dest_;
+	un32a *pal = pal_;
+
+	for (; cnt > 0; cnt--, src++, d++)
+		_mm_storeu_si128(d, _mm_set1_epi32(pal[*src]));
+}
+
+static void sse2_2(void *dest_, byte *src, void *pal_, int cnt)
+{
+	TAIL(un16a, 1)
+}
+
+static void sse2_2_2x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m128i *d = dest_, v;
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 2)
+	{
+		v = look8(pal_, src);
+		_mm_storeu_si128(d, _mm_unpacklo_epi16(v, v));
+		_mm_storeu_si128(d + 1, _mm_unpackhi_epi16(v, v));
+	}
+	dest_ = d;
+	TAIL(un16a, 2)
+}
+
+
+static void sse2_yuv(void *dest_, byte *src, void *pal_, int cnt,
+	un32 y0, un32 y1)
+{
+	un32a *pal = pal_;
+	__m128i *d = dest_, a, b, c;
+	__m128i m0 = _mm_set1_epi32(y0), m1 = _mm_set1_epi32(y1);
+	__m128i m = _mm_or_si128(m0, m1);
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d++)
+	{
+		a = _mm_set_epi32(pal[src[6]], pal[src[4]], pal[src[2]], pal[src[0]]);
+		b = _mm_set_epi32(pal[src[7]], pal[src[5]], pal[src[3]], pal[src[1]]);
+		c = _mm_andnot_si128(m, _mm_avg_epu8(a, b));
+		a = _mm_or_si128(_mm_and_si128(a, m0), _mm_and_si128(b, m1));
+		_mm_storeu_si128(d, _mm_or_si128(a, c));
+	}
+	yuvtail(d, src, pal_, cnt, 1, y0, y1);
+}
+
+#ifdef SIMD_AVX2
+
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+static int avx2 = -1;
+
+static int hasavx2()
+{
+	if (avx2 < 0)
+	{
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2") != 0;
+	}
+	return avx2;
+}
+
+/* eight pixels' colors, gathered */
+AVX2 static __m256i gather8(void *pal, byte *s)
+{
+	__m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)s));
+	return _mm256_i32gather_epi32((int *)pal, i, 4);
+}
+
+/* eight copies made of v's pixels, as permutevar8x32 takes them */
+#define PERM(a, b, c, d, e, f, g, h) _mm256_setr_epi32(a, b, c, d, e, f, g, h)
+
+AVX2 static void avx2_4(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m256i *d = dest_;
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d++)
+		_mm256_storeu_si256(d, gather8(pal_, src));
+	dest_ = d;
+	TAIL(un32a, 1)
+}
+
+AVX2 static void avx2_4_2x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m256i *d = dest_, v;
+	__m256i p0 = PERM(0, 0, 1, 1, 2, 2, 3, 3);
+	__m256i p1 = PERM(4, 4, 5, 5, 6, 6, 7, 7);
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 2)
+	{
+		v = gather8(pal_, src);
+		_mm256_storeu_si256(d, _mm256_permutevar8x32_epi32(v, p0));
+		_mm256_storeu_si256(d + 1, _mm256_permutevar8x32_epi32(v, p1));
+	}
+	dest_ = d;
+	TAIL(un32a, 2)
+}
+
+AVX2 static void avx2_4_3x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m256i *d = dest_, v;
+	__m256i p0 = PERM(0, 0, 0, 1, 1, 1, 2, 2);
+	__m256i p1 = PERM(2, 3, 3, 3, 4, 4, 4, 5);
+	__m256i p2 = PERM(5, 5, 6, 6, 6, 7, 7, 7);
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 3)
+	{
+		v = gather8(pal_, src);
+		_mm256_storeu_si256(d, _mm256_permutevar8x32_epi32(v, p0));
+		_mm256_storeu_si256(d + 1, _mm256_permutevar8x32_epi32(v, p1));
+		_mm256_storeu_si256(d + 2, _mm256_permutevar8x32_epi32(v, p2));
+	}
+	dest_ = d;
+	TAIL(un32a, 3)
+}
+
+AVX2 static void avx2_4_4x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	__m256i *d = dest_, v;
+	__m256i p0 = PERM(0, 0, 0, 0, 1, 1, 1, 1);
+	__m256i p1 = PERM(2, 2, 2, 2, 3, 3, 3, 3);
+	__m256i p2 = PERM(4, 4, 4, 4, 5, 5, 5, 5);
+	__m256i p3 = PERM(6, 6, 6, 6, 7, 7, 7, 7);
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 4)
+	{
+		v = gather8(pal_, src);
+		_mm256_storeu_si256(d, _mm256_permutevar8x32_epi32(v, p0));
+		_mm256_storeu_si256(d + 1, _mm256_permutevar8x32_epi32(v, p1));
+		_mm256_storeu_si256(d + 2, _mm256_permutevar8x32_epi32(v, p2));
+		_mm256_storeu_si256(d + 3, _mm256_permutevar8x32_epi32(v, p3));
+	}
+	dest_ = d;
+	TAIL(un32a, 4)
+}
+
+/* sixteen pixels as words split into the even ones and the odd ones,
+   each gathered */
+AVX2 static void avx2_yuv(void *dest_, byte *src, void *pal_, int cnt,
+	un32 y0, un32 y1)
+{
+	__m256i *d = dest_, i, a, b, c;
+	__m256i m0 = _mm256_set1_epi32(y0), m1 = _mm256_set1_epi32(y1);
+	__m256i m = _mm256_or_si256(m0, m1), lo = _mm256_set1_epi32(0xff);
+
+	for (; cnt >= 16; cnt -= 16, src += 16, d++)
+	{
+		i = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)src));
+		a = _mm256_i32gather_epi32((int *)pal_, _mm256_and_si256(i, lo), 4);
+		b = _mm256_i32gather_epi32((int *)pal_, _mm256_srli_epi32(i, 8), 4);
+		c = _mm256_andnot_si256(m, _mm256_avg_epu8(a, b));
+		a = _mm256_or_si256(_mm256_and_si256(a, m0), _mm256_and_si256(b, m1));
+		_mm256_storeu_si256(d, _mm256_or_si256(a, c));
+	}
+	yuvtail(d, src, pal_, cnt, 1, y0, y1);
+}
+
+#define PICK(f) if (hasavx2()) avx2_##f(dest, src, pal, cnt); \
+	else sse2_##f(dest, src, pal, cnt);
+
+#else
+
+#define PICK(f) sse2_##f(dest, src, pal, cnt);
+
+#endif
+
+/* the 16 bit ones gather no better than sse2 does, since every
+   other 16 bits of what's gathered is thrown away */
+void refresh_2(void *dest, byte *src, void *pal, int cnt)
+{
+	sse2_2(dest, src, pal, cnt);
+}
+
+void refresh_2_2x(void *dest, byte *src, void *pal, int cnt)
+{
+	sse2_2_2x(dest, src, pal, cnt);
+}
+
+void refresh_4(void *dest, byte *src, void *pal, int cnt)
+{
+	PICK(4)
+}
+
+void refresh_4_2x(void *dest, byte *src, void *pal, int cnt)
+{
+	PICK(4_2x)
+}
+
+void refresh_4_3x(void *dest, byte *src, void *pal, int cnt)
+{
+	PICK(4_3x)
+}
+
+void refresh_4_4x(void *dest, byte *src, void *pal, int cnt)
+{
+	PICK(4_4x)
+}
+
+void refresh_yuv(void *dest, byte *src, void *pal, int cnt, int n,
+	un32 y0, un32 y1)
+{
+	if (n == 2) refresh_4(dest, src, pal, cnt);
+	else if (n == 4) refresh_4_2x(dest, src, pal, cnt);
+	else if (n != 1) yuvtail(dest, src, pal, cnt, n, y0, y1);
+#ifdef SIMD_AVX2
+	else if (hasavx2()) avx2_yuv(dest, src, pal, cnt, y0, y1);
+#endif
+	else sse2_yuv(dest, src, pal, cnt, y0, y1);
+}
+
+#endif /* SIMD_SSE2 */
+
+
+#ifdef __aarch64__
+
+#include <arm_neon.h>
+
+static uint32x4_t look4(un32a *pal, byte *s)
+{
+	un32 c[4];
+
+	c[0] = pal[s[0]];
+	c[1] = pal[s[1]];
+	c[2] = pal[s[2]];
+	c[3] = pal[s[3]];
+	return vld1q_u32(c);
+}
+
+static uint16x8_t look8(un16a *pal, byte *s)
+{
+	un16 c[8];
+	int i;
+
+	for (i = 0; i < 8; i++) c[i] = pal[s[i]];
+	return vld1q_u16(c);
+}
+
+void refresh_4(void *dest_, byte *src, void *pal_, int cnt)
+{
+	un32 *d = dest_;
+
+	for (; cnt >= 4; cnt -= 4, src += 4, d += 4)
+		vst1q_u32(d, look4(pal_, src));
+	dest_ = d;
+	TAIL(un32a, 1)
+}
+
+void refresh_4_2x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	un32 *d = dest_;
+	uint32x4x2_t v;
+
+	for (; cnt >= 4; cnt -= 4, src += 4, d += 8)
+	{
+		v.val[0] = v.val[1] = look4(pal_, src);
+		vst2q_u32(d, v);
+	}
+	dest_ = d;
+	TAIL(un32a, 2)
+}
+
+void refresh_4_3x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	un32 *d = dest_;
+	uint32x4x3_t v;
+
+	for (; cnt >= 4; cnt -= 4, src += 4, d += 12)
+	{
+		v.val[0] = v.val[1] = v.val[2] = look4(pal_, src);
+		vst3q_u32(d, v);
+	}
+	dest_ = d;
+	TAIL(un32a, 3)
+}
+
+void refresh_4_4x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	un32 *d = dest_;
+	uint32x4x4_t v;
+
+	for (; cnt >= 4; cnt -= 4, src += 4, d += 16)
+	{
+		v.val[0] = v.val[1] = v.val[2] = v.val[3] = look4(pal_, src);
+		vst4q_u32(d, v);
+	}
+	dest_ = d;
+	TAIL(un32a, 4)
+}
+
+void refresh_2(void *dest_, byte *src, void *pal_, int cnt)
+{
+	un16 *d = dest_;
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 8)
+		vst1q_u16(d, look8(pal_, src));
+	dest_ = d;
+	TAIL(un16a, 1)
+}
+
+void refresh_2_2x(void *dest_, byte *src, void *pal_, int cnt)
+{
+	un16 *d = dest_;
+	uint16x8x2_t v;
+
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 16)
+	{
+		v.val[0] = v.val[1] = look8(pal_, src);
+		vst2q_u16(d, v);
+	}
+	dest_ = d;
+	TAIL(un16a, 2)
+}
+
+/* every other pixel of eight */
+static uint32x4_t look4even(un32a *pal, byte *s)
+{
+	un32 c[4];
+
+	c[0] = pal[s[0]];
+	c[1] = pal[s[2]];
+	c[2] = pal[s[4]];
+	c[3] = pal[s[6]];
+	return vld1q_u32(c);
+}
+
+void refresh_yuv(void *dest_, byte *src, void *pal_, int cnt, int n,
+	un32 y0, un32 y1)
+{
+	un32 *d = dest_;
+	uint32x4_t a, b, c, m0, m1;
+
+	if (n != 1)
+	{
+		if (n == 2) refresh_4(dest_, src, pal_, cnt);
+		else if (n == 4) refresh_4_2x(dest_, src, pal_, cnt);
+		else yuvtail(dest_, src, pal_, cnt, n, y0, y1);
+		return;
+	}
+	m0 = vdupq_n_u32(y0);
+	m1 = vdupq_n_u32(y1);
+	for (; cnt >= 8; cnt -= 8, src += 8, d += 4)
+	{
+		a = look4even(pal_, src);
+		b = look4even(pal_, src + 1);
+		c = vreinterpretq_u32_u8(vrhaddq_u8(vreinterpretq_u8_u32(a),
+			vreinterpretq_u8_u32(b)));
+		vst1q_u32(d, vbslq_u32(m0, a, vbslq_u32(m1, b, c)));
+	}
+	yuvtail(d, src, pal_, cnt, 1, y0, y1);
+}
+
+#endif /* __aarch64__ */
+
+#endif /* ASM_REFRESH_4 */
@@ -0,0 +1,130 @@
+/*
+ * scaler.c
+ *
+ * scaler_edges eight pixels at a time, with sse2 or neon. The yuv
+ * planes are 16 bits a sample, so a vector holds the same sample of
+ * eight neighbouring pixels and each distance in xBR's rule is three
+ * absolute differences, a multiply and two adds for all of them; the
+ * sums and compares are then as in the C, done with masks instead of
+ * branches. Rows are 160 wide, 20 vectors exactly, and the planes are
+ * padded so the loads either side stay inside them.
+ */
+
+#include "defs.h"
+#include "scaler.h"
+#ifdef USE_ASM
+#include "asm.h"
+#endif
+
+#ifdef ASM_SCALER_EDGES
+
+#ifdef SIMD_SSE2
+
+#include <emmintrin.h>
+
+#define LD(p, o) _mm_loadu_si128((__m128i *)((p) + (o)))
+
+static __m128i absdiff(__m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a));
+}
+
+static __m128i dist(un16 *y, un16 *u, un16 *v, int a, int b)
+{
+	return _mm_add_epi16(_mm_mullo_epi16(absdiff(LD(y, a), LD(y, b)),
+			_mm_set1_epi16(6)),
+		_mm_add_epi16(absdiff(LD(u, a), LD(u, b)),
+			absdiff(LD(v, a), LD(v, b))));
+}
+
+#define D(a, b) dist(y, u, v, (a), (b))
+
+static __m128i corner(un16 *y, un16 *u, un16 *v, int dx, int dy, int k)
+{
+	__m128i zero = _mm_setzero_si128(), df, dh, e, i, edge;
+
+	df = D(0, dx);
+	dh = D(0, dy);
+	e = _mm_add_epi16(_mm_add_epi16(D(0, dx - dy), D(0, dy - dx)),
+		_mm_add_epi16(_mm_add_epi16(D(dx + dy, 2 * dy), D(dx + dy, 2 * dx)),
+			_mm_slli_epi16(D(dy, dx), 2)));
+	i = _mm_add_epi16(_mm_add_epi16(D(dy, -dx), D(dy, dx + 2 * dy)),
+		_mm_add_epi16(_mm_add_epi16(D(dx, 2 * dx + dy), D(dx, -dy)),
+			_mm_slli_epi16(D(0, dx + dy), 2)));
+	edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi16(df, zero),
+		_mm_cmpeq_epi16(dh, zero)), _mm_cmplt_epi16(e, i));
+	return _mm_and_si128(edge, _mm_or_si128(_mm_set1_epi16(1 << k),
+		_mm_and_si128(_mm_cmpgt_epi16(df, dh), _mm_set1_epi16(16 << k))));
+}
+
+void scaler_edges(byte *flags, un16 *y, un16 *u, un16 *v, int stride)
+{
+	__m128i f;
+	int x;
+
+	for (x = 0; x < 160; x += 8, y += 8, u += 8, v += 8)
+	{
+		f = _mm_or_si128(
+			_mm_or_si128(corner(y, u, v, -1, -stride, 0),
+				corner(y, u, v, 1, -stride, 1)),
+			_mm_or_si128(corner(y, u, v, -1, stride, 2),
+				corner(y, u, v, 1, stride, 3)));
+		_mm_storel_epi64((__m128i *)(flags + x),
+			_mm_packus_epi16(f, _mm_setzero_si128()));
+	}
+}
+
+#endif /* SIMD_SSE2 */
+
+#ifdef __aarch64__
+
+#include <arm_neon.h>
+
+#define LD(p, o) vld1q_u16((p) + (o))
+
+static uint16x8_t dist(un16 *y, un16 *u, un16 *v, int a, int b)
+{
+	return vmlaq_n_u16(vaddq_u16(vabdq_u16(LD(u, a), LD(u, b)),
+			vabdq_u16(LD(v, a), LD(v, b))),
+		vabdq_u16(LD(y, a), LD(y, b)), 6);
+}
+
+#define D(a, b) dist(y, u, v, (a), (b))
+
+static uint16x8_t corner(un16 *y, un16 *u, un16 *v, int dx, int dy, int k)
+{
+	uint16x8_t df, dh, e, i, edge;
+
+	df = D(0, dx);
+	dh = D(0, dy);
+	e = vaddq_u16(vaddq_u16(D(0, dx - dy), D(0, dy - dx)),
+		vaddq_u16(vaddq_u16(D(dx + dy, 2 * dy), D(dx + dy, 2 * dx)),
+			vshlq_n_u16(D(dy, dx), 2)));
+	i = vaddq_u16(vaddq_u16(D(dy, -dx), D(dy, dx + 2 * dy)),
+		vaddq_u16(vaddq_u16(D(dx, 2 * dx + dy), D(dx, -dy)),
+			vshlq_n_u16(D(0, dx + dy), 2)));
+	edge = vandq_u16(vcltq_u16(e, i),
+		vandq_u16(vtstq_u16(df, df), vtstq_u16(dh, dh)));
+	return vandq_u16(edge, vorrq_u16(vdupq_n_u16(1 << k),
+		vandq_u16(vcgtq_u16(df, dh), vdupq_n_u16(16 << k))));
+}
+
+void scaler_edges(byte *flags, un16 *y, un16 *u, un16 *v, int stride)
+{
+	uint16x8_t f;
+	int x;
+
+	for (x = 0; x < 160; x += 8, y += 8, u += 8, v += 8)
+	{
+		f = vorrq_u16(
+			vorrq_u16(corner(y, u, v, -1, -stride, 0),
+				corner(y, u, v, 1, -stride, 1)),
+			vorrq_u16(corner(y, u, v, -1, stride, 2),
+				corner(y, u, v, 1, stride, 3)));
+		vst1_u8(flags + x, vmovn_u16(f));
+	}
+}
+
+#endif /* __aarch64__ */
+
+#endif /* ASM_SCALER_EDGES */
@@ -0,0 +1,21 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* what the emulator is busy with, for --bench to sample. the code
+   that sets it puts back what was there before when it's done */
+enum
+{
+	BENCH_OTHER,
+	BENCH_CPU,
+	BENCH_MEM,
+	BENCH_LCD,
+	BENCH_VRAM,
+	BENCH_SOUND,
+	BENCH_N
+};
+
+extern volatile int bench_in;
+
+void bench_run(int frames, int json);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "defs.h"
+
+/* set while the lcd should hand capture_line every line it draws */
+extern int capturing;
+
+void capture_line(int l, byte *buf);
+void capture_pcm();
+void capture_frame();
+void capture_shot(char *name);
+void capture_stop();
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef CHEAT_H
+#define CHEAT_H
+
+#include "defs.h"
+
+/* how many codes patch the rom; mem.c only looks for patched pages
+   while there are some */
+extern int cheat_rom;
+
+int cheat_add(char *code);
+void cheat_clear();
+void cheat_unload();
+byte *cheat_page(int k);
+void cheat_frame();
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * context.c
+ *
+ * Lets one process run several instances of the same game. The
+ * globals (cpu, mbc, ram, lcd and the rest) stay what the emulator
+ * runs on; a context is a parked copy of them, with its own sram.
+ * context_save parks the running instance and context_load puts one
+ * back, so a frontend can step several of them in turn. ROM is not
+ * copied: every context made from the same load shares rom.bank, as
+ * it does the lookup tables and caches, which get rebuilt on load.
+ *
+ * The renderer's place in the frame is saved too, so instances can
+ * be switched mid-frame as link.c does. What isn't per instance: the
+ * frontend's fb and pcm, the rcvars, the rewind history (reset on
+ * every load) and the loader's battery save, which follows whichever
+ * instance is running. LOWMEM builds keep wram out of struct ram, so
+ * there it's parked by contents, like sram.
+ *
+ * Where the machine's globals share a section (MACHINE in defs.h), a
+ * context keeps a copy of the whole section and is saved or loaded
+ * with a single memcpy; PARKED finds one of them in the copy.
+ *
+ * A context that's going to sit parked a while can be packed:
+ * context_pack lz's the lot into one block, a few kilobytes for most
+ * games, and context_unpack makes it a context again. Nothing
+ * derived from the machine (patpix and the rest) is in a context to
+ * begin with; context_load rebuilds it.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "cpu.h"
+#include "mem.h"
+#include "hw.h"
+#include "regs.h"
+#include "lcd.h"
+#include "rtc.h"
+#include "sound.h"
+#include "rewind.h"
+#include "lz.h"
+#include "context.h"
+
+#ifdef MACHINE_SECTION
+extern byte __start_gbmachine[], __stop_gbmachine[];
+#define MACHINELEN (__stop_gbmachine - __start_gbmachine)
+#define PARKED(c, x) \
+	((__typeof__(&(x)))((c)->machine + ((byte *)&(x) - __start_gbmachine)))
+#else
+#define PARKED(c, x) (&(c)->x)
+#endif
+
+struct context
+{
+#ifdef MACHINE_SECTION
+	byte *machine;
+#else
+	struct cpu cpu;
+	struct mbc mbc;
+	struct ram ram;
+	struct hw hw;
+	struct lcd lcd;
+	struct scan scan;
+	struct rtc rtc;
+	struct snd snd;
+#endif
+	byte *sram;
+	int sramlen;
+#ifdef LOWMEM
+	byte *wram;
+	int wramlen;
+#endif
+};
+
+
+/* the parked machine, without sram (or wram with LOWMEM) */
+#ifdef MACHINE_SECTION
+#define MACHINEOF(c) ((c)->machine)
+#define MACHINESIZE MACHINELEN
+#else
+#define MACHINEOF(c) ((byte *)(c))
+#define MACHINESIZE ((int)offsetof(struct context, sram))
+#endif
+
+static struct context *alloc(int sramlen)
+{
+	struct context *c;
+
+#ifdef MACHINE_SECTION
+	/* the copy of the section goes right after the struct */
+	if (!(c = malloc(sizeof *c + MACHINELEN))) return 0;
+	c->machine = (byte *)(c + 1);
+#else
+	if (!(c = malloc(sizeof *c))) return 0;
+#endif
+	c->sramlen = sramlen;
+	c->sram = 0;
+#ifdef LOWMEM
+	c->wram = 0;
+	c->wramlen = 0;
+#endif
+	if (c->sramlen && !(c->sram = malloc(c->sramlen)))
+	{
+		free(c);
+		return 0;
+	}
+	return c;
+}
+
+/* a new context holding a copy of the running instance */
+struct context *context_new()
+{
+	struct context *c;
+
+	if (!(c = alloc(ram.sbank ? 8192 * mbc.ramsize : 0))) return 0;
+	context_save(c);
+	return c;
+}
+
+void context_free(struct context *c)
+{
+	if (!c) return;
+	free(c->sram);
+#ifdef LOWMEM
+	free(c->wram);
+#endif
+	free(c);
+}
+
+void context_save(struct context *c)
+{
+	lcd_flush();
+#ifdef MACHINE_SECTION
+	memcpy(c->machine, __start_gbmachine, MACHINELEN);
+#else
+	c->cpu = cpu;
+	c->mbc = mbc;
+	c->ram = ram;
+	c->hw = hw;
+	c->lcd = lcd;
+	c->scan = scan;
+	c->rtc = rtc;
+	c->snd = snd;
+#endif
+	if (c->sramlen) memcpy(c->sram, ram.sbank, c->sramlen);
+#ifdef LOWMEM
+	if (c->wramlen != WRAMBANKS << 12)
+	{
+		free(c->wram);
+		c->wramlen = (c->wram = malloc(WRAMBANKS << 12)) ? WRAMBANKS << 12 : 0;
+	}
+	if (c->wramlen) memcpy(c->wram, ram.ibank, c->wramlen);
+#endif
+}
+
+/* the sram buffer itself stays the loader's; only its contents move */
+void context_load(struct context *c)
+{
+	byte (*sbank)[8192] = ram.sbank;
+#ifdef LOWMEM
+	byte (*ibank)[4096] = ram.ibank;
+	int ibanks = ram.ibanks;
+#endif
+
+	lcd_flush();
+#ifdef MACHINE_SECTION
+	memcpy(__start_gbmachine, c->machine, MACHINELEN);
+#else
+	cpu = c->cpu;
+	mbc = c->mbc;
+	ram = c->ram;
+	hw = c->hw;
+	lcd = c->lcd;
+	scan = c->scan;
+	rtc = c->rtc;
+	snd = c->snd;
+#endif
+	ram.sbank = sbank;
+#ifdef LOWMEM
+	ram.ibank = ibank;
+	ram.ibanks = ibanks;
+#endif
+	if (c->sramlen && sbank) memcpy(sbank, c->sram, c->sramlen);
+#ifdef LOWMEM
+	if (!mem_sizewram() && c->wramlen == WRAMBANKS << 12)
+		memcpy(ram.ibank, c->wram, c->wramlen);
+#endif
+	mem_alldirty();
+	mem_updatemap();
+	vram_dirty();
+	pal_dirty();
+	rewind_reset();
+}
+
+/* a packed context starts with the sizes of what's in it */
+struct packhead
+{
+	int raw, sramlen, wramlen;
+};
+
+/* c in one lz block, of *len bytes, and c freed; 0 if there's no
+   memory for it, with c as it was */
+byte *context_pack(struct context *c, int *len)
+{
+	struct packhead h;
+	byte *raw, *out, *p;
+	int n;
+
+	h.sramlen = c->sramlen;
+#ifdef LOWMEM
+	h.wramlen = c->wramlen;
+#else
+	h.wramlen = 0;
+#endif
+	h.raw = MACHINESIZE + h.sramlen + h.wramlen;
+	if (!(raw = malloc(h.raw))) return 0;
+	if (!(out = malloc(sizeof h + LZ_BOUND(h.raw))))
+	{
+		free(raw);
+		return 0;
+	}
+	memcpy(raw, MACHINEOF(c), MACHINESIZE);
+	if (h.sramlen) memcpy(raw + MACHINESIZE, c->sram, h.sramlen);
+#ifdef LOWMEM
+	if (h.wramlen) memcpy(raw + MACHINESIZE + h.sramlen, c->wram, h.wramlen);
+#endif
+	memcpy(out, &h, sizeof h);
+	n = sizeof h + lz_pack(out + sizeof h, raw, h.raw);
+	free(raw);
+	if ((p = realloc(out, n))) out = p;
+	context_free(c);
+	*len = n;
+	return out;
+}
+
+/* a context again from what context_pack made, which stays the
+   caller's; 0 if there's no memory or it won't unpack */
+struct context *context_unpack(byte *in, int len)
+{
+	struct packhead h;
+	struct context *c;
+	byte *raw;
+
+	if (len < (int)sizeof h) return 0;
+	memcpy(&h, in, sizeof h);
+	if (h.raw != MACHINESIZE + h.sramlen + h.wramlen) return 0;
+	if (!(c = alloc(h.sramlen))) return 0;
+	if (!(raw = malloc(h.raw))
+		|| lz_unpack(raw, h.raw, in + sizeof h, len - sizeof h))
+		goto fail;
+#ifdef LOWMEM
+	if (h.wramlen && !(c->wram = malloc(h.wramlen))) goto fail;
+	c->wramlen = h.wramlen;
+	if (h.wramlen) memcpy(c->wram, raw + MACHINESIZE + h.sramlen, h.wramlen);
+#endif
+	memcpy(MACHINEOF(c), raw, MACHINESIZE);
+	if (h.sramlen) memcpy(c->sram, raw + MACHINESIZE, h.sramlen);
+	free(raw);
+	return c;
+fail:
+	free(raw);
+	context_free(c);
+	return 0;
+}
+
+/* a byte coming down the link cable to a parked instance. if it's
+   waiting for one, on the external clock, it takes b, finishes the
+   transfer and gives back what it was sending; otherwise -1 */
+int context_serial(struct context *c, byte b)
+{
+	struct cpu *p = PARKED(c, cpu);
+	byte *hi = PARKED(c, ram)->hi, r = hi[RI_SB];
+
+	if ((hi[RI_SC] & 0x81) != 0x80) return -1;
+	hi[RI_SB] = b;
+	hi[RI_SC] &= 0x7f;
+	hi[RI_IF] |= IF_SERIAL;
+	if ((hi[RI_IE] & IF_SERIAL) && p->ime) p->halt = 0;
+	p->evnext = 0;
+	return r;
+}
+
+/* makes to a copy of from without loading either; both come from the
+   same load, so their sram is the same size */
+void context_copy(struct context *to, struct context *from)
+{
+#ifdef MACHINE_SECTION
+	memcpy(to->machine, from->machine, MACHINELEN);
+#else
+	to->cpu = from->cpu;
+	to->mbc = from->mbc;
+	to->ram = from->ram;
+	to->hw = from->hw;
+	to->lcd = from->lcd;
+	to->scan = from->scan;
+	to->rtc = from->rtc;
+	to->snd = from->snd;
+#endif
+	if (to->sramlen) memcpy(to->sram, from->sram, to->sramlen);
+#ifdef LOWMEM
+	if (from->wramlen && to->wramlen != from->wramlen)
+	{
+		free(to->wram);
+		to->wramlen = (to->wram = malloc(from->wramlen)) ? from->wramlen : 0;
+	}
+	if (to->wramlen) memcpy(to->wram, from->wram, to->wramlen);
+#endif
+}
+
+/* whether two parked instances are in the same state, byte for byte.
+   the renderer's caches are parked too, so two that got there by
+   different ways may not count as the same; the cpu, which differs
+   soonest, is compared first */
+int context_same(struct context *a, struct context *b)
+{
+	if (memcmp(PARKED(a, cpu), PARKED(b, cpu), sizeof cpu)) return 0;
+#ifdef MACHINE_SECTION
+	if (memcmp(a->machine, b->machine, MACHINELEN)) return 0;
+#else
+	if (memcmp(&a->mbc, &b->mbc, sizeof mbc)
+		|| memcmp(&a->ram, &b->ram, sizeof ram)
+		|| memcmp(&a->hw, &b->hw, sizeof hw)
+		|| memcmp(&a->lcd, &b->lcd, sizeof lcd)
+		|| memcmp(&a->scan, &b->scan, sizeof scan)
+		|| memcmp(&a->rtc, &b->rtc, sizeof rtc)
+		|| memcmp(&a->snd, &b->snd, sizeof snd))
+		return 0;
+#endif
+	if (a->sramlen && memcmp(a->sram, b->sram, a->sramlen)) return 0;
+#ifdef LOWMEM
+	if (a->wramlen != b->wramlen
+		|| (a->wramlen && memcmp(a->wram, b->wram, a->wramlen)))
+		return 0;
+#endif
+	return 1;
+}
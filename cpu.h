@@ -15,6 +15,8 @@ union reg
 	un32 d; /* padding for alignment, carry */
 };
 
+/* what every instruction or event touches comes first, so it all
+   shares the one cache line; asm/i386/cpu.s knows the offsets */
 struct cpu
 {
 	union reg pc, sp, bc, de, hl, af;
@@ -24,17 +26,35 @@ struct cpu
 	int div, tim;
 	int lcdc;
 	int snd;
+	int evcnt, evnext;
+	un32 insns; /* instructions interpreted, wrapping; for --bench */
+	int serial; /* cycles left of a serial transfer, 0 if none */
+	unsigned long long clock; /* cycles run, never reset; see gb_clock */
+	int stall; /* cycles dma has kept the cpu off the bus, still owed */
+	int cut; /* see emu_step: -1 while it runs, then what's left of the
+	            line when the lcd went off */
 };
 
+/* the "accuracy" tiers, each its own build of the interpreter */
+#define ACC_FAST 0
+#define ACC_BALANCED 1
+#define ACC_ACCURATE 2
+
 extern struct cpu cpu;
 
 void cpu_reset();
 void div_advance(int cnt);
 void timer_advance(int cnt);
+void serial_advance(int cnt);
 void lcdc_advance(int cnt);
 void sound_advance(int cnt);
 void cpu_timers(int cnt);
+void cpu_sync();
 int cpu_emulate(int cycles);
+int cpu_accuracy(int a);
+void cpu_idleforget();
+void cpu_idlehint(unsigned offset, int cost);
+int cpu_idlefound(unsigned *out, int max);
 
 #endif
 
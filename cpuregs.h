@@ -14,30 +14,38 @@
 #define W(r) ((r).w[LO])
 #define DW(r) ((r).d)
 
-#define A HB(cpu.af)
-#define F LB(cpu.af)
-#define B HB(cpu.bc)
-#define C LB(cpu.bc)
-#define D HB(cpu.de)
-#define E LB(cpu.de)
-#define H HB(cpu.hl)
-#define L LB(cpu.hl)
-
-#define AF W(cpu.af)
-#define BC W(cpu.bc)
-#define DE W(cpu.de)
-#define HL W(cpu.hl)
-
-#define PC W(cpu.pc)
-#define SP W(cpu.sp)
-
-#define xAF DW(cpu.af)
-#define xBC DW(cpu.bc)
-#define xDE DW(cpu.de)
-#define xHL DW(cpu.hl)
-
-#define xPC DW(cpu.pc)
-#define xSP DW(cpu.sp)
+/*
+ * The register macros normally refer to the global cpu, but cpu_emulate
+ * redefines REGS to run on a local copy (see LOAD_REGS in cpu.c).
+ */
+#ifndef REGS
+#define REGS cpu
+#endif
+
+#define A HB(REGS.af)
+#define F LB(REGS.af)
+#define B HB(REGS.bc)
+#define C LB(REGS.bc)
+#define D HB(REGS.de)
+#define E LB(REGS.de)
+#define H HB(REGS.hl)
+#define L LB(REGS.hl)
+
+#define AF W(REGS.af)
+#define BC W(REGS.bc)
+#define DE W(REGS.de)
+#define HL W(REGS.hl)
+
+#define PC W(REGS.pc)
+#define SP W(REGS.sp)
+
+#define xAF DW(REGS.af)
+#define xBC DW(REGS.bc)
+#define xDE DW(REGS.de)
+#define xHL DW(REGS.hl)
+
+#define xPC DW(REGS.pc)
+#define xSP DW(REGS.sp)
 
 #define IMA cpu.ima
 #define IME cpu.ime
@@ -1,7 +1,31 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include "defs.h"
+#include "profile.h"
+
+extern int debug_trace, bintrace, debug_stops;
+extern void (*debug_watchhook)(int a, byte b, int write);
+
+/* whether cpu_emulate has to stop in debug_insn before every
+   instruction, and go through debug_end as it returns */
+#define DEBUG_HOOKED (debug_trace || bintrace > 0 || profiling || opcounting \
+	|| debug_stops)
+
 void debug_disassemble(addr a, int c);
+int debug_mnemonic(char *out, byte *ops);
+void debug_opname(char *out, int op, int cb);
+int debug_oplen(byte op);
+void debug_insn(int elapsed);
+void debug_end(int elapsed);
+int debug_bintracedump(char *name);
+int debug_setbreak(int bank, int a, int on);
+void debug_clearbreaks();
+void debug_setwatch(int a, int len, int how, int on);
+int debug_watching(int a, int write);
+void debug_watch(int a, byte b, int write);
+void debug_stopnext(int sig);
+int debug_peek(int a);
+int debug_poke(int a, byte b);
 
 #endif
-
@@ -6,6 +6,13 @@
 
 
 
+/* small-ram targets (configure --enable-lowmem): the tile cache
+   without flipped copies, and tables made or allocated as they're
+   needed rather than kept around; see INSTALL for what's left */
+#ifdef LOWMEM
+#define COMPACT_PATPIX
+#endif
+
 #ifdef IS_LITTLE_ENDIAN
 #define LO 0
 #define HI 1
@@ -29,6 +36,18 @@ typedef signed int n32;
 typedef un16 word;
 typedef word addr;
 
+/* the machine's own state (cpu, hw, mbc, ram, lcd, scan, snd and rtc)
+   is defined MACHINE: in one section of its own, each part starting on
+   a cache line, so the parts the cpu loop uses all the time sit
+   together and context.c can park or restore all of it with one
+   memcpy. without gcc and elf they're ordinary globals. */
+#if defined(__GNUC__) && defined(__ELF__)
+#define MACHINE __attribute__((section("gbmachine"), aligned(64)))
+#define MACHINE_SECTION
+#else
+#define MACHINE
+#endif
+
 /* stuff from main.c ... */
 void die(char *fmt, ...);
 void doevents();
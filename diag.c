@@ -0,0 +1,320 @@
+/*
+ * diag.c
+ *
+ * Diagnostics from places that can't afford to wait on stdio: the
+ * debugger's trace and its watch and break lines, the loader's
+ * complaints from its worker threads and the frame loop. Each thread
+ * that has something to say gets a ring of its own the first time it
+ * does, and only it ever writes there, so nothing is locked. A thread
+ * of ours empties the rings and writes whole lines, a few at a time,
+ * so lines from different threads, or different batch workers on
+ * one terminal, never run into each other. Where there are no
+ * threads, the rings are emptied by whoever logs, as it goes, and
+ * so it is in a forked child, which has no thread of ours: it drops
+ * what it inherited still waiting, the parent's to write, and takes
+ * over the rings of the threads that didn't come with it. A thread
+ * gives its ring back when it ends (diag_done), for the next to use.
+ *
+ * A line that comes again and again from the same place is only let
+ * through RATE times a second. The rest are counted, and the count
+ * goes out before the next one that is let through. A line that
+ * finds its ring full is dropped and counted the same way, but for
+ * DIAG_ALL ones, the trace, which wait for room: a trace with holes
+ * in it is no use.
+ *
+ * diag_flush waits for everything logged so far to be written. It's
+ * done at exit and by die, and should be done by anything about to
+ * leave without exit (a forked batch worker's _exit).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "defs.h"
+#include "sys.h"
+#include "diag.h"
+
+#ifdef __ATOMIC_ACQUIRE
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define CLAIM(p) __atomic_fetch_add(p, 1, __ATOMIC_ACQ_REL)
+#define TRYLOCK(p) !__atomic_exchange_n(p, 1, __ATOMIC_ACQUIRE)
+#else
+#define LOAD(p) (*(p))
+#define STORE(p, v) (*(p) = (v))
+#define CLAIM(p) ((*(p))++)
+#define TRYLOCK(p) (*(p) ? 0 : (*(p) = 1))
+#endif
+
+#ifdef __GNUC__
+#define LOCAL __thread
+#else
+#define LOCAL
+#endif
+
+#define RINGS 16
+#define RINGSIZE 65536
+#define LINE 512
+#define SITES 16
+#define RATE 20
+/* what goes out in one write; a pipe writes this much in one piece */
+#define CHUNK 4096
+
+static struct ring
+{
+	byte buf[RINGSIZE];
+	unsigned head, tail;
+	/* set while a thread has it */
+	int busy;
+	/* the producer's own: lines it had no room for, and the places
+	   it's been logging from lately, for the rate limit */
+	int lost;
+	struct site
+	{
+		char *fmt;
+		unsigned since;
+		int n, dropped;
+	} sites[SITES];
+} *rings[RINGS];
+
+static int nrings, threaded, draining;
+static LOCAL struct ring *mine;
+static LOCAL int full;
+
+
+/*
+ * The writing side, the thread's or whoever gets the lock.
+ */
+
+static struct out
+{
+	FILE *f;
+	char buf[CHUNK];
+	int len;
+} outs[2];
+
+static void emit(struct out *o)
+{
+	if (!o->len) return;
+	fwrite(o->buf, 1, o->len, o->f);
+	fflush(o->f);
+	o->len = 0;
+}
+
+/* a line of n bytes out of ring r at t, which may wrap */
+static void take(struct ring *r, unsigned t, int err, int n)
+{
+	struct out *o = &outs[err];
+	int i;
+
+	if (o->len + n > CHUNK) emit(o);
+	for (i = 0; i < n; i++)
+		o->buf[o->len + i] = r->buf[(t + i) % RINGSIZE];
+	o->len += n;
+}
+
+/* everything there is now; 1 if there was anything, 0 if not or if
+   someone else is at it already */
+static int drain()
+{
+	struct ring *r;
+	unsigned t, h;
+	int i, n, any = 0;
+
+	if (!TRYLOCK(&draining)) return 0;
+	outs[0].f = stdout;
+	outs[1].f = stderr;
+	for (i = 0; i < LOAD(&nrings) && i < RINGS; i++)
+	{
+		if (!(r = LOAD(&rings[i]))) continue;
+		h = LOAD(&r->head);
+		for (t = r->tail; t != h; t += 3 + n)
+		{
+			n = r->buf[t % RINGSIZE] | r->buf[(t + 1) % RINGSIZE] << 8;
+			take(r, t + 3, r->buf[(t + 2) % RINGSIZE], n);
+		}
+		if (t != r->tail) any = 1;
+		emit(&outs[0]);
+		emit(&outs[1]);
+		STORE(&r->tail, t);
+	}
+	STORE(&draining, 0);
+	return any;
+}
+
+static void worker(void *p)
+{
+	for (;;)
+		if (!drain()) sys_nap(2000);
+}
+
+static int pending()
+{
+	struct ring *r;
+	int i;
+
+	for (i = 0; i < LOAD(&nrings) && i < RINGS; i++)
+		if ((r = LOAD(&rings[i])) && LOAD(&r->tail) != r->head)
+			return 1;
+	return 0;
+}
+
+void diag_flush()
+{
+	int i;
+
+	/* not forever: the thread may be stuck writing to a pipe that
+	   nobody reads */
+	for (i = 0; i < 2000 && pending(); i++)
+		if (!drain()) sys_nap(1000);
+}
+
+
+/*
+ * The logging side.
+ */
+
+/* in the child after a fork, with only the thread that forked */
+static void forked()
+{
+	struct ring *r;
+	int i;
+
+	threaded = -1;
+	draining = 0;
+	outs[0].len = outs[1].len = 0;
+	for (i = 0; i < nrings && i < RINGS; i++)
+	{
+		if (!(r = rings[i])) continue;
+		r->tail = r->head;
+		if (r != mine) r->busy = 0;
+	}
+}
+
+static struct ring *ring()
+{
+	int i;
+
+	if (mine || full) return mine;
+	for (i = 0; i < LOAD(&nrings) && i < RINGS; i++)
+		if (LOAD(&rings[i]) && TRYLOCK(&rings[i]->busy))
+		{
+			/* the rate limit was the last thread's */
+			mine = rings[i];
+			memset(mine->sites, 0, sizeof mine->sites);
+			return mine;
+		}
+	if ((i = CLAIM(&nrings)) >= RINGS || !(mine = calloc(1, sizeof *mine)))
+	{
+		full = 1;
+		return 0;
+	}
+	mine->busy = 1;
+	STORE(&rings[i], mine);
+	if (!i)
+	{
+		atexit(diag_flush);
+		sys_onfork(forked);
+		STORE(&threaded, sys_thread(worker, 0) ? -1 : 1);
+	}
+	return mine;
+}
+
+void diag_done()
+{
+	if (!mine) return;
+	STORE(&mine->busy, 0);
+	mine = 0;
+}
+
+/* 1 if there's no room for n more bytes */
+static int nofit(struct ring *r, int n)
+{
+	return RINGSIZE - (r->head - LOAD(&r->tail)) < (unsigned)n + 3;
+}
+
+static void put(struct ring *r, int err, char *s, int n)
+{
+	unsigned h = r->head;
+	int i;
+
+	r->buf[h % RINGSIZE] = n;
+	r->buf[(h + 1) % RINGSIZE] = n >> 8;
+	r->buf[(h + 2) % RINGSIZE] = err;
+	for (i = 0; i < n; i++)
+		r->buf[(h + 3 + i) % RINGSIZE] = s[i];
+	STORE(&r->head, h + 3 + n);
+}
+
+/* 1 if the line from fmt is one too many this second */
+static int limited(struct ring *r, char *fmt, int *dropped)
+{
+	struct site *s, *old = r->sites;
+	unsigned now = sys_micros();
+
+	for (s = r->sites; s < r->sites + SITES && s->fmt != fmt; s++)
+		if (now - s->since > now - old->since) old = s;
+	if (s == r->sites + SITES)
+	{
+		s = old;
+		s->fmt = fmt;
+		s->since = now;
+		s->n = s->dropped = 0;
+	}
+	if (now - s->since >= 1000000)
+	{
+		s->since = now;
+		s->n = 0;
+	}
+	if (++s->n > RATE)
+	{
+		s->dropped++;
+		return 1;
+	}
+	*dropped = s->dropped;
+	s->dropped = 0;
+	return 0;
+}
+
+void diag(int how, char *fmt, ...)
+{
+	struct ring *r = ring();
+	int err = !!(how & DIAG_ERR), dropped = 0, n = 0;
+	char line[LINE];
+	va_list ap;
+
+	if (!r)
+	{
+		va_start(ap, fmt);
+		vfprintf(err ? stderr : stdout, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	if (!(how & DIAG_ALL) && limited(r, fmt, &dropped)) return;
+	if (r->lost)
+		n = snprintf(line, LINE, "(%d lines lost, no room for them)\n", r->lost);
+	if (dropped)
+		n += snprintf(line + n, LINE - n, "(%d more like the next)\n", dropped);
+	va_start(ap, fmt);
+	n += vsnprintf(line + n, LINE - n, fmt, ap);
+	va_end(ap);
+	if (n >= LINE)
+	{
+		n = LINE - 1;
+		line[n - 1] = '\n';
+	}
+	while (nofit(r, n))
+	{
+		if (!(how & DIAG_ALL))
+		{
+			r->lost += 1 + dropped;
+			return;
+		}
+		if (!drain()) sys_nap(200);
+	}
+	r->lost = 0;
+	put(r, err, line, n);
+	if (LOAD(&threaded) < 0) drain();
+}
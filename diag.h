@@ -0,0 +1,14 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+/* to stderr rather than stdout */
+#define DIAG_ERR 1
+/* never dropped or rate limited; waits for room instead */
+#define DIAG_ALL 2
+
+void diag(int how, char *fmt, ...);
+void diag_flush();
+/* gives the calling thread's ring back, for a thread about to end */
+void diag_done();
+
+#endif
@@ -5,7 +5,12 @@
 
 extern rcvar_t rcfile_exports[], emu_exports[], loader_exports[],
 	lcd_exports[], rtc_exports[], debug_exports[], sound_exports[],
-	vid_exports[], joy_exports[], pcm_exports[], menu_exports[];
+	vid_exports[], joy_exports[], pcm_exports[], menu_exports[],
+	rewind_exports[], movie_exports[], timeline_exports[],
+	profile_exports[], gdbstub_exports[], netlink_exports[],
+	netplay_exports[], capture_exports[], stream_exports[],
+	stats_exports[], cpu_exports[], romdb_exports[],
+	bench_exports[], until_exports[];
 
 
 rcvar_t *sources[] =
@@ -21,6 +26,20 @@ rcvar_t *sources[] =
 	joy_exports,
 	pcm_exports,
 	menu_exports,
+	rewind_exports,
+	movie_exports,
+	timeline_exports,
+	profile_exports,
+	gdbstub_exports,
+	netlink_exports,
+	netplay_exports,
+	capture_exports,
+	stream_exports,
+	stats_exports,
+	cpu_exports,
+	romdb_exports,
+	bench_exports,
+	until_exports,
 	NULL
 };
 
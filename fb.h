@@ -19,10 +19,20 @@ struct fb
 	{
 		int l, r;
 	} cc[4];
+	/* 1: each pixel a 32 bit yuv pair of its own color, two wide on
+	   the screen, pelsize 4; 2: packed 4:2:2 at two bytes a pixel,
+	   pelsize 2, chroma shared by each two. either way cc[0] and
+	   cc[3] place the two y, cc[1] u and cc[2] v */
 	int yuv;
 	int enabled;
 	int dirty;
 	int delegate_scaling;
+	/* set whenever a line is drawn into ptr, for front ends that
+	   need to know whether a frame put anything there */
+	int drawn;
+	/* set by front ends while their window is minimized or otherwise
+	   out of sight, for "whenhidden" */
+	int hidden;
 };
 
 
@@ -33,14 +33,21 @@ struct hw
 
 
 extern struct hw hw;
+extern byte (*hw_link)(byte b);
+extern int (*hw_linkpoll)(byte b);
 
 void hw_interrupt(byte i, byte mask);
 void hw_dma(byte b);
 void hw_hdma();
 void hw_hdma_cmd(byte c);
 void hw_reset();
+void hw_serial_start(byte b);
+void hw_serial_done();
+byte *hw_serial_output(int *len);
 void pad_refresh();
 void pad_set(byte k, int st);
+void pad_capture(byte *to);
+void pad_latepoll(void (*poll)());
 
 #endif
 
@@ -129,6 +129,7 @@ typedef struct event_s
 	int code;
 	int dx, dy;
 	int x, y;
+	unsigned time; /* sys_micros() when it was posted */
 } event_t;
 
 #define EV_NONE 0
@@ -136,9 +137,14 @@ typedef struct event_s
 #define EV_RELEASE 2
 #define EV_REPEAT 3
 #define EV_MOUSE 4
+#define EV_STATE 5
 
 int ev_postevent(event_t *ev);
 int ev_getevent(event_t *ev);
+int ev_peekevent(event_t *ev);
+void ev_hold(int on, unsigned t);
+
+extern int ev_drops;
 
 
 #endif
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "refresh.h"
@@ -6,16 +7,23 @@
 #include "regs.h"
 #include "hw.h"
 #include "mem.h"
+#include "cpu.h"
 #include "lcd.h"
 #include "rc.h"
 #include "fb.h"
+#include "bench.h"
+#include "stats.h"
+#include "timeline.h"
+#include "capture.h"
+#include "stream.h"
+#include "observe.h"
 #ifdef USE_ASM
 #include "asm.h"
 #endif
 
-struct lcd lcd;
+MACHINE struct lcd lcd;
 
-struct scan scan;
+MACHINE struct scan scan;
 
 #define BG (scan.bg)
 #define WND (scan.wnd)
@@ -40,10 +48,30 @@ struct scan scan;
 #define WY (scan.wy)
 #define WT (scan.wt)
 #define WV (scan.wv)
+#define WL (scan.wl)
 
+/* where the next line goes in the framebuffer. it's the front end's,
+   not the machine's, so it's left out of scan and what a context
+   parks */
+static byte *vdest;
+
+/* with COMPACT_PATPIX only the plain orientation of each tile is kept,
+   decoded the first time it is drawn after a change; vertical flips
+   just pick another row and horizontal ones are decoded straight from
+   vram as they are needed. that's 64k less cache to fight over, for a
+   little more work per tile fetched. */
+#ifdef COMPACT_PATPIX
+#ifdef USE_ASM
+#error "COMPACT_PATPIX does not work with the asm lcd routines"
+#endif
+byte patpix[1024][8][8];
+#else
 byte patpix[4096][8][8];
+#endif
 byte patdirty[1024];
 byte anydirty;
+/* the same tiles again, for lcd_offload, which clears them itself */
+byte tiledirty[1024];
 
 # define MAX_SCALE 4
 static int scale = 1;
@@ -53,6 +81,7 @@ static int rgb332;
 
 static int sprsort = 1;
 static int sprdebug;
+static int bglayer;
 
 #define DEF_PAL { 0x98d0e0, 0x68a0b0, 0x60707C, 0x2C3C3C }
 
@@ -76,6 +105,7 @@ rcvar_t lcd_exports[] =
 	RCV_VECTOR("dmg_obp1", dmg_pal[3], 4, "colors for sprite pal 2"),
 	RCV_BOOL("sprsort", &sprsort, "speedhack: disable sprite sorting"),
 	RCV_BOOL("sprdebug", &sprdebug, "debug sprite visibility"),
+	RCV_BOOL("bglayer", &bglayer, "speedhack: keep whole tile maps drawn"),
 	RCV_BOOL("colorfilter", &usefilter, "washed out look like a real CGB"),
 	RCV_BOOL("filterdmg", &filterdmg, "like colorfilter but for DMG"),
 	RCV_VECTOR("red", filter[0], 4, "filter values for red"),
@@ -84,8 +114,6 @@ rcvar_t lcd_exports[] =
 	RCV_END
 };
 
-static byte *vdest;
-
 #if defined(ALLOW_UNALIGNED_IO) && defined(__GNUC__)
 #include <stdint.h>
 static __inline void memcpy8(void *__restrict dest, const void *__restrict src)
@@ -100,60 +128,127 @@ static __inline void memcpy8(void *__restrict dest, const void *__restrict src)
 #endif
 
 
-
+#ifndef COMPACT_PATPIX
+#define PATROW(t, v) (patpix[t][v])
+#endif
 
 #ifndef ASM_UPDATEPATPIX
+/* pixtab[f][b] is the 8 pixels that bitplane byte b stands for, one
+   per byte, left to right (f = 0) or mirrored (f = 1). a tile row is
+   then the low plane's entry or'ed with the high plane's shifted up
+   one, done a word at a time since no pixel ever carries into the
+   next byte. */
+static byte pixtab[2][256][8];
+
+static void pixtab_init()
+{
+	int b, k;
+
+	for (b = 0; b < 256; b++)
+		for (k = 0; k < 8; k++)
+		{
+			pixtab[0][b][7-k] = (b >> k) & 1;
+			pixtab[1][b][k] = (b >> k) & 1;
+		}
+}
+
+static void decoderow(byte *d, byte *lo, byte *hi)
+{
+	un32 l[2], h[2];
+
+	memcpy(l, lo, 8);
+	memcpy(h, hi, 8);
+	l[0] |= h[0] << 1;
+	l[1] |= h[1] << 1;
+	memcpy(d, l, 8);
+}
+
+static void decodetile(int i)
+{
+	int j;
+	byte *p = lcd.vbank[0] + (i<<4);
+
+	patdirty[i] = 0;
+	for (j = 0; j < 8; j++, p += 2)
+		decoderow(patpix[i][j], pixtab[0][p[0]], pixtab[0][p[1]]);
+}
+
+#ifdef COMPACT_PATPIX
+static byte tilerow[8];
+
+/* row v of tile t, flipped as t's flip bits say; a mirrored row is
+   built in tmp and only lasts until tmp is used again */
+static byte *patrow(int t, int v, byte *tmp)
+{
+	byte *p;
+
+	if (t & 2048) v = 7 - v;
+	if (t & 1024)
+	{
+		p = lcd.vbank[0] + ((t & 1023) << 4) + (v << 1);
+		decoderow(tmp, pixtab[1][p[0]], pixtab[1][p[1]]);
+		return tmp;
+	}
+	t &= 1023;
+	if (patdirty[t]) decodetile(t);
+	return patpix[t][v];
+}
+
+#define PATROW(t, v) patrow((t), (v), tilerow)
+
 void updatepatpix()
 {
-	int i, j, k;
-	int a, c;
-	byte *vram = lcd.vbank[0];
+	static int inited;
+
+	if (!inited) pixtab_init(), inited = 1;
+	/* the tiles themselves are decoded as they are fetched */
+	anydirty = 0;
+}
+#else
+void updatepatpix()
+{
+	static int inited;
+	int i, j;
+	byte *p;
 
 	if (!anydirty) return;
+	if (!inited) pixtab_init(), inited = 1;
 	for (i = 0; i < 1024; i++)
 	{
 		if (i == 384) i = 512;
 		if (i == 896) break;
 		if (!patdirty[i]) continue;
-		patdirty[i] = 0;
-		for (j = 0; j < 8; j++)
+		decodetile(i);
+		p = lcd.vbank[0] + (i<<4);
+		for (j = 0; j < 8; j++, p += 2)
 		{
-			a = ((i<<4) | (j<<1));
-			for (k = 0; k < 8; k++)
-			{
-				c = vram[a] & (1<<k) ? 1 : 0;
-				c |= vram[a+1] & (1<<k) ? 2 : 0;
-				patpix[i+1024][j][k] = c;
-			}
-			for (k = 0; k < 8; k++)
-				patpix[i][j][k] =
-					patpix[i+1024][j][7-k];
-		}
-		for (j = 0; j < 8; j++)
-		{
-			for (k = 0; k < 8; k++)
-			{
-				patpix[i+2048][j][k] =
-					patpix[i][7-j][k];
-				patpix[i+3072][j][k] =
-					patpix[i+1024][7-j][k];
-			}
+			decoderow(patpix[i+1024][j], pixtab[1][p[0]], pixtab[1][p[1]]);
+			memcpy(patpix[i+2048][7-j], patpix[i][j], 8);
+			memcpy(patpix[i+3072][7-j], patpix[i+1024][j], 8);
 		}
 	}
 	anydirty = 0;
 }
+#endif
 #endif /* ASM_UPDATEPATPIX */
 
 
 
-void tilebuf()
+/* bumped by every write to the tile maps, so tilebuf can tell when the
+   lists it built for the last line are still good; they normally are
+   for all 8 lines of a tile row */
+static un32 mapgen = 1;
+/* and by writes to the tiles, with each tile's own count in tilever */
+static un32 tilegen = 1, tilever[1024];
+
+static void bg_tilebuf(int cnt)
 {
-	int i, cnt;
+	int i;
 	int base;
 	byte *tilemap, *attrmap;
-	int *tilebuf;
-	int *wrap;
-	static int wraptable[64] =
+	un16 *tilebuf;
+	const int *wrap;
+	static const int wraptable[64] =
 	{
 		0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
 		0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,-32
@@ -164,7 +259,6 @@ void tilebuf()
 	attrmap = lcd.vbank[1] + base;
 	tilebuf = BG;
 	wrap = wraptable + S;
-	cnt = ((WX + 7) >> 3) + 1;
 
 	if (hw.cgb)
 	{
@@ -174,7 +268,8 @@ void tilebuf()
 				*(tilebuf++) = *tilemap
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*attrmap & 0x07) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
 				attrmap += *wrap + 1;
 				tilemap += *(wrap++) + 1;
 			}
@@ -184,7 +279,8 @@ void tilebuf()
 				*(tilebuf++) = (256 + ((n8)*tilemap))
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*attrmap & 0x07) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
 				attrmap += *wrap + 1;
 				tilemap += *(wrap++) + 1;
 			}
@@ -204,14 +300,19 @@ void tilebuf()
 				tilemap += *(wrap++);
 			}
 	}
+}
 
-	if (WX >= 160) return;
+static void wnd_tilebuf(int cnt)
+{
+	int i;
+	int base;
+	byte *tilemap, *attrmap;
+	un16 *tilebuf;
 
 	base = ((R_LCDC & LCDC_BIT_WIN_MAP)?0x1C00:0x1800) + (WT<<5);
 	tilemap = lcd.vbank[0] + base;
 	attrmap = lcd.vbank[1] + base;
 	tilebuf = WND;
-	cnt = ((160 - WX) >> 3) + 1;
 
 	if (hw.cgb)
 	{
@@ -221,7 +322,9 @@ void tilebuf()
 				*(tilebuf++) = *(tilemap++)
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*(attrmap++)&7) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
+				attrmap++;
 			}
 		else
 			for (i = cnt; i > 0; i--)
@@ -229,7 +332,9 @@ void tilebuf()
 				*(tilebuf++) = (256 + ((n8)*(tilemap++)))
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*(attrmap++)&7) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
+				attrmap++;
 			}
 	}
 	else
@@ -243,31 +348,64 @@ void tilebuf()
 	}
 }
 
+void tilebuf()
+{
+	static un32 bgkey, bggen, wndkey, wndgen;
+	un32 key;
+	int cnt;
+
+	cnt = ((WX + 7) >> 3) + 1;
+	key = (R_LCDC & (LCDC_BIT_BG_MAP | LCDC_BIT_TILE_SEL))
+		| T << 8 | S << 13 | cnt << 18 | hw.cgb << 24;
+	if (key != bgkey || mapgen != bggen)
+	{
+		bg_tilebuf(cnt);
+		bgkey = key;
+		bggen = mapgen;
+	}
+
+	if (WX >= 160) return;
+
+	cnt = ((160 - WX) >> 3) + 1;
+	key = (R_LCDC & (LCDC_BIT_WIN_MAP | LCDC_BIT_TILE_SEL))
+		| WT << 8 | cnt << 13 | hw.cgb << 24;
+	if (key != wndkey || mapgen != wndgen)
+	{
+		wnd_tilebuf(cnt);
+		wndkey = key;
+		wndgen = mapgen;
+	}
+}
+
 
 void bg_scan()
 {
 	int cnt;
 	byte *src, *dest;
-	int *tile;
+	un16 *tile;
 
 	if (WX <= 0) return;
 	cnt = WX;
 	tile = BG;
 	dest = BUF;
 
-	src = patpix[*(tile++)][V] + U;
-	memcpy(dest, src, 8-U);
-	dest += 8-U;
-	cnt -= 8-U;
-	if (cnt <= 0) return;
+	/* with no fine scroll every tile is copied whole */
+	if (U)
+	{
+		src = PATROW(*(tile++), V) + U;
+		memcpy(dest, src, 8-U);
+		dest += 8-U;
+		cnt -= 8-U;
+		if (cnt <= 0) return;
+	}
 	while (cnt >= 8)
 	{
-		src = patpix[*(tile++)][V];
+		src = PATROW(*(tile++), V);
 		MEMCPY8(dest, src);
 		dest += 8;
 		cnt -= 8;
 	}
-	src = patpix[*tile][V];
+	src = PATROW(*tile, V);
 	while (cnt--)
 		*(dest++) = *(src++);
 }
@@ -276,7 +414,7 @@ void wnd_scan()
 {
 	int cnt;
 	byte *src, *dest;
-	int *tile;
+	un16 *tile;
 
 	if (WX >= 160) return;
 	cnt = 160 - WX;
@@ -285,12 +423,12 @@ void wnd_scan()
 
 	while (cnt >= 8)
 	{
-		src = patpix[*(tile++)][WV];
+		src = PATROW(*(tile++), WV);
 		MEMCPY8(dest, src);
 		dest += 8;
 		cnt -= 8;
 	}
-	src = patpix[*tile][WV];
+	src = PATROW(*tile, WV);
 	while (cnt--)
 		*(dest++) = *(src++);
 }
@@ -300,66 +438,66 @@ static void blendcpy(byte *dest, byte *src, byte b, int cnt)
 	while (cnt--) *(dest++) = *(src++) | b;
 }
 
-static int priused(void *attr)
+/* blendcpy of a whole tile row, 4 pixels at a time: pattern pixels are
+   0-3 and b only has bits 2-4 set, so nothing crosses a byte */
+static void blendcpy8(byte *dest, byte *src, byte b)
 {
-	un32 *a = attr;
-	return (int)((a[0]|a[1]|a[2]|a[3]|a[4]|a[5]|a[6]|a[7])&0x80808080);
+	un32 w[2], m = b * 0x01010101u;
+
+	memcpy(w, src, 8);
+	w[0] |= m;
+	w[1] |= m;
+	memcpy(dest, w, 8);
 }
 
-void bg_scan_pri()
-{
-	int cnt, i;
-	byte *src, *dest;
+/* the priority mask for the tile whose palette word is p: 0xff if
+   the tile's colors 1-3 go over sprites */
+#define PRIMASK(p) (((p) & 0x100) ? 0xff : 0)
 
-	if (WX <= 0) return;
-	i = S;
-	cnt = WX;
-	dest = PRI;
-	src = lcd.vbank[1] + ((R_LCDC & LCDC_BIT_BG_MAP)?0x1C00:0x1800) + (T<<5);
+/* bg_scan_color and scan.pri together, for cgb lines with sprites on
+   them, in one walk over the tile list. u is the fine scroll */
+static void scan_color_pri(byte *dest, byte *pri, un16 *tile, int v, int u, int cnt)
+{
+	byte *src;
+	un32 m[2];
 
-	if (!priused(src))
+	if (u)
 	{
-		memset(dest, 0, cnt);
-		return;
+		src = PATROW(tile[0], v) + u;
+		blendcpy(dest, src, tile[1], 8-u);
+		memset(pri, PRIMASK(tile[1]), 8-u);
+		tile += 2;
+		dest += 8-u;
+		pri += 8-u;
+		cnt -= 8-u;
+		if (cnt <= 0) return;
 	}
-
-	memset(dest, src[i++&31]&128, 8-U);
-	dest += 8-U;
-	cnt -= 8-U;
-	if (cnt <= 0) return;
 	while (cnt >= 8)
 	{
-		memset(dest, src[i++&31]&128, 8);
+		src = PATROW(tile[0], v);
+		blendcpy8(dest, src, tile[1]);
+		m[0] = m[1] = PRIMASK(tile[1]) * 0x01010101u;
+		memcpy(pri, m, 8);
+		tile += 2;
 		dest += 8;
+		pri += 8;
 		cnt -= 8;
 	}
-	memset(dest, src[i&31]&128, cnt);
+	src = PATROW(tile[0], v);
+	blendcpy(dest, src, tile[1], cnt);
+	memset(pri, PRIMASK(tile[1]), cnt);
 }
 
-void wnd_scan_pri()
+void bg_scan_pri()
 {
-	int cnt, i;
-	byte *src, *dest;
+	if (WX <= 0) return;
+	scan_color_pri(BUF, PRI, BG, V, U, WX);
+}
 
+void wnd_scan_pri()
+{
 	if (WX >= 160) return;
-	i = 0;
-	cnt = 160 - WX;
-	dest = PRI + WX;
-	src = lcd.vbank[1] + ((R_LCDC & LCDC_BIT_WIN_MAP)?0x1C00:0x1800) + (WT<<5);
-
-	if (!priused(src))
-	{
-		memset(dest, 0, cnt);
-		return;
-	}
-
-	while (cnt >= 8)
-	{
-		memset(dest, src[i++]&128, 8);
-		dest += 8;
-		cnt -= 8;
-	}
-	memset(dest, src[i]&128, cnt);
+	scan_color_pri(BUF + WX, PRI + WX, WND, WV, 0, 160 - WX);
 }
 
 #ifndef ASM_BG_SCAN_COLOR
@@ -367,26 +505,29 @@ void bg_scan_color()
 {
 	int cnt;
 	byte *src, *dest;
-	int *tile;
+	un16 *tile;
 
 	if (WX <= 0) return;
 	cnt = WX;
 	tile = BG;
 	dest = BUF;
 
-	src = patpix[*(tile++)][V] + U;
-	blendcpy(dest, src, *(tile++), 8-U);
-	dest += 8-U;
-	cnt -= 8-U;
-	if (cnt <= 0) return;
+	if (U)
+	{
+		src = PATROW(*(tile++), V) + U;
+		blendcpy(dest, src, *(tile++), 8-U);
+		dest += 8-U;
+		cnt -= 8-U;
+		if (cnt <= 0) return;
+	}
 	while (cnt >= 8)
 	{
-		src = patpix[*(tile++)][V];
-		blendcpy(dest, src, *(tile++), 8);
+		src = PATROW(*(tile++), V);
+		blendcpy8(dest, src, *(tile++));
 		dest += 8;
 		cnt -= 8;
 	}
-	src = patpix[*(tile++)][V];
+	src = PATROW(*(tile++), V);
 	blendcpy(dest, src, *(tile++), cnt);
 }
 #endif
@@ -395,7 +536,7 @@ void wnd_scan_color()
 {
 	int cnt;
 	byte *src, *dest;
-	int *tile;
+	un16 *tile;
 
 	if (WX >= 160) return;
 	cnt = 160 - WX;
@@ -404,15 +545,107 @@ void wnd_scan_color()
 
 	while (cnt >= 8)
 	{
-		src = patpix[*(tile++)][WV];
-		blendcpy(dest, src, *(tile++), 8);
+		src = PATROW(*(tile++), WV);
+		blendcpy8(dest, src, *(tile++));
 		dest += 8;
 		cnt -= 8;
 	}
-	src = patpix[*(tile++)][WV];
+	src = PATROW(*(tile++), WV);
 	blendcpy(dest, src, *(tile++), cnt);
 }
 
+/* with bglayer, each tile map is kept drawn whole, 256x256, as
+   bg_scan or bg_scan_color would draw it, so a line of background or
+   window is a copy from its layer: two for a background that wraps.
+   a cell is drawn again when its tile word (as tilebuf makes it) or
+   the tile itself has changed since, and a row of cells is only
+   looked over when some map or tile has been written since it last
+   was, or the tile data select has been flipped. cgb lines with
+   sprites on them need scan.pri too and go the usual way. */
+struct layer
+{
+	byte pix[256][256];
+	un32 word[1024], ver[1024];
+	un32 mapgen[32], tilegen[32];
+	byte sel[32];
+};
+
+static struct layer *layers[2];
+
+static un32 cellword(byte *tilemap, byte *attrmap)
+{
+	un32 t, a;
+
+	t = (R_LCDC & LCDC_BIT_TILE_SEL) ? *tilemap : 256 + (n8)*tilemap;
+	if (!hw.cgb) return t;
+	a = *attrmap;
+	return t | (a & 0x08) << 6 | (a & 0x60) << 5
+		| ((a & 0x07) << 2 | (a & 0x80) << 1) << 16;
+}
+
+/* row r of the layer for the map at 0x1800 + (m << 10), brought up
+   to date; 0 if there's no memory for it */
+static struct layer *layer_row(int m, int r)
+{
+	struct layer *y = layers[m];
+	byte sel = R_LCDC & LCDC_BIT_TILE_SEL;
+	byte *tilemap, *attrmap;
+	un32 w, t;
+	int c, v;
+
+	if (!y)
+	{
+		if (!(y = layers[m] = malloc(sizeof *y))) return 0;
+		/* tilever never goes back to 0, so every cell is drawn */
+		memset(y, 0, sizeof *y);
+	}
+	if (y->mapgen[r] == mapgen && y->tilegen[r] == tilegen
+		&& y->sel[r] == sel)
+		return y;
+	tilemap = lcd.vbank[0] + 0x1800 + (m << 10) + (r << 5);
+	attrmap = tilemap + 0x2000;
+	for (c = 0; c < 32; c++)
+	{
+		w = cellword(tilemap + c, attrmap + c);
+		t = w & 0xffff;
+		if (w == y->word[(r<<5)+c] && y->ver[(r<<5)+c] == tilever[t & 1023])
+			continue;
+		y->word[(r<<5)+c] = w;
+		y->ver[(r<<5)+c] = tilever[t & 1023];
+		for (v = 0; v < 8; v++)
+			blendcpy8(y->pix[(r<<3)+v] + (c<<3), PATROW(t, v), w >> 16);
+	}
+	y->mapgen[r] = mapgen;
+	y->tilegen[r] = tilegen;
+	y->sel[r] = sel;
+	return y;
+}
+
+/* 0 if the line's been drawn from the layers */
+static int layer_scan()
+{
+	struct layer *y;
+	byte *src;
+	int n;
+
+	if (WX > 0)
+	{
+		if (!(y = layer_row(!!(R_LCDC & LCDC_BIT_BG_MAP), T))) return -1;
+		src = y->pix[Y];
+		n = 256 - X < WX ? 256 - X : WX;
+		memcpy(BUF, src + X, n);
+		memcpy(BUF + n, src, WX - n);
+	}
+	if (WX < 160)
+	{
+		if (!(y = layer_row(!!(R_LCDC & LCDC_BIT_WIN_MAP), WT))) return -1;
+		src = y->pix[(WT<<3) + WV];
+		if (WX < 0) memcpy(BUF, src - WX, 160);
+		else memcpy(BUF + WX, src, 160 - WX);
+	}
+	return 0;
+}
+
 static void recolor(byte *buf, byte fill, int cnt)
 {
 	while (cnt--) *(buf++) |= fill;
@@ -438,25 +671,70 @@ void spr_count()
 	}
 }
 
+#ifdef COMPACT_PATPIX
+/* mirrored sprite rows have to outlive spr_enum */
+static byte sprrow[10][8];
+#endif
+
+/* which sprites each line shows, as oam indices: the first 10 that
+   cover the line, in oam order, or for dmg with sprsort in drawing
+   order (by x, oam order breaking ties). they only change with oam,
+   the sprite size or the sort mode, so they're worked out once for
+   the whole screen and reused until one of those does */
+static byte sprbin[144][10], sprbincnt[144];
+static int sprbinkey = -1;
+
+void oam_dirty()
+{
+	sprbinkey = -1;
+}
+
+static void spr_bin()
+{
+	int i, j, k, l, h, n, key;
+	struct obj *o = lcd.oam.obj;
+	byte *b;
+
+	h = (R_LCDC & LCDC_BIT_OBJ_SIZE) ? 16 : 8;
+	key = h | (sprsort && !hw.cgb) << 5;
+	if (key == sprbinkey) return;
+	sprbinkey = key;
+	memset(sprbincnt, 0, sizeof sprbincnt);
+	for (i = 0; i < 40; i++)
+	{
+		l = o[i].y - 16;
+		for (j = l < 0 ? 0 : l; j < l + h && j < 144; j++)
+			if (sprbincnt[j] < 10) sprbin[j][sprbincnt[j]++] = i;
+	}
+	if (!(key & 32)) return;
+	for (j = 0; j < 144; j++)
+	{
+		b = sprbin[j];
+		n = sprbincnt[j];
+		for (k = 1; k < n; k++)
+		{
+			i = b[k];
+			for (l = k; l > 0 && o[b[l-1]].x > o[i].x; l--)
+				b[l] = b[l-1];
+			b[l] = i;
+		}
+	}
+}
+
 void spr_enum()
 {
-	int i, j;
+	int i, n;
 	struct obj *o;
-	struct vissprite ts[10];
 	int v, pat;
-	int l, x;
 
 	NS = 0;
 	if (!(R_LCDC & LCDC_BIT_OBJ_EN)) return;
+	if ((unsigned)L >= 144) return;
 
-	o = lcd.oam.obj;
-
-	for (i = 40; i; i--, o++)
+	spr_bin();
+	for (i = 0, n = sprbincnt[L]; i < n; i++)
 	{
-		if (L >= o->y || L + 16 < o->y)
-			continue;
-		if (L + 8 >= o->y && !(R_LCDC & LCDC_BIT_OBJ_SIZE))
-			continue;
+		o = &lcd.oam.obj[sprbin[L][i]];
 		VS[NS].x = (int)o->x - 8;
 		v = L - (int)o->y + 16;
 		if (hw.cgb)
@@ -481,28 +759,40 @@ void spr_enum()
 			}
 			if (o->flags & 0x40) pat ^= 1;
 		}
+#ifdef COMPACT_PATPIX
+		VS[NS].buf = patrow(pat, v, sprrow[NS]);
+#else
 		VS[NS].buf = patpix[pat][v];
-		if (++NS == 10) break;
+#endif
+		NS++;
 	}
-	if (!sprsort || hw.cgb) return;
-	/* not quite optimal but it finally works! */
-	for (i = 0; i < NS; i++)
+}
+
+#ifndef ASM_SPR_BLEND8
+/* 0xff for each of the 4 pixels in w whose color is 1-3 */
+#define OPAQUE(w) ((((w) | (w) >> 1) & 0x01010101u) * 0xff)
+
+/* a whole row of a sprite, src, onto the line at dest, 4 pixels at a
+   time with masks rather than a test per pixel. bg is the background
+   under it before any sprite went on, and pri is 0xff for the pixels
+   where colors 1-3 of the background stay in front */
+void spr_blend8(byte *dest, byte *src, byte *bg, byte *pri, byte pal)
+{
+	un32 s[2], d[2], g[2], p[2], draw;
+	int k;
+
+	memcpy(s, src, 8);
+	memcpy(g, bg, 8);
+	memcpy(p, pri, 8);
+	memcpy(d, dest, 8);
+	for (k = 0; k < 2; k++)
 	{
-		l = 0;
-		x = VS[0].x;
-		for (j = 1; j < NS; j++)
-		{
-			if (VS[j].x < x)
-			{
-				l = j;
-				x = VS[j].x;
-			}
-		}
-		ts[i] = VS[l];
-		VS[l].x = 160;
+		draw = OPAQUE(s[k]) & ~(OPAQUE(g[k]) & p[k]);
+		d[k] = (d[k] & ~draw) | ((s[k] | pal * 0x01010101u) & draw);
 	}
-	memcpy(VS, ts, sizeof ts);
+	memcpy(dest, d, 8);
 }
+#endif
 
 void spr_scan()
 {
@@ -511,6 +801,8 @@ void spr_scan()
 	byte *src, *dest, *bg, *pri;
 	struct vissprite *vs;
 	static byte bgdup[256];
+	static const byte behind[8] = { 255, 255, 255, 255, 255, 255, 255, 255 };
+	static const byte infront[8];
 
 	if (!ns) return;
 
@@ -536,28 +828,22 @@ void spr_scan()
 			else i = 8;
 		}
 		pal = vs->pal;
-		if (vs->pri)
+		bg = bgdup + (dest - BUF);
+		pri = PRI + (dest - BUF);
+		/* a sprite goes behind colors 1-3 of the background if it
+		   says so itself, or on cgb if the tile does (scan.pri) */
+		if (i == 8)
 		{
-			bg = bgdup + (dest - BUF);
-			while (i--)
-			{
-				b = src[i];
-				if (b && !(bg[i]&3)) dest[i] = pal|b;
-			}
+			spr_blend8(dest, src, bg, vs->pri ? (byte *)behind
+				: hw.cgb ? pri : (byte *)infront, pal);
+			continue;
 		}
-		else if (hw.cgb)
+		while (i--)
 		{
-			bg = bgdup + (dest - BUF);
-			pri = PRI + (dest - BUF);
-			while (i--)
-			{
-				b = src[i];
-				if (b && (!pri[i] || !(bg[i]&3)))
-					dest[i] = pal|b;
-			}
+			b = src[i];
+			if (b && (!(bg[i]&3) || !(vs->pri || (hw.cgb && pri[i]))))
+				dest[i] = pal|b;
 		}
-		else while (i--) if (src[i]) dest[i] = pal|src[i];
-		/* else while (i--) if (src[i]) dest[i] = 31 + ns; */
 	}
 	if (sprdebug) for (i = 0; i < NS; i++) BUF[i<<1] = 36;
 }
@@ -567,25 +853,79 @@ void spr_scan()
 
 
 
+static int colcheck();
+static void updatepalette(int i);
+static un32 mapcolor(int c);
+
+/* where the top left pixel of the picture goes, centered */
+static byte *origin()
+{
+	return fb.ptr + ((fb.w*fb.pelsize)>>1)
+		- (80*fb.pelsize) * scale
+		+ ((fb.h>>1) - 72*scale) * fb.pitch;
+}
+
+/* density as it applies: no more than scale, and just the one row
+   of each line when there is no scaling done here */
+static int rows()
+{
+	if (density > scale) density = scale;
+	if (scale == 1 || fb.delegate_scaling) density = 1;
+	return density;
+}
+
+/* whether row i of a line's scale rows is drawn, with d from rows() */
+#define ROWDRAWN(i, d) ((i) < (d) || ((d) <= 0 && !((i)&1)))
+
+/* after the front end says the framebuffer is dirty (a new mode, a
+   new buffer), blank what the picture doesn't draw over every frame:
+   the border around it and the rows density leaves out. the picture
+   itself is all drawn again anyway */
+static void border()
+{
+	byte *p = fb.ptr, *top = origin(), *row;
+	int s = fb.delegate_scaling ? 1 : scale, d = rows(), y;
+	int w = 160 * fb.pelsize * s, left = (top - p) % fb.pitch;
+
+	fb.dirty = 0;
+	memset(p, 0, top - left - p);
+	for (y = 0, row = top - left; y < 144 * scale; y++, row += fb.pitch)
+	{
+		if (y >= 144 * s || !ROWDRAWN(y % s, d))
+		{
+			memset(row, 0, fb.pitch);
+			continue;
+		}
+		memset(row, 0, left);
+		memset(row + left + w, 0, fb.pitch - left - w);
+	}
+	memset(row, 0, p + fb.pitch * fb.h - row);
+}
+
 void lcd_begin()
 {
+	int i;
+
+	lcd_flush();
 	if (fb.indexed)
 	{
 		if (rgb332) pal_set332();
 		else pal_expire();
 	}
+	/* a filter or fb format change shows from this frame on */
+	if (colcheck())
+		for (i = 0; i < 64; i++)
+			updatepalette(i);
 	while (scale * 160 > fb.w || scale * 144 > fb.h) scale--;
-	vdest = fb.ptr + ((fb.w*fb.pelsize)>>1)
-		- (80*fb.pelsize) * scale
-		+ ((fb.h>>1) - 72*scale) * fb.pitch;
+	vdest = origin();
 	WY = R_WY;
 }
 
 void lcd_linetovram() {
 	int i, work_scale;
 	byte scalebuf[160*4*MAX_SCALE], *dest;
-	if (density > scale) density = scale;
-	if (scale == 1 || fb.delegate_scaling) density = 1;
+	fb.drawn = 1;
+	rows();
 
 	work_scale = fb.delegate_scaling ? 1: scale;
 
@@ -594,7 +934,12 @@ void lcd_linetovram() {
 		die("error: no code available to scale > %d!", MAX_SCALE);
 	}
 
-	switch (work_scale)
+	/* packed 4:2:2, two bytes a pixel, which pairs up the pixels
+	   itself, whatever the scale */
+	if (fb.yuv == 2)
+		refresh_yuv(dest, BUF, PAL4, 160, work_scale ? work_scale : 1,
+			0xffu << fb.cc[0].l, 0xffu << fb.cc[3].l);
+	else switch (work_scale)
 	{
 	case 0:
 	case 1:
@@ -669,11 +1014,13 @@ void lcd_linetovram() {
 		break;
 	}
 
+	/* the copies come from scalebuf rather than the row above, which
+	   may be in uncached video memory that's slow to read back */
 	if (density != 1)
 	{
 		for (i = 0; i < scale; i++)
 		{
-			if ((i < density) || ((density <= 0) && !(i&1)))
+			if (ROWDRAWN(i, density))
 				memcpy(vdest, scalebuf, 160 * fb.pelsize * scale);
 			vdest += fb.pitch;
 		}
@@ -681,75 +1028,296 @@ void lcd_linetovram() {
 	else vdest += fb.pitch * work_scale;
 }
 
-void lcd_refreshline()
+/* with hashing on, each line goes into a hash as the scanner leaves
+   it in scan.buf, colors still as palette indices, and with the
+   framebuffer off that's all that happens to it: nothing is looked
+   up in a palette or written out. the palettes themselves go in when
+   the hash is taken, as they are then */
+static int hashing;
+static unsigned long long hash;
+
+#define HASHK 0x9e3779b97f4a7c15ULL
+
+/* four lanes of eight bytes at a time, so the multiplies overlap */
+static void hashline(int l)
 {
-	static int WL = 0;
+	unsigned long long w[20], a = hash ^ (l + 1), b = 0, c = 0, d = 0;
+	int i;
 
-	if (!fb.enabled) return;
+	memcpy(w, BUF, 160);
+	for (i = 0; i < 20; i += 4)
+	{
+		a = (a ^ w[i]) * HASHK, a ^= a >> 29;
+		b = (b ^ w[i+1]) * HASHK, b ^= b >> 29;
+		c = (c ^ w[i+2]) * HASHK, c ^= c >> 29;
+		d = (d ^ w[i+3]) * HASHK, d ^= d >> 29;
+	}
+	hash = (a ^ (b << 16 | b >> 48) ^ (c << 32 | c >> 32)
+		^ (d << 48 | d >> 16)) * HASHK;
+}
 
-	if (!(R_LCDC & LCDC_BIT_LCD_EN))
-		return; /* should not happen... */
+void lcd_hash(int on)
+{
+	hashing = on;
+	hash = 0;
+}
+
+/* the hash of the lines drawn since the last call; called again with
+   the machine where it was, as until_frame does after hashlog, it's
+   the same one again */
+un32 lcd_framehash()
+{
+	static unsigned long long at = -1;
+	static un32 again;
+	unsigned long long h = hash, w[16];
+	int i;
+
+	if (cpu.clock == at) return again;
+	at = cpu.clock;
+	memcpy(w, lcd.pal, 128);
+	for (i = 0; i < 16; i++)
+		h = (h ^ w[i]) * HASHK, h ^= h >> 29;
+	h ^= R_BGP | R_OBP0 << 8 | R_OBP1 << 16 | hw.cgb << 24;
+	h *= HASHK;
+	hash = 0;
+	return again = h >> 32;
+}
+
+/* the row of the window line l shows, or 255 if it shows none. in
+   order to have these offsets correct we need to count the number of
+   lines that displayed a window, so this is done as each line is
+   queued, in order, not when it's drawn */
+static int winrow(int l)
+{
+	int wx = R_WX - 7;
+
+	if (l == 0) { WY = R_WY; WL = 0; }
+	if (WY>l || WY<0 || WY>143 || wx<-7 || wx>159 || !(R_LCDC & LCDC_BIT_WIN_EN))
+		return 255;
+	return WL++;
+}
+
+/* draw is 0 when the line is only wanted for the hash, the capture,
+   the stream or an observation */
+static void refreshline(int l, int win, int draw)
+{
+	int was;
 
 	updatepatpix();
 
-	L = R_LY;
+	L = l;
 	X = R_SCX;
 	Y = (R_SCY + L) & 0xff;
 	S = X >> 3;
 	T = Y >> 3;
 	U = X & 7;
 	V = Y & 7;
-	if (L == 0) { WY = R_WY; WL = 0; }
 
 	WX = R_WX - 7;
-	if (WY>L || WY<0 || WY>143 || WX<-7 || WX>159 || !(R_LCDC & LCDC_BIT_WIN_EN))
+	if (win == 255)
 		WX = 160;
 	else {
-		/* in order to have these offsets correct we need to count
-		   the number of lines that displayed a window */
-		WT = WL >> 3;
-		WV = WL & 7;
-		++WL;
+		WT = win >> 3;
+		WV = win & 7;
 	}
 
 	spr_enum();
 
-	tilebuf();
-	if (hw.cgb)
+	if (bglayer && !(hw.cgb && NS) && !layer_scan())
 	{
-		bg_scan_color();
-		wnd_scan_color();
-		if (NS)
-		{
-			bg_scan_pri();
-			wnd_scan_pri();
-		}
+		if (!hw.cgb) recolor(BUF+WX, 0x04, 160-WX);
 	}
 	else
 	{
-		bg_scan();
-		wnd_scan();
-		recolor(BUF+WX, 0x04, 160-WX);
+		tilebuf();
+		if (hw.cgb)
+		{
+			if (NS)
+			{
+				bg_scan_pri();
+				wnd_scan_pri();
+			}
+			else
+			{
+				bg_scan_color();
+				wnd_scan_color();
+			}
+		}
+		else
+		{
+			bg_scan();
+			wnd_scan();
+			recolor(BUF+WX, 0x04, 160-WX);
+		}
 	}
 	spr_scan();
 
-	if (fb.dirty) memset(fb.ptr, 0, fb.pitch * fb.h);
-	fb.dirty = 0;
-
+	if (hashing) hashline(l);
+	if (capturing) capture_line(l, BUF);
+	if (streaming) stream_line(l, BUF);
+	if (observing) observe_line(l, BUF);
+	if (!fb.enabled || !draw) return;
+
+	/* where the line goes comes from the framebuffer as it is, not
+	   from where lcd_begin left off: a state loaded or a context
+	   switched in mid frame may be drawing into another one */
+	vdest = origin() + l * fb.pitch * (fb.delegate_scaling ? 1 : scale);
+	was = bench_in;
+	bench_in = BENCH_VRAM;
 	lcd_linetovram();
+	bench_in = was;
 }
 
+/* a line isn't drawn when the lcdc gets to it, only queued with the
+   registers it depends on as they are at that moment. the queue is
+   drawn in one go at vblank, or earlier when something else the lines
+   read (vram, oam, palettes, the framebuffer position) is about to
+   change; this keeps the renderer and the cpu core out of each other's
+   cache for most of the frame, without changing what ends up on the
+   screen. a front end that draws on the gpu gets the queue instead,
+   see lcd_offload. */
+static struct lcdline linelog[144];
+static int nlog;
 
+int (*lcd_offload)(struct lcdline *lines, int n, int sort);
 
+static int skipframe;
 
+/* frameskip: the lcdc keeps running, nothing gets drawn. returns
+   what it was before */
+int lcd_skipframe(int skip)
+{
+	int was = skipframe;
 
+	skipframe = skip;
+	return was;
+}
 
+void lcd_refreshline()
+{
+	if ((!fb.enabled && !hashing && !capturing && !streaming && !observing)
+		|| skipframe)
+		return;
 
-static void updatepalette(int i)
+	if (!(R_LCDC & LCDC_BIT_LCD_EN))
+		return; /* should not happen... */
+
+	if (nlog == 144) lcd_flush();
+	linelog[nlog].ly = R_LY;
+	linelog[nlog].lcdc = R_LCDC;
+	linelog[nlog].scx = R_SCX;
+	linelog[nlog].scy = R_SCY;
+	linelog[nlog].wx = R_WX;
+	linelog[nlog].win = winrow(R_LY);
+	nlog++;
+}
+
+/* draw the lines queued so far */
+void lcd_flush()
 {
-	int c, r, g, b, y, u, v, rr, gg;
+	byte lcdc = R_LCDC, scx = R_SCX, scy = R_SCY, wx = R_WX;
+	int i, off, was = bench_in;
+
+	if (!nlog) return;
+	bench_in = BENCH_LCD;
+	TL_BEGIN(TL_LCD);
+	off = lcd_offload && fb.enabled
+		&& !lcd_offload(linelog, nlog, sprsort && !hw.cgb);
+	if (fb.enabled && fb.dirty && !off) border();
+	for (i = 0; i < nlog
+		&& (!off || hashing || capturing || streaming || observing); i++)
+	{
+		R_LCDC = linelog[i].lcdc;
+		R_SCX = linelog[i].scx;
+		R_SCY = linelog[i].scy;
+		R_WX = linelog[i].wx;
+		refreshline(linelog[i].ly, linelog[i].win, !off);
+	}
+	nlog = 0;
+	TL_END(TL_LCD);
+	bench_in = was;
+	R_LCDC = lcdc;
+	R_SCX = scx;
+	R_SCY = scy;
+	R_WX = wx;
+}
+
+/* paint over the picture just drawn: buf is 160 wide and h lines
+   high, 1 for white, 0 for black and anything else to let the picture
+   through. for the stat overlay, so it's kept simple; indexed
+   framebuffers have no colors to spare and are left alone */
+void lcd_overlay(byte *buf, int h)
+{
+	un32 c[2], p;
+	un16 half[2];
+	byte *top, *d;
+	int x, y, i, j, s = fb.delegate_scaling ? 1 : scale;
+
+	if (!fb.enabled || fb.indexed || skipframe) return;
+	if (h > 144) h = 144;
+	c[0] = mapcolor(0);
+	c[1] = mapcolor(0x7fff);
+	top = origin();
+	for (y = 0; y < h; y++)
+		for (x = 0; x < 160; x++)
+		{
+			if (buf[y*160+x] > 1) continue;
+			p = c[buf[y*160+x]];
+			memcpy(half, &p, sizeof half);
+			for (i = 0; i < s; i++)
+			{
+				d = top + (y*s + i) * fb.pitch + x*s*fb.pelsize;
+				for (j = 0; j < s; j++, d += fb.pelsize)
+					switch (fb.pelsize)
+					{
+					case 1: *d = p; break;
+					/* in a 4:2:2 pair, the half for whichever
+					   pixel of it this is */
+					case 2:
+						*(un16a *)d = fb.yuv == 2
+							? half[(d - fb.ptr) % fb.pitch >> 1 & 1] : p;
+						break;
+					case 3: d[0] = p; d[1] = p>>8; d[2] = p>>16; break;
+					case 4: *(un32a *)d = p; break;
+					}
+			}
+		}
+}
+
+
+
+
+
+
+
+/*
+ * coltab holds what every 15 bit color turns into for the current
+ * filter and fb format, so a palette write is a lookup rather than a
+ * trip through the filter matrix and yuv conversion. colkey is the
+ * state the table was made for; colcheck rebuilds it when that moves.
+ * In indexed mode the table holds filtered rgb for pal_getcolor.
+ * LOWMEM builds do without the table's 128k and map each palette
+ * entry as it is written.
+ */
+
+#ifndef LOWMEM
+static un32 coltab[32768];
+#endif
+
+struct colkey
+{
+	int filter[3][4];
+	int usefilter, yuv, indexed, pelsize;
+	int cc[4][2];
+};
+
+static struct colkey colkey;
+static int colvalid;
+
+static un32 mapcolor(int c)
+{
+	int r, g, b, y, u, v, rr, gg;
 
-	c = (lcd.pal[i<<1] | ((int)lcd.pal[(i<<1)|1] << 8)) & 0x7FFF;
 	r = (c & 0x001F) << 3;
 	g = (c & 0x03E0) >> 2;
 	b = (c & 0x7C00) >> 7;
@@ -757,7 +1325,7 @@ static void updatepalette(int i)
 	g |= (g >> 5);
 	b |= (b >> 5);
 
-	if (usefilter && (filterdmg || hw.cgb))
+	if (colkey.usefilter)
 	{
 		rr = ((r * filter[0][0] + g * filter[0][1] + b * filter[0][2]) >> 8) + filter[0][3];
 		gg = ((r * filter[1][0] + g * filter[1][1] + b * filter[1][2]) >> 8) + filter[1][3];
@@ -777,26 +1345,82 @@ static void updatepalette(int i)
 		if (u > 255) u = 255;
 		if (v < 0) v = 0;
 		if (v > 255) v = 255;
-		PAL4[i] = (y<<fb.cc[0].l) | (y<<fb.cc[3].l)
+		return (y<<fb.cc[0].l) | (y<<fb.cc[3].l)
 			| (u<<fb.cc[1].l) | (v<<fb.cc[2].l);
+	}
+
+	if (fb.indexed)
+	{
+		if (r < 0) r = 0;
+		if (r > 255) r = 255;
+		if (g < 0) g = 0;
+		if (g > 255) g = 255;
+		if (b < 0) b = 0;
+		if (b > 255) b = 255;
+		return (r<<16) | (g<<8) | b;
+	}
+
+	r = (r >> fb.cc[0].r) << fb.cc[0].l;
+	g = (g >> fb.cc[1].r) << fb.cc[1].l;
+	b = (b >> fb.cc[2].r) << fb.cc[2].l;
+	return r|g|b;
+}
+
+/* returns 1 if the table had to be rebuilt */
+static int colcheck()
+{
+	struct colkey k;
+	int i;
+
+	memcpy(k.filter, filter, sizeof k.filter);
+	k.usefilter = usefilter && (filterdmg || hw.cgb);
+	k.yuv = fb.yuv;
+	k.indexed = fb.indexed;
+	k.pelsize = fb.pelsize;
+	for (i = 0; i < 4; i++)
+	{
+		k.cc[i][0] = fb.cc[i].l;
+		k.cc[i][1] = fb.cc[i].r;
+	}
+	if (colvalid && !memcmp(&k, &colkey, sizeof k)) return 0;
+	colkey = k;
+	colvalid = 1;
+#ifndef LOWMEM
+	for (i = 0; i < 32768; i++)
+		coltab[i] = mapcolor(i);
+#endif
+	return 1;
+}
+
+static void updatepalette(int i)
+{
+	int c;
+	un32 p;
+
+	c = (lcd.pal[i<<1] | ((int)lcd.pal[(i<<1)|1] << 8)) & 0x7FFF;
+#ifdef LOWMEM
+	p = mapcolor(c);
+#else
+	p = coltab[c];
+#endif
+
+	if (fb.yuv)
+	{
+		PAL4[i] = p;
 		return;
 	}
 
 	if (fb.indexed)
 	{
 		pal_release(PAL1[i]);
-		c = pal_getcolor(c, r, g, b);
+		c = pal_getcolor(c, p >> 16, (p >> 8) & 0xff, p & 0xff);
 		PAL1[i] = c;
 		PAL2[i] = (c<<8) | c;
 		PAL4[i] = (c<<24) | (c<<16) | (c<<8) | c;
 		return;
 	}
 
-	r = (r >> fb.cc[0].r) << fb.cc[0].l;
-	g = (g >> fb.cc[1].r) << fb.cc[1].l;
-	b = (b >> fb.cc[2].r) << fb.cc[2].l;
-	c = r|g|b;
-
+	c = p;
 	switch (fb.pelsize)
 	{
 	case 1:
@@ -818,6 +1442,7 @@ static void updatepalette(int i)
 void pal_write(int i, byte b)
 {
 	if (lcd.pal[i] == b) return;
+	lcd_flush();
 	lcd.pal[i] = b;
 	updatepalette(i>>1);
 }
@@ -846,21 +1471,109 @@ void pal_write_dmg(int i, int mapnum, byte d)
 
 void vram_write(int a, byte b)
 {
+	if (nlog) lcd_flush();
 	lcd.vbank[R_VBK&1][a] = b;
+	dirty.vram |= 1 << (((R_VBK&1)<<1) | (a>>12));
+	hashdirty.vram |= 1 << (((R_VBK&1)<<1) | (a>>12));
+	if (a >= 0x1800)
+	{
+		mapgen++;
+		return;
+	}
+	a = ((R_VBK&1)<<9)+(a>>4);
+	if (!patdirty[a]) stat_tiles++;
+	patdirty[a] = 1;
+	tiledirty[a] = 1;
+	tilever[a]++;
+	tilegen++;
+	anydirty = 1;
+}
+
+/* the same as n vram_writes of src[0..n-1] starting at a, for dma;
+   a + n must not go past the end of vram */
+void vram_copy(int a, byte *src, int n)
+{
+	int bank = R_VBK&1, end = a + n, i;
+
+	if (n <= 0) return;
+	if (nlog) lcd_flush();
+	memcpy(lcd.vbank[bank] + a, src, n);
+	for (i = a >> 12; i <= (end - 1) >> 12; i++)
+	{
+		dirty.vram |= 1 << ((bank<<1) | i);
+		hashdirty.vram |= 1 << ((bank<<1) | i);
+	}
+	if (end > 0x1800) mapgen++;
 	if (a >= 0x1800) return;
-	patdirty[((R_VBK&1)<<9)+(a>>4)] = 1;
+	if (end > 0x1800) end = 0x1800;
+	for (i = a >> 4; i <= (end - 1) >> 4; i++)
+	{
+		if (!patdirty[(bank<<9) + i]) stat_tiles++;
+		patdirty[(bank<<9) + i] = 1;
+		tiledirty[(bank<<9) + i] = 1;
+		tilever[(bank<<9) + i]++;
+	}
+	tilegen++;
 	anydirty = 1;
 }
 
+/* the n 4k pages of vram put back to src, for loadstate_delta, but
+   for the pages set in same, which are taken to match already. only
+   16 byte pieces that differ are copied, and only the tiles among
+   them marked; a map that differs just costs the maps */
+void vram_restore(byte *src, int n, un32 same)
+{
+	byte *mem = lcd.vbank[0], *m, *s;
+	int p, a, t;
+
+	for (p = 0; p < n; p++)
+	{
+		m = mem + (p<<12);
+		s = src + (p<<12);
+		if ((same >> p) & 1 || !memcmp(m, s, 4096)) continue;
+		if (nlog) lcd_flush();
+		dirty.vram |= 1 << p;
+		hashdirty.vram |= 1 << p;
+		for (a = 0; a < 4096; a += 16)
+		{
+			if (!memcmp(m + a, s + a, 16)) continue;
+			memcpy(m + a, s + a, 16);
+			/* the second page of a bank has the maps from 0x800 */
+			if ((p & 1) && a >= 0x800)
+			{
+				mapgen++;
+				continue;
+			}
+			t = ((p>>1)<<9) + ((p&1)<<8) + (a>>4);
+			if (!patdirty[t]) stat_tiles++;
+			patdirty[t] = 1;
+			tiledirty[t] = 1;
+			tilever[t]++;
+			tilegen++;
+			anydirty = 1;
+		}
+	}
+}
+
 void vram_dirty()
 {
+	int i;
+
+	oam_dirty();
+	mapgen++;
 	anydirty = 1;
+	for (i = 0; i < 1024; i++) stat_tiles += !patdirty[i];
 	memset(patdirty, 1, sizeof patdirty);
+	memset(tiledirty, 1, sizeof tiledirty);
+	for (i = 0; i < 1024; i++) tilever[i]++;
+	tilegen++;
 }
 
 void pal_dirty()
 {
 	int i;
+	lcd_flush();
+	colcheck();
 	if (!hw.cgb)
 	{
 		pal_write_dmg(0, 0, R_BGP);
@@ -872,9 +1585,33 @@ void pal_dirty()
 		updatepalette(i);
 }
 
+/* lcd.pal put back to src, for loadstate_delta: what pal_dirty does,
+   but only the entries that differ are worked out again */
+void pal_restore(byte *src)
+{
+	int i, all;
+
+	lcd_flush();
+	all = colcheck();
+	for (i = 0; i < (int)sizeof lcd.pal; i++)
+		pal_write(i, src[i]);
+	if (!hw.cgb)
+	{
+		pal_write_dmg(0, 0, R_BGP);
+		pal_write_dmg(8, 1, R_BGP);
+		pal_write_dmg(64, 2, R_OBP0);
+		pal_write_dmg(72, 3, R_OBP1);
+	}
+	if (all)
+		for (i = 0; i < 64; i++)
+			updatepalette(i);
+}
+
 void lcd_reset()
 {
+	nlog = 0;
 	memset(&lcd, 0, sizeof lcd);
+	dirty.vram = hashdirty.vram = ~0;
 	lcd_begin();
 	vram_dirty();
 	pal_dirty();
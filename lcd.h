@@ -12,17 +12,24 @@ struct vissprite
 	byte pal, pri, pad[6];
 };
 
+/* laid out hottest first: the line's registers fill the first cache
+   line, then what every line is drawn through, then the palettes, of
+   which only the one for the framebuffer's depth is ever used */
 struct scan
 {
-	int bg[64];
-	int wnd[64];
+	int ns, l, x, y, s, t, u, v, wx, wy, wt, wv;
+	int wl; /* window lines drawn this frame */
+	int pad[3];
+	/* as tilebuf makes them: a pattern number with the cgb bank and
+	   flip bits, then on cgb its palette and priority bits */
+	un16 bg[64];
+	un16 wnd[64];
 	byte buf[256];
+	byte pri[256];
+	struct vissprite vs[16];
 	byte pal1[128];
 	un16 pal2[64];
 	un32 pal4[64];
-	byte pri[256];
-	struct vissprite vs[16];
-	int ns, l, x, y, s, t, u, v, wx, wy, wt, wv;
 };
 
 struct obj
@@ -44,9 +51,26 @@ struct lcd
 	byte pal[128];
 };
 
+/* a line as lcd_refreshline queues it: the registers it's drawn
+   with, and the row of the window it shows, 255 for none */
+struct lcdline
+{
+	byte ly, lcdc, scx, scy, wx, win, pad[2];
+};
+
 extern struct lcd lcd;
 extern struct scan scan;
 
+/* set by a front end that draws the picture itself, on the gpu.
+   lcd_flush hands it the lines queued, to be drawn from lcd.vbank,
+   lcd.oam and scan.pal4 as they are at the time, and draws nothing
+   into fb itself; sort says sprites go in order of x, as dmg with
+   "sprsort". it returns -1 to have the core draw them after all */
+extern int (*lcd_offload)(struct lcdline *lines, int n, int sort);
+/* the tiles written since lcd_offload last cleared them, numbered as
+   patdirty: bank << 9 | the tile's place in 0x8000-0x97FF */
+extern byte tiledirty[1024];
+
 void updatepatpix();
 void tilebuf();
 void bg_scan();
@@ -58,14 +82,24 @@ void wnd_scan_color();
 void spr_count();
 void spr_enum();
 void spr_scan();
+void spr_blend8(byte *dest, byte *src, byte *bg, byte *pri, byte pal);
 void lcd_begin();
 void lcd_refreshline();
+void lcd_flush();
+void lcd_overlay(byte *buf, int h);
+int lcd_skipframe(int skip);
+void lcd_hash(int on);
+un32 lcd_framehash();
 void lcd_linetovram();
 void pal_write(int i, byte b);
 void pal_write_dmg(int i, int mapnum, byte d);
 void vram_write(int a, byte b);
 void vram_dirty();
+void vram_copy(int a, byte *src, int n);
+void oam_dirty();
 void pal_dirty();
+void vram_restore(byte *src, int n, un32 same);
+void pal_restore(byte *src);
 void lcd_reset();
 
 #define LCDC_BIT_BG_EN    (1<<0) /* BG display off or on - CGB: always on */
@@ -0,0 +1,171 @@
+/*
+ * link.c
+ *
+ * A link cable between two instances in one process, so trading and
+ * battles can be tested without a second machine, and faster than
+ * real time. link_start makes a second instance, a copy of the
+ * running one (see context.c), and plugs hw_link into it: when one
+ * instance finishes a transfer on the internal clock, the byte is
+ * swapped with the other's SB there and then, if the other is waiting
+ * on the external clock, and the other gets its serial interrupt.
+ *
+ * The two are never run an instruction at a time against each other;
+ * they only meet where a transfer does. link_frame runs whichever is
+ * behind until it catches up with the other or starts a transfer of
+ * its own. A transfer that has started holds the other back only as
+ * far as the moment it ends, so when it ends the other has got just
+ * there: the byte it takes and the one it gives back are the ones it
+ * has at that moment. An idle cable then costs two context switches
+ * a frame, and a busy one two a byte.
+ *
+ * Each instance draws into a framebuffer of its own; the first has
+ * the frontend's, the second a copy. The rest of the frontend's state
+ * (sound, input, rcvars) goes with whichever instance is loaded.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "cpu.h"
+#include "hw.h"
+#include "regs.h"
+#include "fb.h"
+#include "context.h"
+#include "link.h"
+
+/* cycles in a frame */
+#define FRAME 35112
+
+static struct context *ctx[2];
+static byte *fbs[2];
+static int cur;
+/* how far each has run this frame, whether it has drawn, and when a
+   transfer it has started ends, or 0 */
+static int at[2], drawn[2], due[2];
+
+
+static byte exchange(byte b)
+{
+	int r = context_serial(ctx[!cur], b);
+
+	due[cur] = 0;
+	return r < 0 ? 0xff : r;
+}
+
+int link_linked()
+{
+	return ctx[0] != 0;
+}
+
+int link_start()
+{
+	int size = fb.pitch * fb.h;
+
+	if (ctx[0]) return 0;
+	ctx[0] = context_new();
+	ctx[1] = context_new();
+	fbs[0] = fb.ptr;
+	if (!ctx[0] || !ctx[1] || !(fbs[1] = malloc(size)))
+	{
+		context_free(ctx[0]);
+		context_free(ctx[1]);
+		ctx[0] = ctx[1] = 0;
+		return -1;
+	}
+	memcpy(fbs[1], fbs[0], size);
+	cur = 0;
+	at[0] = at[1] = due[0] = due[1] = 0;
+	hw_link = exchange;
+	return 0;
+}
+
+/* the first instance is the one left running */
+void link_stop()
+{
+	if (!ctx[0]) return;
+	link_select(0);
+	context_free(ctx[0]);
+	context_free(ctx[1]);
+	free(fbs[1]);
+	ctx[0] = ctx[1] = 0;
+	fbs[1] = 0;
+	hw_link = 0;
+}
+
+/* loads instance i, parking the other */
+void link_select(int i)
+{
+	if (!ctx[0] || i == cur || i < 0 || i > 1) return;
+	context_save(ctx[cur]);
+	context_load(ctx[i]);
+	fb.ptr = fbs[i];
+	cur = i;
+}
+
+int link_selected()
+{
+	return cur;
+}
+
+/* runs the loaded instance on to limit, calling vblank as it gets to
+   line 144, or until it starts a transfer */
+static void run(int limit, void (*vblank)(int i))
+{
+	int ly, step;
+
+	do
+	{
+		ly = R_LY;
+		step = cpu.lcdc < limit - at[cur] ? cpu.lcdc : limit - at[cur];
+		at[cur] += cpu_emulate(step > 0 ? step : 1);
+		if (R_LY == 144 && ly != 144)
+		{
+			vblank(cur);
+			drawn[cur] = 1;
+		}
+		if (cpu.serial && !due[cur])
+		{
+			due[cur] = at[cur] + cpu.serial;
+			return;
+		}
+	}
+	while (at[cur] < limit);
+}
+
+/*
+ * One frame of both instances, in lockstep. vblank is called for each
+ * as it gets to vblank, with that instance loaded and its number, to
+ * do what the frontend does there; an instance with the lcd off gets
+ * the call at the end of the frame instead. The instance selected
+ * before is the one selected after.
+ */
+void link_frame(void (*vblank)(int i))
+{
+	int was = cur, i, limit;
+
+	if (!ctx[0]) return;
+	for (;;)
+	{
+		i = at[1] < at[0];
+		if (at[i] >= FRAME) break;
+		/* a transfer the other has passed without finishing was
+		   cancelled */
+		if (due[!i] <= at[!i]) due[!i] = 0;
+		limit = due[!i] && due[!i] < FRAME ? due[!i] : FRAME;
+		link_select(i);
+		run(limit, vblank);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		if (!drawn[i])
+		{
+			link_select(i);
+			vblank(i);
+		}
+		drawn[i] = 0;
+		at[i] -= FRAME;
+		due[i] = due[i] > FRAME ? due[i] - FRAME : 0;
+	}
+	link_select(was);
+}
@@ -0,0 +1,11 @@
+#ifndef LINK_H
+#define LINK_H
+
+int link_start();
+void link_stop();
+int link_linked();
+void link_select(int i);
+int link_selected();
+void link_frame(void (*vblank)(int i));
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include "defs.h"
+
+/* the most lz_pack can write for len bytes of input */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+int lz_pack(byte *out, byte *in, int len);
+int lz_unpack(byte *out, int size, byte *in, int len);
+
+#endif
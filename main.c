@@ -16,6 +16,15 @@
 #include "loader.h"
 #include "mem.h"
 #include "menu.h"
+#include "bench.h"
+#include "movie.h"
+#include "timeline.h"
+#include "profile.h"
+#include "memstats.h"
+#include "debug.h"
+#include "sound.h"
+#include "capture.h"
+#include "diag.h"
 
 #include "Version"
 
@@ -123,6 +132,7 @@ static void joytest()
 			case EV_RELEASE: ename = "release"; break;
 			case EV_REPEAT: ename = "repeat"; break;
 			case EV_MOUSE: ename = "mouse"; break;
+			case EV_STATE: ename = "state"; break;
 			default: ename = "unknown";
 			};
 			kname = k_keyname(e.code);
@@ -151,6 +161,13 @@ static void help(char *name)
 "      --copying                 show copying permissions\n"
 "      --joytest                 init joystick and show button names pressed\n"
 "      --rominfo                 show some info about the rom\n"
+"      --bench FRAMES            run FRAMES frames headless and uncapped,\n"
+"                                then report speed and where time went\n"
+"      --bench-json FRAMES       the same, reported as json\n"
+"      --record FILE             record the pad input to movie FILE\n"
+"      --playback FILE           play movie FILE back, as fast as possible\n"
+"      --startup-profile         report how long each step of starting up\n"
+"                                took, up to the end of the first frame\n"
 "");
 	exit(0);
 }
@@ -176,11 +193,67 @@ static void version(char *name)
 }
 
 
+/*
+ * With --startup-profile, each step of starting up is timed, and the
+ * lot reported on stderr when the first frame is done. The joystick
+ * and the sound device aren't needed for the first frame, and opening
+ * them can take a while (sdl's audio especially), so with it they're
+ * left until it has been shown, and that frame goes unheard. Without
+ * it they're opened before the rom is loaded, as always.
+ */
+
+static void *stimer;
+static struct
+{
+	char *what;
+	int us;
+} steps[24];
+static int nsteps, started;
+
+static void step(char *what)
+{
+	if (!stimer || nsteps == 24) return;
+	steps[nsteps].what = what;
+	steps[nsteps++].us = sys_elapsed(stimer);
+}
+
+static void report()
+{
+	int i, total = 0;
+
+	if (!stimer) return;
+	fprintf(stderr, "startup, in microseconds:\n");
+	for (i = 0; i < nsteps; i++)
+	{
+		fprintf(stderr, "%9d  %s\n", steps[i].us, steps[i].what);
+		total += steps[i].us;
+	}
+	fprintf(stderr, "%9d  total\n", total);
+	free(stimer);
+	stimer = 0;
+}
+
+static void opendevices()
+{
+	started = 1;
+	joy_init();
+	step("joy_init");
+	pcm_init();
+	sound_setrate();
+	step("pcm_init");
+}
+
 void doevents()
 {
 	event_t ev;
 	int st;
 
+	if (!started)
+	{
+		step("first frame");
+		opendevices();
+		report();
+	}
 	ev_poll(0);
 	while (ev_getevent(&ev))
 	{
@@ -196,8 +269,17 @@ void doevents()
 
 static void shutdown()
 {
-	joy_close();
+	movie_stop();
+	timeline_dump(0);
+	if (profiling) prof_dump(0);
+	if (opcounting) prof_opdump(0);
+	memstats_dump(0);
+	debug_bintracedump(0);
+	sound_close();
+	capture_stop();
 	vid_close();
+	if (!started) return;
+	joy_close();
 	pcm_close();
 }
 
@@ -205,6 +287,7 @@ void die(char *fmt, ...)
 {
 	va_list ap;
 
+	diag_flush();
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
@@ -254,21 +337,33 @@ int load_rom_and_rc(char *rom) {
 	strcat(cmd, ".rc");
 	rc_command(cmd);
 	free(cmd);
+	step("rom's rc file");
 	rom = strdup(rom);
 	sys_sanitize(rom);
 	if(loader_init(rom)) {
 		/*loader_get_error();*/
 		return -1;
 	}
+	step("loader_init");
 	emu_reset();
+	step("emu_reset");
 	return 0;
 }
 
 
+static void startmovie(char *record, char *play)
+{
+	if (record && movie_record(record))
+		die("cannot record to %s\n", record);
+	if (play && movie_play(play))
+		die("cannot play %s\n", play);
+}
+
+
 int main(int argc, char *argv[])
 {
-	int i, ri = 0, sv = 0;
-	char *opt, *arg, *cmd, *s, *rom = 0;
+	int i, ri = 0, sv = 0, bench = 0, json = 0;
+	char *opt, *arg, *cmd, *s, *rom = 0, *record = 0, *play = 0;
 
 	/* Avoid initializing video if we don't have to */
 	for (i = 1; i < argc; i++)
@@ -285,25 +380,46 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "--joytest"))
 			joytest();
 		else if (!strcmp(argv[i], "--rominfo")) ri = 1;
+		else if (!strcmp(argv[i], "--startup-profile"))
+			stimer = sys_timer();
+		else if (!strcmp(argv[i], "--bench")
+			|| !strcmp(argv[i], "--bench-json"))
+		{
+			json = argv[i][7] != 0;
+			if (i + 1 >= argc || (bench = atoi(argv[++i])) <= 0)
+				die("--bench needs a number of frames\n");
+		}
+		else if (!strcmp(argv[i], "--record")
+			|| !strcmp(argv[i], "--playback"))
+		{
+			if (i + 1 >= argc) die("missing argument to %s\n", argv[i]);
+			if (argv[i][2] == 'r') record = argv[++i];
+			else play = argv[++i];
+		}
 		else if (argv[i][0] == '-' && argv[i][1] == '-');
 		else if (argv[i][0] == '-' && argv[i][1]);
 		else rom = argv[i];
 	}
 
-	if (ri && !rom) usage(base(argv[0]));
+	if ((ri || bench) && !rom) usage(base(argv[0]));
 	if (ri) rominfo(rom);
 
+	step("arguments");
 	/* If we have special perms, drop them ASAP! */
 	vid_preinit();
+	step("vid_preinit");
 
 	init_exports();
+	step("init_exports");
 
 	s = strdup(argv[0]);
 	sys_sanitize(s);
 	sys_initpath(s);
+	step("sys_initpath");
 
 	for (i = 0; defaultconfig[i]; i++)
 		rc_command(defaultconfig[i]);
+	step("default config");
 
 	if (sv) {
 		show_exports();
@@ -329,6 +445,11 @@ int main(int argc, char *argv[])
 			rc_command(cmd);
 			free(cmd);
 		}
+		else if (!strcmp(argv[i], "--bench")
+			|| !strcmp(argv[i], "--bench-json")
+			|| !strcmp(argv[i], "--record")
+			|| !strcmp(argv[i], "--playback")) i++;
+		else if (!strcmp(argv[i], "--startup-profile"));
 		else if (!strncmp(argv[i], "--no-", 5))
 		{
 			opt = strdup(argv[i]+5);
@@ -362,15 +483,31 @@ int main(int argc, char *argv[])
 		else if (argv[i][0] == '-' && argv[i][1]);
 	}
 
+	step("options and rc files");
+
+	if (bench)
+	{
+		catch_signals();
+		if (load_rom_and_rc(rom))
+			die("rom load failed: %s\n", loader_get_error());
+		startmovie(record, play);
+		report();
+		/* nothing is written back: no sram, no rtc */
+		bench_run(bench, json);
+		movie_stop();
+		exit(0);
+	}
+
 	/* FIXME - make interface modules responsible for atexit() */
 	atexit(shutdown);
 	catch_signals();
 	vid_init();
-	joy_init();
-	pcm_init();
+	step("vid_init");
+	if (!stimer) opendevices();
 	menu_init();
+	step("menu_init");
 
-	if(rom) load_rom_and_rc(rom);
+	if(rom && !load_rom_and_rc(rom)) startmovie(record, play);
 	else {
 		rc_command("bind esc menu");
 		menu_initpage(mp_romsel);
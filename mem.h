@@ -27,6 +27,8 @@ struct mbc
 	int enableram;
 	int batt;
 	byte *rmap[0x10], *wmap[0x10];
+	/* the handlers for writes to each 8k of 0000-7FFF, see mbc_write */
+	void (*write[4])(int a, byte b);
 };
 
 struct rom
@@ -35,26 +37,94 @@ struct rom
 	char name[20];
 };
 
+/* LOWMEM builds allocate only the wram banks the mode has, 2 on a
+   dmg and 8 on a cgb, rather than always keeping 8 in here; WRAMBANKS
+   is how many there are either way */
 struct ram
 {
 	byte hi[256];
+#ifdef LOWMEM
+	byte (*ibank)[4096];
+	int ibanks;
+#else
 	byte ibank[8][4096];
+#endif
 	byte (*sbank)[8192];
 	int loaded;
 };
 
+#ifdef LOWMEM
+#define WRAMBANKS (ram.ibanks)
+#else
+#define WRAMBANKS 8
+#endif
+
+
+/* which 4k pages of ram.ibank, lcd.vbank and ram.sbank were written
+   since the last mem_checkpoint(), one bit per page in the same order
+   as the arrays. mem_checkpoint() also turns on tracking: from then
+   on, the first write to a clean page goes through mem_write, which
+   marks it and maps it back in, so tracking costs one slow write per
+   page per checkpoint. the bits mean nothing before the first
+   checkpoint. gen counts checkpoints, so a user can tell whether
+   somebody else has reset the bits since it last looked.
+   sramsave is the same thing for the battery save writer: pages of
+   ram.sbank written since the last mem_sramsaved(). it's kept apart
+   from the checkpoint bits so the two users don't step on each other. */
+struct dirty
+{
+	un32 iram, vram, sram;
+	int track, gen;
+	un32 sramsave;
+	int savetrack;
+};
+
+/* the same again for state_hash() in save.c: pages written since the
+   last mem_hashed(). it's apart from struct dirty because runahead and
+   netplay put that back along with the memory, and the hashes of the
+   pages don't go back with them. */
+struct hashdirty
+{
+	un32 iram, vram, sram;
+	int track;
+};
 
 extern struct mbc mbc;
 extern struct rom rom;
 extern struct ram ram;
+extern struct dirty dirty;
+extern struct hashdirty hashdirty;
 extern struct rom bootrom;
+extern int mem_rwatch, mem_wwatch;
+extern int mem_wcode;
+extern void (*mem_codewrite)(int a);
+
+extern byte (*hi_read[256])(byte r);
+extern void (*hi_write[256])(byte r, byte b);
 
 
 
 void mem_mapbootrom();
 void mem_updatemap();
+void mem_maprom();
+void mem_mapsram();
+void mem_mapvram();
+void mem_mapwram();
+void mem_updatehi();
+void mem_hiread(byte r, byte (*read)(byte r));
+void mem_setcode(int mask);
+void mem_checkpoint();
+void mem_alldirty();
+void mem_sramsaved();
+void mem_hashed();
 void ioreg_write(byte r, byte b);
 void mbc_write(int a, byte b);
+#ifdef LOWMEM
+int mem_sizewram();
+#else
+#define mem_sizewram() 0
+#endif
+
 void mem_write(int a, byte b);
 byte mem_read(int a);
 void mbc_reset();
@@ -0,0 +1,153 @@
+/*
+ * memstats.c
+ *
+ * Where the cpu's memory accesses go, for deciding which fast paths
+ * are worth having. Built with -DMEMSTATS, every read, write and
+ * instruction fetch the cpu makes is counted by the 256 byte region
+ * it lands in, every access to ff00-ffff by register, and every trip
+ * through mem_read or mem_write by what made it take the slow way.
+ * Without MEMSTATS the counting compiles to nothing and there's
+ * nothing to dump.
+ *
+ * "memstatsdump" writes the counts out, busiest first, to the file
+ * given or else to the rom's title with .memstats after it, in
+ * savedir like screenshots. They're also written when the rom is
+ * unloaded or gnuboy exits, and start again from 0 for the next rom,
+ * so a run over a catalog leaves one file per game.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "mem.h"
+#include "rtc.h"
+#include "rc.h"
+#include "sys.h"
+#include "memstats.h"
+
+#ifdef MEMSTATS
+
+un32 ms_region[3][256], ms_hi[2][256], ms_slow[2][MS_N];
+
+static const char *whynames[MS_N] =
+{
+	"watch", "rom", "mbc", "vram", "sram", "rtc", "wram", "echo",
+	"oam", "ff00-ffff"
+};
+
+int memstats_why(int w, int a)
+{
+	int watch = w ? mem_wwatch | mem_wcode : mem_rwatch;
+
+	if (((watch >> (a >> 12)) & 1) && a < 0xff00) return MS_WATCH;
+	switch (a >> 13)
+	{
+	case 0: case 1: case 2: case 3:
+		return w ? MS_MBC : MS_ROM;
+	case 4:
+		return MS_VRAM;
+	case 5:
+		return (rtc.sel & 8) ? MS_RTC : MS_SRAM;
+	case 6:
+		return MS_WRAM;
+	}
+	if (a < 0xfe00) return MS_ECHO;
+	if (a < 0xff00) return MS_OAM;
+	return MS_HI;
+}
+
+void memstats_reset()
+{
+	memset(ms_region, 0, sizeof ms_region);
+	memset(ms_hi, 0, sizeof ms_hi);
+	memset(ms_slow, 0, sizeof ms_slow);
+}
+
+/* indices 0..n-1 in order of total[], most first */
+static un32 *sortby;
+
+static int busiest(const void *a, const void *b)
+{
+	un32 x = sortby[*(const int *)a], y = sortby[*(const int *)b];
+	return x < y ? 1 : x > y ? -1 : *(const int *)a - *(const int *)b;
+}
+
+static void rank(int *order, un32 *total, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) order[i] = i;
+	sortby = total;
+	qsort(order, n, sizeof *order, busiest);
+}
+
+int memstats_dump(char *name)
+{
+	FILE *f;
+	char *dir, *fn = name;
+	un32 total[256];
+	int order[256], i, j, r;
+
+	for (i = r = 0; i < 256; i++)
+		r |= ms_region[MS_READ][i] | ms_region[MS_WRITE][i];
+	if (!r) return 0;
+	if (!fn)
+	{
+		if (!(dir = rc_getstr("savedir"))) dir = ".";
+		if (!(fn = malloc(strlen(dir) + sizeof rom.name + 16)))
+			return -1;
+		sprintf(fn, "%s/%s", dir, *rom.name ? rom.name : "gnuboy");
+		sys_sanitize(fn + strlen(dir) + 1);
+		strcat(fn, ".memstats");
+	}
+	f = fopen(fn, "w");
+	if (fn != name) free(fn);
+	if (!f) return -1;
+
+	fprintf(f, "%s\n\nslow path      reads     writes\n",
+		*rom.name ? rom.name : "gnuboy");
+	for (i = 0; i < MS_N; i++) total[i] = ms_slow[0][i] + ms_slow[1][i];
+	rank(order, total, MS_N);
+	for (i = 0; i < MS_N && total[order[i]]; i++)
+		fprintf(f, "%-10s %10lu %10lu\n", whynames[order[i]],
+			(unsigned long)ms_slow[0][order[i]],
+			(unsigned long)ms_slow[1][order[i]]);
+
+	fprintf(f, "\nregister       reads     writes\n");
+	for (i = 0; i < 256; i++) total[i] = ms_hi[0][i] + ms_hi[1][i];
+	rank(order, total, 256);
+	for (i = 0; i < 256 && total[order[i]]; i++)
+		fprintf(f, "ff%02x       %10lu %10lu\n", order[i],
+			(unsigned long)ms_hi[0][order[i]],
+			(unsigned long)ms_hi[1][order[i]]);
+
+	/* fetches went through readb and were counted as reads too */
+	fprintf(f, "\nregion         reads     writes    fetches\n");
+	for (i = 0; i < 256; i++)
+		total[i] = ms_region[MS_READ][i] + ms_region[MS_WRITE][i];
+	rank(order, total, 256);
+	for (i = 0; i < 256 && total[order[i]]; i++)
+	{
+		j = order[i];
+		fprintf(f, "%02x00-%02xff  %10lu %10lu %10lu\n", j, j,
+			(unsigned long)(ms_region[MS_READ][j] - ms_region[MS_FETCH][j]),
+			(unsigned long)ms_region[MS_WRITE][j],
+			(unsigned long)ms_region[MS_FETCH][j]);
+	}
+	return fclose(f) ? -1 : 0;
+}
+
+#else
+
+void memstats_reset()
+{
+}
+
+int memstats_dump(char *name)
+{
+	return name ? -1 : 0;
+}
+
+#endif
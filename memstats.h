@@ -0,0 +1,52 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include "defs.h"
+
+/* what sent an access the slow way, through mem_read or mem_write */
+enum
+{
+	MS_WATCH,	/* a watchpoint, or code the profiler is watching */
+	MS_ROM,		/* reading rom that isn't mapped: boot rom, cheats */
+	MS_MBC,		/* writing rom, which is the mbc */
+	MS_VRAM,
+	MS_SRAM,	/* cartridge ram off, or being tracked */
+	MS_RTC,
+	MS_WRAM,	/* being tracked for rewind or hashing */
+	MS_ECHO,
+	MS_OAM,
+	MS_HI,		/* ff00-ffff: io registers and hram */
+	MS_N
+};
+
+/* the kinds of access counted per 256 byte region; MS_READ counts
+   fetches as well */
+enum
+{
+	MS_READ,
+	MS_WRITE,
+	MS_FETCH
+};
+
+#ifdef MEMSTATS
+
+extern un32 ms_region[3][256], ms_hi[2][256], ms_slow[2][MS_N];
+
+#define MS_ACCESS(k, a) (ms_region[k][((a) >> 8) & 0xff]++)
+#define MS_HIREG(w, r) (ms_hi[w][(r) & 0xff]++)
+#define MS_SLOW(w, a) (ms_slow[w][memstats_why((w), (a))]++)
+
+int memstats_why(int w, int a);
+
+#else
+
+#define MS_ACCESS(k, a) ((void)0)
+#define MS_HIREG(w, r) ((void)0)
+#define MS_SLOW(w, a) ((void)0)
+
+#endif
+
+void memstats_reset();
+int memstats_dump(char *name);
+
+#endif
@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <stdio.h>
@@ -19,11 +20,14 @@
 #define FONTW 5
 #define FONTH 7
 #define FONTMAX 127
+/* how long the menu naps when idle, for backends whose ev_poll can't
+   wait for input */
+#define MENUNAP 10000
 
 static char *romdir;
 static struct ezmenu ezm;
 static enum menu_page currpage;
-static unsigned char screen[160*144];
+static unsigned char *screen; /* made the first time it's painted */
 static char statusline[64];
 
 
@@ -42,15 +46,258 @@ static int allowed_ext(char *fn) {
 	return 0;
 }
 
-static int strlistcmp(const void* a, const void *b) {
-	return strcmp(*(char* const*) a, *(char* const*) b);
-}
-
 static int strendswith(char *s, char *end) {
 	size_t ls = strlen(s), le = strlen(end);
 	return ls >= le && !strcmp(s + ls - le, end);
 }
 
+/*
+ * The rom list is read a little at a time while the menu waits for a
+ * key, so a big directory on slow storage pages in instead of freezing
+ * the menu. What was found last time is kept in an index in savedir,
+ * one per directory, with each rom's size, mtime and what its header
+ * says; that's shown at once when the page opens, while the directory
+ * is read again behind it, and only roms that changed have their
+ * headers read again.
+ */
+
+struct rom {
+	char *name;
+	long long size, mtime;
+	char title[17];
+	unsigned char dir, known, cgb, type;
+};
+
+static struct {
+	DIR *dir;
+	void *timer;
+	char *index;
+	/* old is the index as loaded, new the directory as read so far;
+	   next is the first of new whose header is still to be read */
+	struct rom *old, *new;
+	int nold, nnew, cap, next, changed;
+	/* what the page is showing */
+	struct rom *shown;
+	char **lines;
+	char footer[40];
+} romsel;
+
+static int romcmp(const void *a, const void *b) {
+	return strcmp(((struct rom*)a)->name, ((struct rom*)b)->name);
+}
+
+static void romsel_footer(void) {
+	struct rom *r = ezm.sel ? &romsel.shown[ezm.sel-1] : 0;
+	if(!r || r->dir || !r->known) snprintf(romsel.footer, sizeof romsel.footer,
+		"%s", romsel.dir ? "reading..." : " ");
+	else snprintf(romsel.footer, sizeof romsel.footer, "%-16s %s %02X",
+		r->title, r->cgb ? "cgb" : "dmg", r->type);
+	ezmenu_setfooter(&ezm, romsel.footer);
+}
+
+/* show n roms from list, keeping the selection where it was */
+static void romsel_show(struct rom *list, int n) {
+	char *was = ezm.lines && ezm.sel < ezm.linecount ? ezm.lines[ezm.sel] : 0;
+	char **lines = malloc(sizeof(char*) * (n+1));
+	int i, sel = 0;
+	lines[0] = "..";
+	for(i = 0; i < n; ++i) {
+		lines[i+1] = list[i].name;
+		if(was && !strcmp(was, list[i].name)) sel = i+1;
+	}
+	free(romsel.lines);
+	romsel.lines = lines;
+	romsel.shown = list;
+	ezmenu_setlines(&ezm, lines, n+1);
+	ezm.sel = sel;
+	romsel_footer();
+}
+
+static void index_load(void) {
+	FILE *f;
+	char line[1024], *t, *name;
+	struct rom r;
+	int dir, known, cgb, type, n;
+
+	if(!(f = fopen(romsel.index, "r"))) return;
+	if(!fgets(line, sizeof line, f) || strcmp(line, "gnuboy rom index 1\n")) {
+		fclose(f);
+		return;
+	}
+	while(fgets(line, sizeof line, f)) {
+		memset(&r, 0, sizeof r);
+		if(sscanf(line, "%lld %lld %d %d %d %d%n",
+			&r.size, &r.mtime, &dir, &known, &cgb, &type, &n) < 6
+			|| line[n] != ' ' || !(name = strchr(t = line + n + 1, '\t')))
+			continue;
+		*(name++) = 0;
+		name[strcspn(name, "\n")] = 0;
+		snprintf(r.title, sizeof r.title, "%s", t);
+		r.dir = dir, r.known = known, r.cgb = cgb, r.type = type;
+		r.name = strdup(name);
+		romsel.old = realloc(romsel.old, sizeof r * (romsel.nold+1));
+		romsel.old[romsel.nold++] = r;
+	}
+	fclose(f);
+	qsort(romsel.old, romsel.nold, sizeof *romsel.old, romcmp);
+}
+
+static void index_save(void) {
+	FILE *f;
+	char *tmp = malloc(strlen(romsel.index) + 8);
+	struct rom *r;
+	int ok;
+
+	sprintf(tmp, "%s.new", romsel.index);
+	if(!(f = fopen(tmp, "w"))) goto done;
+	fprintf(f, "gnuboy rom index 1\n");
+	for(r = romsel.new; r < romsel.new + romsel.nnew; ++r)
+		if(!strchr(r->name, '\n'))
+			fprintf(f, "%lld %lld %d %d %d %d %s\t%s\n", r->size, r->mtime,
+				r->dir, r->known, r->cgb, r->type, r->title, r->name);
+	ok = !ferror(f);
+	if(fclose(f) || !ok || rename(tmp, romsel.index)) remove(tmp);
+done:
+	free(tmp);
+}
+
+static void romsel_close(void) {
+	int i;
+	if(romsel.dir) closedir(romsel.dir);
+	for(i = 0; i < romsel.nold; ++i) free(romsel.old[i].name);
+	for(i = 0; i < romsel.nnew; ++i) free(romsel.new[i].name);
+	free(romsel.old);
+	free(romsel.new);
+	free(romsel.lines);
+	free(romsel.index);
+	free(romsel.timer);
+	memset(&romsel, 0, sizeof romsel);
+	ezm.lines = 0;
+}
+
+/* the roms in the zip at fn, from the loader's index of it; -1 if fn
+   isn't a zip. list may be 0 to count them */
+static int zip_roms(char *fn, struct rom *list) {
+	struct zipentry *e;
+	int i, n, k = 0;
+	if(!strendswith(fn, ".zip") || (n = zip_index(fn, &e)) < 0) return -1;
+	for(i = 0; i < n; ++i) {
+		if(!allowed_ext(e[i].name) || strendswith(e[i].name, ".zip")) continue;
+		if(list) {
+			memset(&list[k], 0, sizeof *list);
+			list[k].name = strdup(e[i].name);
+			list[k].size = e[i].usize;
+		}
+		k++;
+	}
+	return k;
+}
+
+/* a zip holding more than one rom is browsed like a directory. there's
+   nothing to read a little at a time, and its roms' headers are left
+   alone, since each would have to be inflated whole to get at */
+static int romsel_openzip(void) {
+	int n = zip_roms(romdir, 0);
+	if(n < 0) return -1;
+	romsel.new = malloc(sizeof *romsel.new * (n ? n : 1));
+	romsel.nnew = romsel.cap = zip_roms(romdir, romsel.new);
+	qsort(romsel.new, romsel.nnew, sizeof *romsel.new, romcmp);
+	return 0;
+}
+
+static int romsel_open(void) {
+	char *savedir = rc_getstr("savedir");
+	if(!romsel_openzip()) return 0;
+	if(!(romsel.dir = opendir(romdir))) return -1;
+	romsel.timer = sys_timer();
+	romsel.next = -1;
+	if(savedir && *savedir) {
+		romsel.index = malloc(strlen(savedir) + 24);
+		sprintf(romsel.index, "%s/romdir-%08x.idx", savedir, rc_hash(romdir));
+		index_load();
+	}
+	return 0;
+}
+
+/* reads the next directory entry into new; 0 at the end */
+static int romsel_read(void) {
+	struct dirent *file;
+	struct stat st;
+	struct rom r, *old;
+	char path[1024];
+
+	while((file = readdir(romsel.dir))) {
+		if(file->d_name[0] == '.') continue;
+		snprintf(path, sizeof path, "%s/%s", romdir, file->d_name);
+		if(stat(path, &st)) continue;
+		memset(&r, 0, sizeof r);
+		r.dir = S_ISDIR(st.st_mode);
+		if(!r.dir && !allowed_ext(file->d_name)) continue;
+		r.name = file->d_name;
+		r.size = st.st_size;
+		r.mtime = st.st_mtime;
+		old = bsearch(&r, romsel.old, romsel.nold, sizeof r, romcmp);
+		if(old && old->size == r.size && old->mtime == r.mtime && old->dir == r.dir)
+			r = *old;
+		else romsel.changed = 1;
+		r.name = strdup(file->d_name);
+		if(romsel.nnew == romsel.cap) {
+			romsel.cap = romsel.cap ? romsel.cap * 2 : 64;
+			romsel.new = realloc(romsel.new, sizeof r * romsel.cap);
+		}
+		romsel.new[romsel.nnew++] = r;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Does a few milliseconds of the romsel. -1 if there's nothing left to
+ * do, 1 if the page has to be drawn again.
+ */
+static int romsel_scan(void) {
+	char path[1024];
+	struct rom *r;
+	int cgb, type, got = 0, redraw = 0;
+
+	if(!romsel.dir) return -1;
+	sys_elapsed(romsel.timer);
+	while(romsel.dir && got < 10000) {
+		if(romsel.next < 0) {
+			if(romsel_read()) redraw = !romsel.nold;
+			else {
+				qsort(romsel.new, romsel.nnew, sizeof *romsel.new, romcmp);
+				romsel.next = 0;
+			}
+		} else if(romsel.next < romsel.nnew) {
+			r = &romsel.new[romsel.next++];
+			if(r->dir || r->known) continue;
+			snprintf(path, sizeof path, "%s/%s", romdir, r->name);
+			if(!rom_header(path, r->title, &cgb, &type)) {
+				r->known = 1;
+				r->cgb = cgb;
+				r->type = type;
+			}
+		} else {
+			closedir(romsel.dir);
+			romsel.dir = 0;
+			if(romsel.changed || romsel.nnew != romsel.nold) {
+				if(romsel.index) index_save();
+			}
+			redraw = 1;
+		}
+		got += sys_elapsed(romsel.timer);
+	}
+	if(redraw) {
+		if(romsel.next < 0)
+			qsort(romsel.new, romsel.nnew, sizeof *romsel.new, romcmp);
+		if(romsel.next < 0 || romsel.changed || romsel.nnew != romsel.nold)
+			romsel_show(romsel.new, romsel.nnew);
+		else romsel_footer();
+	}
+	return redraw;
+}
+
 /* this is defined this way so a couple 0 bytes can be added that can
    be overwritten with the mapped key name, if desired */
 static char* controller_menu_items[] = {
@@ -78,15 +325,7 @@ void menu_initpage(enum menu_page page) {
 		"state 5", "state 6", "state 7", "state 8", "state 9",
 		"back",
 	};
-	DIR *dir;
-	struct dirent* file;
-	char **dirlist = 0;
-	unsigned dirlistcnt = 0, i;
-	if(currpage == mp_romsel) {
-		for(i=0; i<ezm.linecount; ++i)
-			free(ezm.lines[i]);
-		free(ezm.lines);
-	}
+	if(currpage == mp_romsel) romsel_close();
 	switch(page) {
 	case mp_savestate:
 	case mp_loadstate:
@@ -110,8 +349,7 @@ void menu_initpage(enum menu_page page) {
 		ezmenu_setfooter(&ezm, " ");
 		break;
 	case mp_romsel:
-		dir = opendir(romdir);
-		if(!dir) {
+		if(romsel_open()) {
 			loader_set_error("failed to open directory");
 			if(strendswith(romdir, "/.."))
 				romdir[strlen(romdir)-3] = 0;
@@ -119,25 +357,7 @@ void menu_initpage(enum menu_page page) {
 			goto loaderr;
 		}
 		ezmenu_setheader(&ezm, "GNUBOY ROM Selection");
-		ezmenu_setfooter(&ezm, " ");
-		dirlist = malloc(sizeof(char*));
-		dirlist[0] = strdup("..");
-		dirlistcnt = 1;
-		while((file = readdir(dir))) {
-			if(file->d_name[0] == '.') continue;
-			if (!allowed_ext(file->d_name)) {
-				char path[1024];
-				struct stat st;
-				snprintf(path, sizeof path, "%s/%s", romdir, file->d_name);
-				if(!stat(path, &st) && S_ISDIR(st.st_mode));
-				else continue;
-			}
-			dirlist = realloc(dirlist, sizeof(char*)*(++dirlistcnt));
-			dirlist[dirlistcnt-1] = strdup(file->d_name);
-		}
-		closedir(dir);
-		qsort(dirlist+1, dirlistcnt-1, sizeof(char*), strlistcmp);
-		ezmenu_setlines(&ezm, dirlist, dirlistcnt);
+		romsel_show(romsel.nold ? romsel.old : romsel.new, romsel.nold ? romsel.nold : romsel.nnew);
 		break;
 	}
 	currpage = page;
@@ -184,6 +404,7 @@ static void restore_pal(struct palbkup *bk) {
 
 static void menu_paint(void) {
 	struct palbkup bk;
+	if (!screen && !(screen = calloc(160, 144))) return;
 	/* since we use gb's lcd routines to draw to vram, we have to backup
 	   previous palette entries */
 	bkup_pal(&bk);
@@ -216,13 +437,32 @@ static void menu_paint(void) {
 	restore_pal(&bk);
 }
 
+/* text over the game's picture rather than a page of its own, a line
+   of it per \n, black behind the letters and the picture elsewhere */
+void menu_overlay(char *text) {
+	static unsigned char buf[160*144];
+	int x = 0, y = 0;
+	memset(buf, 0xff, sizeof buf);
+	for (; *text && y + FONTH <= 144; text++) {
+		if (*text == '\n') {
+			x = 0;
+			y += FONTH;
+			continue;
+		}
+		if (x + FONTW <= 160) font_blit(buf, x, y, *text, 0);
+		x += FONTW;
+	}
+	lcd_overlay(buf, y + FONTH);
+}
+
 static int menu_getevent(int *st) {
 	event_t ev;
 	int polled = 0;
 	while (1) {
 		if(!ev_getevent(&ev)) {
 			if(polled) break;
-			ev_poll(1);
+			/* wait for input, unless there's rom scanning to do */
+			ev_poll(currpage != mp_romsel || !romsel.dir);
 			polled = 1;
 			continue;
 		}
@@ -276,15 +516,17 @@ entry:;
 	ezmenu_update(&ezm);
 	menu_paint();
 	while(1) {
-		int st, k = menu_getevent(&st);
+		int st, r, k = menu_getevent(&st);
 		if (!k || !st) goto next;
 		switch(menu_translate_key(k)) {
 		case mk_up:
 			ezmenu_userinput(&ezm, EZM_UP);
+			if(currpage == mp_romsel) romsel_footer();
 			menu_paint();
 			break;
 		case mk_down:
 			ezmenu_userinput(&ezm, EZM_DOWN);
+			if(currpage == mp_romsel) romsel_footer();
 			menu_paint();
 			break;
 		case mk_cancel:
@@ -296,7 +538,14 @@ entry:;
 				char rd[1024];
 				struct stat st;
 				snprintf(rd, sizeof rd, "%s/%s", romdir, ezm.vislines[ezm.vissel]);
-				if(!stat(rd, &st) && S_ISDIR(st.st_mode)) {
+				if(strendswith(rd, "/..") && zip_roms(romdir, 0) >= 0) {
+					/* out of a zip, to the directory it's in */
+					if(strrchr(romdir, '/')) *strrchr(romdir, '/') = 0;
+					else strcpy(romdir, ".");
+					menu_initpage(mp_romsel);
+					goto entry;
+				}
+				if((!stat(rd, &st) && S_ISDIR(st.st_mode)) || zip_roms(rd, 0) > 1) {
 					free(romdir);
 					romdir = strdup(rd);
 					menu_initpage(mp_romsel);
@@ -371,7 +620,12 @@ entry:;
 			break;
 		default:
 			next:;
-			sys_sleep(300);
+			if(currpage != mp_romsel || (r = romsel_scan()) < 0)
+				sys_nap(MENUNAP);
+			else if(r) {
+				ezmenu_update(&ezm);
+				menu_paint();
+			}
 		}
 	}
 	out:; return;
@@ -10,3 +10,4 @@ enum menu_page {
 void menu_init(void);
 void menu_initpage(enum menu_page);
 void menu_enter(void);
+void menu_overlay(char *text);
@@ -2,6 +2,7 @@
 #include <stdint.h>
 
 void *tinfl_decompress_mem_to_heap(const void *, size_t, size_t *, int);
+void *tinfl_decompress_mem_to_heap_sized(const void *, size_t, size_t, size_t *, int);
 
 #ifdef MINIZ_PRIVATE
 
@@ -17,8 +18,9 @@ typedef int64_t mz_int64;
 typedef uint64_t mz_uint64;
 typedef int mz_bool;
 
-typedef mz_uint32 tinfl_bit_buf_t;
-#define TINFL_BITBUF_SIZE (32)
+typedef mz_uint64 tinfl_bit_buf_t;
+#define TINFL_BITBUF_SIZE (64)
+#define TINFL_USE_64BIT_BITBUF 1
 
 enum
 {
@@ -38,6 +40,8 @@ struct tinfl_decompressor_tag
     tinfl_bit_buf_t m_bit_buf;
     size_t m_dist_from_out_buf_start;
     mz_int16 m_look_up[TINFL_MAX_HUFF_TABLES][TINFL_FAST_LOOKUP_SIZE];
+    /* two literals at once, for tinfl_fast */
+    mz_uint32 m_pairs[TINFL_FAST_LOOKUP_SIZE];
     mz_int16 m_tree_0[TINFL_MAX_HUFF_SYMBOLS_0 * 2];
     mz_int16 m_tree_1[TINFL_MAX_HUFF_SYMBOLS_1 * 2];
     mz_int16 m_tree_2[TINFL_MAX_HUFF_SYMBOLS_2 * 2];
@@ -107,6 +111,7 @@ enum
 #define MZ_MACRO_END while (0)
 #define MZ_READ_LE16(p) ((mz_uint32)(((const mz_uint8 *)(p))[0]) | ((mz_uint32)(((const mz_uint8 *)(p))[1]) << 8U))
 #define MZ_READ_LE32(p) ((mz_uint32)(((const mz_uint8 *)(p))[0]) | ((mz_uint32)(((const mz_uint8 *)(p))[1]) << 8U) | ((mz_uint32)(((const mz_uint8 *)(p))[2]) << 16U) | ((mz_uint32)(((const mz_uint8 *)(p))[3]) << 24U))
+#define MZ_READ_LE64(p) ((mz_uint64)MZ_READ_LE32(p) | ((mz_uint64)MZ_READ_LE32((const mz_uint8 *)(p) + 4) << 32U))
 
 #define TINFL_DECOMPRESS_MEM_TO_MEM_FAILED ((size_t)(-1))
 
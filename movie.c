@@ -0,0 +1,244 @@
+/*
+ * movie.c
+ *
+ * Input movies, for runs that have to see exactly the same input every
+ * time. A movie is a save state followed by the pad of every frame
+ * after it, run length encoded:
+ *
+ *   "GBmv", crc-64 of the first rom bank (8 bytes, little endian),
+ *   state length (4 bytes, little endian), the state (packed, see
+ *   save.c, or in older movies as it is in memory), then runs of
+ *   a frame count (7 bits a byte, low first, high bit set on all but
+ *   the last) and the pad byte held for those frames.
+ *
+ * Starting from a state rather than from power on means the ram the
+ * loader made up, the rtc as it was resynced from the clock and
+ * anything else the host put in are all in the movie. After that
+ * nothing but the pad comes from outside: the rtc only moves with
+ * rtc_tick once a frame. Both ends begin in movie_frame, at the same
+ * point of the frame, and both run from the state as it loads back,
+ * so whatever the state file doesn't keep is the same in each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "hw.h"
+#include "cpu.h"
+#include "mem.h"
+#include "lcd.h"
+#include "sound.h"
+#include "save.h"
+#include "loader.h"
+#include "rc.h"
+#include "movie.h"
+
+static int moviequit;
+
+rcvar_t movie_exports[] =
+{
+	RCV_BOOL("moviequit", &moviequit, "quit when a movie finishes playing"),
+	RCV_END
+};
+
+#define REC 1
+#define PLAY 2
+
+static FILE *f;
+static int mode, starting;
+static byte *start;
+static int startlen;
+static byte last;
+static unsigned long run;
+
+
+static void putle(unsigned long long v, int n)
+{
+	while (n--)
+	{
+		fputc(v & 0xff, f);
+		v >>= 8;
+	}
+}
+
+static unsigned long long getle(int n)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		v |= (unsigned long long)(fgetc(f) & 0xff) << (8*i);
+	return v;
+}
+
+static uint64_t romkey()
+{
+	return rom_fingerprint(rom.bank[0], 16384);
+}
+
+static void putrun()
+{
+	unsigned long n = run;
+
+	for (; n >= 128; n >>= 7)
+		fputc((n & 127) | 128, f);
+	fputc(n, f);
+	fputc(last, f);
+}
+
+/* the next run, or 0 at the end of the movie */
+static int getrun()
+{
+	int c, s;
+
+	run = 0;
+	for (s = 0; (c = fgetc(f)) != EOF; s += 7)
+	{
+		run |= (unsigned long)(c & 127) << s;
+		if (!(c & 128)) break;
+	}
+	if (c == EOF || (c = fgetc(f)) == EOF) return 0;
+	last = c;
+	return run > 0;
+}
+
+/* press and release whatever differs from last, one button at a time
+   so each press raises its interrupt as it would from the keyboard */
+static void setpad()
+{
+	int i;
+
+	for (i = 1; i < 256; i <<= 1)
+		if ((hw.pad ^ last) & i)
+			pad_set(i, last & i);
+}
+
+static void reload(byte *buf, int len)
+{
+	cpu_sync();
+	loadstate_from_buffer(buf, len);
+	vram_dirty();
+	pal_dirty();
+	sound_dirty();
+	mem_updatemap();
+	cpu_sync();
+}
+
+int movie_record(char *name)
+{
+	movie_stop();
+	if (!(f = fopen(name, "wb"))) return -1;
+	mode = REC;
+	starting = 1;
+	return 0;
+}
+
+int movie_play(char *name)
+{
+	char magic[4];
+	uint64_t key;
+
+	movie_stop();
+	if (!(f = fopen(name, "rb"))) return -1;
+	if (fread(magic, 4, 1, f) != 1 || memcmp(magic, "GBmv", 4))
+		goto bad;
+	key = getle(8);
+	startlen = getle(4);
+	if (key != romkey() || startlen < 16 || startlen > (16 << 20))
+		goto bad;
+	if (!(start = malloc(startlen))
+		|| fread(start, startlen, 1, f) != 1)
+		goto bad;
+	mode = PLAY;
+	starting = 1;
+	return 0;
+bad:
+	free(start);
+	start = 0;
+	fclose(f);
+	f = 0;
+	return -1;
+}
+
+void movie_stop()
+{
+	if (mode == REC && !starting)
+		putrun();
+	if (mode == PLAY && !starting)
+	{
+		last = 0;
+		setpad();
+	}
+	if (f) fclose(f);
+	f = 0;
+	free(start);
+	start = 0;
+	mode = starting = 0;
+}
+
+int movie_playing()
+{
+	return mode == PLAY;
+}
+
+int movie_active()
+{
+	return mode != 0;
+}
+
+/* called once per frame by the main loop, after events are handled */
+void movie_frame()
+{
+	if (mode == REC && starting)
+	{
+		startlen = savestate_packsize();
+		if (!(start = malloc(startlen)))
+		{
+			movie_stop();
+			return;
+		}
+		startlen = savestate_pack(start, startlen);
+		reload(start, startlen);
+		fwrite("GBmv", 4, 1, f);
+		putle(romkey(), 8);
+		putle(startlen, 4);
+		fwrite(start, startlen, 1, f);
+		free(start);
+		start = 0;
+		starting = 0;
+		last = hw.pad;
+		run = 1;
+	}
+	else if (mode == REC)
+	{
+		if (hw.pad == last)
+		{
+			run++;
+			return;
+		}
+		putrun();
+		last = hw.pad;
+		run = 1;
+	}
+	else if (mode == PLAY)
+	{
+		if (starting)
+		{
+			reload(start, startlen);
+			free(start);
+			start = 0;
+			starting = 0;
+			run = 0;
+		}
+		if (!run && !getrun())
+		{
+			movie_stop();
+			if (moviequit) exit(0);
+			return;
+		}
+		run--;
+		setpad();
+	}
+}
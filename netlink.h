@@ -0,0 +1,6 @@
+#ifndef NETLINK_H
+#define NETLINK_H
+
+void netlink_frame();
+
+#endif
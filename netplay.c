@@ -0,0 +1,418 @@
+/*
+ * netplay.c
+ *
+ * Two players on two machines at one game, over udp, with rollback so
+ * neither waits on the network. Both pads drive the game together:
+ * what it sees each frame is the two of them or'ed. With "netplayport"
+ * and "netplaypeer" set on both sides and "netplayhost" on one, the
+ * host sends the guest its save state, packed (see save.c) so it goes
+ * over in a few packets, both load it, and from then on both run the
+ * same frames on the same input, the way a movie plays back (see
+ * movie.c).
+ *
+ * The local pad is applied at once, and the other player's is guessed
+ * to be what it was last heard to be. Every frame starts with a
+ * snapshot, in memory, as runahead takes them (see emu.c). When the
+ * other player's pad turns out to have been something else for a
+ * frame already run, the game goes back to the snapshot of that frame
+ * and runs forward again to now with the right pads, not drawn and not
+ * heard. That's never more than "rollback" frames; a player further
+ * behind than that makes the other wait. A frame takes well under
+ * 100us to run here, so going back the default 8 costs a millisecond
+ * or so, within the frame it happens in.
+ *
+ * Each message carries every pad the other side hasn't acknowledged
+ * yet, so a lost one costs nothing once the next gets through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "cpu.h"
+#include "hw.h"
+#include "regs.h"
+#include "mem.h"
+#include "lcd.h"
+#include "rtc.h"
+#include "sound.h"
+#include "pcm.h"
+#include "emu.h"
+#include "save.h"
+#include "cheat.h"
+#include "rc.h"
+#include "sys.h"
+#include "netplay.h"
+
+static int netplayport, netplayhost, rollback = 8;
+static char *netplaypeer;
+
+rcvar_t netplay_exports[] =
+{
+	RCV_INT("netplayport", &netplayport, "udp port for netplay, 0 = off"),
+	RCV_STRING("netplaypeer", &netplaypeer, "host:port of the other player"),
+	RCV_BOOL("netplayhost", &netplayhost, "send the other player our game to start from"),
+	RCV_INT("rollback", &rollback, "most frames netplay goes back to fix a guess"),
+	RCV_END
+};
+
+#define MAXROLL 32
+/* pads kept, ours and theirs, by frame */
+#define RING 64
+/* the state goes over in pieces this big, this many a frame */
+#define CHUNK 1024
+#define WINDOW 32
+/* how long to wait for a player who's stopped answering */
+#define TIMEOUT 5000
+
+#define SENDING 1
+#define RECEIVING 2
+#define PLAYING 3
+
+static int fd = -1, port, mode;
+static char *peer;
+
+/* the starting state, and how much of it the guest has */
+static byte *start;
+static int startlen, have;
+
+/* f is the frame about to run; rc the newest of theirs we have, and
+   acked the newest of ours they have. local is our pad as it is now,
+   mine and theirs the pads by frame, and guess what was used for
+   theirs when the frame ran */
+static int f, rc, acked;
+static byte local, mine[RING], theirs[RING], guess[RING];
+
+static struct snap
+{
+	byte *state;
+	struct cpu cpu;
+	struct hw hw;
+	struct snd snd;
+	struct rtc rtc;
+	struct dirty dirty;
+} snaps[MAXROLL + 1];
+static int snaplen, late = -1;
+
+
+static void put32(byte *p, int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int get32(byte *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (un32)p[3] << 24;
+}
+
+/* the same steps as loading a movie's state, on both sides */
+static void reload(byte *buf, int len)
+{
+	cpu_sync();
+	loadstate_delta(buf, len, 0);
+	sound_dirty();
+	mem_updatemap();
+	cpu_sync();
+}
+
+static void save(int h)
+{
+	struct snap *s = &snaps[h % (MAXROLL + 1)];
+
+	savestate_to_buffer(s->state, snaplen);
+	s->cpu = cpu, s->hw = hw, s->snd = snd, s->rtc = rtc, s->dirty = dirty;
+}
+
+static void load(int h)
+{
+	struct snap *s = &snaps[h % (MAXROLL + 1)];
+
+	loadstate_delta(s->state, snaplen, 0);
+	cpu = s->cpu, hw = s->hw, snd = s->snd, rtc = s->rtc, dirty = s->dirty;
+	mem_updatemap();
+}
+
+/* what the game's pad is made, from the pad it has now, button by
+   button the way a movie does it */
+static void setpad(byte p)
+{
+	int i;
+
+	pad_capture(0);
+	for (i = 1; i < 256; i <<= 1)
+		if ((hw.pad ^ p) & i)
+			pad_set(i, p & i);
+	if (mode == PLAYING) pad_capture(&local);
+}
+
+static void freesnaps()
+{
+	int i;
+
+	for (i = 0; i <= MAXROLL; i++)
+	{
+		free(snaps[i].state);
+		snaps[i].state = 0;
+	}
+}
+
+static void hangup()
+{
+	if (mode == PLAYING) setpad(local);
+	pad_capture(0);
+	sys_hangup(fd);
+	fd = -1;
+	mode = 0;
+	free(start);
+	start = 0;
+	freesnaps();
+}
+
+static void play()
+{
+	int i;
+
+	/* whatever we're holding down now, in the state or not */
+	local = hw.pad;
+	reload(start, startlen);
+	free(start);
+	start = 0;
+	snaplen = savestate_size();
+	for (i = 0; i <= MAXROLL; i++)
+		if (!(snaps[i].state = malloc(snaplen)))
+		{
+			fprintf(stderr, "netplay: out of memory\n");
+			hangup();
+			return;
+		}
+	f = 0;
+	rc = acked = -1;
+	mode = PLAYING;
+	pad_capture(&local);
+	fprintf(stderr, "netplay: started\n");
+}
+
+static void putpads()
+{
+	byte m[16 + RING];
+	int from = acked + 1, n;
+
+	if (from < f - RING + 1) from = f - RING + 1;
+	n = f - from + 1;
+	m[0] = 'I';
+	put32(m + 1, f);
+	put32(m + 5, rc);
+	m[9] = n;
+	while (n--) m[10 + n] = mine[(from + n) % RING];
+	sys_udpsend(fd, (char *)m, 10 + f - from + 1);
+}
+
+static void putack(int n)
+{
+	byte m[5];
+
+	m[0] = 'A';
+	put32(m + 1, n);
+	sys_udpsend(fd, (char *)m, 5);
+}
+
+static void gotpads(byte *m, int len)
+{
+	int newest = get32(m + 1), n = m[9], h;
+
+	if (len < 10 + n) return;
+	if (get32(m + 5) > acked) acked = get32(m + 5);
+	/* a gap: wait for one that covers it */
+	if (newest - n + 1 > rc + 1) return;
+	for (h = rc + 1; h <= newest; h++)
+	{
+		theirs[h % RING] = m[10 + n - 1 - (newest - h)];
+		if (h < f && guess[h % RING] != theirs[h % RING] && late < 0)
+			late = h;
+	}
+	if (newest > rc) rc = newest;
+}
+
+static void gotstate(byte *m, int len)
+{
+	int off = get32(m + 1), total = get32(m + 5);
+
+	if (mode != RECEIVING)
+	{
+		putack(startlen);
+		return;
+	}
+	if (!start)
+	{
+		if (total < 16 || total > (16 << 20)
+			|| !(start = malloc(total)))
+			return;
+		startlen = total;
+	}
+	if (total != startlen || off != have || off + len - 9 > startlen)
+		return;
+	memcpy(start + have, m + 9, len - 9);
+	have += len - 9;
+	putack(have);
+}
+
+/* everything that has come in, waiting up to us for the first */
+static void drain(int us)
+{
+	byte m[16 + CHUNK];
+	int n;
+
+	while ((n = sys_udprecv(fd, (char *)m, sizeof m, us)) != -2)
+	{
+		if (n < 0) return;
+		us = 0;
+		if (n >= 10 && m[0] == 'I')
+		{
+			/* the guest is playing, so it has the state */
+			if (mode == SENDING) have = startlen;
+			if (mode == PLAYING) gotpads(m, n);
+		}
+		else if (n > 9 && m[0] == 'S') gotstate(m, n);
+		else if (n == 5 && m[0] == 'A' && mode == SENDING)
+		{
+			if (get32(m + 1) > have) have = get32(m + 1);
+		}
+	}
+}
+
+static void sendstate()
+{
+	byte m[9 + CHUNK];
+	int i, off, n;
+
+	drain(0);
+	if (have >= startlen)
+	{
+		play();
+		return;
+	}
+	for (i = 0, off = have; i < WINDOW && off < startlen; i++, off += n)
+	{
+		n = startlen - off < CHUNK ? startlen - off : CHUNK;
+		m[0] = 'S';
+		put32(m + 1, off);
+		put32(m + 5, startlen);
+		memcpy(m + 9, start + off, n);
+		sys_udpsend(fd, (char *)m, 9 + n);
+	}
+}
+
+/* back to frame h and forward again to now, with the pads as we
+   know them now */
+static void resim(int h)
+{
+	byte *p = pcm.buf;
+	int was = lcd_skipframe(1);
+
+	load(h);
+	pcm.buf = 0;
+	for (; h < f; h++)
+	{
+		save(h);
+		guess[h % RING] = theirs[(h <= rc ? h : rc) % RING];
+		setpad(mine[h % RING] | guess[h % RING]);
+		emu_frame();
+		rtc_tick();
+		sound_mix();
+		cheat_frame();
+	}
+	pcm.buf = p;
+	lcd_skipframe(was);
+}
+
+static void plugin()
+{
+	char *p, host[256];
+
+	port = netplayport;
+	free(peer);
+	peer = netplaypeer ? strdup(netplaypeer) : 0;
+	if (fd >= 0) hangup();
+	if (!port || !peer) return;
+	if (!(p = strrchr(peer, ':')) || p - peer >= (int)sizeof host)
+	{
+		fprintf(stderr, "netplaypeer should be host:port\n");
+		return;
+	}
+	memcpy(host, peer, p - peer);
+	host[p - peer] = 0;
+	if ((fd = sys_udp(port, host, atoi(p + 1))) < 0)
+	{
+		fprintf(stderr, "netplay: cannot reach %s\n", peer);
+		return;
+	}
+	have = 0;
+	start = 0;
+	mode = RECEIVING;
+	if (!netplayhost) return;
+	startlen = savestate_packsize();
+	if (!(start = malloc(startlen)))
+	{
+		hangup();
+		return;
+	}
+	startlen = savestate_pack(start, startlen);
+	mode = SENDING;
+}
+
+int netplay_active()
+{
+	return mode != 0;
+}
+
+/*
+ * The main loop calls this once a frame, after everything else that
+ * happens between frames, so that's where a frame starts as far as
+ * going back to it goes.
+ */
+void netplay_frame()
+{
+	int waited = 0;
+
+	if (netplayport != port || !netplaypeer != !peer
+		|| (peer && strcmp(netplaypeer, peer)))
+		plugin();
+	if (fd < 0) return;
+	if (mode == SENDING) sendstate();
+	if (mode == RECEIVING)
+	{
+		drain(0);
+		if (start && have == startlen) play();
+	}
+	if (mode != PLAYING) return;
+
+	if (rollback > MAXROLL) rollback = MAXROLL;
+	if (rollback < 1) rollback = 1;
+	mine[f % RING] = local;
+	late = -1;
+	putpads();
+	drain(0);
+	/* too far ahead of them to guess any further */
+	while (f - rc > rollback || f - acked >= RING - 1)
+	{
+		if (waited >= TIMEOUT)
+		{
+			fprintf(stderr, "netplay: %s stopped answering\n", peer);
+			hangup();
+			return;
+		}
+		drain(10000);
+		putpads();
+		waited += 10;
+	}
+	if (late >= 0) resim(late);
+	save(f);
+	guess[f % RING] = theirs[(f <= rc ? f : rc < 0 ? 0 : rc) % RING];
+	if (rc < 0) guess[f % RING] = 0;
+	setpad(local | guess[f % RING]);
+	f++;
+}
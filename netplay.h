@@ -0,0 +1,7 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+int netplay_active();
+void netplay_frame();
+
+#endif
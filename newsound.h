@@ -0,0 +1,550 @@
+/*
+ * newsound.h
+ *
+ * Event driven sound_mix, built in place of the one in sound.c unless
+ * OLDSOUND is defined. Not a normal header: sound.c includes it so
+ * the two share its tables and statics, and it isn't a .c so that
+ * builds taking every .c file (Makefile.sdl2min2) leave it alone.
+ *
+ * sound.c steps every length, envelope and sweep counter on every
+ * output sample. Here we work out how many samples remain until the
+ * first of those events is due, render that many samples of each
+ * channel with nothing but the waveform in the loop, then advance
+ * the counters all at once and run whatever came due (nextevent and
+ * events, which live in sound.c since sound_skip uses them too). The
+ * output is sample for sample the same as sound.c's, so either can be
+ * checked against the other, unless bandlimit is set (see blip below)
+ * or soundquality isn't standard.
+ */
+
+
+#define MIXLEN 512
+
+static int mixl[MIXLEN], mixr[MIXLEN];
+
+
+/* the waveforms; each adds n samples into ml/mr, and takes what it
+   needs of the registers as arguments, so the sound thread can draw
+   them from a copy */
+
+static void sq_render(struct sndchan *c, int duty, int *ml, int *mr,
+	int l, int r, int n)
+{
+	const byte *wave = sqwave[duty];
+	unsigned pos = c->pos, freq = c->freq;
+	int v = c->envol << 2, i, s;
+
+	for (i = 0; i < n; i++)
+	{
+		s = wave[(pos>>18)&7] & v;
+		pos += freq;
+		mr[i] += s & r;
+		ml[i] += s & l;
+	}
+	c->pos = pos;
+}
+
+static void s3_render(struct sndchan *c, byte nr32, const byte *wave,
+	int *ml, int *mr, int l, int r, int n)
+{
+	unsigned pos = c->pos, freq = c->freq;
+	int sh, i, s;
+
+	if (!(nr32 & 96))
+	{
+		c->pos = pos + freq * n;
+		return;
+	}
+	sh = 3 - ((nr32>>5)&3);
+	for (i = 0; i < n; i++)
+	{
+		s = wave[(pos>>22) & 15];
+		if (pos & (1<<21)) s &= 15;
+		else s >>= 4;
+		s -= 8;
+		pos += freq;
+		s <<= sh;
+		mr[i] += s & r;
+		ml[i] += s & l;
+	}
+	c->pos = pos;
+}
+
+static void s4_render(struct sndchan *c, byte nr43, int *ml, int *mr,
+	int l, int r, int n)
+{
+	unsigned pos = c->pos, freq = c->freq;
+	const byte *noise = (nr43 & 8) ? noise7 : noise15;
+	unsigned wrap = (nr43 & 8) ? 15 : 4095;
+	int v = c->envol, i, s;
+
+	for (i = 0; i < n; i++)
+	{
+		s = 1 & (noise[(pos>>20)&wrap] >> (7-((pos>>17)&7)));
+		s = (-s) & v;
+		pos += freq;
+		s += s << 1;
+		mr[i] += s & r;
+		ml[i] += s & l;
+	}
+	c->pos = pos;
+}
+
+
+/*
+ * With bandlimit set, or soundquality high, the waveforms aren't sampled at all. Each
+ * channel only reports the moments its level changes, as a delta at
+ * 1/256 sample resolution split between the two samples around it,
+ * and output integrates the lot. Every sample is then the average
+ * level over its whole period instead of the level at one instant,
+ * which takes most of the aliasing out of high notes. outl/outr are
+ * the levels each channel has put into accl/accr so far.
+ */
+
+static int dl[MIXLEN+1], dr[MIXLEN+1];
+static int accl, accr;
+static int outl[4], outr[4];
+
+static void blip(int ch, int i, int f, int s, int l, int r)
+{
+	int d;
+
+	if ((d = (s & l) - outl[ch]))
+	{
+		dl[i] += d * (256 - f);
+		dl[i+1] += d * f;
+		outl[ch] += d;
+	}
+	if ((d = (s & r) - outr[ch]))
+	{
+		dr[i] += d * (256 - f);
+		dr[i+1] += d * f;
+		outr[ch] += d;
+	}
+}
+
+static int s1_level(unsigned pos)
+{
+	return sqwave[R_NR11>>6][(pos>>18)&7] & (S1.envol << 2);
+}
+
+static int s2_level(unsigned pos)
+{
+	return sqwave[R_NR21>>6][(pos>>18)&7] & (S2.envol << 2);
+}
+
+static int s3_level(unsigned pos)
+{
+	int s;
+
+	if (!(R_NR32 & 96)) return 0;
+	s = WAVE[(pos>>22) & 15];
+	if (pos & (1<<21)) s &= 15;
+	else s >>= 4;
+	return (s - 8) << (3 - ((R_NR32>>5)&3));
+}
+
+static int s4_level(unsigned pos)
+{
+	int s;
+
+	if (R_NR43 & 8) s = 1 & (noise7[
+		(pos>>20)&15] >> (7-((pos>>17)&7)));
+	else s = 1 & (noise15[
+		(pos>>20)&4095] >> (7-((pos>>17)&7)));
+	s = (-s) & S4.envol;
+	return s + (s << 1);
+}
+
+/* where, in 256ths of a sample, pos + x is crossed by a channel that
+   moves freq per sample; x is at most freq */
+static int frac(unsigned x, unsigned freq)
+{
+	if (freq >> 23)
+	{
+		x >>= 8;
+		freq >>= 8;
+	}
+	return (x << 8) / freq;
+}
+
+/* walk the points where pos crosses a multiple of 1<<sh over the next
+   n samples, reporting the level after each; returns the final pos */
+static unsigned edges(int ch, unsigned pos, unsigned freq, int sh,
+	int (*level)(unsigned), int l, int r, int n)
+{
+	unsigned b, j;
+	int i = 0;
+
+	blip(ch, 0, 0, level(pos), l, r);
+	if (!freq) return pos;
+	b = (pos | ((1u << sh) - 1)) + 1;
+	for (;;)
+	{
+		j = (b - pos - 1) / freq;
+		if (j >= (unsigned)(n - i)) break;
+		i += j;
+		pos += j * freq;
+		blip(ch, i, frac(b - pos, freq), level(b), l, r);
+		b += 1u << sh;
+	}
+	return pos + (n - i) * freq;
+}
+
+/* pan masks for the two bits of nr51 m belonging to one channel */
+#define PANL(m, b) (((m) & ((b)<<4)) ? -1 : 0)
+#define PANR(m, b) (((m) & (b)) ? -1 : 0)
+
+/* all four channels for bandlimit, leaving n samples in mixl/mixr in
+   256ths; whatever spills past the last one waits in dl[0]/dr[0] */
+static void blip_render(int n)
+{
+	int m = R_NR51, i;
+
+	memset(dl + 1, 0, n * sizeof *dl);
+	memset(dr + 1, 0, n * sizeof *dr);
+	if (S1.on) S1.pos = edges(0, S1.pos, S1.freq, 18, s1_level, PANL(m, 1), PANR(m, 1), n);
+	else blip(0, 0, 0, 0, 0, 0);
+	if (S2.on) S2.pos = edges(1, S2.pos, S2.freq, 18, s2_level, PANL(m, 2), PANR(m, 2), n);
+	else blip(1, 0, 0, 0, 0, 0);
+	if (S3.on && (R_NR32 & 96))
+		S3.pos = edges(2, S3.pos, S3.freq, 21, s3_level, PANL(m, 4), PANR(m, 4), n);
+	else
+	{
+		if (S3.on) S3.pos += S3.freq * n;
+		blip(2, 0, 0, 0, 0, 0);
+	}
+	if (S4.on) S4.pos = edges(3, S4.pos, S4.freq, 17, s4_level, PANL(m, 8), PANR(m, 8), n);
+	else blip(3, 0, 0, 0, 0, 0);
+	for (i = 0; i < n; i++)
+	{
+		mixl[i] = accl += dl[i];
+		mixr[i] = accr += dr[i];
+	}
+	dl[0] = dl[n];
+	dr[0] = dr[n];
+}
+
+/* n samples of ml/mr, scaled up by 1<<sh, into out as bits and stereo
+   say, at master volumes vl and vr; returns the bytes written. the 16
+   bit loops have nothing in them to keep the compiler from vectorizing
+   them, and the channels can't go past full scale, so there's no
+   clamping there */
+static int pack(byte *out, int *ml, int *mr, int n, int vl, int vr, int sh,
+	int bits, int stereo)
+{
+	n16 *p = (n16 *)out;
+	int i, l, r;
+
+	if (bits == 16)
+	{
+		if (stereo)
+			for (i = 0; i < n; i++)
+			{
+				p[2*i] = (ml[i] * vl) << 8 >> sh;
+				p[2*i+1] = (mr[i] * vr) << 8 >> sh;
+			}
+		else
+			for (i = 0; i < n; i++)
+				p[i] = (((ml[i] * vl) << 8 >> sh) + ((mr[i] * vr) << 8 >> sh)) >> 1;
+		return n * (stereo ? 4 : 2);
+	}
+	for (i = 0; i < n; i++)
+	{
+		l = (ml[i] * vl) >> sh;
+		r = (mr[i] * vr) >> sh;
+
+		if (l > 127) l = 127;
+		else if (l < -128) l = -128;
+		if (r > 127) r = 127;
+		else if (r < -128) r = -128;
+
+		if (stereo)
+		{
+			out[2*i] = l+128;
+			out[2*i+1] = r+128;
+		}
+		else out[i] = ((l+r)>>1)+128;
+	}
+	return n * (stereo ? 2 : 1);
+}
+
+/* mixl/mixr are scaled up by 1<<sh, counting the master volume; they
+   go into pcm.buf as many at a time as there's room for, and it's
+   handed over whenever it fills */
+static void output(int n, int sh)
+{
+	int vl = R_NR50 & 0x07, vr = (R_NR50 & 0x70) >> 4;
+	int i, k, size = (pcm.bits == 16 ? 2 : 1) * (pcm.stereo ? 2 : 1);
+
+	if (!pcm.buf) return;
+	for (i = 0; i < n; i += k)
+	{
+		if (pcm.pos >= pcm.len)
+		{
+			capture_pcm();
+			pcm_submit();
+		}
+		k = (pcm.len - pcm.pos) / size;
+		/* at least one, whatever the length of the buffer */
+		if (k < 1) k = 1;
+		if (k > n - i) k = n - i;
+		pcm.pos += pack(pcm.buf + pcm.pos, mixl + i, mixr + i, k, vl, vr,
+			sh, pcm.bits, pcm.stereo);
+	}
+}
+
+/* n samples of the four waveforms into ml/mr, from the channels ch,
+   the sound registers in hi (where ram.hi has them) and the wave
+   pattern; the channels' positions move on past them */
+static void draw(struct sndchan *ch, const byte *hi, const byte *wave,
+	int *ml, int *mr, int n)
+{
+	int m = hi[RI_NR51];
+
+	memset(ml, 0, n * sizeof *ml);
+	memset(mr, 0, n * sizeof *mr);
+	if (ch[0].on) sq_render(&ch[0], hi[RI_NR11]>>6, ml, mr, PANL(m, 1), PANR(m, 1), n);
+	if (ch[1].on) sq_render(&ch[1], hi[RI_NR21]>>6, ml, mr, PANL(m, 2), PANR(m, 2), n);
+	if (ch[2].on) s3_render(&ch[2], hi[RI_NR32], wave, ml, mr, PANL(m, 4), PANR(m, 4), n);
+	if (ch[3].on) s4_render(&ch[3], hi[RI_NR43], ml, mr, PANL(m, 8), PANR(m, 8), n);
+}
+
+
+/*
+ * With "soundthread" the waveforms are drawn in a thread of their own.
+ * The emulator still applies every write and moves every counter on
+ * from one event to the next, as sound_skip does, so the channels'
+ * state (and what NR52 reads back) is exactly what it would be; but
+ * where render would draw a run of samples it puts a copy of what the
+ * run is drawn from in a span, for the thread to draw and pack into
+ * synthout, and sound_mix moves whatever the thread has finished into
+ * pcm.buf. The samples are the same ones, they just come out a little
+ * later, up to a frame. bandlimit is drawn here as before, since it
+ * carries its own state from one run to the next, and so are the
+ * other soundquality tiers.
+ */
+
+#define SPANS 256 /* a power of two */
+#define OUTLEN 65536 /* the same */
+
+struct span
+{
+	int n;
+	struct sndchan ch[4];
+	byte hi[RI_NR52 + 1];
+	byte wave[16];
+	byte bits, stereo;
+};
+
+/* threaded is 1 once the thread runs, -1 if it can't or has been
+   stopped; quit tells it to end once it has drawn every span, and it
+   sets done when it has */
+static struct span spans[SPANS];
+static unsigned shead, stail;
+static byte synthout[OUTLEN];
+static unsigned ohead, otail;
+static int quit, done;
+
+static void synth(void *arg)
+{
+	static int ml[MIXLEN], mr[MIXLEN];
+	static byte buf[MIXLEN * 4];
+	struct span *s;
+	unsigned t = 0;
+	int n, k, vl, vr;
+
+	emu_pin(PIN_AUDIO);
+	for (;;)
+	{
+		if (t == LOAD(&shead))
+		{
+			/* shead again, as it may have moved before quit */
+			if (LOAD(&quit) && t == LOAD(&shead)) break;
+			sys_nap(1000);
+			continue;
+		}
+		s = &spans[t % SPANS];
+		draw(s->ch, s->hi, s->wave, ml, mr, s->n);
+		vl = s->hi[RI_NR50] & 0x07;
+		vr = (s->hi[RI_NR50] & 0x70) >> 4;
+		n = pack(buf, ml, mr, s->n, vl, vr, 4, s->bits, s->stereo);
+		while (OUTLEN - (ohead - LOAD(&otail)) < (unsigned)n)
+			sys_nap(1000);
+		k = OUTLEN - ohead % OUTLEN;
+		if (k > n) k = n;
+		memcpy(synthout + ohead % OUTLEN, buf, k);
+		memcpy(synthout, buf + k, n - k);
+		STORE(&ohead, ohead + n);
+		STORE(&stail, ++t);
+	}
+	STORE(&done, 1);
+}
+
+/* what the thread has finished, into pcm.buf */
+static void collect()
+{
+	unsigned t = otail, h = LOAD(&ohead), k;
+
+	if (!pcm.buf) return;
+	while (t != h)
+	{
+		if (pcm.pos >= pcm.len)
+		{
+			capture_pcm();
+			pcm_submit();
+		}
+		k = h - t;
+		if (k > OUTLEN - t % OUTLEN) k = OUTLEN - t % OUTLEN;
+		if (k > (unsigned)(pcm.len - pcm.pos)) k = pcm.len - pcm.pos;
+		memcpy(pcm.buf + pcm.pos, synthout + t % OUTLEN, k);
+		pcm.pos += k;
+		STORE(&otail, t += k);
+	}
+}
+
+/* wait for the thread to finish everything handed to it, so the
+   samples drawn here come after */
+static void settle()
+{
+	if (threaded <= 0) return;
+	while (LOAD(&stail) != shead || LOAD(&ohead) != otail)
+	{
+		collect();
+		if (!pcm.buf) return;
+		sys_nap(100);
+	}
+}
+
+/* at exit: the thread ended, and what it drew since the last frame
+   out to capture and the device rather than lost. the thread can't
+   finish while synthout is full, so it's emptied as it goes */
+static void stopsynth()
+{
+	int i;
+
+	if (threaded <= 0) return;
+	STORE(&quit, 1);
+	/* it only has up to a frame left, but don't wait forever */
+	for (i = 0; i < 3000 && !LOAD(&done); i++)
+	{
+		if (pcm.buf) collect();
+		else STORE(&otail, LOAD(&ohead));
+		sys_nap(1000);
+	}
+	threaded = -1;
+	collect();
+	if (pcm.buf && pcm.pos)
+	{
+		capture_pcm();
+		pcm_submit();
+	}
+}
+
+/* the next n samples, as spans for the thread; -1 if there's no
+   thread to give them to */
+static int handoff(int n)
+{
+	struct span *s;
+	int k;
+
+	if (!threaded) threaded = sys_thread(synth, 0) ? -1 : 1;
+	if (threaded < 0) return -1;
+	for (; n; n -= k)
+	{
+		k = nextevent(n < MIXLEN ? n : MIXLEN);
+		while (shead - LOAD(&stail) == SPANS)
+		{
+			collect();
+			sys_nap(100);
+		}
+		s = &spans[shead % SPANS];
+		s->n = k;
+		memcpy(s->ch, snd.ch, sizeof s->ch);
+		memcpy(s->hi, ram.hi, sizeof s->hi);
+		memcpy(s->wave, WAVE, sizeof s->wave);
+		s->bits = pcm.bits;
+		s->stereo = pcm.stereo;
+		STORE(&shead, shead + 1);
+		if (S1.on) S1.pos += S1.freq * k;
+		if (S2.on) S2.pos += S2.freq * k;
+		if (S3.on) S3.pos += S3.freq * k;
+		if (S4.on) S4.pos += S4.freq * k;
+		events(k);
+	}
+	return 0;
+}
+
+
+/*
+ * soundquality fast draws one sample in HOLD, from the channels as
+ * they'd be if the rate were a quarter of what it is, and holds it
+ * for the rest. The channels are moved on by the full n afterwards,
+ * so they end up exactly where standard would leave them and only
+ * the samples differ. Each run starts on a fresh sample, which keeps
+ * it from depending on anything but the run itself.
+ */
+
+#define HOLD 4
+
+static void draw_fast(int n)
+{
+	static int hl[MIXLEN / HOLD], hr[MIXLEN / HOLD];
+	struct sndchan ch[4];
+	int i;
+
+	memcpy(ch, snd.ch, sizeof ch);
+	for (i = 0; i < 4; i++)
+		ch[i].freq = (unsigned)ch[i].freq * HOLD;
+	draw(ch, ram.hi, WAVE, hl, hr, (n + HOLD - 1) / HOLD);
+	for (i = 0; i < 4; i++)
+		if (snd.ch[i].on) snd.ch[i].pos += snd.ch[i].freq * n;
+	for (i = 0; i < n; i++)
+	{
+		mixl[i] = hl[i / HOLD];
+		mixr[i] = hr[i / HOLD];
+	}
+}
+
+static void render()
+{
+	int left, n, q, was = bench_in;
+
+	if (!RATE || cpu.snd < RATE) return;
+	bench_in = BENCH_SOUND;
+	TL_BEGIN(TL_MIX);
+
+	/* bandlimit is what high was before there were tiers */
+	q = soundquality;
+	if (q > SQ_HIGH || (q == SQ_STANDARD && bandlimit)) q = SQ_HIGH;
+	left = samples();
+	if (!pcm.buf || q <= SQ_OFF)
+	{
+		settle();
+		sound_skip(left);
+		silence(left);
+		left = 0;
+	}
+	else if (soundthread && q == SQ_STANDARD && !handoff(left)) left = 0;
+	else settle();
+	while (left)
+	{
+		n = nextevent(left < MIXLEN ? left : MIXLEN);
+		if (q == SQ_HIGH)
+		{
+			blip_render(n);
+			events(n);
+			output(n, 12);
+			left -= n;
+			continue;
+		}
+		if (q == SQ_FAST) draw_fast(n);
+		else draw(snd.ch, ram.hi, WAVE, mixl, mixr, n);
+		events(n);
+		output(n, 4);
+		left -= n;
+	}
+	R_NR52 = (R_NR52&0xf0) | S1.on | (S2.on<<1) | (S3.on<<2) | (S4.on<<3);
+	TL_END(TL_MIX);
+	bench_in = was;
+}
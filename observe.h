@@ -0,0 +1,27 @@
+#ifndef OBSERVE_H
+#define OBSERVE_H
+
+#include "defs.h"
+
+#define OBS_GRAY 0
+#define OBS_INDEX 1
+/* the most addresses observe_gather reads */
+#define OBS_MAXRAM 4096
+
+/* set while the lcd should hand observe_line every line it makes:
+   only for the frame after observe_arm */
+extern int observing;
+
+int observe_setup(int kind, int shrink, byte *ring, int depth);
+void observe_arm();
+void observe_line(int l, byte *buf);
+void observe_frame();
+int observe_count();
+int observe_ram(const int *addrs, int n);
+int observe_gather(byte *out);
+
+/* adds the brightness of a line's 160 pixels, palette indices in buf
+   looked up in lum, to acc, shrink of them into each; see observe.c */
+void observe_row(un16 *acc, byte *buf, byte *lum, int shrink);
+
+#endif
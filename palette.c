@@ -1,17 +1,30 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "defs.h"
 #include "fb.h"
 #include "sys.h"
 
-static byte palmap[32768];
 static byte pallock[256];
 static int palrev[256];
-
-/* Course color mapping, for when palette is exhausted. */
-static byte crsmap[4][32768];
-static int crsrev[4][256];
-static const int crsmask[4] = { 0x7BDE, 0x739C, 0x6318, 0x4210 };
+/* set once vid_setpal has given an entry a color */
+static byte palset[256];
+/* entries not in use, so a search for one isn't made when none are */
+static int palfree = 255;
+
+/*
+ * When every entry is taken, a color is shown as the nearest one the
+ * palette has, nearest as the sum of the differences in red, green
+ * and blue. invmap has that for all 32768 colors, so each is one
+ * read; it's made again, when next needed, only after an entry has
+ * been given a new color, which while the palette is full is seldom.
+ */
+#ifdef LOWMEM
+static byte *palmap, *invmap;
+#else
+static byte palmap[32768], invmap[32768];
+#endif
+static int invvalid;
 
 enum plstatus
 {
@@ -22,66 +35,74 @@ enum plstatus
 };
 
 
-static byte bestmatch(int c)
+/* a breadth first fill from the palette's colors, a step at a time
+   in red, green or blue, which comes to the same as measuring the
+   distance to every one of them; where two colors are as near the
+   lower entry usually wins, as it would in a search */
+static void mkinverse()
 {
-	byte n, best;
-	int r, g, b;
-	int r2, g2, b2, c2;
-	int err, besterr;
-
-	r = (c & 0x001F) << 3;
-	g = (c & 0x03E0) >> 2;
-	b = (c & 0x7C00) >> 7;
-
-	best = 0;
-	besterr = 1024;
-	for (n = 1; n; n++)
+	static const int step[3][2] =
 	{
-		c2 = palrev[n];
-		r2 = (c2 & 0x001F) << 3;
-		g2 = (c2 & 0x03E0) >> 2;
-		b2 = (c2 & 0x7C00) >> 7;
-		err = abs(r-r2) + abs(b-b2) + abs(g-g2);
-		if (err < besterr)
-		{
-			besterr = err;
-			best = n;
-		}
-	}
-	return best;
-}
-
-static void makecourse(int c, byte n)
-{
-	int i;
-	for (i = 0; i < 4; i++)
+		{ 0x0001, 0x001F }, { 0x0020, 0x03E0 }, { 0x0400, 0x7C00 }
+	};
+	un16 *queue;
+	byte seen[32768 / 8];
+	int head = 0, tail = 0, n, c, d, i;
+
+	invvalid = 1;
+	memset(invmap, 0, 32768);
+	if (!(queue = malloc(32768 * sizeof *queue))) return;
+	memset(seen, 0, sizeof seen);
+	for (n = 1; n < 256; n++)
 	{
-		c &= crsmask[i];
-		crsmap[i][c] = n;
-		crsrev[i][n] = c;
+		c = palrev[n];
+		if (!palset[n] || seen[c >> 3] & 1 << (c & 7)) continue;
+		seen[c >> 3] |= 1 << (c & 7);
+		invmap[c] = n;
+		queue[tail++] = c;
 	}
-}
-
-static byte findcourse(int c)
-{
-	int i;
-	byte n;
-	for (i = 0; i < 4; i++)
+	while (head < tail)
 	{
-		c &= crsmask[i];
-		n = crsmap[i][c];
-		if (crsrev[i][n] == c)
-			return n;
+		c = queue[head++];
+		for (i = 0; i < 3; i++)
+		{
+			/* one down, unless it's already 0, and one up, unless
+			   it's already 31 */
+			if (c & step[i][1])
+			{
+				d = c - step[i][0];
+				if (!(seen[d >> 3] & 1 << (d & 7)))
+				{
+					seen[d >> 3] |= 1 << (d & 7);
+					invmap[d] = invmap[c];
+					queue[tail++] = d;
+				}
+			}
+			if ((c & step[i][1]) != step[i][1])
+			{
+				d = c + step[i][0];
+				if (!(seen[d >> 3] & 1 << (d & 7)))
+				{
+					seen[d >> 3] |= 1 << (d & 7);
+					invmap[d] = invmap[c];
+					queue[tail++] = d;
+				}
+			}
+		}
 	}
-	return 0;
+	free(queue);
 }
 
 
 void pal_lock(byte n)
 {
 	if (!n) return;
+	if (!pallock[n]) palfree--;
 	if (pallock[n] >= pl_locked)
-		pallock[n]++;
+	{
+		/* held 252 times over is held; wrapping would free it */
+		if (pallock[n] < 255) pallock[n]++;
+	}
 	else pallock[n] = pl_locked;
 }
 
@@ -89,23 +110,29 @@ byte pal_getcolor(int c, int r, int g, int b)
 {
 	byte n;
 	static byte l;
+#ifdef LOWMEM
+	if (!palmap && !(palmap = calloc(32768, 1))) return 0;
+	if (!invmap && !(invmap = calloc(32768, 1))) return 0;
+#endif
 	n = palmap[c];
 	if (n && pallock[n] && palrev[n] == c)
 	{
 		pal_lock(n);
 		return n;
 	}
-	for (n = l+1; n != l; n++)
+	for (n = l+1; palfree && n != l; n++)
 	{
 		if (!n || pallock[n] /* || n < 16 */) continue;
 		pal_lock(n);
 		palmap[c] = n;
 		palrev[n] = c;
-		makecourse(c, n);
+		palset[n] = 1;
+		invvalid = 0;
 		vid_setpal(n, r, g, b);
 		return (l = n);
 	}
-	n = findcourse(c);
+	if (!invvalid) mkinverse();
+	n = invmap[c];
 	pal_lock(n);
 	return n;
 }
@@ -122,7 +149,7 @@ void pal_expire()
 	int i;
 	for (i = 0; i < 256; i++)
 		if (pallock[i] && pallock[i] < pl_locked)
-			pallock[i]--;
+			if (!--pallock[i] && i) palfree++;
 }
 
 
@@ -9,8 +9,23 @@ struct pcm
 {
 	int hz, len;
 	int stereo;
+	/* 16 for signed native endian 16 bit samples, otherwise unsigned
+	   8 bit; len and pos count bytes either way */
+	int bits;
 	byte *buf;
 	int pos;
+	/* for drivers pacing by the clock rather than by pcm_submit:
+	   with drc set, samples are timed at exactly hz instead of the
+	   nearest whole number of cycles, each stretched by skew/65536
+	   of its length (shortened if negative) to steer the buffer */
+	int drc, skew;
+	/* how much sound the backend holds after the last pcm_submit, in
+	   us, for stat_audio; left 0 by those that can't tell */
+	int fill;
+	/* set by emu_run while the sound device's clock paces it (see
+	   "audioclock"): pcm_submit then only queues what it's given,
+	   with no waiting and no rate control */
+	int clocked;
 };
 
 extern struct pcm pcm;
@@ -0,0 +1,24 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "defs.h"
+
+extern int profiling, opcounting;
+
+/* opcodes, then what followed each CB, then pairs run one after the
+   other, first << 8 | second */
+#define OPCOUNTS (512 + 65536)
+
+void prof_insn(int elapsed);
+void prof_end(int elapsed);
+void prof_reset();
+int prof_dump(char *name);
+void prof_op();
+unsigned long long *prof_opcounts();
+int prof_opdump(char *name);
+int prof_coversize();
+void prof_cover(byte *map);
+int prof_covered();
+int prof_span();
+
+#endif
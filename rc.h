@@ -46,10 +46,13 @@ void rc_export(rcvar_t *v);
 void rc_exportvars(rcvar_t *vars);
 
 int rc_findvar(char *name);
+unsigned rc_hash(char *name);
+rccmd_t *rc_findcmd(char *name);
 
 int rc_setvar_n(int i, int c, char **v);
 int rc_setvar(char *name, int c, char **v);
 
+int rc_gettype_n(int i);
 int rc_getint_n(int i);
 float rc_getfloat_n(int i);
 int *rc_getvec_n(int i);
@@ -45,6 +45,10 @@ void refresh_3_4x(void *dest, byte *src, void *pal, int cnt);
 #ifdef ASM_REFRESH_4_4X
 void refresh_4_4x(void *dest, byte *src, void *pal, int cnt);
 #endif
+#ifdef ASM_REFRESH_YUV
+void refresh_yuv(void *dest, byte *src, void *pal, int cnt, int n,
+	un32 y0, un32 y1);
+#endif
 
 #ifdef __GNUC__
 #define MAY_ALIAS __attribute__((__may_alias__))
@@ -55,6 +59,14 @@ void refresh_4_4x(void *dest, byte *src, void *pal, int cnt);
 typedef un16 un16a MAY_ALIAS;
 typedef un32 un32a MAY_ALIAS;
 
+/* a packed 4:2:2 pair of two pixels a and b, each a pair of its own
+   color as the yuv palette has them: a's y where y0 says, b's where
+   y1 says, and the chroma bytes the average of theirs, rounded up as
+   pavgb and vrhadd round */
+#define YUVAVG(a, b) (((a) | (b)) - ((((a) ^ (b)) >> 1) & 0x7f7f7f7f))
+#define YUVPAIR(a, b, y0, y1) (((a) & (y0)) | ((b) & (y1)) \
+	| (YUVAVG(a, b) & ~((y0) | (y1))))
+
 
 #ifndef ASM_REFRESH_1
 static void refresh_1(void *dest_, byte *src, void *pal_, int cnt)
@@ -129,7 +141,7 @@ static void refresh_2_2x(void *dest_, byte *src, void *pal_, int cnt)
 static void refresh_3_2x(void *dest_, byte *src, void *pal_, int cnt)
 {
 	byte *dest = dest_;
-	un32a *pal = pal;
+	un32a *pal = pal_;
 	un32 c;
 	while (cnt--)
 	{
@@ -220,6 +232,30 @@ static void refresh_3_4x(void *dest_, byte *src, void *pal_, int cnt)
 }
 #endif
 
+#ifndef ASM_REFRESH_YUV
+/* fb.yuv 2: cnt pixels each n wide on the screen, two screen pixels
+   to a pair, so where a pair straddles two pixels its chroma is
+   shared between them */
+static void refresh_yuv(void *dest_, byte *src, void *pal_, int cnt, int n,
+	un32 y0, un32 y1)
+{
+	un32a *dest = dest_, *pal = pal_;
+	un32 a = 0, c;
+	int i, odd = 0;
+
+	/* unscaled, which is what an overlay that scales itself draws */
+	for (; n == 1 && cnt >= 2; cnt -= 2, src += 2)
+		*(dest++) = YUVPAIR(pal[src[0]], pal[src[1]], y0, y1);
+	while (cnt--)
+	{
+		c = pal[*(src++)];
+		for (i = 0; i < n; i++, odd ^= 1)
+			if (odd) *(dest++) = YUVPAIR(a, c, y0, y1);
+			else a = c;
+	}
+}
+#endif
+
 #ifndef ASM_REFRESH_4_4X
 static void refresh_4_4x(void *dest_, byte *src, void *pal_, int cnt)
 {
@@ -0,0 +1,224 @@
+/*
+ * rewind.c
+ *
+ * Keeps a history of recent save states so the game can be stepped
+ * backwards. Only the newest snapshot is stored in full; the ring
+ * holds, for every older one, the xor of it against its successor,
+ * run length encoded. Consecutive frames mostly touch the same few
+ * bytes, so a delta is usually a few hundred bytes rather than the
+ * 50-90k of a full state.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "rc.h"
+#include "lcd.h"
+#include "mem.h"
+#include "sound.h"
+#include "save.h"
+#include "rewind.h"
+
+
+/* most snapshots the index can hold, regardless of rewindmem */
+#define REWIND_MAX 16384
+
+#define FREENULL(X) do { free(X); X = 0; } while(0)
+
+static int rewindstep;
+static int rewindmem = 8192;
+
+rcvar_t rewind_exports[] =
+{
+	RCV_INT("rewindstep", &rewindstep, "frames between rewind snapshots, 0 = off"),
+	RCV_INT("rewindmem", &rewindmem, "memory for rewind history, in kilobytes"),
+	RCV_END
+};
+
+static byte *cur, *tmp, *dbuf, *ring;
+static int size, ringsize, havecur;
+static int frames, held, gen;
+
+/* allocated with the rest, so a build that never rewinds doesn't
+   carry the 128k of it */
+static struct
+{
+	int ofs, len;
+} *ent;
+static int first, count;
+
+
+void rewind_reset()
+{
+	havecur = 0;
+	first = count = 0;
+	frames = 0;
+}
+
+static int setup()
+{
+	int n = savestate_size(), r = rewindmem << 10;
+
+	if (n == size && r == ringsize) return 0;
+	free(cur);
+	free(tmp);
+	free(dbuf);
+	free(ring);
+	size = n;
+	ringsize = r;
+	cur = malloc(size);
+	tmp = malloc(size);
+	/* see delta() for the worst case */
+	dbuf = malloc(size + (size / 65535 + 2) * 8);
+	ring = malloc(ringsize);
+	if (!ent) ent = malloc(REWIND_MAX * sizeof *ent);
+	rewind_reset();
+	if (cur && tmp && dbuf && ring && ent) return 0;
+	FREENULL(cur);
+	FREENULL(tmp);
+	FREENULL(dbuf);
+	FREENULL(ring);
+	size = ringsize = 0;
+	return -1;
+}
+
+/* a and b agree on the next n bytes (n <= 4) */
+static int same(byte *a, byte *b, int n)
+{
+	while (n--) if (*(a++) != *(b++)) return 0;
+	return 1;
+}
+
+/* encode a ^ b into out as runs of (zeros, literals, literal bytes),
+   both counts little endian 16 bit. a literal run only ends where at
+   least 4 equal bytes follow, so every run header pays for itself and
+   the output is never much bigger than len. with usedirty, 4k blocks
+   that mem.c knows weren't written are skipped without comparing. */
+static int delta(byte *out, byte *a, byte *b, int len, int usedirty)
+{
+	byte *o = out;
+	int i = 0, z, l, n;
+
+	while (i < len)
+	{
+		for (z = 0; i < len && z < 65535; i++, z++)
+		{
+			while (usedirty && !(i & 4095) && i < len
+				&& z <= 65535 - 4096 && savestate_clean(i >> 12))
+				i += 4096, z += 4096;
+			if (i >= len || z >= 65535 || a[i] != b[i]) break;
+		}
+		for (l = 0; i + l < len && l < 65535; l++)
+		{
+			n = len - i - l < 4 ? len - i - l : 4;
+			if (same(a+i+l, b+i+l, n)) break;
+			o[4 + l] = a[i+l] ^ b[i+l];
+		}
+		o[0] = z; o[1] = z >> 8;
+		o[2] = l; o[3] = l >> 8;
+		o += 4 + l;
+		i += l;
+	}
+	return o - out;
+}
+
+static void undelta(byte *mem, byte *d, int len)
+{
+	byte *end = d + len;
+	int l;
+
+	while (d < end)
+	{
+		mem += d[0] | d[1] << 8;
+		l = d[2] | d[3] << 8;
+		d += 4;
+		while (l--) *(mem++) ^= *(d++);
+	}
+}
+
+#define NEWEST ((first + count - 1) % REWIND_MAX)
+
+static void push(byte *d, int len)
+{
+	int pos = 0, end, wrap = 0;
+
+	if (len > ringsize)
+	{
+		first = count = 0;
+		return;
+	}
+	if (count)
+	{
+		pos = ent[NEWEST].ofs + ent[NEWEST].len;
+		if (pos + len > ringsize) wrap = pos, pos = 0;
+	}
+	end = pos + len;
+	/* entries are laid out oldest to newest, so anything in our way is
+	   the oldest one; when we wrap, so is everything left at the top */
+	while (count && (count == REWIND_MAX
+		|| (wrap && ent[first].ofs >= wrap)
+		|| (ent[first].ofs < end && ent[first].ofs + ent[first].len > pos)))
+	{
+		first = (first + 1) % REWIND_MAX;
+		count--;
+	}
+	count++;
+	ent[NEWEST].ofs = pos;
+	ent[NEWEST].len = len;
+	memcpy(ring + pos, d, len);
+}
+
+static void snapshot()
+{
+	byte *p;
+
+	if (setup()) return;
+	savestate_to_buffer(tmp, size);
+	if (havecur)
+		push(dbuf, delta(dbuf, tmp, cur, size, dirty.gen == gen));
+	/* the new state is now the current one; the delta we just pushed
+	   turns it back into the one before */
+	p = cur, cur = tmp, tmp = p;
+	havecur = 1;
+	/* until the next snapshot, a page nobody writes to is the same
+	   in memory as in cur */
+	mem_checkpoint();
+	gen = dirty.gen;
+}
+
+/* load the newest snapshot and make the one before it the newest */
+void rewind_step()
+{
+	if (!havecur || setup()) return;
+	loadstate_delta(cur, size, dirty.gen == gen);
+	sound_dirty();
+	mem_updatemap();
+	if (count)
+	{
+		undelta(cur, ring + ent[NEWEST].ofs, ent[NEWEST].len);
+		count--;
+	}
+	/* memory is the old cur now, not this one */
+	gen = dirty.gen - 1;
+	frames = 0;
+}
+
+void rewind_hold(int on)
+{
+	held = on;
+}
+
+/* called once per frame by the main loop */
+void rewind_frame()
+{
+	if (rewindstep <= 0) return;
+	if (held)
+	{
+		rewind_step();
+		return;
+	}
+	if (++frames < rewindstep) return;
+	frames = 0;
+	snapshot();
+}
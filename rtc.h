@@ -25,6 +25,8 @@ void rtc_tick();
 #include <stdio.h>
 void rtc_save_internal(FILE *f);
 void rtc_load_internal(FILE *f);
+void rtc_get(int *v);
+void rtc_set(int *v, long then);
 
 #endif
 
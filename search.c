@@ -0,0 +1,206 @@
+/*
+ * search.c
+ *
+ * Ram search, for finding where a game keeps something (lives, a
+ * timer, a position) by how it changes. "search reset" takes a
+ * snapshot of wram, sram and hram with every byte a candidate; each
+ * filter after that keeps the candidates whose byte now stands in the
+ * given relation to its value in the last snapshot (or to a number),
+ * and takes a new snapshot. "search list" shows what's left.
+ *
+ * Candidates are a bitmap, a bit per byte, and a filter is a straight
+ * pass over each region comparing it with its snapshot eight bytes to
+ * a bitmap byte, written so the compiler can vectorize it; a whole
+ * pass over the 32k of cgb wram takes a few microseconds, so a script
+ * can filter every frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "hw.h"
+#include "mem.h"
+#include "search.h"
+
+/* the regions searched, in this order in the snapshot and bitmap;
+   each starts on a multiple of 8 bytes */
+static struct region
+{
+	byte *mem;
+	int len, off, base, banklen;
+} regions[3];
+static int nregions, total;
+
+static byte *snap, *bits;
+
+
+static void layout()
+{
+	struct region *r = regions;
+
+	nregions = total = 0;
+	r->mem = ram.ibank[0];
+	r->len = (hw.cgb ? 8 : 2) * 4096;
+	r->base = 0xC000;
+	r->banklen = 4096;
+	r++;
+	if (mbc.ramsize && ram.sbank)
+	{
+		r->mem = ram.sbank[0];
+		r->len = mbc.ramsize * 8192;
+		r->base = 0xA000;
+		r->banklen = 8192;
+		r++;
+	}
+	r->mem = ram.hi + 0x80;
+	r->len = 127;
+	r->base = 0xFF80;
+	r->banklen = 128;
+	r++;
+	nregions = r - regions;
+	for (r = regions; r < regions + nregions; r++)
+	{
+		r->off = total;
+		total += (r->len + 7) & ~7;
+	}
+}
+
+int search_reset()
+{
+	int i;
+
+	free(snap);
+	free(bits);
+	layout();
+	snap = malloc(total);
+	bits = malloc(total / 8);
+	if (!snap || !bits)
+	{
+		free(snap);
+		free(bits);
+		snap = bits = 0;
+		return -1;
+	}
+	memset(snap, 0, total);
+	memset(bits, 0, total / 8);
+	for (i = 0; i < nregions; i++)
+	{
+		memcpy(snap + regions[i].off, regions[i].mem, regions[i].len);
+		memset(bits + regions[i].off / 8, 0xff, regions[i].len / 8);
+		if (regions[i].len & 7)
+			bits[(regions[i].off + regions[i].len) / 8] =
+				(1 << (regions[i].len & 7)) - 1;
+	}
+	return 0;
+}
+
+/* one relation over len bytes: clears the bit of every byte of cur
+   that doesn't stand in it to its byte in prev, then refreshes prev.
+   len is a multiple of 8, which the callers pad to. */
+#define FILTER(test) \
+	for (i = 0; i < len; i += 8) \
+	{ \
+		if (!b[i/8]) continue; \
+		m = 0; \
+		for (j = 0; j < 8; j++) \
+			m |= (test) << j; \
+		b[i/8] &= m; \
+	}
+
+static void filter(byte *cur, byte *prev, byte *b, int len, int rel, int n)
+{
+	int i, j, m;
+
+#define C ((int)cur[i+j])
+#define P ((int)prev[i+j])
+	switch (rel)
+	{
+	case SEARCH_EQ: FILTER(C == n); break;
+	case SEARCH_NE: FILTER(C != n); break;
+	case SEARCH_LT: FILTER(C < n); break;
+	case SEARCH_GT: FILTER(C > n); break;
+	case SEARCH_SAME: FILTER(C == P); break;
+	case SEARCH_CHANGED: FILTER(C != P); break;
+	case SEARCH_INC: FILTER(n ? ((C - P) & 0xff) == n : C > P); break;
+	case SEARCH_DEC: FILTER(n ? ((P - C) & 0xff) == n : C < P); break;
+	}
+#undef C
+#undef P
+	memcpy(prev, cur, len);
+}
+
+/* a new rom or a switch to cgb moves or resizes the regions, and
+   then the search has to start again */
+static int stale()
+{
+	struct region was[3];
+	int n = nregions;
+
+	memcpy(was, regions, sizeof was);
+	layout();
+	if (n == nregions && !memcmp(was, regions, n * sizeof *regions))
+		return 0;
+	free(snap);
+	free(bits);
+	snap = bits = 0;
+	return 1;
+}
+
+int search_filter(int rel, int n)
+{
+	int i, len;
+	byte tail[8];
+	struct region *r;
+
+	if (!snap || stale()) return -1;
+	for (r = regions; r < regions + nregions; r++)
+	{
+		len = r->len & ~7;
+		filter(r->mem, snap + r->off, bits + r->off / 8, len, rel, n);
+		if (len == r->len) continue;
+		/* the odd end, through a padded copy */
+		memset(tail, 0, 8);
+		memcpy(tail, r->mem + len, r->len - len);
+		filter(tail, snap + r->off + len, bits + (r->off + len) / 8,
+			8, rel, n);
+		i = r->len - len;
+		bits[(r->off + len) / 8] &= (1 << i) - 1;
+	}
+	return 0;
+}
+
+int search_count()
+{
+	int i, j, n = 0;
+
+	if (!bits) return 0;
+	for (i = 0; i < total / 8; i++)
+		for (j = bits[i]; j; j &= j - 1)
+			n++;
+	return n;
+}
+
+/* prints up to max candidates as bank:addr = value */
+void search_list(int max)
+{
+	struct region *r;
+	int i, k, bank, a;
+
+	printf("%d candidates\n", search_count());
+	if (!bits) return;
+	for (r = regions; r < regions + nregions && max > 0; r++)
+		for (i = 0; i < r->len && max > 0; i++)
+		{
+			k = r->off + i;
+			if (!(bits[k / 8] & (1 << (k & 7)))) continue;
+			bank = i / r->banklen;
+			a = r->base + i % r->banklen;
+			/* wram banks past 0 all sit at D000 */
+			if (r->base == 0xC000 && bank) a = 0xD000 + (i & 0xfff);
+			printf("%02X:%04X = %02X\n", bank, a, r->mem[i]);
+			max--;
+		}
+	fflush(stdout);
+}
@@ -0,0 +1,24 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+/* relations for search_filter: the first four against the number
+   given, the rest against the last snapshot (INC and DEC by exactly
+   n if it isn't 0) */
+enum
+{
+	SEARCH_EQ,
+	SEARCH_NE,
+	SEARCH_LT,
+	SEARCH_GT,
+	SEARCH_SAME,
+	SEARCH_CHANGED,
+	SEARCH_INC,
+	SEARCH_DEC
+};
+
+int search_reset();
+int search_filter(int rel, int n);
+int search_count();
+void search_list(int max);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * alloccheck.c
+ *
+ * The frame loop, and taking and putting back snapshots, are meant to
+ * make no heap allocations once they're going: their buffers are
+ * made the first time and kept. Built with -DALLOCCHECK (add it to
+ * CFLAGS), this holds them to it. Every malloc, calloc and realloc
+ * the thread makes is counted, and the loop and the snapshot code
+ * mark the count before and check it after with ALLOC_MARK and
+ * ALLOC_CHECK; after the first few times through, the first
+ * allocation a place makes is reported on stderr, and --bench says
+ * how many the run made. The counting is by replacing glibc's malloc
+ * with one that counts and calls the real one, so it catches the
+ * library's own allocations too, fopen's for instance; elsewhere the
+ * count stays 0 and nothing is ever reported. Without ALLOCCHECK
+ * there's nothing here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloccheck.h"
+
+#ifdef ALLOCCHECK
+
+/* the times through a place before it's held to anything */
+#define WARMUP 3
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+
+/* per thread, so the sound and video threads don't count against the
+   frame loop */
+static __thread unsigned long count;
+
+void *malloc(size_t n)
+{
+	count++;
+	return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	count++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n)
+{
+	count++;
+	return __libc_realloc(p, n);
+}
+
+unsigned long alloc_count()
+{
+	return count;
+}
+
+#else
+
+unsigned long alloc_count()
+{
+	return 0;
+}
+
+#endif
+
+/* seen is the place's own; it goes negative once it's reported */
+void alloc_check(unsigned long mark, const char *what, int *seen)
+{
+	unsigned long n = alloc_count() - mark;
+
+	if (*seen < 0 || (*seen)++ < WARMUP || !n) return;
+	fprintf(stderr, "alloccheck: %lu heap allocation%s in %s\n",
+		n, n == 1 ? "" : "s", what);
+	*seen = -1;
+}
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * bench.c
+ *
+ * --bench: runs the loaded rom for a number of frames as fast as it
+ * will go, drawing into memory and mixing sound into a buffer that's
+ * thrown away, and reports the speed and where the time went. The
+ * split comes from sampling bench_in on a cpu time profiling timer,
+ * so the parts being measured only pay for two stores each; it means
+ * little for runs much shorter than a second. With --playback the
+ * movie drives the pad, so a run can be repeated exactly.
+ *
+ * Each frame is timed too, and the report gives the median, 90th and
+ * 99th percentile and worst of them, then a hash of the state the run
+ * ends in and of the last picture, so two runs of the same rom and
+ * movie can be checked to have done the same thing. With "benchpace"
+ * frames are run at real time instead, each waiting for its turn, and
+ * how late the slowest came in is reported as well; that's the
+ * latency a player would see, which an uncapped run hides.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "fb.h"
+#include "pcm.h"
+#include "cpu.h"
+#include "lcd.h"
+#include "sound.h"
+#include "sys.h"
+#include "emu.h"
+#include "bench.h"
+#include "movie.h"
+#include "save.h"
+#include "rc.h"
+#include "alloccheck.h"
+
+/* a frame's length in us, 70224 cycles at 4194304 Hz */
+#define FRAMEUS 16743
+
+volatile int bench_in;
+
+static int pace;
+
+rcvar_t bench_exports[] =
+{
+	RCV_BOOL("benchpace", &pace, "--bench at real time, for frame latency"),
+	RCV_END
+};
+
+static const char *names[BENCH_N] =
+{
+	"other", "cpu", "mem", "lcd", "linetovram", "sound"
+};
+
+static const char *what[BENCH_N] =
+{
+	"everything else",
+	"cpu_emulate: decode, execute, timers and lcdc",
+	"mem_read and mem_write, the slow paths",
+	"lcd_refreshline: building the scanlines",
+	"lcd_linetovram: scanlines into the framebuffer",
+	"sound_mix",
+};
+
+static unsigned long samples[BENCH_N];
+
+static void sample()
+{
+	samples[bench_in]++;
+}
+
+static int cmpint(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* the pth percentile of the n sorted times t */
+static int pct(int *t, int n, int p)
+{
+	return t[(n - 1) * p / 100];
+}
+
+static un32 fbhash(byte *p, int n)
+{
+	un32 h = 2166136261u;
+
+	while (n--) h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+void bench_run(int frames, int json)
+{
+	static byte *fbbuf, *pcmbuf;
+	static char *one = "1";
+	void *timer;
+	double secs, insns = 0, us = 0, due = 0;
+	unsigned long total = 0;
+	un32 last, fbh;
+	unsigned long long sh;
+	unsigned long am;
+	int i, profiled, *ft, late = 0, t;
+
+	/* no display or sound device is set up; the core gets memory
+	   to draw and mix into instead, big enough that pcm_submit is
+	   never called. it is allocated here rather than static, so
+	   instances that never bench don't carry it */
+	if (!fbbuf && !(fbbuf = malloc(160*144*4 + 65536)))
+		die("out of memory\n");
+	pcmbuf = fbbuf + 160*144*4;
+	if (!(ft = malloc(frames * sizeof *ft)))
+		die("out of memory\n");
+	memset(&fb, 0, sizeof fb);
+	fb.w = 160;
+	fb.h = 144;
+	fb.pelsize = 4;
+	fb.pitch = 160*4;
+	fb.ptr = fbbuf;
+	fb.cc[0].l = 16;
+	fb.cc[1].l = 8;
+	fb.enabled = 1;
+	/* lcd_begin took scale down to fit whatever fb was before, which
+	   with nothing set up was nothing at all */
+	rc_setvar("scale", 1, &one);
+	memset(&pcm, 0, sizeof pcm);
+	pcm.hz = 44100;
+	pcm.stereo = 1;
+	pcm.bits = 16;
+	pcm.buf = pcmbuf;
+	pcm.len = 65536;
+	lcd_begin();
+	pal_dirty();
+
+	memset(samples, 0, sizeof samples);
+	profiled = !sys_sampler(sample, 1000);
+	timer = sys_timer();
+	last = cpu.insns;
+	am = ALLOC_MARK();
+	for (i = 0; i < frames; i++)
+	{
+		bench_in = BENCH_CPU;
+		emu_frame();
+		bench_in = BENCH_LCD;
+		lcd_flush();
+		bench_in = BENCH_SOUND;
+		sound_mix();
+		pcm.pos = 0;
+		bench_in = BENCH_OTHER;
+		movie_frame();
+		insns += (un32)(cpu.insns - last);
+		last = cpu.insns;
+		us += ft[i] = sys_elapsed(timer);
+		if (!pace) continue;
+		/* how far past its time this frame was ready, then wait
+		   for the next one's; the wait isn't part of any frame */
+		due += FRAMEUS;
+		t = (int)(us - due);
+		if (t > late) late = t;
+		if (t < 0) sys_sleep(-t), us = due;
+		sys_elapsed(timer);
+	}
+	am = ALLOC_MARK() - am;
+	sys_sampler(0, 0);
+	secs = 0;
+	for (i = 0; i < frames; i++) secs += ft[i];
+	secs /= 1e6;
+	if (secs <= 0) secs = 1e-6;
+	for (i = 0; i < BENCH_N; i++) total += samples[i];
+	qsort(ft, frames, sizeof *ft, cmpint);
+	sh = (unsigned long long)state_hash();
+	fbh = fbhash(fbbuf, 160*144*4);
+
+	if (json)
+	{
+		printf("{\"frames\": %d, \"seconds\": %.6f, \"fps\": %.2f, "
+			"\"insns_per_sec\": %.0f, \"samples\": %lu, \"split\": {",
+			frames, secs, frames / secs, insns / secs, total);
+		for (i = 0; i < BENCH_N; i++)
+			printf("%s\"%s\": %.4f", i ? ", " : "", names[i],
+				total ? (double)samples[i] / total : 0.0);
+		printf("}, \"frame_us\": {\"p50\": %d, \"p90\": %d, "
+			"\"p99\": %d, \"max\": %d}", pct(ft, frames, 50),
+			pct(ft, frames, 90), pct(ft, frames, 99), ft[frames-1]);
+		if (pace) printf(", \"late_us\": %d", late);
+#ifdef ALLOCCHECK
+		printf(", \"allocs\": %lu", am);
+#endif
+		printf(", \"state\": \"%016llx\", \"fb\": \"%08x\"}\n", sh, fbh);
+		free(ft);
+		return;
+	}
+	printf("%d frames in %.3f s\n", frames, secs);
+	printf("  %.1f fps, %.1fx real time\n", frames / secs,
+		frames / secs / (4194304.0 / 70224));
+	printf("  %.2f million guest instructions per second\n",
+		insns / secs / 1e6);
+	printf("  frame times %d/%d/%d us (median, 90%%, 99%%), worst %d\n",
+		pct(ft, frames, 50), pct(ft, frames, 90), pct(ft, frames, 99),
+		ft[frames-1]);
+	if (pace) printf("  at real time, frames up to %d us late\n", late);
+#ifdef ALLOCCHECK
+	printf("  %lu heap allocations\n", am);
+#endif
+	printf("  state %016llx, picture %08x\n", sh, fbh);
+	free(ft);
+	if (!profiled || !total)
+	{
+		printf("  (no time split: no profiling timer here)\n");
+		return;
+	}
+	printf("time split over %lu samples:\n", total);
+	for (i = 0; i < BENCH_N; i++)
+		printf("  %5.1f%%  %-11s %s\n", 100.0 * samples[i] / total,
+			names[i], what[i]);
+}
@@ -0,0 +1,598 @@
+/*
+ * capture.c
+ *
+ * Screenshots and video capture, without the emulator ever waiting
+ * on a disk or an encoder. While capturing, the lcd hands over every
+ * line as it draws it, and it's kept as the 15 bit colors its palette
+ * indices stand for, with the frame's sound after it, in a slot of a
+ * ring. At the end of the frame the slot goes to a thread of its own
+ * that makes rgb of it and writes it out. When the ring is full (the
+ * encoder can't keep up) the frame is dropped and counted in
+ * "capturedrops" rather than waited for. Where there are no threads
+ * the writing is done at the end of the frame instead.
+ *
+ * "capturecmd" is a command to pipe the picture to, 160x144 rgb24 at
+ * 59.7275 frames a second, and "captureaudio" a file for the sound,
+ * as the sound device takes it; a fifo there lets one encoder have
+ * both. With ffmpeg, for instance:
+ *
+ *   mkfifo /tmp/gbsound
+ *   set captureaudio /tmp/gbsound
+ *   set capturecmd "ffmpeg -f rawvideo -pix_fmt rgb24 -s 160x144
+ *     -r 59.7275 -i - -f s16le -ar 44100 -ac 2 -i /tmp/gbsound out.mkv"
+ *
+ * (all on one line). Setting capturecmd to "" stops it. A frame that
+ * isn't drawn (frameskip, fast forward) goes out as the one before.
+ *
+ * screenshot writes the next frame as a png, to the file named or
+ * else into savedir, named for the cartridge's title and numbered.
+ *
+ * "wavdump" is a file to write all the sound to, as a wav, from when
+ * it's set until it's set to "" again; every frame's sound goes in,
+ * fast forward or not. The sound is gathered in big blocks, two of
+ * them, and the thread writes one while the other fills, so the
+ * emulator never calls stdio for it. Since it's for checking the
+ * sound against sound known to be good, none is ever dropped: should
+ * the thread still be writing the one when the other fills, which
+ * only running unpaced gets near, the emulator waits for it.
+ * headlessgnuboy only makes sound with "sound" set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "lcd.h"
+#include "mem.h"
+#include "pcm.h"
+#include "rc.h"
+#include "sys.h"
+#include "capture.h"
+
+static char *capturecmd, *captureaudio;
+static int capturedrops;
+static char *wavdump;
+
+rcvar_t capture_exports[] =
+{
+	RCV_STRING("capturecmd", &capturecmd, "command to pipe rgb24 frames to, \"\" = off"),
+	RCV_STRING("captureaudio", &captureaudio, "file for the sound of a capture"),
+	RCV_INT("capturedrops", &capturedrops, "frames capture had no room for"),
+	RCV_STRING("wavdump", &wavdump, "wav file to write the sound to, \"\" = off"),
+	RCV_END
+};
+
+#ifdef __ATOMIC_ACQUIRE
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD(p) (*(p))
+#define STORE(p, v) (*(p) = (v))
+#endif
+
+#define SLOTS 8
+/* the most sound a frame can have, in bytes */
+#define SOUND 16384
+
+static struct slot
+{
+	un16 pix[160*144];
+	byte sound[SOUND];
+	int len, drawn;
+	int hz, stereo, bits;
+	/* a stream to start, "" to stop the one going, and a png to
+	   write, numbered after the name if number is set; the thread
+	   frees them */
+	char *cmd, *audio, *shot;
+	int number;
+} *slots;
+
+/* head is the emulator's, tail the thread's */
+static unsigned head, tail;
+static struct slot *cur;
+static int threaded, quit, done;
+static char *stream, *shot;
+static int number;
+
+/* six seconds of 16 bit stereo at 44100 Hz */
+#define BLOCK (1 << 20)
+
+/* the wavdump blocks: one fills while the thread writes the other.
+   full is set while a block is the thread's, and it clears it once
+   it's written; only one is ever full. a block may open a new file
+   first, for sound in its format, and close the file after it */
+static struct block
+{
+	byte buf[BLOCK];
+	int len, full;
+	char *open;
+	int close;
+	int hz, stereo, bits;
+} *blocks;
+static int fill;
+/* the file the sound's going to, and the format it's in */
+static char *wav;
+static int wavhz, wavstereo, wavbits;
+
+int capturing;
+
+
+void capture_line(int l, byte *buf)
+{
+	un16 *d;
+	int i, c;
+
+	if (!cur || l >= 144) return;
+	d = cur->pix + l * 160;
+	for (i = 0; i < 160; i++)
+	{
+		c = buf[i] << 1;
+		d[i] = lcd.pal[c] | lcd.pal[c+1] << 8;
+	}
+	cur->drawn = 1;
+}
+
+static void wavput(byte *p, int n);
+
+/* the sound made so far, before pcm_submit takes it */
+void capture_pcm()
+{
+	int n;
+
+	if (!pcm.buf || !pcm.pos) return;
+	if (wav) wavput(pcm.buf, pcm.pos);
+	if (!cur) return;
+	n = pcm.pos;
+	if (n > SOUND - cur->len) n = SOUND - cur->len;
+	memcpy(cur->sound + cur->len, pcm.buf, n);
+	cur->len += n;
+	cur->hz = pcm.hz;
+	cur->stereo = pcm.stereo;
+	cur->bits = pcm.bits;
+}
+
+
+/*
+ * The thread's side.
+ */
+
+static FILE *video, *sound;
+static int told;
+static byte *rgb;
+
+static un32 crctab[256];
+
+static un32 crc(un32 c, byte *p, int n)
+{
+	un32 t;
+	int i, j;
+
+	if (!crctab[1])
+		for (i = 0; i < 256; i++)
+		{
+			for (t = i, j = 0; j < 8; j++)
+				t = t & 1 ? 0xedb88320 ^ (t >> 1) : t >> 1;
+			crctab[i] = t;
+		}
+	c = ~c;
+	while (n--) c = crctab[(c ^ *(p++)) & 255] ^ (c >> 8);
+	return ~c;
+}
+
+static void put32(byte *p, un32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int chunk(FILE *f, char *type, byte *p, int n)
+{
+	byte b[8];
+
+	put32(b, n);
+	memcpy(b + 4, type, 4);
+	put32(p + n, crc(crc(0, b + 4, 4), p, n));
+	return fwrite(b, 8, 1, f) == 1 && fwrite(p, n + 4, 1, f) == 1;
+}
+
+/* rgb as an 8 bit rgb png, its pixels in stored (uncompressed)
+   deflate blocks, which every reader takes */
+static int png(char *name)
+{
+	static const byte sig[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+	byte *buf, *p;
+	int raw = 144 * 481, i, j, n, ok;
+	un32 a = 1, b = 0;
+	FILE *f;
+
+	if (!(p = buf = malloc(raw + 64))) return -1;
+	if (!(f = fopen(name, "wb")))
+	{
+		free(buf);
+		return -1;
+	}
+	put32(p, 160);
+	put32(p + 4, 144);
+	p[8] = 8;
+	p[9] = 2;
+	p[10] = p[11] = p[12] = 0;
+	ok = fwrite(sig, 8, 1, f) == 1 && chunk(f, "IHDR", p, 13);
+
+	*(p++) = 0x78;
+	*(p++) = 0x01;
+	for (i = 0; i < raw; i += n)
+	{
+		n = raw - i < 65535 ? raw - i : 65535;
+		*(p++) = i + n == raw;
+		*(p++) = n;
+		*(p++) = n >> 8;
+		*(p++) = ~n;
+		*(p++) = ~n >> 8;
+		for (j = i; j < i + n; j++)
+		{
+			/* each row starts with its filter, 0 */
+			*p = j % 481 ? rgb[j / 481 * 480 + j % 481 - 1] : 0;
+			a = (a + *(p++)) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	put32(p, b << 16 | a);
+	p += 4;
+	ok = ok && chunk(f, "IDAT", buf, p - buf) && chunk(f, "IEND", buf, 0);
+	if (fclose(f)) ok = 0;
+	free(buf);
+	return ok ? 0 : -1;
+}
+
+/* numbered, the first of name-0000.png, name-0001.png... that
+   isn't there yet */
+static void shoot(char *name, int numbered)
+{
+	char *s = malloc(strlen(name) + 16);
+	FILE *f;
+	int i;
+
+	strcpy(s, name);
+	for (i = 0; numbered && i < 10000; i++)
+	{
+		sprintf(s, "%s-%04d.png", name, i);
+		if (!(f = fopen(s, "rb"))) break;
+		fclose(f);
+	}
+	if (png(s)) fprintf(stderr, "cannot write %s\n", s);
+	free(s);
+}
+
+static void endstream()
+{
+	if (video) pclose(video);
+	if (sound) fclose(sound);
+	video = sound = 0;
+}
+
+static void startstream(char *cmd, char *audio)
+{
+	endstream();
+	told = 0;
+	if (!*cmd) return;
+	if (!(video = popen(cmd, "w")))
+		fprintf(stderr, "cannot run %s\n", cmd);
+	if (audio && *audio && !(sound = fopen(audio, "wb")))
+		fprintf(stderr, "cannot write %s\n", audio);
+}
+
+static void put(struct slot *s)
+{
+	int i, c;
+
+	if (s->cmd) startstream(s->cmd, s->audio);
+	if (s->drawn)
+		for (i = 0; i < 160*144; i++)
+		{
+			c = s->pix[i];
+			rgb[3*i] = (c & 31) << 3 | (c & 31) >> 2;
+			rgb[3*i+1] = (c >> 5 & 31) << 3 | (c >> 5 & 31) >> 2;
+			rgb[3*i+2] = (c >> 10 & 31) << 3 | (c >> 10 & 31) >> 2;
+		}
+	if (video && fwrite(rgb, 160*144*3, 1, video) != 1)
+	{
+		fprintf(stderr, "capture: the encoder has gone away\n");
+		pclose(video);
+		video = 0;
+	}
+	if (sound && s->len)
+	{
+		if (!told++)
+			fprintf(stderr, "capture: sound is %s %d bit, %d Hz\n",
+				s->stereo ? "stereo" : "mono", s->bits, s->hz);
+		if (fwrite(s->sound, s->len, 1, sound) != 1)
+		{
+			fclose(sound);
+			sound = 0;
+		}
+	}
+	if (s->shot) shoot(s->shot, s->number);
+	free(s->cmd);
+	free(s->audio);
+	free(s->shot);
+}
+
+/* everything handed over so far; whether there was anything */
+static int drain()
+{
+	unsigned t = tail, was = t;
+
+	while (t != LOAD(&head))
+	{
+		put(&slots[t % SLOTS]);
+		STORE(&tail, ++t);
+	}
+	return t != was;
+}
+
+static FILE *wavf;
+static long wavlen;
+static struct { int hz, stereo, bits; } wavfmt;
+
+static void put16(byte *p, int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32le(byte *p, un32 v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+/* the sizes are put right when the file is closed, and until then
+   say as much as there can be, for readers of a pipe */
+static int wavheader(un32 len)
+{
+	byte h[44];
+	int align = (1 + wavfmt.stereo) * (wavfmt.bits / 8);
+
+	memcpy(h, "RIFF", 4);
+	put32le(h + 4, len + 36);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put32le(h + 16, 16);
+	put16(h + 20, 1);
+	put16(h + 22, 1 + wavfmt.stereo);
+	put32le(h + 24, wavfmt.hz);
+	put32le(h + 28, wavfmt.hz * align);
+	put16(h + 32, align);
+	put16(h + 34, wavfmt.bits);
+	memcpy(h + 36, "data", 4);
+	put32le(h + 40, len);
+	return fwrite(h, 44, 1, wavf) == 1;
+}
+
+static void wavclose()
+{
+	if (!wavf) return;
+	/* a pipe can't seek, and doesn't need to */
+	if (!fseek(wavf, 0, SEEK_SET)) wavheader(wavlen);
+	if (fclose(wavf)) fprintf(stderr, "cannot write the wav file\n");
+	wavf = 0;
+}
+
+static void wavopen(struct block *b)
+{
+	wavclose();
+	wavfmt.hz = b->hz;
+	wavfmt.stereo = b->stereo;
+	wavfmt.bits = b->bits;
+	wavlen = 0;
+	if (!(wavf = fopen(b->open, "wb")) || !wavheader(0xffffffff - 36))
+		fprintf(stderr, "cannot write %s\n", b->open);
+	free(b->open);
+	b->open = 0;
+}
+
+static int wavdrain()
+{
+	struct block *b;
+	int i, any = 0;
+
+	for (i = 0; blocks && i < 2; i++)
+	{
+		b = &blocks[i];
+		if (!LOAD(&b->full)) continue;
+		if (b->open) wavopen(b);
+		if (wavf && b->len && fwrite(b->buf, b->len, 1, wavf) != 1)
+		{
+			fprintf(stderr, "cannot write the wav file\n");
+			fclose(wavf);
+			wavf = 0;
+		}
+		wavlen += b->len;
+		if (b->close) wavclose();
+		STORE(&b->full, 0);
+		any = 1;
+	}
+	return any;
+}
+
+static void worker(void *p)
+{
+	int a, b;
+
+	while (!LOAD(&quit))
+	{
+		a = drain();
+		b = wavdrain();
+		if (!a && !b) sys_nap(4000);
+	}
+	drain();
+	wavdrain();
+	endstream();
+	STORE(&done, 1);
+}
+
+
+/*
+ * The emulator's side.
+ */
+
+static void start()
+{
+	if (!threaded) threaded = sys_thread(worker, 0) ? -1 : 1;
+}
+
+/* hand the block being filled to the thread, with close set if the
+   file ends after it, and go on to the other one; -1 if that one is
+   still the thread's */
+static int wavflush(int close)
+{
+	struct block *b = &blocks[fill];
+
+	if (LOAD(&blocks[!fill].full)) return -1;
+	b->close = close;
+	STORE(&b->full, 1);
+	fill = !fill;
+	b = &blocks[fill];
+	b->len = b->close = 0;
+	b->open = 0;
+	if (threaded < 0) wavdrain();
+	return 0;
+}
+
+static void wavput(byte *p, int n)
+{
+	struct block *b = &blocks[fill];
+	int k;
+
+	while (n)
+	{
+		if (b->len == BLOCK)
+		{
+			/* the thread has fallen behind */
+			while (wavflush(0)) sys_nap(1000);
+			b = &blocks[fill];
+		}
+		k = BLOCK - b->len < n ? BLOCK - b->len : n;
+		memcpy(b->buf + b->len, p, k);
+		b->len += k;
+		p += k;
+		n -= k;
+	}
+}
+
+/* once a frame, to start and stop wavdump. it starts with the first
+   sound, when the format is known, and the sound going to another
+   format (the device was reopened) starts the file over */
+static void wavframe()
+{
+	char *name = wavdump && *wavdump ? wavdump : 0;
+	struct block *b;
+
+	if (name && !pcm.hz) name = 0;
+	if (!name == !wav && (!name || (!strcmp(name, wav) && wavhz == pcm.hz
+		&& wavstereo == pcm.stereo && wavbits == pcm.bits)))
+		return;
+	if (!blocks)
+	{
+		if (!(blocks = calloc(2, sizeof *blocks))) return;
+		start();
+	}
+	/* try again next frame */
+	if (wav && wavflush(1)) return;
+	free(wav);
+	wav = 0;
+	if (!name) return;
+	wav = strdup(name);
+	b = &blocks[fill];
+	b->open = strdup(name);
+	b->hz = wavhz = pcm.hz;
+	b->stereo = wavstereo = pcm.stereo;
+	b->bits = wavbits = pcm.bits;
+}
+
+void capture_shot(char *name)
+{
+	char *dir = rc_getstr("savedir");
+
+	free(shot);
+	if ((number = !name))
+	{
+		if (!dir) dir = ".";
+		shot = malloc(strlen(dir) + sizeof rom.name + 8);
+		sprintf(shot, "%s/%s", dir, *rom.name ? rom.name : "gnuboy");
+		sys_sanitize(shot + strlen(dir) + 1);
+	}
+	else shot = strdup(name);
+}
+
+/* after the frame's sound is mixed, before it's submitted */
+void capture_frame()
+{
+	char *cmd = capturecmd && *capturecmd ? capturecmd : 0;
+	int change = !cmd != !stream || (cmd && strcmp(cmd, stream));
+
+	capture_pcm();
+	wavframe();
+	if (cur)
+	{
+		cur = 0;
+		STORE(&head, head + 1);
+		if (threaded < 0) drain();
+	}
+	capturing = 0;
+	if (!cmd && !change && !shot) return;
+	if (!slots)
+	{
+		if (!rgb && !(rgb = malloc(160*144*3))) return;
+		if (!(slots = calloc(SLOTS, sizeof *slots))) return;
+		start();
+	}
+	/* no room: try again next frame */
+	if (head - LOAD(&tail) >= SLOTS)
+	{
+		if (cmd) capturedrops++;
+		return;
+	}
+	cur = &slots[head % SLOTS];
+	cur->len = cur->drawn = 0;
+	cur->cmd = cur->audio = cur->shot = 0;
+	if (change)
+	{
+		free(stream);
+		stream = cmd ? strdup(cmd) : 0;
+		cur->cmd = strdup(cmd ? cmd : "");
+		if (captureaudio) cur->audio = strdup(captureaudio);
+	}
+	cur->shot = shot;
+	cur->number = number;
+	shot = 0;
+	capturing = 1;
+}
+
+/* finish what's been handed over, for the end of the program; the
+   frame being made now is left out */
+void capture_stop()
+{
+	int i;
+
+	cur = 0;
+	capturing = 0;
+	/* the sound there's been so far, and the end of the wav file */
+	for (i = 0; wav && wavflush(1) && i < 3000; i++)
+		sys_sleep(10000);
+	free(wav);
+	wav = 0;
+	if (!threaded) return;
+	if (threaded < 0)
+	{
+		drain();
+		endstream();
+		return;
+	}
+	STORE(&quit, 1);
+	/* the encoder may take a while to finish, but not forever */
+	for (i = 0; i < 3000 && !LOAD(&done); i++)
+		sys_sleep(10000);
+}
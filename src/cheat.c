@@ -0,0 +1,189 @@
+/*
+ * cheat.c
+ *
+ * Game Genie and GameShark codes. Neither costs a thing on a read.
+ *
+ * A Game Genie code patches the rom. Rather than checking every read
+ * against the codes, each 4k page of the rom that a code changes gets
+ * a patched copy, and mem.c maps the copy in its place whenever the
+ * page is mapped (see OVERLAY there), so reads go at full speed and
+ * banks no code touches are mapped exactly as before. A code with a
+ * compare byte only patches banks where the original byte matches,
+ * which is what lets it pick one bank out of many at the same
+ * address.
+ *
+ * A GameShark code sets a byte of ram, and keeps setting it: they are
+ * all written once a frame, between frames, as the real thing did at
+ * vblank.
+ *
+ *   ABC-DEF-GHI or ABC-DEF   Game Genie: AB is the new byte, FCDE the
+ *                            address with F inverted, and G and I
+ *                            the compare byte, rotated and scrambled
+ *   TTVVLLHH                 GameShark: VV is the byte, HHLL the
+ *                            address; TT of 8x or 9x picks wram bank x
+ *                            for D000-DFFF
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "defs.h"
+#include "regs.h"
+#include "mem.h"
+#include "fastmem.h"
+#include "cheat.h"
+#include "loader.h"
+
+#define MAXCHEATS 64
+
+struct cheat
+{
+	int addr, val, cmp, bank;
+};
+
+static struct cheat gg[MAXCHEATS], gs[MAXCHEATS];
+static int ngg, ngs;
+
+int cheat_rom;
+
+/* patched copies of the rom pages, by rom offset >> 12, or NULL */
+static byte **pages;
+static int npages;
+
+
+static int unhex(int c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	c = toupper(c);
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* the hex digits of code into d, dashes dropped; how many, or -1 */
+static int digits(char *code, int *d, int max)
+{
+	int n = 0;
+
+	for (; *code; code++)
+	{
+		if (*code == '-') continue;
+		if (n == max || (d[n] = unhex(*code)) < 0) return -1;
+		n++;
+	}
+	return n;
+}
+
+int cheat_add(char *code)
+{
+	int d[9], n, c;
+	struct cheat *p;
+
+	n = digits(code, d, 9);
+	if (n == 6 || n == 9)
+	{
+		if (ngg == MAXCHEATS) return -1;
+		p = gg + ngg;
+		p->val = d[0] << 4 | d[1];
+		p->addr = (d[5] ^ 15) << 12 | d[2] << 8 | d[3] << 4 | d[4];
+		p->cmp = -1;
+		if (n == 9)
+		{
+			c = d[6] << 4 | d[8];
+			p->cmp = ((c >> 2 | c << 6) & 0xff) ^ 0xba;
+		}
+		if (p->addr >= 0x8000) return -1;
+		ngg++;
+		cheat_rom = ngg;
+		cheat_unload();
+		if (rom.bank) mem_updatemap();
+		return 0;
+	}
+	if (n == 8)
+	{
+		if (ngs == MAXCHEATS) return -1;
+		p = gs + ngs;
+		c = d[0] << 4 | d[1];
+		p->bank = c & 0x80 ? c & 7 : -1;
+		p->val = d[2] << 4 | d[3];
+		p->addr = d[6] << 12 | d[7] << 8 | d[4] << 4 | d[5];
+		if (p->addr < 0x8000) return -1;
+		ngs++;
+		return 0;
+	}
+	return -1;
+}
+
+void cheat_clear()
+{
+	ngg = ngs = cheat_rom = 0;
+	cheat_unload();
+	if (rom.bank) mem_updatemap();
+}
+
+/* drops the patched pages, for when the rom goes */
+void cheat_unload()
+{
+	int i;
+
+	for (i = 0; i < npages; i++)
+		free(pages[i]);
+	free(pages);
+	pages = 0;
+	npages = 0;
+}
+
+static void patch(int k, struct cheat *p)
+{
+	byte *orig = rom.bank[0] + (k << 12);
+
+	if (rom_lazy) rom_unpack(k >> 2);
+	if (p->cmp >= 0 && orig[p->addr & 0xfff] != p->cmp) return;
+	if (!pages[k] && (pages[k] = malloc(4096)))
+		memcpy(pages[k], orig, 4096);
+	if (pages[k]) pages[k][p->addr & 0xfff] = p->val;
+}
+
+static int build()
+{
+	int i, k;
+
+	npages = mbc.romsize * 4;
+	if (!(pages = calloc(npages, sizeof *pages))) return -1;
+	for (i = 0; i < ngg; i++)
+	{
+		if (gg[i].addr < 0x4000)
+			patch(gg[i].addr >> 12, gg + i);
+		else for (k = 4 + ((gg[i].addr >> 12) & 3); k < npages; k += 4)
+			patch(k, gg + i);
+	}
+	return 0;
+}
+
+/* the patched copy of rom page k (offset >> 12), or NULL */
+byte *cheat_page(int k)
+{
+	if (!pages && (!rom.bank || build())) return 0;
+	return k < npages ? pages[k] : 0;
+}
+
+/* called once per frame by the main loop */
+void cheat_frame()
+{
+	int i, n;
+	struct cheat *p;
+
+	for (i = 0, p = gs; i < ngs; i++, p++)
+	{
+		n = p->bank ? p->bank : 1;
+		if (p->bank < 0 || (p->addr & 0xf000) != 0xd000
+			|| n == ((R_SVBK & 7) ? (R_SVBK & 7) : 1))
+			writeb(p->addr, p->val);
+		else if (n < WRAMBANKS)
+		{
+			ram.ibank[n][p->addr & 0xfff] = p->val;
+			dirty.iram |= 1 << n;
+			hashdirty.iram |= 1 << n;
+		}
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "defs.h"
+
+struct context;
+
+struct context *context_new();
+void context_free(struct context *c);
+void context_save(struct context *c);
+void context_load(struct context *c);
+int context_serial(struct context *c, byte b);
+void context_copy(struct context *to, struct context *from);
+int context_same(struct context *a, struct context *b);
+byte *context_pack(struct context *c, int *len);
+struct context *context_unpack(byte *in, int len);
+
+#endif
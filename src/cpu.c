@@ -2,6 +2,8 @@
 
 
 
+#include <string.h>
+
 #include "defs.h"
 #include "regs.h"
 #include "hw.h"
@@ -12,13 +14,15 @@
 #include "cpucore.h"
 #include "lcdc.h"
 #include "debug.h"
+#include "loader.h"
+#include "rc.h"
 
 #ifdef USE_ASM
 #include "asm.h"
 #endif
 
 
-struct cpu cpu;
+MACHINE struct cpu cpu;
 
 
 
@@ -36,7 +40,19 @@ struct cpu cpu;
 ? mbc.rmap[PC>>12][PC++] \
 : mem_read(PC++) )
 
-#define FETCH (readb(PC++))
+/* fetching goes through the read map like any other read. taking the
+   check out altogether (fetching straight from mbc.rmap) makes no
+   measurable difference, since the map entry for the code page is
+   always in cache and the branch always goes the same way, so there's
+   nothing for a cache of predecoded instructions to win here: looking
+   an instruction up in one costs more than decoding it, which is one
+   table lookup on the opcode. nor is there for keeping a pointer to
+   the code page in a local: fetching through it could be no quicker
+   than the unchecked fetch, and it would have to be refreshed after
+   every jump, every page crossing and every write that might switch a
+   bank (a rom bank switch from code running in that very bank being
+   the usual case). */
+#define FETCH (MS_ACCESS(MS_FETCH, PC), readb(PC++))
 
 
 #define INC(r) { ((r)++); \
@@ -164,52 +180,134 @@ F = ZFLAG((r)); }
 #define RES(n,r) { (r) &= ~(1 << (n)); }
 #define SET(n,r) { (r) |= (1 << (n)); }
 
-#define CB_REG_CASES(r, n) \
-case 0x00|(n): RLC(r); break; \
-case 0x08|(n): RRC(r); break; \
-case 0x10|(n): RL(r); break; \
-case 0x18|(n): RR(r); break; \
-case 0x20|(n): SLA(r); break; \
-case 0x28|(n): SRA(r); break; \
-case 0x30|(n): SWAP(r); break; \
-case 0x38|(n): SRL(r); break; \
-case 0x40|(n): BIT(0, r); break; \
-case 0x48|(n): BIT(1, r); break; \
-case 0x50|(n): BIT(2, r); break; \
-case 0x58|(n): BIT(3, r); break; \
-case 0x60|(n): BIT(4, r); break; \
-case 0x68|(n): BIT(5, r); break; \
-case 0x70|(n): BIT(6, r); break; \
-case 0x78|(n): BIT(7, r); break; \
-case 0x80|(n): RES(0, r); break; \
-case 0x88|(n): RES(1, r); break; \
-case 0x90|(n): RES(2, r); break; \
-case 0x98|(n): RES(3, r); break; \
-case 0xA0|(n): RES(4, r); break; \
-case 0xA8|(n): RES(5, r); break; \
-case 0xB0|(n): RES(6, r); break; \
-case 0xB8|(n): RES(7, r); break; \
-case 0xC0|(n): SET(0, r); break; \
-case 0xC8|(n): SET(1, r); break; \
-case 0xD0|(n): SET(2, r); break; \
-case 0xD8|(n): SET(3, r); break; \
-case 0xE0|(n): SET(4, r); break; \
-case 0xE8|(n): SET(5, r); break; \
-case 0xF0|(n): SET(6, r); break; \
-case 0xF8|(n): SET(7, r); break;
-
-
-#define ALU_CASES(base, imm, op, label) \
-case (imm): b = FETCH; goto label; \
-case (base): b = B; goto label; \
-case (base)+1: b = C; goto label; \
-case (base)+2: b = D; goto label; \
-case (base)+3: b = E; goto label; \
-case (base)+4: b = H; goto label; \
-case (base)+5: b = L; goto label; \
-case (base)+6: b = readb(HL); goto label; \
-case (base)+7: b = A; \
-label: op(b); break;
+/*
+ * Opcode dispatch.  With GCC-compatible compilers each handler ends
+ * by fetching the next opcode and jumping straight through a label
+ * table (threaded code), so the host branch predictor sees one
+ * indirect jump per handler rather than a single shared one at the
+ * top of a switch.  The fast path only checks the event deadline and
+ * the timeslice; anything else that needs the top of the loop (halt,
+ * an interrupt becoming pending, EI, tracing) sets cpu.evnext to 0 so
+ * that it goes the slow way for the next instruction.
+ * Define NO_COMPUTED_GOTO to get the plain portable switch.
+ */
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+#define CYCLES { \
+clen = (clen << 1) >> SPEED; \
+i -= clen; \
+ninsn++; \
+cpu.evcnt += clen; }
+
+#ifdef COMPUTED_GOTO
+#define OP(n) op_##n:
+#define CBOP(n) cb_##n:
+#define DISPATCH(t, n) goto *(t)[(n)];
+#define NEXT do { CYCLES; \
+if (cpu.evcnt < cpu.evnext && i > 0) { \
+op = FETCH; clen = cycles_table[op]; goto *optable[op]; } \
+goto slow; } while (0)
+#define NEXT2(m, n) do { CYCLES; \
+if (cpu.evcnt < cpu.evnext && i > 0) { \
+op = FETCH; clen = cycles_table[op]; \
+if (op == m) goto op_##m; \
+if (op == n) goto op_##n; \
+goto *optable[op]; } \
+goto slow; } while (0)
+#else
+#define OP(n) case n:
+#define CBOP(n) case n:
+#define DISPATCH(t, n) switch (n)
+#define NEXT break
+#define NEXT2(m, n) break
+#endif
+
+/*
+ * NEXT2 ends an instruction that is nearly always followed by one of
+ * two others, as in DEC B; JR NZ or LDH A,(n); CP n: when one of
+ * them comes next it is jumped to directly, a branch the host cpu
+ * predicts per pair, rather than through the table. It's what a fused
+ * handler for the pair would save, without the second copy of each
+ * instruction; both still count their own cycles and the event
+ * deadline is checked in between, exactly as with NEXT. The pairs
+ * were picked with "opcount".
+ */
+#define NEXT1(n) NEXT2(n, n)
+
+#define CB_REG_CASES(r, lo, hi, ld, st) \
+CBOP(0x0##lo) ld; RLC(r); st; \
+CBOP(0x0##hi) ld; RRC(r); st; \
+CBOP(0x1##lo) ld; RL(r); st; \
+CBOP(0x1##hi) ld; RR(r); st; \
+CBOP(0x2##lo) ld; SLA(r); st; \
+CBOP(0x2##hi) ld; SRA(r); st; \
+CBOP(0x3##lo) ld; SWAP(r); st; \
+CBOP(0x3##hi) ld; SRL(r); st; \
+CBOP(0x4##lo) ld; BIT(0, r); NEXT; \
+CBOP(0x4##hi) ld; BIT(1, r); NEXT; \
+CBOP(0x5##lo) ld; BIT(2, r); NEXT; \
+CBOP(0x5##hi) ld; BIT(3, r); NEXT; \
+CBOP(0x6##lo) ld; BIT(4, r); NEXT; \
+CBOP(0x6##hi) ld; BIT(5, r); NEXT; \
+CBOP(0x7##lo) ld; BIT(6, r); NEXT; \
+CBOP(0x7##hi) ld; BIT(7, r); NEXT; \
+CBOP(0x8##lo) ld; RES(0, r); st; \
+CBOP(0x8##hi) ld; RES(1, r); st; \
+CBOP(0x9##lo) ld; RES(2, r); st; \
+CBOP(0x9##hi) ld; RES(3, r); st; \
+CBOP(0xA##lo) ld; RES(4, r); st; \
+CBOP(0xA##hi) ld; RES(5, r); st; \
+CBOP(0xB##lo) ld; RES(6, r); st; \
+CBOP(0xB##hi) ld; RES(7, r); st; \
+CBOP(0xC##lo) ld; SET(0, r); st; \
+CBOP(0xC##hi) ld; SET(1, r); st; \
+CBOP(0xD##lo) ld; SET(2, r); st; \
+CBOP(0xD##hi) ld; SET(3, r); st; \
+CBOP(0xE##lo) ld; SET(4, r); st; \
+CBOP(0xE##hi) ld; SET(5, r); st; \
+CBOP(0xF##lo) ld; SET(6, r); st; \
+CBOP(0xF##hi) ld; SET(7, r); st;
+
+
+#define ALU_CASES_LO(row, imm, op, label, next) \
+OP(imm) b = FETCH; goto label; \
+OP(row##0) b = B; goto label; \
+OP(row##1) b = C; goto label; \
+OP(row##2) b = D; goto label; \
+OP(row##3) b = E; goto label; \
+OP(row##4) b = H; goto label; \
+OP(row##5) b = L; goto label; \
+OP(row##6) b = readb(HL); goto label; \
+OP(row##7) b = A; \
+label: op(b); next;
+
+#define ALU_CASES_HI(row, imm, op, label, next) \
+OP(imm) b = FETCH; goto label; \
+OP(row##8) b = B; goto label; \
+OP(row##9) b = C; goto label; \
+OP(row##A) b = D; goto label; \
+OP(row##B) b = E; goto label; \
+OP(row##C) b = H; goto label; \
+OP(row##D) b = L; goto label; \
+OP(row##E) b = readb(HL); goto label; \
+OP(row##F) b = A; \
+label: op(b); next;
+
+#ifdef COMPUTED_GOTO
+#define OPROW(p, h) \
+&&p##0x##h##0, &&p##0x##h##1, &&p##0x##h##2, &&p##0x##h##3, \
+&&p##0x##h##4, &&p##0x##h##5, &&p##0x##h##6, &&p##0x##h##7, \
+&&p##0x##h##8, &&p##0x##h##9, &&p##0x##h##A, &&p##0x##h##B, \
+&&p##0x##h##C, &&p##0x##h##D, &&p##0x##h##E, &&p##0x##h##F
+#define OPTABLE(p) { \
+OPROW(p, 0), OPROW(p, 1), OPROW(p, 2), OPROW(p, 3), \
+OPROW(p, 4), OPROW(p, 5), OPROW(p, 6), OPROW(p, 7), \
+OPROW(p, 8), OPROW(p, 9), OPROW(p, A), OPROW(p, B), \
+OPROW(p, C), OPROW(p, D), OPROW(p, E), OPROW(p, F) }
+#endif
 
 
 
@@ -250,6 +348,11 @@ void cpu_reset()
 	cpu.div = 0;
 	cpu.tim = 0;
 	cpu.lcdc = 40;
+	cpu.serial = 0;
+	cpu.evcnt = 0;
+	cpu.evnext = 0;
+	cpu.stall = 0;
+	cpu.cut = 0;
 
 	IME = 0;
 	IMA = 0;
@@ -266,6 +369,15 @@ void cpu_reset()
 }
 
 
+/*
+ * DIV and TIMA are brought up to date only when cpu_sync is, with
+ * however many cycles have gone by since, not as each instruction
+ * runs: the cpu loop just counts cycles, every read or write of them
+ * syncs first, and the next TIMA overflow is one of the deadlines
+ * cpu_sync works out (timer_deadline), so the interrupt comes on the
+ * cycle it should.
+ */
+
 void div_advance(int cnt)
 {
 	cpu.div += (cnt<<1);
@@ -293,9 +405,10 @@ void timer_advance(int cnt)
 		{
 			hw_interrupt(IF_TIMER, IF_TIMER);
 			hw_interrupt(0, IF_TIMER);
+			/* however many times round it went, in one go; a halt
+			   with the timer's interrupt off can span thousands */
+			tima = R_TMA + (tima - 256) % (256 - R_TMA);
 		}
-		while (tima >= 256)
-			tima = tima - 256 + R_TMA;
 		R_TIMA = tima;
 	}
 }
@@ -311,19 +424,88 @@ void sound_advance(int cnt)
 	cpu.snd += cnt;
 }
 
+/* a transfer on the internal serial clock; see hw_serial_start */
+void serial_advance(int cnt)
+{
+	if (!cpu.serial) return;
+	if ((cpu.serial -= cnt) > 0) return;
+	cpu.serial = 0;
+	hw_serial_done();
+}
+
 void cpu_timers(int cnt)
 {
 	div_advance(cnt << cpu.speed);
 	timer_advance(cnt << cpu.speed);
+	serial_advance(cnt);
 	lcdc_advance(cnt);
 	sound_advance(cnt);
 }
 
-int cpu_idle(int max)
+
+/*
+ * Rather than calling cpu_timers after every instruction, cpu_emulate
+ * just adds up the cycles it has run in cpu.evcnt and calls cpu_sync
+ * once the total reaches cpu.evnext. cpu_sync hands the pending cycles
+ * to the timers, lcdc and sound, then works out how many more can be
+ * run before the next lcdc transition that matters (lcdc_horizon),
+ * TIMA overflow or the end of a serial transfer, the only events that
+ * can change anything the cpu sees without the cpu asking for it.
+ * Anything that reads or writes the io registers must call cpu_sync
+ * first so it sees (and changes) up-to-date state, and must set
+ * cpu.evnext to 0 if it may have changed the timing of any of them.
+ * Interrupts are only checked for when cpu_sync is due, so cpu_sync
+ * also sets cpu.evnext to 0 while an enabled interrupt is pending, and
+ * so does anything that changes IME or halts the cpu.
+ */
+
+/* cycles until TIMA next overflows, or -1 if the timer is stopped */
+static int timer_deadline()
 {
 	int cnt, unit;
 
+	if (!(R_TAC & 0x04)) return -1;
+	unit = (((-R_TAC) & 3) << 1) + cpu.speed;
+	cnt = ((256 - R_TIMA) << 9) - cpu.tim;
+	return (cnt + (1<<unit) - 1) >> unit;
+}
+
+void cpu_sync()
+{
+	int cnt;
+
+	if ((cnt = cpu.evcnt))
+	{
+		cpu.evcnt = 0;
+		cpu_timers(cnt);
+	}
+
+	cpu.evnext = lcdc_horizon();
+	if ((cnt = timer_deadline()) >= 0 && cnt < cpu.evnext)
+		cpu.evnext = cnt;
+	if (cpu.serial && cpu.serial < cpu.evnext)
+		cpu.evnext = cpu.serial;
+	if ((IME && (IF & IE)) || cpu.stall)
+		cpu.evnext = 0;
+}
+
+/*
+ * One step of cpu_idle: run the halted cpu up to the next point where
+ * an enabled interrupt could be raised (or max cycles, whichever comes
+ * first), and return the number of cycles run, or 0 if the cpu isn't
+ * halted waiting for an interrupt. Vblank and timer interrupts can be
+ * predicted exactly; stat interrupts depend on too much, so when they
+ * are enabled we stop at every lcdc transition, and serial ones come
+ * when the transfer in progress ends. Joypad interrupts can't happen
+ * while the cpu is halted (the pad is only read between frames), so
+ * they never shorten the step.
+ */
+static int halt_step(int max)
+{
+	int cnt;
+
 	if (!(cpu.halt && IME)) return 0;
+	cpu_sync();
 	if (R_IF & R_IE)
 	{
 		cpu.halt = 0;
@@ -331,581 +513,494 @@ int cpu_idle(int max)
 	}
 
 	/* Make sure we don't miss lcdc status events! */
-	if ((R_IE & (IF_VBLANK | IF_STAT)) && (max > cpu.lcdc))
-		max = cpu.lcdc;
-	
-	/* If timer interrupt cannot happen, this is very simple! */
-	if (!((R_IE & IF_TIMER) && (R_TAC & 0x04)))
+	if (R_IE & IF_STAT)
 	{
-		cpu_timers(max);
-		return max;
+		if (max > cpu.lcdc) max = cpu.lcdc;
+	}
+	else if (R_IE & IF_VBLANK)
+	{
+		if (max > (cnt = lcdc_vblank())) max = cnt;
 	}
 
-	/* Figure out when the next timer interrupt will happen */
-	unit = ((-R_TAC) & 3) << 1;
-	cnt = (511 - cpu.tim + (1<<unit)) >> unit;
-	cnt += (255 - R_TIMA) << (9 - unit);
+	if ((R_IE & IF_TIMER) && (cnt = timer_deadline()) >= 0 && max > cnt)
+		max = cnt;
+	if ((R_IE & IF_SERIAL) && cpu.serial && max > cpu.serial)
+		max = cpu.serial;
 
-	if (max < cnt)
-		cnt = max;
-	
-	cpu_timers(cnt);
+	cpu.evcnt = max;
+	cpu_sync();
+	return max;
+}
+
+/*
+ * cpu_idle runs a halted cpu all the way to the next interrupt (or the
+ * end of the timeslice) in one go, bringing the timers, lcdc and sound
+ * up to date in bulk rather than returning to cpu_emulate at every
+ * event on the way.
+ */
+int cpu_idle(int max)
+{
+	int cnt, n;
+
+	for (cnt = 0; cnt < max; cnt += n)
+		if (!(n = halt_step(max - cnt))) break;
 	return cnt;
 }
 
 #ifndef ASM_CPU_EMULATE
 
-extern int debug_trace;
 
-int cpu_emulate(int cycles)
+/*
+ * Idle loop detection. Lots of games wait for a particular line or
+ * lcdc mode by spinning on something like LDH A,(FF44); CP n; JR NZ
+ * instead of using HALT. STAT, LY and IF only ever change on an lcdc
+ * or timer event, and such a loop has no side effects beyond A and F
+ * (which come out the same every time around), so every pass before
+ * the next event does exactly the same thing. idle_skip lets
+ * cpu_emulate account for all of those passes at once, stopping one
+ * short of the event (or the end of the timeslice) so that the last
+ * passes are run for real and everything stays cycle exact.
+ */
+
+#define IDLE_MAX 8 /* longest loop body we look at, in bytes */
+
+/* the next event, lcdc transitions included; cpu.evnext may be past
+   some of them (see lcdc_horizon), and they change what loops see */
+#define EVDUE (cpu.lcdc < cpu.evnext ? cpu.lcdc : cpu.evnext)
+
+/* "idleskip" and "loopskip" turn these off, for romdb to do for a
+   game they don't suit */
+static int idleskip = 1, loopskip = 1;
+
+/* how closely to follow the hardware, see cpu_emulate */
+static int accuracy = ACC_FAST;
+
+rcvar_t cpu_exports[] =
 {
-	int i;
-	byte op, cbop;
-	int clen;
-	static union reg acc;
-	static byte b;
-	static word w;
-
-	i = cycles;
-next:
-	if ((clen = cpu_idle(i)))
-	{
-		i -= clen;
-		if (i > 0) goto next;
-		return cycles-i;
-	}
+	RCV_INT("accuracy", &accuracy, "0 = fast, 1 = balanced, 2 = accurate"),
+	RCV_BOOL("idleskip", &idleskip, "speedhack: skip ahead in loops waiting on LY, STAT or IF"),
+	RCV_BOOL("loopskip", &loopskip, "speedhack: run copy and fill loops as one copy"),
+	RCV_END
+};
+
+/* the tier, for hw.c to ask and libgnuboy to keep per instance; set
+   if a >= 0, and returns what it was */
+int cpu_accuracy(int a)
+{
+	int was = accuracy;
+
+	if (a >= 0) accuracy = a;
+	return was;
+}
+
+static int idle_reg(byte r)
+{
+	return r == RI_STAT || r == RI_LY || r == RI_IF;
+}
 
-	if (IME && (IF & IE))
+/* the byte k on from the JR, from p if it's given (the JR in memory,
+   with the whole loop in front of it) and through readb if not */
+#define IDLE_AT(k) (p ? p[k] : readb(pc + (k)))
+
+/* pc is the address of a taken backward JR; returns the cost of one
+ * pass around the loop it closes, or 0 if it isn't an idle loop */
+static int idle_loop(word pc, const byte *p)
+{
+	int a, n, cost;
+	byte op;
+
+	a = 2 + (n8)IDLE_AT(1);
+	n = -a;
+	cost = cycles_table[0x18];
+	if (!n) return cost; /* JR to itself, waiting for an interrupt */
+
+	op = IDLE_AT(a);
+	if (op == 0xF0 && idle_reg(IDLE_AT(a + 1)))
+		a += 2, n -= 2;
+	else if (op == 0xFA && IDLE_AT(a + 2) == 0xFF && idle_reg(IDLE_AT(a + 1)))
+		a += 3, n -= 3;
+	else return 0;
+	cost += cycles_table[op];
+
+	while (n > 0)
 	{
-		PRE_INT;
-		switch ((byte)(IF & IE))
-		{
-		case 0x01: case 0x03: case 0x05: case 0x07:
-		case 0x09: case 0x0B: case 0x0D: case 0x0F:
-		case 0x11: case 0x13: case 0x15: case 0x17:
-		case 0x19: case 0x1B: case 0x1D: case 0x1F:
-			THROW_INT(0); break;
-		case 0x02: case 0x06: case 0x0A: case 0x0E:
-		case 0x12: case 0x16: case 0x1A: case 0x1E:
-			THROW_INT(1); break;
-		case 0x04: case 0x0C: case 0x14: case 0x1C:
-			THROW_INT(2); break;
-		case 0x08: case 0x18:
-			THROW_INT(3); break;
-		case 0x10:
-			THROW_INT(4); break;
-		}
+		op = IDLE_AT(a);
+		if (op == 0xFE || op == 0xE6) /* CP imm, AND imm */
+			cost += cycles_table[op];
+		else if (op == 0xCB && (IDLE_AT(a + 1) & 0xC7) == 0x47) /* BIT n,A */
+			cost += cb_cycles_table[IDLE_AT(a + 1)];
+		else return 0;
+		a += 2, n -= 2;
 	}
-	IME = IMA;
-	
-	if (debug_trace) debug_disassemble(PC, 1);
-	op = FETCH;
-	clen = cycles_table[op];
+	return n ? 0 : cost;
+}
 
-	switch(op)
-	{
-	case 0x00: /* NOP */
-	case 0x40: /* LD B,B */
-	case 0x49: /* LD C,C */
-	case 0x52: /* LD D,D */
-	case 0x5B: /* LD E,E */
-	case 0x64: /* LD H,H */
-	case 0x6D: /* LD L,L */
-	case 0x7F: /* LD A,A */
-		break;
-			
-	case 0x41: /* LD B,C */
-		B = C; break;
-	case 0x42: /* LD B,D */
-		B = D; break;
-	case 0x43: /* LD B,E */
-		B = E; break;
-	case 0x44: /* LD B,H */
-		B = H; break;
-	case 0x45: /* LD B,L */
-		B = L; break;
-	case 0x46: /* LD B,(HL) */
-		B = readb(xHL); break;
-	case 0x47: /* LD B,A */
-		B = A; break;
-
-	case 0x48: /* LD C,B */
-		C = B; break;
-	case 0x4A: /* LD C,D */
-		C = D; break;
-	case 0x4B: /* LD C,E */
-		C = E; break;
-	case 0x4C: /* LD C,H */
-		C = H; break;
-	case 0x4D: /* LD C,L */
-		C = L; break;
-	case 0x4E: /* LD C,(HL) */
-		C = readb(xHL); break;
-	case 0x4F: /* LD C,A */
-		C = A; break;
-
-	case 0x50: /* LD D,B */
-		D = B; break;
-	case 0x51: /* LD D,C */
-		D = C; break;
-	case 0x53: /* LD D,E */
-		D = E; break;
-	case 0x54: /* LD D,H */
-		D = H; break;
-	case 0x55: /* LD D,L */
-		D = L; break;
-	case 0x56: /* LD D,(HL) */
-		D = readb(xHL); break;
-	case 0x57: /* LD D,A */
-		D = A; break;
-
-	case 0x58: /* LD E,B */
-		E = B; break;
-	case 0x59: /* LD E,C */
-		E = C; break;
-	case 0x5A: /* LD E,D */
-		E = D; break;
-	case 0x5C: /* LD E,H */
-		E = H; break;
-	case 0x5D: /* LD E,L */
-		E = L; break;
-	case 0x5E: /* LD E,(HL) */
-		E = readb(xHL); break;
-	case 0x5F: /* LD E,A */
-		E = A; break;
-
-	case 0x60: /* LD H,B */
-		H = B; break;
-	case 0x61: /* LD H,C */
-		H = C; break;
-	case 0x62: /* LD H,D */
-		H = D; break;
-	case 0x63: /* LD H,E */
-		H = E; break;
-	case 0x65: /* LD H,L */
-		H = L; break;
-	case 0x66: /* LD H,(HL) */
-		H = readb(xHL); break;
-	case 0x67: /* LD H,A */
-		H = A; break;
-			
-	case 0x68: /* LD L,B */
-		L = B; break;
-	case 0x69: /* LD L,C */
-		L = C; break;
-	case 0x6A: /* LD L,D */
-		L = D; break;
-	case 0x6B: /* LD L,E */
-		L = E; break;
-	case 0x6C: /* LD L,H */
-		L = H; break;
-	case 0x6E: /* LD L,(HL) */
-		L = readb(xHL); break;
-	case 0x6F: /* LD L,A */
-		L = A; break;
-			
-	case 0x70: /* LD (HL),B */
-		b = B; goto __LD_HL;
-	case 0x71: /* LD (HL),C */
-		b = C; goto __LD_HL;
-	case 0x72: /* LD (HL),D */
-		b = D; goto __LD_HL;
-	case 0x73: /* LD (HL),E */
-		b = E; goto __LD_HL;
-	case 0x74: /* LD (HL),H */
-		b = H; goto __LD_HL;
-	case 0x75: /* LD (HL),L */
-		b = L; goto __LD_HL;
-	case 0x77: /* LD (HL),A */
-		b = A;
-	__LD_HL:
-		writeb(xHL,b);
-		break;
-			
-	case 0x78: /* LD A,B */
-		A = B; break;
-	case 0x79: /* LD A,C */
-		A = C; break;
-	case 0x7A: /* LD A,D */
-		A = D; break;
-	case 0x7B: /* LD A,E */
-		A = E; break;
-	case 0x7C: /* LD A,H */
-		A = H; break;
-	case 0x7D: /* LD A,L */
-		A = L; break;
-	case 0x7E: /* LD A,(HL) */
-		A = readb(xHL); break;
-
-	case 0x01: /* LD BC,imm */
-		BC = readw(xPC); PC += 2; break;
-	case 0x11: /* LD DE,imm */
-		DE = readw(xPC); PC += 2; break;
-	case 0x21: /* LD HL,imm */
-		HL = readw(xPC); PC += 2; break;
-	case 0x31: /* LD SP,imm */
-		SP = readw(xPC); PC += 2; break;
-
-	case 0x02: /* LD (BC),A */
-		writeb(xBC, A); break;
-	case 0x0A: /* LD A,(BC) */
-		A = readb(xBC); break;
-	case 0x12: /* LD (DE),A */
-		writeb(xDE, A); break;
-	case 0x1A: /* LD A,(DE) */
-		A = readb(xDE); break;
-
-	case 0x22: /* LDI (HL),A */
-		writeb(xHL, A); HL++; break;
-	case 0x2A: /* LDI A,(HL) */
-		A = readb(xHL); HL++; break;
-	case 0x32: /* LDD (HL),A */
-		writeb(xHL, A); HL--; break;
-	case 0x3A: /* LDD A,(HL) */
-		A = readb(xHL); HL--; break;
-
-	case 0x06: /* LD B,imm */
-		B = FETCH; break;
-	case 0x0E: /* LD C,imm */
-		C = FETCH; break;
-	case 0x16: /* LD D,imm */
-		D = FETCH; break;
-	case 0x1E: /* LD E,imm */
-		E = FETCH; break;
-	case 0x26: /* LD H,imm */
-		H = FETCH; break;
-	case 0x2E: /* LD L,imm */
-		L = FETCH; break;
-	case 0x36: /* LD (HL),imm */
-		b = FETCH; writeb(xHL, b); break;
-	case 0x3E: /* LD A,imm */
-		A = FETCH; break;
-
-	case 0x08: /* LD (imm),SP */
-		writew(readw(xPC), SP); PC += 2; break;
-	case 0xEA: /* LD (imm),A */
-		writeb(readw(xPC), A); PC += 2; break;
-
-	case 0xE0: /* LDH (imm),A */
-		writehi(FETCH, A); break;
-	case 0xE2: /* LDH (C),A */
-		writehi(C, A); break;
-	case 0xF0: /* LDH A,(imm) */
-		A = readhi(FETCH); break;
-	case 0xF2: /* LDH A,(C) (undocumented) */
-		A = readhi(C); break;
-			
-
-	case 0xF8: /* LD HL,SP+imm */
-		{
-			/* https://gammpei.github.io/blog/posts/2018-03-04/how-to-write-a-game-boy-emulator-part-8-blarggs-cpu-test-roms-1-3-4-5-7-8-9-10-11.html */
-			signed char v = (signed char) FETCH;
-			int temp = (int)(SP) + (int)v;
+#undef IDLE_AT
 
-			byte half_carry = ((SP & 0xff) ^ v ^ temp) & 0x10;
+/*
+ * The idle loops found in rom are remembered by where they are in the
+ * image, so each is only looked at once, and romdb keeps them from one
+ * run to the next. An entry is one word, the offset of the JR + 1 over
+ * 8 bits of cost, so there's never half of one. It belongs to the rom
+ * image hintrom; loading a rom, or running an instance of a different
+ * one, empties the table.
+ */
 
-			F &= ~(FZ | FN | FH | FC);
+#define IDLE_HINTS 256
+#define IDLE_SLOT(w) (((w) * 2654435761u) >> 24)
 
-			if (half_carry) F |= FH;
-			if ((SP & 0xff) + (byte)v > 0xff) F |= FC;
+static unsigned hints[IDLE_HINTS];
+static byte hintnew[IDLE_HINTS];
+static void *hintrom;
 
-			HL = temp & 0xffff;
-		}
-		break;
-	case 0xF9: /* LD SP,HL */
-		SP = HL; break;
-	case 0xFA: /* LD A,(imm) */
-		A = readb(readw(xPC)); PC += 2; break;
-
-		ALU_CASES(0x80, 0xC6, ADD, __ADD)
-		ALU_CASES(0x88, 0xCE, ADC, __ADC)
-		ALU_CASES(0x90, 0xD6, SUB, __SUB)
-		ALU_CASES(0x98, 0xDE, SBC, __SBC)
-		ALU_CASES(0xA0, 0xE6, AND, __AND)
-		ALU_CASES(0xA8, 0xEE, XOR, __XOR)
-		ALU_CASES(0xB0, 0xF6, OR, __OR)
-		ALU_CASES(0xB8, 0xFE, CP, __CP)
-
-	case 0x09: /* ADD HL,BC */
-		w = BC; goto __ADDW;
-	case 0x19: /* ADD HL,DE */
-		w = DE; goto __ADDW;
-	case 0x39: /* ADD HL,SP */
-		w = SP; goto __ADDW;
-	case 0x29: /* ADD HL,HL */
-		w = HL;
-	__ADDW:
-		ADDW(w);
-		break;
-
-	case 0x04: /* INC B */
-		INC(B); break;
-	case 0x0C: /* INC C */
-		INC(C); break;
-	case 0x14: /* INC D */
-		INC(D); break;
-	case 0x1C: /* INC E */
-		INC(E); break;
-	case 0x24: /* INC H */
-		INC(H); break;
-	case 0x2C: /* INC L */
-		INC(L); break;
-	case 0x34: /* INC (HL) */
-		b = readb(xHL);
-		INC(b);
-		writeb(xHL, b);
-		break;
-	case 0x3C: /* INC A */
-		INC(A); break;
-			
-	case 0x03: /* INC BC */
-		INCW(BC); break;
-	case 0x13: /* INC DE */
-		INCW(DE); break;
-	case 0x23: /* INC HL */
-		INCW(HL); break;
-	case 0x33: /* INC SP */
-		INCW(SP); break;
-			
-	case 0x05: /* DEC B */
-		DEC(B); break;
-	case 0x0D: /* DEC C */
-		DEC(C); break;
-	case 0x15: /* DEC D */
-		DEC(D); break;
-	case 0x1D: /* DEC E */
-		DEC(E); break;
-	case 0x25: /* DEC H */
-		DEC(H); break;
-	case 0x2D: /* DEC L */
-		DEC(L); break;
-	case 0x35: /* DEC (HL) */
-		b = readb(xHL);
-		DEC(b);
-		writeb(xHL, b);
-		break;
-	case 0x3D: /* DEC A */
-		DEC(A); break;
-
-	case 0x0B: /* DEC BC */
-		DECW(BC); break;
-	case 0x1B: /* DEC DE */
-		DECW(DE); break;
-	case 0x2B: /* DEC HL */
-		DECW(HL); break;
-	case 0x3B: /* DEC SP */
-		DECW(SP); break;
-
-	case 0x07: /* RLCA */
-		RLCA(A); break;
-	case 0x0F: /* RRCA */
-		RRCA(A); break;
-	case 0x17: /* RLA */
-		RLA(A); break;
-	case 0x1F: /* RRA */
-		RRA(A); break;
-
-	case 0x27: /* DAA */
-		{
-			int a = A;
-			if (!(F & FN))
-			{
-				if ((F & FH) || ((a & 0x0f) > 9)) a += 0x06;
+void cpu_idleforget()
+{
+	memset(hints, 0, sizeof hints);
+	memset(hintnew, 0, sizeof hintnew);
+	hintrom = rom.bank;
+}
 
-				if ((F & FC) || (a > 0x9f)) a += 0x60;
-			}
-			else
-			{
-				if (F & FH) a = (a - 6) & 0xff;
-				if (F & FC) a -= 0x60;
-			}
+/* where the JR at p is in the rom image, + 1, or 0 if it isn't in rom
+   or the loop isn't all in the page it's in */
+static unsigned idle_where(word pc, const byte *p)
+{
+	const byte *lo = rom.bank[0];
 
-			F &= ~(FH | FZ);
+	if ((pc & 0xfff) < IDLE_MAX || (pc & 0xfff) == 0xfff
+		|| p < lo || p >= lo + 16384 * mbc.romsize)
+		return 0;
+	return p - lo + 1;
+}
 
-			if (a & 0x100) F |= FC;
+static int idle_cost(word pc)
+{
+	const byte *p = mbc.rmap[pc >> 12];
+	unsigned where, h;
+	int cost;
+
+	if (!p || !(where = idle_where(pc, p + pc)))
+		return idle_loop(pc, 0);
+	if ((void *)rom.bank != hintrom) cpu_idleforget();
+	h = hints[IDLE_SLOT(where)];
+	if (h >> 8 == where) return h & 255;
+	if ((cost = idle_loop(pc, p + pc)) && where < 1 << 24)
+	{
+		hints[IDLE_SLOT(where)] = where << 8 | cost;
+		hintnew[IDLE_SLOT(where)] = 1;
+	}
+	return cost;
+}
 
-			a &= 0xff;
+/* an idle loop romdb found last time, its JR at offset in the rom
+   image; it's checked against the rom before it's taken */
+void cpu_idlehint(unsigned offset, int cost)
+{
+	const byte *p;
+
+	if (offset >= 16384u * mbc.romsize) return;
+	if ((void *)rom.bank != hintrom) cpu_idleforget();
+	rom_unpack(offset >> 14);
+	p = rom.bank[0] + offset;
+	if (!idle_where(offset, p)
+		|| (n8)p[1] >= 0 || (n8)p[1] < -(IDLE_MAX+2)
+		|| idle_loop(0, p) != cost)
+		return;
+	hints[IDLE_SLOT(offset + 1)] = (offset + 1) << 8 | cost;
+	hintnew[IDLE_SLOT(offset + 1)] = 0;
+}
 
-			if (!a) F |= FZ;
+/* the loops found since the rom was loaded that weren't hinted, as
+   offset and cost pairs into out, at most max of them; the count */
+int cpu_idlefound(unsigned *out, int max)
+{
+	int i, n = 0;
 
-			A = (byte)a;
-		}
-		break;
-	case 0x2F: /* CPL */
-		CPL(A); break;
-
-	case 0x18: /* JR */
-	__JR:
-		JR; break;
-	case 0x20: /* JR NZ */
-		if (!(F&FZ)) goto __JR; NOJR; break;
-	case 0x28: /* JR Z */
-		if (F&FZ) goto __JR; NOJR; break;
-	case 0x30: /* JR NC */
-		if (!(F&FC)) goto __JR; NOJR; break;
-	case 0x38: /* JR C */
-		if (F&FC) goto __JR; NOJR; break;
-
-	case 0xC3: /* JP */
-	__JP:
-		JP; break;
-	case 0xC2: /* JP NZ */
-		if (!(F&FZ)) goto __JP; NOJP; break;
-	case 0xCA: /* JP Z */
-		if (F&FZ) goto __JP; NOJP; break;
-	case 0xD2: /* JP NC */
-		if (!(F&FC)) goto __JP; NOJP; break;
-	case 0xDA: /* JP C */
-		if (F&FC) goto __JP; NOJP; break;
-	case 0xE9: /* JP HL */
-		PC = HL; break;
-
-	case 0xC9: /* RET */
-	__RET:
-		RET; break;
-	case 0xC0: /* RET NZ */
-		if (!(F&FZ)) goto __RET; NORET; break;
-	case 0xC8: /* RET Z */
-		if (F&FZ) goto __RET; NORET; break;
-	case 0xD0: /* RET NC */
-		if (!(F&FC)) goto __RET; NORET; break;
-	case 0xD8: /* RET C */
-		if (F&FC) goto __RET; NORET; break;
-	case 0xD9: /* RETI */
-		IME = IMA = 1; goto __RET;
-
-	case 0xCD: /* CALL */
-	__CALL:
-		CALL; break;
-	case 0xC4: /* CALL NZ */
-		if (!(F&FZ)) goto __CALL; NOCALL; break;
-	case 0xCC: /* CALL Z */
-		if (F&FZ) goto __CALL; NOCALL; break;
-	case 0xD4: /* CALL NC */
-		if (!(F&FC)) goto __CALL; NOCALL; break;
-	case 0xDC: /* CALL C */
-		if (F&FC) goto __CALL; NOCALL; break;
-
-	case 0xC7: /* RST 0 */
-		b = 0x00; goto __RST;
-	case 0xCF: /* RST 8 */
-		b = 0x08; goto __RST;
-	case 0xD7: /* RST 10 */
-		b = 0x10; goto __RST;
-	case 0xDF: /* RST 18 */
-		b = 0x18; goto __RST;
-	case 0xE7: /* RST 20 */
-		b = 0x20; goto __RST;
-	case 0xEF: /* RST 28 */
-		b = 0x28; goto __RST;
-	case 0xF7: /* RST 30 */
-		b = 0x30; goto __RST;
-	case 0xFF: /* RST 38 */
-		b = 0x38;
-	__RST:
-		RST(b); break;
-			
-	case 0xC1: /* POP BC */
-		POP(BC); break;
-	case 0xC5: /* PUSH BC */
-		PUSH(BC); break;
-	case 0xD1: /* POP DE */
-		POP(DE); break;
-	case 0xD5: /* PUSH DE */
-		PUSH(DE); break;
-	case 0xE1: /* POP HL */
-		POP(HL); break;
-	case 0xE5: /* PUSH HL */
-		PUSH(HL); break;
-	case 0xF1: /* POP AF */
-		POP(AF); AF &= 0xfff0; break;
-	case 0xF5: /* PUSH AF */
-		PUSH(AF); break;
-
-	case 0xE8: /* ADD SP,imm */
-		{
-			/* https://gammpei.github.io/blog/posts/2018-03-04/how-to-write-a-game-boy-emulator-part-8-blarggs-cpu-test-roms-1-3-4-5-7-8-9-10-11.html */
-			signed char v = (signed char) FETCH;
-			int temp = (int)(SP) + (int)v;
+	if ((void *)rom.bank != hintrom) return 0;
+	for (i = 0; i < IDLE_HINTS && n < max; i++)
+	{
+		if (!hintnew[i] || !hints[i]) continue;
+		out[2*n] = (hints[i] >> 8) - 1;
+		out[2*n+1] = hints[i] & 255;
+		n++;
+	}
+	return n;
+}
 
-			byte half_carry = ((SP & 0xff) ^ v ^ temp) & 0x10;
+/* returns the number of cycles skipped, already added to cpu.evcnt;
+ * clen is the unscaled length of the JR itself, i the cycles left */
+static int idle_skip(word pc, int clen, int i)
+{
+	int cost, left;
+
+	if (!idleskip) return 0;
+	if (IME != IMA || (IME && (IF & IE))) return 0;
+	if (!(cost = idle_cost(pc))) return 0;
+	cost = (cost << 1) >> cpu.speed;
+	clen = (clen << 1) >> cpu.speed;
+	/* the io read synced just before reading, so if anything has
+	 * synced since (i.e. an event may have changed the register
+	 * after we read it) evcnt won't add up to the rest of the loop */
+	if (cost != clen && cpu.evcnt != cost - clen) return 0;
+	left = EVDUE - cpu.evcnt;
+	if (left > i) left = i;
+	left -= clen + 1;
+	if (left < cost) return 0;
+	left -= left % cost;
+	cpu.evcnt += left;
+	return left;
+}
 
-			F &= ~(FZ | FN | FH | FC);
+/*
+ * Copy and fill loops. Games clear and copy memory with loops like
+ *
+ *   LD (HL+),A; DEC B; JR NZ
+ *   LD A,(HL+); LD (DE),A; INC DE; DEC B; JR NZ
+ *   LD A,(HL+); LD (DE),A; INC DE; DEC BC; LD A,B; OR C; JR NZ
+ *
+ * (the first two also counting with C), a handful of instructions a
+ * byte for hundreds or thousands of bytes. loop_skip is called at the
+ * taken JR like idle_skip, and runs as many of the passes still to
+ * come as it can as one plain copy or fill, straight through the
+ * pages mbc.rmap and mbc.wmap map. It stops one pass before the count
+ * runs out, at the end of a page, and short of the next event or the
+ * end of the timeslice, and the interpreter runs on from there until
+ * it gets back to the JR. Everything whose accesses have to be seen
+ * one by one (io, vram, watched or tracked pages) has no map entry,
+ * and a loop writing over its own code is left alone, so registers,
+ * memory and cycles come out exactly as if every instruction had run.
+ */
+
+/* pc is the address of a taken JR NZ; returns the number of cycles
+ * run, already added to cpu.evcnt */
+static int loop_skip(word pc, int clen, int i)
+{
+	word t;
+	byte *rp = 0, *wp, dec;
+	int body, count, n, a, cost, left, k;
 
-			if (half_carry) F |= FH;
-			if ((SP & 0xff) + (byte)v > 0xff) F |= FC;
+#ifdef MEMSTATS
+	return 0; /* the accesses have to be counted one at a time */
+#endif
+	if (!loopskip) return 0;
+	if (IME != IMA || (IME && (IF & IE))) return 0;
+	t = pc + 2 + (n8)readb(pc + 1);
+	body = (word)(pc - t);
+	if (body == 2 && readb(t) == 0x22)
+		dec = readb(t + 1);
+	else if ((body == 4 || body == 6) && readb(t) == 0x2A
+		&& readb(t + 1) == 0x12 && readb(t + 2) == 0x13)
+		dec = readb(t + 3);
+	else return 0;
+	if (body == 6)
+	{
+		if (dec != 0x0B || readb(t + 4) != 0x78 || readb(t + 5) != 0xB1)
+			return 0;
+		count = BC;
+	}
+	else if (dec == 0x05) count = B;
+	else if (dec == 0x0D) count = C;
+	else return 0;
+
+	/* the passes that end with the JR taken again */
+	n = count - 1;
+	a = body == 2 ? HL : DE;
+	if (!(wp = mbc.wmap[a >> 12])) return 0;
+	wp += a;
+	if (n > 0x1000 - (a & 0xfff)) n = 0x1000 - (a & 0xfff);
+	if (a <= pc + 1 && a + n > t) return 0;
+	if (body != 2)
+	{
+		if (!(rp = mbc.rmap[HL >> 12])) return 0;
+		rp += HL;
+		if (n > 0x1000 - (HL & 0xfff)) n = 0x1000 - (HL & 0xfff);
+	}
 
-			SP = temp & 0xffff;
-		}
-		break;
+	cost = cycles_table[0x20];
+	for (k = 0; k < body; k++) cost += cycles_table[readb(t + k)];
+	cost = (cost << 1) >> cpu.speed;
+	clen = (clen << 1) >> cpu.speed;
+	left = EVDUE - cpu.evcnt;
+	if (left > i) left = i;
+	left -= clen + 1;
+	if (n > left / cost) n = left / cost;
+	if (n <= 0) return 0;
+
+	if (body == 2)
+	{
+		memset(wp, A, n);
+		HL += n;
+	}
+	else
+	{
+		/* byte by byte, since source and destination may overlap */
+		for (k = 0; k < n; k++) wp[k] = rp[k];
+		A = rp[n - 1];
+		HL += n;
+		DE += n;
+	}
+	if (body == 6)
+	{
+		BC -= n;
+		A = B | C;
+		F = 0;
+	}
+	else if (dec == 0x05)
+	{
+		B -= n;
+		F = (F & (FL|FC)) | decflag_table[B];
+	}
+	else
+	{
+		C -= n;
+		F = (F & (FL|FC)) | decflag_table[C];
+	}
+	cpu.insns += n * (body + 1);
+	cpu.evcnt += n * cost;
+	return n * cost;
+}
 
+/*
+ * cpu_emulate keeps the registers in locals so the compiler can hold
+ * them in host registers; nothing it calls (memory, io, cpu_sync)
+ * looks at them. They have to be written back to the global cpu
+ * before anything that does, i.e. the debugger, die(), and returning.
+ */
 
-	case 0xF3: /* DI */
-		DI; break;
-	case 0xFB: /* EI */
-		EI; break;
+struct regs
+{
+	union reg pc, sp, bc, de, hl, af;
+};
+
+#define LOAD_REGS ( r.pc = cpu.pc, r.sp = cpu.sp, r.bc = cpu.bc, \
+r.de = cpu.de, r.hl = cpu.hl, r.af = cpu.af )
+#define SAVE_REGS ( cpu.pc = r.pc, cpu.sp = r.sp, cpu.bc = r.bc, \
+cpu.de = r.de, cpu.hl = r.hl, cpu.af = r.af )
+
+#undef REGS
+#define REGS r
+
+/*
+ * The interpreter proper, built once for each cpu speed and each
+ * "accuracy" tier, so what a tier adds costs the others nothing:
+ *
+ *   fast      as it has always been
+ *   balanced  hdma and gdma take the cpu off the bus for as long as
+ *             they copy, 8 of its cycles a block, where fast has the
+ *             copy take no time at all (hw.c sets cpu.stall)
+ *   accurate  and the cpu can't get at vram while the lcd is drawing
+ *             (mode 3) nor oam while it's looking through it or
+ *             drawing (modes 2 and 3); reads give FF, writes are lost.
+ *             Copy loops are run for real, not by loopskip, which
+ *             doesn't look.
+ *
+ * Test roms want accurate; most games can't tell them apart.
+ */
+
+#define SPEED 0
+#define ACCURACY ACC_FAST
+#define CPU_EMULATE cpu_emulate_ss
+#include "cpuemu.h"
+#undef CPU_EMULATE
+#undef SPEED
+
+#define SPEED 1
+#define CPU_EMULATE cpu_emulate_ds
+#include "cpuemu.h"
+#undef CPU_EMULATE
+#undef SPEED
+#undef ACCURACY
+
+#define SPEED 0
+#define ACCURACY ACC_BALANCED
+#define CPU_EMULATE cpu_emulate_ss1
+#include "cpuemu.h"
+#undef CPU_EMULATE
+#undef SPEED
+
+#define SPEED 1
+#define CPU_EMULATE cpu_emulate_ds1
+#include "cpuemu.h"
+#undef CPU_EMULATE
+#undef SPEED
+#undef ACCURACY
+
+/* the accurate cpu's memory; the lcd's mode is up to date at every
+   instruction, since each change of it is an event (see cpu_sync) */
+#define LOCKED(a) ( (R_LCDC & 0x80) && (((a) & 0xE000) == 0x8000 \
+? (R_STAT & 3) == 3 : (a) >= 0xFE00 && (a) < 0xFEA0 && (R_STAT & 2)) )
+
+static byte lockedreadb(int a)
+{
+	return LOCKED(a) ? 0xFF : readb(a);
+}
 
-	case 0x37: /* SCF */
-		SCF; break;
-	case 0x3F: /* CCF */
-		CCF; break;
+static void lockedwriteb(int a, byte b)
+{
+	if (!LOCKED(a)) writeb(a, b);
+}
 
-	case 0x10: /* STOP */
-		PC++;
-		if (R_KEY1 & 1)
-		{
-			cpu.speed = cpu.speed ^ 1;
-			R_KEY1 = (R_KEY1 & 0x7E) | (cpu.speed << 7);
-			break;
-		}
-		/* NOTE - we do not implement dmg STOP whatsoever */
-		break;
-			
-	case 0x76: /* HALT */
-		cpu.halt = 1;
-		break;
-
-	case 0xCB: /* CB prefix */
-		cbop = FETCH;
-		clen = cb_cycles_table[cbop];
-		switch (cbop)
-		{
-			CB_REG_CASES(B, 0);
-			CB_REG_CASES(C, 1);
-			CB_REG_CASES(D, 2);
-			CB_REG_CASES(E, 3);
-			CB_REG_CASES(H, 4);
-			CB_REG_CASES(L, 5);
-			CB_REG_CASES(A, 7);
-		default:
-			b = readb(xHL);
-			switch(cbop)
-			{
-				CB_REG_CASES(b, 6);
-			}
-			if ((cbop & 0xC0) != 0x40) /* exclude BIT */
-				writeb(xHL, b);
-			break;
-		}
-		break;
-			
-	default:
-		die(
-			"invalid opcode 0x%02X at address 0x%04X, rombank = %d\n",
-			op, (PC-1) & 0xffff, mbc.rombank);
-		break;
-	}
+static int lockedreadw(int a)
+{
+	if (LOCKED(a) || LOCKED(a + 1))
+		return lockedreadb(a) | (lockedreadb(a + 1) << 8);
+	return readw(a);
+}
+
+static void lockedwritew(int a, int w)
+{
+	lockedwriteb(a, w);
+	lockedwriteb(a + 1, w >> 8);
+}
+
+#define readb lockedreadb
+#define writeb lockedwriteb
+#define readw lockedreadw
+#define writew lockedwritew
+
+#define SPEED 0
+#define ACCURACY ACC_ACCURATE
+#define CPU_EMULATE cpu_emulate_ss2
+#include "cpuemu.h"
+#undef CPU_EMULATE
+#undef SPEED
+
+#define SPEED 1
+#define CPU_EMULATE cpu_emulate_ds2
+#include "cpuemu.h"
+#undef CPU_EMULATE
+#undef SPEED
+#undef ACCURACY
+
+#undef readb
+#undef writeb
+#undef readw
+#undef writew
+
+#undef REGS
+#define REGS cpu
+
+static int (*const tiers[3][2])(int) =
+{
+	{ cpu_emulate_ss, cpu_emulate_ds },
+	{ cpu_emulate_ss1, cpu_emulate_ds1 },
+	{ cpu_emulate_ss2, cpu_emulate_ds2 },
+};
 
-	clen <<= 1;
-	div_advance(clen);
-	timer_advance(clen);
-	clen >>= cpu.speed;
-	lcdc_advance(clen);
-	sound_advance(clen);
+int cpu_emulate(int cycles)
+{
+	int i, speed, t;
 
-	i -= clen;
-	if (i > 0) goto next;
-	return cycles-i;
+	t = accuracy < ACC_FAST ? ACC_FAST
+		: accuracy > ACC_ACCURATE ? ACC_ACCURATE : accuracy;
+	i = 0;
+	do
+	{
+		speed = cpu.speed;
+		i += tiers[t][speed](cycles - i);
+	}
+	while (cpu.speed != speed && i < cycles);
+	cpu.clock += i;
+	return i;
 }
 
 #endif /* ASM_CPU_EMULATE */
@@ -916,7 +1011,11 @@ next:
 int cpu_step(int max)
 {
 	int cnt;
-	if ((cnt = cpu_idle(max))) return cnt;
+	if ((cnt = cpu_idle(max)))
+	{
+		cpu.clock += cnt;
+		return cnt;
+	}
 	return cpu_emulate(1);
 }
 
@@ -0,0 +1,622 @@
+/*
+ * cpuemu.h - the body of the interpreter loop. This is not a normal
+ * header: cpu.c includes it once for each cpu speed and accuracy
+ * tier, with SPEED set to 0 or 1, ACCURACY to one of the ACC_ tiers
+ * and CPU_EMULATE to the name of the function to define, so that the
+ * cycle scaling in CYCLES is a constant shift rather than a load of
+ * cpu.speed after every instruction, and a tier's extra work is
+ * compiled out of the others. A speed
+ * switch (STOP) returns from the function and cpu_emulate carries on
+ * in the other one. All the macros it relies on are defined in cpu.c.
+ */
+
+
+static int CPU_EMULATE(int cycles)
+{
+	int i;
+	byte op, cbop;
+	int clen;
+	un32 ninsn = 0;
+	struct regs r;
+	union reg acc;
+	byte b;
+	word w;
+#ifdef COMPUTED_GOTO
+	static const void *const optable[256] = OPTABLE(op_);
+	static const void *const cb_optable[256] = OPTABLE(cb_);
+#endif
+
+	i = cycles;
+	LOAD_REGS;
+	cpu_sync();
+next:
+	if (cpu.halt && (clen = cpu_idle(i)))
+	{
+		i -= clen;
+		if (i > 0) goto next;
+		SAVE_REGS;
+		cpu.insns += ninsn;
+		if (DEBUG_HOOKED) debug_end(cycles-i);
+		return cycles-i;
+	}
+
+	if (IME && (IF & IE))
+	{
+		PRE_INT;
+		switch ((byte)(IF & IE))
+		{
+		case 0x01: case 0x03: case 0x05: case 0x07:
+		case 0x09: case 0x0B: case 0x0D: case 0x0F:
+		case 0x11: case 0x13: case 0x15: case 0x17:
+		case 0x19: case 0x1B: case 0x1D: case 0x1F:
+			THROW_INT(0); break;
+		case 0x02: case 0x06: case 0x0A: case 0x0E:
+		case 0x12: case 0x16: case 0x1A: case 0x1E:
+			THROW_INT(1); break;
+		case 0x04: case 0x0C: case 0x14: case 0x1C:
+			THROW_INT(2); break;
+		case 0x08: case 0x18:
+			THROW_INT(3); break;
+		case 0x10:
+			THROW_INT(4); break;
+		}
+	}
+	if (IME != IMA)
+	{
+		/* EI takes effect after the next instruction, which then
+		 * has to come back here for the interrupt check */
+		IME = IMA;
+		cpu.evnext = 0;
+	}
+	
+	if (DEBUG_HOOKED)
+	{
+		SAVE_REGS;
+		debug_insn(cycles-i);
+		LOAD_REGS; /* a debugger may have changed them */
+		cpu.evnext = 0;
+	}
+	op = FETCH;
+	clen = cycles_table[op];
+
+	DISPATCH(optable, op)
+	{
+	OP(0x00) /* NOP */
+	OP(0x40) /* LD B,B */
+	OP(0x49) /* LD C,C */
+	OP(0x52) /* LD D,D */
+	OP(0x5B) /* LD E,E */
+	OP(0x64) /* LD H,H */
+	OP(0x6D) /* LD L,L */
+	OP(0x7F) /* LD A,A */
+		NEXT;
+			
+	OP(0x41) /* LD B,C */
+		B = C; NEXT;
+	OP(0x42) /* LD B,D */
+		B = D; NEXT;
+	OP(0x43) /* LD B,E */
+		B = E; NEXT;
+	OP(0x44) /* LD B,H */
+		B = H; NEXT;
+	OP(0x45) /* LD B,L */
+		B = L; NEXT;
+	OP(0x46) /* LD B,(HL) */
+		B = readb(xHL); NEXT;
+	OP(0x47) /* LD B,A */
+		B = A; NEXT;
+
+	OP(0x48) /* LD C,B */
+		C = B; NEXT;
+	OP(0x4A) /* LD C,D */
+		C = D; NEXT;
+	OP(0x4B) /* LD C,E */
+		C = E; NEXT;
+	OP(0x4C) /* LD C,H */
+		C = H; NEXT;
+	OP(0x4D) /* LD C,L */
+		C = L; NEXT;
+	OP(0x4E) /* LD C,(HL) */
+		C = readb(xHL); NEXT;
+	OP(0x4F) /* LD C,A */
+		C = A; NEXT;
+
+	OP(0x50) /* LD D,B */
+		D = B; NEXT;
+	OP(0x51) /* LD D,C */
+		D = C; NEXT;
+	OP(0x53) /* LD D,E */
+		D = E; NEXT;
+	OP(0x54) /* LD D,H */
+		D = H; NEXT;
+	OP(0x55) /* LD D,L */
+		D = L; NEXT;
+	OP(0x56) /* LD D,(HL) */
+		D = readb(xHL); NEXT;
+	OP(0x57) /* LD D,A */
+		D = A; NEXT;
+
+	OP(0x58) /* LD E,B */
+		E = B; NEXT;
+	OP(0x59) /* LD E,C */
+		E = C; NEXT;
+	OP(0x5A) /* LD E,D */
+		E = D; NEXT;
+	OP(0x5C) /* LD E,H */
+		E = H; NEXT;
+	OP(0x5D) /* LD E,L */
+		E = L; NEXT;
+	OP(0x5E) /* LD E,(HL) */
+		E = readb(xHL); NEXT;
+	OP(0x5F) /* LD E,A */
+		E = A; NEXT;
+
+	OP(0x60) /* LD H,B */
+		H = B; NEXT;
+	OP(0x61) /* LD H,C */
+		H = C; NEXT;
+	OP(0x62) /* LD H,D */
+		H = D; NEXT;
+	OP(0x63) /* LD H,E */
+		H = E; NEXT;
+	OP(0x65) /* LD H,L */
+		H = L; NEXT;
+	OP(0x66) /* LD H,(HL) */
+		H = readb(xHL); NEXT;
+	OP(0x67) /* LD H,A */
+		H = A; NEXT;
+			
+	OP(0x68) /* LD L,B */
+		L = B; NEXT;
+	OP(0x69) /* LD L,C */
+		L = C; NEXT;
+	OP(0x6A) /* LD L,D */
+		L = D; NEXT;
+	OP(0x6B) /* LD L,E */
+		L = E; NEXT;
+	OP(0x6C) /* LD L,H */
+		L = H; NEXT;
+	OP(0x6E) /* LD L,(HL) */
+		L = readb(xHL); NEXT;
+	OP(0x6F) /* LD L,A */
+		L = A; NEXT;
+			
+	OP(0x70) /* LD (HL),B */
+		b = B; goto __LD_HL;
+	OP(0x71) /* LD (HL),C */
+		b = C; goto __LD_HL;
+	OP(0x72) /* LD (HL),D */
+		b = D; goto __LD_HL;
+	OP(0x73) /* LD (HL),E */
+		b = E; goto __LD_HL;
+	OP(0x74) /* LD (HL),H */
+		b = H; goto __LD_HL;
+	OP(0x75) /* LD (HL),L */
+		b = L; goto __LD_HL;
+	OP(0x77) /* LD (HL),A */
+		b = A;
+	__LD_HL:
+		writeb(xHL,b);
+		NEXT;
+			
+	OP(0x78) /* LD A,B */
+		A = B; NEXT1(0xB1);
+	OP(0x79) /* LD A,C */
+		A = C; NEXT;
+	OP(0x7A) /* LD A,D */
+		A = D; NEXT;
+	OP(0x7B) /* LD A,E */
+		A = E; NEXT;
+	OP(0x7C) /* LD A,H */
+		A = H; NEXT;
+	OP(0x7D) /* LD A,L */
+		A = L; NEXT;
+	OP(0x7E) /* LD A,(HL) */
+		A = readb(xHL); NEXT;
+
+	OP(0x01) /* LD BC,imm */
+		BC = readw(xPC); PC += 2; NEXT;
+	OP(0x11) /* LD DE,imm */
+		DE = readw(xPC); PC += 2; NEXT;
+	OP(0x21) /* LD HL,imm */
+		HL = readw(xPC); PC += 2; NEXT;
+	OP(0x31) /* LD SP,imm */
+		SP = readw(xPC); PC += 2; NEXT;
+
+	OP(0x02) /* LD (BC),A */
+		writeb(xBC, A); NEXT;
+	OP(0x0A) /* LD A,(BC) */
+		A = readb(xBC); NEXT;
+	OP(0x12) /* LD (DE),A */
+		writeb(xDE, A); NEXT1(0x13);
+	OP(0x1A) /* LD A,(DE) */
+		A = readb(xDE); NEXT1(0x22);
+
+	OP(0x22) /* LDI (HL),A */
+		writeb(xHL, A); HL++; NEXT;
+	OP(0x2A) /* LDI A,(HL) */
+		A = readb(xHL); HL++; NEXT2(0x12, 0x22);
+	OP(0x32) /* LDD (HL),A */
+		writeb(xHL, A); HL--; NEXT;
+	OP(0x3A) /* LDD A,(HL) */
+		A = readb(xHL); HL--; NEXT;
+
+	OP(0x06) /* LD B,imm */
+		B = FETCH; NEXT;
+	OP(0x0E) /* LD C,imm */
+		C = FETCH; NEXT;
+	OP(0x16) /* LD D,imm */
+		D = FETCH; NEXT;
+	OP(0x1E) /* LD E,imm */
+		E = FETCH; NEXT;
+	OP(0x26) /* LD H,imm */
+		H = FETCH; NEXT;
+	OP(0x2E) /* LD L,imm */
+		L = FETCH; NEXT;
+	OP(0x36) /* LD (HL),imm */
+		b = FETCH; writeb(xHL, b); NEXT;
+	OP(0x3E) /* LD A,imm */
+		A = FETCH; NEXT;
+
+	OP(0x08) /* LD (imm),SP */
+		writew(readw(xPC), SP); PC += 2; NEXT;
+	OP(0xEA) /* LD (imm),A */
+		writeb(readw(xPC), A); PC += 2; NEXT;
+
+	OP(0xE0) /* LDH (imm),A */
+		writehi(FETCH, A); NEXT;
+	OP(0xE2) /* LDH (C),A */
+		writehi(C, A); NEXT;
+	OP(0xF0) /* LDH A,(imm) */
+		A = readhi(FETCH); NEXT2(0xE6, 0xFE);
+	OP(0xF2) /* LDH A,(C) (undocumented) */
+		A = readhi(C); NEXT;
+			
+
+	OP(0xF8) /* LD HL,SP+imm */
+		{
+			/* https://gammpei.github.io/blog/posts/2018-03-04/how-to-write-a-game-boy-emulator-part-8-blarggs-cpu-test-roms-1-3-4-5-7-8-9-10-11.html */
+			signed char v = (signed char) FETCH;
+			int temp = (int)(SP) + (int)v;
+
+			byte half_carry = ((SP & 0xff) ^ v ^ temp) & 0x10;
+
+			F &= ~(FZ | FN | FH | FC);
+
+			if (half_carry) F |= FH;
+			if ((SP & 0xff) + (byte)v > 0xff) F |= FC;
+
+			HL = temp & 0xffff;
+		}
+		NEXT;
+	OP(0xF9) /* LD SP,HL */
+		SP = HL; NEXT;
+	OP(0xFA) /* LD A,(imm) */
+		A = readb(readw(xPC)); PC += 2; NEXT;
+
+		ALU_CASES_LO(0x8, 0xC6, ADD, __ADD, NEXT)
+		ALU_CASES_HI(0x8, 0xCE, ADC, __ADC, NEXT)
+		ALU_CASES_LO(0x9, 0xD6, SUB, __SUB, NEXT)
+		ALU_CASES_HI(0x9, 0xDE, SBC, __SBC, NEXT)
+		ALU_CASES_LO(0xA, 0xE6, AND, __AND, NEXT2(0x20, 0x28))
+		ALU_CASES_HI(0xA, 0xEE, XOR, __XOR, NEXT)
+		ALU_CASES_LO(0xB, 0xF6, OR, __OR, NEXT2(0x20, 0x28))
+		ALU_CASES_HI(0xB, 0xFE, CP, __CP, NEXT2(0x20, 0x28))
+
+	OP(0x09) /* ADD HL,BC */
+		w = BC; goto __ADDW;
+	OP(0x19) /* ADD HL,DE */
+		w = DE; goto __ADDW;
+	OP(0x39) /* ADD HL,SP */
+		w = SP; goto __ADDW;
+	OP(0x29) /* ADD HL,HL */
+		w = HL;
+	__ADDW:
+		ADDW(w);
+		NEXT;
+
+	OP(0x04) /* INC B */
+		INC(B); NEXT;
+	OP(0x0C) /* INC C */
+		INC(C); NEXT;
+	OP(0x14) /* INC D */
+		INC(D); NEXT;
+	OP(0x1C) /* INC E */
+		INC(E); NEXT;
+	OP(0x24) /* INC H */
+		INC(H); NEXT;
+	OP(0x2C) /* INC L */
+		INC(L); NEXT;
+	OP(0x34) /* INC (HL) */
+		b = readb(xHL);
+		INC(b);
+		writeb(xHL, b);
+		NEXT;
+	OP(0x3C) /* INC A */
+		INC(A); NEXT;
+			
+	OP(0x03) /* INC BC */
+		INCW(BC); NEXT;
+	OP(0x13) /* INC DE */
+		INCW(DE); NEXT;
+	OP(0x23) /* INC HL */
+		INCW(HL); NEXT;
+	OP(0x33) /* INC SP */
+		INCW(SP); NEXT;
+			
+	OP(0x05) /* DEC B */
+		DEC(B); NEXT1(0x20);
+	OP(0x0D) /* DEC C */
+		DEC(C); NEXT1(0x20);
+	OP(0x15) /* DEC D */
+		DEC(D); NEXT;
+	OP(0x1D) /* DEC E */
+		DEC(E); NEXT;
+	OP(0x25) /* DEC H */
+		DEC(H); NEXT;
+	OP(0x2D) /* DEC L */
+		DEC(L); NEXT;
+	OP(0x35) /* DEC (HL) */
+		b = readb(xHL);
+		DEC(b);
+		writeb(xHL, b);
+		NEXT;
+	OP(0x3D) /* DEC A */
+		DEC(A); NEXT1(0x20);
+
+	OP(0x0B) /* DEC BC */
+		DECW(BC); NEXT1(0x78);
+	OP(0x1B) /* DEC DE */
+		DECW(DE); NEXT;
+	OP(0x2B) /* DEC HL */
+		DECW(HL); NEXT;
+	OP(0x3B) /* DEC SP */
+		DECW(SP); NEXT;
+
+	OP(0x07) /* RLCA */
+		RLCA(A); NEXT;
+	OP(0x0F) /* RRCA */
+		RRCA(A); NEXT;
+	OP(0x17) /* RLA */
+		RLA(A); NEXT;
+	OP(0x1F) /* RRA */
+		RRA(A); NEXT;
+
+	OP(0x27) /* DAA */
+		{
+			int a = A;
+			if (!(F & FN))
+			{
+				if ((F & FH) || ((a & 0x0f) > 9)) a += 0x06;
+
+				if ((F & FC) || (a > 0x9f)) a += 0x60;
+			}
+			else
+			{
+				if (F & FH) a = (a - 6) & 0xff;
+				if (F & FC) a -= 0x60;
+			}
+
+			F &= ~(FH | FZ);
+
+			if (a & 0x100) F |= FC;
+
+			a &= 0xff;
+
+			if (!a) F |= FZ;
+
+			A = (byte)a;
+		}
+		NEXT;
+	OP(0x2F) /* CPL */
+		CPL(A); NEXT;
+
+	OP(0x18) /* JR */
+	__JR:
+		b = readb(PC);
+		if ((n8)b < 0 && (n8)b >= -(IDLE_MAX+2) && !DEBUG_HOOKED)
+		{
+			i -= idle_skip(PC-1, clen, i);
+			if (op == 0x20 && ACCURACY < ACC_ACCURATE)
+			{
+				SAVE_REGS;
+				i -= loop_skip(PC-1, clen, i);
+				LOAD_REGS;
+			}
+		}
+		JR; NEXT;
+	OP(0x20) /* JR NZ */
+		if (!(F&FZ)) goto __JR; NOJR; NEXT;
+	OP(0x28) /* JR Z */
+		if (F&FZ) goto __JR; NOJR; NEXT;
+	OP(0x30) /* JR NC */
+		if (!(F&FC)) goto __JR; NOJR; NEXT;
+	OP(0x38) /* JR C */
+		if (F&FC) goto __JR; NOJR; NEXT;
+
+	OP(0xC3) /* JP */
+	__JP:
+		JP; NEXT;
+	OP(0xC2) /* JP NZ */
+		if (!(F&FZ)) goto __JP; NOJP; NEXT;
+	OP(0xCA) /* JP Z */
+		if (F&FZ) goto __JP; NOJP; NEXT;
+	OP(0xD2) /* JP NC */
+		if (!(F&FC)) goto __JP; NOJP; NEXT;
+	OP(0xDA) /* JP C */
+		if (F&FC) goto __JP; NOJP; NEXT;
+	OP(0xE9) /* JP HL */
+		PC = HL; NEXT;
+
+	OP(0xC9) /* RET */
+	__RET:
+		RET; NEXT;
+	OP(0xC0) /* RET NZ */
+		if (!(F&FZ)) goto __RET; NORET; NEXT;
+	OP(0xC8) /* RET Z */
+		if (F&FZ) goto __RET; NORET; NEXT;
+	OP(0xD0) /* RET NC */
+		if (!(F&FC)) goto __RET; NORET; NEXT;
+	OP(0xD8) /* RET C */
+		if (F&FC) goto __RET; NORET; NEXT;
+	OP(0xD9) /* RETI */
+		IME = IMA = 1; cpu.evnext = 0; goto __RET;
+
+	OP(0xCD) /* CALL */
+	__CALL:
+		CALL; NEXT;
+	OP(0xC4) /* CALL NZ */
+		if (!(F&FZ)) goto __CALL; NOCALL; NEXT;
+	OP(0xCC) /* CALL Z */
+		if (F&FZ) goto __CALL; NOCALL; NEXT;
+	OP(0xD4) /* CALL NC */
+		if (!(F&FC)) goto __CALL; NOCALL; NEXT;
+	OP(0xDC) /* CALL C */
+		if (F&FC) goto __CALL; NOCALL; NEXT;
+
+	OP(0xC7) /* RST 0 */
+		b = 0x00; goto __RST;
+	OP(0xCF) /* RST 8 */
+		b = 0x08; goto __RST;
+	OP(0xD7) /* RST 10 */
+		b = 0x10; goto __RST;
+	OP(0xDF) /* RST 18 */
+		b = 0x18; goto __RST;
+	OP(0xE7) /* RST 20 */
+		b = 0x20; goto __RST;
+	OP(0xEF) /* RST 28 */
+		b = 0x28; goto __RST;
+	OP(0xF7) /* RST 30 */
+		b = 0x30; goto __RST;
+	OP(0xFF) /* RST 38 */
+		b = 0x38;
+	__RST:
+		RST(b); NEXT;
+			
+	OP(0xC1) /* POP BC */
+		POP(BC); NEXT;
+	OP(0xC5) /* PUSH BC */
+		PUSH(BC); NEXT;
+	OP(0xD1) /* POP DE */
+		POP(DE); NEXT;
+	OP(0xD5) /* PUSH DE */
+		PUSH(DE); NEXT;
+	OP(0xE1) /* POP HL */
+		POP(HL); NEXT;
+	OP(0xE5) /* PUSH HL */
+		PUSH(HL); NEXT;
+	OP(0xF1) /* POP AF */
+		POP(AF); AF &= 0xfff0; NEXT;
+	OP(0xF5) /* PUSH AF */
+		PUSH(AF); NEXT;
+
+	OP(0xE8) /* ADD SP,imm */
+		{
+			/* https://gammpei.github.io/blog/posts/2018-03-04/how-to-write-a-game-boy-emulator-part-8-blarggs-cpu-test-roms-1-3-4-5-7-8-9-10-11.html */
+			signed char v = (signed char) FETCH;
+			int temp = (int)(SP) + (int)v;
+
+			byte half_carry = ((SP & 0xff) ^ v ^ temp) & 0x10;
+
+			F &= ~(FZ | FN | FH | FC);
+
+			if (half_carry) F |= FH;
+			if ((SP & 0xff) + (byte)v > 0xff) F |= FC;
+
+			SP = temp & 0xffff;
+		}
+		NEXT;
+
+
+	OP(0xF3) /* DI */
+		DI; NEXT;
+	OP(0xFB) /* EI */
+		EI; cpu.evnext = 0; NEXT;
+
+	OP(0x37) /* SCF */
+		SCF; NEXT;
+	OP(0x3F) /* CCF */
+		CCF; NEXT;
+
+	OP(0x10) /* STOP */
+		PC++;
+		if (R_KEY1 & 1)
+		{
+			cpu_sync();
+			cpu.speed = cpu.speed ^ 1;
+			R_KEY1 = (R_KEY1 & 0x7E) | (cpu.speed << 7);
+			/* count STOP at the new speed, then leave so that
+			 * cpu_emulate can switch to the other variant */
+			clen = (clen << 1) >> cpu.speed;
+			i -= clen;
+			cpu.evcnt += clen;
+			goto out;
+		}
+		/* NOTE - we do not implement dmg STOP whatsoever */
+		NEXT;
+			
+	OP(0x76) /* HALT */
+		cpu.halt = 1;
+		cpu.evnext = 0;
+		NEXT;
+
+	OP(0xCB) /* CB prefix */
+		cbop = FETCH;
+		clen = cb_cycles_table[cbop];
+		DISPATCH(cb_optable, cbop)
+		{
+			CB_REG_CASES(B, 0, 8, , NEXT);
+			CB_REG_CASES(C, 1, 9, , NEXT);
+			CB_REG_CASES(D, 2, A, , NEXT);
+			CB_REG_CASES(E, 3, B, , NEXT);
+			CB_REG_CASES(H, 4, C, , NEXT);
+			CB_REG_CASES(L, 5, D, , NEXT);
+			CB_REG_CASES(b, 6, E, b = readb(xHL), writeb(xHL, b); NEXT);
+			CB_REG_CASES(A, 7, F, , NEXT);
+		}
+		NEXT;
+			
+	OP(0xD3) OP(0xDB) OP(0xDD) OP(0xE3) OP(0xE4) OP(0xEB)
+	OP(0xEC) OP(0xED) OP(0xF4) OP(0xFC) OP(0xFD)
+		SAVE_REGS;
+		die(
+			"invalid opcode 0x%02X at address 0x%04X, rombank = %d\n",
+			op, (PC-1) & 0xffff, mbc.rombank);
+		NEXT;
+	}
+
+	CYCLES;
+slow:
+	if (cpu.cut > 0)
+	{
+		/* the lcd went off; stop where the line would have ended */
+		clen = cpu.cut - cpu.evcnt;
+		if (i > clen)
+		{
+			cycles -= i - clen;
+			i = clen;
+		}
+		cpu.cut = -1;
+	}
+	if (cpu.evcnt >= cpu.evnext)
+		cpu_sync();
+#if ACCURACY >= ACC_BALANCED
+	/* dma took the bus; the time passes, with the cpu standing by */
+	while (cpu.stall)
+	{
+		i -= cpu.stall;
+		cpu.evcnt += cpu.stall;
+		cpu.stall = 0;
+		if (cpu.evcnt >= cpu.evnext)
+			cpu_sync();
+	}
+#endif
+	if (i > 0) goto next;
+out:
+	cpu_sync();
+	SAVE_REGS;
+	cpu.insns += ninsn;
+	if (DEBUG_HOOKED) debug_end(cycles-i);
+	return cycles-i;
+}
+
@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "defs.h"
 #include "cpu.h"
@@ -9,11 +10,20 @@
 #include "fastmem.h"
 #include "regs.h"
 #include "rc.h"
+#include "debug.h"
+#include "profile.h"
+#include "lcd.h"
+#include "gdbstub.h"
+#include "loader.h"
+#include "until.h"
+#include "diag.h"
 
 #include "cpuregs.h"
 
 
-static char *mnemonic_table[256] =
+/* arrays of chars rather than pointers, which would need relocating
+   at load time in every process; these stay in the shared rodata */
+static const char mnemonic_table[256][16] =
 {
 	"NOP",
 	"LD BC,%w",
@@ -218,7 +228,7 @@ static char *mnemonic_table[256] =
 	"RET Z",
 	"RET",
 	"JP Z,%w",
-	NULL,
+	"",
 	"CALL Z,%w",
 	"CALL %w",
 	"ADC A,%b",
@@ -226,7 +236,7 @@ static char *mnemonic_table[256] =
 	"RET NC",
 	"POP DE",
 	"JP NC,%w",
-	NULL,
+	"",
 	"CALL NC,%w",
 	"PUSH DE",
 	"SUB %b",
@@ -234,32 +244,32 @@ static char *mnemonic_table[256] =
 	"RET C",
 	"RETI",
 	"JP C,%w",
-	NULL,
+	"",
 	"CALL C,%w",
-	NULL,
+	"",
 	"SBC A,%b",
 	"RST 18h",
 	"LD (FF00+%b),A",
 	"POP HL",
 	"LD (FF00+C),A",
-	NULL,
-	NULL,
+	"",
+	"",
 	"PUSH HL",
 	"AND %b",
 	"RST 20h",
 	"ADD SP,%o",
 	"JP HL",
 	"LD (%w),A",
-	NULL,
-	NULL,
-	NULL,
+	"",
+	"",
+	"",
 	"XOR %b",
 	"RST 28h",
 	"LD A,(FF00+%b)",
 	"POP AF",
 	"LD A,(FF00+C)",
 	"DI",
-	NULL,
+	"",
 	"PUSH AF",
 	"OR %b",
 	"RST 30h",
@@ -267,13 +277,13 @@ static char *mnemonic_table[256] =
 	"LD SP,HL",
 	"LD A,(%w)",
 	"EI",
-	NULL,
-	NULL,
+	"",
+	"",
 	"CP %b",
 	"RST 38h"
 };
 
-static char *cb_mnemonic_table[256] =
+static const char cb_mnemonic_table[256][16] =
 {
 	"RLC B",
 	"RLC C",
@@ -533,7 +543,7 @@ static char *cb_mnemonic_table[256] =
 	"SET 7,A"
 };
 
-static byte operand_count[256] =
+static const byte operand_count[256] =
 {
 	1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
 	1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
@@ -557,91 +567,133 @@ static byte operand_count[256] =
 /* replace with a real interactive debugger eventually... */
 
 int debug_trace = 0;
+int bintrace = 0;
+static char *bintracefile;
+static char *breakcmd;
 
 rcvar_t debug_exports[] =
 {
 	RCV_BOOL("trace", &debug_trace, "print debug trace for each CPU insn"),
+	RCV_INT("bintrace", &bintrace, "CPU insns to keep in the binary trace ring, 0 = off"),
+	RCV_STRING("bintracefile", &bintracefile, "file bintracedump writes to"),
+	RCV_STRING("breakcmd", &breakcmd, "command run when a breakpoint or watchpoint hits"),
 	RCV_END
 };
 
-void debug_disassemble(addr a, int c)
+/* the length of the instruction starting with op */
+int debug_oplen(byte op)
 {
-	static int i, j, k;
-	static byte code;
-	static byte ops[3];
-	static int opaddr;
-	static char mnemonic[256];
-	static char *pattern;
+	return operand_count[op];
+}
 
-	if (!debug_trace) return;
-	while (c > 0)
+/* writes the mnemonic for the instruction in ops to out, which needs
+   room for 32 chars, and returns its length */
+int debug_mnemonic(char *out, byte *ops)
+{
+	const char *pattern;
+	int i, j, k;
+
+	k = 1;
+	if (ops[0] != 0xCB)
 	{
-		k = 0;
-		opaddr = a;
-		code = ops[k++] = readb(a); a++;
-		if (code != 0xCB)
+		pattern = mnemonic_table[ops[0]];
+		if (!*pattern)
+			pattern = "***INVALID***";
+	}
+	else pattern = cb_mnemonic_table[ops[k++]];
+	i = j = 0;
+	while (pattern[i])
+	{
+		if (pattern[i] == '%')
 		{
-			pattern = mnemonic_table[code];
-			if (!pattern)
-				pattern = "***INVALID***";
+			switch (pattern[++i])
+			{
+			case 'B':
+			case 'b':
+				j += sprintf(out + j, "%02Xh", ops[k++]);
+				break;
+			case 'W':
+			case 'w':
+				j += sprintf(out + j, "%04Xh",
+					((ops[k+1] << 8) | ops[k]));
+				k += 2;
+				break;
+			case 'O':
+			case 'o':
+				j += sprintf(out + j, "%+d", (n8)(ops[k++]));
+				break;
+			}
+			i++;
 		}
 		else
 		{
-			code = ops[k++] = readb(a); a++;
-			pattern = cb_mnemonic_table[code];
+			out[j++] = pattern[i++];
+		}
+	}
+	out[j] = 0;
+	return operand_count[ops[0]];
+}
+
+/* the instruction op is, or CB op if cb is set, with n, nn or e where
+   its operand goes */
+void debug_opname(char *out, int op, int cb)
+{
+	const char *pattern = cb ? cb_mnemonic_table[op] : mnemonic_table[op];
+
+	if (!*pattern) pattern = "***INVALID***";
+	for (; *pattern; pattern++)
+	{
+		if (*pattern != '%')
+		{
+			*(out++) = *pattern;
+			continue;
 		}
-		i = j = 0;
-		while (pattern[i])
+		switch (*(++pattern))
 		{
-			if (pattern[i] == '%')
-			{
-				switch (pattern[++i])
-				{
-				case 'B':
-				case 'b':
-					ops[k] = readb(a); a++;
-					j += sprintf(mnemonic + j,
-						"%02Xh", ops[k++]);
-					break;
-				case 'W':
-				case 'w':
-					ops[k] = readb(a); a++;
-					ops[k+1] = readb(a); a++;
-					j += sprintf(mnemonic + j, "%04Xh",
-						((ops[k+1] << 8) | ops[k]));
-					k += 2;
-					break;
-				case 'O':
-				case 'o':
-					ops[k] = readb(a); a++;
-					j += sprintf(mnemonic + j, "%+d",
-						(n8)(ops[k++]));
-					break;
-				}
-				i++;
-			}
-			else
-			{
-				mnemonic[j++] = pattern[i++];
-			}
+		case 'B': case 'b': out += sprintf(out, "n"); break;
+		case 'W': case 'w': out += sprintf(out, "nn"); break;
+		case 'O': case 'o': out += sprintf(out, "e"); break;
 		}
-		mnemonic[j] = 0;
-		printf("%04X ", opaddr);
-		switch (operand_count[ops[0]]) {
+	}
+	*out = 0;
+}
+
+void debug_disassemble(addr a, int c)
+{
+	static byte ops[3];
+	static int opaddr;
+	static char mnemonic[256];
+	char hex[12];
+	int i, n;
+
+	if (!debug_trace) return;
+	while (c > 0)
+	{
+		opaddr = a;
+		ops[0] = readb(a);
+		n = operand_count[ops[0]];
+		for (i = 1; i < n; i++)
+			ops[i] = readb(a + i);
+		a += n;
+		debug_mnemonic(mnemonic, ops);
+		switch (n) {
 		case 1:
-			printf("%02X       ", ops[0]);
+			sprintf(hex, "%02X", ops[0]);
 			break;
 		case 2:
-			printf("%02X %02X    ", ops[0], ops[1]);
+			sprintf(hex, "%02X %02X", ops[0], ops[1]);
 			break;
 		case 3:
-			printf("%02X %02X %02X ", ops[0], ops[1], ops[2]);
+			sprintf(hex, "%02X %02X %02X", ops[0], ops[1], ops[2]);
 			break;
 		}
-		printf("%-16.16s", mnemonic);
-		printf(
+		/* the whole line in one go, never dropped (see diag.c) */
+		diag(DIAG_ALL,
+			"%04X %-9s%-16.16s"
 			" SP=%04X.%04X BC=%04X.%02X.%02X DE=%04X.%02X "
-			"HL=%04X.%02X A=%02X F=%02X %c%c%c%c%c",
+			"HL=%04X.%02X A=%02X F=%02X %c%c%c%c%c"
+			" IE=%02X IF=%02X LCDC=%02X STAT=%02X LY=%02X LYC=%02X\n",
+			opaddr, hex, mnemonic,
 			SP, readw(SP),
 			BC, readb(BC), readb(0xFF00 | C),
 			DE, readb(DE),
@@ -650,40 +702,402 @@ void debug_disassemble(addr a, int c)
 			((F & 0x80) ? 'Z' : '-'),
 			((F & 0x40) ? 'N' : '-'),
 			((F & 0x20) ? 'H' : '-'),
-			((F & 0x10) ? 'C' : '-')
-		);
-		printf(
-			" IE=%02X IF=%02X LCDC=%02X STAT=%02X LY=%02X LYC=%02X",
+			((F & 0x10) ? 'C' : '-'),
 			R_IE, R_IF, R_LCDC, R_STAT, R_LY, R_LYC
 		);
-		printf("\n");
-		fflush(stdout);
 		c--;
 	}
 }
 
 
+/*
+ * The binary trace. printing every instruction as text is a hundred
+ * times slower than running it, so with "bintrace" set the cpu just
+ * drops a fixed size record of each one into a ring of that many,
+ * and "bintracedump" (or exit) writes the ring out for
+ * gnuboy-tracedump to disassemble at leisure. It keeps the last
+ * stretch before whatever went wrong, however far into the run.
+ *
+ * The file is "GBtr", the record count (4 bytes), then records of
+ * cycle (4), PC, bank, AF, BC, DE, HL, SP (2 each), the instruction
+ * bytes (3) and IME (1), 22 bytes in all, little endian. The cycle
+ * counts from when tracing began. The bank is whichever one is
+ * mapped at PC: rom bank, sram bank or wram bank, else 0.
+ */
+
+static struct rec
+{
+	un32 cycle;
+	word pc, bank, af, bc, de, hl, sp;
+	byte ops[3], ime;
+} *ring;
+static int ringsize, ringhead, ringcount;
+static un32 tracecyc, tracebase;
+
+static int bankof(word pc)
+{
+	int n;
+
+	switch (pc >> 12)
+	{
+	case 0x4: case 0x5: case 0x6: case 0x7:
+		return mbc.rombank;
+	case 0xA: case 0xB:
+		return mbc.rambank;
+	case 0xD:
+		n = R_SVBK & (WRAMBANKS - 1);
+		return n ? n : 1;
+	}
+	return 0;
+}
+
+static void record()
+{
+	struct rec *r;
+	int i, n;
+
+	if (ringsize != bintrace)
+	{
+		free(ring);
+		ringsize = (ring = malloc(bintrace * sizeof *ring)) ? bintrace : 0;
+		ringhead = ringcount = 0;
+		if (!ringsize) return;
+	}
+	r = ring + ringhead;
+	r->cycle = tracecyc;
+	r->pc = PC;
+	r->bank = bankof(PC);
+	r->af = AF;
+	r->bc = BC;
+	r->de = DE;
+	r->hl = HL;
+	r->sp = SP;
+	r->ime = IME;
+	r->ops[0] = readb(PC);
+	n = operand_count[r->ops[0]];
+	for (i = 1; i < 3; i++)
+		r->ops[i] = i < n ? readb(PC + i) : 0;
+	if (++ringhead == ringsize) ringhead = 0;
+	if (ringcount < ringsize) ringcount++;
+}
+
+static void put(FILE *f, un32 v, int n)
+{
+	while (n--)
+	{
+		fputc(v & 0xff, f);
+		v >>= 8;
+	}
+}
+
+int debug_bintracedump(char *name)
+{
+	FILE *f;
+	struct rec *r;
+	int i;
+
+	if (!ringcount) return 0;
+	if (!name) name = bintracefile && *bintracefile ? bintracefile : "gnuboy-trace.bin";
+	if (!(f = fopen(name, "wb"))) return -1;
+	fwrite("GBtr", 4, 1, f);
+	put(f, ringcount, 4);
+	for (i = 0; i < ringcount; i++)
+	{
+		r = ring + (ringhead - ringcount + i + ringsize) % ringsize;
+		put(f, r->cycle, 4);
+		put(f, r->pc, 2);
+		put(f, r->bank, 2);
+		put(f, r->af, 2);
+		put(f, r->bc, 2);
+		put(f, r->de, 2);
+		put(f, r->hl, 2);
+		put(f, r->sp, 2);
+		fwrite(r->ops, 3, 1, f);
+		fputc(r->ime, f);
+	}
+	return fclose(f) ? -1 : 0;
+}
+
 
+/*
+ * Breakpoints and watchpoints. Neither costs anything where it isn't
+ * set. A PC breakpoint sets a bit in breakbits and keeps debug_stops
+ * up, so cpu_emulate stops in debug_insn before every instruction and
+ * looks the PC up there; with none set the cpu runs unhooked. A
+ * watchpoint takes its page out of the memory maps (see mem.c), so
+ * only accesses to that 4k page take the slow way, through mem_read
+ * and mem_write, which hand them to debug_watch. Reads count
+ * instruction fetches, and the debugger's own reads don't count.
+ *
+ * A hit goes to gdb if it's attached (see gdbstub.c). Otherwise it
+ * prints a line and runs breakcmd, if it's set, as an rc command:
+ * "menu" to stop there, "bintracedump" for how it got there, "set
+ * trace 1" to follow it from there, and so on. A watchpoint hit has
+ * no PC of its own, since the cpu is midway through the instruction;
+ * it's reported before the next one, with that PC. The bitmaps are
+ * only allocated once the first of either is set.
+ *
+ * With debug_watchhook set, as libgnuboy's gb_watch does, watched
+ * accesses go to it as they happen instead, and nothing stops.
+ */
 
+#define MAXBREAK 64
 
+int debug_stops;
+void (*debug_watchhook)(int a, byte b, int write);
+static byte *breakbits, (*watchbits)[8192];
+static struct { int bank, addr; } breaks[MAXBREAK];
+static int nbreaks, peeking;
+static int hit, hitaddr, hitval, hitwrite, halt;
 
+#define BIT(bits, a) ((bits)[(a) >> 3] & (1 << ((a) & 7)))
 
+static int makebits()
+{
+	if (!breakbits && (breakbits = calloc(3, 8192)))
+		watchbits = (void *)(breakbits + 8192);
+	return breakbits ? 0 : -1;
+}
 
+static void restops()
+{
+	debug_stops = nbreaks + hit + (halt != 0);
+}
 
+static void stop(char *why)
+{
+	if (gdb_attached())
+	{
+		gdb_stop(why);
+		return;
+	}
+	diag_flush();
+	if (breakcmd && *breakcmd) rc_command(breakcmd);
+}
 
+/* bank -1 is any bank */
+int debug_setbreak(int bank, int a, int on)
+{
+	int i, j;
 
+	if (makebits()) return -1;
+	a &= 0xffff;
+	for (i = 0; i < nbreaks; i++)
+		if (breaks[i].addr == a && breaks[i].bank == bank)
+			break;
+	if (on && i == nbreaks)
+	{
+		if (nbreaks == MAXBREAK) return -1;
+		breaks[nbreaks].bank = bank;
+		breaks[nbreaks].addr = a;
+		nbreaks++;
+	}
+	else if (!on && i < nbreaks)
+		breaks[i] = breaks[--nbreaks];
+	breakbits[a >> 3] &= ~(1 << (a & 7));
+	for (j = 0; j < nbreaks; j++)
+		if (breaks[j].addr == a)
+			breakbits[a >> 3] |= 1 << (a & 7);
+	restops();
+	return 0;
+}
 
+void debug_clearbreaks()
+{
+	if (breakbits) memset(breakbits, 0, 8192);
+	nbreaks = 0;
+	restops();
+}
 
+/* how: 1 for reads, 2 for writes, 3 for both; on adds those to the
+   watched accesses of len bytes from a, otherwise takes them away */
+void debug_setwatch(int a, int len, int how, int on)
+{
+	int i, j, page, mask;
 
+	if (makebits()) return;
+	for (i = 0; i < len; i++, a++)
+	{
+		a &= 0xffff;
+		for (j = 0; j < 2; j++)
+		{
+			if (!(how & (1 << j))) continue;
+			if (on) watchbits[j][a >> 3] |= 1 << (a & 7);
+			else watchbits[j][a >> 3] &= ~(1 << (a & 7));
+		}
+	}
+	for (j = 0; j < 2; j++)
+	{
+		mask = 0;
+		for (page = 0; page < 16; page++)
+			for (i = page << 9; i < (page + 1) << 9; i++)
+				if (watchbits[j][i])
+				{
+					mask |= 1 << page;
+					break;
+				}
+		if (j) mem_wwatch = mask;
+		else mem_rwatch = mask;
+	}
+	mem_updatemap();
+	mem_updatehi();
+}
 
+int debug_watching(int a, int write)
+{
+	return watchbits && BIT(watchbits[write != 0], a) != 0;
+}
 
+/* mem.c calls this for every access to a watched page */
+void debug_watch(int a, byte b, int write)
+{
+	if (peeking || hit || !watchbits || !BIT(watchbits[write != 0], a))
+		return;
+	if (!write && until_fetch(a, bankof(a))) return;
+	if (debug_watchhook)
+	{
+		debug_watchhook(a, b, write);
+		return;
+	}
+	hit = 1;
+	hitaddr = a;
+	hitval = b;
+	hitwrite = write;
+	restops();
+	cpu.evnext = 0;
+}
 
+/* stop before the next instruction whatever it is, reporting signal
+   sig to gdb: for single steps and interrupts from the debugger */
+void debug_stopnext(int sig)
+{
+	halt = sig;
+	restops();
+	cpu.evnext = 0;
+}
 
+static void checkstops()
+{
+	int i, bank;
+	char why[32];
 
+	if (halt)
+	{
+		sprintf(why, "S%02X", halt);
+		halt = 0;
+		restops();
+		stop(why);
+		return;
+	}
+	if (hit)
+	{
+		hit = 0;
+		restops();
+		if (!gdb_attached())
+			diag(0, "watch: %04X %s %02X, at %02X:%04X\n", hitaddr,
+				hitwrite ? "written" : "read", hitval, bankof(PC), PC);
+		sprintf(why, "T05%swatch:%04X;", hitwrite ? "" : "r", hitaddr);
+		stop(why);
+		return;
+	}
+	if (!breakbits || !BIT(breakbits, PC)) return;
+	bank = bankof(PC);
+	for (i = 0; i < nbreaks; i++)
+		if (breaks[i].addr == PC
+			&& (breaks[i].bank < 0 || breaks[i].bank == bank))
+			break;
+	if (i == nbreaks) return;
+	if (!gdb_attached()) diag(0, "break: %02X:%04X\n", bank, PC);
+	stop("T05swbreak:;");
+}
 
+/*
+ * Memory as the debugger sees it, without setting off watchpoints.
+ * Addresses above FFFF pick a bank, (bank << 16) | addr, for the
+ * banked regions (rom at 4000, vram, sram, wram at D000); below that
+ * it's whatever is mapped now. Writes below 8000 patch the rom
+ * rather than talking to the mbc, unless the rom is mapped from a
+ * file or shared (see rom_shared). -1 if there's no such memory, or
+ * it can't be written.
+ */
 
+int debug_peek(int a)
+{
+	int bank = a >> 16, b;
 
+	a &= 0xffff;
+	if (bank && a >= 0x4000 && a < 0x8000)
+	{
+		if (bank >= mbc.romsize) return -1;
+		if (rom_lazy) rom_unpack(bank);
+		return rom.bank[bank][a & 0x3fff];
+	}
+	if (bank && a >= 0x8000 && a < 0xA000)
+		return bank < 2 ? lcd.vbank[bank][a & 0x1fff] : -1;
+	if (bank && a >= 0xA000 && a < 0xC000)
+		return bank < mbc.ramsize ? ram.sbank[bank][a & 0x1fff] : -1;
+	if (bank && a >= 0xD000 && a < 0xE000)
+		return bank < WRAMBANKS ? ram.ibank[bank][a & 0x0fff] : -1;
+	if (bank) return -1;
+	peeking++;
+	b = readb(a);
+	peeking--;
+	return b;
+}
 
+int debug_poke(int a, byte b)
+{
+	int bank = a >> 16;
 
+	if (!bank && (a & 0xffff) < 0x8000)
+		bank = (a & 0xffff) < 0x4000 ? 0 : mbc.rombank;
+	else if (!bank)
+	{
+		peeking++;
+		writeb(a, b);
+		peeking--;
+		return 0;
+	}
+	a &= 0xffff;
+	if (a < 0x8000 && bank < mbc.romsize)
+	{
+		/* a mapped rom is read-only, and may not be ours */
+		if (rom_shared()) return -1;
+		if (rom_lazy) rom_unpack(bank);
+		rom.bank[bank][a & 0x3fff] = b;
+	}
+	else if (a >= 0x8000 && a < 0xA000 && bank < 2)
+	{
+		lcd.vbank[bank][a & 0x1fff] = b;
+		vram_dirty();
+	}
+	else if (a >= 0xA000 && a < 0xC000 && bank < mbc.ramsize)
+		ram.sbank[bank][a & 0x1fff] = b;
+	else if (a >= 0xD000 && a < 0xE000 && bank < WRAMBANKS)
+		ram.ibank[bank][a & 0x0fff] = b;
+	else return -1;
+	/* behind the trackers' backs, so they have to look at it all */
+	mem_alldirty();
+	return 0;
+}
 
+/* cpu_emulate calls this before each instruction while DEBUG_HOOKED,
+   with the cycles it has run so far in this timeslice */
+void debug_insn(int elapsed)
+{
+	tracecyc = tracebase + elapsed;
+	peeking++;
+	if (profiling) prof_insn(elapsed);
+	if (opcounting) prof_op();
+	if (bintrace > 0) record();
+	debug_disassemble(PC, 1);
+	peeking--;
+	if (debug_stops) checkstops();
+}
 
+/* and this when it returns */
+void debug_end(int elapsed)
+{
+	tracebase += elapsed;
+	if (profiling) prof_end(elapsed);
+}
@@ -1,26 +1,77 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "defs.h"
 #include "regs.h"
 #include "hw.h"
 #include "cpu.h"
+#include "lcdc.h"
 #include "mem.h"
 #include "lcd.h"
+#include "fb.h"
 #include "rc.h"
+#include "rckeys.h"
+#include "input.h"
 #include "rtc.h"
 #include "sys.h"
 #include "sound.h"
+#include "pcm.h"
+#include "rewind.h"
+#include "loader.h"
+#include "save.h"
+#include "movie.h"
+#include "timeline.h"
+#include "gdbstub.h"
+#include "netlink.h"
+#include "netplay.h"
+#include "stream.h"
+#include "cheat.h"
+#include "capture.h"
+#include "stats.h"
 #include "cpu.h"
+#include "emu.h"
+#include "until.h"
+#include "alloccheck.h"
 
 
 static int framelen = 16743;
 static int framecount;
 static int paused;
+static int frameskip, autoskip;
+static int ffspeed = 4;
+static int fastfwd, ffdraw;
+static int runahead;
+static int lateinput;
+static int timedinput;
+static int audioclock;
+static int jitmargin;
+static int whenhidden;
+/* cpu and real-time priority for each of the threads emu_pin knows */
+static int pincpu[3] = { -1, -1, -1 }, pinprio[3];
+static int pinfailed[3];
 
 rcvar_t emu_exports[] =
 {
 	RCV_INT("framelen", &framelen, ""),
 	RCV_INT("framecount", &framecount, ""),
+	RCV_INT("frameskip", &frameskip, "frames not drawn after each one that is"),
+	RCV_INT("autoframeskip", &autoskip, "most frames to skip in a row when running slow, 0 = off"),
+	RCV_INT("ffspeed", &ffspeed, "speed while fast forwarding, 0 = as fast as possible"),
+	RCV_INT("runahead", &runahead, "frames to run ahead of the one shown, 0 = off"),
+	RCV_INT("lateinput", &lateinput, "look at the pad again when the game first reads it each frame"),
+	RCV_BOOL("timedinput", &timedinput, "give the game each press at the point in the frame it came"),
+	RCV_INT("audioclock", &audioclock, "pace by the sound device, keeping this many ms queued, 0 = off"),
+	RCV_INT("jitmargin", &jitmargin, "start each frame late, to be done this many us before it's due, 0 = off"),
+	RCV_INT("whenhidden", &whenhidden, "while the window is minimized: 0 = run on, 1 = run slowly and quietly, 2 = stop"),
+	RCV_INT("inputdrops", &ev_drops, "input events lost to a full queue"),
+	RCV_INT("emucpu", &pincpu[PIN_EMU], "cpu to keep the emulation on, -1 = any"),
+	RCV_INT("emuprio", &pinprio[PIN_EMU], "real-time priority for the emulation, 0 = off"),
+	RCV_INT("audiocpu", &pincpu[PIN_AUDIO], "cpu to keep the sound thread on, -1 = any"),
+	RCV_INT("audioprio", &pinprio[PIN_AUDIO], "real-time priority for the sound thread, 0 = off"),
+	RCV_INT("presentcpu", &pincpu[PIN_PRESENT], "cpu to keep the presenter thread on, -1 = any"),
+	RCV_INT("presentprio", &pinprio[PIN_PRESENT], "real-time priority for the presenter thread, 0 = off"),
 	RCV_END
 };
 
@@ -34,6 +85,28 @@ int emu_paused(void) {
 	return paused;
 }
 
+void emu_fastforward(int on) {
+	if (on && !fastfwd) ffdraw = 1;
+	fastfwd = on;
+}
+
+int emu_fastforwarding(void) {
+	return fastfwd;
+}
+
+/* put the calling thread, which is the one named by what, where
+   emucpu and so on say; failing only gets a warning, once */
+void emu_pin(int what)
+{
+	static char *names[3] = { "emulation", "sound", "presenter" };
+
+	if (pincpu[what] < 0 && pinprio[what] <= 0) return;
+	if (!sys_pin(pincpu[what], pinprio[what]) || pinfailed[what]) return;
+	fprintf(stderr, "warning: couldn't put the %s thread on cpu %d at priority %d\n",
+		names[what], pincpu[what], pinprio[what]);
+	pinfailed[what] = 1;
+}
+
 void emu_init()
 {
 	
@@ -54,15 +127,29 @@ void emu_reset()
 	mbc_reset();
 	sound_reset();
 	mem_mapbootrom();
+	bootrom_reset();
+	until_reset();
 }
 
 
 
 
 
-void emu_step()
+/*
+ * emu_step runs to the lcdc horizon, often all the way to vblank. When
+ * the lcd is switched off on the way, LY drops to 0 and the frame is
+ * over, so lcdc_change arms cpu.cut and the slice stops where a step
+ * of one line would have. Other slices (the 2280 cycles at the top of
+ * vblank, say) run their full length as they always did.
+ */
+int emu_step()
 {
-	cpu_emulate(cpu.lcdc);
+	int n;
+
+	cpu.cut = -1;
+	n = cpu_emulate(lcdc_horizon());
+	cpu.cut = 0;
+	return n;
 }
 
 
@@ -72,37 +159,407 @@ void emu_step()
 
 void *sys_timer();
 
-void emu_run()
+/* whether to leave the next frame undrawn. used is how long the one
+   just emulated took; with autoframeskip a frame is skipped whenever
+   the previous one couldn't keep up, but never more than autoskip of
+   them in a row, so the picture still moves */
+static int skipnext(int used)
+{
+	static int skipped;
+
+	if (frameskip > 0)
+	{
+		if (skipped < frameskip) return ++skipped;
+	}
+	else if (autoskip > 0 && used > framelen && skipped < autoskip)
+		return ++skipped;
+	skipped = 0;
+	return 0;
+}
+
+/* pcm_submit and sys_sleep, marked on the frame timeline */
+static int submit()
+{
+	int ret;
+
+	TL_BEGIN(TL_SUBMIT);
+	ret = pcm_submit();
+	TL_END(TL_SUBMIT);
+	return ret;
+}
+
+/* timed is set while timedinput is in effect; framestart is when
+   the frame being emulated began, lastframe when the one before did */
+static int timed;
+static unsigned framestart, lastframe;
+
+static void sleepfor(int us)
 {
-	void *timer = sys_timer();
-	int delay;
+	unsigned end;
+	int left;
+
+	TL_BEGIN(TL_SLEEP);
+	/* with timedinput, backends that have to be polled are polled
+	   every millisecond or so, to stamp what they post near enough
+	   to when it happened */
+	if (timed)
+	{
+		end = sys_micros() + us;
+		while ((left = end - sys_micros()) > 1000)
+		{
+			sys_sleep(1000);
+			ev_poll(0);
+		}
+		us = left;
+	}
+	sys_sleep(us);
+	TL_END(TL_SLEEP);
+}
+
+/*
+ * With audioclock the sound device's clock sets the pace instead of
+ * framelen and sys_sleep: whenever the cycles owed have run, the
+ * sound made so far is queued, we wait for the queue to drain to
+ * audioclock ms, and then owe as many cycles as it takes to fill it
+ * back up by CLOCKSLICE. That happens between steps, anywhere in the
+ * frame, so the sound goes out in small even pieces rather than a
+ * frame at a time, and the video is shown whenever a frame is done.
+ * Backends that can't say how much they hold (pcm_queued) are paced
+ * the usual way. waited is how long was spent waiting this frame.
+ */
+
+#define CLOCKSLICE 4000
+/* cycles a second, as cpu_emulate counts them */
+#define CLOCKHZ 2097152
+
+static int clocked, owed, waited;
+
+static void pace(int cycles)
+{
+	int q, low = audioclock * 1000;
+
+	if ((owed -= cycles) > 0) return;
+	sound_mix();
+	capture_pcm();
+	submit();
+	if ((q = pcm_queued()) > low)
+	{
+		sleepfor(q - low);
+		waited += q - low;
+		q = pcm_queued();
+	}
+	if (q < 0) q = low;
+	owed += (low + CLOCKSLICE - q) * (long long)CLOCKHZ / 1000000;
+}
+
+/*
+ * With vsync, vid_end waits for the display; a frame started as soon
+ * as the one before it was shown is ready long before it can be, and
+ * so is the input it was made from. With jitmargin set, jitwait waits
+ * at the start of each frame instead, until there's only just time to
+ * make it: jitbusy, the longest that polling, emulating and drawing a
+ * frame has taken lately, plus jitmargin us to spare. jitbusy
+ * follows a slower frame at once and a quicker one only gradually.
+ */
+
+static int jitbusy;
+
+static void jitwait()
+{
+	int us = framelen - jitbusy - jitmargin;
+
+	if (us <= 0) return;
+	sleepfor(us);
+	waited += us;
+}
+
+static void jitmeasure(int busy)
+{
+	if (busy > jitbusy) jitbusy = busy;
+	else jitbusy -= (jitbusy - busy) / 16;
+}
+
+/*
+ * While the front end says its window can't be seen (fb.hidden), with
+ * whenhidden 1 the game goes on at 1/HIDDENSLOW speed with the sound
+ * paused, and with 2 it stops altogether: we sit in ev_poll, which
+ * blocks where the backend can, until the window comes back or the
+ * emulator is paused, and only the events that come in get handled.
+ * quiet is set while the sound is paused for it.
+ */
+
+#define HIDDENSLOW 4
+/* how often to look again, for backends whose ev_poll can't wait */
+#define HIDDENNAP 50000
 
+static int quiet;
+
+static void hideaway(void *timer)
+{
+	int hide = fb.hidden && whenhidden > 0 && !paused;
+
+	if (hide != quiet) pcm_pause(quiet = hide);
+	if (!hide || whenhidden < 2) return;
+	while (fb.hidden && !paused)
+	{
+		ev_poll(1);
+		doevents();
+		if (fb.hidden) sys_nap(HIDDENNAP);
+	}
+	pcm_pause(quiet = 0);
+	/* the time away isn't the frame's */
+	sys_elapsed(timer);
+}
+
+/* with fast forward on, frames run back to back and only some of
+   them are drawn and heard: every speed'th, paced so that speed
+   frames take one framelen, or with speed 0 about one per framelen
+   of real time and no pacing at all. the sound of the others is
+   dropped. ffdraw says whether the next frame is one that's shown.
+   a movie plays back this way too, as fast as it can */
+static void fastframe(int used, int speed)
+{
+	static int hidden, spent;
+
+	spent += used;
+	if (!ffdraw)
+	{
+		pcm.pos = 0;
+		hidden++;
+	}
+	else
+	{
+		if (!submit() && speed > 0)
+			sleepfor(framelen - spent);
+		hidden = spent = 0;
+	}
+	if (speed > 0) ffdraw = hidden >= speed - 1;
+	else ffdraw = spent + used >= framelen;
+}
+
+/* one whole frame, from the start of vblank to the start of the next,
+   the same way emu_run goes through it */
+void emu_frame()
+{
+	if (!(R_LCDC & 0x80))
+		cpu_emulate(32832);
+	while (R_LY > 0)
+		emu_step();
+	cpu_emulate(2280);
+	while (R_LY > 0 && R_LY < 144)
+		emu_step();
+}
+
+/* with runahead, the frame just emulated is never shown. instead we
+   save the state, run that many frames further on the current input
+   with no sound and only the last of them drawn, and go back. games
+   that take a frame or two to react to the pad then seem to react at
+   once. the state file doesn't hold everything the channels, the cpu
+   and memory tracking keep, so those structs are copied whole, and
+   only the pages, tiles and palette entries the frames changed are
+   put back and redrawn */
+static void runahead_frames()
+{
+	static byte *buf;
+	static int size;
+	struct cpu c;
+	struct hw h;
+	struct snd s;
+	struct rtc r;
+	struct dirty d;
+	byte *p;
+	int i, n = savestate_size();
+
+	if (n != size)
+	{
+		free(buf);
+		size = (buf = malloc(n)) ? n : 0;
+	}
+	if (!buf) return;
+	/* input taken in a frame that's thrown away would be lost */
+	pad_latepoll(0);
+	savestate_to_buffer(buf, size);
+	c = cpu, h = hw, s = snd, r = rtc, d = dirty;
+	/* so going back only looks at the pages the frames wrote */
+	mem_checkpoint();
+	p = pcm.buf;
+	pcm.buf = 0;
+	for (i = 1; i <= runahead; i++)
+	{
+		lcd_skipframe(i < runahead);
+		emu_frame();
+	}
+	lcd_flush();
+	pcm.buf = p;
+	loadstate_delta(buf, size, 1);
+	cpu = c, hw = h, snd = s, rtc = r, dirty = d;
+	mem_updatemap();
+}
+
+/* with lateinput, the pad is looked at again when the game first
+   reads it in a frame, after whatever time passed since doevents.
+   that's in the middle of an instruction, so only pad buttons are
+   handled here, and only up to the first event for anything else;
+   doevents takes care of the rest at the end of the frame */
+static void padevents()
+{
+	event_t ev;
+
+	ev_poll(0);
+	while (ev_peekevent(&ev))
+	{
+		if ((ev.type == EV_PRESS || ev.type == EV_RELEASE)
+			&& !rc_padkey(ev.code))
+			break;
+		ev_getevent(&ev);
+		if (ev.type == EV_PRESS || ev.type == EV_RELEASE)
+			rc_dokey(ev.code, ev.type != EV_RELEASE);
+	}
+}
+
+/* with timedinput, a frame is given the input that came while the
+   one before it was running and being waited on, spread over it as
+   it came: an event that came a third of the way through that time
+   goes in once the game is a third of the way down this frame, the
+   next time it reads the pad from there on. the frame starts at the
+   top of vblank, line 144. input that comes after the frame starts
+   is held back for the next one, and like with lateinput, anything
+   that isn't a pad button waits for doevents */
+static void timedevents()
+{
+	event_t ev;
+	unsigned len = framestart - lastframe;
+	int line = (R_LY + 154 - 144) % 154;
+
+	while (ev_peekevent(&ev))
+	{
+		if ((ev.type == EV_PRESS || ev.type == EV_RELEASE)
+			&& !rc_padkey(ev.code))
+			return;
+		if (len && (int)(ev.time - lastframe) > 0
+			&& (ev.time - lastframe) * 154ULL / len > (unsigned)line)
+		{
+			pad_latepoll(timedevents);
+			return;
+		}
+		ev_getevent(&ev);
+		if (ev.type == EV_PRESS || ev.type == EV_RELEASE)
+			rc_dokey(ev.code, ev.type != EV_RELEASE);
+	}
+}
+
+void emu_run()
+{
+	/* kept from one run to the next, as the loop starts again after
+	   every pause */
+	static void *timer;
+	int used, slept, skip = 0, fast, raw;
+	unsigned busy = sys_micros();
+	unsigned long am;
+	char *s;
+
+	if (!timer) timer = sys_timer();
+	else sys_elapsed(timer);
+
+	emu_pin(PIN_EMU);
 	vid_begin();
 	lcd_begin();
 	for (;;)
 	{
-		cpu_emulate(2280);
-		while (R_LY > 0 && R_LY < 144)
-			emu_step();
-		
+		am = ALLOC_MARK();
+		clocked = audioclock > 0 && !fastfwd && !movie_playing()
+			&& pcm_queued() >= 0;
+		pcm.clocked = clocked;
+		TL_BEGIN(TL_CPU);
+		if (clocked)
+		{
+			pace(cpu_emulate(2280));
+			while (R_LY > 0 && R_LY < 144)
+				pace(emu_step());
+		}
+		else
+		{
+			cpu_emulate(2280);
+			while (R_LY > 0 && R_LY < 144)
+				emu_step();
+		}
+		if (runahead > 0 && !skip)
+			runahead_frames();
+		TL_END(TL_CPU);
+
+		lcd_flush();
+		stats_draw();
+		if (jitmargin > 0) jitmeasure(sys_micros() - busy);
+		TL_BEGIN(TL_VID);
 		vid_end();
+		TL_END(TL_VID);
+		if ((s = until_frame())) die("finished, until %s\n", s);
 		rtc_tick();
 		sound_mix();
-		if (!pcm_submit())
+		capture_frame();
+		stream_frame();
+		/* the time spent waiting for the sound or for just in time
+		   is part of the frame's pace but not of its work */
+		raw = sys_elapsed(timer);
+		used = raw - waited;
+		fast = fastfwd || movie_playing();
+		if (fast) fastframe(used, fastfwd ? ffspeed : 0);
+		else if (clocked) submit();
+		else if (!submit())
+			sleepfor((quiet ? HIDDENSLOW : 1) * framelen - raw);
+		slept = sys_elapsed(timer) + waited;
+		stats_frame(used, slept);
+		/* what follows is the pad, commands and files */
+		ALLOC_CHECK(am, "the frame loop");
+		skip = fast ? !ffdraw : skipnext(used);
+		lcd_skipframe(skip || runahead > 0);
+		waited = 0;
+		if (jitmargin > 0 && !fast && !clocked && !quiet) jitwait();
+		busy = sys_micros();
+		pad_latepoll(0);
+		TL_BEGIN(TL_EVENTS);
+		doevents();
+		TL_END(TL_EVENTS);
+		hideaway(timer);
+		if (paused)
 		{
-			delay = framelen - sys_elapsed(timer);
-			sys_sleep(delay);
-			sys_elapsed(timer);
+			timed = 0;
+			ev_hold(0, 0);
+			return;
 		}
-		doevents();
-		if (paused) return;
+		gdb_poll();
+		netlink_frame();
+		movie_frame();
+		cheat_frame();
+		netplay_frame();
+		/* a movie only knows the pad as it was between frames */
+		if (lateinput && !movie_active()) pad_latepoll(padevents);
+		am = ALLOC_MARK();
+		rewind_frame();
+		ALLOC_CHECK(am, "rewind_frame");
+		loader_frame();
 		vid_begin();
+		if (timedinput && !movie_active())
+		{
+			lastframe = timed ? framestart : sys_micros();
+			framestart = sys_micros();
+			timed = 1;
+			ev_hold(1, framestart);
+			pad_latepoll(timedevents);
+		}
+		else if (timed)
+		{
+			timed = 0;
+			ev_hold(0, 0);
+		}
 		if (framecount) { if (!--framecount) die("finished\n"); }
+		TL_BEGIN(TL_CPU);
 		if (!(R_LCDC & 0x80))
 			cpu_emulate(32832);
 		
 		while (R_LY > 0) /* wait for next frame */
 			emu_step();
+		TL_END(TL_CPU);
 	}
 }
 
@@ -3,8 +3,19 @@
 
 void emu_run();
 void emu_reset();
+int emu_step();
+void emu_frame();
 void emu_pause(int paused);
 int emu_paused(void);
+void emu_fastforward(int on);
+int emu_fastforwarding(void);
+
+/* the threads emu_pin can be asked about, by the one that's running */
+#define PIN_EMU 0
+#define PIN_AUDIO 1
+#define PIN_PRESENT 2
+
+void emu_pin(int what);
 
 #endif
 
@@ -1,42 +1,132 @@
 /*
  * events.c
  *
- * Event queue.
+ * Event queue. Events may be posted from any thread, a joystick or
+ * network thread say, while the emulator takes them off in its own,
+ * so nothing here takes a lock. The queue is a ring in which every
+ * slot has a sequence number saying whose turn it is: a poster claims
+ * the next position by moving head on with a compare and swap, fills
+ * the slot, and only then sets its sequence to say it's there. When
+ * the ring is full the event is dropped, and counted in ev_drops,
+ * rather than anyone waiting.
+ *
+ * Each event is stamped with sys_micros() as it's posted. ev_hold
+ * keeps back everything posted from a given time on, so the emulator
+ * can take a frame's worth of input and leave what came after it.
  */
 
 
 #include "input.h"
+#include "sys.h"
 
 
 char keystates[MAX_KEYS];
 int nkeysdown;
+int ev_drops;
+
+/* a power of two */
+#define MAX_EVENTS 256
+#define MASK (MAX_EVENTS - 1)
+
+/* without atomics only one thread may post */
+#ifdef __ATOMIC_ACQUIRE
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define CLAIM(p, o) __atomic_compare_exchange_n(p, o, *(o) + 1, 1, \
+	__ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define COUNT(p) __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#else
+#define LOAD(p) (*(p))
+#define STORE(p, v) (*(p) = (v))
+#define CLAIM(p, o) (*(p) == *(o) ? (*(p) = *(o) + 1, 1) : (*(o) = *(p), 0))
+#define COUNT(p) ((*(p))++)
+#endif
+
+/* the sequence of the slot for position pos is kept less pos's place
+   in the ring, so that all zeros is an empty ring: pos & ~MASK when
+   it's free for pos, one more when pos has been posted */
+static struct slot
+{
+	unsigned seq;
+	event_t ev;
+} ring[MAX_EVENTS];
+static unsigned head, tail;
 
-#define MAX_EVENTS 32
-
-static event_t eventqueue[MAX_EVENTS];
-static int eventhead, eventpos;
+static int holding;
+static unsigned holdfrom;
 
 
 int ev_postevent(event_t *ev)
 {
-	int nextevent;
-	nextevent = (eventhead+1)%MAX_EVENTS;
-	if (nextevent == eventpos)
+	struct slot *s;
+	unsigned pos = LOAD(&head), lap;
+
+	ev->time = sys_micros();
+	for (;;)
+	{
+		s = &ring[pos & MASK];
+		lap = pos & ~MASK;
+		if (LOAD(&s->seq) == lap)
+		{
+			if (CLAIM(&head, &pos)) break;
+		}
+		/* still holding the one from the lap before */
+		else if ((int)(LOAD(&s->seq) - lap) < 0)
+		{
+			COUNT(&ev_drops);
+			return 0;
+		}
+		else pos = LOAD(&head);
+	}
+	s->ev = *ev;
+	STORE(&s->seq, lap + 1);
+	return 1;
+}
+
+/* the next event, if it's there and not held back */
+static event_t *next()
+{
+	struct slot *s = &ring[tail & MASK];
+
+	if (LOAD(&s->seq) != (tail & ~MASK) + 1) return 0;
+	if (holding && (int)(s->ev.time - holdfrom) >= 0) return 0;
+	return &s->ev;
+}
+
+/* with on, events posted at time t or later are left in the queue
+   until ev_hold is called again; without, they all come out */
+void ev_hold(int on, unsigned t)
+{
+	holding = on;
+	holdfrom = t;
+}
+
+/* the event ev_getevent would return next, left in the queue */
+int ev_peekevent(event_t *ev)
+{
+	event_t *e = next();
+
+	if (!e)
+	{
+		ev->type = EV_NONE;
 		return 0;
-	eventqueue[eventhead] = *ev;
-	eventhead = nextevent;
+	}
+	*ev = *e;
 	return 1;
 }
 
 int ev_getevent(event_t *ev)
 {
-	if (eventpos == eventhead)
+	event_t *e = next();
+
+	if (!e)
 	{
 		ev->type = EV_NONE;
 		return 0;
 	}
-	*ev = eventqueue[eventpos];
-	eventpos = (eventpos+1)%MAX_EVENTS;
+	*ev = *e;
+	STORE(&ring[tail & MASK].seq, (tail & ~MASK) + MAX_EVENTS);
+	tail++;
 	if (ev->type == EV_PRESS)
 	{
 		keystates[ev->code] = 1;
@@ -50,11 +140,3 @@ int ev_getevent(event_t *ev)
 	}
 	return 1;
 }
-
-
-
-
-
-
-
-
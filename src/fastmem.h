@@ -5,11 +5,13 @@
 
 #include "defs.h"
 #include "mem.h"
+#include "memstats.h"
 
 
 static byte readb(int a)
 {
 	byte *p = mbc.rmap[a>>12];
+	MS_ACCESS(MS_READ, a);
 	if (p) return p[a];
 	else return mem_read(a);
 }
@@ -17,12 +19,15 @@ static byte readb(int a)
 static void writeb(int a, byte b)
 {
 	byte *p = mbc.wmap[a>>12];
+	MS_ACCESS(MS_WRITE, a);
 	if (p) p[a] = b;
 	else mem_write(a, b);
 }
 
 static int readw(int a)
 {
+	MS_ACCESS(MS_READ, a);
+	MS_ACCESS(MS_READ, a+1);
 	if ((a+1) & 0xfff)
 	{
 		byte *p = mbc.rmap[a>>12];
@@ -43,6 +48,8 @@ static int readw(int a)
 
 static void writew(int a, int w)
 {
+	MS_ACCESS(MS_WRITE, a);
+	MS_ACCESS(MS_WRITE, a+1);
 	if ((a+1) & 0xfff)
 	{
 		byte *p = mbc.wmap[a>>12];
@@ -72,28 +79,20 @@ static void writew(int a, int w)
 
 static byte readhi(int a)
 {
-	return readb(a | 0xff00);
+	byte (*rd)(byte) = hi_read[a];
+	MS_ACCESS(MS_READ, 0xff00);
+	MS_HIREG(0, a);
+	return rd ? rd(a) : ram.hi[a];
 }
 
 static void writehi(int a, byte b)
 {
-	writeb(a | 0xff00, b);
-}
-
-#if 0
-static byte readhi(int a)
-{
-	byte (*rd)() = hi_read[a];
-	return rd ? rd(a) : (ram.hi[a] | himask[a]);
-}
-
-static void writehi(int a, byte b)
-{
-	byte (*wr)() = hi_write[a];
+	void (*wr)(byte, byte) = hi_write[a];
+	MS_ACCESS(MS_WRITE, 0xff00);
+	MS_HIREG(1, a);
 	if (wr) wr(a, b);
-	else ram.hi[a] = b & ~himask[a];
+	else ram.hi[a] = b;
 }
-#endif
 
 
 #endif
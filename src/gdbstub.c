@@ -0,0 +1,379 @@
+/*
+ * gdbstub.c
+ *
+ * A gdb remote serial protocol server, for debugging a game from gdb
+ * or anything else that speaks the protocol. With "gdbport" set, the
+ * next frame waits for a debugger to connect to that port on the
+ * loopback interface, and the game stops before its next instruction
+ * until it says to go on.
+ *
+ * It sits on the breakpoints and watchpoints of debug.c, so a game
+ * running under the debugger costs no more than those do: nothing
+ * beyond a look at the socket once a frame, for gdb's interrupt,
+ * until a breakpoint is set. While stopped, everything waits here,
+ * inside debug_insn, with the registers in the cpu struct.
+ *
+ * Registers are in the order gdb's z80 target has them, all 16 bits
+ * little endian: AF BC DE HL SP PC, then IX IY AF' BC' DE' HL' IR,
+ * which read 0 and ignore writes. Addresses above FFFF name a bank,
+ * (bank << 16) | addr, both for memory and for breakpoints (see
+ * debug_peek); below that they're whatever is mapped now, and a
+ * breakpoint hits in any bank.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "cpu.h"
+#include "rc.h"
+#include "sys.h"
+#include "debug.h"
+#include "gdbstub.h"
+
+#include "cpuregs.h"
+
+static int gdbport;
+
+rcvar_t gdbstub_exports[] =
+{
+	RCV_INT("gdbport", &gdbport, "tcp port to wait for gdb on, 0 = off"),
+	RCV_END
+};
+
+#define NREGS 13
+#define MAXPACKET 4096
+
+static int fd = -1, listened, running;
+static char last[32] = "S05";
+static char in[MAXPACKET + 1], out[MAXPACKET + 1];
+
+static const char hex[] = "0123456789abcdef";
+
+
+int gdb_attached()
+{
+	return fd >= 0;
+}
+
+static void hangup()
+{
+	sys_hangup(fd);
+	fd = -1;
+	running = 0;
+	debug_clearbreaks();
+	debug_setwatch(0, 65536, 3, 0);
+}
+
+static int unhex(int c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* sends a packet and waits for gdb's ack, resending on a nak */
+static void put(char *s)
+{
+	char buf[MAXPACKET + 4];
+	int i, sum = 0, n = 0, c;
+
+	buf[n++] = '$';
+	for (i = 0; s[i] && n < MAXPACKET; i++)
+	{
+		buf[n++] = s[i];
+		sum += (byte)s[i];
+	}
+	buf[n++] = '#';
+	buf[n++] = hex[(sum >> 4) & 15];
+	buf[n++] = hex[sum & 15];
+	do
+	{
+		if (sys_send(fd, buf, n) < 0) c = -1;
+		else while ((c = sys_recv(fd, 1)) >= 0 && c != '+' && c != '-');
+	}
+	while (c == '-');
+	if (c < 0) hangup();
+}
+
+/* the next packet into in, acked; -1 if gdb has gone */
+static int get()
+{
+	int c, n, sum, check;
+
+	for (;;)
+	{
+		while ((c = sys_recv(fd, 1)) != '$')
+			if (c < 0) return -1;
+		n = sum = 0;
+		while ((c = sys_recv(fd, 1)) != '#')
+		{
+			if (c < 0) return -1;
+			if (n < MAXPACKET) in[n++] = c;
+			sum += c;
+		}
+		in[n] = 0;
+		check = unhex(sys_recv(fd, 1)) << 4;
+		check += unhex(sys_recv(fd, 1));
+		if (check == (sum & 0xff))
+		{
+			sys_send(fd, "+", 1);
+			return n;
+		}
+		sys_send(fd, "-", 1);
+	}
+}
+
+static char *puthex(char *p, int v, int bytes)
+{
+	while (bytes--)
+	{
+		*p++ = hex[(v >> 4) & 15];
+		*p++ = hex[v & 15];
+		v >>= 8;
+	}
+	*p = 0;
+	return p;
+}
+
+static int gethex(char **p, int bytes)
+{
+	int v = 0, i, hi, lo;
+
+	for (i = 0; i < bytes; i++)
+	{
+		if ((hi = unhex((*p)[0])) < 0 || (lo = unhex((*p)[1])) < 0)
+			return -1;
+		v |= (hi << 4 | lo) << (8 * i);
+		*p += 2;
+	}
+	return v;
+}
+
+static word *reg(int n)
+{
+	static word dummy;
+	word *const regs[] = { &AF, &BC, &DE, &HL, &SP, &PC };
+
+	dummy = 0;
+	return n >= 0 && n < 6 ? regs[n] : &dummy;
+}
+
+/* p and P only take the registers there are */
+#define REALREG(n) ((n) >= 0 && (n) < 6)
+
+static void readregs()
+{
+	char *p = out;
+	int i;
+
+	for (i = 0; i < NREGS; i++)
+		p = puthex(p, *reg(i), 2);
+}
+
+static int writereg(int n, char **p)
+{
+	int v = gethex(p, 2);
+
+	if (v < 0) return -1;
+	*reg(n) = v;
+	return 0;
+}
+
+static void readmem(char *p)
+{
+	int a, len, b;
+	char *o = out;
+
+	if (sscanf(p, "%x,%x", &a, &len) != 2)
+	{
+		strcpy(out, "E01");
+		return;
+	}
+	if (len > MAXPACKET / 2) len = MAXPACKET / 2;
+	while (len--)
+	{
+		if ((b = debug_peek(a++)) < 0) break;
+		o = puthex(o, b, 1);
+	}
+	if (o == out) strcpy(out, "E14");
+}
+
+static void writemem(char *p)
+{
+	int a, len, b;
+
+	if (sscanf(p, "%x,%x", &a, &len) != 2 || !(p = strchr(p, ':')))
+	{
+		strcpy(out, "E01");
+		return;
+	}
+	for (p++; len--; a++)
+		if ((b = gethex(&p, 1)) < 0 || debug_poke(a, b) < 0)
+		{
+			strcpy(out, "E14");
+			return;
+		}
+	strcpy(out, "OK");
+}
+
+/* Z and z: 0 and 1 breakpoints, 2 write, 3 read, 4 access watches */
+static void setpoint(char *p, int on)
+{
+	int type, a, len;
+
+	if (sscanf(p, "%d,%x,%x", &type, &a, &len) != 3)
+	{
+		strcpy(out, "E01");
+		return;
+	}
+	switch (type)
+	{
+	case 0:
+	case 1:
+		if (debug_setbreak(a >> 16 ? a >> 16 : -1, a, on) < 0)
+		{
+			strcpy(out, "E0c");
+			return;
+		}
+		break;
+	case 2:
+	case 3:
+	case 4:
+		debug_setwatch(a, len, type == 2 ? 2 : type == 3 ? 1 : 3, on);
+		break;
+	default:
+		out[0] = 0;
+		return;
+	}
+	strcpy(out, "OK");
+}
+
+/* an address after c or s moves the PC there first */
+static void resume(char *p, int step)
+{
+	int a;
+
+	if (sscanf(p, "%x", &a) == 1) PC = a;
+	if (step) debug_stopnext(5);
+	running = 1;
+}
+
+/*
+ * debug.c calls this when the cpu stops, why being the stop reply
+ * to send if gdb is waiting for one. It takes packets until one of
+ * them lets the cpu go on.
+ */
+void gdb_stop(char *why)
+{
+	int n;
+
+	if (fd < 0) return;
+	strncpy(last, why, sizeof last - 1);
+	if (running) put(last);
+	running = 0;
+	while (fd >= 0)
+	{
+		if ((n = get()) < 0)
+		{
+			hangup();
+			return;
+		}
+		out[0] = 0;
+		switch (in[0])
+		{
+		case '?':
+			strcpy(out, last);
+			break;
+		case 'g':
+			readregs();
+			break;
+		case 'G':
+			{
+				char *p = in + 1;
+				for (n = 0; n < NREGS && *p; n++)
+					if (writereg(n, &p) < 0) break;
+				strcpy(out, "OK");
+			}
+			break;
+		case 'p':
+			n = strtol(in + 1, 0, 16);
+			if (!REALREG(n)) strcpy(out, "E01");
+			else puthex(out, *reg(n), 2);
+			break;
+		case 'P':
+			{
+				char *p = strchr(in, '=');
+				n = strtol(in + 1, 0, 16);
+				if (!REALREG(n) || !p || (p++, writereg(n, &p)) < 0)
+					strcpy(out, "E01");
+				else strcpy(out, "OK");
+			}
+			break;
+		case 'm':
+			readmem(in + 1);
+			break;
+		case 'M':
+			writemem(in + 1);
+			break;
+		case 'Z':
+		case 'z':
+			setpoint(in + 1, in[0] == 'Z');
+			break;
+		case 'c':
+		case 's':
+			resume(in + 1, in[0] == 's');
+			return;
+		case 'D':
+			put("OK");
+			hangup();
+			return;
+		case 'k':
+			hangup();
+			exit(0);
+		case 'H':
+		case 'T':
+			strcpy(out, "OK");
+			break;
+		case 'q':
+			if (!strncmp(in, "qSupported", 10))
+				sprintf(out, "PacketSize=%x;swbreak+", MAXPACKET);
+			else if (!strcmp(in, "qAttached"))
+				strcpy(out, "1");
+			break;
+		}
+		put(out);
+	}
+}
+
+/*
+ * The main loop calls this once a frame. It waits for gdb if
+ * "gdbport" has just been set, and otherwise looks for the interrupt
+ * gdb sends when the user hits ^C.
+ */
+void gdb_poll()
+{
+	int c;
+
+	if (gdbport != listened)
+	{
+		listened = gdbport;
+		if (fd >= 0) hangup();
+		if (!gdbport) return;
+		fprintf(stderr, "waiting for gdb on port %d\n", gdbport);
+		if ((fd = sys_listen(gdbport)) < 0)
+		{
+			fprintf(stderr, "cannot listen on port %d\n", gdbport);
+			return;
+		}
+		strcpy(last, "S05");
+		debug_stopnext(5);
+		return;
+	}
+	if (fd < 0) return;
+	while ((c = sys_recv(fd, 0)) >= 0)
+		if (c == 3) debug_stopnext(2);
+	if (c == -1) hangup();
+}
@@ -0,0 +1,8 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+int gdb_attached();
+void gdb_stop(char *why);
+void gdb_poll();
+
+#endif
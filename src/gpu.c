@@ -0,0 +1,349 @@
+/*
+ * gpu.c
+ *
+ * Drawing the picture with an OpenGL compute shader instead of the
+ * core's scanline renderer, for "gpurender". Each time lcd_flush
+ * would draw the lines it has queued, gpu_add takes a copy of what
+ * they're drawn from (the tile maps, oam, the palette as scan.pal4
+ * has it, in the framebuffer's format, and the registers logged for
+ * each line) as one batch; usually that's once a frame, at vblank,
+ * but a game that changes vram or the palette partway down the
+ * screen makes a batch for each part. At present time gpu_draw hands
+ * each batch to the shader, one workgroup per line and one invocation
+ * per pixel, all 144 lines at once, and the results go straight into
+ * the SDL texture that's shown.
+ *
+ * The tiles themselves, all 384 of each bank, stay on the gpu in a
+ * buffer of their own. A batch only carries those tiledirty says
+ * were written since the batch before, and gpu_draw puts them in the
+ * buffer ahead of drawing it, so a game that leaves its tiles alone
+ * sends none at all. A frame the presenter never got to has its
+ * tiles marked dirty again by gpu_drop, for the next batch to carry.
+ *
+ * The shader does what tilebuf, bg_scan, wnd_scan, spr_enum and
+ * spr_scan do, straight from vram: the same tile numbering, flips,
+ * cgb attributes and priorities, and the same first 10 sprites of a
+ * line. sprdebug is left out. It needs OpenGL 4.3, and the texture
+ * SDL's opengl renderer made; without them gpu_init fails and the
+ * core goes on drawing as before.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+
+#include "defs.h"
+#include "hw.h"
+#include "lcd.h"
+#include "gpu.h"
+
+static const char *source =
+	"#version 430\n"
+	"layout(local_size_x = 160) in;\n"
+	"layout(std430, binding = 0) readonly buffer Batch\n"
+	"{\n"
+	"	uint maps[1024];\n"
+	"	uint oam[40];\n"
+	"	uint pal[64];\n"
+	"	uint lines[288];\n"
+	"	uint cgb, sort, n;\n"
+	"};\n"
+	"layout(std430, binding = 1) readonly buffer Tiles\n"
+	"{\n"
+	"	uint tiles[3072];\n"
+	"};\n"
+	"layout(rgba8, binding = 0) writeonly uniform image2D img;\n"
+	"\n"
+	/* a is from 0x9800, bank 1's maps 2048 on */
+	"uint mbyte(uint a)\n"
+	"{\n"
+	"	return (maps[a >> 2] >> ((a & 3u) << 3)) & 255u;\n"
+	"}\n"
+	"\n"
+	"uint tbyte(uint a)\n"
+	"{\n"
+	"	return (tiles[a >> 2] >> ((a & 3u) << 3)) & 255u;\n"
+	"}\n"
+	"\n"
+	/* tiles are numbered as patpix has them: 0-383, plus 512 for
+	   bank 1, whose tiles follow bank 0's in the buffer */
+	"uint pixel(uint t, uint v, uint u)\n"
+	"{\n"
+	"	uint a = ((t & 511u) + ((t & 512u) != 0u ? 384u : 0u)) * 16u + v * 2u;\n"
+	"	uint s = 7u - u;\n"
+	"	return ((tbyte(a) >> s) & 1u) | (((tbyte(a + 1u) >> s) & 1u) << 1);\n"
+	"}\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	uint x = gl_LocalInvocationID.x, i = gl_WorkGroupID.y;\n"
+	"	uint a = lines[i * 2u], b = lines[i * 2u + 1u];\n"
+	"	uint ly = a & 255u, lcdc = (a >> 8) & 255u;\n"
+	"	uint scx = (a >> 16) & 255u, scy = a >> 24;\n"
+	"	int wx = int(b & 255u) - 7;\n"
+	"	uint win = (b >> 8) & 255u;\n"
+	"	bool inwin = win != 255u && int(x) >= wx;\n"
+	"	uint map, col, row, t, attr, c, idx;\n"
+	"\n"
+	"	if (inwin)\n"
+	"	{\n"
+	"		col = uint(int(x) - wx);\n"
+	"		row = win;\n"
+	"		map = (lcdc & 64u) != 0u ? 0x400u : 0u;\n"
+	"	}\n"
+	"	else\n"
+	"	{\n"
+	"		col = (x + scx) & 255u;\n"
+	"		row = (ly + scy) & 255u;\n"
+	"		map = (lcdc & 8u) != 0u ? 0x400u : 0u;\n"
+	"	}\n"
+	"	map += (row >> 3) * 32u + (col >> 3);\n"
+	"	t = mbyte(map);\n"
+	"	if ((lcdc & 16u) == 0u && t < 128u) t += 256u;\n"
+	"	attr = cgb != 0u ? mbyte(2048u + map) : 0u;\n"
+	"	row &= 7u;\n"
+	"	col &= 7u;\n"
+	"	if ((attr & 0x40u) != 0u) row = 7u - row;\n"
+	"	if ((attr & 0x20u) != 0u) col = 7u - col;\n"
+	"	c = pixel(t | ((attr & 8u) << 6), row, col);\n"
+	"	if (cgb != 0u) idx = c | ((attr & 7u) << 2);\n"
+	"	else idx = inwin ? c | 4u : c;\n"
+	"\n"
+	/* the sprite that ends up on top is the first in the line's list
+	   that draws here, or with sort the one with the least x */
+	"	if ((lcdc & 2u) != 0u)\n"
+	"	{\n"
+	"		uint h = (lcdc & 4u) != 0u ? 16u : 8u, k = 0u, best = ~0u;\n"
+	"		uint j, o, oy, ox, fl, v, u, p, key;\n"
+	"\n"
+	"		for (j = 0u; j < 40u && k < 10u; j++)\n"
+	"		{\n"
+	"			o = oam[j];\n"
+	"			oy = o & 255u;\n"
+	"			ox = (o >> 8) & 255u;\n"
+	"			if (ly + 16u < oy || ly + 16u >= oy + h) continue;\n"
+	"			key = sort != 0u ? (ox << 4) | k : k;\n"
+	"			k++;\n"
+	"			if (x >= ox || x + 8u < ox || key >= best) continue;\n"
+	"			fl = o >> 24;\n"
+	"			v = ly + 16u - oy;\n"
+	"			u = x + 8u - ox;\n"
+	"			if ((fl & 0x40u) != 0u) v = h - 1u - v;\n"
+	"			if ((fl & 0x20u) != 0u) u = 7u - u;\n"
+	"			t = (o >> 16) & 255u;\n"
+	"			if (h == 16u) t = (t & 254u) | (v >> 3);\n"
+	"			if (cgb != 0u) t |= (fl & 8u) << 6;\n"
+	"			p = pixel(t, v & 7u, u);\n"
+	"			if (p == 0u) continue;\n"
+	"			if (c != 0u && ((fl & 0x80u) != 0u\n"
+	"				|| (cgb != 0u && (attr & 0x80u) != 0u))) continue;\n"
+	"			best = key;\n"
+	"			if (cgb != 0u) idx = 32u + ((fl & 7u) << 2) + p;\n"
+	"			else idx = 32u + ((fl & 0x10u) >> 2) + p;\n"
+	"		}\n"
+	"	}\n"
+	"\n"
+	/* pal is in the texture's format, 0xaarrggbb */
+	"	imageStore(img, ivec2(int(x), int(ly)),\n"
+	"		vec4(unpackUnorm4x8(pal[idx]).zyx, 1.0));\n"
+	"}\n";
+
+/* SDL's renderer made the context; anything past gl 1.1 has to be
+   looked up, and so does everything else, so as not to link with
+   libGL */
+typedef const GLubyte *(APIENTRY *GETSTRINGPROC)(GLenum);
+typedef void (APIENTRY *GETINTEGERVPROC)(GLenum, GLint *);
+
+#define GLFUNCS \
+	F(GETSTRINGPROC, GetString) \
+	F(GETINTEGERVPROC, GetIntegerv) \
+	F(PFNGLCREATESHADERPROC, CreateShader) \
+	F(PFNGLSHADERSOURCEPROC, ShaderSource) \
+	F(PFNGLCOMPILESHADERPROC, CompileShader) \
+	F(PFNGLGETSHADERIVPROC, GetShaderiv) \
+	F(PFNGLGETSHADERINFOLOGPROC, GetShaderInfoLog) \
+	F(PFNGLDELETESHADERPROC, DeleteShader) \
+	F(PFNGLCREATEPROGRAMPROC, CreateProgram) \
+	F(PFNGLATTACHSHADERPROC, AttachShader) \
+	F(PFNGLLINKPROGRAMPROC, LinkProgram) \
+	F(PFNGLGETPROGRAMIVPROC, GetProgramiv) \
+	F(PFNGLUSEPROGRAMPROC, UseProgram) \
+	F(PFNGLDELETEPROGRAMPROC, DeleteProgram) \
+	F(PFNGLGENBUFFERSPROC, GenBuffers) \
+	F(PFNGLDELETEBUFFERSPROC, DeleteBuffers) \
+	F(PFNGLBINDBUFFERBASEPROC, BindBufferBase) \
+	F(PFNGLBUFFERDATAPROC, BufferData) \
+	F(PFNGLBUFFERSUBDATAPROC, BufferSubData) \
+	F(PFNGLBINDIMAGETEXTUREPROC, BindImageTexture) \
+	F(PFNGLDISPATCHCOMPUTEPROC, DispatchCompute) \
+	F(PFNGLMEMORYBARRIERPROC, MemoryBarrier)
+
+#define F(t, n) static t n;
+GLFUNCS
+#undef F
+
+static GLuint prog, buf, tiles, img;
+/* the tile buffer is empty, so the next batch carries them all */
+static int fresh;
+
+static int load()
+{
+#define F(t, n) if (!(n = (t)SDL_GL_GetProcAddress("gl" #n))) return -1;
+	GLFUNCS
+#undef F
+	return 0;
+}
+
+/* a copy of what the lines are drawn from, as it is now; -1 if
+   there's no memory for it */
+int gpu_add(struct gpuframe *f, struct lcdline *lines, int n, int sort)
+{
+	struct gpubatch *b;
+	int i;
+
+	if (f->n == f->max)
+	{
+		if (!(b = realloc(f->b, (f->max + 4) * sizeof *b)))
+			return -1;
+		f->b = b;
+		f->max += 4;
+	}
+	b = &f->b[f->n++];
+	memcpy(b->maps[0], lcd.vbank[0] + 0x1800, sizeof b->maps[0]);
+	memcpy(b->maps[1], lcd.vbank[1] + 0x1800, sizeof b->maps[1]);
+	if (fresh)
+	{
+		memset(tiledirty, 1, sizeof tiledirty);
+		fresh = 0;
+	}
+	b->ntiles = 0;
+	for (i = 0; i < 1024; i++)
+	{
+		if ((i & 511) >= 384 || !tiledirty[i]) continue;
+		tiledirty[i] = 0;
+		b->tile[b->ntiles] = (i >> 9) * 384 + (i & 511);
+		memcpy(b->data[b->ntiles++], lcd.vbank[i >> 9] + (i & 511) * 16, 16);
+	}
+	memcpy(b->oam, lcd.oam.mem, sizeof b->oam);
+	memcpy(b->pal, scan.pal4, sizeof b->pal);
+	memcpy(b->lines, lines, n * sizeof *lines);
+	b->cgb = hw.cgb;
+	b->sort = sort;
+	b->n = n;
+	return 0;
+}
+
+/* in the thread that owns the renderer, with texture the one shown;
+   -1 if there's no compute here */
+int gpu_init(SDL_Texture *texture)
+{
+	GLuint sh;
+	GLint ok, tex;
+	const char *ver;
+	int major, minor;
+	float w, h;
+	char log[1024];
+
+	if (!SDL_GL_GetCurrentContext() || load()) return -1;
+	ver = (const char *)GetString(GL_VERSION);
+	if (!ver || sscanf(ver, "%d.%d", &major, &minor) != 2
+		|| major * 10 + minor < 43)
+		return -1;
+	/* the image has to be a plain 2d texture */
+	if (SDL_GL_BindTexture(texture, &w, &h)) return -1;
+	GetIntegerv(GL_TEXTURE_BINDING_2D, &tex);
+	SDL_GL_UnbindTexture(texture);
+	if (!tex) return -1;
+	img = tex;
+
+	sh = CreateShader(GL_COMPUTE_SHADER);
+	ShaderSource(sh, 1, &source, 0);
+	CompileShader(sh);
+	GetShaderiv(sh, GL_COMPILE_STATUS, &ok);
+	if (!ok)
+	{
+		GetShaderInfoLog(sh, sizeof log, 0, log);
+		fprintf(stderr, "gpurender: %s\n", log);
+		DeleteShader(sh);
+		return -1;
+	}
+	prog = CreateProgram();
+	AttachShader(prog, sh);
+	LinkProgram(prog);
+	DeleteShader(sh);
+	GetProgramiv(prog, GL_LINK_STATUS, &ok);
+	if (!ok)
+	{
+		DeleteProgram(prog);
+		prog = 0;
+		return -1;
+	}
+	GenBuffers(1, &buf);
+	GenBuffers(1, &tiles);
+	BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, tiles);
+	BufferData(GL_SHADER_STORAGE_BUFFER, 768 * 16, 0, GL_DYNAMIC_DRAW);
+	fresh = 1;
+	return 0;
+}
+
+/* draw f's batches into the texture, and empty it */
+void gpu_draw(struct gpuframe *f)
+{
+	struct gpubatch *b;
+	GLint was;
+	int i, j;
+
+	/* SDL keeps track of the program it last used */
+	GetIntegerv(GL_CURRENT_PROGRAM, &was);
+	UseProgram(prog);
+	BindImageTexture(0, img, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+	for (i = 0; i < f->n; i++)
+	{
+		b = &f->b[i];
+		/* the tiles come in order, so runs of them go up together */
+		BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, tiles);
+		for (j = 0; j < b->ntiles; )
+		{
+			int k = j + 1;
+			while (k < b->ntiles && b->tile[k] == b->tile[k-1] + 1) k++;
+			BufferSubData(GL_SHADER_STORAGE_BUFFER, b->tile[j] * 16,
+				(k - j) * 16, b->data[j]);
+			j = k;
+		}
+		/* and only what the shader reads of the rest */
+		BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buf);
+		BufferData(GL_SHADER_STORAGE_BUFFER, offsetof(struct gpubatch, ntiles),
+			b, GL_STREAM_DRAW);
+		DispatchCompute(1, b->n, 1);
+	}
+	MemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	UseProgram(was);
+	f->n = 0;
+}
+
+/* for a frame that won't be drawn: its tiles go with the next batch */
+void gpu_drop(struct gpuframe *f)
+{
+	int i, j, t;
+
+	for (i = 0; i < f->n; i++)
+		for (j = 0; j < f->b[i].ntiles; j++)
+		{
+			t = f->b[i].tile[j];
+			tiledirty[t < 384 ? t : 512 + t - 384] = 1;
+		}
+	f->n = 0;
+}
+
+void gpu_close()
+{
+	if (!prog) return;
+	DeleteBuffers(1, &buf);
+	DeleteBuffers(1, &tiles);
+	DeleteProgram(prog);
+	prog = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef GPU_H
+#define GPU_H
+
+#include <SDL2/SDL.h>
+
+#include "defs.h"
+#include "lcd.h"
+
+/* everything a batch of lines is drawn from but the tiles, laid out
+   as the shader's storage buffer has it up to ntiles; then the tiles
+   that have changed since the batch before, which go into the tile
+   buffer first, numbered 0-767, bank 1's after bank 0's */
+struct gpubatch
+{
+	byte maps[2][2048];
+	byte oam[160];
+	un32 pal[64];
+	struct lcdline lines[144];
+	un32 cgb, sort, n;
+	int ntiles;
+	un16 tile[768];
+	byte data[768][16];
+};
+
+/* the batches of one frame, in the order lcd_flush handed them over */
+struct gpuframe
+{
+	struct gpubatch *b;
+	int n, max;
+};
+
+int gpu_add(struct gpuframe *f, struct lcdline *lines, int n, int sort);
+void gpu_drop(struct gpuframe *f);
+int gpu_init(SDL_Texture *texture);
+void gpu_draw(struct gpuframe *f);
+void gpu_close();
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -10,7 +11,7 @@
 #include "fastmem.h"
 
 
-struct hw hw;
+MACHINE struct hw hw;
 
 
 
@@ -49,13 +50,37 @@ void hw_dma(byte b)
 	int i;
 	addr a;
 
+	lcd_flush();
 	a = ((addr)b) << 8;
-	for (i = 0; i < 160; i++, a++)
+	/* 160 bytes from a 256 byte boundary never cross a page */
+	if (mbc.rmap[a>>12])
+		memcpy(lcd.oam.mem, mbc.rmap[a>>12] + a, 160);
+	else for (i = 0; i < 160; i++, a++)
 		lcd.oam.mem[i] = readb(a);
+	oam_dirty();
 }
 
 
 
+/*
+ * hdma_block copies one 16 byte block, which being 16 byte aligned at
+ * both ends never straddles a page; when the source is plain memory
+ * and the destination is within vram, it's done in one go.
+ */
+
+static void hdma_block(addr sa, int da)
+{
+	int i;
+
+	if (mbc.rmap[sa>>12] && da < 0xA000)
+	{
+		vram_copy(da & 0x1FFF, mbc.rmap[sa>>12] + sa, 16);
+		return;
+	}
+	for (i = 0; i < 16; i++)
+		writeb(da++, readb(sa++));
+}
+
 void hw_hdma_cmd(byte c)
 {
 	int cnt;
@@ -74,11 +99,14 @@ void hw_hdma_cmd(byte c)
 	sa = ((addr)R_HDMA1 << 8) | (R_HDMA2&0xf0);
 	da = 0x8000 | ((int)(R_HDMA3&0x1f) << 8) | (R_HDMA4&0xf0);
 	cnt = ((int)c)+1;
-	/* FIXME - this should use cpu time! */
-	/*cpu_timers(102 * cnt);*/
-	cnt <<= 4;
-	while (cnt--)
-		writeb(da++, readb(sa++));
+	/* the cpu waits it out, past the fast tier (see cpu_emulate) */
+	if (cpu_accuracy(-1) >= ACC_BALANCED)
+	{
+		cpu.stall += 16 * cnt;
+		cpu.evnext = 0;
+	}
+	for (; cnt; cnt--, sa += 16, da += 16)
+		hdma_block(sa, da);
 	R_HDMA1 = sa >> 8;
 	R_HDMA2 = sa & 0xF0;
 	R_HDMA3 = 0x1F & (da >> 8);
@@ -89,15 +117,16 @@ void hw_hdma_cmd(byte c)
 
 void hw_hdma()
 {
-	int cnt;
 	addr sa;
 	int da;
 
 	sa = ((addr)R_HDMA1 << 8) | (R_HDMA2&0xf0);
 	da = 0x8000 | ((int)(R_HDMA3&0x1f) << 8) | (R_HDMA4&0xf0);
-	cnt = 16;
-	while (cnt--)
-		writeb(da++, readb(sa++));
+	hdma_block(sa, da);
+	if (cpu_accuracy(-1) >= ACC_BALANCED)
+		cpu.stall += 16;
+	sa += 16;
+	da += 16;
 	R_HDMA1 = sa >> 8;
 	R_HDMA2 = sa & 0xF0;
 	R_HDMA3 = 0x1F & (da >> 8);
@@ -153,16 +182,139 @@ void pad_release(byte k)
 	pad_refresh();
 }
 
+/* while pad_capture has given them somewhere else to go, buttons
+   set with pad_set land there and the game doesn't see them; netplay
+   uses this to keep the local pad apart from the one the game has */
+static byte *capture;
+
+void pad_capture(byte *to)
+{
+	capture = to;
+}
+
 void pad_set(byte k, int st)
 {
+	if (capture)
+	{
+		if (st) *capture |= k;
+		else *capture &= ~k;
+		return;
+	}
 	st ? pad_press(k) : pad_release(k);
 }
 
+/*
+ * pad_latepoll arranges for poll to be called just before the next
+ * read of P1, so the game sees input gathered as late as possible.
+ * It's called once; until then P1 isn't the plain read it normally
+ * is (see mem_updatehi, which also drops the hook).
+ */
+
+static void (*latepoll)();
+
+static byte pad_read(byte r)
+{
+	void (*poll)() = latepoll;
+
+	pad_latepoll(0);
+	poll();
+	return R_P1;
+}
+
+void pad_latepoll(void (*poll)())
+{
+	latepoll = poll;
+	mem_hiread(RI_P1, poll ? pad_read : NULL);
+}
+
+/*
+ * Serial transfers. A transfer on the internal clock shifts out SB
+ * and shifts in whatever is on the other end of the link, taking the
+ * 8 bits' worth of time it really takes before SC bit 7 clears and
+ * the serial interrupt comes (cpu.serial counts it down, see
+ * serial_advance). With no cable that's 0xff, and a transfer on the
+ * external clock, which on hardware would wait forever, gives up after
+ * as long as a byte takes on the internal clock: SC bit 7 clears, for
+ * games that poll it, but SB stays and there's no interrupt, since no
+ * clock ever came. With hw_link set (see link.c), a transfer swaps the
+ * byte with the other instance. A cable that has to be
+ * asked whether the other end's clock has come, hw_linkpoll (see
+ * netlink.c), gets asked every LINKPOLL cycles while a transfer on
+ * the external clock waits. Every byte sent is kept, which is how
+ * test roms report their results (see gb_serial in the library).
+ */
+
+#define LINKPOLL 256
+
+byte (*hw_link)(byte b);
+int (*hw_linkpoll)(byte b);
+
+static byte *sent;
+static int nsent, maxsent;
+
+void hw_serial_start(byte b)
+{
+	R_SC = b;
+	cpu.serial = 0;
+	if ((b & 0x81) == 0x80)
+	{
+		if (hw_linkpoll) cpu.serial = LINKPOLL;
+		else if (!hw_link) cpu.serial = 2048 >> cpu.speed;
+	}
+	if ((b & 0x81) != 0x81) return;
+	/* 8192Hz, or 32 times that on a cgb with the fast clock */
+	cpu.serial = 2048 >> cpu.speed;
+	if (hw.cgb && (b & 2)) cpu.serial >>= 5;
+}
+
+void hw_serial_done()
+{
+	byte *p;
+	int in = 0xff;
+
+	if (!(R_SC & 1))
+	{
+		if (!hw_linkpoll)
+		{
+			/* no cable; see above */
+			if (!hw_link) R_SC &= 0x7f;
+			return;
+		}
+		if ((in = hw_linkpoll(R_SB)) < 0)
+		{
+			cpu.serial = LINKPOLL;
+			return;
+		}
+	}
+	else if (hw_link) in = hw_link(R_SB);
+	if (nsent == maxsent)
+	{
+		maxsent = maxsent ? maxsent * 2 : 256;
+		if (!(p = realloc(sent, maxsent))) maxsent = nsent;
+		else sent = p;
+	}
+	if (nsent < maxsent) sent[nsent++] = R_SB;
+	R_SB = in;
+	R_SC &= 0x7f;
+	hw_interrupt(IF_SERIAL, IF_SERIAL);
+	hw_interrupt(0, IF_SERIAL);
+}
+
+byte *hw_serial_output(int *len)
+{
+	*len = nsent;
+	return sent;
+}
+
 void hw_reset()
 {
 	hw.ilines = hw.pad = 0;
+	nsent = 0;
 
 	memset(ram.hi, 0, sizeof ram.hi);
+	/* with no boot rom, rom is at 0000 from the start (see
+	   mem_updatemap) */
+	REG(RI_BOOT) = bootrom.bank ? 0xfe : 0xff;
 
 	R_P1 = 0xFF;
 	R_LCDC = 0x91;
@@ -172,6 +324,8 @@ void hw_reset()
 	R_SVBK = 0x01;
 	R_HDMA5 = 0xFF;
 	R_VBK = 0xFE;
+
+	mem_updatehi();
 }
 
 
@@ -10,6 +10,10 @@
 
 #define C (cpu.lcdc)
 
+/* for embedders, called as each visible line is finished and as the
+   frame is, at the start of vblank; 0 for none costs a test a line */
+void (*lcdc_linehook)(int line);
+void (*lcdc_framehook)();
 
 /*
  * stat_trigger updates the STAT interrupt line to reflect whether any
@@ -73,6 +77,7 @@ void lcdc_change(byte b)
 	R_LCDC = b;
 	if ((R_LCDC ^ old) & 0x80) /* lcd on/off change */
 	{
+		if ((old & 0x80) && cpu.cut < 0) cpu.cut = C;
 		R_LY = 0;
 		stat_change(2);
 		C = 40;
@@ -146,15 +151,18 @@ void lcdc_trans()
 			break;
 		case 3:
 			stat_change(0);
+			/* the copy takes 16 of the hblank's 102; it's the cpu
+			   that waits for it, from the balanced tier up */
 			if (hw.hdma & 0x80)
 				hw_hdma();
-			/* FIXME -- how much of the hblank does hdma use?? */
-			/* else */
 			C += 102;
 			break;
 		case 0:
+			if (lcdc_linehook) lcdc_linehook(R_LY);
 			if (++R_LY >= 144)
 			{
+				lcd_flush();
+				if (lcdc_framehook) lcdc_framehook();
 				if (cpu.halt)
 				{
 					hw_interrupt(IF_VBLANK, IF_VBLANK);
@@ -177,3 +185,61 @@ void lcdc_trans()
 
 
 
+
+/*
+ * lcdc_vblank returns the number of cycles until lcdc_trans will
+ * raise the vblank interrupt, provided nothing touches the lcdc in
+ * the mean time (i.e. the cpu is halted). This is only worked out for
+ * the visible lines; anywhere else we just return the time to the
+ * next transition, so the caller ends up stepping through them.
+ */
+
+int lcdc_vblank()
+{
+	int cnt = C;
+
+	if (!(R_LCDC & 0x80) || R_LY >= 144)
+		return cnt;
+	switch ((byte)(R_STAT & 3))
+	{
+	case 2:
+		cnt += 86;
+		/* fall through */
+	case 3:
+		cnt += 102;
+		/* fall through */
+	case 0:
+		return cnt + (143 - R_LY) * 228;
+	}
+	return C;
+}
+
+/*
+ * lcdc_horizon is how far the cpu can run before lcdc_trans has to
+ * be called for anything but the lcdc to notice: the next transition
+ * that could raise an interrupt. With only vblank to watch for, that
+ * is the end of the visible lines, and everything up to it goes in
+ * one event; cpu_sync walks the transitions it passed when it's
+ * called, at the horizon or when the cpu touches an io register, so
+ * what the cpu reads and the registers each line is queued with (see
+ * lcd_refreshline) come out as if every one had been an event. vram
+ * and oam writes catch the lcdc up as well, since they flush the
+ * queued lines (see mem.c). Not done at all when something has to
+ * happen at each line: stat's mode interrupts, hdma, a line hook, or
+ * the accurate cpu, which looks at the mode for every access.
+ */
+
+int lcdc_horizon()
+{
+	int cnt;
+
+	if (!(R_LCDC & 0x80) || R_LY >= 144 || (R_STAT & 0x28)
+		|| (hw.hdma & 0x80) || lcdc_linehook
+		|| cpu_accuracy(-1) >= ACC_ACCURATE)
+		return C;
+	cnt = lcdc_vblank();
+	/* the line where LY comes to LYC */
+	if ((R_STAT & 0x40) && R_LYC > R_LY && R_LYC < 144)
+		cnt -= (144 - R_LYC) * 228;
+	return cnt;
+}
@@ -1,8 +1,13 @@
 #ifndef LCDC_H
 #define LCDC_H
 
+extern void (*lcdc_linehook)(int line);
+extern void (*lcdc_framehook)();
+
 void lcdc_change(byte b);
 void lcdc_trans();
+int lcdc_vblank();
+int lcdc_horizon();
 void stat_write(byte b);
 void stat_trigger();
 
@@ -7,6 +7,7 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "defs.h"
 #include "loader.h"
@@ -16,15 +17,23 @@
 #include "rtc.h"
 #include "rc.h"
 #include "lcd.h"
-#include "inflate.h"
 #include "miniz.h"
 #define XZ_USE_CRC64
 #include "xz.h"
 #include "save.h"
 #include "sound.h"
 #include "sys.h"
-
-static int mbc_table[256] =
+#include "rewind.h"
+#include "input.h"
+#include "cheat.h"
+#include "memstats.h"
+#include "cpu.h"
+#include "romdb.h"
+#include "movie.h"
+#include "alloccheck.h"
+#include "diag.h"
+
+static const int mbc_table[256] =
 {
 	0, 1, 1, 1, 0, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 3,
 	3, 3, 3, 3, 0, 0, 0, 0, 0, 5, 5, 5, MBC_RUMBLE, MBC_RUMBLE, MBC_RUMBLE, 0,
@@ -47,21 +56,21 @@ static int mbc_table[256] =
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, MBC_HUC3, MBC_HUC1
 };
 
-static int rtc_table[256] =
+static const int rtc_table[256] =
 {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
 	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0
 };
 
-static int batt_table[256] =
+static const int batt_table[256] =
 {
 	0, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0,
 	1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 0,
 	0
 };
 
-static int romsize_table[256] =
+static const int romsize_table[256] =
 {
 	2, 4, 8, 16, 32, 64, 128, 256, 512,
 	0, 0, 0, 0, 0, 0, 0, 0,
@@ -77,7 +86,7 @@ static int romsize_table[256] =
 	/* 0, 0, 72, 80, 96  -- actual values but bad to use these! */
 };
 
-static int ramsize_table[256] =
+static const int ramsize_table[256] =
 {
 	1, 1, 1, 4, 16,
 	4 /* FIXME - what value should this be?! */
@@ -99,6 +108,15 @@ static int forcebatt, nobatt;
 static int forcedmg, gbamode;
 
 static int memfill = -1, memrand = -1;
+static int bootcache = 1;
+
+static char *romcache;
+
+static int sramsync = 300;
+static int romwatch;
+/* the sram file on disk is known to match ram.sbank, apart from the
+   pages flagged in dirty.sramsave */
+static int sramsynced;
 
 
 static void initmem(void *mem, int size)
@@ -151,89 +169,47 @@ void loader_set_error(char *fmt, ...)
 	loader_error = strdup(buf);
 }
 
-static int inflate_callback(byte b)
-{
-	if (inf_pos >= inf_len)
-	{
-		inf_len += 512;
-		inf_buf = realloc(inf_buf, inf_len);
-		if (!inf_buf) {
-			loader_set_error("out of memory inflating file @ %d bytes\n", inf_pos);
-			return -1;
-		}
-	}
-	inf_buf[inf_pos++] = b;
-	return 0;
-}
-
-typedef int (*unzip_or_inflate_func) (const unsigned char *data, long *p, int (* callback) (unsigned char d));
+/* the gzip and zip containers tell us the uncompressed size, but it's
+   only a hint: anything this far beyond the biggest real cartridge is
+   treated as garbage and the inflater grows its buffer on its own. */
+#define INF_HINT_MAX (1 << 25)
 
-static byte *gunzip_or_inflate(byte *data, int *len, unsigned offset,
-	unzip_or_inflate_func func)
+static byte *tinflate(byte *data, int *len, unsigned st, unsigned srclen,
+	unsigned hint)
 {
-	long pos = 0;
-	inf_buf = 0;
-	inf_pos = inf_len = 0;
-	if (func(data+offset, &pos, inflate_callback) < 0)
-		return data;
+	byte *new;
+	size_t newlen;
+	if (hint > INF_HINT_MAX) hint = 0;
+	new = tinfl_decompress_mem_to_heap_sized(data+st, srclen, hint, &newlen, 0);
+	if (!new) return data;
 	free(data);
-	*len = inf_pos;
-	return inf_buf;
+	*len = newlen;
+	return new;
 }
 
+/* gzip member: 10 byte header, optional fields selected by the flag
+   byte, raw deflate data, then crc32 and isize. */
 static byte *gunzip(byte *data, int *len) {
-	return gunzip_or_inflate(data, len, 0, unzip);
-}
-
-/* primitive pkzip decompressor. it can only decompress the first
-   file in a zip archive. */
-static byte *pkunzip(byte *data, int *len) {
-	unsigned short fnl, el, comp;
-	unsigned int st;
-	void *new;
-	size_t newlen;
-	int oldlen = *len;
-	if (*len < 128) return data;
-	memcpy(&comp, data+8, 2);
-	comp = LIL(comp);
-	if(comp != 0 && comp != 8) return data;
-	memcpy(&fnl, data+26, 2);
-	memcpy(&el, data+28, 2);
-	fnl = LIL(fnl);
-	el = LIL(el);
-	st = 30 + fnl + el;
-	if(*len < st) return data;
-	if(comp == 0) {
-		inf_buf = realloc(NULL, *len - st);
-		memcpy(inf_buf, data+st, *len - st);
-		free(data);
-		inf_len = *len = *len - st;
-		return inf_buf;
-	}
-	*len -= st;
-	newlen = 0;
-	new = tinfl_decompress_mem_to_heap(data+st, *len, &newlen, 0);
-	if(new) {
-		*len = newlen;
-		free(data);
-		return new;
-	}
-	*len = oldlen;
-	return data;
-}
-
-static int write_dec(byte *data, int len) {
-	int i;
-	for(i=0; i < len; i++)
-		if(inflate_callback(data[i])) return -1;
-	return 0;
+	unsigned st = 10, isize;
+	byte flg;
+	if (*len < 18 || data[2] != 8) return data;
+	flg = data[3];
+	if (flg & 4) st += 2 + (data[10] | data[11] << 8);
+	if (flg & 8) while (st < *len && data[st++]);
+	if (flg & 16) while (st < *len && data[st++]);
+	if (flg & 2) st += 2;
+	if (st + 8 > *len) return data;
+	memcpy(&isize, data + *len - 4, 4);
+	isize = LIL(isize);
+	return tinflate(data, len, st, *len - st - 8, isize);
 }
 
+/* xz doesn't store the uncompressed size up front, so the decoder
+   writes straight into inf_buf and we double it whenever it fills up. */
 static int unxz(byte *data, int len) {
 	struct xz_buf b;
 	struct xz_dec *s;
 	enum xz_ret ret;
-	unsigned char out[4096];
 
 	/*
 	 * Support up to 64 MiB dictionary. The actually needed memory
@@ -245,20 +221,26 @@ static int unxz(byte *data, int len) {
 	b.in = data;
 	b.in_pos = 0;
 	b.in_size = len;
-	b.out = out;
+	b.out = 0;
 	b.out_pos = 0;
-	b.out_size = sizeof(out);
+	b.out_size = 0;
 
 	while (1) {
-		ret = xz_dec_run(s, &b);
-		if(b.out_pos == sizeof(out)) {
-			if(write_dec(out, sizeof(out))) goto err;
-			b.out_pos = 0;
+		if(b.out_pos == b.out_size) {
+			inf_len = inf_len ? inf_len * 2 : 4 * len;
+			inf_buf = realloc(inf_buf, inf_len);
+			if(!inf_buf) {
+				loader_set_error("out of memory inflating file @ %d bytes\n", (int)b.out_pos);
+				goto err;
+			}
+			b.out = inf_buf;
+			b.out_size = inf_len;
 		}
 
-		if(ret == XZ_OK) continue;
+		ret = xz_dec_run(s, &b);
+		inf_pos = b.out_pos;
 
-		if(write_dec(out, b.out_pos)) goto err;
+		if(ret == XZ_OK) continue;
 
 		if(ret == XZ_STREAM_END) {
 			xz_dec_end(s);
@@ -272,33 +254,640 @@ static int unxz(byte *data, int len) {
 	return -1;
 }
 
-static byte *do_unxz(byte *data, int *len) {
+static void crc_init()
+{
+	static int done;
+	if (done) return;
 	xz_crc32_init();
 	xz_crc64_init();
+	done = 1;
+}
+
+/* crc-64 (ecma-182, the one xz uses) of a memory image. it's what we use
+   to recognize a rom or any other blob regardless of its file name. */
+uint64_t rom_fingerprint(byte *data, int len)
+{
+	crc_init();
+	return xz_crc64(data, len, 0);
+}
+
+static unsigned le16(byte *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static unsigned le32(byte *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+/*
+ * An xz file made in blocks (xz -T, or --block-size) ends with an index
+ * of them, saying how long each is and how much it unpacks to, so they
+ * can be unpacked side by side, each straight to its own place in the
+ * image. xz_dec only knows whole streams, so each block is given to it
+ * as one: the file's stream header, the block, and an index and footer
+ * made up for it alone. That's done in single-call mode, which needs no
+ * dictionary besides the output, and checks the block's crc as usual.
+ * Files of one block, or of more than one stream, go through unxz.
+ */
+
+#define XZ_THREADS 7
+
+struct xzblock
+{
+	unsigned in, size, out, len;
+};
+
+static struct
+{
+	byte *data, *out;
+	struct xzblock *b;
+	int n, next, live, failed;
+} xzjob;
+
+static int getvli(byte *p, unsigned *pos, unsigned end, unsigned long long *v)
+{
+	int i;
+
+	for (*v = i = 0; *pos < end && i < 9; i++)
+	{
+		*v |= (unsigned long long)(p[*pos] & 0x7f) << (7 * i);
+		if (!(p[(*pos)++] & 0x80)) return 0;
+	}
+	return -1;
+}
+
+static int putvli(byte *p, unsigned long long v)
+{
+	int n = 0;
+
+	for (; v >= 0x80; v >>= 7) p[n++] = v | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+static void putle32(byte *p, unsigned v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* block b of the file at data, as a stream of its own, into out */
+static int xzblock(byte *data, byte *out, struct xzblock *b)
+{
+	struct xz_dec *s;
+	struct xz_buf buf;
+	byte *st, *p;
+	unsigned pad = (b->size + 3) & ~3;
+	int n, ok;
+
+	if (!(st = malloc(12 + pad + 64))) return -1;
+	memcpy(st, data, 12);
+	memcpy(st + 12, data + b->in, pad);
+	p = st + 12 + pad;
+	n = 0;
+	p[n++] = 0;
+	n += putvli(p + n, 1);
+	n += putvli(p + n, b->size);
+	n += putvli(p + n, b->len);
+	while (n & 3) p[n++] = 0;
+	putle32(p + n, xz_crc32(p, n, 0));
+	n += 4;
+	putle32(p + n + 4, n / 4 - 1);
+	memcpy(p + n + 8, data + 6, 2);
+	putle32(p + n, xz_crc32(p + n + 4, 6, 0));
+	memcpy(p + n + 10, "YZ", 2);
+	n += 12;
+
+	ok = 0;
+	if ((s = xz_dec_init(XZ_SINGLE, 0)))
+	{
+		buf.in = st;
+		buf.in_pos = 0;
+		buf.in_size = 12 + pad + n;
+		buf.out = out + b->out;
+		buf.out_pos = 0;
+		buf.out_size = b->len;
+		ok = xz_dec_run(s, &buf) == XZ_STREAM_END && buf.out_pos == b->len;
+		xz_dec_end(s);
+	}
+	free(st);
+	return ok ? 0 : -1;
+}
+
+/* takes blocks until there are none left */
+static void xzworker(void *unused)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&xzjob.next, 1, __ATOMIC_RELAXED)) < xzjob.n)
+		if (xzblock(xzjob.data, xzjob.out, &xzjob.b[i]))
+			__atomic_store_n(&xzjob.failed, 1, __ATOMIC_RELAXED);
+	if (unused) __atomic_fetch_sub(&xzjob.live, 1, __ATOMIC_RELEASE);
+}
+
+/* the blocks of a one-stream file, from its index; 0 if it isn't one
+   of those, or it's only one block */
+static struct xzblock *xzindex(byte *data, unsigned len, int *count,
+	unsigned *total)
+{
+	struct xzblock *b;
+	unsigned long long v, size, out;
+	unsigned at, pos, end, in;
+	int i, n;
+
+	while (len >= 24 && !memcmp(data + len - 4, "\0\0\0", 4)) len -= 4;
+	if (len < 24 || memcmp(data + len - 2, "YZ", 2)
+		|| memcmp(data + 6, data + len - 4, 2)
+		|| xz_crc32(data + len - 8, 6, 0) != le32(data + len - 12))
+		return 0;
+	end = len - 12;
+	at = (le32(data + len - 8) + 1) * 4;
+	if (at > end - 12) return 0;
+	at = end - at;
+	pos = at + 1;
+	if (data[at] || xz_crc32(data + at, end - at - 4, 0) != le32(data + end - 4)
+		|| getvli(data, &pos, end, &v) || v < 2 || v > 65536)
+		return 0;
+	n = v;
+	if (!(b = malloc(n * sizeof *b))) return 0;
+	in = 12;
+	out = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (getvli(data, &pos, end, &size) || getvli(data, &pos, end, &v)
+			|| !size || size > at || in + ((size + 3) & ~3ULL) > at
+			|| out + v > INF_HINT_MAX)
+		{
+			free(b);
+			return 0;
+		}
+		b[i].in = in;
+		b[i].size = size;
+		b[i].out = out;
+		b[i].len = v;
+		in += (size + 3) & ~3;
+		out += v;
+	}
+	/* anything left before the index would be another stream */
+	if (in != at)
+	{
+		free(b);
+		return 0;
+	}
+	*count = n;
+	*total = out;
+	return b;
+}
+
+static byte *xzparallel(byte *data, int *len)
+{
+	struct xzblock *b;
+	unsigned total;
+	int n, i;
+
+	if (!(b = xzindex(data, *len, &n, &total))) return 0;
+	xzjob.data = data;
+	xzjob.b = b;
+	xzjob.n = n;
+	xzjob.next = xzjob.failed = 0;
+	xzjob.live = 0;
+	if (!(xzjob.out = malloc(total ? total : 1)))
+	{
+		free(b);
+		return 0;
+	}
+	for (i = 0; i < n - 1 && i < XZ_THREADS; i++)
+	{
+		__atomic_fetch_add(&xzjob.live, 1, __ATOMIC_RELAXED);
+		if (sys_thread(xzworker, &xzjob))
+		{
+			__atomic_fetch_sub(&xzjob.live, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	xzworker(0);
+	while (__atomic_load_n(&xzjob.live, __ATOMIC_ACQUIRE)) sys_nap(100);
+	free(b);
+	if (xzjob.failed)
+	{
+		free(xzjob.out);
+		return 0;
+	}
+	*len = total;
+	return xzjob.out;
+}
+
+static byte *do_unxz(byte *data, int *len) {
+	byte *out;
+	crc_init();
+	if ((out = xzparallel(data, len)))
+	{
+		free(data);
+		return out;
+	}
 	inf_buf = 0;
 	inf_pos = inf_len = 0;
 	if (unxz(data, *len) < 0)
+	{
+		free(inf_buf);
+		inf_buf = 0;
 		return data;
+	}
 	free(data);
 	*len = inf_pos;
 	return inf_buf;
 }
 
+/*
+ * Zip archives. The central directory at the end lists every member,
+ * with its sizes, crc and where its local header is, so one member is
+ * found and inflated without reading or inflating any other. A zip on
+ * its own gives its first rom (.gb or .gbc), or failing that its first
+ * member; "pack.zip/name" is the member called name, read straight
+ * from the file. zip_index keeps the last archive's directory, for the
+ * rom browser and for loading from it again, until the file changes.
+ * Zip64 isn't handled; no rom pack comes near 4GB.
+ */
+
+/* whether s ends in ext, in either case */
+static int hasext(const char *s, const char *ext)
+{
+	int n = strlen(s), m = strlen(ext);
+
+	if (n < m) return 0;
+	for (s += n - m; *s; s++, ext++)
+		if (tolower((byte)*s) != *ext) return 0;
+	return 1;
+}
+
+/* the end of central directory record in the last n bytes of an
+   archive, which are at p; -1 if there's none */
+static int zip_end(byte *p, int n)
+{
+	int i;
+
+	for (i = n - 22; i >= 0 && i >= n - 22 - 65535; i--)
+		if (le32(p + i) == 0x06054b50 && i + 22 + le16(p + i + 20) <= n)
+			return i;
+	return -1;
+}
+
+static void zip_free(struct zipentry *e, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) free(e[i].name);
+	free(e);
+}
+
+/* the count entries of a central directory, len bytes at cd */
+static int zip_entries(byte *cd, unsigned len, int count,
+	struct zipentry **list)
+{
+	struct zipentry *e;
+	unsigned pos = 0, fnl;
+	int n;
+
+	if (!(e = calloc(count ? count : 1, sizeof *e))) return -1;
+	for (n = 0; n < count; n++)
+	{
+		if (pos + 46 > len || le32(cd + pos) != 0x02014b50) break;
+		fnl = le16(cd + pos + 28);
+		if (pos + 46 + fnl > len || !(e[n].name = malloc(fnl + 1))) break;
+		memcpy(e[n].name, cd + pos + 46, fnl);
+		e[n].name[fnl] = 0;
+		e[n].method = le16(cd + pos + 10);
+		e[n].crc = le32(cd + pos + 16);
+		e[n].csize = le32(cd + pos + 20);
+		e[n].usize = le32(cd + pos + 24);
+		e[n].off = le32(cd + pos + 42);
+		pos += 46 + fnl + le16(cd + pos + 30) + le16(cd + pos + 32);
+	}
+	*list = e;
+	return n;
+}
+
+/* which member to load: the one called name, or without a name the
+   first rom, or the first file */
+static int zip_pick(struct zipentry *e, int n, const char *name)
+{
+	int i;
+
+	if (name)
+	{
+		for (i = 0; i < n; i++)
+			if (!strcmp(e[i].name, name)) return i;
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		if (hasext(e[i].name, ".gb") || hasext(e[i].name, ".gbc"))
+			return i;
+	for (i = 0; i < n && hasext(e[i].name, "/"); i++);
+	return i < n ? i : -1;
+}
+
+/* the member whose compressed data is at comp, in a buffer of its
+   own; 0 if it's damaged or compressed some way other than deflate */
+static byte *zip_inflate(byte *comp, struct zipentry *e, int *len)
+{
+	byte *out;
+	size_t n;
+
+	if (e->method == 0)
+	{
+		if (!(out = malloc(e->csize ? e->csize : 1))) return 0;
+		memcpy(out, comp, e->csize);
+		n = e->csize;
+	}
+	else if (e->method == 8)
+	{
+		out = tinfl_decompress_mem_to_heap_sized(comp, e->csize,
+			e->usize > INF_HINT_MAX ? 0 : e->usize, &n, 0);
+		if (!out) return 0;
+	}
+	else
+	{
+		loader_set_error("%s: unsupported zip compression %d\n",
+			e->name, e->method);
+		return 0;
+	}
+	crc_init();
+	if (n != e->usize || xz_crc32(out, n, 0) != e->crc)
+	{
+		loader_set_error("%s: damaged zip member\n", e->name);
+		free(out);
+		return 0;
+	}
+	*len = n;
+	return out;
+}
+
+/* a whole archive in memory, which is freed if a member comes out */
+static byte *pkunzip(byte *data, int *len)
+{
+	struct zipentry *e;
+	byte *out = 0;
+	unsigned st;
+	int end, n, i;
+
+	if ((end = zip_end(data, *len)) < 0) return data;
+	st = le32(data + end + 16);
+	if (st > (unsigned)end || le32(data + end + 12) > end - st) return data;
+	if ((n = zip_entries(data + st, end - st, le16(data + end + 10), &e)) < 0)
+		return data;
+	if ((i = zip_pick(e, n, 0)) >= 0 && e[i].off + 30 <= (unsigned)*len
+		&& le32(data + e[i].off) == 0x04034b50)
+	{
+		st = e[i].off + 30 + le16(data + e[i].off + 26)
+			+ le16(data + e[i].off + 28);
+		if (st <= (unsigned)*len && e[i].csize <= *len - st)
+			out = zip_inflate(data + st, &e[i], len);
+	}
+	zip_free(e, n);
+	if (!out) return data;
+	free(data);
+	return out;
+}
+
+static struct
+{
+	char *fn;
+	long long size, mtime;
+	struct zipentry *e;
+	int n;
+} zipcache;
+
+static int readat(FILE *f, long off, void *buf, int len)
+{
+	return fseek(f, off, SEEK_SET) || fread(buf, 1, len, f) != (size_t)len
+		? -1 : 0;
+}
+
+int zip_index(char *fn, struct zipentry **list)
+{
+	struct stat st;
+	FILE *f;
+	byte *tail, *cd;
+	unsigned cdlen, cdoff;
+	int n, end, count;
+
+	if (stat(fn, &st) || !S_ISREG(st.st_mode)) return -1;
+	if (zipcache.fn && !strcmp(zipcache.fn, fn)
+		&& zipcache.size == st.st_size && zipcache.mtime == st.st_mtime)
+	{
+		*list = zipcache.e;
+		return zipcache.n;
+	}
+	if (!(f = fopen(fn, "rb"))) return -1;
+	n = st.st_size < 22 + 65535 ? st.st_size : 22 + 65535;
+	tail = malloc(n ? n : 1);
+	if (!tail || readat(f, st.st_size - n, tail, n)
+		|| (end = zip_end(tail, n)) < 0)
+	{
+		free(tail);
+		fclose(f);
+		return -1;
+	}
+	count = le16(tail + end + 10);
+	cdlen = le32(tail + end + 12);
+	cdoff = le32(tail + end + 16);
+	free(tail);
+	cd = 0;
+	if ((long long)cdoff + cdlen > st.st_size || !(cd = malloc(cdlen + 1))
+		|| readat(f, cdoff, cd, cdlen)
+		|| (n = zip_entries(cd, cdlen, count, list)) < 0)
+	{
+		free(cd);
+		fclose(f);
+		return -1;
+	}
+	free(cd);
+	fclose(f);
+	if (zipcache.fn) zip_free(zipcache.e, zipcache.n);
+	free(zipcache.fn);
+	zipcache.fn = strdup(fn);
+	zipcache.size = st.st_size;
+	zipcache.mtime = st.st_mtime;
+	zipcache.e = *list;
+	zipcache.n = n;
+	return n;
+}
+
+/* for "pack.zip/name", the archive opened and the member read from
+   it; 0 if fn isn't one */
+static FILE *zip_open(char *fn, byte **data, int *len)
+{
+	struct zipentry *e;
+	FILE *f;
+	byte h[30], *comp;
+	char *p, *path;
+	int n, i;
+
+	if (!(path = strdup(fn))) return 0;
+	for (p = path; (p = strchr(p, '/')); p++)
+	{
+		*p = 0;
+		if (hasext(path, ".zip") && (n = zip_index(path, &e)) >= 0)
+			break;
+		*p = '/';
+	}
+	f = 0;
+	if (!p || (i = zip_pick(e, n, p + 1)) < 0 || !(f = fopen(path, "rb"))
+		|| readat(f, e[i].off, h, 30) || le32(h) != 0x04034b50
+		|| !(comp = malloc(e[i].csize ? e[i].csize : 1)))
+		goto fail;
+	if (readat(f, e[i].off + 30 + le16(h + 26) + le16(h + 28),
+		comp, e[i].csize) || !(*data = zip_inflate(comp, &e[i], len)))
+	{
+		free(comp);
+		goto fail;
+	}
+	free(comp);
+	free(path);
+	return f;
+fail:
+	if (f) fclose(f);
+	free(path);
+	return 0;
+}
+
+static int decompress_magic(byte *data)
+{
+	if (data[0] == 0x1f && data[1] == 0x8b) return 1;
+	if (data[0] == 0xFD && !memcmp(data+1, "7zXZ", 4)) return 2;
+	if (data[0] == 'P' && !memcmp(data+1, "K\03\04", 3)) return 3;
+	return 0;
+}
+
 static byte *decompress(byte *data, int *len)
 {
-	if (data[0] == 0x1f && data[1] == 0x8b)
-		return gunzip(data, len);
-	if (data[0] == 0xFD && !memcmp(data+1, "7zXZ", 4))
-		return do_unxz(data, len);
-	if (data[0] == 'P' && !memcmp(data+1, "K\03\04", 3))
-		return pkunzip(data, len);
+	switch (decompress_magic(data))
+	{
+	case 1: return gunzip(data, len);
+	case 2: return do_unxz(data, len);
+	case 3: return pkunzip(data, len);
+	}
 	return data;
 }
 
-static FILE* rom_loadfile(char *fn, byte** data, int *len) {
+/*
+ * The same index lets a rom that's been packed in small blocks (xz
+ * --block-size=16KiB, say) be unpacked as it's used instead of all at
+ * load: the image is allocated whole, but only bank 0 is unpacked into
+ * it then, and mem_maprom asks for each other bank as it's mapped. The
+ * pages of the image that are never written are never given memory,
+ * so a short run of a big rom starts at once and costs little. Bank
+ * switching is the only way to a bank besides the debugger and
+ * cheats, which ask too. A block is claimed before it's unpacked, so
+ * instances in other threads that share the rom (see context.c) wait
+ * for it instead of writing it twice. Only done without a romcache,
+ * which is the other way of not unpacking a rom every time.
+ */
+
+int rom_lazy;
+
+static struct
+{
+	byte *data, *state;
+	struct xzblock *b;
+	int n;
+} lazy;
+
+/* block i into the image at out, unless it's there already */
+static void lazyblock(byte *out, int i)
+{
+	byte none = 0;
+
+	if (__atomic_load_n(&lazy.state[i], __ATOMIC_ACQUIRE) == 2) return;
+	if (__atomic_compare_exchange_n(&lazy.state[i], &none, 1, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		if (xzblock(lazy.data, out, &lazy.b[i]))
+		{
+			diag(DIAG_ERR, "rom block %d is damaged\n", i);
+			memset(out + lazy.b[i].out, 0xff, lazy.b[i].len);
+		}
+		__atomic_store_n(&lazy.state[i], 2, __ATOMIC_RELEASE);
+		return;
+	}
+	while (__atomic_load_n(&lazy.state[i], __ATOMIC_ACQUIRE) != 2)
+		sys_nap(100);
+}
+
+static void lazyrange(byte *out, unsigned lo, unsigned hi)
+{
+	int a = 0, b = lazy.n, m;
+
+	/* the first block that ends past lo */
+	while (a < b)
+	{
+		m = (a + b) / 2;
+		if (lazy.b[m].out + lazy.b[m].len <= lo) a = m + 1;
+		else b = m;
+	}
+	for (; a < lazy.n && lazy.b[a].out < hi; a++) lazyblock(out, a);
+}
+
+void rom_unpack(int bank)
+{
+	if (rom_lazy) lazyrange(rom.bank[0], bank * 16384, bank * 16384 + 16384);
+}
+
+static void lazyfree()
+{
+	rom_lazy = 0;
+	free(lazy.data);
+	free(lazy.state);
+	free(lazy.b);
+	memset(&lazy, 0, sizeof lazy);
+}
+
+/* the image of the compressed rom at data with only bank 0 unpacked,
+   taking data over; 0 if it isn't a file of blocks */
+static byte *xzlazy(byte *data, int *len)
+{
+	struct xzblock *b;
+	unsigned total, rlen;
+	byte *out;
+	int n;
+
+	if (*len < 5 || decompress_magic(data) != 2) return 0;
+	crc_init();
+	if (!(b = xzindex(data, *len, &n, &total))) return 0;
+	lazyfree();
+	lazy.b = b;
+	lazy.n = n;
+	lazy.data = data;
+	lazy.state = calloc(n, 1);
+	if (total < 0x150 || !lazy.state || !(out = malloc(total)))
+		goto fail;
+	lazyrange(out, 0, 16384);
+	rlen = 16384 * romsize_table[out[0x148]];
+	/* a block past the end of the rom would be unpacked past the end
+	   of rom.bank */
+	if (rlen < total)
+	{
+		free(out);
+		goto fail;
+	}
+	rom_lazy = 1;
+	*len = total;
+	return out;
+fail:
+	lazy.data = 0;
+	lazyfree();
+	return 0;
+}
+
+static FILE* rom_readfile(char *fn, byte** data, int *len) {
 	FILE *f;
 	if (strcmp(fn, "-")) f = fopen(fn, "rb");
 	else f = stdin;
+	if (!f && (f = zip_open(fn, data, len))) return f;
 	if (!f) {
 	err:
 		loader_set_error("cannot open rom file: %s\n", fn);
@@ -310,7 +899,12 @@ static FILE* rom_loadfile(char *fn, byte** data, int *len) {
 		f = 0;
 		goto err;
 	}
-	*data = decompress(*data, len);
+	return f;
+}
+
+static FILE* rom_loadfile(char *fn, byte** data, int *len) {
+	FILE *f = rom_readfile(fn, data, len);
+	if (f) *data = decompress(*data, len);
 	return f;
 }
 
@@ -340,20 +934,120 @@ int bootrom_load() {
        rom_load_simple is only called by rominfo in main.c, which we can ignore.
        the mem allocated by loadfile thru loader_init/rom_load ends up in
        rom.bank, which is freed in loader_unload(), just like the malloc'd
-       rom.sbank.
+       rom.sbank. uncompressed roms skip loadfile entirely: rom_mapfile
+       maps them via sys_mapfile and loader_unload() unmaps them again
+       (rom_maplen tells the two cases apart). rom_load_shared can leave
+       rom.bank pointing at the caller's own memory, which isn't ours to
+       free or unmap (rom_maplen is -1 then).
    where it gets complicated is when rom_loadfile uncompresses data.
    the allocation returned by loadfile is passed to decompress().
    if it fails, it returns the original loadfile allocation, on success
    it returns a pointer to inf_buf which contains the uncompressed data.
 */
 
-int rom_load()
+/* size of the mapping behind rom.bank, 0 if it came from loadfile,
+   -1 if it's the caller's (rom_load_shared) */
+static int rom_maplen;
+
+int rom_shared()
 {
-	FILE *f;
-	byte c, *data, *header;
-	int len = 0, rlen;
-	f = rom_loadfile(romfile, &data, &len);
-	if(!f) return -1;
+	return rom_maplen != 0;
+}
+
+/* uncompressed roms are mapped straight from the file instead of being
+   copied, when the sys backend supports it. anything that isn't
+   obviously a plain rom image goes through the normal loader. */
+static byte *rom_mapfile(char *fn, int *len, int *maplen)
+{
+	byte *data;
+	int rlen;
+
+	if (!strcmp(fn, "-")) return 0;
+	if (!(data = sys_mapfile(fn, len, 0, 0))) return 0;
+	if (*len < 0x150 || decompress_magic(data)
+		|| !(rlen = 16384 * romsize_table[data[0x148]]))
+	{
+		sys_unmapfile(data, *len);
+		return 0;
+	}
+	if (rlen > *len)
+	{
+		sys_unmapfile(data, *len);
+		if (!(data = sys_mapfile(fn, len, rlen, 0xff))) return 0;
+	}
+	*maplen = rlen > *len ? rlen : *len;
+	return data;
+}
+
+/* the rom cache keeps decompressed copies of compressed roms, named
+   after the fingerprint of the compressed file, so that later runs can
+   map them instead of decompressing again. */
+static char *rom_cachename(byte *data, int len)
+{
+	char *name = malloc(strlen(romcache) + 24);
+	sprintf(name, "%s/%016llx.gb", romcache,
+		(unsigned long long)rom_fingerprint(data, len));
+	return name;
+}
+
+static void rom_cachestore(char *name, byte *data, int len)
+{
+	/* by way of a temporary file, so that other instances never map
+	   a half written image. two storing the same rom at once both
+	   write the same thing, and whichever renames last wins */
+	sys_putfile(name, data, len);
+}
+
+/* like rom_loadfile, but compressed roms go through the cache */
+static FILE *rom_loadcached(char *fn, byte **data, int *len, int *maplen)
+{
+	FILE *f, *cf;
+	char *name;
+	byte *cached;
+	int clen;
+
+	f = rom_readfile(fn, data, len);
+	if (f && (!romcache || !*romcache) && (cached = xzlazy(*data, len)))
+	{
+		*data = cached;
+		return f;
+	}
+	if (!f || !romcache || !*romcache || !decompress_magic(*data))
+	{
+		if (f) *data = decompress(*data, len);
+		return f;
+	}
+	name = rom_cachename(*data, *len);
+	cached = rom_mapfile(name, &clen, maplen);
+	if (!cached && (cf = fopen(name, "rb")))
+	{
+		/* no mmap on this system; reading is still cheaper */
+		cached = loadfile(cf, &clen);
+		fclose(cf);
+	}
+	if (cached)
+	{
+		free(*data);
+		*data = cached;
+		*len = clen;
+	}
+	else
+	{
+		cached = *data;
+		*data = decompress(*data, len);
+		if (*data != cached) rom_cachestore(name, *data, *len);
+	}
+	free(name);
+	return f;
+}
+
+/* set up rom.bank and the cartridge from an image in memory, which
+   from then on belongs to rom.bank; maplen is as for rom_maplen */
+static int rom_setup(byte *data, int len, int maplen)
+{
+	byte c, *header;
+	int rlen;
+
 	header = data;
 
 	memcpy(rom.name, header+0x0134, 16);
@@ -382,13 +1076,17 @@ int rom_load()
 	c = header[0x0143];
 
 	/* from this point on, we may no longer access data and header */
-	rom.bank = realloc(data, rlen);
-	if (rlen > len) memset(rom.bank[0]+len, 0xff, rlen - len);
+	if ((rom_maplen = maplen)) rom.bank = (void *)data;
+	else
+	{
+		rom.bank = realloc(data, rlen);
+		if (rlen > len) memset(rom.bank[0]+len, 0xff, rlen - len);
+	}
+	cpu_idleforget();
 
 	ram.sbank = malloc(8192 * mbc.ramsize);
 
 	initmem(ram.sbank, 8192 * mbc.ramsize);
-	initmem(ram.ibank, 4096 * 8);
 
 	mbc.rombank = 1;
 	mbc.rambank = 0;
@@ -396,16 +1094,344 @@ int rom_load()
 	hw.cgb = ((c == 0x80) || (c == 0xc0)) && !forcedmg;
 	hw.gba = (hw.cgb && gbamode);
 
-	if (strcmp(romfile, "-")) fclose(f);
+	if (mem_sizewram())
+	{
+		loader_set_error("out of memory\n");
+		return -1;
+	}
+	initmem(ram.ibank, 4096 * WRAMBANKS);
+
+	return 0;
+}
 
+/*
+ * A rom pack is any number of roms in one uncompressed file, for farms
+ * that would otherwise open thousands of files, often over a network
+ * filesystem. The pack named by "rompack" is mapped the first time
+ * it's needed and stays mapped, and "pack:hash" loads the rom whose
+ * fingerprint (rom_fingerprint, as romcache names files) is hash by
+ * pointing rom.bank into the mapping: nothing's read or copied, and a
+ * process that maps the pack before forking (gnuboy-batch -P) shares
+ * it with every worker. rom_pack_make writes one. Little endian:
+ *
+ *   "GBROMPAK", count (4), 0 (4)
+ *   count entries of 64 bytes, in order of hash:
+ *     hash (8), offset (8), size (4), cart type, cgb flag, rom size
+ *     code, 0, title (16, 0 padded), 24 bytes of 0
+ *
+ * then the images, each at a page aligned offset and padded with 0xff
+ * to the size its header gives. A pack has to be under 2GB, and where
+ * the system can't map files there are no packs.
+ */
+
+#define PACKHEAD 16
+#define PACKENTRY 64
+#define PACKALIGN 4096
+
+static char *rompack;
+static char *packname;
+static byte *pack;
+static int packlen;
+
+int rom_pack_open()
+{
+	unsigned n;
+
+	if (pack && packname && rompack && !strcmp(packname, rompack))
+		return 0;
+	if (pack) sys_unmapfile(pack, packlen);
+	pack = 0;
+	free(packname);
+	packname = 0;
+	if (!rompack || !*rompack) return -1;
+	if (!(pack = sys_mapfile(rompack, &packlen, 0, 0)))
+	{
+		loader_set_error("cannot map rom pack %s\n", rompack);
+		return -1;
+	}
+	n = le32(pack + 8);
+	if (packlen < PACKHEAD || memcmp(pack, "GBROMPAK", 8)
+		|| n > (unsigned)(packlen - PACKHEAD) / PACKENTRY)
+	{
+		loader_set_error("%s is not a rom pack\n", rompack);
+		sys_unmapfile(pack, packlen);
+		pack = 0;
+		return -1;
+	}
+	packname = strdup(rompack);
 	return 0;
 }
 
+static int rom_packload(char *hash)
+{
+	unsigned long long h, e, off;
+	unsigned size;
+	byte *p;
+	int a, b, m;
+
+	h = strtoull(hash, 0, 16);
+	if (rom_pack_open()) return -1;
+	a = 0;
+	b = le32(pack + 8);
+	while (a < b)
+	{
+		m = (a + b) / 2;
+		p = pack + PACKHEAD + m * PACKENTRY;
+		e = le32(p) | (unsigned long long)le32(p + 4) << 32;
+		if (e == h) break;
+		if (e < h) a = m + 1;
+		else b = m;
+	}
+	if (a >= b)
+	{
+		loader_set_error("no rom %s in %s\n", hash, rompack);
+		return -1;
+	}
+	off = le32(p + 8) | (unsigned long long)le32(p + 12) << 32;
+	size = le32(p + 16);
+	if (off > (unsigned)packlen || size > packlen - off || size < 0x150
+		|| 16384 * romsize_table[pack[off + 0x148]] > size)
+	{
+		loader_set_error("rom %s in %s is damaged\n", hash, rompack);
+		return -1;
+	}
+	return rom_setup(pack + off, size, -1);
+}
+
+struct packentry
+{
+	unsigned long long hash, off;
+	unsigned size;
+	byte type, cgb, romsize;
+	char title[16];
+};
+
+static int packcmp(const void *a, const void *b)
+{
+	const struct packentry *x = a, *y = b;
+
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static void put64(byte *p, unsigned long long v)
+{
+	putle32(p, v);
+	putle32(p + 4, v >> 32);
+}
+
+/* a pack of the n roms in files, which may be compressed, as out, with
+   each one's hash in hashes if it isn't 0; the same rom twice is
+   packed once */
+int rom_pack_make(char *out, char **files, int n, unsigned long long *hashes)
+{
+	struct packentry *e;
+	FILE *f, *o;
+	byte *data, ent[PACKENTRY], pad[PACKALIGN];
+	unsigned long long at;
+	int i, k, len, rlen, ne = 0;
+
+	if (!(e = calloc(n ? n : 1, sizeof *e))) return -1;
+	if (!(o = fopen(out, "wb")))
+	{
+		loader_set_error("cannot write %s\n", out);
+		free(e);
+		return -1;
+	}
+	crc_init();
+	memset(pad, 0xff, sizeof pad);
+	at = (PACKHEAD + (unsigned long long)n * PACKENTRY + PACKALIGN - 1)
+		& ~(unsigned long long)(PACKALIGN - 1);
+	for (i = 0; i < n; i++)
+	{
+		if (!(f = rom_readfile(files[i], &data, &len))) goto fail;
+		if (f != stdin) fclose(f);
+		data = decompress(data, &len);
+		if (len < 0x150 || !(rlen = 16384 * romsize_table[data[0x148]]))
+		{
+			loader_set_error("%s is not a rom\n", files[i]);
+			free(data);
+			goto fail;
+		}
+		e[ne].hash = rom_fingerprint(data, len);
+		if (hashes) hashes[i] = e[ne].hash;
+		for (k = 0; k < ne && e[k].hash != e[ne].hash; k++);
+		if (k < ne)
+		{
+			free(data);
+			continue;
+		}
+		e[ne].off = at;
+		e[ne].size = len > rlen ? len : rlen;
+		e[ne].type = data[0x147];
+		e[ne].cgb = data[0x143];
+		e[ne].romsize = data[0x148];
+		memcpy(e[ne].title, data + 0x134, 16);
+		if (fseek(o, at, SEEK_SET) || fwrite(data, len, 1, o) != 1)
+		{
+			free(data);
+			goto wfail;
+		}
+		free(data);
+		for (k = len; k < (int)e[ne].size; k += sizeof pad)
+			if (fwrite(pad, e[ne].size - k < sizeof pad
+				? e[ne].size - k : sizeof pad, 1, o) != 1)
+				goto wfail;
+		at = (at + e[ne].size + PACKALIGN - 1)
+			& ~(unsigned long long)(PACKALIGN - 1);
+		ne++;
+	}
+	qsort(e, ne, sizeof *e, packcmp);
+	memset(ent, 0, sizeof ent);
+	memcpy(ent, "GBROMPAK", 8);
+	putle32(ent + 8, ne);
+	if (fseek(o, 0, SEEK_SET) || fwrite(ent, PACKHEAD, 1, o) != 1)
+		goto wfail;
+	for (i = 0; i < ne; i++)
+	{
+		memset(ent, 0, sizeof ent);
+		put64(ent, e[i].hash);
+		put64(ent + 8, e[i].off);
+		putle32(ent + 16, e[i].size);
+		ent[20] = e[i].type;
+		ent[21] = e[i].cgb;
+		ent[22] = e[i].romsize;
+		memcpy(ent + 24, e[i].title, 16);
+		if (fwrite(ent, PACKENTRY, 1, o) != 1) goto wfail;
+	}
+	free(e);
+	if (fclose(o))
+	{
+		loader_set_error("cannot write %s\n", out);
+		remove(out);
+		return -1;
+	}
+	return 0;
+wfail:
+	loader_set_error("cannot write %s\n", out);
+fail:
+	fclose(o);
+	remove(out);
+	free(e);
+	return -1;
+}
+
+int rom_load()
+{
+	FILE *f = 0;
+	byte *data;
+	int len = 0, maplen = 0, r;
+	if (!strncmp(romfile, "pack:", 5)) return rom_packload(romfile + 5);
+	/* a watched file is read rather than mapped: rebuilding it would
+	   pull the pages out from under the running game */
+	if (romwatch > 0 || !(data = rom_mapfile(romfile, &len, &maplen)))
+	{
+		f = rom_loadcached(romfile, &data, &len, &maplen);
+		if(!f) return -1;
+	}
+	r = rom_setup(data, len, maplen);
+	if (f && strcmp(romfile, "-")) fclose(f);
+	return r;
+}
+
+/* like rom_load, from a copy of len bytes at data, which may be
+   compressed; for embedders that have no rom file */
+int rom_load_mem(const byte *data, int len)
+{
+	byte *copy;
+
+	if (len < 0x150 || !(copy = malloc(len)))
+	{
+		loader_set_error("bad rom image\n");
+		return -1;
+	}
+	memcpy(copy, data, len);
+	copy = decompress(copy, &len);
+	if (len < 0x150)
+	{
+		free(copy);
+		loader_set_error("bad rom image\n");
+		return -1;
+	}
+	if (rom_setup(copy, len, 0))
+	{
+		free(copy);
+		return -1;
+	}
+	return 0;
+}
+
+/* rom_load from the file fn, for embedders that don't go through
+   loader_init */
+int rom_load_file(const char *fn)
+{
+	free(romfile);
+	if (!(romfile = strdup(fn)))
+	{
+		loader_set_error("out of memory\n");
+		return -1;
+	}
+	if (!rom_load()) return 0;
+	free(romfile);
+	romfile = 0;
+	return -1;
+}
+
+/* like rom_load_mem, but an uncompressed image that holds the whole
+   rom is used where it is rather than copied, so instances loaded
+   from the same memory (a mapping shared between processes, say)
+   share one rom. the caller keeps it there, unchanged, until the rom
+   is unloaded. anything else is copied as rom_load_mem does. */
+int rom_load_shared(const byte *data, int len)
+{
+	int rlen;
+
+	if (len < 0x150 || decompress_magic((byte *)data)
+		|| !(rlen = 16384 * romsize_table[data[0x148]]) || rlen > len)
+		return rom_load_mem(data, len);
+	return rom_setup((byte *)data, len, -1);
+}
+
 int rom_load_simple(char *fn) {
 	romfile = fn;
 	return rom_load();
 }
 
+/* the title, cgb flag and cartridge type from the header of the rom
+   in fn, without loading it, for the menu's rom index. a compressed
+   rom has to be unpacked whole to get at its header. */
+int rom_header(char *fn, char *title, int *cgb, int *type)
+{
+	FILE *f;
+	byte buf[0x150], *data = buf;
+	int i, len;
+
+	if (!(f = fopen(fn, "rb")))
+	{
+		if (!(f = zip_open(fn, &data, &len))) return -1;
+	}
+	else if ((len = fread(buf, 1, sizeof buf, f)) >= 5
+		&& decompress_magic(buf))
+	{
+		fseek(f, 0, SEEK_SET);
+		if ((data = loadfile(f, &len))) data = decompress(data, &len);
+	}
+	fclose(f);
+	if (!data || len < 0x150)
+	{
+		if (data != buf) free(data);
+		return -1;
+	}
+	/* the end of the title is a manufacturer code and the cgb flag
+	   on newer carts; stop at anything that isn't text */
+	for (i = 0; i < 16 && data[0x134+i] >= 32 && data[0x134+i] < 127; i++)
+		title[i] = data[0x134+i];
+	title[i] = 0;
+	*cgb = data[0x143] == 0x80 || data[0x143] == 0xc0;
+	*type = data[0x147];
+	if (data != buf) free(data);
+	return 0;
+}
+
 int sram_load()
 {
 	FILE *f;
@@ -414,10 +1440,15 @@ int sram_load()
 
 	/* Consider sram loaded at this point, even if file doesn't exist */
 	ram.loaded = 1;
+	sramsynced = 0;
 
 	f = fopen(sramfile, "rb");
 	if (!f) return -1;
-	fread(ram.sbank, 8192, mbc.ramsize, f);
+	if (fread(ram.sbank, 8192, mbc.ramsize, f) == mbc.ramsize)
+	{
+		sramsynced = 1;
+		mem_sramsaved();
+	}
 	fclose(f);
 	
 	return 0;
@@ -434,51 +1465,428 @@ int sram_save()
 	
 	f = fopen(sramfile, "wb");
 	if (!f) return -1;
-	fwrite(ram.sbank, 8192, mbc.ramsize, f);
-	fclose(f);
+	sramsynced = fwrite(ram.sbank, 8192, mbc.ramsize, f) == mbc.ramsize;
+	if (fclose(f)) sramsynced = 0;
+	if (sramsynced) mem_sramsaved();
 	
 	return 0;
 }
 
+/* write back just the 4k pages of sram that changed since the file
+   was last brought up to date, or the whole thing if we don't know
+   what's on disk */
+int sram_flush()
+{
+	FILE *f;
+	int i, ok = 1;
 
-void state_save(int n)
+	if (!sramsynced) return sram_save();
+	if (!mbc.batt || !sramfile || !ram.loaded || !mbc.ramsize)
+		return -1;
+	if (!dirty.sramsave) return 0;
+
+	if (!(f = fopen(sramfile, "r+b"))) return sram_save();
+	for (i = 0; i < mbc.ramsize << 1; i++)
+	{
+		if (!((dirty.sramsave >> i) & 1)) continue;
+		if (fseek(f, (long)i << 12, SEEK_SET)
+			|| fwrite(ram.sbank[0] + (i << 12), 4096, 1, f) != 1)
+			ok = 0;
+	}
+	if (fclose(f)) ok = 0;
+	if (!ok) return sram_save();
+	mem_sramsaved();
+	return 0;
+}
+
+static void state_write(int all);
+static void bootrom_frame();
+
+/* with romwatch the rom's file is looked at every WATCHEVERY frames,
+   and once it has changed and then sat still for a look, so that it
+   isn't caught half written, it's swapped in with loader_swap */
+#define WATCHEVERY 30
+
+static void romwatch_frame()
+{
+	static char *file;
+	static long long size, mtime;
+	static int frames, moved;
+	struct stat st;
+	char *s;
+
+	if (romwatch <= 0 || !romfile || ++frames < WATCHEVERY) return;
+	frames = 0;
+	if (stat(romfile, &st) || !S_ISREG(st.st_mode)) return;
+	if (!file || strcmp(file, romfile))
+	{
+		free(file);
+		file = strdup(romfile);
+		moved = 0;
+	}
+	else if (st.st_size != size || st.st_mtime != mtime) moved = 1;
+	else if (moved)
+	{
+		moved = 0;
+		s = strdup(file);
+		if (s && loader_swap(s, romwatch > 1) >= 0)
+			diag(DIAG_ERR, "romwatch: %s reloaded\n", s);
+		free(s);
+	}
+	size = st.st_size;
+	mtime = st.st_mtime;
+}
+
+/* called once per frame by the main loop */
+void loader_frame()
+{
+	static int frames;
+
+	state_write(0);
+	bootrom_frame();
+	romwatch_frame();
+	if (sramsync <= 0 || ++frames < sramsync) return;
+	frames = 0;
+	sram_flush();
+}
+
+
+/* state_save only snapshots the machine into memory; the file is
+   written a chunk per frame from loader_frame, under a temporary name
+   that is renamed into place at the end, so a slow disk never stalls
+   a frame and a crash never leaves a half written state behind. when
+   it's done an EV_STATE event is posted, with the slot in code and
+   x nonzero if the write failed. */
+#define STATE_CHUNK 32768
+
+static struct
 {
+	byte *buf;
+	int len, pos, slot;
+	char *name, *tmp;
 	FILE *f;
-	char *name;
+} pending;
 
-	if (n < 0) n = saveslot;
-	if (n < 0) n = 0;
-	name = malloc(strlen(saveprefix) + 5);
-	sprintf(name, "%s.%03d", saveprefix, n);
+/* the numbered slots 0-9 are kept in memory too, as last saved or
+   loaded, so loading one again is an unpack with no file opened. the
+   file is only read again if its size or time say something else has
+   written it since; size is -1 while what's here hasn't reached the
+   file, or couldn't, and then it wins */
+#define SLOTS 10
 
-	if ((f = fopen(name, "wb")))
+static struct
+{
+	byte *buf;
+	int len, room;
+	long size;
+	time_t mtime;
+} slots[SLOTS];
+
+/* room is how much buf holds, so a later save can go in it again
+   rather than in a new one */
+static void slot_keep(int n, byte *buf, int len, int room, struct stat *st)
+{
+	if (n >= SLOTS) return;
+	if (slots[n].buf != buf)
 	{
-		savestate(f);
-		fclose(f);
+		free(slots[n].buf);
+		slots[n].room = room;
 	}
-	free(name);
+	slots[n].buf = buf;
+	slots[n].len = len;
+	slots[n].size = st ? (long)st->st_size : -1;
+	slots[n].mtime = st ? st->st_mtime : 0;
+}
+
+static void slots_free()
+{
+	int i;
+
+	for (i = 0; i < SLOTS; i++)
+		free(slots[i].buf);
+	memset(slots, 0, sizeof slots);
+}
+
+static void state_done(int err)
+{
+	struct stat st;
+	event_t ev;
+
+	if (pending.f && fclose(pending.f)) err = 1;
+	if (!err && rename(pending.tmp, pending.name))
+	{
+		/* not everybody's rename replaces an existing file */
+		remove(pending.name);
+		if (rename(pending.tmp, pending.name)) err = 1;
+	}
+	if (err) remove(pending.tmp);
+	else if (pending.slot < SLOTS && slots[pending.slot].buf == pending.buf
+		&& !stat(pending.name, &st))
+		slot_keep(pending.slot, pending.buf, pending.len, 0, &st);
+	memset(&ev, 0, sizeof ev);
+	ev.type = EV_STATE;
+	ev.code = pending.slot;
+	ev.x = err;
+	ev_postevent(&ev);
+	if (pending.slot >= SLOTS || slots[pending.slot].buf != pending.buf)
+		free(pending.buf);
+	memset(&pending, 0, sizeof pending);
+}
+
+/* write the next piece of a pending state, or all of it if all is set */
+static void state_write(int all)
+{
+	int n;
+
+	if (!pending.buf) return;
+	do
+	{
+		if (!pending.f && !(pending.f = fopen(pending.tmp, "wb")))
+		{
+			state_done(1);
+			return;
+		}
+		n = pending.len - pending.pos;
+		if (!all && n > STATE_CHUNK) n = STATE_CHUNK;
+		if (fwrite(pending.buf + pending.pos, n, 1, pending.f) != 1)
+		{
+			state_done(1);
+			return;
+		}
+		pending.pos += n;
+	} while (pending.pos < pending.len);
+	state_done(0);
+}
+
+/* a write still going to the file about to be written again is no
+   use any more */
+static void state_drop()
+{
+	if (pending.f) fclose(pending.f);
+	remove(pending.tmp);
+	if (pending.slot >= SLOTS || slots[pending.slot].buf != pending.buf)
+		free(pending.buf);
+	memset(&pending, 0, sizeof pending);
+}
+
+/* the state files' names are made in buffers that are kept, so saving
+   and loading a numbered slot, the one in memory, goes nowhere near
+   the heap once it's been done before */
+enum { NAME_SAVE, NAME_TMP, NAME_LOAD };
+
+static struct
+{
+	char *buf;
+	int len;
+} names[3];
+
+static char *namebuf(int i, int n)
+{
+	if (n > names[i].len)
+	{
+		free(names[i].buf);
+		names[i].len = (names[i].buf = malloc(n)) ? n : 0;
+	}
+	return names[i].buf;
+}
+
+void state_save(int n)
+{
+	unsigned long am = ALLOC_MARK();
+	int room;
+
+	if (n < 0) n = saveslot;
+	if (n < 0) n = 0;
+	if (pending.buf && pending.slot == n) state_drop();
+	state_write(1);
+
+	room = savestate_packsize();
+	if (!(pending.name = namebuf(NAME_SAVE, strlen(saveprefix) + 16))
+		|| !(pending.tmp = namebuf(NAME_TMP, strlen(saveprefix) + 20)))
+		return;
+	/* nothing's writing the slot's own buffer now */
+	if (n < SLOTS && slots[n].buf && slots[n].room >= room)
+		pending.buf = slots[n].buf;
+	else if (!(pending.buf = malloc(room))) return;
+	pending.len = savestate_pack(pending.buf, room);
+	pending.slot = n;
+	slot_keep(n, pending.buf, pending.len, room, 0);
+	sprintf(pending.name, "%s.%03d", saveprefix, n);
+	sprintf(pending.tmp, "%s.tmp", pending.name);
+	ALLOC_CHECK(am, "state_save");
 }
 
 
 void state_load(int n)
 {
 	FILE *f;
+	struct stat st;
 	char *name;
+	byte *p, *keep;
+	int len, ok = 0, got;
+	unsigned long am = ALLOC_MARK();
 
 	if (n < 0) n = saveslot;
 	if (n < 0) n = 0;
-	name = malloc(strlen(saveprefix) + 5);
+	if (!(name = namebuf(NAME_LOAD, strlen(saveprefix) + 16)))
+		return;
 	sprintf(name, "%s.%03d", saveprefix, n);
+	/* only a write to this very file has to be finished first */
+	if (pending.buf && pending.slot == n && n >= SLOTS) state_write(1);
+	got = !stat(name, &st);
 
-	if ((f = fopen(name, "rb")))
+	if (n < SLOTS && slots[n].buf && (slots[n].size < 0
+		|| (got && st.st_size == slots[n].size
+		&& st.st_mtime == slots[n].mtime)))
+	{
+		loadstate_from_buffer(slots[n].buf, slots[n].len);
+		ok = 1;
+	}
+	/* mapped where the system can, rather than read into a copy */
+	else if ((p = sys_mapfile(name, &len, 0, 0)))
+	{
+		loadstate_from_buffer(p, len);
+		if (n < SLOTS && got)
+		{
+			keep = slots[n].buf && slots[n].room >= len
+				? slots[n].buf : malloc(len);
+			if (keep) memcpy(keep, p, len);
+			if (keep) slot_keep(n, keep, len,
+				keep == slots[n].buf ? slots[n].room : len, &st);
+		}
+		sys_unmapfile(p, len);
+		ok = 1;
+	}
+	else if ((f = fopen(name, "rb")))
 	{
 		loadstate(f);
 		fclose(f);
+		ok = 1;
+	}
+	if (ok)
+	{
 		vram_dirty();
 		pal_dirty();
 		sound_dirty();
 		mem_updatemap();
 	}
+	ALLOC_CHECK(am, "state_load");
+}
+
+
+/*
+ * The boot rom always does the same thing for the same cart header,
+ * so once it has run we keep the state it left the machine in and
+ * hand that back on the next reset instead of running it again; with
+ * bootcache 2 it's also kept in savedir for later runs. The key
+ * covers the whole page the boot rom is mapped in, header included.
+ * A run where a button was held is left alone, as the cgb boot rom
+ * picks a palette from it, and so is memrand, which wants its fresh
+ * random ram. Cartridge ram and the rtc aren't the boot rom's
+ * business and are kept as they are.
+ */
+
+static struct
+{
+	byte *buf;
+	int len;
+	uint64_t key;
+} boot;
+static int booting;
+
+static uint64_t bootkey()
+{
+	return rom_fingerprint(bootrom.bank[0], 4096)
+		^ (hw.cgb | hw.gba << 1) ^ (uint64_t)savestate_size() << 2;
+}
+
+static char *bootname(uint64_t key)
+{
+	char *name = malloc(strlen(savedir) + 24);
+	sprintf(name, "%s/%016llx.boot", savedir, (unsigned long long)key);
+	return name;
+}
+
+static int bootfetch(uint64_t key)
+{
+	FILE *f;
+	char *name;
+	byte *data;
+	int len;
+
+	if (boot.buf && boot.key == key) return 0;
+	if (bootcache < 2 || !savedir) return -1;
+	name = bootname(key);
+	f = fopen(name, "rb");
+	free(name);
+	if (!f) return -1;
+	data = loadfile(f, &len);
+	fclose(f);
+	if (!data || len != savestate_size())
+	{
+		free(data);
+		return -1;
+	}
+	free(boot.buf);
+	boot.buf = data;
+	boot.len = len;
+	boot.key = key;
+	return 0;
+}
+
+/* called by emu_reset once the boot rom is mapped */
+void bootrom_reset()
+{
+	byte *sram = 0;
+	struct rtc keep = rtc;
+	int slen = 8192 * mbc.ramsize;
+
+	booting = 0;
+	if (!bootrom.bank || bootcache <= 0 || memrand >= 0) return;
+	if (bootfetch(bootkey()))
+	{
+		booting = 1;
+		return;
+	}
+	if (slen && !(sram = malloc(slen))) return;
+	if (sram) memcpy(sram, ram.sbank, slen);
+	/* a state that's no good is refused before anything is touched,
+	   so then we can still boot for real, and replace it */
+	if (loadstate_from_buffer(boot.buf, boot.len) < 0)
+	{
+		free(sram);
+		booting = 1;
+		return;
+	}
+	if (sram) memcpy(ram.sbank, sram, slen);
+	free(sram);
+	rtc = keep;
+	vram_dirty();
+	pal_dirty();
+	sound_dirty();
+	mem_updatemap();
+}
+
+static void bootrom_frame()
+{
+	char *name;
+
+	if (!booting) return;
+	if (hw.pad)
+	{
+		booting = 0;
+		return;
+	}
+	if (!(REG(RI_BOOT) & 1)) return;
+	booting = 0;
+	free(boot.buf);
+	boot.len = savestate_size();
+	if (!(boot.buf = malloc(boot.len))) return;
+	savestate_to_buffer(boot.buf, boot.len);
+	boot.key = bootkey();
+	if (bootcache < 2 || !savedir) return;
+	name = bootname(boot.key);
+	rom_cachestore(name, boot.buf, boot.len);
 	free(name);
 }
 
@@ -503,12 +1911,30 @@ void rtc_load()
 #define FREENULL(X) do { free(X); X = 0; } while(0)
 void loader_unload()
 {
-	sram_save();
+	state_write(1);
+	slots_free();
+	romdb_unload();
+	sram_flush();
+	memstats_dump(0);
+	memstats_reset();
+	sramsynced = 0;
 	if (romfile) FREENULL(romfile);
 	if (sramfile) FREENULL(sramfile);
 	if (saveprefix) FREENULL(saveprefix);
+	if (rom.bank && rom_maplen)
+	{
+		if (rom_maplen > 0) sys_unmapfile(rom.bank, rom_maplen);
+		rom.bank = 0;
+		rom_maplen = 0;
+	}
 	if (rom.bank) FREENULL(rom.bank);
+	lazyfree();
+	cheat_unload();
 	if (ram.sbank) FREENULL(ram.sbank);
+#ifdef LOWMEM
+	if (ram.ibank) FREENULL(ram.ibank);
+	ram.ibanks = 0;
+#endif
 	if (bootrom.bank) FREENULL(bootrom.bank);
 	mbc.type = mbc.romsize = mbc.ramsize = mbc.batt = 0;
 }
@@ -531,10 +1957,14 @@ static char *ldup(char *s)
 	return n;
 }
 
+static int cleanup_set;
+
 static void cleanup()
 {
-	sram_save();
+	state_write(1);
+	sram_flush();
 	rtc_save();
+	romdb_unload();
 	/* IDEA - if error, write emergency savestate..? */
 }
 
@@ -543,10 +1973,13 @@ int loader_init(char *s)
 	char *name, *p;
 
 	sys_checkdir(savedir, 1); /* needs to be writable */
+	if (romcache && *romcache) sys_checkdir(romcache, 1);
 
 	romfile = s;
 	if(rom_load()) return -1;
+	rewind_reset();
 	bootrom_load();
+	romdb_load(savedir);
 	vid_settitle(rom.name);
 	if (savename && *savename)
 	{
@@ -576,10 +2009,54 @@ int loader_init(char *s)
 	sram_load();
 	rtc_load();
 
-	atexit(cleanup);
+	if (!cleanup_set) atexit(cleanup);
+	cleanup_set = 1;
 	return 0;
 }
 
+/* s in place of the running rom, for "loadrom" and romwatch, without
+   touching anything the frontend has open; the rom, its saves and its
+   rc file are swapped under it. with keep the machine carries on from
+   where it was, if the new rom is laid out the same (model, mapper and
+   cartridge ram), and otherwise it starts from reset. s without a rom
+   header in it is turned away before anything is touched; if it has
+   one and still won't load, the old rom is loaded again and carries on
+   where it was. 1 if the state was kept, 0 if not, -1 if s didn't
+   load */
+int loader_swap(char *s, int keep)
+{
+	byte *buf = 0;
+	char *was, *e, title[17];
+	int len = 0, cgb = hw.cgb, type = mbc.type, ramsize = mbc.ramsize;
+	int r = -1, c, t;
+
+	if (strncmp(s, "pack:", 5) && rom_header(s, title, &c, &t))
+	{
+		diag(DIAG_ERR, "cannot load %s: no rom there\n", s);
+		return -1;
+	}
+	movie_stop();
+	was = romfile ? strdup(romfile) : 0;
+	if ((buf = malloc(savestate_size())))
+		len = savestate_to_buffer(buf, savestate_size());
+	loader_unload();
+	if (!load_rom_and_rc(s)) r = 0;
+	else
+	{
+		e = loader_get_error();
+		diag(DIAG_ERR, "cannot load %s: %s\n", s, e ? e : "no rom there");
+		if (!was || load_rom_and_rc(was))
+			die("cannot load %s again\n", was ? was : "the old rom");
+	}
+	if ((keep || r < 0) && len > 0 && hw.cgb == cgb && mbc.type == type
+		&& mbc.ramsize == ramsize && !loadstate_from_buffer(buf, len)
+		&& !r)
+		r = 1;
+	free(buf);
+	free(was);
+	return r;
+}
+
 rcvar_t loader_exports[] =
 {
 	RCV_STRING("bootrom_dmg", &bootroms[0], "bootrom for DMG games"),
@@ -587,10 +2064,15 @@ rcvar_t loader_exports[] =
 	RCV_STRING("savedir", &savedir, "save directory"),
 	RCV_STRING("savename", &savename, "base filename for saves"),
 	RCV_INT("saveslot", &saveslot, "which savestate slot to use"),
+	RCV_STRING("romcache", &romcache, "directory for decompressed rom images"),
+	RCV_STRING("rompack", &rompack, "rom pack that \"pack:hash\" loads from"),
 	RCV_BOOL("forcebatt", &forcebatt, "save SRAM even on carts w/o battery"),
 	RCV_BOOL("nobatt", &nobatt, "never save SRAM"),
+	RCV_INT("sramsync", &sramsync, "frames between SRAM write-backs, 0 = on exit only"),
+	RCV_INT("romwatch", &romwatch, "reload the rom when its file changes: 0 = off, 1 = from reset, 2 = keeping the state"),
 	RCV_BOOL("forcedmg", &forcedmg, "force DMG mode for CGB carts"),
 	RCV_BOOL("gbamode", &gbamode, "simulate cart being used on a GBA"),
+	RCV_INT("bootcache", &bootcache, "reuse the state the boot rom ends in: 0 = off, 1 = this run, 2 = also on disk"),
 	RCV_INT("memfill", &memfill, ""),
 	RCV_INT("memrand", &memrand, ""),
 	RCV_END
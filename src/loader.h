@@ -3,6 +3,8 @@
 #ifndef __LOADER_H__
 #define __LOADER_H__
 
+#include <stdint.h>
+#include "defs.h"
 
 typedef struct loader_s
 {
@@ -18,11 +20,45 @@ extern loader_t loader;
 
 
 int rom_load();
+int rom_load_mem(const byte *data, int len);
+int rom_load_shared(const byte *data, int len);
+int rom_load_file(const char *fn);
+int rom_header(char *fn, char *title, int *cgb, int *type);
+
+/* a zip's members, as its central directory lists them; the list is
+   the loader's, and lasts until zip_index is asked about another */
+struct zipentry
+{
+	char *name;
+	unsigned off, csize, usize, crc;
+	int method;
+};
+int zip_index(char *fn, struct zipentry **list);
+
+/* with rom_lazy, banks of rom.bank are unpacked as they're needed, and
+   rom_unpack has to be called before reading a bank that isn't mapped */
+extern int rom_lazy;
+void rom_unpack(int bank);
+/* 1 if rom.bank is a mapped file, a rom pack or the caller's memory,
+   none of which may be written to */
+int rom_shared();
+
+/* rom packs: rom_pack_open maps the one "rompack" names, if it isn't
+   already, so that "pack:hash" roms load from it; -1 if it can't */
+int rom_pack_open();
+int rom_pack_make(char *out, char **files, int n, unsigned long long *hashes);
+
+int bootrom_load();
+void bootrom_reset();
+uint64_t rom_fingerprint(byte *data, int len);
 int sram_load();
 int sram_save();
+int sram_flush();
 
 int loader_init(char *s);
+int loader_swap(char *s, int keep);
 void loader_unload(void);
+void loader_frame();
 char *loader_get_error();
 void loader_set_error(char *fmt, ...);
 
@@ -0,0 +1,227 @@
+/*
+ * lockstep.c
+ *
+ * Many instances of one game run side by side, a frame at a time,
+ * each with its own input: "lanes", for training and searching with
+ * hundreds of copies of the same rom. Lanes that are in the same
+ * state and get the same input would all do the same thing, so they
+ * make a group, and the group is run once, by its first lane, for
+ * all of them. A group splits when its lanes' inputs differ, the
+ * lanes that part ways taking a copy of its state (see context.c) and
+ * its picture, and lockstep_merge puts groups back together where
+ * their states have come out the same again. Every lane starts out
+ * in one group with the running instance, so a run that presses the
+ * same buttons in most lanes for the first frames, as games' intros
+ * do, costs little more than one instance until they spread out.
+ *
+ * The instances are the core's, one loaded at a time, so what's
+ * shared is whole frames, not instructions. rom.bank and the lookup
+ * tables are shared as they are for link.c.
+ *
+ * Each group draws into a framebuffer of its own, the frontend's is
+ * put back when lanes stop. Sound, the rcvars and the rest of the
+ * frontend's state go with whichever group is loaded.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "fb.h"
+#include "context.h"
+#include "lockstep.h"
+
+static struct context **ctx;
+/* each lane's group, as the lane that runs for it, and what it's
+   becoming during lockstep_frame */
+static int *rep, *next;
+static int lanes, cur, size;
+static byte *fbs, *home;
+
+#define FB(i) (fbs + (i) * size)
+
+
+int lockstep_lanes()
+{
+	return lanes;
+}
+
+int lockstep_group(int lane)
+{
+	return lane >= 0 && lane < lanes ? rep[lane] : -1;
+}
+
+int lockstep_groups()
+{
+	int i, n = 0;
+
+	for (i = 0; i < lanes; i++)
+		n += rep[i] == i;
+	return n;
+}
+
+byte *lockstep_fb(int lane)
+{
+	return lane >= 0 && lane < lanes ? FB(rep[lane]) : 0;
+}
+
+/* n lanes, all copies of the running instance */
+int lockstep_start(int n)
+{
+	if (lanes || n < 1) return -1;
+	size = fb.pitch * fb.h;
+	ctx = calloc(n, sizeof *ctx);
+	rep = calloc(n, sizeof *rep);
+	next = calloc(n, sizeof *next);
+	fbs = malloc((size_t)n * size);
+	if (!ctx || !rep || !next || !fbs || !(ctx[0] = context_new()))
+	{
+		free(ctx);
+		free(rep);
+		free(next);
+		free(fbs);
+		return -1;
+	}
+	home = fb.ptr;
+	memcpy(FB(0), home, size);
+	fb.ptr = FB(0);
+	lanes = n;
+	cur = 0;
+	return 0;
+}
+
+/* parks the loaded group and loads i's */
+static void load(int i)
+{
+	if (i == cur) return;
+	context_save(ctx[cur]);
+	context_load(ctx[i]);
+	fb.ptr = FB(i);
+	cur = i;
+}
+
+/* the first lane is the one left running */
+void lockstep_stop()
+{
+	int i;
+
+	if (!lanes) return;
+	load(rep[0]);
+	memcpy(home, FB(cur), size);
+	fb.ptr = home;
+	for (i = 0; i < lanes; i++)
+		context_free(ctx[i]);
+	free(ctx);
+	free(rep);
+	free(next);
+	free(fbs);
+	ctx = 0;
+	rep = next = 0;
+	fbs = 0;
+	lanes = 0;
+}
+
+/* gives lane i a copy of group g's state and picture */
+static int part(int i, int g)
+{
+	if (!ctx[i] && !(ctx[i] = context_new())) return -1;
+	context_copy(ctx[i], ctx[g]);
+	memcpy(FB(i), FB(g), size);
+	return 0;
+}
+
+/*
+ * Loads a lane's group, so the frontend can look at it. With alone,
+ * the lane is first taken out of its group, so that what's done to
+ * it doesn't go for the others too. -1 if there's no memory for that.
+ */
+int lockstep_select(int lane, int alone)
+{
+	int i, g;
+
+	if (lane < 0 || lane >= lanes) return -1;
+	g = rep[lane];
+	if (alone && g != lane)
+	{
+		context_save(ctx[cur]);
+		if (part(lane, g)) return -1;
+		rep[lane] = lane;
+	}
+	else if (alone)
+	{
+		/* the next lane in it runs for the rest */
+		for (i = lane + 1; i < lanes && rep[i] != lane; i++);
+		if (i < lanes)
+		{
+			context_save(ctx[cur]);
+			if (part(i, lane)) return -1;
+			for (g = i; i < lanes; i++)
+				if (rep[i] == lane) rep[i] = g;
+		}
+	}
+	load(rep[lane]);
+	return 0;
+}
+
+/*
+ * One frame of every lane, each with in[lane]. Each lane goes with
+ * the first lane before it that was in its group and has the same
+ * input, or makes a group of its own; then run is called once for
+ * each group, with it loaded and its first lane and input, to run a
+ * frame. The last group run is left loaded. -1, with nothing run, if
+ * there's no memory for the new groups.
+ */
+int lockstep_frame(const int *in, void (*run)(int lane, int in))
+{
+	int i, j;
+
+	if (!lanes) return -1;
+	for (i = 0; i < lanes; i++)
+	{
+		next[i] = i;
+		for (j = 0; j < i; j++)
+			if (rep[j] == rep[i] && in[j] == in[i])
+			{
+				next[i] = next[j];
+				break;
+			}
+	}
+	/* all the copies are taken before anything runs */
+	context_save(ctx[cur]);
+	for (i = 0; i < lanes; i++)
+		if (next[i] == i && rep[i] != i && part(i, rep[i]))
+			return -1;
+	memcpy(rep, next, lanes * sizeof *rep);
+	for (i = 0; i < lanes; i++)
+	{
+		if (rep[i] != i) continue;
+		load(i);
+		run(i, in[i]);
+	}
+	return 0;
+}
+
+/* joins groups that have come to the same state, and returns how
+   many groups there are. it compares every pair, so it's for every
+   so often, not every frame */
+int lockstep_merge()
+{
+	int i, j, k;
+
+	if (!lanes) return 0;
+	context_save(ctx[cur]);
+	for (i = 0; i < lanes; i++)
+	{
+		if (rep[i] != i) continue;
+		for (j = i + 1; j < lanes; j++)
+		{
+			if (rep[j] != j || !context_same(ctx[i], ctx[j])) continue;
+			for (k = j; k < lanes; k++)
+				if (rep[k] == j) rep[k] = i;
+		}
+	}
+	/* what's loaded is the same as its new group */
+	cur = rep[cur];
+	fb.ptr = FB(cur);
+	return lockstep_groups();
+}
@@ -0,0 +1,16 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "defs.h"
+
+int lockstep_start(int n);
+void lockstep_stop();
+int lockstep_lanes();
+int lockstep_groups();
+int lockstep_group(int lane);
+byte *lockstep_fb(int lane);
+int lockstep_select(int lane, int alone);
+int lockstep_frame(const int *in, void (*run)(int lane, int in));
+int lockstep_merge();
+
+#endif
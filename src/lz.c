@@ -0,0 +1,135 @@
+/*
+ * lz.c
+ *
+ * A small lz77 coder for save states, in the lz4 block format so any
+ * lz4 tool can read what it writes. Memory dumps are mostly zeros,
+ * repeated tiles and copies of tables, which a match finder with a
+ * single hashed candidate per position gets nearly all of; packing a
+ * whole cgb state takes some tens of microseconds and unpacking a few.
+ *
+ * A block is a run of sequences, each a token byte (literal count in
+ * the high nibble, match length less 4 in the low, 15 meaning more
+ * bytes follow, each adding up to 255), the literals, and a 16 bit
+ * little endian offset back to the match. The last sequence has only
+ * literals, and as the format asks, the last match ends at least 5
+ * bytes from the end and starts at least 12 from it.
+ */
+
+#include <string.h>
+
+#include "defs.h"
+#include "lz.h"
+
+#define HASHBITS 12
+#define MINMATCH 4
+#define LASTLITS 5
+#define MFLIMIT 12
+
+static un32 get32(byte *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (un32)p[3] << 24;
+}
+
+static byte *count(byte *o, int n)
+{
+	for (; n >= 255; n -= 255)
+		*(o++) = 255;
+	*(o++) = n;
+	return o;
+}
+
+/* one sequence: nlit literals from lit, then a match of n at off back */
+static byte *seq(byte *o, byte *lit, int nlit, int off, int n)
+{
+	byte *token = o++;
+
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15) o = count(o, nlit - 15);
+	memcpy(o, lit, nlit);
+	o += nlit;
+	if (!off) return o;
+	*(o++) = off;
+	*(o++) = off >> 8;
+	n -= MINMATCH;
+	*token |= n < 15 ? n : 15;
+	if (n >= 15) o = count(o, n - 15);
+	return o;
+}
+
+/* packs len bytes of in into out, which must have room for
+   LZ_BOUND(len); returns the bytes written */
+int lz_pack(byte *out, byte *in, int len)
+{
+	/* where each hash was last seen, plus one */
+	static int seen[1 << HASHBITS];
+	byte *o = out;
+	int i = 0, anchor = 0, ref, n, h;
+	un32 v;
+
+	memset(seen, 0, sizeof seen);
+	while (i < len - MFLIMIT)
+	{
+		v = get32(in + i);
+		h = (v * 2654435761u) >> (32 - HASHBITS);
+		ref = seen[h] - 1;
+		seen[h] = i + 1;
+		if (ref < 0 || i - ref > 65535 || get32(in + ref) != v)
+		{
+			i++;
+			continue;
+		}
+		for (n = MINMATCH; i + n < len - LASTLITS
+			&& in[ref + n] == in[i + n]; n++);
+		o = seq(o, in + anchor, i - anchor, i - ref, n);
+		i += n;
+		anchor = i;
+	}
+	o = seq(o, in + anchor, len - anchor, 0, 0);
+	return o - out;
+}
+
+/* 0 if in (len bytes) unpacks to exactly size bytes at out */
+int lz_unpack(byte *out, int size, byte *in, int len)
+{
+	byte *end = in + len, *o = out, *stop = out + size, *m;
+	int t, n, c;
+
+	while (in < end)
+	{
+		t = *(in++);
+		n = t >> 4;
+		if (n == 15)
+			do
+			{
+				if (in == end) return -1;
+				n += c = *(in++);
+			}
+			while (c == 255);
+		if (n > end - in || n > stop - o) return -1;
+		memcpy(o, in, n);
+		o += n;
+		in += n;
+		/* the last sequence has no match */
+		if (in == end) break;
+		if (end - in < 2) return -1;
+		m = o - (in[0] | in[1] << 8);
+		in += 2;
+		n = (t & 15) + MINMATCH;
+		if ((t & 15) == 15)
+			do
+			{
+				if (in == end) return -1;
+				n += c = *(in++);
+			}
+			while (c == 255);
+		if (m < out || m == o || n > stop - o) return -1;
+		/* a match may overlap what it's writing: an offset of one is
+		   a run of a byte, mostly zeros, and shorter overlaps go a
+		   byte at a time */
+		if (o - m >= n) memcpy(o, m, n);
+		else if (o - m == 1) memset(o, *m, n);
+		else for (c = 0; c < n; c++) o[c] = m[c];
+		o += n;
+	}
+	return o == stop ? 0 : -1;
+}
@@ -1,20 +1,30 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "defs.h"
 #include "hw.h"
+#include "cpu.h"
 #include "regs.h"
 #include "mem.h"
 #include "rtc.h"
 #include "lcd.h"
 #include "lcdc.h"
 #include "sound.h"
-
-struct mbc mbc;
+#include "bench.h"
+#include "stats.h"
+#include "memstats.h"
+#include "debug.h"
+#include "cheat.h"
+#include "loader.h"
+
+MACHINE struct mbc mbc;
 struct rom rom;
-struct ram ram;
+MACHINE struct ram ram;
 struct rom bootrom;
+struct dirty dirty;
+struct hashdirty hashdirty;
 
 /*
  * In order to make reads and writes efficient, we keep tables
@@ -24,74 +34,227 @@ struct rom bootrom;
  * region in host system memory. For ranges that require special
  * processing, the pointer is NULL.
  *
- * mem_updatemap is called whenever bank changes or other operations
- * make the old maps potentially invalid.
+ * mem_updatemap rebuilds both maps from scratch, and is called after
+ * anything that may have invalidated all of them (reset, loading a
+ * state, unmapping the boot rom). Bank switches only touch the pages
+ * they affect, through mem_maprom, mem_mapsram, mem_mapvram and
+ * mem_mapwram.
+ */
+
+/* true if page n of mask is being tracked and hasn't been written since
+   the last checkpoint; such pages stay out of the write map. a page
+   stays out while any of the trackers has it clean. */
+#define CLEAN(mask, n) (dirty.track && !(((mask) >> (n)) & 1))
+#define HASHCLEAN(mask, n) (hashdirty.track && !(((mask) >> (n)) & 1))
+#define IRAMCLEAN(n) (CLEAN(dirty.iram, n) || HASHCLEAN(hashdirty.iram, n))
+#define SRAMCLEAN(n) (CLEAN(dirty.sram, n) \
+	|| HASHCLEAN(hashdirty.sram, n) \
+	|| (dirty.savetrack && !((dirty.sramsave >> (n)) & 1)))
+
+/*
+ * Watchpoints (see debug.c) work by keeping the pages with a watched
+ * address in them out of the maps: every mapping function below ends
+ * with UNWATCH, which takes them back out, so only accesses to those
+ * pages come here through mem_read and mem_write and get checked.
+ * mem_rwatch and mem_wwatch have bit n set for page n.
  */
 
+int mem_rwatch, mem_wwatch;
+
+/*
+ * Pages of ram holding code that something has made a copy of (a
+ * block cache, a recompiler, the profiler) are kept out of the write
+ * map the same way, with bit n of mem_wcode for page n, so that writes
+ * to them come through mem_write and mem_codewrite gets to see each
+ * one and drop whatever was made from that address. Other pages keep
+ * their direct writes. Bit 15 stands for hram, whose writes are hooked
+ * through hi_write instead.
+ */
+
+int mem_wcode;
+void (*mem_codewrite)(int a);
+
+static void unwatch()
+{
+	int n;
+
+	for (n = 0; n < 16; n++)
+	{
+		if ((mem_rwatch >> n) & 1) mbc.rmap[n] = NULL;
+		if (((mem_wwatch | mem_wcode) >> n) & 1) mbc.wmap[n] = NULL;
+	}
+}
+
+#define UNWATCH() if (mem_rwatch | mem_wwatch | mem_wcode) unwatch()
+
+/* rom pages a cheat code patches are mapped from the patched copy
+   instead (see cheat.c); mem_maprom, which mem_updatemap calls after
+   mapping bank 0, ends with OVERLAY, before UNWATCH */
+static void overlay()
+{
+	int n, k;
+	byte *p;
+
+	for (n = 0; n < 8; n++)
+	{
+		k = n < 4 ? n : (mbc.rombank << 2) | (n & 3);
+		if (mbc.rmap[n] != rom.bank[0] + (k << 12) - (n << 12))
+			continue;
+		if ((p = cheat_page(k))) mbc.rmap[n] = p - (n << 12);
+	}
+}
+
+#define OVERLAY() if (cheat_rom) overlay()
+
 void mem_mapbootrom() {
 	if (!bootrom.bank) return;
 	mbc.rmap[0x0] = bootrom.bank[0];
+	UNWATCH();
 }
 
-void mem_updatemap()
+void mem_maprom()
 {
-	int n;
-	byte **map;
+	byte **map = mbc.rmap;
 
 	mbc.rombank &= (mbc.romsize - 1);
-	mbc.rambank &= (mbc.ramsize - 1);
-
-	map = mbc.rmap;
-	/* don't unmap bootrom unless RI_BOOT was locked */
-	if (REG(RI_BOOT) & 1) map[0x0] = rom.bank[0];
-	map[0x1] = rom.bank[0];
-	map[0x2] = rom.bank[0];
-	map[0x3] = rom.bank[0];
 	if (mbc.rombank < mbc.romsize)
 	{
+		if (rom_lazy) rom_unpack(mbc.rombank);
 		map[0x4] = rom.bank[mbc.rombank] - 0x4000;
 		map[0x5] = rom.bank[mbc.rombank] - 0x4000;
 		map[0x6] = rom.bank[mbc.rombank] - 0x4000;
 		map[0x7] = rom.bank[mbc.rombank] - 0x4000;
 	}
 	else map[0x4] = map[0x5] = map[0x6] = map[0x7] = NULL;
-	if (0 && (R_STAT & 0x03) == 0x03)
-	{
-		map[0x8] = NULL;
-		map[0x9] = NULL;
-	}
-	else
-	{
-		map[0x8] = lcd.vbank[R_VBK & 1] - 0x8000;
-		map[0x9] = lcd.vbank[R_VBK & 1] - 0x8000;
-	}
+	OVERLAY();
+	UNWATCH();
+}
+
+void mem_mapsram()
+{
+	byte *p = NULL;
+
+	mbc.rambank &= (mbc.ramsize - 1);
 	if (mbc.enableram && !(rtc.sel&8))
-	{
-		map[0xA] = ram.sbank[mbc.rambank] - 0xA000;
-		map[0xB] = ram.sbank[mbc.rambank] - 0xA000;
-	}
-	else map[0xA] = map[0xB] = NULL;
-	map[0xC] = ram.ibank[0] - 0xC000;
-	n = R_SVBK & 0x07;
-	map[0xD] = ram.ibank[n?n:1] - 0xD000;
-	map[0xE] = ram.ibank[0] - 0xE000;
+		p = ram.sbank[mbc.rambank] - 0xA000;
+	mbc.rmap[0xA] = mbc.rmap[0xB] = p;
+	mbc.wmap[0xA] = SRAMCLEAN(mbc.rambank<<1) ? NULL : p;
+	mbc.wmap[0xB] = SRAMCLEAN((mbc.rambank<<1)|1) ? NULL : p;
+	UNWATCH();
+}
+
+void mem_mapvram()
+{
+	byte **map = mbc.rmap;
+
+	/* mapped whatever the lcd is doing; the accurate cpu is the one
+	   that keeps off it in mode 3 (see cpu_emulate) */
+	map[0x8] = lcd.vbank[R_VBK & 1] - 0x8000;
+	map[0x9] = lcd.vbank[R_VBK & 1] - 0x8000;
+	UNWATCH();
+}
+
+/* bank 0 of wram, at C000 and its echo at E000 */
+static void mem_mapiram()
+{
+	byte *p = IRAMCLEAN(0) ? NULL : ram.ibank[0];
+
+	mbc.rmap[0xC] = ram.ibank[0] - 0xC000;
+	mbc.rmap[0xE] = ram.ibank[0] - 0xE000;
+	mbc.wmap[0xC] = p ? p - 0xC000 : NULL;
+	mbc.wmap[0xE] = p ? p - 0xE000 : NULL;
+	UNWATCH();
+}
+
+void mem_mapwram()
+{
+	int n = R_SVBK & (WRAMBANKS - 1);
+
+	if (!n) n = 1;
+	mbc.rmap[0xD] = ram.ibank[n] - 0xD000;
+	mbc.wmap[0xD] = IRAMCLEAN(n) ? NULL : ram.ibank[n] - 0xD000;
+	UNWATCH();
+}
+
+void mem_updatemap()
+{
+	byte **map;
+
+	stat_maps++;
+	map = mbc.rmap;
+	/* don't unmap bootrom unless RI_BOOT was locked */
+	if (REG(RI_BOOT) & 1) map[0x0] = rom.bank[0];
+	map[0x1] = rom.bank[0];
+	map[0x2] = rom.bank[0];
+	map[0x3] = rom.bank[0];
 	map[0xF] = NULL;
 
 	map = mbc.wmap;
 	map[0x0] = map[0x1] = map[0x2] = map[0x3] = NULL;
 	map[0x4] = map[0x5] = map[0x6] = map[0x7] = NULL;
 	map[0x8] = map[0x9] = NULL;
-	if (mbc.enableram && !(rtc.sel&8))
-	{
-		map[0xA] = ram.sbank[mbc.rambank] - 0xA000;
-		map[0xB] = ram.sbank[mbc.rambank] - 0xA000;
-	}
-	else map[0xA] = map[0xB] = NULL;
-	map[0xC] = ram.ibank[0] - 0xC000;
-	n = R_SVBK & 0x07;
-	map[0xD] = ram.ibank[n?n:1] - 0xD000;
-	map[0xE] = ram.ibank[0] - 0xE000;
 	map[0xF] = NULL;
+
+	mem_maprom();
+	mem_mapvram();
+	mem_mapsram();
+	mem_mapiram();
+	mem_mapwram();
+	UNWATCH();
+}
+
+void mem_checkpoint()
+{
+	dirty.iram = dirty.vram = dirty.sram = 0;
+	dirty.track = 1;
+	dirty.gen++;
+	mem_mapsram();
+	mem_mapiram();
+	mem_mapwram();
+}
+
+#ifdef LOWMEM
+/* ram.ibank made the size hw.cgb says, once it's known on loading a
+   rom or a state; banks that weren't there before come up zeroed.
+   the maps still point at the old banks until mem_updatemap(). */
+int mem_sizewram()
+{
+	int n = hw.cgb ? 8 : 2;
+	byte (*p)[4096];
+
+	if (ram.ibank && ram.ibanks == n) return 0;
+	if (!(p = realloc(ram.ibank, n * 4096))) return -1;
+	if (n > ram.ibanks)
+		memset(p[ram.ibanks], 0, (n - ram.ibanks) * 4096);
+	ram.ibank = p;
+	ram.ibanks = n;
+	return 0;
+}
+#endif
+
+/* for anything that replaces memory wholesale (reset, loading a state) */
+void mem_alldirty()
+{
+	dirty.iram = dirty.vram = dirty.sram = dirty.sramsave = ~0;
+	hashdirty.iram = hashdirty.vram = hashdirty.sram = ~0;
+}
+
+/* the battery save on disk now matches ram.sbank */
+void mem_sramsaved()
+{
+	dirty.sramsave = 0;
+	dirty.savetrack = 1;
+	mem_mapsram();
+}
+
+/* state_hash has hashed every page as it is now */
+void mem_hashed()
+{
+	hashdirty.iram = hashdirty.vram = hashdirty.sram = 0;
+	hashdirty.track = 1;
+	mem_mapsram();
+	mem_mapiram();
+	mem_mapwram();
 }
 
 
@@ -159,14 +322,7 @@ void ioreg_write(byte r, byte b)
 		pad_refresh();
 		break;
 	case RI_SC:
-		/* FIXME - this is a hack for stupid roms that probe serial */
-		if ((b & 0x81) == 0x81)
-		{
-			R_SB = 0xff;
-			hw_interrupt(IF_SERIAL, IF_SERIAL);
-			hw_interrupt(0, IF_SERIAL);
-		}
-		R_SC = b; /* & 0x7f; */
+		hw_serial_start(b);
 		break;
 	case RI_SB:
 		REG(r) = b;
@@ -186,7 +342,7 @@ void ioreg_write(byte r, byte b)
 		break;
 	case RI_VBK:
 		REG(r) = b | 0xFE;
-		mem_updatemap();
+		mem_mapvram();
 		break;
 	case RI_BCPS:
 		R_BCPS = b & 0xBF;
@@ -208,7 +364,7 @@ void ioreg_write(byte r, byte b)
 		break;
 	case RI_SVBK:
 		REG(r) = b & 0x07;
-		mem_updatemap();
+		mem_mapwram();
 		break;
 	case RI_BOOT:
 		if(!(b&1)) break;
@@ -256,52 +412,173 @@ void ioreg_write(byte r, byte b)
 }
 
 
-byte ioreg_read(byte r)
+/*
+ * The FF00-FFFF page can't go in the maps above, since most of the io
+ * registers need to do something when accessed. Instead, hi_read and
+ * hi_write hold a handler for each address, or NULL where the byte in
+ * ram.hi can simply be read or written directly: all of HRAM, and for
+ * reading, the registers that only ever change when the program writes
+ * them. Everything else has to bring the timers and lcdc up to date
+ * with cpu_sync first (see cpu.c). mem_updatehi fills in the tables,
+ * and must be called again if hw.cgb changes.
+ */
+
+byte (*hi_read[256])(byte r);
+void (*hi_write[256])(byte r, byte b);
+
+/* the bits of each register that read as 1 whatever is in ram.hi,
+   all of them for registers that aren't there */
+static byte hi_mask[256];
+
+static byte hi_ioread(byte r)
 {
-	switch(r)
+	cpu_sync();
+	return REG(r) | hi_mask[r];
+}
+
+static byte hi_fixedread(byte r)
+{
+	return REG(r) | hi_mask[r];
+}
+
+static byte hi_sndread(byte r)
+{
+	cpu_sync();
+	return sound_read(r);
+}
+
+static void hi_iowrite(byte r, byte b)
+{
+	cpu_sync();
+	ioreg_write(r, b);
+	cpu.evnext = 0;
+}
+
+static void hi_sndwrite(byte r, byte b)
+{
+	cpu_sync();
+	sound_write(r, b);
+	cpu.evnext = 0;
+}
+
+/* the ldh instructions go straight to hi_read and hi_write, so a
+   watched register there gets its entries wrapped instead */
+static byte (*hi_unwatched_read[256])(byte r);
+static void (*hi_unwatched_write[256])(byte r, byte b);
+
+static byte hi_watchread(byte r)
+{
+	byte b = hi_unwatched_read[r] ? hi_unwatched_read[r](r) : ram.hi[r];
+
+	debug_watch(0xFF00 | r, b, 0);
+	return b;
+}
+
+static void hi_watchwrite(byte r, byte b)
+{
+	debug_watch(0xFF00 | r, b, 1);
+	if (hi_unwatched_write[r]) hi_unwatched_write[r](r, b);
+	else ram.hi[r] = b;
+}
+
+static void hi_codewrite(byte r, byte b)
+{
+	if (mem_codewrite) mem_codewrite(0xFF00 | r);
+	ram.hi[r] = b;
+}
+
+static void codehi()
+{
+	int i;
+
+	for (i = 0x80; i < 0xFF; i++)
+		if (!hi_write[i]) hi_write[i] = hi_codewrite;
+}
+
+static void watchhi()
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
 	{
-	case RI_BOOT:
-		return 0xfe | (REG(r) & 1);
-	case RI_SC:
-		r = R_SC;
-		R_SC &= 0x7f;
-		return r;
-	case RI_P1:
-	case RI_SB:
-	case RI_DIV:
-	case RI_TIMA:
-	case RI_TMA:
-	case RI_TAC:
-	case RI_LCDC:
-	case RI_STAT:
-	case RI_SCY:
-	case RI_SCX:
-	case RI_LY:
-	case RI_LYC:
-	case RI_BGP:
-	case RI_OBP0:
-	case RI_OBP1:
-	case RI_WY:
-	case RI_WX:
-	case RI_IE:
-	case RI_IF:
-		return REG(r);
-	case RI_VBK:
-	case RI_BCPS:
-	case RI_OCPS:
-	case RI_BCPD:
-	case RI_OCPD:
-	case RI_SVBK:
-	case RI_KEY1:
-	case RI_HDMA1:
-	case RI_HDMA2:
-	case RI_HDMA3:
-	case RI_HDMA4:
-	case RI_HDMA5:
-		if (hw.cgb) return REG(r);
-	default:
-		return 0xff;
+		hi_unwatched_read[i] = hi_read[i];
+		hi_unwatched_write[i] = hi_write[i];
+		if (debug_watching(0xFF00 | i, 0)) hi_read[i] = hi_watchread;
+		if (debug_watching(0xFF00 | i, 1)) hi_write[i] = hi_watchwrite;
+	}
+}
+
+/* for a handler that comes and goes between rebuilds, pad_read say;
+   it goes behind the watch wrapper if the register has one */
+void mem_hiread(byte r, byte (*read)(byte r))
+{
+	if (hi_read[r] == hi_watchread) hi_unwatched_read[r] = read;
+	else hi_read[r] = read;
+}
+
+void mem_updatehi()
+{
+	static const byte passive[] =
+	{
+		RI_P1, RI_SB, RI_TMA, RI_TAC, RI_LCDC, RI_SCY, RI_SCX,
+		RI_LYC, RI_BGP, RI_OBP0, RI_OBP1, RI_WY, RI_WX, RI_IE
+	};
+	static const byte cgb_passive[] =
+	{
+		RI_KEY1, RI_VBK, RI_BCPS, RI_BCPD, RI_OCPS, RI_OCPD, RI_SVBK
+	};
+	/* the ones that change on their own, as time passes */
+	static const byte active[] =
+	{
+		RI_SC, RI_DIV, RI_TIMA, RI_STAT, RI_LY, RI_IF
+	};
+	static const byte cgb_active[] =
+	{
+		RI_HDMA1, RI_HDMA2, RI_HDMA3, RI_HDMA4, RI_HDMA5
+	};
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		if (i >= 0x80 && i < 0xFF)
+		{
+			hi_read[i] = NULL;
+			hi_write[i] = NULL;
+		}
+		else if (i >= 0x10 && i <= 0x3F)
+		{
+			hi_read[i] = hi_sndread;
+			hi_write[i] = hi_sndwrite;
+		}
+		else
+		{
+			hi_read[i] = hi_fixedread;
+			hi_write[i] = hi_iowrite;
+		}
+		hi_mask[i] = 0xff;
 	}
+	for (i = 0; i < sizeof passive; i++)
+		hi_read[passive[i]] = NULL;
+	for (i = 0; i < sizeof active; i++)
+		hi_read[active[i]] = hi_ioread, hi_mask[active[i]] = 0;
+	if (hw.cgb) for (i = 0; i < sizeof cgb_passive; i++)
+		hi_read[cgb_passive[i]] = NULL;
+	if (hw.cgb) for (i = 0; i < sizeof cgb_active; i++)
+		hi_read[cgb_active[i]] = hi_ioread, hi_mask[cgb_active[i]] = 0;
+	hi_mask[RI_SC] = hw.cgb ? 0x7c : 0x7e;
+	hi_mask[RI_BOOT] = 0xfe;
+	if (mem_wcode & 0x8000) codehi();
+	if ((mem_rwatch | mem_wwatch) & 0x8000) watchhi();
+}
+
+/* sets mem_wcode and takes the pages in it out of the maps, or puts
+   them back */
+void mem_setcode(int mask)
+{
+	if (mask == mem_wcode) return;
+	mem_wcode = mask;
+	mem_updatemap();
+	mem_updatehi();
 }
 
 
@@ -311,147 +588,140 @@ byte ioreg_read(byte r)
  * 0000-7FFF, using the address and byte written as instructions to
  * change rom or sram banks, control special hardware, etc.
  *
+ * Each kind has a handler for each 8k of that, which mbc_reset puts
+ * in mbc.write for the rom's mbc.type, so a bank switch goes straight
+ * to what it does rather than through a switch on the type and
+ * another on the address. A handler remaps only what it changed.
  * mbc_write takes an address (which should be in the proper range)
  * and a byte value written to the address.
  */
 
-void mbc_write(int a, byte b)
+static void setrom(int n)
 {
-	byte ha = (a>>12);
+	if (n == mbc.rombank) return;
+	mbc.rombank = n;
+	mem_maprom();
+}
+
+static void setram(int n)
+{
+	if (n == mbc.rambank) return;
+	mbc.rambank = n;
+	mem_mapsram();
+}
+
+static void nowrite(int a, byte b)
+{
+}
+
+static void ramenable(int a, byte b)
+{
+	b = (b & 0x0F) == 0x0A;
+	if (b == mbc.enableram) return;
+	mbc.enableram = b;
+	mem_mapsram();
+}
+
+/* mbc1, and huc1, which is guessed to be the same */
+static void mbc1_rom(int a, byte b)
+{
+	if ((b & 0x1F) == 0) b = 0x01;
+	setrom((mbc.rombank & 0x60) | (b & 0x1F));
+}
+
+static void mbc1_hi(int a, byte b)
+{
+	if (mbc.model) setram(b & 0x03);
+	else setrom((mbc.rombank & 0x1F) | ((int)(b&3)<<5));
+}
+
+static void mbc1_model(int a, byte b)
+{
+	mbc.model = b & 0x1;
+}
+
+/* is this at all right? */
+static void mbc2(int a, byte b)
+{
+	if ((a & 0x0100) == 0x0000) ramenable(a, b);
+	else if ((a & 0xE100) == 0x2100) setrom(b & 0x0F);
+}
+
+/* mbc3, and huc3 */
+static void mbc3_rom(int a, byte b)
+{
+	b &= 0x7F;
+	setrom(b ? b : 1);
+}
+
+static void mbc3_ram(int a, byte b)
+{
+	int sel = rtc.sel;
+
+	rtc.sel = b & 0x0f;
+	if (rtc.sel != sel && mbc.rambank == (b & 0x03)) mem_mapsram();
+	setram(b & 0x03);
+}
+
+static void mbc3_latch(int a, byte b)
+{
+	rtc_latch(b);
+}
+
+static void mbc5_rom(int a, byte b)
+{
+	if (a & 0x1000)
+	{
+		setrom((mbc.rombank & 0xFF) | ((int)(b&1)<<8));
+		return;
+	}
+	if (b == 0) b = 0x01;
+	setrom((mbc.rombank & 0x100) | b);
+}
+
+static void mbc5_ram(int a, byte b)
+{
+	setram(b & 0x0f);
+}
+
+/* FIXME - save high bit as rumble state */
+static void rumble_ram(int a, byte b)
+{
+	setram(b & 0x07);
+}
+
+static void (*const mbc1_writes[4])(int, byte) =
+	{ ramenable, mbc1_rom, mbc1_hi, mbc1_model };
+static void (*const mbc2_writes[4])(int, byte) =
+	{ mbc2, mbc2, mbc2, mbc2 };
+static void (*const mbc3_writes[4])(int, byte) =
+	{ ramenable, mbc3_rom, mbc3_ram, mbc3_latch };
+static void (*const mbc5_writes[4])(int, byte) =
+	{ ramenable, mbc5_rom, mbc5_ram, nowrite };
+static void (*const rumble_writes[4])(int, byte) =
+	{ ramenable, mbc5_rom, rumble_ram, nowrite };
+static void (*const no_writes[4])(int, byte) =
+	{ nowrite, nowrite, nowrite, nowrite };
+
+static void mbc_select()
+{
+	void (*const *w)(int, byte);
 
-	/* printf("mbc %d: rom bank %02X -[%04X:%02X]-> ", mbc.type, mbc.rombank, a, b); */
 	switch (mbc.type)
 	{
-	case MBC_MBC1:
-		switch (ha & 0xE)
-		{
-		case 0x0:
-			mbc.enableram = ((b & 0x0F) == 0x0A);
-			break;
-		case 0x2:
-			if ((b & 0x1F) == 0) b = 0x01;
-			mbc.rombank = (mbc.rombank & 0x60) | (b & 0x1F);
-			break;
-		case 0x4:
-			if (mbc.model)
-			{
-				mbc.rambank = b & 0x03;
-				break;
-			}
-			mbc.rombank = (mbc.rombank & 0x1F) | ((int)(b&3)<<5);
-			break;
-		case 0x6:
-			mbc.model = b & 0x1;
-			break;
-		}
-		break;
-	case MBC_MBC2: /* is this at all right? */
-		if ((a & 0x0100) == 0x0000)
-		{
-			mbc.enableram = ((b & 0x0F) == 0x0A);
-			break;
-		}
-		if ((a & 0xE100) == 0x2100)
-		{
-			mbc.rombank = b & 0x0F;
-			break;
-		}
-		break;
-	case MBC_MBC3:
-		switch (ha & 0xE)
-		{
-		case 0x0:
-			mbc.enableram = ((b & 0x0F) == 0x0A);
-			break;
-		case 0x2:
-			if ((b & 0x7F) == 0) b = 0x01;
-			mbc.rombank = b & 0x7F;
-			break;
-		case 0x4:
-			rtc.sel = b & 0x0f;
-			mbc.rambank = b & 0x03;
-			break;
-		case 0x6:
-			rtc_latch(b);
-			break;
-		}
-		break;
-	case MBC_RUMBLE:
-		switch (ha & 0xF)
-		{
-		case 0x4:
-		case 0x5:
-			/* FIXME - save high bit as rumble state */
-			/* mask off high bit */
-			b &= 0x7;
-			break;
-		}
-		/* fall thru */
-	case MBC_MBC5:
-		switch (ha & 0xF)
-		{
-		case 0x0:
-		case 0x1:
-			mbc.enableram = ((b & 0x0F) == 0x0A);
-			break;
-		case 0x2:
-			if ((b & 0xFF) == 0) b = 0x01;
-			mbc.rombank = (mbc.rombank & 0x100) | (b & 0xFF);
-			break;
-		case 0x3:
-			mbc.rombank = (mbc.rombank & 0xFF) | ((int)(b&1)<<8);
-			break;
-		case 0x4:
-		case 0x5:
-			mbc.rambank = b & 0x0f;
-			break;
-		}
-		break;
-	case MBC_HUC1: /* FIXME - this is all guesswork -- is it right??? */
-		switch (ha & 0xE)
-		{
-		case 0x0:
-			mbc.enableram = ((b & 0x0F) == 0x0A);
-			break;
-		case 0x2:
-			if ((b & 0x1F) == 0) b = 0x01;
-			mbc.rombank = (mbc.rombank & 0x60) | (b & 0x1F);
-			break;
-		case 0x4:
-			if (mbc.model)
-			{
-				mbc.rambank = b & 0x03;
-				break;
-			}
-			mbc.rombank = (mbc.rombank & 0x1F) | ((int)(b&3)<<5);
-			break;
-		case 0x6:
-			mbc.model = b & 0x1;
-			break;
-		}
-		break;
-	case MBC_HUC3:
-		switch (ha & 0xE)
-		{
-		case 0x0:
-			mbc.enableram = ((b & 0x0F) == 0x0A);
-			break;
-		case 0x2:
-			b &= 0x7F;
-			mbc.rombank = b ? b : 1;
-			break;
-		case 0x4:
-			rtc.sel = b & 0x0f;
-			mbc.rambank = b & 0x03;
-			break;
-		case 0x6:
-			rtc_latch(b);
-			break;
-		}
-		break;
+	case MBC_MBC1: case MBC_HUC1: w = mbc1_writes; break;
+	case MBC_MBC2: w = mbc2_writes; break;
+	case MBC_MBC3: case MBC_HUC3: w = mbc3_writes; break;
+	case MBC_MBC5: w = mbc5_writes; break;
+	case MBC_RUMBLE: w = rumble_writes; break;
+	default: w = no_writes; break;
 	}
-	/* printf("%02X\n", mbc.rombank); */
-	mem_updatemap();
+	memcpy(mbc.write, w, sizeof mbc.write);
+}
+
+void mbc_write(int a, byte b)
+{
+	mbc.write[(a >> 13) & 3](a, b);
 }
 
 
@@ -461,7 +731,12 @@ void mbc_write(int a, byte b)
  * region, it accepts writes to any address.
  */
 
-void mem_write(int a, byte b)
+/* lines the lcdc should have queued by now but hasn't, cpu_sync not
+   being due till the horizon (see lcdc_horizon), have to be queued
+   before vram or oam change under them. evcnt is 0 inside cpu_sync */
+#define CATCHUP() if (cpu.evcnt && cpu.evcnt >= cpu.lcdc) cpu_sync()
+
+static void writemem(int a, byte b)
 {
 	int n;
 	byte ha = (a>>12) & 0xE;
@@ -473,10 +748,11 @@ void mem_write(int a, byte b)
 	case 0x2:
 	case 0x4:
 	case 0x6:
-		mbc_write(a, b);
+		mbc.write[ha >> 1](a, b);
 		break;
 	case 0x8:
 		/* if ((R_STAT & 0x03) == 0x03) break; */
+		CATCHUP();
 		vram_write(a & 0x1FFF, b);
 		break;
 	case 0xA:
@@ -487,40 +763,48 @@ void mem_write(int a, byte b)
 			break;
 		}
 		ram.sbank[mbc.rambank][a & 0x1FFF] = b;
+		n = 1 << ((mbc.rambank<<1) | ((a>>12) & 1));
+		dirty.sram |= n;
+		dirty.sramsave |= n;
+		hashdirty.sram |= n;
+		if (dirty.track || dirty.savetrack || hashdirty.track)
+			mem_mapsram();
 		break;
 	case 0xC:
 		if ((a & 0xF000) == 0xC000)
 		{
 			ram.ibank[0][a & 0x0FFF] = b;
+			dirty.iram |= 1;
+			hashdirty.iram |= 1;
+			if (dirty.track || hashdirty.track) mem_mapiram();
 			break;
 		}
-		n = R_SVBK & 0x07;
-		ram.ibank[n?n:1][a & 0x0FFF] = b;
+		n = R_SVBK & (WRAMBANKS - 1);
+		if (!n) n = 1;
+		ram.ibank[n][a & 0x0FFF] = b;
+		dirty.iram |= 1 << n;
+		hashdirty.iram |= 1 << n;
+		if (dirty.track || hashdirty.track) mem_mapwram();
 		break;
 	case 0xE:
 		if (a < 0xFE00)
 		{
-			mem_write(a & 0xDFFF, b);
+			writemem(a & 0xDFFF, b);
 			break;
 		}
 		if ((a & 0xFF00) == 0xFE00)
 		{
 			/* if (R_STAT & 0x02) break; */
-			if (a < 0xFEA0) lcd.oam.mem[a & 0xFF] = b;
-			break;
-		}
-		/* return writehi(a & 0xFF, b); */
-		if (a >= 0xFF10 && a <= 0xFF3F)
-		{
-			sound_write(a & 0xFF, b);
-			break;
-		}
-		if ((a & 0xFF80) == 0xFF80 && a != 0xFFFF)
-		{
-			ram.hi[a & 0xFF] = b;
+			if (a >= 0xFEA0) break;
+			CATCHUP();
+			lcd_flush();
+			lcd.oam.mem[a & 0xFF] = b;
+			oam_dirty();
 			break;
 		}
-		ioreg_write(a & 0xFF, b);
+		MS_HIREG(1, a);
+		if (hi_write[a & 0xFF]) hi_write[a & 0xFF](a & 0xFF, b);
+		else ram.hi[a & 0xFF] = b;
 	}
 }
 
@@ -531,19 +815,25 @@ void mem_write(int a, byte b)
  * region.
  */
 
-byte mem_read(int a)
+static byte readmem(int a)
 {
 	int n;
 	byte ha = (a>>12) & 0xE;
+	byte *p;
 	
 	/* printf("read %04x\n", a); */
 	switch (ha)
 	{
 	case 0x0:
 	case 0x2:
+		if (cheat_rom && (p = cheat_page(a >> 12)))
+			return p[a & 0xFFF];
 		return rom.bank[0][a];
 	case 0x4:
 	case 0x6:
+		n = (mbc.rombank << 2) | ((a >> 12) & 3);
+		if (cheat_rom && (p = cheat_page(n)))
+			return p[a & 0xFFF];
 		return rom.bank[mbc.rombank][a & 0x3FFF];
 	case 0x8:
 		/* if ((R_STAT & 0x03) == 0x03) return 0xFF; */
@@ -559,29 +849,56 @@ byte mem_read(int a)
 	case 0xC:
 		if ((a & 0xF000) == 0xC000)
 			return ram.ibank[0][a & 0x0FFF];
-		n = R_SVBK & 0x07;
+		n = R_SVBK & (WRAMBANKS - 1);
 		return ram.ibank[n?n:1][a & 0x0FFF];
 	case 0xE:
-		if (a < 0xFE00) return mem_read(a & 0xDFFF);
+		if (a < 0xFE00) return readmem(a & 0xDFFF);
 		if ((a & 0xFF00) == 0xFE00)
 		{
 			/* if (R_STAT & 0x02) return 0xFF; */
 			if (a < 0xFEA0) return lcd.oam.mem[a & 0xFF];
 			return 0xFF;
 		}
-		/* return readhi(a & 0xFF); */
-		if (a == 0xFFFF) return REG(0xFF);
-		if (a >= 0xFF10 && a <= 0xFF3F)
-			return sound_read(a & 0xFF);
-		if ((a & 0xFF80) == 0xFF80)
-			return ram.hi[a & 0xFF];
-		return ioreg_read(a & 0xFF);
+		MS_HIREG(0, a);
+		if (hi_read[a & 0xFF]) return hi_read[a & 0xFF](a & 0xFF);
+		return ram.hi[a & 0xFF];
 	}
 	return 0xff; /* not reached */
 }
 
+void mem_write(int a, byte b)
+{
+	int was = bench_in;
+
+	bench_in = BENCH_MEM;
+	stat_writes++;
+	MS_SLOW(1, a);
+	if (((mem_wwatch >> (a >> 12)) & 1) && a < 0xFF00)
+		debug_watch(a, b, 1);
+	if (((mem_wcode >> (a >> 12)) & 1) && a < 0xFF00 && mem_codewrite)
+		mem_codewrite(a);
+	writemem(a, b);
+	bench_in = was;
+}
+
+byte mem_read(int a)
+{
+	int was = bench_in;
+	byte b;
+
+	bench_in = BENCH_MEM;
+	stat_reads++;
+	MS_SLOW(0, a);
+	b = readmem(a);
+	if (((mem_rwatch >> (a >> 12)) & 1) && a < 0xFF00)
+		debug_watch(a, b, 0);
+	bench_in = was;
+	return b;
+}
+
 void mbc_reset()
 {
+	mbc_select();
 	mbc.rombank = 1;
 	mbc.rambank = 0;
 	mbc.enableram = 0;
@@ -178,12 +178,148 @@ static void tinfl_clear_tree(tinfl_decompressor *r)
         MZ_CLEAR_ARR(r->m_tree_2);
 }
 
+static const mz_uint16 s_length_base[31] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0 };
+static const mz_uint8 s_length_extra[31] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0 };
+static const mz_uint16 s_dist_base[32] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 0, 0 };
+static const mz_uint8 s_dist_extra[32] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+/* For each index into the literal/length lookup, the two literals its
+   bits decode to when both codes fit in TINFL_FAST_LOOKUP_BITS: first
+   | second << 8 | bits used << 16, or 0. */
+static void tinfl_build_pairs(tinfl_decompressor *r)
+{
+    mz_uint i;
+    int a, b;
+    for (i = 0; i < TINFL_FAST_LOOKUP_SIZE; i++)
+    {
+        r->m_pairs[i] = 0;
+        a = r->m_look_up[0][i];
+        if (a <= 0 || (a & 511) >= 256)
+            continue;
+        b = r->m_look_up[0][i >> (a >> 9)];
+        if (b <= 0 || (b & 511) >= 256 || (a >> 9) + (b >> 9) > TINFL_FAST_LOOKUP_BITS)
+            continue;
+        r->m_pairs[i] = (a & 255) | (b & 255) << 8 | ((a >> 9) + (b >> 9)) << 16;
+    }
+}
+
+/* The bulk of a huffman block, for a non-wrapping output buffer, while
+   there's room to be careless in both buffers: the bit buffer is topped
+   up to 56 bits a word at a time, which is enough for a whole length and
+   distance pair, literals come two at a time where m_pairs has them, and
+   matches are copied 8 bytes at a time, overrunning their end, which is
+   why the output needs TINFL_FAST_OUT to spare. Returns 1 after the end
+   of block code, or 0 when tinfl_decompress has to take over: for the
+   end of either buffer, or for anything wrong with the data, which is
+   left unconsumed so that tinfl_decompress reports it. */
+#define TINFL_FAST_IN 8
+#define TINFL_FAST_OUT (258 + 8)
+static int tinfl_fast(tinfl_decompressor *r, const mz_uint8 **pIn, const mz_uint8 *pIn_end, mz_uint8 *pOut_start, mz_uint8 **pOut, mz_uint8 *pOut_end, tinfl_bit_buf_t *pBit_buf, mz_uint32 *pNum_bits)
+{
+    const mz_uint8 *in = *pIn;
+    mz_uint8 *out = *pOut, *src;
+    tinfl_bit_buf_t bit_buf = *pBit_buf, saved_buf;
+    mz_uint32 num_bits = *pNum_bits, saved_bits, e, len, dist, code_len;
+    int sym, done = 0;
+
+    while (pIn_end - in >= TINFL_FAST_IN && pOut_end - out >= TINFL_FAST_OUT)
+    {
+        bit_buf |= MZ_READ_LE64(in) << num_bits;
+        in += (63 - num_bits) >> 3;
+        num_bits |= 56;
+        saved_buf = bit_buf;
+        saved_bits = num_bits;
+
+        if ((e = r->m_pairs[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) != 0)
+        {
+            out[0] = (mz_uint8)e;
+            out[1] = (mz_uint8)(e >> 8);
+            out += 2;
+            bit_buf >>= e >> 16;
+            num_bits -= e >> 16;
+            continue;
+        }
+        if ((sym = r->m_look_up[0][bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
+            code_len = sym >> 9, sym &= 511;
+        else
+        {
+            code_len = TINFL_FAST_LOOKUP_BITS;
+            do
+            {
+                sym = r->m_tree_0[~sym + ((bit_buf >> code_len++) & 1)];
+            } while (sym < 0);
+        }
+        bit_buf >>= code_len;
+        num_bits -= code_len;
+        if (sym < 256)
+        {
+            *out++ = (mz_uint8)sym;
+            continue;
+        }
+        if (sym == 256)
+        {
+            done = 1;
+            break;
+        }
+
+        len = s_length_base[sym - 257] + (mz_uint32)(bit_buf & ((1U << s_length_extra[sym - 257]) - 1));
+        bit_buf >>= s_length_extra[sym - 257];
+        num_bits -= s_length_extra[sym - 257];
+        if ((sym = r->m_look_up[1][bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
+            code_len = sym >> 9, sym &= 511;
+        else
+        {
+            code_len = TINFL_FAST_LOOKUP_BITS;
+            do
+            {
+                sym = r->m_tree_1[~sym + ((bit_buf >> code_len++) & 1)];
+            } while (sym < 0);
+        }
+        bit_buf >>= code_len;
+        num_bits -= code_len;
+        dist = s_dist_base[sym & 31] + (mz_uint32)(bit_buf & ((1U << s_dist_extra[sym & 31]) - 1));
+        bit_buf >>= s_dist_extra[sym & 31];
+        num_bits -= s_dist_extra[sym & 31];
+        if (dist == 0 || dist > (size_t)(out - pOut_start))
+        {
+            bit_buf = saved_buf;
+            num_bits = saved_bits;
+            break;
+        }
+
+        src = out - dist;
+        if (dist >= 8)
+        {
+            mz_uint8 *end = out + len;
+            do
+            {
+                memcpy(out, src, 8);
+                out += 8;
+                src += 8;
+            } while (out < end);
+            out = end;
+        }
+        else if (dist == 1)
+        {
+            memset(out, *src, len);
+            out += len;
+        }
+        else
+        {
+            while (len--)
+                *out++ = *src++;
+        }
+    }
+    /* the word loads leave bits past num_bits that aren't ours yet */
+    *pBit_buf = bit_buf & ~(~(tinfl_bit_buf_t)0 << num_bits);
+    *pNum_bits = num_bits;
+    *pIn = in;
+    *pOut = out;
+    return done;
+}
+
 static tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size, mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size, const mz_uint32 decomp_flags)
 {
-    static const mz_uint16 s_length_base[31] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0 };
-    static const mz_uint8 s_length_extra[31] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0 };
-    static const mz_uint16 s_dist_base[32] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 0, 0 };
-    static const mz_uint8 s_dist_extra[32] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
     static const mz_uint8 s_length_dezigzag[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
     static const mz_uint16 s_min_table_sizes[3] = { 257, 1, 4 };
 
@@ -384,6 +520,8 @@ static tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_
                     tree_cur -= ((rev_code >>= 1) & 1);
                     pTree[-tree_cur - 1] = (mz_int16)sym_index;
                 }
+                if (r->m_type == 0)
+                    tinfl_build_pairs(r);
                 if (r->m_type == 2)
                 {
                     for (counter = 0; counter < (r->m_table_sizes[0] + r->m_table_sizes[1]);)
@@ -416,6 +554,8 @@ static tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_
             for (;;)
             {
                 mz_uint8 *pSrc;
+                if ((decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) && tinfl_fast(r, &pIn_buf_cur, pIn_buf_end, pOut_buf_start, &pOut_buf_cur, pOut_buf_end, &bit_buf, &num_bits))
+                    break;
                 for (;;)
                 {
                     if (((pIn_buf_end - pIn_buf_cur) < 4) || ((pOut_buf_end - pOut_buf_cur) < 2))
@@ -665,13 +805,23 @@ common_exit:
 }
 
 /* Higher level helper functions. */
-void *tinfl_decompress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+/* like tinfl_decompress_mem_to_heap, but the output buffer starts out at
+   size_hint bytes, so a caller that knows the uncompressed size up front
+   (gzip isize, zip local header) gets the whole stream in one pass
+   without any reallocation. */
+void *tinfl_decompress_mem_to_heap_sized(const void *pSrc_buf, size_t src_buf_len, size_t size_hint, size_t *pOut_len, int flags)
 {
     tinfl_decompressor decomp;
     void *pBuf = NULL, *pNew_buf;
     size_t src_buf_ofs = 0, out_buf_capacity = 0;
     *pOut_len = 0;
     tinfl_init(&decomp);
+    if (size_hint)
+    {
+        if (!(pBuf = MZ_MALLOC(size_hint)))
+            return NULL;
+        out_buf_capacity = size_hint;
+    }
     for (;;)
     {
         size_t src_buf_size = src_buf_len - src_buf_ofs, dst_buf_size = out_buf_capacity - *pOut_len, new_out_buf_capacity;
@@ -703,6 +853,11 @@ void *tinfl_decompress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, siz
     return pBuf;
 }
 
+void *tinfl_decompress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+{
+    return tinfl_decompress_mem_to_heap_sized(pSrc_buf, src_buf_len, 0, pOut_len, flags);
+}
+
 #if 0
 size_t tinfl_decompress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags)
 {
@@ -0,0 +1,11 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+int movie_record(char *name);
+int movie_play(char *name);
+void movie_stop();
+void movie_frame();
+int movie_playing();
+int movie_active();
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * netlink.c
+ *
+ * A link cable to another gnuboy over the network, for link play
+ * between machines. With "linkport" and "linkpeer" set, the two talk
+ * over udp, and each runs at its own pace, never waiting on the other
+ * except while a byte is actually crossing the cable.
+ *
+ * Rather than a round trip for every byte, each side tells the other
+ * its end of the cable as it changes: when the game waits on the
+ * external clock (it's the slave), which byte it has ready, and when
+ * it's the master, which of the other side's ready bytes it took and
+ * what it sent in return. The master takes the slave's byte as soon
+ * as it finishes a transfer, if the slave has already said it has one
+ * ready; only if it hasn't does the master stop and wait for it, and
+ * then only up to "linkwait" milliseconds, and only while the other
+ * side has been using the cable in the last second, so a game that
+ * just probes the port now and then never waits at all. The slave
+ * finds its transfer done the next time it asks (see hw_linkpoll).
+ *
+ * Every message is the whole state of one end, so a lost one costs
+ * nothing once the next gets through; besides the ones sent as the
+ * state changes, one goes out every frame as a keepalive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "cpu.h"
+#include "hw.h"
+#include "regs.h"
+#include "mem.h"
+#include "rc.h"
+#include "sys.h"
+#include "netlink.h"
+
+static int linkport, linkwait = 100;
+static char *linkpeer;
+
+rcvar_t netlink_exports[] =
+{
+	RCV_INT("linkport", &linkport, "udp port for the network link cable, 0 = off"),
+	RCV_STRING("linkpeer", &linkpeer, "host:port of the other end of the link cable"),
+	RCV_INT("linkwait", &linkwait, "most ms to wait for the other end's byte"),
+	RCV_END
+};
+
+/* frames without the other side using the cable before a master
+   stops waiting for it */
+#define QUIET 60
+
+static int fd = -1, port;
+static char *peer;
+
+/* our end: the arm we're on, whether a transfer on the external clock
+   is waiting with byte ready, and the last arm of theirs we took and
+   what we sent for it; done is what came back for ours, or -1 */
+static struct end
+{
+	int arm, armed, ready, took, sent;
+} me, them;
+static int done = -1, quiet = QUIET;
+
+
+static void put()
+{
+	char m[9];
+
+	m[0] = 'G';
+	m[1] = 'L';
+	m[2] = me.arm;
+	m[3] = me.arm >> 8;
+	m[4] = me.armed;
+	m[5] = me.ready;
+	m[6] = me.took;
+	m[7] = me.took >> 8;
+	m[8] = me.sent;
+	sys_udpsend(fd, m, 9);
+}
+
+static void got(byte *m)
+{
+	struct end e;
+
+	e.arm = m[2] | m[3] << 8;
+	e.armed = m[4];
+	e.ready = m[5];
+	e.took = m[6] | m[7] << 8;
+	e.sent = m[8];
+	if (e.arm != them.arm || e.took != them.took) quiet = 0;
+	/* they took the byte we have ready */
+	if (me.armed && e.took == me.arm)
+	{
+		done = e.sent;
+		me.armed = 0;
+	}
+	them = e;
+}
+
+/* everything that has come in, waiting up to us for the first */
+static void drain(int us)
+{
+	char m[16];
+	int n;
+
+	while ((n = sys_udprecv(fd, m, sizeof m, us)) != -2)
+	{
+		if (n < 0) return;
+		if (n == 9 && m[0] == 'G' && m[1] == 'L') got((byte *)m);
+		us = 0;
+	}
+}
+
+/* a transfer on our clock has finished sending b */
+static byte master(byte b)
+{
+	int waited = 0;
+
+	drain(0);
+	while (!them.armed || them.arm == me.took)
+	{
+		if (quiet >= QUIET || waited >= linkwait) return 0xff;
+		drain(1000);
+		waited++;
+	}
+	me.took = them.arm;
+	me.sent = b;
+	put();
+	return them.ready;
+}
+
+/* a transfer on their clock is waiting to send b */
+static int slave(byte b)
+{
+	int r;
+
+	if (!me.armed || me.ready != b)
+	{
+		me.arm = (me.arm + 1) & 0xffff;
+		me.armed = 1;
+		me.ready = b;
+		put();
+	}
+	drain(0);
+	if ((r = done) >= 0) done = -1;
+	return r;
+}
+
+static void hangup()
+{
+	sys_hangup(fd);
+	fd = -1;
+	hw_link = 0;
+	hw_linkpoll = 0;
+}
+
+static void plugin()
+{
+	char *p, host[256];
+
+	port = linkport;
+	free(peer);
+	peer = linkpeer ? strdup(linkpeer) : 0;
+	if (fd >= 0) hangup();
+	if (!port || !peer) return;
+	if (!(p = strrchr(peer, ':')) || p - peer >= (int)sizeof host)
+	{
+		fprintf(stderr, "linkpeer should be host:port\n");
+		return;
+	}
+	memcpy(host, peer, p - peer);
+	host[p - peer] = 0;
+	if ((fd = sys_udp(port, host, atoi(p + 1))) < 0)
+	{
+		fprintf(stderr, "cannot open link cable to %s\n", peer);
+		return;
+	}
+	memset(&me, 0, sizeof me);
+	memset(&them, 0, sizeof them);
+	done = -1;
+	quiet = QUIET;
+	hw_link = master;
+	hw_linkpoll = slave;
+	/* a transfer already waiting gets asked about from now on */
+	if ((R_SC & 0x81) == 0x80 && !cpu.serial)
+	{
+		cpu.serial = 1;
+		cpu.evnext = 0;
+	}
+}
+
+/*
+ * The main loop calls this once a frame. It opens or closes the cable
+ * when the rcvars change, notices when the game has given up waiting
+ * on the external clock, and sends the keepalive.
+ */
+void netlink_frame()
+{
+	if (linkport != port || !linkpeer != !peer
+		|| (peer && strcmp(linkpeer, peer)))
+		plugin();
+	if (fd < 0) return;
+	if (me.armed && (R_SC & 0x81) != 0x80)
+		me.armed = 0;
+	drain(0);
+	put();
+	if (quiet < QUIET) quiet++;
+}
@@ -5,13 +5,13 @@
 
 #include "defs.h"
 
-static byte noise7[] =
+static const byte noise7[] =
 {
     0xfb,0xe7,0xae,0x1b,0xa6,0x2b,0x05,0xe3,
     0xb6,0x4a,0x42,0x72,0xd1,0x19,0xaa,0x03,
 };
 
-static byte noise15[] =
+static const byte noise15[] =
 {
 0xff,0xfb,0xff,0xe7,0xff,0xaf,0xfe,0x1f,
 0xfb,0xbf,0xe6,0x7f,0xaa,0xfe,0x01,0xfb,
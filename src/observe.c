@@ -0,0 +1,148 @@
+/*
+ * observe.c
+ *
+ * Observations for agents that learn to play, made from the lines as
+ * the scanner leaves them in scan.buf, palette indices 0-63, so
+ * nothing is looked up or drawn in full colour first. A plane is
+ * 160/shrink by 144/shrink bytes, shrink 1, 2 or 4: OBS_GRAY's are
+ * the average brightness of each shrink by shrink block, 0 black to
+ * 255 white, OBS_INDEX's the palette index of the block's top left
+ * pixel. Planes go one after another into a ring of depth of them
+ * that the caller owns, so the last few frames are always there side
+ * by side, stacked as agents like them.
+ *
+ * Nothing is done but for a frame that's been armed with observe_arm,
+ * and it's as cheap as it can be then: the brightness of the 64
+ * colours is worked out again only when the palettes have changed,
+ * and a line's pixels are looked up and summed into their blocks by
+ * observe_row, sixteen at a time with sse2 or neon (asm/simd). The
+ * plane is cleared when it's armed; lines the lcd doesn't show stay
+ * 0. observe_frame, at vblank, counts it as made.
+ *
+ * observe_gather reads the bytes at a list of addresses as the cpu
+ * would see them, for the ram an agent watches.
+ */
+
+#include <string.h>
+
+#include "defs.h"
+#include "lcd.h"
+#include "debug.h"
+#include "observe.h"
+#ifdef USE_ASM
+#include "asm.h"
+#endif
+
+int observing;
+
+static int kind, shrink, depth, count, armed, w, h;
+static byte *ring, *plane;
+static un16 acc[160];
+/* the palettes lum was worked out from */
+static byte pal[128], lum[64];
+static int nram;
+static int ram[OBS_MAXRAM];
+
+int observe_setup(int k, int s, byte *r, int d)
+{
+	if ((k != OBS_GRAY && k != OBS_INDEX) || (s != 1 && s != 2 && s != 4)
+		|| !r || d < 1)
+		return -1;
+	kind = k;
+	shrink = s;
+	ring = r;
+	depth = d;
+	w = 160 / s;
+	h = 144 / s;
+	count = armed = observing = 0;
+	memset(pal, 0, sizeof pal);
+	memset(lum, 0, sizeof lum);
+	return 0;
+}
+
+void observe_arm()
+{
+	if (!ring) return;
+	plane = ring + (count % depth) * w * h;
+	memset(plane, 0, w * h);
+	armed = observing = 1;
+}
+
+static void relum()
+{
+	int i, c, r, g, b;
+
+	memcpy(pal, lcd.pal, sizeof pal);
+	for (i = 0; i < 64; i++)
+	{
+		c = pal[2*i] | pal[2*i+1] << 8;
+		r = (c & 31) << 3 | (c & 31) >> 2;
+		g = (c >> 5 & 31) << 3 | (c >> 5 & 31) >> 2;
+		b = (c >> 10 & 31) << 3 | (c >> 10 & 31) >> 2;
+		lum[i] = (r * 77 + g * 150 + b * 29) >> 8;
+	}
+}
+
+#ifndef ASM_OBSERVE_ROW
+
+void observe_row(un16 *acc, byte *buf, byte *lum, int shrink)
+{
+	int x;
+
+	for (x = 0; x < 160; x++)
+		acc[x / shrink] += lum[buf[x] & 63];
+}
+
+#endif /* ASM_OBSERVE_ROW */
+
+void observe_line(int l, byte *buf)
+{
+	byte *row;
+	int x, sh;
+
+	if (!armed || l < 0 || l >= 144) return;
+	row = plane + l / shrink * w;
+	if (kind == OBS_INDEX)
+	{
+		if (l % shrink) return;
+		for (x = 0; x < w; x++) row[x] = buf[x * shrink];
+		return;
+	}
+	if (memcmp(pal, lcd.pal, sizeof pal)) relum();
+	if (l % shrink == 0) memset(acc, 0, w * sizeof *acc);
+	observe_row(acc, buf, lum, shrink);
+	if (l % shrink != shrink - 1) return;
+	sh = shrink == 4 ? 4 : shrink == 2 ? 2 : 0;
+	for (x = 0; x < w; x++) row[x] = acc[x] >> sh;
+}
+
+void observe_frame()
+{
+	if (!armed) return;
+	count++;
+	armed = observing = 0;
+}
+
+int observe_count()
+{
+	return count;
+}
+
+int observe_ram(const int *addrs, int n)
+{
+	int i;
+
+	if (n < 0 || n > OBS_MAXRAM) return -1;
+	for (i = 0; i < n; i++) ram[i] = addrs[i] & 0xffff;
+	nram = n;
+	return 0;
+}
+
+int observe_gather(byte *out)
+{
+	int i, b;
+
+	for (i = 0; i < nram; i++)
+		out[i] = (b = debug_peek(ram[i])) < 0 ? 0xff : b;
+	return nram;
+}
@@ -0,0 +1,540 @@
+/*
+ * profile.c
+ *
+ * Where the game spends its cycles. With "profile" on, cpu_emulate
+ * goes the slow way round for every instruction, as it does for
+ * "trace", and tells us how many cycles of its timeslice have run so
+ * far; what has run since the last call is charged to the instruction
+ * before. Instructions are counted by where they are in the rom, bank
+ * included, rather than by PC, so the same address in two banks are
+ * two different places. The cycles a halted cpu sleeps go to its HALT.
+ *
+ * "profdump" lists the routines that took the most, named from an
+ * RGBDS .sym file if "symfile" names one, otherwise by 256 byte block.
+ * With profiling off none of this costs anything beyond the test
+ * cpu_emulate already makes for tracing.
+ *
+ * It also measures how much a recompiler (see HACKING) would gain
+ * from superblocks: blocks run straight through to the next branch,
+ * and a superblock chains blocks across unconditional JP, CALL and JR
+ * whose target is in rom, as long as the switchable bank stays the one
+ * it started with (the guard a recompiler would test mbc.rombank
+ * with). The share of cycles run in superblocks of more than one
+ * block comes at the end of profdump.
+ *
+ * Code run from ram is marked byte by byte, and its pages handed to
+ * mem_setcode, so that writes there come back here and the ones that
+ * land on code already run are counted: each is code a recompiler
+ * would have had to throw away and translate again. Writes to ram
+ * nothing has run from still go straight through.
+ *
+ * For fuzzing, prof_cover takes a map with a byte for each place
+ * instructions are counted by, and sets each one's byte as it runs,
+ * so whoever owns the map (it can be shared between processes) can
+ * tell which inputs reached code nothing had reached before.
+ * prof_span says how far apart the places run lately are, which for
+ * a game stuck in a loop of a few instructions stays tiny.
+ *
+ * "opcount" counts the instructions run by opcode instead, and by
+ * what came after CB, and every pair of opcodes run one after the
+ * other, which is what a superinstruction would fuse. It goes the
+ * slow way round too, but does nothing else there. "opdump" lists
+ * them, most run first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "cpu.h"
+#include "mem.h"
+#include "fastmem.h"
+#include "rc.h"
+#include "profile.h"
+#include "debug.h"
+
+#include "cpuregs.h"
+
+int profiling, opcounting;
+static char *symfile;
+static int proftop = 40;
+
+rcvar_t profile_exports[] =
+{
+	RCV_BOOL("profile", &profiling, "count the cycles spent at each rom address"),
+	RCV_STRING("symfile", &symfile, "RGBDS symbol file profdump names routines from"),
+	RCV_INT("proftop", &proftop, "how many routines profdump lists"),
+	RCV_BOOL("opcount", &opcounting, "count the instructions run by opcode"),
+	RCV_END
+};
+
+/* cycles by rom offset, followed by cycles by address for code
+   running anywhere else (ram, hram, the boot rom) */
+static un32 *cyc;
+static byte *cycrom;
+static int romlen;
+static int last = -1, lastelapsed;
+
+/* the instruction before, the superblock it was in and the totals */
+static int lastpc;
+static byte lastop[3];
+static int sbbank, sbblocks;
+static un32 sbcyc;
+static unsigned long long blocks, superblocks, chained, guards;
+
+/* which bytes of 8000-FFFF have been run as code */
+static byte codebits[4096];
+static unsigned long long smc;
+
+static unsigned long long ops[OPCOUNTS];
+static int prevop = -1;
+
+/* the coverage map, what this process was first to mark in it, and
+   the lowest and highest places run since prof_span */
+static byte *cover;
+static int covered, spanlo, spanhi = -1;
+
+
+void prof_reset()
+{
+	free(cyc);
+	cyc = 0;
+	last = -1;
+	lastelapsed = 0;
+	sbblocks = 0;
+	blocks = superblocks = chained = guards = 0;
+	memset(codebits, 0, sizeof codebits);
+	smc = 0;
+	mem_setcode(0);
+	memset(ops, 0, sizeof ops);
+	prevop = -1;
+}
+
+#define CODEBIT(a) (codebits[((a) - 0x8000) >> 3] & (1 << ((a) & 7)))
+
+static void codewrite(int a)
+{
+	if (a < 0x8000 || !CODEBIT(a)) return;
+	codebits[(a - 0x8000) >> 3] &= ~(1 << (a & 7));
+	smc++;
+}
+
+static void markcode()
+{
+	int i, a, n = debug_oplen(lastop[0]), mask = mem_wcode;
+
+	for (i = 0; i < n; i++)
+	{
+		a = (PC + i) & 0xffff;
+		if (a < 0x8000) continue;
+		codebits[(a - 0x8000) >> 3] |= 1 << (a & 7);
+		mask |= 1 << (a >> 12);
+	}
+	mem_codewrite = codewrite;
+	mem_setcode(mask);
+}
+
+static int setup()
+{
+	if (cyc && cycrom == rom.bank[0] && romlen == mbc.romsize * 16384)
+		return 0;
+	prof_reset();
+	romlen = mbc.romsize * 16384;
+	cycrom = rom.bank[0];
+	cyc = calloc(romlen + 65536, sizeof *cyc);
+	return cyc ? 0 : -1;
+}
+
+static int where()
+{
+	byte *p;
+
+	if (PC < 0x8000 && (p = mbc.rmap[PC>>12]))
+	{
+		p += PC;
+		if (p >= rom.bank[0] && p < rom.bank[0] + romlen)
+			return p - rom.bank[0];
+	}
+	return romlen + PC;
+}
+
+static void charge(int n)
+{
+	un32 c;
+
+	if (last < 0 || n <= 0) return;
+	c = cyc[last] + n;
+	cyc[last] = c < cyc[last] ? 0xffffffff : c;
+}
+
+static void endsb()
+{
+	if (sbblocks > 1) chained += sbcyc;
+	sbblocks = 0;
+	sbcyc = 0;
+}
+
+/* whether the instruction before ended a block, and if it did, whether
+   the superblock can go on into the one starting at k */
+static void chain(int k)
+{
+	int op = lastop[0], to = -1, bank;
+
+	switch (op)
+	{
+	case 0xC3: case 0xCD:
+		to = lastop[1] | lastop[2] << 8;
+		break;
+	case 0x18:
+		to = (lastpc + 2 + (n8)lastop[1]) & 0xffff;
+		break;
+	case 0x10: case 0x76: case 0xE9: case 0xC9: case 0xD9:
+	case 0x20: case 0x28: case 0x30: case 0x38:
+	case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+	case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+	case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+		break;
+	default:
+		if ((op & 0xC7) == 0xC7) break;
+		/* anything else runs on to the next instruction, unless an
+		   interrupt came in between; none is longer than 3 bytes */
+		if (sbblocks && PC > lastpc && PC <= lastpc + 3) return;
+		break;
+	}
+	blocks++;
+	bank = k < romlen ? k >> 14 : -1;
+	if (sbblocks && PC == to && bank >= 0)
+	{
+		if (!bank || !sbbank || bank == sbbank)
+		{
+			if (bank) sbbank = bank;
+			sbblocks++;
+			return;
+		}
+		guards++;
+	}
+	endsb();
+	superblocks++;
+	sbblocks = 1;
+	sbbank = bank > 0 ? bank : 0;
+}
+
+/* called before each instruction with the cycles run so far */
+void prof_insn(int elapsed)
+{
+	int k;
+
+	if (setup()) return;
+	charge(elapsed - lastelapsed);
+	if (sbblocks) sbcyc += elapsed - lastelapsed;
+	k = where();
+	if (cover && !cover[k])
+	{
+		cover[k] = 1;
+		covered++;
+	}
+	if (spanhi < 0) spanlo = spanhi = k;
+	else if (k < spanlo) spanlo = k;
+	else if (k > spanhi) spanhi = k;
+	chain(k);
+	last = k;
+	lastelapsed = elapsed;
+	lastpc = PC;
+	for (k = 0; k < 3; k++) lastop[k] = readb((PC + k) & 0xffff);
+	if (PC >= 0x8000) markcode();
+}
+
+/* bytes a coverage map needs for the rom loaded: the rom, then the
+   64k address space for code run from anywhere else */
+int prof_coversize()
+{
+	return mbc.romsize * 16384 + 65536;
+}
+
+/* map, prof_coversize() bytes, gets a 1 for every place an
+   instruction runs from while profiling is on; 0 for none */
+void prof_cover(byte *map)
+{
+	cover = map;
+	covered = 0;
+}
+
+/* places this process was first to mark since the last call */
+int prof_covered()
+{
+	int n = covered;
+
+	covered = 0;
+	return n;
+}
+
+/* how many bytes the places run since the last call span, a bank
+   apart counting as at least 16k; 0 if nothing has run */
+int prof_span()
+{
+	int n = spanhi < 0 ? 0 : spanhi - spanlo + 1;
+
+	spanhi = -1;
+	return n;
+}
+
+/* called as cpu_emulate returns */
+void prof_end(int elapsed)
+{
+	if (!cyc) return;
+	charge(elapsed - lastelapsed);
+	lastelapsed = 0;
+}
+
+
+struct sym
+{
+	int bank, addr;
+	char *name;
+	unsigned long long total;
+	int hot;
+	un32 hotcyc;
+};
+
+static int symcmp(const void *a, const void *b)
+{
+	const struct sym *x = a, *y = b;
+
+	if (x->bank != y->bank) return x->bank - y->bank;
+	return x->addr - y->addr;
+}
+
+static int totalcmp(const void *a, const void *b)
+{
+	const struct sym *x = a, *y = b;
+
+	if (x->total != y->total) return x->total < y->total ? 1 : -1;
+	return symcmp(a, b);
+}
+
+static struct sym *loadsyms(int *n)
+{
+	FILE *f;
+	struct sym *s = 0, *t;
+	char line[256], name[256];
+	int bank, addr, cnt = 0, size = 0;
+
+	if (!symfile || !*symfile || !(f = fopen(symfile, "r")))
+	{
+		*n = 0;
+		return 0;
+	}
+	while (fgets(line, sizeof line, f))
+	{
+		if (sscanf(line, "%x:%x %255s", &bank, &addr, name) != 3)
+			continue;
+		if (cnt == size)
+		{
+			size = size ? size * 2 : 1024;
+			if (!(t = realloc(s, size * sizeof *s))) break;
+			s = t;
+		}
+		memset(s + cnt, 0, sizeof *s);
+		s[cnt].bank = bank;
+		s[cnt].addr = addr;
+		s[cnt].name = strdup(name);
+		cnt++;
+	}
+	fclose(f);
+	if (cnt) qsort(s, cnt, sizeof *s, symcmp);
+	*n = cnt;
+	return s;
+}
+
+/* the symbol at or before bank:addr in the same bank and the same
+   kind of memory, or -1 */
+static int lookup(struct sym *s, int n, int bank, int addr)
+{
+	int lo = 0, hi = n - 1, mid, found = -1;
+	struct sym key;
+
+	key.bank = bank;
+	key.addr = addr;
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (symcmp(s + mid, &key) <= 0) found = mid, lo = mid + 1;
+		else hi = mid - 1;
+	}
+	if (found < 0 || s[found].bank != bank
+		|| (s[found].addr < 0x8000) != (addr < 0x8000))
+		return -1;
+	return found;
+}
+
+/* bank and address of an entry in cyc, the way RGBDS would give them */
+static void place(int k, int *bank, int *addr)
+{
+	if (k < romlen)
+	{
+		*bank = k >> 14;
+		*addr = (k & 0x3fff) | (*bank ? 0x4000 : 0);
+		return;
+	}
+	*addr = k - romlen;
+	*bank = *addr >= 0xD000 && *addr < 0xE000;
+}
+
+static void add(struct sym *s, int k, un32 c)
+{
+	s->total += c;
+	if (c > s->hotcyc) s->hotcyc = c, s->hot = k;
+}
+
+int prof_dump(char *name)
+{
+	FILE *f = stdout;
+	struct sym *syms, *blk, *all;
+	unsigned long long sum = 0;
+	int nsym, nblk, i, k, j, bank, addr, hb, ha;
+	char label[32];
+
+	if (!cyc) return -1;
+	syms = loadsyms(&nsym);
+	nblk = (romlen + 65536) >> 8;
+	blk = calloc(nblk, sizeof *blk);
+	all = malloc((nsym + nblk) * sizeof *all);
+	if (!blk || !all || (name && !(f = fopen(name, "w"))))
+	{
+		for (i = 0; i < nsym; i++) free(syms[i].name);
+		free(syms);
+		free(blk);
+		free(all);
+		return -1;
+	}
+
+	for (k = 0; k < romlen + 65536; k++)
+	{
+		if (!cyc[k]) continue;
+		sum += cyc[k];
+		place(k, &bank, &addr);
+		if ((j = lookup(syms, nsym, bank, addr)) >= 0)
+			add(syms + j, k, cyc[k]);
+		else
+		{
+			blk[k >> 8].bank = bank;
+			blk[k >> 8].addr = addr & ~0xff;
+			add(blk + (k >> 8), k, cyc[k]);
+		}
+	}
+	memcpy(all, syms, nsym * sizeof *all);
+	memcpy(all + nsym, blk, nblk * sizeof *all);
+	qsort(all, nsym + nblk, sizeof *all, totalcmp);
+
+	fprintf(f, "%12s %6s  %-32s %s\n", "cycles", "share", "routine", "hottest");
+	for (i = 0; i < nsym + nblk && i < proftop && all[i].total; i++)
+	{
+		place(all[i].hot, &hb, &ha);
+		if (!all[i].name)
+			sprintf(label, "%02X:%04X", all[i].bank, all[i].addr);
+		fprintf(f, "%12llu %3d.%d%%  %-32s %02X:%04X\n", all[i].total,
+			(int)(all[i].total * 1000 / sum / 10),
+			(int)(all[i].total * 1000 / sum % 10),
+			all[i].name ? all[i].name : label, hb, ha);
+	}
+	fprintf(f, "%12llu total\n", sum);
+	endsb();
+	if (sum && superblocks)
+		fprintf(f, "%12llu %3d.%d%%  in superblocks of more than one block\n"
+			"%12s %llu blocks, %llu superblocks, %llu cycles a block,"
+			" %llu a superblock, %llu guard exits\n",
+			chained, (int)(chained * 1000 / sum / 10),
+			(int)(chained * 1000 / sum % 10), "",
+			blocks, superblocks, sum / blocks, sum / superblocks, guards);
+	if (smc)
+		fprintf(f, "%12llu writes to code already run from ram\n", smc);
+
+	if (f != stdout) fclose(f);
+	for (i = 0; i < nsym; i++) free(syms[i].name);
+	free(syms);
+	free(blk);
+	free(all);
+	return 0;
+}
+
+
+/* called before each instruction while opcount is on */
+void prof_op()
+{
+	int op = readb(PC);
+
+	ops[op]++;
+	if (op == 0xCB) ops[256 + readb((PC + 1) & 0xffff)]++;
+	if (prevop >= 0) ops[512 + (prevop << 8) + op]++;
+	prevop = op;
+}
+
+/* for embedders, which may add up the counts of several runs here to
+   have opdump list the lot */
+unsigned long long *prof_opcounts()
+{
+	return ops;
+}
+
+static int opcmp(const void *a, const void *b)
+{
+	unsigned long long x = ops[*(const int *)a], y = ops[*(const int *)b];
+
+	if (x != y) return x < y ? 1 : -1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/* the counts from first to first + n, most first, with their share of
+   all the instructions; cb is 1 for what came after CB, 2 for pairs,
+   of which only the top proftop are listed */
+static void oplist(FILE *f, int first, int n, int cb, unsigned long long sum)
+{
+	static int order[65536];
+	char code[8], a[40], b[20];
+	int i, k, max = cb == 2 && proftop < n ? proftop : n;
+
+	for (i = 0; i < n; i++) order[i] = first + i;
+	qsort(order, n, sizeof *order, opcmp);
+	for (i = 0; i < max && ops[order[i]]; i++)
+	{
+		k = order[i] - first;
+		if (cb == 2)
+		{
+			sprintf(code, "%02X %02X", k >> 8, k & 255);
+			debug_opname(a, k >> 8, 0);
+			debug_opname(b, k & 255, 0);
+			strcat(strcat(a, "; "), b);
+		}
+		else
+		{
+			sprintf(code, cb ? "CB %02X" : "%02X", k);
+			debug_opname(a, k, cb);
+		}
+		fprintf(f, "%14llu %3d.%d%%  %-6s %s\n", ops[order[i]],
+			(int)(ops[order[i]] * 1000 / sum / 10),
+			(int)(ops[order[i]] * 1000 / sum % 10), code, a);
+	}
+}
+
+int prof_opdump(char *name)
+{
+	FILE *f = stdout;
+	unsigned long long sum = 0;
+	int i;
+
+	for (i = 0; i < 256; i++) sum += ops[i];
+	if (!sum) return -1;
+	if (name && !(f = fopen(name, "w"))) return -1;
+	fprintf(f, "%14s %6s  %-6s %s\n", "count", "share", "opcode", "instruction");
+	oplist(f, 0, 256, 0, sum);
+	fprintf(f, "%14llu total\n\n", sum);
+	if (ops[0xCB])
+	{
+		oplist(f, 256, 256, 1, sum);
+		fprintf(f, "\n");
+	}
+	oplist(f, 512, 65536, 2, sum);
+	if (f != stdout) fclose(f);
+	return 0;
+}
@@ -10,15 +10,25 @@
 #include "split.h"
 #include "menu.h"
 #include "sys.h"
+#include "rewind.h"
+#include "movie.h"
+#include "timeline.h"
+#include "profile.h"
+#include "memstats.h"
+#include "debug.h"
+#include "cheat.h"
+#include "search.h"
+#include "capture.h"
 
 
 /*
- * define the command functions for the controller pad.
+ * define the command functions for the controller pad. while a movie
+ * plays, the pad is the movie's alone.
  */
 
 #define CMD_PAD(b, B) \
 static int (cmd_ ## b)(int c, char **v) \
-{ pad_set((PAD_ ## B), v[0][0] == '+'); return 0; } \
+{ if (!movie_playing()) pad_set((PAD_ ## B), v[0][0] == '+'); return 0; } \
 static int (cmd_ ## b)(int c, char **v)
 
 CMD_PAD(up, UP);
@@ -94,6 +104,7 @@ static int cmd_quit()
 
 static int cmd_reset()
 {
+	movie_stop();
 	emu_reset();
 	return 0;
 }
@@ -106,10 +117,234 @@ static int cmd_savestate(int argc, char **argv)
 
 static int cmd_loadstate(int argc, char **argv)
 {
+	movie_stop();
 	state_load(argc > 1 ? atoi(argv[1]) : -1);
 	return 0;
 }
 
+/*
+ * loadrom FILE swaps FILE in for the running rom, window, sound and
+ * all staying open, and starts it from reset; loadrom FILE keep
+ * carries the machine's state over when the two are laid out alike.
+ * see loader_swap.
+ */
+
+static int cmd_loadrom(int argc, char **argv)
+{
+	if (argc < 2)
+		return -1;
+	return loader_swap(argv[1], argc > 2 && !strcmp(argv[2], "keep")) < 0
+		? -1 : 0;
+}
+
+static int cmd_rewind(int argc, char **argv)
+{
+	if (argv[0][0] != '-') movie_stop();
+	if (argv[0][0] == '+' || argv[0][0] == '-')
+		rewind_hold(argv[0][0] == '+');
+	else rewind_step();
+	return 0;
+}
+
+/*
+ * record FILE and playback FILE start an input movie, see movie.c;
+ * either of them on its own stops the one that's going. resetting,
+ * loading a state or rewinding stops it too, since the movie would
+ * no longer follow from where it began.
+ */
+
+static int cmd_record(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		movie_stop();
+		return 0;
+	}
+	return movie_record(argv[1]);
+}
+
+static int cmd_playback(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		movie_stop();
+		return 0;
+	}
+	return movie_play(argv[1]);
+}
+
+/*
+ * timelinedump writes the frame timeline out, to the file given or to
+ * timelinefile; see timeline.c.
+ */
+
+static int cmd_timelinedump(int argc, char **argv)
+{
+	return timeline_dump(argc > 1 ? argv[1] : 0);
+}
+
+/*
+ * profdump lists where the cycles went since profiling started or
+ * since profreset, to the file given or to stdout; see profile.c.
+ */
+
+static int cmd_profdump(int argc, char **argv)
+{
+	return prof_dump(argc > 1 ? argv[1] : 0);
+}
+
+/* opdump lists the instructions run by opcode, with opcount on */
+static int cmd_opdump(int argc, char **argv)
+{
+	return prof_opdump(argc > 1 ? argv[1] : 0);
+}
+
+static int cmd_profreset()
+{
+	prof_reset();
+	return 0;
+}
+
+/*
+ * memstatsdump writes where the memory accesses went, in a build with
+ * MEMSTATS, to the file given or one named after the rom; see
+ * memstats.c.
+ */
+
+static int cmd_memstatsdump(int argc, char **argv)
+{
+	return memstats_dump(argc > 1 ? argv[1] : 0);
+}
+
+/*
+ * bintracedump writes the binary trace ring to the file given or to
+ * bintracefile, for gnuboy-tracedump to read; see debug.c.
+ */
+
+static int cmd_bintracedump(int argc, char **argv)
+{
+	return debug_bintracedump(argc > 1 ? argv[1] : 0);
+}
+
+/*
+ * break [BANK:]ADDR stops before the instruction at ADDR, in any bank
+ * or only in BANK; unbreak removes it, or all of them with no
+ * argument. watch, rwatch and awatch ADDR [LEN] watch writes, reads
+ * or both to LEN bytes (1 by default) from ADDR; unwatch ADDR [LEN]
+ * stops, or unwatch alone clears them all. Numbers are in hex. What a
+ * hit does is up to breakcmd; see debug.c.
+ */
+
+static int cmd_break(int argc, char **argv)
+{
+	char *p;
+	int bank = -1;
+
+	if (argc < 2)
+	{
+		if (argv[0][0] != 'u') return -1;
+		debug_clearbreaks();
+		return 0;
+	}
+	if ((p = strchr(argv[1], ':')))
+	{
+		bank = strtol(argv[1], 0, 16);
+		p++;
+	}
+	else p = argv[1];
+	return debug_setbreak(bank, strtol(p, 0, 16), argv[0][0] != 'u');
+}
+
+static int cmd_watch(int argc, char **argv)
+{
+	int how;
+
+	switch (argv[0][0])
+	{
+	case 'r': how = 1; break;
+	case 'w': how = 2; break;
+	case 'a': how = 3; break;
+	default: how = 0; break;
+	}
+	if (argc < 2)
+	{
+		if (how) return -1;
+		debug_setwatch(0, 65536, 3, 0);
+		return 0;
+	}
+	debug_setwatch(strtol(argv[1], 0, 16),
+		argc > 2 ? strtol(argv[2], 0, 16) : 1, how ? how : 3, how != 0);
+	return 0;
+}
+
+/*
+ * cheat adds Game Genie or GameShark codes, any number of them;
+ * clearcheats drops them all. See cheat.c for the formats.
+ */
+
+static int cmd_cheat(int argc, char **argv)
+{
+	int i, ret = 0;
+
+	for (i = 1; i < argc; i++)
+		if (cheat_add(argv[i]) < 0) ret = -1;
+	return ret;
+}
+
+static int cmd_clearcheats()
+{
+	cheat_clear();
+	return 0;
+}
+
+/*
+ * search drives the ram search in search.c: "search reset" starts
+ * over, "search list [max]" prints the candidates, and anything else
+ * filters them: eq, ne, lt and gt against a number, same, changed,
+ * inc and dec against the last snapshot, inc and dec optionally by
+ * exactly the number given. Numbers are decimal, or hex with 0x.
+ */
+
+static int cmd_search(int argc, char **argv)
+{
+	static const char *const rels[] =
+	{
+		"eq", "ne", "lt", "gt", "same", "changed", "inc", "dec", 0
+	};
+	int i;
+
+	if (argc < 2) return -1;
+	if (!strcmp(argv[1], "reset")) return search_reset();
+	if (!strcmp(argv[1], "list"))
+	{
+		search_list(argc > 2 ? strtol(argv[2], 0, 0) : 50);
+		return 0;
+	}
+	for (i = 0; rels[i]; i++)
+		if (!strcmp(argv[1], rels[i]))
+			return search_filter(i, argc > 2 ? strtol(argv[2], 0, 0) : 0);
+	return -1;
+}
+
+/*
+ * screenshot writes the next frame to the png file given, or to a new
+ * numbered one in savedir; see capture.c.
+ */
+
+static int cmd_screenshot(int argc, char **argv)
+{
+	capture_shot(argc > 1 ? argv[1] : 0);
+	return 0;
+}
+
+static int cmd_fastforward(int argc, char **argv)
+{
+	if (argv[0][0] == '+' || argv[0][0] == '-')
+		emu_fastforward(argv[0][0] == '+');
+	else emu_fastforward(!emu_fastforwarding());
+	return 0;
+}
+
 static int cmd_menu(int argc, char **argv)
 {
 	/* some of the actions we perform from the menu require us
@@ -137,6 +372,31 @@ rccmd_t rccmds[] =
 	RCC("menu", cmd_menu),
 	RCC("savestate", cmd_savestate),
 	RCC("loadstate", cmd_loadstate),
+	RCC("loadrom", cmd_loadrom),
+	RCC("rewind", cmd_rewind),
+	RCC("+rewind", cmd_rewind),
+	RCC("-rewind", cmd_rewind),
+	RCC("record", cmd_record),
+	RCC("playback", cmd_playback),
+	RCC("timelinedump", cmd_timelinedump),
+	RCC("profdump", cmd_profdump),
+	RCC("profreset", cmd_profreset),
+	RCC("opdump", cmd_opdump),
+	RCC("memstatsdump", cmd_memstatsdump),
+	RCC("bintracedump", cmd_bintracedump),
+	RCC("break", cmd_break),
+	RCC("unbreak", cmd_break),
+	RCC("watch", cmd_watch),
+	RCC("rwatch", cmd_watch),
+	RCC("awatch", cmd_watch),
+	RCC("unwatch", cmd_watch),
+	RCC("cheat", cmd_cheat),
+	RCC("clearcheats", cmd_clearcheats),
+	RCC("search", cmd_search),
+	RCC("screenshot", cmd_screenshot),
+	RCC("fastforward", cmd_fastforward),
+	RCC("+fastforward", cmd_fastforward),
+	RCC("-fastforward", cmd_fastforward),
 	
 	RCC("+up", cmd_up),
 	RCC("-up", cmd_up),
@@ -162,56 +422,47 @@ rccmd_t rccmds[] =
 
 
 
+/* the commands by name, as the rcvars are (see rcvars.c); the table
+   is fixed, so this is built once */
+static rccmd_t *byname[256];
+
+rccmd_t *rc_findcmd(char *name)
+{
+	static int built;
+	rccmd_t *c;
+	int j;
+
+	if (!built)
+	{
+		for (c = rccmds; c->name; c++)
+		{
+			for (j = rc_hash(c->name) & 255; byname[j]; j = (j + 1) & 255);
+			byname[j] = c;
+		}
+		built = 1;
+	}
+	for (j = rc_hash(name) & 255; byname[j]; j = (j + 1) & 255)
+		if (!strcmp(byname[j]->name, name)) return byname[j];
+	return 0;
+}
+
 int rc_command(char *line)
 {
-	int i, argc, ret;
+	int argc, ret;
 	char *argv[128], *linecopy;
+	rccmd_t *c;
 
 	linecopy = malloc(strlen(line)+1);
 	strcpy(linecopy, line);
 	
 	argc = splitline(argv, (sizeof argv)/(sizeof argv[0]), linecopy);
-	if (!argc)
+	if (!argc || !(c = rc_findcmd(argv[0])))
 	{
+		/* printf("unknown command: %s\n", argv[0]); */
 		free(linecopy);
 		return -1;
 	}
-	
-	for (i = 0; rccmds[i].name; i++)
-	{
-		if (!strcmp(argv[0], rccmds[i].name))
-		{
-			ret = rccmds[i].func(argc, argv);
-			free(linecopy);
-			return ret;
-		}
-	}
-
-	/* printf("unknown command: %s\n", argv[0]); */
+	ret = c->func(argc, argv);
 	free(linecopy);
-	
-	return -1;
+	return ret;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
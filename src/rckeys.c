@@ -9,12 +9,64 @@
 #include "defs.h"
 #include "rc.h"
 #include "input.h"
+#include "split.h"
 
 
 
 
 char *keybind[MAX_KEYS];
 
+/* each binding split up and its commands looked up once, when it's
+   bound, rather than on every press: press is the command itself and
+   release, for a +command, its -command. argv points into line */
+static struct call
+{
+	char *line;
+	rccmd_t *press, *release;
+	int argc;
+	char *argv[1];
+} *calls[MAX_KEYS];
+
+
+static void unbind(int key)
+{
+	free(keybind[key]);
+	keybind[key] = NULL;
+	if (calls[key]) free(calls[key]->line);
+	free(calls[key]);
+	calls[key] = NULL;
+}
+
+static struct call *parse(char *cmd)
+{
+	char *argv[128], *line;
+	struct call *c;
+	int argc;
+
+	if (!(line = strdup(cmd))) return 0;
+	argc = splitline(argv, (sizeof argv)/(sizeof argv[0]), line);
+	c = malloc(sizeof *c + argc * sizeof *argv);
+	if (!c || !argc)
+	{
+		free(line);
+		free(c);
+		return 0;
+	}
+	c->line = line;
+	c->press = rc_findcmd(argv[0]);
+	c->release = 0;
+	if (argv[0][0] == '+')
+	{
+		argv[0][0] = '-';
+		c->release = rc_findcmd(argv[0]);
+		argv[0][0] = '+';
+	}
+	c->argc = argc;
+	memcpy(c->argv, argv, argc * sizeof *argv);
+	c->argv[argc] = 0;
+	return c;
+}
+
 
 
 
@@ -29,8 +81,10 @@ int rc_bindkey(char *keyname, char *cmd)
 	a = strdup(cmd);
 	if (!a) die("out of memory binding key\n");
 
-	if (keybind[key]) free(keybind[key]);
+	unbind(key);
 	keybind[key] = a;
+	/* a, not cmd, which may be in the binding just dropped */
+	calls[key] = parse(a);
 	
 	return 0;
 }
@@ -44,8 +98,7 @@ int rc_unbindkey(char *keyname)
 	key = k_keycode(keyname);
 	if (!key) return -1;
 	
-	if (keybind[key]) free(keybind[key]);
-	keybind[key] = NULL;
+	unbind(key);
 	return 0;
 }
 
@@ -55,13 +108,7 @@ void rc_unbindall()
 	int i;
 
 	for (i = 0; i < MAX_KEYS; i++)
-	{
-		if (keybind[i])
-		{
-			free(keybind[i]);
-			keybind[i] = NULL;
-		}
-	}
+		unbind(i);
 }
 
 char *rc_getkeybind(int key)
@@ -70,19 +117,48 @@ char *rc_getkeybind(int key)
 	return keybind[key];
 }
 
+/* whether key is bound to a pad button and nothing else */
+int rc_padkey(int key)
+{
+	static char *pad[] =
+	{
+		"+up", "+down", "+left", "+right",
+		"+a", "+b", "+start", "+select", 0
+	};
+	int i;
+
+	if (!keybind[key]) return 0;
+	for (i = 0; pad[i]; i++)
+		if (!strcmp(keybind[key], pad[i])) return 1;
+	return 0;
+}
+
+/* a fresh copy of argv for each call, since commands may shuffle it */
+static int call(struct call *c, rccmd_t *cmd)
+{
+	char *argv[128];
+
+	if (!cmd) return -1;
+	memcpy(argv, c->argv, (c->argc + 1) * sizeof *argv);
+	return cmd->func(c->argc, argv);
+}
+
 int rc_dokey(int key, int st)
 {
 	int ret;
-	if (!keybind[key]) return 0;
-	if (keybind[key][0] != '+' && !st) return 0;
+	struct call *c = calls[key];
+
+	if (!c) return 0;
+	if (c->argv[0][0] != '+' && !st) return 0;
 	
 	if (st)
-		ret = rc_command(keybind[key]);
+		ret = call(c, c->press);
 	else
 	{
-		keybind[key][0] = '-';
-		ret = rc_command(keybind[key]);
-		keybind[key][0] = '+';
+		/* the command tells press from release by its name */
+		c->argv[0][0] = '-';
+		ret = call(c, c->release);
+		if (calls[key] == c) c->argv[0][0] = '+';
 	}
 	return ret;
 }
@@ -2,6 +2,7 @@
 #define RCKEYS_H
 
 int rc_dokey(int key, int st);
+int rc_padkey(int key);
 int rc_bindkey(char *keyname, char *cmd);
 int rc_unbindkey(char *keyname);
 void rc_unbindall();
@@ -44,16 +44,57 @@ void rc_exportvars(rcvar_t *vars)
 
 
 
+/* fnv-1a, for the name tables here and in rccmds.c */
+unsigned rc_hash(char *name)
+{
+	unsigned h = 2166136261u;
+
+	while (*name) h = (h ^ (byte)*(name++)) * 16777619u;
+	return h;
+}
+
+/*
+ * The variables are found by name through an open addressed hash
+ * table of their indices, at most half full, so a lookup is a hash
+ * and usually one strcmp. Everything is exported before much looking
+ * up is done, so rather than keeping the table up to date as they
+ * come in, it's rebuilt on the first lookup after one has.
+ */
+
+static int *byname, namemask, nindexed;
+
+static void reindex()
+{
+	int i, j, size;
+
+	for (size = 16; size < 2 * nvars; size <<= 1);
+	free(byname);
+	if (!(byname = malloc(size * sizeof *byname)))
+		die("out of memory indexing rcvars\n");
+	namemask = size - 1;
+	for (j = 0; j < size; j++) byname[j] = -1;
+	/* the first of two with the same name is the one found */
+	for (i = 0; i < nvars; i++)
+	{
+		for (j = rc_hash(rcvars[i].name) & namemask; byname[j] >= 0;
+			j = (j + 1) & namemask)
+			if (!strcmp(rcvars[byname[j]].name, rcvars[i].name)) break;
+		if (byname[j] < 0) byname[j] = i;
+	}
+	nindexed = nvars;
+}
+
 int rc_findvar(char *name)
 {
-	int i;
+	int j;
+
 	if (!rcvars) return -1;
-	for (i = 0; rcvars[i].name; i++)
-		if (!strcmp(rcvars[i].name, name))
-			break;
-	if (!rcvars[i].name)
-		return -1;
-	return i;
+	if (nindexed != nvars) reindex();
+	for (j = rc_hash(name) & namemask; byname[j] >= 0;
+		j = (j + 1) & namemask)
+		if (!strcmp(rcvars[byname[j]].name, name))
+			return byname[j];
+	return -1;
 }
 
 
@@ -110,7 +151,7 @@ int my_atoi(const char *s)
 }
 
 
-/* i - index of variable in rcvars array
+/* i - byname of variable in rcvars array
    c - count of values in v string array
    v - the actual values as string array */
 int rc_setvar_n(int i, int c, char **v)
@@ -184,6 +225,12 @@ void *rc_getmem(char *name)
 	return rcvars[i].mem;
 }
 
+int rc_gettype_n(int i)
+{
+	if (i < 0) return rcv_end;
+	return rcvars[i].type;
+}
+
 int rc_getint_n(int i)
 {
 	if (i < 0) return 0;
@@ -0,0 +1,9 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+void rewind_reset();
+void rewind_frame();
+void rewind_step();
+void rewind_hold(int on);
+
+#endif
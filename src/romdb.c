@@ -0,0 +1,137 @@
+/*
+ * romdb.c
+ *
+ * Settings for particular games. Each line of the database is a key
+ * and what to do for the rom it names:
+ *
+ *   key var value    set the int or bool rcvar var while it's loaded
+ *   key idle off n   the JR at off in the image closes an idle loop
+ *                    costing n cycles a pass (see idle_cost in cpu.c)
+ *
+ * The key is either the rom's 16 hex digit header fingerprint (the
+ * crc-64 of 0x100-0x14F, logo, title, checksums and all) or its title
+ * as the header has it, with _ for each space. Blank lines and those
+ * starting with # are skipped.
+ *
+ * The lines built in below are read first and then the file "romdb"
+ * names, romdb in savedir if it's "", none if it's "-", so a user's
+ * line has the last word. The vars are the speed hacks, sprsort,
+ * idleskip, loopskip and the like, and get back what they were when
+ * the rom is unloaded. The idle loops cpu.c found that it wasn't told
+ * about are added to the file then, so the next run knows them from
+ * the start; each is checked against the rom before it's believed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "mem.h"
+#include "cpu.h"
+#include "rc.h"
+#include "loader.h"
+#include "romdb.h"
+
+static char *romdb;
+
+rcvar_t romdb_exports[] =
+{
+	RCV_STRING("romdb", &romdb, "file of per-rom settings, \"\" = romdb in savedir, \"-\" = none"),
+	RCV_END
+};
+
+/* nothing needs anything yet; a line goes here for a game that's
+   known to break with one of the hacks on, or to be safe with one
+   that's off by default */
+static char *builtin[] =
+{
+	NULL
+};
+
+#define MAXSET 16
+#define MAXIDLE 64
+
+static char *file, key[17], title[17];
+static struct { int var, was; } set[MAXSET];
+static int nset;
+
+static void line(char *s)
+{
+	char *w[4], *v;
+	int n, i, j;
+
+	for (n = 0; n < 4 && (w[n] = strtok(n ? 0 : s, " \t\r\n")); n++);
+	if (n < 3 || *w[0] == '#') return;
+	if (strcmp(w[0], key) && (!*title || strcmp(w[0], title))) return;
+	if (!strcmp(w[1], "idle"))
+	{
+		if (n == 4) cpu_idlehint(strtoul(w[2], 0, 16), atoi(w[3]));
+		return;
+	}
+	i = rc_findvar(w[1]);
+	if (rc_gettype_n(i) != rcv_int && rc_gettype_n(i) != rcv_bool) return;
+	for (j = 0; j < nset && set[j].var != i; j++);
+	if (j == nset)
+	{
+		if (nset == MAXSET) return;
+		set[nset].var = i;
+		set[nset++].was = rc_getint_n(i);
+	}
+	v = w[2];
+	rc_setvar_n(i, 1, &v);
+}
+
+/* after rom_load, with savedir as it is */
+void romdb_load(char *dir)
+{
+	char buf[256];
+	FILE *f;
+	int i;
+
+	romdb_unload();
+	sprintf(key, "%016llx",
+		(unsigned long long)rom_fingerprint(rom.bank[0] + 0x100, 0x50));
+	for (i = 0; rom.name[i] && i < 16; i++)
+		title[i] = rom.name[i] == ' ' ? '_' : rom.name[i];
+	title[i] = 0;
+
+	for (i = 0; builtin[i]; i++)
+	{
+		strcpy(buf, builtin[i]);
+		line(buf);
+	}
+	if (romdb && !strcmp(romdb, "-")) return;
+	if (romdb && *romdb) file = strdup(romdb);
+	else if (dir && (file = malloc(strlen(dir) + 7)))
+		sprintf(file, "%s/romdb", dir);
+	if (!file || !(f = fopen(file, "r"))) return;
+	while (fgets(buf, sizeof buf, f)) line(buf);
+	fclose(f);
+}
+
+void romdb_unload()
+{
+	unsigned found[2 * MAXIDLE];
+	FILE *f;
+	int i, n;
+	char *v, num[16];
+
+	if (file && (n = cpu_idlefound(found, MAXIDLE))
+		&& (f = fopen(file, "a")))
+	{
+		for (i = 0; i < n; i++)
+			fprintf(f, "%s idle %06x %u\n", key, found[2*i], found[2*i+1]);
+		fclose(f);
+	}
+	for (i = nset - 1; i >= 0; i--)
+	{
+		sprintf(num, "%d", set[i].was);
+		v = num;
+		rc_setvar_n(set[i].var, 1, &v);
+	}
+	nset = 0;
+	free(file);
+	file = 0;
+	*key = *title = 0;
+}
@@ -0,0 +1,8 @@
+#ifndef ROMDB_H
+#define ROMDB_H
+
+/* the database of settings for particular roms, see romdb.c */
+void romdb_load(char *dir);
+void romdb_unload();
+
+#endif
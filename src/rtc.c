@@ -9,7 +9,7 @@
 #include "rtc.h"
 #include "rc.h"
 
-struct rtc rtc;
+MACHINE struct rtc rtc;
 
 static int syncrtc = 1;
 
@@ -102,11 +102,29 @@ void rtc_save_internal(FILE *f)
 
 void rtc_load_internal(FILE *f)
 {
-	int rt = 0;
+	int v[7], rt = 0;
+
+	v[0] = rtc.carry, v[1] = rtc.stop, v[2] = rtc.d;
+	v[3] = rtc.h, v[4] = rtc.m, v[5] = rtc.s, v[6] = rtc.t;
 	fscanf(
 		f, "%d %d %d %02d %02d %02d %02d\n%d\n",
-		&rtc.carry, &rtc.stop, &rtc.d,
-		&rtc.h, &rtc.m, &rtc.s, &rtc.t, &rt);
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &rt);
+	rtc_set(v, rt);
+}
+
+/* the clock as the .rtc file has it, carry, stop, d, h, m, s and t,
+   for keeping it somewhere other than a file */
+void rtc_get(int *v)
+{
+	v[0] = rtc.carry, v[1] = rtc.stop, v[2] = rtc.d;
+	v[3] = rtc.h, v[4] = rtc.m, v[5] = rtc.s, v[6] = rtc.t;
+}
+
+/* and put back, then being the time(0) it was taken at, or 0 */
+void rtc_set(int *v, long then)
+{
+	rtc.carry = v[0], rtc.stop = v[1], rtc.d = v[2];
+	rtc.h = v[3], rtc.m = v[4], rtc.s = v[5], rtc.t = v[6];
 	while (rtc.t >= 60) rtc.t -= 60;
 	while (rtc.s >= 60) rtc.s -= 60;
 	while (rtc.m >= 60) rtc.m -= 60;
@@ -114,8 +132,8 @@ void rtc_load_internal(FILE *f)
 	while (rtc.d >= 365) rtc.d -= 365;
 	rtc.stop &= 1;
 	rtc.carry &= 1;
-	if (rt) rt = (time(0) - rt) * 60;
-	if (syncrtc) while (rt-- > 0) rtc_tick();
+	if (then) then = (time(0) - then) * 60;
+	if (syncrtc) while (then-- > 0) rtc_tick();
 }
 
 
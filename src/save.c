@@ -1,6 +1,8 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 #include "defs.h"
 #include "cpu.h"
@@ -11,6 +13,10 @@
 #include "rtc.h"
 #include "mem.h"
 #include "sound.h"
+#include "save.h"
+#include "lz.h"
+#include "alloccheck.h"
+#include "xz.h"
 
 
 #define I1(s, p) { 1, s, p }
@@ -29,7 +35,7 @@ struct svar
 
 static int ver;
 static int sramblock, iramblock, vramblock;
-static int hramofs, hiofs, palofs, oamofs, wavofs;
+static int hramofs, hiofs, palofs, oamofs, wavofs, sndqofs;
 
 struct svar svars[] = 
 {
@@ -50,6 +56,7 @@ struct svar svars[] =
 	I4("tim ", &cpu.tim),
 	I4("lcdc", &cpu.lcdc),
 	I4("snd ", &cpu.snd),
+	I4("ser ", &cpu.serial),
 	
 	I1("ints", &hw.ilines),
 	I1("pad ", &hw.pad),
@@ -107,6 +114,7 @@ struct svar svars[] =
 	I4("pal ", &palofs),
 	I4("oam ", &oamofs),
 	I4("wav ", &wavofs),
+	I4("sndq", &sndqofs),
 	
 	/* NOSAVE is a special code to prevent the rest of the table
 	 * from being saved, used to support old stuff for backwards
@@ -144,87 +152,434 @@ struct svar svars[] =
 };
 
 
-void loadstate(FILE *f)
+/* the state is a 4k header block (the svars table followed by hi, pal,
+   oam and wave ram at fixed offsets) and then internal ram, video ram
+   and sram, each a whole number of 4k blocks. the buffer functions
+   below do all the work without touching stdio, so they're cheap
+   enough to run every frame; the FILE ones just wrap them. */
+
+#define BLOCKS(irl, vrl, srl) \
+	int irl = hw.cgb ? 8 : 2; \
+	int vrl = hw.cgb ? 4 : 2; \
+	int srl = mbc.ramsize << 1
+
+int savestate_size()
 {
-	int i, j;
-	byte buf[4096];
-	un32 (*header)[2] = (un32 (*)[2])buf;
-	un32 d;
-	int irl = hw.cgb ? 8 : 2;
-	int vrl = hw.cgb ? 4 : 2;
-	int srl = mbc.ramsize << 1;
+	BLOCKS(irl, vrl, srl);
+	return (1 + irl + vrl + srl) << 12;
+}
 
-	ver = hramofs = hiofs = palofs = oamofs = wavofs = 0;
+/* copy block n of a state in buf (len bytes) to mem, as much of it as
+   there is; old files may be missing the trailing blocks */
+static void getblocks(void *mem, byte *buf, int len, int n, int cnt)
+{
+	int ofs = n << 12, size = cnt << 12;
+	if (n <= 0 || ofs >= len) return;
+	if (size > len - ofs) size = len - ofs;
+	memcpy(mem, buf + ofs, size);
+}
 
-	fseek(f, 0, SEEK_SET);
-	fread(buf, 4096, 1, f);
-	
-	for (j = 0; header[j][0]; j++)
+/* sets the svars from up to n key/value pairs at h, stopping at an
+   empty key */
+static void getvars(byte *h, int n)
+{
+	int i, j, k;
+	un32 d;
+
+	/* states written by us list the keys in table order, so look
+	   right after the previous match first */
+	for (j = k = 0; j < n && memcmp(h, "\0\0\0\0", 4); j++, h += 8)
 	{
-		for (i = 0; svars[i].ptr; i++)
+		for (i = k; svars[i].ptr && memcmp(h, svars[i].key, 4); i++);
+		if (!svars[i].ptr)
+			for (i = 0; i < k && memcmp(h, svars[i].key, 4); i++);
+		if (!svars[i].ptr || memcmp(h, svars[i].key, 4))
+			continue;
+		k = i + 1;
+		memcpy(&d, h + 4, 4);
+		d = LIL(d);
+		switch (svars[i].len)
 		{
-			if (memcmp(&header[j][0], svars[i].key, 4))
-				continue;
-			d = LIL(header[j][1]);
-			switch (svars[i].len)
-			{
-			case 1:
-				*(byte *)svars[i].ptr = d;
-				break;
-			case 2:
-				*(un16 *)svars[i].ptr = d;
-				break;
-			case 4:
-				*(un32 *)svars[i].ptr = d;
-				break;
-			}
+		case 1:
+			*(byte *)svars[i].ptr = d;
+			break;
+		case 2:
+			*(un16 *)svars[i].ptr = d;
 			break;
+		case 4:
+			*(un32 *)svars[i].ptr = d;
+			break;
+		}
+	}
+}
+
+/*
+ * The packed format, which the .sav files are written in. The layout
+ * above suits states kept in memory, but on disk it's mostly zeros and
+ * has to be picked apart key by key. A packed state is
+ *
+ *   "GbS2", a 32 bit count of sections, 8 bytes of zeros
+ *   the directory: for each section, 32 bytes of
+ *     name (4 bytes), offset, length in the file, length unpacked,
+ *     crc32 of the bytes in the file, flags, 8 bytes of zeros
+ *   the sections, each starting on a multiple of 64 bytes
+ *
+ * all numbers little endian. The sections are the svars (the header
+ * block's key/value pairs, "VARS") and each piece of memory whole:
+ * "HRAM", "PAL ", "OAM ", "WAVE", "WRAM", "VRAM" and "SRAM", and
+ * "SNDQ", the sound register writes not yet mixed. A section
+ * with the LZ flag is lz4 coded (see lz.c), which is only done where
+ * it comes out smaller, so a section stored as it is can be mapped in
+ * and copied straight into place; PACKED, packbits run length coding,
+ * is what the first packed files used. Sections the loader
+ * doesn't know are skipped, and every checksum is checked before
+ * anything is loaded, so a damaged file leaves the game as it was.
+ */
+
+#define PACKED 1
+#define CHECKED 2
+#define LZ 4
+#define DIRENT 32
+#define MAXSECT 9
+#define ALIGN(n) (((n) + 63) & ~63)
+
+struct sect
+{
+	char name[4];
+	byte *mem;
+	int len;
+};
+
+static un32 get32(byte *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (un32)p[3] << 24;
+}
+
+static void put32(byte *p, un32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* the sound register writes sound_write has queued (see sound.c) are
+   part of the state: a count, then each write's time, register and
+   value. they have to be kept rather than mixed on saving, since that
+   would put samples into pcm that only belong there later */
+#define SNDQLEN (4 + 6 * SNDQUEUE)
+
+static byte sndq[SNDQLEN];
+
+static void putsndq(byte *p)
+{
+	int i;
+
+	memset(p, 0, SNDQLEN);
+	put32(p, snd.nq);
+	for (i = 0, p += 4; i < snd.nq; i++, p += 6)
+	{
+		put32(p, snd.q[i].t);
+		p[4] = snd.q[i].r;
+		p[5] = snd.q[i].b;
+	}
+}
+
+/* anything out of order or later than cpu.snd is thrown away */
+static void getsndq(byte *p)
+{
+	int i, n = get32(p), t = 0;
+
+	snd.nq = 0;
+	if (n < 0 || n > SNDQUEUE) return;
+	for (i = 0, p += 4; i < n; i++, p += 6)
+	{
+		if ((int)get32(p) < t || (int)get32(p) > cpu.snd) return;
+		t = snd.q[i].t = get32(p);
+		snd.q[i].r = p[4];
+		snd.q[i].b = p[5];
+		snd.nq++;
+	}
+}
+
+static un32 crc(byte *p, int len)
+{
+	static int init;
+
+	if (!init) xz_crc32_init();
+	init = 1;
+	return xz_crc32(p, len, 0);
+}
+
+/* the sections a state of the machine as it is now has; the svars go
+   through vars, a header block */
+static int sections(struct sect *s, byte *vars)
+{
+	int n;
+	BLOCKS(irl, vrl, srl);
+
+	for (n = 0; svars[n].len > 0; n++);
+	memcpy(s[0].name, "VARS", 4), s[0].mem = vars, s[0].len = 8 * n;
+	memcpy(s[1].name, "HRAM", 4), s[1].mem = ram.hi, s[1].len = sizeof ram.hi;
+	memcpy(s[2].name, "PAL ", 4), s[2].mem = lcd.pal, s[2].len = sizeof lcd.pal;
+	memcpy(s[3].name, "OAM ", 4), s[3].mem = lcd.oam.mem, s[3].len = sizeof lcd.oam;
+	memcpy(s[4].name, "WAVE", 4), s[4].mem = snd.wave, s[4].len = sizeof snd.wave;
+	memcpy(s[5].name, "WRAM", 4), s[5].mem = ram.ibank[0], s[5].len = irl << 12;
+	memcpy(s[6].name, "VRAM", 4), s[6].mem = lcd.vbank[0], s[6].len = vrl << 12;
+	memcpy(s[7].name, "SNDQ", 4), s[7].mem = sndq, s[7].len = sizeof sndq;
+	if (!srl) return 8;
+	memcpy(s[8].name, "SRAM", 4), s[8].mem = ram.sbank[0], s[8].len = srl << 12;
+	return 9;
+}
+
+/* packbits: a byte n below 128 is followed by n+1 bytes to copy, and
+   one of 128 or more by a byte to repeat 257-n times. 0 if in (len
+   bytes) unpacks to exactly size bytes */
+static int unpack(byte *out, int size, byte *in, int len)
+{
+	byte *end = in + len, *stop = out + size;
+	int n;
+
+	while (in < end)
+	{
+		n = *(in++);
+		if (n < 128)
+		{
+			if (++n > end - in || n > stop - out) return -1;
+			memcpy(out, in, n);
+			in += n;
+		}
+		else
+		{
+			if (in == end || (n = 257 - n) > stop - out) return -1;
+			memset(out, *(in++), n);
 		}
+		out += n;
 	}
+	return out == stop ? 0 : -1;
+}
+
+static int loadpacked(byte *buf, int len)
+{
+	struct sect s[MAXSECT];
+	byte vars[4096], *d;
+	int i, j, k, n, cnt, off, flen, size;
+
+	cnt = get32(buf + 4);
+	if (len < 16 || cnt < 0 || cnt > (len - 16) / DIRENT) return -1;
+	/* first make sure it will all load */
+	for (i = 0, d = buf + 16; i < cnt; i++, d += DIRENT)
+	{
+		off = get32(d + 4);
+		flen = get32(d + 8);
+		if (off < 16 || off > len || flen < 0 || flen > len - off
+			|| ((d[20] & CHECKED) && crc(buf + off, flen) != get32(d + 16)))
+			return -1;
+	}
+	lcd_flush();
+	ver = hramofs = hiofs = palofs = oamofs = wavofs = sndqofs = 0;
+	sramblock = iramblock = vramblock = 0;
+	cpu.serial = 0;
+	memset(vars, 0, sizeof vars);
+	memset(sndq, 0, sizeof sndq);
+	/* the vars first: they say whether it's a cgb, and so how much
+	   of the rest there is */
+	for (j = 0; j < 2; j++)
+	{
+		n = sections(s, vars);
+		/* leaving room for the empty key that ends them */
+		s[0].len = sizeof vars - 8;
+		for (i = 0, d = buf + 16; i < cnt; i++, d += DIRENT)
+		{
+			if (j == !memcmp(d, "VARS", 4)) continue;
+			for (k = 0; k < n && memcmp(s[k].name, d, 4); k++);
+			off = get32(d + 4);
+			flen = get32(d + 8);
+			size = get32(d + 12);
+			if (k == n || size < 0 || size > s[k].len) continue;
+			if (d[20] & LZ)
+				lz_unpack(s[k].mem, size, buf + off, flen);
+			else if (d[20] & PACKED)
+				unpack(s[k].mem, size, buf + off, flen);
+			else
+				memcpy(s[k].mem, buf + off, size < flen ? size : flen);
+		}
+		if (!j)
+		{
+			getvars(vars, sizeof vars / 8);
+			if (mem_sizewram()) return -1;
+		}
+	}
+	getsndq(sndq);
+	mem_alldirty();
+	return 0;
+}
+
+/* the header block of a plain state: the svars, hi, the wave ram and
+   the sound queue. pal, oam and the blocks are left to the caller */
+static int loadhead(byte *buf, int len)
+{
+	if (len < 4096 || memcmp(buf, svars[0].key, 4)) return -1;
+	/* lines still queued belong to the state we're replacing */
+	lcd_flush();
+
+	ver = hramofs = hiofs = palofs = oamofs = wavofs = sndqofs = 0;
+	sramblock = iramblock = vramblock = 0;
+	/* states from before serial timing have no transfer going */
+	cpu.serial = 0;
+
+	getvars(buf, 511);
+	if (mem_sizewram()) return -1;
 
 	/* obsolete as of version 0x104 */
 	if (hramofs) memcpy(ram.hi+128, buf+hramofs, 127);
 	
 	if (hiofs) memcpy(ram.hi, buf+hiofs, sizeof ram.hi);
-	if (palofs) memcpy(lcd.pal, buf+palofs, sizeof lcd.pal);
-	if (oamofs) memcpy(lcd.oam.mem, buf+oamofs, sizeof lcd.oam);
 
 	if (wavofs) memcpy(snd.wave, buf+wavofs, sizeof snd.wave);
 	else memcpy(snd.wave, ram.hi+0x30, 16); /* patch data from older files */
+	snd.nq = 0;
+	if (sndqofs > 0 && sndqofs <= 4096 - SNDQLEN) getsndq(buf+sndqofs);
+	return 0;
+}
 
-	fseek(f, iramblock<<12, SEEK_SET);
-	fread(ram.ibank, 4096, irl, f);
-	
-	fseek(f, vramblock<<12, SEEK_SET);
-	fread(lcd.vbank, 4096, vrl, f);
-	
-	fseek(f, sramblock<<12, SEEK_SET);
-	fread(ram.sbank, 4096, srl, f);
+static void loadbody(byte *buf, int len, int irl, int vrl, int srl)
+{
+	if (palofs) memcpy(lcd.pal, buf+palofs, sizeof lcd.pal);
+	if (oamofs) memcpy(lcd.oam.mem, buf+oamofs, sizeof lcd.oam);
+
+	getblocks(ram.ibank, buf, len, iramblock, irl);
+	getblocks(lcd.vbank, buf, len, vramblock, vrl);
+	getblocks(ram.sbank, buf, len, sramblock, srl);
+	mem_alldirty();
 }
 
-void savestate(FILE *f)
+static int loadbuffer(byte *buf, int len)
+{
+	BLOCKS(irl, vrl, srl);
+
+	if (len >= 16 && !memcmp(buf, "GbS2", 4)) return loadpacked(buf, len);
+	if (loadhead(buf, len)) return -1;
+	loadbody(buf, len, irl, vrl, srl);
+	return 0;
+}
+
+int loadstate_from_buffer(byte *buf, int len)
+{
+	unsigned long am = ALLOC_MARK();
+	int r = loadbuffer(buf, len);
+
+	ALLOC_CHECK(am, "loadstate_from_buffer");
+	return r;
+}
+
+/* the n 4k blocks from block b of buf that differ from mem copied
+   over it, but for the pages set in same, which are taken to match
+   already; the pages copied, as bits */
+static un32 putblocks(byte *mem, byte *buf, int b, int n, un32 same)
+{
+	un32 put = 0;
+	int i;
+
+	for (i = 0; i < n; i++, mem += 4096)
+	{
+		if ((same >> i) & 1 || !memcmp(mem, buf + ((b+i)<<12), 4096))
+			continue;
+		memcpy(mem, buf + ((b+i)<<12), 4096);
+		put |= 1 << i;
+	}
+	return put;
+}
+
+/*
+ * Loading a state the machine is mostly in already, for rewind,
+ * runahead and rollback. Only the pages that differ from memory are
+ * copied and only they are marked dirty, and the lcd is told just
+ * which tiles, maps and palette entries changed, so nothing it has
+ * worked out from the rest is thrown away. With clean, buf is what
+ * savestate_to_buffer gave at the last mem_checkpoint(), and the pages
+ * not written since aren't even compared. Packed states, short ones
+ * and ones that switch between cgb and dmg are loaded whole, and the
+ * lcd rebuilds everything, as after loadstate_from_buffer.
+ */
+int loadstate_delta(byte *buf, int len, int clean)
+{
+	BLOCKS(irl, vrl, srl);
+	int cgb = hw.cgb;
+	un32 put;
+
+	if (!dirty.track) clean = 0;
+	if (len < savestate_size() || memcmp(buf, svars[0].key, 4))
+	{
+		if (loadstate_from_buffer(buf, len)) return -1;
+		vram_dirty();
+		pal_dirty();
+		return 0;
+	}
+	if (loadhead(buf, len)) return -1;
+	if (hw.cgb != cgb || !palofs || !oamofs
+		|| !iramblock || !vramblock || !sramblock)
+	{
+		loadbody(buf, len, irl, vrl, srl);
+		vram_dirty();
+		pal_dirty();
+		return 0;
+	}
+
+	pal_restore(buf+palofs);
+	if (memcmp(lcd.oam.mem, buf+oamofs, sizeof lcd.oam))
+	{
+		memcpy(lcd.oam.mem, buf+oamofs, sizeof lcd.oam);
+		oam_dirty();
+	}
+	vram_restore(buf + (vramblock<<12), vrl, clean ? ~dirty.vram : 0);
+
+	put = putblocks(ram.ibank[0], buf, iramblock, irl,
+		clean ? ~dirty.iram : 0);
+	dirty.iram |= put;
+	hashdirty.iram |= put;
+	put = putblocks(ram.sbank[0], buf, sramblock, srl,
+		clean ? ~dirty.sram : 0);
+	dirty.sram |= put;
+	hashdirty.sram |= put;
+	dirty.sramsave |= put;
+	return 0;
+}
+
+/* nonzero if 4k block n of a state saved now is known to be unchanged
+   since the last mem_checkpoint(); the layout is the one written by
+   savestate_to_buffer */
+int savestate_clean(int n)
+{
+	BLOCKS(irl, vrl, srl);
+
+	if (!dirty.track || n < 1) return 0;
+	if (--n < irl) return !((dirty.iram >> n) & 1);
+	if ((n -= irl) < vrl) return !((dirty.vram >> n) & 1);
+	if ((n -= vrl) < srl) return !((dirty.sram >> n) & 1);
+	return 0;
+}
+
+/* the header block of a state saved now, into buf */
+static void header(byte *buf, int irl, int vrl)
 {
 	int i;
-	byte buf[4096];
-	un32 (*header)[2] = (un32 (*)[2])buf;
 	un32 d = 0;
-	int irl = hw.cgb ? 8 : 2;
-	int vrl = hw.cgb ? 4 : 2;
-	int srl = mbc.ramsize << 1;
 
 	ver = 0x105;
 	iramblock = 1;
 	vramblock = 1+irl;
 	sramblock = 1+irl+vrl;
 	wavofs = 4096 - 784;
+	sndqofs = 4096 - 784 - SNDQLEN;
 	hiofs = 4096 - 768;
 	palofs = 4096 - 512;
 	oamofs = 4096 - 256;
-	memset(buf, 0, sizeof buf);
+	memset(buf, 0, 4096);
 
 	for (i = 0; svars[i].len > 0; i++)
 	{
-		memcpy(&header[i][0], svars[i].key, 4);
+		memcpy(buf + 8*i, svars[i].key, 4);
 		switch (svars[i].len)
 		{
 		case 1:
@@ -237,43 +592,209 @@ void savestate(FILE *f)
 			d = *(un32 *)svars[i].ptr;
 			break;
 		}
-		header[i][1] = LIL(d);
+		d = LIL(d);
+		memcpy(buf + 8*i + 4, &d, 4);
 	}
-	header[i][0] = header[i][1] = 0;
 
 	memcpy(buf+hiofs, ram.hi, sizeof ram.hi);
 	memcpy(buf+palofs, lcd.pal, sizeof lcd.pal);
 	memcpy(buf+oamofs, lcd.oam.mem, sizeof lcd.oam);
 	memcpy(buf+wavofs, snd.wave, sizeof snd.wave);
-
-	fseek(f, 0, SEEK_SET);
-	fwrite(buf, 4096, 1, f);
-	
-	fseek(f, iramblock<<12, SEEK_SET);
-	fwrite(ram.ibank, 4096, irl, f);
-	
-	fseek(f, vramblock<<12, SEEK_SET);
-	fwrite(lcd.vbank, 4096, vrl, f);
-	
-	fseek(f, sramblock<<12, SEEK_SET);
-	fwrite(ram.sbank, 4096, srl, f);
+	putsndq(buf+sndqofs);
 }
 
+int savestate_to_buffer(byte *buf, int len)
+{
+	BLOCKS(irl, vrl, srl);
 
+	if (len < savestate_size()) return -1;
 
+	header(buf, irl, vrl);
+	memcpy(buf + (iramblock<<12), ram.ibank, irl<<12);
+	memcpy(buf + (vramblock<<12), lcd.vbank, vrl<<12);
+	memcpy(buf + (sramblock<<12), ram.sbank, srl<<12);
+	return (1 + irl + vrl + srl) << 12;
+}
 
+/* the most a packed state of the machine as it is now can take */
+int savestate_packsize()
+{
+	struct sect s[MAXSECT];
+	int i, n, len = ALIGN(16 + MAXSECT * DIRENT);
 
+	n = sections(s, 0);
+	for (i = 0; i < n; i++)
+		len += ALIGN(LZ_BOUND(s[i].len));
+	return len;
+}
 
+/* writes a packed state into buf; returns the bytes used, or -1 if
+   len is less than savestate_packsize() */
+int savestate_pack(byte *buf, int len)
+{
+	struct sect s[MAXSECT];
+	byte vars[4096], *d;
+	int i, n, off, flen;
+	unsigned long am = ALLOC_MARK();
+
+	if (len < savestate_packsize()) return -1;
+	n = sections(s, vars);
+	header(vars, s[5].len >> 12, s[6].len >> 12);
+	putsndq(sndq);
+	off = ALIGN(16 + n * DIRENT);
+	memset(buf, 0, off);
+	memcpy(buf, "GbS2", 4);
+	put32(buf + 4, n);
+	for (i = 0, d = buf + 16; i < n; i++, d += DIRENT)
+	{
+		flen = lz_pack(buf + off, s[i].mem, s[i].len);
+		d[20] = CHECKED | LZ;
+		if (flen >= s[i].len)
+		{
+			memcpy(buf + off, s[i].mem, flen = s[i].len);
+			d[20] = CHECKED;
+		}
+		memcpy(d, s[i].name, 4);
+		put32(d + 4, off);
+		put32(d + 8, flen);
+		put32(d + 12, s[i].len);
+		put32(d + 16, crc(buf + off, flen));
+		memset(buf + off + flen, 0, ALIGN(flen) - flen);
+		off += ALIGN(flen);
+	}
+	ALLOC_CHECK(am, "savestate_pack");
+	return off;
+}
 
+/*
+ * A 64 bit hash of the state savestate_to_buffer would save now, for
+ * telling whether two runs are still in step; equal states hash the
+ * same on any machine. It's cheap enough to take every frame: each 4k
+ * block has a hash of its own, kept between calls, and only the
+ * blocks written since the last call (see mem_hashed) and the header
+ * are hashed again, and then the table of block hashes.
+ *
+ * The hash is xxh64's loop, four independent lanes of multiply and
+ * rotate over 32 bytes at a time, which keeps the multipliers busy;
+ * a block goes through in a few hundred nanoseconds.
+ */
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define ROTL(x, n) ((x) << (n) | (x) >> (64 - (n)))
+#define ROUND(a, v) (a = ROTL(a + (v) * P2, 31) * P1)
+
+static uint64_t get64(byte *p)
+{
+#ifdef IS_LITTLE_ENDIAN
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+#else
+	return (uint64_t)(p[0] | p[1] << 8 | p[2] << 16 | (un32)p[3] << 24)
+		| (uint64_t)(p[4] | p[5] << 8 | p[6] << 16 | (un32)p[7] << 24) << 32;
+#endif
+}
 
+/* len is a multiple of 32 */
+static uint64_t hash(byte *p, int len, uint64_t seed)
+{
+	uint64_t a = seed + P1 + P2, b = seed + P2, c = seed, d = seed - P1, h;
 
+	for (; len > 0; len -= 32, p += 32)
+	{
+		ROUND(a, get64(p));
+		ROUND(b, get64(p + 8));
+		ROUND(c, get64(p + 16));
+		ROUND(d, get64(p + 24));
+	}
+	h = ROTL(a, 1) + ROTL(b, 7) + ROTL(c, 12) + ROTL(d, 18);
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
 
+static uint64_t *blockhash;
+static int nblocks;
 
+uint64_t state_hash()
+{
+	static byte head[4096];
+	/* room for the most blocks there can be: cgb, 128k of sram */
+	byte sum[8 * (1 + 8 + 4 + 32)], *p;
+	int i, n;
+	un32 bits;
+	BLOCKS(irl, vrl, srl);
+
+	n = 1 + irl + vrl + srl;
+	/* all of them, the first time and whenever the layout changes */
+	if (n != nblocks)
+	{
+		free(blockhash);
+		nblocks = (blockhash = malloc(n * sizeof *blockhash)) ? n : 0;
+		mem_alldirty();
+	}
+	header(head, irl, vrl);
+	for (i = 0; i < nblocks; i++)
+	{
+		if (!i)
+		{
+			p = head;
+			bits = 1;
+		}
+		else if (i <= irl)
+		{
+			p = ram.ibank[i - 1];
+			bits = hashdirty.iram >> (i - 1);
+		}
+		else if (i <= irl + vrl)
+		{
+			p = lcd.vbank[0] + ((i - 1 - irl) << 12);
+			bits = hashdirty.vram >> (i - 1 - irl);
+		}
+		else
+		{
+			p = ram.sbank[0] + ((i - 1 - irl - vrl) << 12);
+			bits = hashdirty.sram >> (i - 1 - irl - vrl);
+		}
+		if (bits & 1) blockhash[i] = hash(p, 4096, i);
+	}
+	mem_hashed();
+	/* the table as little endian bytes, so it hashes the same anywhere */
+	for (i = 0; i < nblocks; i++)
+		for (n = 0; n < 8; n++)
+			sum[8*i + n] = blockhash[i] >> (8*n);
+	memset(sum + 8*nblocks, 0, sizeof sum - 8*nblocks);
+	return hash(sum, (8*nblocks + 31) & ~31, nblocks);
+}
 
+void loadstate(FILE *f)
+{
+	byte *buf;
+	long len;
 
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len <= 0 || !(buf = malloc(len))) return;
+	len = fread(buf, 1, len, f);
+	loadstate_from_buffer(buf, len);
+	free(buf);
+}
 
+void savestate(FILE *f)
+{
+	int len = savestate_packsize();
+	byte *buf = malloc(len);
 
-
-
-
-
+	if (!buf) return;
+	len = savestate_pack(buf, len);
+	fseek(f, 0, SEEK_SET);
+	fwrite(buf, len, 1, f);
+	free(buf);
+}
@@ -2,9 +2,38 @@
 #define SAVE_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+#include "defs.h"
 
 void savestate(FILE *f);
 void loadstate(FILE *f);
 
+/* the same thing on a caller supplied buffer. savestate_to_buffer returns
+   the number of bytes used or -1 if len is less than savestate_size().
+   after loading, the caller must mark everything dirty just like after
+   loadstate (vram_dirty, pal_dirty, sound_dirty, mem_updatemap). */
+int savestate_size();
+int savestate_to_buffer(byte *buf, int len);
+int loadstate_from_buffer(byte *buf, int len);
+int savestate_clean(int n);
+
+/* loadstate_from_buffer for a state the machine is mostly in already:
+   only what differs is copied and marked dirty, and the vram and
+   palette caches are brought up to date here, so the caller only does
+   sound_dirty and mem_updatemap. with clean, buf was saved at the
+   last mem_checkpoint(); see save.c */
+int loadstate_delta(byte *buf, int len, int clean);
+
+/* the packed format savestate writes, smaller and quicker to load;
+   loadstate_from_buffer takes either. savestate_pack returns the bytes
+   used, or -1 if len is less than savestate_packsize() */
+int savestate_packsize();
+int savestate_pack(byte *buf, int len);
+
+/* a hash of what a state saved now would hold, cheap enough to take
+   every frame; see save.c */
+uint64_t state_hash();
+
 #endif
 
@@ -0,0 +1,166 @@
+/*
+ * scaler.c
+ *
+ * xBR, a smoothing scaler for pixel art, for front ends that show the
+ * picture bigger than the core draws it. Each of a pixel's four
+ * corners is looked at in turn: where the colors along the diagonal
+ * through it differ less than those across it, there's an edge, and
+ * the pixels of the corner that are past it take the color of the
+ * neighbor on the far side, or half of it where the edge only cuts
+ * them through the middle. Everywhere else a pixel is simply copied
+ * n times each way, as refresh does.
+ *
+ * Colors are compared in yuv, worked out once per pixel into planes
+ * with two pixels of the picture's edge repeated on every side, so
+ * that finding the edges is plain arithmetic with nothing to test.
+ * The distance is xBR's, with its weights of 48, 7 and 6 for y, u and
+ * v rounded to 6, 1 and 1, so a sum of eight of them fits in 16 bits
+ * and the sse2 and neon scaler_edges in asm/simd do eight pixels at
+ * once.
+ *
+ * It's run after a frame is finished, not a line at a time, since
+ * every row needs the two below it. A band of rows depends on nothing
+ * but the picture, so a front end can split a frame among threads,
+ * each with its own scratch; see sys/sdl2.
+ */
+
+#include <stdlib.h>
+
+#include "defs.h"
+#include "scaler.h"
+#ifdef USE_ASM
+#include "asm.h"
+#endif
+
+#define W 160
+#define H 144
+/* a plane row: 2 pixels of edge either side, and room for the last
+   vector's loads */
+#define STRIDE 168
+#define PLANE (148 * STRIDE)
+
+static void toyuv(un16 *y, un16 *u, un16 *v, un32 *s)
+{
+	int x, r, g, b;
+	un32 c;
+
+	for (x = -2; x < W + 2; x++)
+	{
+		c = s[x < 0 ? 0 : x >= W ? W - 1 : x];
+		r = (c >> 16) & 255;
+		g = (c >> 8) & 255;
+		b = c & 255;
+		y[x] = (r * 77 + g * 150 + b * 29) >> 8;
+		u[x] = (b * 128 - r * 43 - g * 85 + 32768) >> 8;
+		v[x] = (r * 128 - g * 107 - b * 21 + 32768) >> 8;
+	}
+}
+
+#ifndef ASM_SCALER_EDGES
+
+#define D(a, b) (6 * abs(y[a] - y[b]) + abs(u[a] - u[b]) + abs(v[a] - v[b]))
+
+/* the corner towards dx and dy, in its own terms as though it were
+   the bottom right one: 0 for no edge, 1 for an edge whose color
+   comes from the side, 0x11 for one whose color comes from below */
+static int corner(un16 *y, un16 *u, un16 *v, int dx, int dy)
+{
+	int e, i, df, dh;
+
+	df = D(0, dx);
+	dh = D(0, dy);
+	if (!df || !dh) return 0;
+	e = D(0, dx - dy) + D(0, dy - dx) + D(dx + dy, 2 * dy)
+		+ D(dx + dy, 2 * dx) + 4 * D(dy, dx);
+	i = D(dy, -dx) + D(dy, dx + 2 * dy) + D(dx, 2 * dx + dy)
+		+ D(dx, -dy) + 4 * D(0, dx + dy);
+	return e >= i ? 0 : df > dh ? 0x11 : 1;
+}
+
+/* bit k of a pixel's flags is an edge at corner k, 0 top left, 1 top
+   right, 2 bottom left, 3 bottom right; bit 4+k says it takes its
+   color from above or below rather than from the side */
+void scaler_edges(byte *flags, un16 *y, un16 *u, un16 *v, int stride)
+{
+	int x;
+
+	for (x = 0; x < W; x++, y++, u++, v++)
+		flags[x] = corner(y, u, v, -1, -stride)
+			| corner(y, u, v, 1, -stride) << 1
+			| corner(y, u, v, -1, stride) << 2
+			| corner(y, u, v, 1, stride) << 3;
+}
+
+#endif /* ASM_SCALER_EDGES */
+
+static un32 mix(un32 a, un32 b)
+{
+	return ((a & 0xfefefefe) >> 1) + ((b & 0xfefefefe) >> 1);
+}
+
+void scaler_band(void *dest, int dpitch, void *src, int spitch,
+	int n, int y0, int y1, un16 *tmp)
+{
+	un16 *y = tmp, *u = tmp + PLANE, *v = tmp + 2 * PLANE;
+	byte wt[16], flags[W];
+	int r, x, i, j, k, w, f, o, dp = dpitch / 4;
+	un32 *s, *up, *down, *d, c, px;
+
+	/* for each of the n*n pixels a pixel becomes, the corner it's in
+	   shifted up 2, and how much of it is past an edge there, 1 for
+	   half and 2 for all */
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+		{
+			w = abs(2 * j + 1 - n) + abs(2 * i + 1 - n) - n + 1;
+			if (w > 2) w = 2;
+			wt[i * n + j] = w <= 0 ? 0
+				: w | (2 * j + 1 > n) << 2 | (2 * i + 1 > n) << 3;
+		}
+
+	for (r = y0 - 2; r < y1 + 2; r++)
+	{
+		o = (r - y0 + 2) * STRIDE + 2;
+		k = r < 0 ? 0 : r >= H ? H - 1 : r;
+		toyuv(y + o, u + o, v + o, (un32 *)((byte *)src + k * spitch));
+	}
+
+	for (r = y0; r < y1; r++)
+	{
+		o = (r - y0 + 2) * STRIDE + 2;
+		scaler_edges(flags, y + o, u + o, v + o, STRIDE);
+		s = (un32 *)((byte *)src + r * spitch);
+		up = r ? (un32 *)((byte *)s - spitch) : s;
+		down = r < H - 1 ? (un32 *)((byte *)s + spitch) : s;
+		d = (un32 *)((byte *)dest + r * n * dpitch);
+		for (x = 0; x < W; x++, d += n)
+		{
+			c = s[x];
+			if (!(f = flags[x]))
+			{
+				for (i = 0; i < n; i++)
+					for (j = 0; j < n; j++)
+						d[i * dp + j] = c;
+				continue;
+			}
+			for (i = 0; i < n; i++)
+				for (j = 0; j < n; j++)
+				{
+					w = wt[i * n + j];
+					k = w >> 2;
+					px = c;
+					if ((w & 3) && (f >> k & 1))
+					{
+						if (f >> k & 16)
+							px = k & 2 ? down[x] : up[x];
+						else if (k & 1)
+							px = s[x < W - 1 ? x + 1 : x];
+						else
+							px = s[x ? x - 1 : x];
+						if ((w & 3) == 1) px = mix(c, px);
+					}
+					d[i * dp + j] = px;
+				}
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include "defs.h"
+
+/* un16s of scratch scaler_band needs, enough for a whole frame */
+#define SCALER_TMP (3 * 148 * 168)
+
+/* rows y0 to y1 of a 160x144 picture of 0xrrggbb ints, smoothed with
+   xbr at n times, 2 to 4, into dest; spitch and dpitch are in bytes.
+   Bands of one picture can go to different threads, each with its
+   own tmp */
+void scaler_band(void *dest, int dpitch, void *src, int spitch,
+	int n, int y0, int y1, un16 *tmp);
+
+/* the edges found around each of a row's 160 pixels, from the yuv
+   planes at that row; see scaler.c */
+void scaler_edges(byte *flags, un16 *y, un16 *u, un16 *v, int stride);
+
+#endif
@@ -15,6 +15,7 @@
 
 #include "rc.h"
 #include "pcm.h"
+#include "emu.h"
 
 
 struct pcm pcm;
@@ -22,16 +23,39 @@ struct pcm pcm;
 static int sound = 1;
 static int samplerate = 44100;
 static int stereo = 1;
+static int bits = 16;
 static SDL_AudioDeviceID device;
 static int paused;
 static int threaded;
-static volatile int audio_done;
+static int latency = 40;
+static int underruns, overruns;
+static int drc;
+
+/* the most rate control will stretch or shrink a sample, in 65536ths;
+   328 is half a percent, too little to hear as a change in pitch */
+#define DRC_MAX 328
+
+/*
+ * In threaded mode pcm_submit and the audio callback share a single
+ * producer, single consumer ring. rd and wr count bytes ever read and
+ * written; each side only ever stores its own, so no lock is needed,
+ * and the difference is how much is queued. pcm_submit waits while
+ * more than "latency" ms worth is queued, which is what paces us.
+ */
+static byte *ring, silence;
+static unsigned ringmask, target;
+static SDL_atomic_t rd, wr;
 
 rcvar_t pcm_exports[] =
 {
 	RCV_BOOL("sound", &sound, "enable sound"),
 	RCV_BOOL("sound_threaded", &threaded, "use threaded sound"),
+	RCV_INT("sound_latency", &latency, "threaded sound buffering in ms"),
+	RCV_INT("sound_underruns", &underruns, "times threaded sound ran dry"),
+	RCV_INT("sound_overruns", &overruns, "times threaded sound had to drop data"),
+	RCV_BOOL("sound_drc", &drc, "pace by the clock, keep threaded sound in step by rate control"),
 	RCV_INT("stereo", &stereo, "enable stereo"),
+	RCV_INT("sound_bits", &bits, "sample size, 8 or 16"),
 	RCV_INT("samplerate", &samplerate, "samplerate, recommended: 32768"),
 	RCV_END
 };
@@ -39,22 +63,72 @@ rcvar_t pcm_exports[] =
 
 static void audio_callback(void *blah, byte *stream, int len)
 {
-	memcpy(stream, pcm.buf, len);
-	audio_done = 1;
+	static int pinned;
+	unsigned r = SDL_AtomicGet(&rd), n, i;
+
+	/* SDL's audio thread is only ours to touch from in here */
+	if (!pinned) emu_pin(PIN_AUDIO);
+	pinned = 1;
+	n = (unsigned)SDL_AtomicGet(&wr) - r;
+	if (n < (unsigned)len)
+	{
+		memset(stream + n, silence, len - n);
+		underruns++;
+		len = n;
+	}
+	i = r & ringmask;
+	n = ringmask + 1 - i;
+	if (n > (unsigned)len) n = len;
+	memcpy(stream, ring + i, n);
+	memcpy(stream + n, ring, len - n);
+	SDL_AtomicSet(&rd, r + len);
+}
+
+/* queue len bytes from buf, dropping what doesn't fit */
+static void ring_put(byte *buf, unsigned len)
+{
+	unsigned w = SDL_AtomicGet(&wr), n, i;
+
+	n = ringmask + 1 - (w - (unsigned)SDL_AtomicGet(&rd));
+	if (len > n)
+	{
+		overruns++;
+		len = n;
+	}
+	i = w & ringmask;
+	n = ringmask + 1 - i;
+	if (n > len) n = len;
+	memcpy(ring + i, buf, n);
+	memcpy(ring, buf + n, len - n);
+	SDL_AtomicSet(&wr, w + len);
+}
+
+static unsigned ring_used()
+{
+	return (unsigned)SDL_AtomicGet(&wr) - (unsigned)SDL_AtomicGet(&rd);
+}
+
+/* n bytes of sound in us */
+static int bytes_us(unsigned n)
+{
+	return n * 1000000LL / (pcm.hz * (pcm.stereo + 1) * (pcm.bits / 8));
 }
 
 void pcm_init()
 {
 	int i;
+	unsigned n;
 	SDL_AudioSpec as = {0}, ob;
 
 	if (!sound) return;
+	if (latency < 1) latency = 1;
 
 	SDL_InitSubSystem(SDL_INIT_AUDIO);
 	as.freq = samplerate;
-	as.format = AUDIO_U8;
+	as.format = bits == 16 ? AUDIO_S16SYS : AUDIO_U8;
 	as.channels = 1 + stereo;
-	as.samples = samplerate / 60;
+	/* in threaded mode the callback comes about twice per latency */
+	as.samples = threaded ? samplerate * latency / 2000 : samplerate / 60;
 	as.userdata = 0;
 	for (i = 1; i < as.samples; i<<=1);
 	as.samples = i;
@@ -66,13 +140,36 @@ void pcm_init()
 	}
 	pcm.hz = ob.freq;
 	pcm.stereo = ob.channels - 1;
+	pcm.bits = bits == 16 ? 16 : 8;
 	pcm.len = ob.size;
 	pcm.buf = malloc(pcm.len);
 	pcm.pos = 0;
 	memset(pcm.buf, 0, pcm.len);
+	if (threaded)
+	{
+		silence = ob.silence;
+		target = ob.freq * ob.channels * (pcm.bits / 8) / 1000 * latency;
+		if (target < ob.size) target = ob.size;
+		for (n = 1; n < target + 2 * ob.size; n <<= 1);
+		if (!(ring = malloc(n))) {
+			SDL_CloseAudioDevice(device);
+			sound = 0;
+			return;
+		}
+		ringmask = n - 1;
+		SDL_AtomicSet(&rd, 0);
+		SDL_AtomicSet(&wr, 0);
+	}
 	SDL_PauseAudioDevice(device, 0);
 }
 
+int pcm_queued()
+{
+	if (!sound || !device || paused) return -1;
+	if (threaded) return bytes_us(ring_used());
+	return bytes_us(SDL_GetQueuedAudioSize(device));
+}
+
 int pcm_submit()
 {
 	int res, min;
@@ -80,11 +177,36 @@ int pcm_submit()
 		pcm.pos = 0;
 		return 0;
 	}
+	if (pcm.clocked) {
+		pcm.drc = 0;
+		if (threaded) ring_put(pcm.buf, pcm.pos);
+		else SDL_QueueAudio(device, pcm.buf, pcm.pos);
+		pcm.pos = 0;
+		pcm.fill = pcm_queued();
+		return 1;
+	}
+	if(threaded && drc) {
+		ring_put(pcm.buf, pcm.pos);
+		pcm.pos = 0;
+		pcm.fill = bytes_us(ring_used());
+		pcm.drc = 1;
+		/* steer the fill towards target, smoothed since it moves in
+		   whole callbacks */
+		res = ((int)ring_used() - (int)target) * DRC_MAX / (int)target;
+		if (res > DRC_MAX) res = DRC_MAX;
+		if (res < -DRC_MAX) res = -DRC_MAX;
+		pcm.skew += (res - pcm.skew) / 8;
+		return 0;
+	}
+	pcm.drc = 0;
 	if(threaded) {
-		if(pcm.pos < pcm.len) return 1;
-		while(!audio_done) SDL_Delay(4);
-		audio_done = 0;
+		/* give up after a quarter second rather than hang on a
+		   device that stopped asking for data */
+		for (min = 0; ring_used() > target && min < 250; min++)
+			SDL_Delay(1);
+		ring_put(pcm.buf, pcm.pos);
 		pcm.pos = 0;
+		pcm.fill = bytes_us(ring_used());
 		return 1;
 	}
 	min = pcm.len*2;
@@ -92,12 +214,15 @@ int pcm_submit()
 	pcm.pos = 0;
 	while (res && SDL_GetQueuedAudioSize(device) > min)
 		SDL_Delay(1);
+	pcm.fill = bytes_us(SDL_GetQueuedAudioSize(device));
 	return res;
 }
 
 void pcm_close()
 {
 	if (sound) SDL_CloseAudioDevice(device);
+	free(ring);
+	ring = 0;
 }
 
 void pcm_pause(int dopause)
@@ -4,6 +4,7 @@
 
 #include "input.h"
 #include "rc.h"
+#include "sys.h"
 
 enum joyaxis { JA_X=0, JA_Y };
 enum joyaxisvalue {
@@ -11,18 +12,27 @@ enum joyaxisvalue {
 };
 
 
+/* a stick counts as pushed past this, and as let go again only once
+   it's back within half of it, so one resting near the edge doesn't
+   flicker on and off */
 #define JOY_COMMIT_RANGE 3276
 
 static int use_joy = 1, sdl_joy_num;
 static SDL_Joystick * sdl_joy = NULL;
 static unsigned char Xstatus, Ystatus;
+static int joyrate;
+static SDL_Thread *reader;
+static SDL_atomic_t quit;
 
 rcvar_t joy_exports[] =
 {
 	RCV_BOOL("joy", &use_joy, "enable joystick"),
+	RCV_INT("joy_rate", &joyrate, "read the joystick in a thread this many times a second, 0 = with the other events"),
 	RCV_END
 };
 
+static int joy_thread(void *arg);
+
 void joy_init()
 {
 	int i;
@@ -52,11 +62,28 @@ void joy_init()
 		}
 	}
 
+	if (!sdl_joy) return;
+	if (joyrate > 1000) joyrate = 1000;
+	if (joyrate > 0)
+	{
+		/* the thread does all the reading, so SDL's event pump
+		   mustn't */
+		SDL_JoystickEventState(SDL_IGNORE);
+		SDL_AtomicSet(&quit, 0);
+		if ((reader = SDL_CreateThread(joy_thread, "joy", 0)))
+			return;
+	}
 	/* make sure that Joystick event polling is a go */
 	SDL_JoystickEventState(SDL_ENABLE);
 }
 
-void joy_close() {}
+void joy_close()
+{
+	if (!reader) return;
+	SDL_AtomicSet(&quit, 1);
+	SDL_WaitThread(reader, 0);
+	reader = 0;
+}
 
 static void joyaxis_evt(enum joyaxis axis, enum joyaxisvalue newstate)
 {
@@ -83,65 +110,106 @@ static void joyaxis_evt(enum joyaxis axis, enum joyaxisvalue newstate)
 	}
 }
 
+static void joyaxis_value(enum joyaxis axis, int v)
+{
+	int now = axis == JA_X ? Xstatus : Ystatus;
+
+	if (v > JOY_COMMIT_RANGE)
+		joyaxis_evt(axis, JAV_RIGHT_OR_DOWN);
+	else if (v < -JOY_COMMIT_RANGE)
+		joyaxis_evt(axis, JAV_LEFT_OR_UP);
+	else if (!(now == JAV_RIGHT_OR_DOWN && v >= JOY_COMMIT_RANGE / 2)
+		&& !(now == JAV_LEFT_OR_UP && v <= -JOY_COMMIT_RANGE / 2))
+		joyaxis_evt(axis, JAV_CENTERED);
+}
+
+static void joyhat_evt(int value)
+{
+	switch (value) {
+	case SDL_HAT_LEFTUP:
+		joyaxis_evt(JA_X, JAV_LEFT_OR_UP);
+		joyaxis_evt(JA_Y, JAV_LEFT_OR_UP);
+		break;
+	case SDL_HAT_UP:
+		joyaxis_evt(JA_Y, JAV_LEFT_OR_UP);
+		break;
+	case SDL_HAT_RIGHTUP:
+		joyaxis_evt(JA_X, JAV_RIGHT_OR_DOWN);
+		joyaxis_evt(JA_Y, JAV_LEFT_OR_UP);
+		break;
+	case SDL_HAT_LEFT:
+		joyaxis_evt(JA_X, JAV_LEFT_OR_UP);
+		break;
+	case SDL_HAT_CENTERED:
+		joyaxis_evt(JA_X, JAV_CENTERED);
+		joyaxis_evt(JA_Y, JAV_CENTERED);
+		break;
+	case SDL_HAT_RIGHT:
+		joyaxis_evt(JA_X, JAV_RIGHT_OR_DOWN);
+		break;
+	case SDL_HAT_LEFTDOWN:
+		joyaxis_evt(JA_X, JAV_LEFT_OR_UP);
+		joyaxis_evt(JA_Y, JAV_RIGHT_OR_DOWN);
+		break;
+	case SDL_HAT_DOWN:
+		joyaxis_evt(JA_Y, JAV_RIGHT_OR_DOWN);
+		break;
+	case SDL_HAT_RIGHTDOWN:
+		joyaxis_evt(JA_X, JAV_RIGHT_OR_DOWN);
+		joyaxis_evt(JA_Y, JAV_RIGHT_OR_DOWN);
+		break;
+	}
+}
+
+/* with joy_rate, the stick, hat and buttons are read here as often as
+   that and each change posted as it's seen, stamped with when that
+   was, rather than waiting for the emulator's next ev_poll; for
+   timedinput that's nearer to when it really happened. SDL locks
+   its joysticks while they're updated, so this is safe alongside
+   the event pump, which leaves them alone */
+static int joy_thread(void *arg)
+{
+	int i, b, hat = SDL_HAT_CENTERED, h, v, axis[2] = { 0, 0 };
+	Uint16 was = 0;
+	event_t ev;
+
+	while (!SDL_AtomicGet(&quit))
+	{
+		SDL_JoystickUpdate();
+		/* only on a change, as with events, so a stick left alone
+		   doesn't undo the hat */
+		for (i = 0; i < 2; i++)
+			if ((v = SDL_JoystickGetAxis(sdl_joy, i)) != axis[i])
+				joyaxis_value(i ? JA_Y : JA_X, axis[i] = v);
+		if (SDL_JoystickNumHats(sdl_joy) > 0
+			&& (h = SDL_JoystickGetHat(sdl_joy, 0)) != hat)
+			joyhat_evt(hat = h);
+		for (i = 0; i < 16 && i < SDL_JoystickNumButtons(sdl_joy); i++)
+		{
+			b = SDL_JoystickGetButton(sdl_joy, i) != 0;
+			if (b == ((was >> i) & 1)) continue;
+			was ^= 1 << i;
+			ev.type = b ? EV_PRESS : EV_RELEASE;
+			ev.code = K_JOY0 + i;
+			ev_postevent(&ev);
+		}
+		sys_nap(1000000 / joyrate);
+	}
+	return 0;
+}
+
 void sdljoy_process_event(SDL_Event *event)
 {
-	enum joyaxis ja;
 	event_t ev;
 
 	switch(event->type) {
 	case SDL_JOYHATMOTION:
-		switch (event->jhat.value) {
-		case SDL_HAT_LEFTUP:
-			joyaxis_evt(JA_X, JAV_LEFT_OR_UP);
-			joyaxis_evt(JA_Y, JAV_LEFT_OR_UP);
-			break;
-		case SDL_HAT_UP:
-			joyaxis_evt(JA_Y, JAV_LEFT_OR_UP);
-			break;
-		case SDL_HAT_RIGHTUP:
-			joyaxis_evt(JA_X, JAV_RIGHT_OR_DOWN);
-			joyaxis_evt(JA_Y, JAV_LEFT_OR_UP);
-			break;
-		case SDL_HAT_LEFT:
-			joyaxis_evt(JA_X, JAV_LEFT_OR_UP);
-			break;
-		case SDL_HAT_CENTERED:
-			joyaxis_evt(JA_X, JAV_CENTERED);
-			joyaxis_evt(JA_Y, JAV_CENTERED);
-			break;
-		case SDL_HAT_RIGHT:
-			joyaxis_evt(JA_X, JAV_RIGHT_OR_DOWN);
-			break;
-		case SDL_HAT_LEFTDOWN:
-			joyaxis_evt(JA_X, JAV_LEFT_OR_UP);
-			joyaxis_evt(JA_Y, JAV_RIGHT_OR_DOWN);
-			break;
-		case SDL_HAT_DOWN:
-			joyaxis_evt(JA_Y, JAV_RIGHT_OR_DOWN);
-			break;
-		case SDL_HAT_RIGHTDOWN:
-			joyaxis_evt(JA_X, JAV_RIGHT_OR_DOWN);
-			joyaxis_evt(JA_Y, JAV_RIGHT_OR_DOWN);
-			break;
-		}
+		joyhat_evt(event->jhat.value);
 		break;
 	/* case SDL_CONTROLLERAXISMOTION: */
 	case SDL_JOYAXISMOTION:
-		ja = JA_Y;
-		switch (event->jaxis.axis & 1)
-		{
-		case 0:
-			ja = JA_X;
-			/* fall-through */
-		case 1:
-			if (event->jaxis.value > JOY_COMMIT_RANGE)
-				joyaxis_evt(ja, JAV_RIGHT_OR_DOWN);
-			else if (event->jaxis.value < -JOY_COMMIT_RANGE)
-				joyaxis_evt(ja, JAV_LEFT_OR_UP);
-			else
-				joyaxis_evt(ja, JAV_CENTERED);
-			break;
-		}
+		joyaxis_value(event->jaxis.axis & 1 ? JA_Y : JA_X,
+			event->jaxis.value);
 		break;
 	case SDL_JOYBUTTONUP:
 		if (event->jbutton.button>15) break;
@@ -10,6 +10,18 @@
 #include "rc.h"
 #include "noise.h"
 #include "sys.h"
+#include "bench.h"
+#include "timeline.h"
+#include "capture.h"
+#include "emu.h"
+
+#ifdef __ATOMIC_ACQUIRE
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD(p) (*(p))
+#define STORE(p, v) (*(p) = (v))
+#endif
 
 const static byte dmgwave[16] =
 {
@@ -47,7 +59,14 @@ const static int freqtab[8] =
 	(1<<14)/7
 };
 
-struct snd snd;
+MACHINE struct snd snd;
+
+/* the channel at a time mixer in newsound.h is the one used; -DOLDSOUND
+   brings back the sample at a time loop below, which it should match
+   sample for sample */
+#ifndef OLDSOUND
+#define NEWSOUND
+#endif
 
 #define RATE (snd.rate)
 #define WAVE (snd.wave) /* ram.hi+0x30 */
@@ -56,8 +75,24 @@ struct snd snd;
 #define S3 (snd.ch[2])
 #define S4 (snd.ch[3])
 
+/* what the mixer spends on the samples, SQ_* in sound.h; an -DOLDSOUND
+   build only tells off from the rest */
+static int soundquality = SQ_STANDARD;
+
+#ifdef NEWSOUND
+static int bandlimit, soundthread; /* see newsound.h */
+static int threaded;
+static void collect();
+static void stopsynth();
+#endif
+
 rcvar_t sound_exports[] =
 {
+	RCV_INT("soundquality", &soundquality, "0 = off, 1 = fast, 2 = standard, 3 = high"),
+#ifdef NEWSOUND
+	RCV_BOOL("bandlimit", &bandlimit, "average each sample over its period, less aliasing"),
+	RCV_BOOL("soundthread", &soundthread, "draw the waveforms in a thread of their own"),
+#endif
 	RCV_END
 };
 
@@ -145,11 +180,18 @@ void sound_off()
 	sound_dirty();
 }
 
+/* with no sound device the registers still have to behave, so keep
+   time as if at 44100 Hz; see sound_skip. called again when the device
+   is opened after the reset */
+void sound_setrate()
+{
+	snd.rate = (1<<21) / (pcm.hz ? pcm.hz : 44100);
+}
+
 void sound_reset()
 {
 	memset(&snd, 0, sizeof snd);
-	if (pcm.hz) snd.rate = (1<<21) / pcm.hz;
-	else snd.rate = 0;
+	sound_setrate();
 	memcpy(WAVE, hw.cgb ? cgbwave : dmgwave, 16);
 	memcpy(ram.hi+0x30, WAVE, 16);
 	sound_off();
@@ -157,13 +199,221 @@ void sound_reset()
 }
 
 
-void sound_mix()
+/* how many samples are due, taking the cycles they cover off cpu.snd;
+   see pcm.drc. sndfrac is the fraction of a cycle, in 65536ths, that
+   the last one ran over */
+static int sndfrac;
+
+#ifndef NEWSOUND
+/* one sample for pcm.bits == 16; l and r are already at full scale,
+   which the channels can't exceed, so there is nothing to clamp */
+static void put16(int l, int r)
+{
+	n16 *p;
+
+	if (pcm.pos >= pcm.len)
+	{
+		capture_pcm();
+		pcm_submit();
+	}
+	p = (n16 *)(pcm.buf + pcm.pos);
+	if (pcm.stereo)
+	{
+		p[0] = l;
+		p[1] = r;
+		pcm.pos += 4;
+	}
+	else
+	{
+		p[0] = (l+r)>>1;
+		pcm.pos += 2;
+	}
+}
+#endif
+
+static int samples()
+{
+	un32 p;
+	int n, c;
+
+	if (!pcm.drc || !pcm.hz)
+	{
+		n = cpu.snd / RATE;
+		cpu.snd -= n * RATE;
+		return n;
+	}
+	p = ((un32)RATE << 16) + ((((un32)1 << 21) % pcm.hz) << 16) / pcm.hz;
+	p += ((int)(p >> 8) * pcm.skew) >> 8;
+	for (n = 0;; n++)
+	{
+		c = (sndfrac + p) >> 16;
+		if (cpu.snd < c) break;
+		cpu.snd -= c;
+		sndfrac += p - (c << 16);
+	}
+	return n;
+}
+
+/* how many samples, at most n, until a counter that grows by RATE
+   every sample reaches lim */
+static int until(int cnt, int lim, int n)
 {
-	int s, l, r, f, n;
+	int k;
+
+	if (cnt + RATE >= lim) return 1;
+	k = (lim - cnt + RATE - 1) / RATE;
+	return k < n ? k : n;
+}
+
+static int nextevent(int n)
+{
+	if (S1.on)
+	{
+		if (R_NR14 & 64) n = until(S1.cnt, S1.len, n);
+		if (S1.enlen) n = until(S1.encnt, S1.enlen, n);
+		if (S1.swlen) n = until(S1.swcnt, S1.swlen, n);
+	}
+	if (S2.on)
+	{
+		if (R_NR24 & 64) n = until(S2.cnt, S2.len, n);
+		if (S2.enlen) n = until(S2.encnt, S2.enlen, n);
+	}
+	if (S3.on && (R_NR34 & 64))
+		n = until(S3.cnt, S3.len, n);
+	if (S4.on)
+	{
+		if (R_NR44 & 64) n = until(S4.cnt, S4.len, n);
+		if (S4.enlen) n = until(S4.encnt, S4.enlen, n);
+	}
+	return n;
+}
+
+/* the events; t is RATE times the number of samples just rendered,
+   which nextevent made sure is never past the first one due */
+
+static void envelope(struct sndchan *c, int t)
+{
+	if (!c->enlen || (c->encnt += t) < c->enlen) return;
+	c->encnt -= c->enlen;
+	c->envol += c->endir;
+	if (c->envol < 0) c->envol = 0;
+	if (c->envol > 15) c->envol = 15;
+}
+
+static void sweep(int t)
+{
+	int f, n;
+
+	if (!S1.swlen || (S1.swcnt += t) < S1.swlen) return;
+	S1.swcnt -= S1.swlen;
+	f = S1.swfreq;
+	n = (R_NR10 & 7);
+	if (R_NR10 & 8) f -= (f >> n);
+	else f += (f >> n);
+	if (f > 2047)
+		S1.on = 0;
+	else
+	{
+		S1.swfreq = f;
+		R_NR13 = f;
+		R_NR14 = (R_NR14 & 0xF8) | (f>>8);
+		s1_freq_d(2048 - f);
+	}
+}
+
+static void events(int n)
+{
+	int t = n * RATE;
+
+	if (S1.on)
+	{
+		if ((R_NR14 & 64) && ((S1.cnt += t) >= S1.len))
+			S1.on = 0;
+		envelope(&S1, t);
+		sweep(t);
+	}
+	if (S2.on)
+	{
+		if ((R_NR24 & 64) && ((S2.cnt += t) >= S2.len))
+			S2.on = 0;
+		envelope(&S2, t);
+	}
+	if (S3.on)
+	{
+		if ((R_NR34 & 64) && ((S3.cnt += t) >= S3.len))
+			S3.on = 0;
+	}
+	if (S4.on)
+	{
+		if ((R_NR44 & 64) && ((S4.cnt += t) >= S4.len))
+			S4.on = 0;
+		envelope(&S4, t);
+	}
+}
+
+/* with nowhere to send samples, only the channel state has to move
+   on; the counters jump from one event to the next and nothing is
+   rendered, so it costs next to nothing however many samples pass */
+static void sound_skip(int n)
+{
+	int k;
+
+	for (; n; n -= k)
+	{
+		k = nextevent(n);
+		if (S1.on) S1.pos += S1.freq * k;
+		if (S2.on) S2.pos += S2.freq * k;
+		if (S3.on) S3.pos += S3.freq * k;
+		if (S4.on) S4.pos += S4.freq * k;
+		events(k);
+	}
+}
+
+/* n samples of nothing into pcm.buf, for soundquality off: the
+   device and capture still get their samples on time */
+static void silence(int n)
+{
+	int k, size = (pcm.bits == 16 ? 2 : 1) * (pcm.stereo ? 2 : 1);
+
+	if (!pcm.buf) return;
+	for (; n; n -= k)
+	{
+		if (pcm.pos >= pcm.len)
+		{
+			capture_pcm();
+			pcm_submit();
+		}
+		k = (pcm.len - pcm.pos) / size;
+		if (k < 1) k = 1;
+		if (k > n) k = n;
+		memset(pcm.buf + pcm.pos, pcm.bits == 16 ? 0 : 128, k * size);
+		pcm.pos += k * size;
+	}
+}
+
+int sound_quality(int q)
+{
+	int was = soundquality;
+
+	if (q >= 0) soundquality = q;
+	return was;
+}
+
+#ifdef NEWSOUND
+#include "newsound.h"
+#else
+static void render()
+{
+	int s, l, r, f, n, cnt, was = bench_in;
 
 	if (!RATE || cpu.snd < RATE) return;
+	bench_in = BENCH_SOUND;
+	TL_BEGIN(TL_MIX);
 
-	for (; cpu.snd >= RATE; cpu.snd -= RATE)
+	cnt = samples();
+	if (!pcm.buf || soundquality <= SQ_OFF)
+		sound_skip(cnt), silence(cnt), cnt = 0;
+	for (; cnt; cnt--)
 	{
 		l = r = 0;
 
@@ -259,6 +509,11 @@ void sound_mix()
 		
 		l *= (R_NR50 & 0x07);
 		r *= ((R_NR50 & 0x70)>>4);
+		if (pcm.bits == 16)
+		{
+			if (pcm.buf) put16(l << 4, r << 4);
+			continue;
+		}
 		l >>= 4;
 		r >>= 4;
 		
@@ -270,7 +525,10 @@ void sound_mix()
 		if (pcm.buf)
 		{
 			if (pcm.pos >= pcm.len)
+			{
+				capture_pcm();
 				pcm_submit();
+			}
 			if (pcm.stereo)
 			{
 				pcm.buf[pcm.pos++] = l+128;
@@ -280,9 +538,53 @@ void sound_mix()
 		}
 	}
 	R_NR52 = (R_NR52&0xf0) | S1.on | (S2.on<<1) | (S3.on<<2) | (S4.on<<3);
+	TL_END(TL_MIX);
+	bench_in = was;
 }
+#endif
+
+
+
+/*
+ * Sound register writes don't render the samples up to them there and
+ * then. Music drivers write dozens of them a frame, each of which
+ * would otherwise start the mixer for a handful of samples; instead
+ * sound_write queues them with the time they were made at, and
+ * sound_mix, called once a frame (or sooner if the queue fills up or
+ * a register is read back), renders up to each in turn, applies it
+ * and carries on, so the samples come out exactly as if every write
+ * had been mixed up to on the spot. Anything that looks at the sound
+ * state from outside has to call sound_mix first; saving a state does.
+ */
+
+static void apply(byte r, byte b);
+
+void sound_mix()
+{
+	int i, t, done = 0, end = cpu.snd;
 
+	for (i = 0; i < snd.nq; i++)
+	{
+		t = snd.q[i].t;
+		cpu.snd = t - done;
+		render();
+		done = t - cpu.snd;
+		apply(snd.q[i].r, snd.q[i].b);
+	}
+	snd.nq = 0;
+	cpu.snd = end - done;
+	render();
+#ifdef NEWSOUND
+	if (threaded > 0) collect();
+#endif
+}
 
+void sound_close()
+{
+#ifdef NEWSOUND
+	stopsynth();
+#endif
+}
 
 byte sound_read(byte r)
 {
@@ -347,16 +649,24 @@ void sound_write(byte r, byte b)
 	if (!timer) timer = sys_timer();
 	printf("write %02X: %02X @ %d\n", r, b, sys_elapsed(timer));
 #endif
-	
+
+	if (snd.nq == SNDQUEUE) sound_mix();
+	snd.q[snd.nq].t = cpu.snd;
+	snd.q[snd.nq].r = r;
+	snd.q[snd.nq].b = b;
+	snd.nq++;
+}
+
+/* a queued write, once everything before it has been rendered */
+static void apply(byte r, byte b)
+{
 	if (!(R_NR52 & 128) && r != RI_NR52) return;
 	if ((r & 0xF0) == 0x30)
 	{
-		if (S3.on) sound_mix();
 		if (!S3.on)
 			WAVE[r-0x30] = ram.hi[r] = b;
 		return;
 	}
-	sound_mix();
 	switch (r)
 	{
 	case RI_NR10:
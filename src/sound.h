@@ -16,11 +16,24 @@ struct sndchan
 };
 
 
+/* a register write sound_write has held back; t is what cpu.snd was
+   when it was made, i.e. how far into the samples still to render it
+   takes effect */
+struct sndwrite
+{
+	int t;
+	byte r, b;
+};
+
+#define SNDQUEUE 64
+
 struct snd
 {
 	int rate;
 	struct sndchan ch[4];
 	byte wave[16];
+	int nq;
+	struct sndwrite q[SNDQUEUE];
 };
 
 
@@ -33,12 +46,27 @@ byte sound_read(byte r);
 void sound_dirty();
 void sound_off();
 void sound_reset();
+void sound_setrate();
 void sound_mix();
+/* at exit, before pcm_close: sound still being drawn (soundthread)
+   is finished and submitted */
+void sound_close();
 void s1_init();
 void s2_init();
 void s3_init();
 void s4_init();
 
+/* soundquality: off moves the channels on without drawing them and
+   sends silence; fast samples them at a quarter of the rate; standard
+   once a sample; high averages over each sample, like bandlimit */
+#define SQ_OFF 0
+#define SQ_FAST 1
+#define SQ_STANDARD 2
+#define SQ_HIGH 3
+
+/* sets soundquality unless q < 0; returns what it was */
+int sound_quality(int q);
+
 
 
 #endif
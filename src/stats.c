@@ -0,0 +1,113 @@
+/*
+ * stats.c
+ *
+ * Counters kept all the time, cheap enough never to turn off, so a
+ * slowdown on someone's machine can be pinned on something without a
+ * profiler or a rebuild. The main loop hands over how long each frame
+ * took to emulate and draw and how long it then spent waiting (on the
+ * clock or on the sound), mem.c and lcd.c bump a counter each for the
+ * slow paths they take, and once a second of frames the lot is summed
+ * up into the stat_ variables. Those are only ever written here; the
+ * front end or a script can read them like any other. With "statosd"
+ * set they are drawn over the top of the picture as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "rc.h"
+#include "pcm.h"
+#include "menu.h"
+#include "stats.h"
+
+unsigned stat_reads, stat_writes, stat_maps, stat_tiles;
+
+static int statosd;
+static float fps;
+static int frame50, frame99, sleeping, audio;
+static int reads, writes, maps, tiles;
+
+rcvar_t stats_exports[] =
+{
+	RCV_BOOL("statosd", &statosd, "draw the stat_ counters over the picture"),
+	RCV_FLOAT("stat_fps", &fps, "frames emulated per second"),
+	RCV_INT("stat_frame50", &frame50, "median time to emulate and draw a frame, us"),
+	RCV_INT("stat_frame99", &frame99, "99th percentile of the same, us"),
+	RCV_INT("stat_sleep", &sleeping, "percent of the time spent waiting"),
+	RCV_INT("stat_audio", &audio, "sound queued in the backend, us, if it can tell"),
+	RCV_INT("stat_reads", &reads, "mem_read calls per frame"),
+	RCV_INT("stat_writes", &writes, "mem_write calls per frame"),
+	RCV_INT("stat_maps", &maps, "mem_updatemap calls per frame"),
+	RCV_INT("stat_tiles", &tiles, "tiles decoded again per frame"),
+	RCV_END
+};
+
+/* frames in a summing up; at fast forward there can be more than 60
+   of them in a second, and past this many it's summed up early */
+#define MAXFRAMES 512
+
+static int times[MAXFRAMES], nframes;
+static unsigned busy, idle;
+static char text[160];
+
+/* a shell sort rather than qsort, which can go to the heap for its
+   scratch space, and this is in the frame loop */
+static void sortint(int *a, int n)
+{
+	int gap, i, j, v;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++)
+		{
+			for (v = a[i], j = i; j >= gap && a[j-gap] > v; j -= gap)
+				a[j] = a[j-gap];
+			a[j] = v;
+		}
+}
+
+static void sumup()
+{
+	int n = nframes;
+	unsigned total = busy + idle ? busy + idle : 1;
+
+	sortint(times, n);
+	fps = n * 1000000.0f / total;
+	frame50 = times[n / 2];
+	frame99 = times[(n * 99) / 100];
+	sleeping = (int)(idle * 100.0 / total);
+	audio = pcm.fill;
+	reads = stat_reads / n;
+	writes = stat_writes / n;
+	maps = stat_maps / n;
+	tiles = stat_tiles / n;
+	stat_reads = stat_writes = stat_maps = stat_tiles = 0;
+	nframes = 0;
+	busy = idle = 0;
+
+	sprintf(text, "fps %.1f frame %d.%d/%d.%dms\n"
+		"sleep %d%% audio %dms\n"
+		"read %d write %d\n"
+		"map %d tiles %d",
+		fps, frame50 / 1000, frame50 / 100 % 10,
+		frame99 / 1000, frame99 / 100 % 10,
+		sleeping, audio / 1000, reads, writes, maps, tiles);
+}
+
+/* used is how long the frame took, slept how long was waited after */
+void stats_frame(int used, int slept)
+{
+	if (used < 0) used = 0;
+	if (slept < 0) slept = 0;
+	times[nframes++] = used;
+	busy += used;
+	idle += slept;
+	if (busy + idle >= 1000000 || nframes == MAXFRAMES)
+		sumup();
+}
+
+/* over the frame just drawn, before it's shown */
+void stats_draw()
+{
+	if (statosd && *text) menu_overlay(text);
+}
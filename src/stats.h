@@ -0,0 +1,10 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* bumped where they happen, summed up once a second, see stats.c */
+extern unsigned stat_reads, stat_writes, stat_maps, stat_tiles;
+
+void stats_frame(int used, int slept);
+void stats_draw();
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * stream.c
+ *
+ * Showing the game on a thin client somewhere else on the network,
+ * over udp, for a fraction of what a video encoder would cost. With
+ * "streamport" and "streampeer" set, the lcd hands over every line as
+ * it draws it, as the palette indices it's made of, and at the end of
+ * each frame the 8x8 tiles that have changed since the last one go
+ * out, lz packed (see lz.c), with lcd.pal when it has changed. The
+ * client keeps the picture as indices and makes colors of it itself.
+ * The buttons come back the same way and go into the event queue as
+ * the joystick, so the usual joy bindings apply.
+ *
+ * Everything's little endian. A frame is one or more packets of
+ *
+ *   'G', frame number (4), packet number in the frame, flags
+ *   [128 bytes of lcd.pal, 64 colors of 15 bits, if flags & 1]
+ *   tile count, lz block
+ *
+ * and flags & 2 marks the last packet of the frame. The block unpacks
+ * to the tiles, each its number (2), 0-359 across then down, and its
+ * 64 indices, row by row. Each packet stands on its own, so a lost one
+ * only leaves its tiles out of date; a few tiles are sent again every
+ * frame whether they've changed or not, round the screen in a second
+ * and a half, and the palette once a second, so those come right on
+ * their own. The client sends
+ *
+ *   'P', buttons (as GB_* in gnuboy.h), flags
+ *
+ * whenever it likes, and with flags & 1 the next frame sends every
+ * tile and the palette, for a client that's just started or has seen
+ * a packet go missing. A palette changed partway down the screen is
+ * sent as it is at the end of the frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "lcd.h"
+#include "input.h"
+#include "lz.h"
+#include "rc.h"
+#include "sys.h"
+#include "stream.h"
+
+static int streamport;
+static char *streampeer;
+
+rcvar_t stream_exports[] =
+{
+	RCV_INT("streamport", &streamport, "udp port to stream the picture from, 0 = off"),
+	RCV_STRING("streampeer", &streampeer, "host:port of the client to stream to"),
+	RCV_END
+};
+
+#define TILES (20 * 18)
+#define TILE 66
+/* keeps a packet inside an ethernet frame */
+#define PACKET 1400
+#define HEAD 8
+#define PAL 128
+/* tiles sent again each frame, and frames between palettes */
+#define REFRESH 4
+#define PALEVERY 60
+
+int streaming;
+
+static int fd = -1, port;
+static char *peer;
+static byte cur[144 * 160], shown[144 * 160];
+static byte sentpal[128];
+static byte rec[TILES * TILE];
+static byte pkt[PACKET], packed[LZ_BOUND(255 * TILE)];
+static int all, frame, sweep, buttons;
+
+static const int joycodes[8] =
+{
+	K_JOYRIGHT, K_JOYLEFT, K_JOYUP, K_JOYDOWN,
+	K_JOY1, K_JOY0, K_JOY2, K_JOY3
+};
+
+void stream_line(int l, byte *buf)
+{
+	if (l < 144) memcpy(cur + l * 160, buf, 160);
+}
+
+static void hangup()
+{
+	if (fd >= 0) sys_hangup(fd);
+	fd = -1;
+	streaming = 0;
+}
+
+static void plugin()
+{
+	char *p, host[256];
+
+	port = streamport;
+	free(peer);
+	peer = streampeer ? strdup(streampeer) : 0;
+	hangup();
+	if (!port || !peer) return;
+	if (!(p = strrchr(peer, ':')) || p - peer >= (int)sizeof host)
+	{
+		fprintf(stderr, "streampeer should be host:port\n");
+		return;
+	}
+	memcpy(host, peer, p - peer);
+	host[p - peer] = 0;
+	if ((fd = sys_udp(port, host, atoi(p + 1))) < 0)
+	{
+		fprintf(stderr, "stream: cannot reach %s\n", peer);
+		return;
+	}
+	memset(cur, 0, sizeof cur);
+	all = 1;
+	streaming = 1;
+}
+
+/* the client's buttons, as presses and releases of the joystick */
+static void input()
+{
+	byte m[16];
+	event_t ev;
+	int n, i, b;
+
+	while ((n = sys_udprecv(fd, (char *)m, sizeof m, 0)) != -2)
+	{
+		if (n < 3 || m[0] != 'P') continue;
+		if (m[2] & 1) all = 1;
+		b = m[1];
+		for (i = 0; i < 8; i++)
+		{
+			if (!((b ^ buttons) >> i & 1)) continue;
+			memset(&ev, 0, sizeof ev);
+			ev.type = b >> i & 1 ? EV_PRESS : EV_RELEASE;
+			ev.code = joycodes[i];
+			ev_postevent(&ev);
+		}
+		buttons = b;
+	}
+}
+
+static int changed(int t)
+{
+	byte *a = cur + (t / 20) * 8 * 160 + (t % 20) * 8;
+	byte *b = shown + (a - cur);
+	int i;
+
+	for (i = 0; i < 8; i++, a += 160, b += 160)
+		if (memcmp(a, b, 8)) return 1;
+	return 0;
+}
+
+static void put(byte *r, int t)
+{
+	byte *s = cur + (t / 20) * 8 * 160 + (t % 20) * 8;
+	int i;
+
+	r[0] = t;
+	r[1] = t >> 8;
+	for (i = 0; i < 8; i++, s += 160)
+		memcpy(r + 2 + i * 8, s, 8);
+}
+
+/* one packet: the header, the palette if pal, and the block, len
+   bytes from packed holding n tiles */
+static void send(int n, int len, int pal, int seq, int last)
+{
+	byte *o = pkt;
+
+	*(o++) = 'G';
+	*(o++) = frame;
+	*(o++) = frame >> 8;
+	*(o++) = frame >> 16;
+	*(o++) = frame >> 24;
+	*(o++) = seq;
+	*(o++) = (pal ? 1 : 0) | (last ? 2 : 0);
+	if (pal)
+	{
+		memcpy(o, lcd.pal, PAL);
+		o += PAL;
+	}
+	*(o++) = n;
+	memcpy(o, packed, len);
+	sys_udpsend(fd, (char *)pkt, o - pkt + len);
+}
+
+/* so many tiles always fit in a packet, however badly they pack */
+#define SURE ((PACKET - HEAD - PAL - 16) / TILE - 1)
+
+void stream_frame()
+{
+	int t, n, k, len, seq, pal;
+	byte *r;
+
+	if (streamport != port || !streampeer != !peer
+		|| (peer && strcmp(streampeer, peer)))
+		plugin();
+	if (fd < 0) return;
+	input();
+
+	n = 0;
+	for (t = 0; t < TILES; t++)
+		if (all || changed(t)) put(rec + n++ * TILE, t);
+	if (!all)
+		for (k = 0; k < REFRESH; k++, sweep = (sweep + 1) % TILES)
+			if (!changed(sweep)) put(rec + n++ * TILE, sweep);
+	pal = all || frame % PALEVERY == 0 || memcmp(sentpal, lcd.pal, PAL);
+	memcpy(sentpal, lcd.pal, PAL);
+	memcpy(shown, cur, sizeof shown);
+	all = 0;
+
+	/* as many tiles a packet as will go, halving until they do; a
+	   frame's changes usually go in one */
+	for (r = rec, seq = 0; n > 0 || seq == 0; seq++, pal = 0)
+	{
+		for (k = n < 255 ? n : 255;; k /= 2)
+		{
+			len = lz_pack(packed, r, k * TILE);
+			if (k <= SURE || HEAD + PAL + len <= PACKET) break;
+		}
+		send(k, len, pal, seq, k == n);
+		r += k * TILE;
+		n -= k;
+	}
+	frame++;
+}
@@ -0,0 +1,10 @@
+#ifndef UNTIL_H
+#define UNTIL_H
+
+/* conditions for ending a run early, see until.c */
+void until_reset();
+int until_set(char *s);
+int until_fetch(int a, int bank);
+char *until_frame();
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "defs.h"
+
+/* set while the lcd should hand stream_line every line it draws */
+extern int streaming;
+
+void stream_line(int l, byte *buf);
+void stream_frame();
+
+#endif
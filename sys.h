@@ -15,12 +15,25 @@ void pcm_init();
 int pcm_submit();
 void pcm_close();
 void pcm_pause(int dopause);
+/* how much sound the backend holds, in microseconds, or -1 if it
+   can't tell; for audioclock */
+int pcm_queued();
 
 void ev_poll(int wait);
 
 void sys_checkdir(char *path, int wr);
 void sys_sleep(int us);
+/* sleep at least us, without sys_sleep's care to wake up on time; for
+   threads other than the emulator's */
+void sys_nap(int us);
 void sys_sanitize(char *s);
+void *sys_mapfile(char *fn, int *len, int size, int fill);
+void sys_unmapfile(void *p, int size);
+/* len bytes of data written to fn by way of a temporary file named
+   for this process and the time, made only if nothing else has made
+   it, then renamed into place, so readers never see it half written;
+   -1 if that couldn't be done, and no file left behind */
+int sys_putfile(char *fn, void *data, int len);
 
 void joy_init();
 void joy_poll();
@@ -31,9 +44,51 @@ void kb_poll();
 void kb_close();
 
 
-/* FIXME these have different prototype for obsolete ( == M$ ) platforms */
-#include <sys/time.h>
-int sys_elapsed(struct timeval *prev);
+/* the timer is whatever the backend keeps time in; sys_elapsed gives
+   the microseconds since sys_timer or the last sys_elapsed on it */
+void *sys_timer();
+int sys_elapsed(void *prev);
+/* a clock in microseconds that wraps around, for stamping events;
+   may be called from any thread */
+unsigned sys_micros();
+/* run fn(arg) in a thread of its own, which is left to end by itself
+   and calls diag_done when fn returns; -1 if there's no way to */
+int sys_thread(void (*fn)(void *), void *arg);
+/* have child called in the child process after every fork; where
+   there's no fork there's nothing to do */
+void sys_onfork(void (*child)());
+/* keep the calling thread to one cpu, unless cpu is -1, and with prio
+   above 0 give it that real-time priority, or the most there is; -1
+   if either can't be done, often for want of permission */
+int sys_pin(int cpu, int prio);
+/* numa: with cpu -1 how many memory nodes there are, 1 where that
+   can't be told, otherwise the node cpu is on. sys_pin_node keeps the
+   calling thread to the cpus of node, or lets it run anywhere again
+   with -1, and moves what memory it can of the process's own there.
+   sys_nodecopy makes a copy of file fn held in node's memory, and
+   gives a path to it that this process and those forked from it can
+   open; 0 if there's no way to */
+int sys_node(int cpu);
+int sys_pin_node(int node);
+char *sys_nodecopy(char *fn, int node);
+/* call fn every us microseconds of cpu time, from a signal handler,
+   until called again with fn 0; -1 if there's no way to */
+int sys_sampler(void (*fn)(), int us);
+/* the gdb stub's connection: sys_listen waits for a client on a tcp
+   port, -1 if there's no way to; sys_recv gives the next byte, -1 when
+   the connection is gone, and without wait -2 if none has come */
+int sys_listen(int port);
+int sys_recv(int fd, int wait);
+int sys_send(int fd, char *buf, int len);
+void sys_hangup(int fd);
+/* the network link cable: sys_udp opens a udp socket on port that
+   talks only to host:peerport, -1 if there's no way to; sys_udprecv
+   puts the next datagram in buf and gives its length, waiting up to
+   us microseconds for one, -2 if none came; sys_udpsend sends one.
+   sys_hangup closes it */
+int sys_udp(int port, char *host, int peerport);
+int sys_udprecv(int fd, char *buf, int len, int us);
+int sys_udpsend(int fd, char *buf, int len);
 void sys_initpath();
 
 #endif
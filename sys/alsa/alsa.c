@@ -0,0 +1,257 @@
+/*
+ * alsa.c
+ *
+ * Sound straight to alsa (or pipewire or pulse, through their alsa
+ * plugins), written into the device's own buffer by mmap rather than
+ * copied through write(). What matters here is knowing how long a
+ * sample takes to be heard: snd_pcm_delay counts everything queued,
+ * in the buffer and past it in the hardware, and that is what rate
+ * control steers (see pcm.drc). emu_run then paces by the clock, and
+ * the buffer is kept at "sound_latency" ms ahead of the speaker by
+ * stretching or shrinking samples a fraction of a percent.
+ *
+ * A frame's sound comes in one go at the end of the frame, so what's
+ * queued goes from sound_latency up to that plus a frame and back;
+ * it's the low point that's steered, and "sound_delay" is what it
+ * was at the last submit, in microseconds.
+ *
+ * With sound_drc off pcm_submit waits for the buffer to drain down to
+ * sound_latency instead, and the sound does the pacing.
+ * "audioclock" does that finer, in slices of a frame (see emu.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <alsa/asoundlib.h>
+
+#include "defs.h"
+#include "pcm.h"
+#include "rc.h"
+#include "sys.h"
+
+struct pcm pcm;
+
+static int sound = 1;
+static int stereo = 1;
+static int samplerate = 44100;
+static char *alsa_device;
+static int latency = 10;
+static int drc = 1;
+static int delay, underruns, overruns;
+static int paused;
+
+/* the most rate control will stretch or shrink a sample, in 65536ths;
+   328 is half a percent, too little to hear as a change in pitch */
+#define DRC_MAX 328
+
+rcvar_t pcm_exports[] =
+{
+	RCV_BOOL("sound", &sound, "enable sound"),
+	RCV_INT("stereo", &stereo, "enable stereo"),
+	RCV_INT("samplerate", &samplerate, "sample rate"),
+	RCV_STRING("alsa_device", &alsa_device, "alsa pcm to play on"),
+	RCV_INT("sound_latency", &latency, "sound buffering in ms"),
+	RCV_BOOL("sound_drc", &drc, "pace by the clock, keep the sound in step by rate control"),
+	RCV_INT("sound_delay", &delay, "how far behind the sound was last, in us"),
+	RCV_INT("sound_underruns", &underruns, "times the sound ran dry"),
+	RCV_INT("sound_overruns", &overruns, "times sound had to be dropped"),
+	RCV_END
+};
+
+
+static snd_pcm_t *handle;
+static int framebytes;
+static snd_pcm_uframes_t target;
+static int mmapped;
+
+
+static int setup()
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t size, period;
+	unsigned rate = samplerate, ch = 1 + !!stereo;
+	int dir = 0;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+	if (snd_pcm_hw_params_any(handle, hw) < 0) return -1;
+	mmapped = snd_pcm_hw_params_set_access(handle, hw,
+		SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+	if (!mmapped && snd_pcm_hw_params_set_access(handle, hw,
+		SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+		return -1;
+	if (snd_pcm_hw_params_set_format(handle, hw, SND_PCM_FORMAT_S16) < 0
+		|| snd_pcm_hw_params_set_channels_near(handle, hw, &ch) < 0
+		|| snd_pcm_hw_params_set_rate_near(handle, hw, &rate, &dir) < 0)
+		return -1;
+	/* room for the target, a frame's worth on top, and some slack;
+	   periods small enough that the device isn't what holds us up */
+	target = rate * latency / 1000;
+	size = target + rate / 30;
+	period = rate / 1000;
+	if (snd_pcm_hw_params_set_buffer_size_near(handle, hw, &size) < 0
+		|| snd_pcm_hw_params_set_period_size_near(handle, hw, &period, &dir) < 0
+		|| snd_pcm_hw_params(handle, hw) < 0)
+		return -1;
+	snd_pcm_hw_params_get_buffer_size(hw, &size);
+	if (target > size / 2) target = size / 2;
+
+	if (snd_pcm_sw_params_current(handle, sw) < 0
+		|| snd_pcm_sw_params_set_start_threshold(handle, sw, target) < 0
+		|| snd_pcm_sw_params_set_avail_min(handle, sw, period) < 0
+		|| snd_pcm_sw_params(handle, sw) < 0)
+		return -1;
+
+	pcm.hz = rate;
+	pcm.stereo = ch == 2;
+	pcm.bits = 16;
+	framebytes = 2 * ch;
+	/* a frame and a bit, so a frame stretched by rate control still
+	   goes in one piece */
+	pcm.len = rate / 50 * framebytes;
+	pcm.buf = malloc(pcm.len);
+	pcm.pos = 0;
+	return pcm.buf ? 0 : -1;
+}
+
+void pcm_init()
+{
+	if (!sound) return;
+	if (latency < 1) latency = 1;
+	if (!alsa_device) alsa_device = strdup("default");
+	if (snd_pcm_open(&handle, alsa_device, SND_PCM_STREAM_PLAYBACK,
+		SND_PCM_NONBLOCK) < 0)
+	{
+		handle = 0;
+		return;
+	}
+	if (setup() < 0)
+	{
+		snd_pcm_close(handle);
+		handle = 0;
+		free(pcm.buf);
+		memset(&pcm, 0, sizeof pcm);
+	}
+}
+
+void pcm_close()
+{
+	if (handle)
+	{
+		snd_pcm_drop(handle);
+		snd_pcm_close(handle);
+		handle = 0;
+	}
+	free(pcm.buf);
+	memset(&pcm, 0, sizeof pcm);
+}
+
+/* as many frames of buf as there's room for, straight into the
+   device's buffer; how many went, or an alsa error */
+static snd_pcm_sframes_t put(byte *buf, snd_pcm_uframes_t n)
+{
+	const snd_pcm_channel_area_t *a;
+	snd_pcm_uframes_t off, got, done = 0;
+	snd_pcm_sframes_t room;
+	int err;
+
+	if (!mmapped) return snd_pcm_writei(handle, buf, n);
+	if ((room = snd_pcm_avail_update(handle)) < 0) return room;
+	if ((snd_pcm_uframes_t)room < n) n = room;
+	while (done < n)
+	{
+		got = n - done;
+		if ((err = snd_pcm_mmap_begin(handle, &a, &off, &got)) < 0)
+			return err;
+		memcpy((byte *)a[0].addr + off * framebytes,
+			buf + done * framebytes, got * framebytes);
+		if ((err = snd_pcm_mmap_commit(handle, off, got)) < 0)
+			return err;
+		done += got;
+	}
+	return done;
+}
+
+/* the queue, in frames, or 0 when it isn't playing */
+static snd_pcm_sframes_t queued()
+{
+	snd_pcm_sframes_t d;
+
+	if (snd_pcm_delay(handle, &d) < 0 || d < 0) return 0;
+	return d;
+}
+
+int pcm_submit()
+{
+	snd_pcm_uframes_t n = pcm.pos / framebytes, done = 0;
+	snd_pcm_sframes_t r, was;
+	int res, tries = 0;
+
+	if (!handle || !pcm.buf || paused)
+	{
+		pcm.pos = 0;
+		return 0;
+	}
+	/* the low point, just before this frame's sound goes in: how
+	   long its first sample will take to be heard */
+	was = queued();
+	delay = was * 1000000LL / pcm.hz;
+	while (done < n)
+	{
+		r = put(pcm.buf + done * framebytes, n - done);
+		if (r == -EAGAIN) r = 0;
+		if (r == -EPIPE) underruns++;
+		if (r < 0 && snd_pcm_recover(handle, r, 1) < 0) break;
+		if (r > 0) done += r;
+		else if (r == 0)
+		{
+			/* full: rate control and audioclock let the rest go,
+			   otherwise it waits, but not on a device that has
+			   stopped */
+			if (drc || pcm.clocked || ++tries > 250)
+			{
+				overruns++;
+				break;
+			}
+			snd_pcm_wait(handle, 1);
+		}
+	}
+	pcm.pos = 0;
+	pcm.fill = queued() * 1000000LL / pcm.hz;
+	if (pcm.clocked)
+	{
+		pcm.drc = 0;
+		return 1;
+	}
+	if (drc)
+	{
+		pcm.drc = 1;
+		res = ((int)was - (int)target) * DRC_MAX / (int)target;
+		if (res > DRC_MAX) res = DRC_MAX;
+		if (res < -DRC_MAX) res = -DRC_MAX;
+		pcm.skew += (res - pcm.skew) / 8;
+		return 0;
+	}
+	pcm.drc = 0;
+	/* what's over the target is how long to sleep */
+	if ((r = queued()) > (snd_pcm_sframes_t)target)
+		sys_sleep((r - target) * 1000000LL / pcm.hz);
+	return 1;
+}
+
+int pcm_queued()
+{
+	if (!handle || paused) return -1;
+	return queued() * 1000000LL / pcm.hz;
+}
+
+void pcm_pause(int dopause)
+{
+	if (dopause == paused) return;
+	paused = dopause;
+	if (!handle) return;
+	if (paused) snd_pcm_drop(handle);
+	else snd_pcm_prepare(handle);
+}
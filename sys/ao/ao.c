@@ -88,6 +88,11 @@ int pcm_submit()
 	return 1;
 }
 
+int pcm_queued()
+{
+	return -1;
+}
+
 void pcm_pause(int dopause)
 {
 	paused = dopause;
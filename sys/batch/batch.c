@@ -0,0 +1,1611 @@
+/*
+ * batch.c
+ *
+ * gnuboy-batch: runs a list of jobs, each a rom played for a number
+ * of frames, across several processes at once, and prints how fast
+ * each went and a hash of where it ended up. The core keeps all its
+ * state in globals, so instead of threads every job gets a process
+ * of its own, forked fresh from a parent that has not loaded
+ * anything; a worker that finishes early simply gets the next job,
+ * so a few long jobs don't hold the rest up.
+ *
+ * A job file has one job per line:
+ *
+ *   rom frames [inputs [state]] [conditions]
+ *
+ * and blank lines and lines starting with # are skipped. inputs, if
+ * given and not "-", names a file of "frame buttons" lines, buttons
+ * being the GB_* bits of gnuboy.h in hex; each takes effect at the
+ * start of its frame and holds until the next. state, if given, is a
+ * save state the job starts from instead of power on. For each job
+ * one line is printed as it finishes,
+ *
+ *   job rom frames fps state fb
+ *
+ * state and fb being FNV-1a hashes of the final save state and the
+ * last frame drawn, or "job rom error message" if it failed. Jobs
+ * are numbered from 1 in file order. The exit status is 1 if any
+ * job failed.
+ *
+ * Test roms that report over the serial port end their job early:
+ * as soon as what they've sent holds blargg's "Passed" or "Failed",
+ * or mooneye's 3 5 8 13 21 34 or six 0x42 bytes, the job stops, frames
+ * is how many it actually ran, and the line ends with "pass" or
+ * "fail". A failed test counts as a failed job.
+ *
+ * Any other test can be ended early too, with stop conditions: words
+ * anywhere after frames of the form pc=, ram=, serial=, hash= or
+ * static=, as gb_until takes them (see until.c), and those given with
+ * -u for every job. The first to come true ends the job at the end of
+ * that frame, and the line ends with "until" and the condition. The
+ * job hasn't failed for it.
+ *
+ * With -c file every job also counts the instructions it runs, by
+ * opcode, which slows it right down; the workers add their counts
+ * into one table the parent shares with them, and once all the jobs
+ * are done the totals over the whole list are written to file,
+ * sorted, like gnuboy's "opdump". A worker that crashed adds nothing.
+ *
+ * With -C dir compressed roms are decompressed into dir the first
+ * time and mapped from there after (gb_rom_cache).
+ *
+ * With -k dir every job leaves a checkpoint in dir each -K frames
+ * (36000, ten minutes of game time, by default): its packed state,
+ * how far it's got, how long that took and what it has sent over
+ * serial so far. A forked child writes it, syncs it and renames it
+ * into place, so the job doesn't wait on the disk. Run the same job
+ * file again, here or on another machine that sees dir, and a job
+ * with a checkpoint carries on from it instead of from the start,
+ * ending up with the same state and picture hashes; the file goes
+ * once the job is done. A checkpoint is only taken up by the job
+ * with the same number, rom, frames, inputs and state, starting from
+ * the same machine state.
+ *
+ * With -P pack, roms given as "pack:hash" come out of that rom pack,
+ * which is mapped once, before the workers are forked, so no job opens
+ * or reads a rom at all. -M pack rom... makes one of the roms given,
+ * and prints "hash rom" for each.
+ *
+ * The next few jobs after the ones running are forked early and load
+ * their roms, states and inputs while they wait their turn, so the
+ * workers don't sit idle on storage between jobs; -a sets how many,
+ * by default as many as there are workers, and -a 0 forks each only
+ * as a worker comes free. A job that can't load fails there and then.
+ *
+ * With -p each worker is kept to one cpu, one from each physical core
+ * and none shared, so jobs don't get moved about or run on the two
+ * halves of a hyperthreaded core; without -j there are then as many
+ * workers as physical cores. The same goes for -f and -w. Where
+ * there are several numa nodes the cores are dealt out a node at a
+ * time, each worker's memory is moved onto its own node when it's
+ * pinned, a job loaded ahead is loaded on the node of the slot it's
+ * likely to get (and given one there if one's free), and with -P each
+ * node gets a copy of the pack in its own memory, so no worker reads
+ * its rom or keeps its machine on the far side of the interconnect.
+ *
+ * See serve() for running as a fork server instead, fuzz() for
+ * looking for crashes and hangs, deal() and work() for spreading the
+ * jobs over several machines, and push() for sending numbers to
+ * StatsD.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+
+#include "../lib/gnuboy.h"
+
+#define MAXLINE 1024
+/* the most a pack can be to be copied to each node */
+#define PACKCOPY (1 << 30)
+
+struct job
+{
+	char *rom, *inputs, *state, *until;
+	int frames;
+};
+
+struct input
+{
+	int frame, buttons;
+};
+
+static struct job *jobs;
+static int njobs;
+static pid_t *pids;
+static int statsd = -1;
+static unsigned long long *opshared;
+static char *cachedir;
+static char *packfile;
+static int *cores, ncores, *nodeof, nnodes = 1;
+static char **packcopy;
+static char *ckdir;
+static int ckevery = 36000;
+static char *untilall;
+
+/* the running job's checkpoint file, the hash of the state it
+   started from, what it had sent over serial before it was resumed,
+   and the child writing the last one */
+static struct
+{
+	char *name;
+	unsigned long long start;
+	unsigned char *serial;
+	int nserial;
+	pid_t writer;
+} ck;
+
+
+static void *loadfile(char *fn, int *len)
+{
+	FILE *f;
+	char *data = 0, *p;
+	int n = 0, max = 0, r;
+
+	if (!(f = fopen(fn, "rb"))) return 0;
+	for (;;)
+	{
+		if (n == max)
+		{
+			max = max ? max * 2 : 1 << 16;
+			if (!(p = realloc(data, max))) break;
+			data = p;
+		}
+		if ((r = fread(data + n, 1, max - n, f)) <= 0) break;
+		n += r;
+	}
+	fclose(f);
+	*len = n;
+	return data;
+}
+
+static struct input *loadinputs(char *fn, int *count)
+{
+	FILE *f;
+	char line[MAXLINE];
+	struct input *in = 0, *p;
+	int n = 0, frame, buttons;
+
+	if (!(f = fopen(fn, "r"))) return 0;
+	while (fgets(line, sizeof line, f))
+	{
+		if (sscanf(line, "%d %x", &frame, &buttons) != 2) continue;
+		if (!(p = realloc(in, (n + 1) * sizeof *in))) break;
+		in = p;
+		in[n].frame = frame;
+		in[n].buttons = buttons;
+		n++;
+	}
+	fclose(f);
+	*count = n;
+	return in ? in : malloc(1);
+}
+
+/* whether w is one of gb_until's conditions rather than a file */
+static int iscond(char *w)
+{
+	static char *kinds[] = { "pc=", "ram=", "serial=", "hash=", "static=", 0 };
+	int i;
+
+	for (i = 0; kinds[i]; i++)
+		if (!strncmp(w, kinds[i], strlen(kinds[i]))) return 1;
+	return 0;
+}
+
+static void loadjobs(char *fn)
+{
+	FILE *f;
+	char line[MAXLINE], *rom, *w, *inputs, *state, until[MAXLINE];
+	struct job *p;
+	int frames;
+
+	if (!(f = fopen(fn, "r")))
+	{
+		perror(fn);
+		exit(1);
+	}
+	while (fgets(line, sizeof line, f))
+	{
+		if (*line == '#') continue;
+		if (!(rom = strtok(line, " \t\r\n")) || !(w = strtok(0, " \t\r\n"))
+			|| sscanf(w, "%d", &frames) != 1)
+			continue;
+		inputs = state = 0;
+		*until = 0;
+		while ((w = strtok(0, " \t\r\n")))
+		{
+			if (iscond(w)) strcat(strcat(until, " "), w);
+			else if (!inputs) inputs = w;
+			else if (!state) state = w;
+		}
+		if (!(p = realloc(jobs, (njobs + 1) * sizeof *jobs)))
+			break;
+		jobs = p;
+		jobs[njobs].rom = strdup(rom);
+		jobs[njobs].frames = frames;
+		jobs[njobs].inputs = inputs && strcmp(inputs, "-") ? strdup(inputs) : 0;
+		jobs[njobs].state = state ? strdup(state) : 0;
+		jobs[njobs].until = *until ? strdup(until + 1) : 0;
+		njobs++;
+	}
+	fclose(f);
+}
+
+static unsigned fnv(const void *data, int len, unsigned h)
+{
+	const unsigned char *p = data;
+
+	while (len--) h = (h ^ *(p++)) * 16777619u;
+	return h;
+}
+
+/* names the contents of the files a job needs, when another
+   machine is fetching them */
+static unsigned long long fnv64(const void *data, int len)
+{
+	const unsigned char *p = data;
+	unsigned long long h = 14695981039346656037ull;
+
+	while (len--) h = (h ^ *(p++)) * 1099511628211ull;
+	return h;
+}
+
+static long micros()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* one cpu from each physical core, as far as linux's sysfs tells
+   them apart; otherwise each online cpu counts as a core */
+static void findcores()
+{
+	int n = sysconf(_SC_NPROCESSORS_CONF), i, j, core, pkg, on, r, k;
+	int *id;
+	char fn[96];
+	FILE *f;
+
+	if (n <= 0 || !(cores = malloc(n * sizeof *cores))
+		|| !(id = malloc(n * 2 * sizeof *id)))
+		return;
+	for (i = 0; i < n; i++)
+	{
+		on = 1;
+		sprintf(fn, "/sys/devices/system/cpu/cpu%d/online", i);
+		if ((f = fopen(fn, "r")))
+		{
+			if (fscanf(f, "%d", &on) != 1) on = 1;
+			fclose(f);
+		}
+		if (!on) continue;
+		core = pkg = -1;
+		sprintf(fn, "/sys/devices/system/cpu/cpu%d/topology/core_id", i);
+		if ((f = fopen(fn, "r")))
+		{
+			if (fscanf(f, "%d", &core) != 1) core = -1;
+			fclose(f);
+		}
+		sprintf(fn, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", i);
+		if ((f = fopen(fn, "r")))
+		{
+			if (fscanf(f, "%d", &pkg) != 1) pkg = -1;
+			fclose(f);
+		}
+		for (j = 0; j < ncores && core >= 0; j++)
+			if (id[j*2] == core && id[j*2+1] == pkg) break;
+		if (j < ncores) continue;
+		id[ncores*2] = core;
+		id[ncores*2+1] = pkg;
+		cores[ncores++] = i;
+	}
+	/* on a machine with several memory nodes, dealt out a node at a
+	   time, so worker w's node is w % nnodes however many there are */
+	if ((nnodes = gb_node(-1)) > 1 && (nodeof = malloc(n * sizeof *nodeof)))
+	{
+		for (i = 0; i < ncores; i++)
+		{
+			id[i] = cores[i];
+			id[n + i] = gb_node(cores[i]);
+		}
+		/* the r'th core of each node in turn */
+		for (r = j = 0; j < ncores; r++)
+			for (k = 0; k < nnodes; k++)
+			{
+				for (i = 0, on = 0; i < ncores; i++)
+					if (id[n + i] == k && on++ == r) break;
+				if (i == ncores) continue;
+				cores[j] = id[i];
+				nodeof[j++] = k;
+			}
+	}
+	else nnodes = 1;
+	free(id);
+}
+
+/* the process onto node k, its memory with it, and from then on
+   loading from k's own copy of the pack */
+static void onnode(int k)
+{
+	gb_pin_node(k);
+	if (packcopy) packfile = packcopy[k];
+}
+
+/* a copy of the pack in each node's memory, where there's room; the
+   mapping of the file itself is only ever on the one node */
+static void copypack()
+{
+	struct stat st;
+	int k;
+
+	if (nnodes < 2 || stat(packfile, &st) || st.st_size > PACKCOPY
+		|| !(packcopy = malloc(nnodes * sizeof *packcopy)))
+		return;
+	for (k = 0; k < nnodes; k++)
+		if (!(packcopy[k] = gb_node_copy(packfile, k)))
+			packcopy[k] = packfile;
+}
+
+/* the process in worker slot w to its own core, with -p */
+static void pin(int w)
+{
+	if (ncores && nnodes > 1) onnode(nodeof[w % ncores]);
+	if (ncores && gb_pin(cores[w % ncores], 0))
+		fprintf(stderr, "worker %d: cannot pin to cpu %d\n", w, cores[w % ncores]);
+}
+
+/* one result line, in a single write so lines from several workers
+   never interleave */
+static void report(char *fmt, ...)
+{
+	char buf[MAXLINE * 2];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if (n > (int)sizeof buf - 1) n = sizeof buf - 1;
+	if (write(1, buf, n) < 0) exit(1);
+}
+
+/*
+ * With -m host:port every job's numbers also go to StatsD, over udp,
+ * as one datagram from the process that ran it once it's done: the
+ * emulation itself never waits on it or shares anything with whoever
+ * collects them, and a collector that's down loses numbers, not jobs.
+ * Per job, under gnuboy.batch.:
+ *
+ *   frames, cycles     counters; cycles are of the 4 MHz clock, 70224
+ *                      a frame, so the rates are what was emulated
+ *   time, fps          timers, for the spread between jobs
+ *   state              the save state's size in bytes, a gauge
+ *
+ * and jobs and failed counters, from the parent in batch mode, so a
+ * worker that crashed is still counted, or from the child serving a
+ * request with -s.
+ */
+static void push(char *fmt, ...)
+{
+	char buf[MAXLINE];
+	va_list ap;
+	int n;
+
+	if (statsd < 0) return;
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if (n > (int)sizeof buf - 1) n = sizeof buf - 1;
+	send(statsd, buf, n, 0);
+}
+
+static void statsd_open(char *addr)
+{
+	struct addrinfo hints, *ai;
+	char host[MAXLINE], *port;
+
+	snprintf(host, sizeof host, "%s", addr);
+	if (!(port = strrchr(host, ':')))
+	{
+		fprintf(stderr, "%s: no port\n", addr);
+		exit(1);
+	}
+	*(port++) = 0;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, port, &hints, &ai))
+	{
+		fprintf(stderr, "%s: unknown host\n", addr);
+		exit(1);
+	}
+	if ((statsd = socket(ai->ai_family, SOCK_DGRAM, 0)) < 0
+		|| connect(statsd, ai->ai_addr, ai->ai_addrlen) < 0)
+	{
+		perror(addr);
+		exit(1);
+	}
+	freeaddrinfo(ai);
+}
+
+static void ended(int failed)
+{
+	push("gnuboy.batch.jobs:1|c\n%s", failed ? "gnuboy.batch.failed:1|c\n" : "");
+}
+
+static int contains(const unsigned char *p, int len, const void *s, int n)
+{
+	for (; len >= n; p++, len--)
+		if (!memcmp(p, s, n)) return 1;
+	return 0;
+}
+
+/* what a test rom has said over the serial port: 1 passed, -1 failed,
+   0 nothing yet */
+static int verdict()
+{
+	static const unsigned char fib[] = { 3, 5, 8, 13, 21, 34 };
+	static const unsigned char bad[] = { 0x42, 0x42, 0x42, 0x42, 0x42, 0x42 };
+	const unsigned char *out;
+	unsigned char *all = 0;
+	int len, v = 0;
+
+	out = gb_serial(&len);
+	/* a resumed job's has what was said before it was stopped */
+	if (ck.nserial && (all = malloc(ck.nserial + len)))
+	{
+		memcpy(all, ck.serial, ck.nserial);
+		memcpy(all + ck.nserial, out, len);
+		out = all;
+		len += ck.nserial;
+	}
+	if (contains(out, len, "Passed", 6) || contains(out, len, fib, 6))
+		v = 1;
+	else if (contains(out, len, "Failed", 6) || contains(out, len, bad, 6))
+		v = -1;
+	free(all);
+	return v;
+}
+
+/* play frames more frames from wherever the core is now and report
+   under the name tag; input frame numbers count from here */
+/* inputs read ahead of play, so a job can be loaded before it runs */
+static int readinputs(char *tag, char *inputs, struct input **in, int *ni)
+{
+	*in = 0;
+	*ni = 0;
+	if (inputs && !(*in = loadinputs(inputs, ni)))
+	{
+		report("%s error cannot read %s\n", tag, inputs);
+		return 1;
+	}
+	return 0;
+}
+
+static int writeall(int fd, const void *buf, int len)
+{
+	const char *p = buf;
+	int n;
+
+	while (len > 0)
+	{
+		if ((n = write(fd, p, len)) <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * A checkpoint file is a line "GbCk start frame micros serial", the
+ * serial bytes and then the packed state; it's named after a hash
+ * of what the job was given.
+ */
+
+static void ckname(char *tag, int frames, char *inputs, char *state)
+{
+	char key[MAXLINE * 4];
+
+	free(ck.name);
+	free(ck.serial);
+	ck.serial = 0;
+	ck.nserial = 0;
+	snprintf(key, sizeof key, "%s %d %s %s", tag, frames,
+		inputs ? inputs : "-", state ? state : "-");
+	ck.name = malloc(strlen(ckdir) + 24);
+	sprintf(ck.name, "%s/%016llx.ckpt", ckdir, fnv64(key, strlen(key)));
+	ck.start = gb_state_hash();
+}
+
+static void ckwait()
+{
+	if (ck.writer > 0) waitpid(ck.writer, 0, 0);
+	ck.writer = 0;
+}
+
+/* frame frames in, after t us */
+static void checkpoint(int frame, long t)
+{
+	const unsigned char *out;
+	char head[128], tmp[MAXLINE];
+	unsigned char *state;
+	int len, nout, fd, h;
+	pid_t pid;
+
+	if (!(state = malloc(len = gb_state_packsize()))
+		|| (len = gb_pack_state(state, len)) < 0)
+	{
+		free(state);
+		return;
+	}
+	out = gb_serial(&nout);
+	h = sprintf(head, "GbCk %016llx %d %ld %d\n", ck.start, frame, t,
+		ck.nserial + nout);
+	/* one at a time, though the last is long gone by now */
+	ckwait();
+	fflush(stdout);
+	if ((pid = fork()) > 0)
+	{
+		ck.writer = pid;
+		free(state);
+		return;
+	}
+	snprintf(tmp, sizeof tmp, "%s.%d", ck.name, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) >= 0)
+	{
+		if (writeall(fd, head, h) || writeall(fd, ck.serial, ck.nserial)
+			|| writeall(fd, out, nout) || writeall(fd, state, len)
+			|| fsync(fd) || close(fd) || rename(tmp, ck.name))
+			unlink(tmp);
+	}
+	free(state);
+	/* without a child, it was written here and now */
+	if (!pid) _exit(0);
+}
+
+/* the frame the job's checkpoint got to, with *t how long it took,
+   and the state loaded; 0 if there's none to carry on from */
+static int resume(long *t)
+{
+	unsigned long long start;
+	unsigned char *data, *p;
+	int len, frame, nserial, n;
+
+	*t = 0;
+	if (!(data = loadfile(ck.name, &len))) return 0;
+	if (!(p = memchr(data, '\n', len))
+		|| sscanf((char *)data, "GbCk %llx %d %ld %d%n", &start, &frame, t,
+			&nserial, &n) != 4
+		|| start != ck.start || frame <= 0 || nserial < 0
+		|| nserial > len - (++p - data)
+		|| !(ck.serial = malloc(nserial + 1))
+		|| gb_load_state(p + nserial, len - (p - data) - nserial))
+	{
+		free(data);
+		*t = 0;
+		return 0;
+	}
+	memcpy(ck.serial, p, nserial);
+	ck.nserial = nserial;
+	free(data);
+	return frame;
+}
+
+static int play(char *tag, int frames, struct input *in, int ni)
+{
+	void *state;
+	const char *met = 0;
+	int k = 0, i = 0, size, v = 0, seen = 0, len;
+	long start, t = 0;
+
+	if (ck.name && (i = resume(&t)))
+	{
+		while (k < ni && in[k].frame < i) k++;
+		v = verdict();
+	}
+	start = micros() - t;
+	for (; i < frames && !v; i++)
+	{
+		while (k < ni && in[k].frame <= i)
+			gb_set_input(in[k++].buttons);
+		gb_run_frame();
+		/* only look again when something new has come out */
+		gb_serial(&len);
+		if ((len != seen && (seen = len, v = verdict()))
+			|| (met = gb_until_met()))
+		{
+			i++;
+			break;
+		}
+		if (ck.name && (i + 1) % ckevery == 0 && i + 1 < frames)
+			checkpoint(i + 1, micros() - start);
+	}
+	t = micros() - start;
+	frames = i;
+	if (ck.name)
+	{
+		ckwait();
+		unlink(ck.name);
+	}
+
+	size = gb_state_size();
+	if (!(state = calloc(1, size)) || gb_save_state(state, size) < 0)
+	{
+		report("%s error cannot save state\n", tag);
+		return 1;
+	}
+	report("%s %d %ld %08x %08x%s%s%s\n", tag, frames,
+		t > 0 ? (long)frames * 1000000L / t : 0L,
+		fnv(state, size, 2166136261u),
+		fnv(gb_framebuffer(), GB_WIDTH * GB_HEIGHT * 4, 2166136261u),
+		v > 0 ? " pass" : v < 0 ? " fail" : "",
+		met ? " until " : "", met ? met : "");
+	push("gnuboy.batch.frames:%d|c\ngnuboy.batch.cycles:%lld|c\n"
+		"gnuboy.batch.time:%ld|ms\ngnuboy.batch.fps:%ld|ms\n"
+		"gnuboy.batch.state:%d|g\n",
+		frames, frames * 70224LL, t / 1000,
+		t > 0 ? (long)frames * 1000000L / t : 0L, size);
+	return v < 0;
+}
+
+static int load(char *tag, char *rom)
+{
+	gb_init(0);
+	if (cachedir) gb_rom_cache(cachedir);
+	if (packfile) gb_rom_pack(packfile);
+	if (gb_load_rom_file(rom))
+	{
+		report("%s error %.*s\n", tag, (int)strcspn(gb_error(), "\n"),
+			gb_error());
+		return 1;
+	}
+	return 0;
+}
+
+/* the job's own stop conditions and -u's */
+static int setuntil(char *tag, char *until)
+{
+	char all[2 * MAXLINE];
+
+	snprintf(all, sizeof all, "%s%s%s", untilall ? untilall : "",
+		untilall && until ? " " : "", until ? until : "");
+	if (!gb_until(all)) return 0;
+	report("%s error cannot make sense of until %s\n", tag, all);
+	return 1;
+}
+
+/* one job, whichever machine it's on; with go >= 0 everything is
+   loaded first and then it waits there for the slot to run on */
+static int job(char *tag, char *rom, int frames, char *inputs, char *state,
+	char *until, int go)
+{
+	struct input *in;
+	void *data;
+	int len, ni, w;
+
+	if (load(tag, rom) || setuntil(tag, until)) return 1;
+	if (opshared) gb_count_ops(1);
+	if (state)
+	{
+		if (!(data = loadfile(state, &len)) || gb_load_state(data, len))
+		{
+			report("%s error cannot load %s\n", tag, state);
+			return 1;
+		}
+		free(data);
+	}
+	if (readinputs(tag, inputs, &in, &ni)) return 1;
+	if (ckdir) ckname(tag, frames, inputs, state);
+	if (go >= 0)
+	{
+		/* the parent's gone if this fails, so there's no one to tell */
+		if (read(go, &w, sizeof w) != sizeof w) return 1;
+		close(go);
+		pin(w);
+	}
+	return play(tag, frames, in, ni);
+}
+
+static int run(int n, int go)
+{
+	struct job *j = &jobs[n];
+	char tag[MAXLINE + 16];
+
+	unsigned long long *ops;
+	int i, r;
+
+	sprintf(tag, "%d %s", n+1, j->rom);
+	r = job(tag, j->rom, j->frames, j->inputs, j->state, j->until, go);
+	if (opshared)
+	{
+		ops = gb_op_counts();
+		for (i = 0; i < GB_OPCOUNTS; i++)
+			if (ops[i]) __atomic_fetch_add(&opshared[i], ops[i], __ATOMIC_RELAXED);
+	}
+	return r;
+}
+
+/*
+ * Job n forked ahead of its turn, to load its rom (through the cache,
+ * with -C), its state and its inputs while the jobs before it are
+ * still running, so storage is read while the cpus are busy rather
+ * than while they wait. It then waits on a pipe for the parent to
+ * write the slot it's to run on; gofd[n] is the parent's end. The
+ * pipes of the jobs still waiting before it are closed, so a parent
+ * that dies leaves none of them hanging.
+ */
+static int *gofd;
+
+static pid_t ahead(int n, int first)
+{
+	int fd[2], c;
+	pid_t pid;
+
+	if (pipe(fd) < 0) return -1;
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+	{
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+	if (!pid)
+	{
+		for (c = first; c < n; c++)
+			if (gofd[c] >= 0) close(gofd[c]);
+		close(fd[1]);
+		signal(SIGPIPE, SIG_DFL);
+		/* its slot's not known yet, but the parent gives it one on
+		   this node if it can, so it loads where it will run */
+		if (nnodes > 1) onnode(n % nnodes);
+		c = run(n, fd[0]);
+		gb_diag_flush();
+		_exit(c);
+	}
+	close(fd[0]);
+	gofd[n] = fd[1];
+	return pid;
+}
+
+
+/*
+ * With -s the jobs come from a unix socket instead, all on the one
+ * rom, which is loaded and run for warm frames just once, up front.
+ * Each connection gets a fork of that process, so it starts from
+ * the warmed up state straight away, sharing the parent's memory
+ * until it writes to it. A client sends one "frames [inputs]" line
+ * and gets back one "rom frames fps state fb" line, as above, and
+ * the connection is closed.
+ */
+
+static int request(int c, char *rom)
+{
+	char line[MAXLINE], inputs[MAXLINE];
+	struct input *in;
+	int n = 0, frames, ni;
+
+	while (n < MAXLINE - 1 && read(c, line + n, 1) == 1)
+		if (line[n++] == '\n') break;
+	line[n] = 0;
+	dup2(c, 1);
+	close(c);
+	*inputs = 0;
+	if (sscanf(line, "%d %s", &frames, inputs) < 1)
+	{
+		report("%s error bad request\n", rom);
+		return 1;
+	}
+	if (readinputs(rom, *inputs ? inputs : 0, &in, &ni)) return 1;
+	return play(rom, frames, in, ni);
+}
+
+static void serve(char *path, char *rom, int warm)
+{
+	struct sockaddr_un sa;
+	int s, c;
+
+	if (load(rom, rom)) exit(1);
+	while (warm-- > 0) gb_run_frame();
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sa.sun_path)
+	{
+		fprintf(stderr, "%s: socket path too long\n", path);
+		exit(1);
+	}
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+		|| bind(s, (struct sockaddr *)&sa, sizeof sa) < 0
+		|| listen(s, 64) < 0)
+	{
+		perror(path);
+		exit(1);
+	}
+	/* nobody waits for the children, so don't leave them as zombies */
+	signal(SIGCHLD, SIG_IGN);
+	fflush(stdout);
+	for (;;)
+	{
+		if ((c = accept(s, 0, 0)) < 0) continue;
+		if (!fork())
+		{
+			close(s);
+			c = request(c, rom);
+			ended(c);
+			gb_diag_flush();
+			_exit(c);
+		}
+		close(c);
+	}
+}
+
+/*
+ * With -f dir the workers fuzz the one rom instead, for crashes and
+ * softlocks. It's loaded and warmed up once, and that state is the
+ * first snapshot; every run then loads a snapshot, which is a lot
+ * cheaper than loading the rom, and presses buttons at random for
+ * -l frames (900 by default). A run that reaches code no run has
+ * reached before (see gb_cover) leaves where it ended as another
+ * snapshot, for later runs to go on from, up to MAXSNAPS of them.
+ * The coverage map and the snapshots are shared by all the workers.
+ *
+ * A run hangs if the cpu halts for good ("dead") or if for HANG
+ * frames together it runs nothing but a few bytes of code ("spin");
+ * a worker that dies has crashed, on an invalid opcode or otherwise,
+ * and another takes its place. The first MAXFOUND of those, which
+ * are often the same few found again and again, are written into dir
+ * as inputs files leading to them from power on, and each gets a line
+ *
+ *   rom kind frames file
+ *
+ * so that "rom frames file" in a job file plays it again. After -t
+ * seconds (60 by default) the totals go to stderr. The buttons of a
+ * run come from a seed, so a snapshot only keeps the one it was
+ * made from, the run's length and the snapshot before.
+ */
+
+#define MAXSNAPS 1024
+#define MAXFOUND 100
+#define HANG 600
+#define SPIN 16
+
+struct snap
+{
+	int parent, frames, ready;
+	unsigned seed;
+};
+
+/* what a worker is on, for when it dies */
+struct slot
+{
+	int snap, frames;
+	unsigned seed;
+};
+
+struct fuzz
+{
+	int nsnaps, found, crashes, hangs;
+	long long runs, frames;
+};
+
+static struct fuzz *fz;
+static struct snap *snaps;
+static struct slot *slots;
+static unsigned char *states, *covermap;
+static int statesize, runlen = 900;
+
+struct seq
+{
+	unsigned s;
+	int hold, held;
+};
+
+static unsigned rnd(unsigned *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+/* the next frame's buttons: held for 1 to 32 frames at a time, mostly
+   one button, sometimes two or none */
+static int press(struct seq *q)
+{
+	unsigned r;
+
+	if (--q->hold > 0) return q->held;
+	q->hold = 1 + rnd(&q->s) % 32;
+	r = rnd(&q->s);
+	q->held = r & 3 ? 1 << (r >> 2 & 7) : 0;
+	if (!(r & 0x300)) q->held |= 1 << (r >> 10 & 7);
+	return q->held;
+}
+
+/* the buttons from power on to frames frames into run seed on
+   snapshot n, as an inputs file */
+static int writeinputs(char *fn, int n, unsigned seed, int frames)
+{
+	FILE *f;
+	struct seq q;
+	int chain[MAXSNAPS], depth = 0, at, i, k, b, last = 0;
+
+	if (!(f = fopen(fn, "w"))) return -1;
+	for (; n > 0; n = snaps[n].parent)
+		chain[depth++] = n;
+	at = snaps[0].frames;
+	fprintf(f, "0 0\n");
+	for (k = depth; k >= 0; k--)
+	{
+		q.s = k ? snaps[chain[k-1]].seed : seed;
+		q.hold = q.held = 0;
+		for (i = 0; i < (k ? snaps[chain[k-1]].frames : frames); i++, at++)
+			if ((b = press(&q)) != last)
+				fprintf(f, "%d %x\n", at, last = b);
+	}
+	fclose(f);
+	return at;
+}
+
+static void found(char *dir, char *rom, char *kind, struct slot *w)
+{
+	char fn[MAXLINE + 32];
+	int n = __atomic_fetch_add(&fz->found, 1, __ATOMIC_RELAXED), frames;
+
+	if (n >= MAXFOUND) return;
+	snprintf(fn, sizeof fn, "%s/%s-%d.in", dir, kind, n + 1);
+	if ((frames = writeinputs(fn, w->snap, w->seed, w->frames)) < 0)
+		report("%s error cannot write %s\n", rom, fn);
+	else report("%s %s %d %s\n", rom, kind, frames, fn);
+}
+
+static void fuzzer(int w, char *dir, char *rom)
+{
+	struct slot *me = &slots[w];
+	struct seq q;
+	unsigned rng = 2463534242u + w * 7919u;
+	int s, n, f, spin;
+	char *kind;
+
+	pin(w);
+	for (;;)
+	{
+		n = __atomic_load_n(&fz->nsnaps, __ATOMIC_RELAXED);
+		s = rnd(&rng) % (n < MAXSNAPS ? n : MAXSNAPS);
+		if (!__atomic_load_n(&snaps[s].ready, __ATOMIC_ACQUIRE)) continue;
+		me->snap = s;
+		me->seed = q.s = rnd(&rng) | 1;
+		me->frames = 0;
+		q.hold = q.held = 0;
+		gb_load_state(states + s * statesize, statesize);
+		gb_cover_new();
+		gb_pc_span();
+		kind = 0;
+		for (f = spin = 0; f < runlen && !kind; f++)
+		{
+			gb_set_input(press(&q));
+			gb_run_frame();
+			me->frames = f + 1;
+			spin = gb_pc_span() <= SPIN ? spin + 1 : 0;
+			if (gb_dead()) kind = "dead";
+			else if (spin >= HANG) kind = "spin";
+		}
+		__atomic_fetch_add(&fz->runs, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&fz->frames, f, __ATOMIC_RELAXED);
+		if (kind)
+		{
+			__atomic_fetch_add(&fz->hangs, 1, __ATOMIC_RELAXED);
+			found(dir, rom, kind, me);
+			continue;
+		}
+		if (!gb_cover_new()) continue;
+		if ((s = __atomic_fetch_add(&fz->nsnaps, 1, __ATOMIC_RELAXED)) >= MAXSNAPS)
+		{
+			fz->nsnaps = MAXSNAPS;
+			continue;
+		}
+		gb_save_state(states + s * statesize, statesize);
+		snaps[s].parent = me->snap;
+		snaps[s].seed = me->seed;
+		snaps[s].frames = runlen;
+		__atomic_store_n(&snaps[s].ready, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void fuzz(char *dir, char *rom, int warm, int workers, int seconds)
+{
+	pid_t *pid;
+	long start = micros();
+	int i, status, covered = 0, size;
+	unsigned char *p;
+
+	if (load(rom, rom)) exit(1);
+	for (i = 0; i < warm; i++)
+		gb_run_frame();
+	statesize = gb_state_size();
+	size = sizeof *fz + MAXSNAPS * (sizeof *snaps + statesize)
+		+ workers * sizeof *slots + gb_cover_size();
+	if (!(pid = calloc(workers, sizeof *pid))
+		|| (p = mmap(0, size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+	fz = (struct fuzz *)p;
+	snaps = (struct snap *)(fz + 1);
+	slots = (struct slot *)(snaps + MAXSNAPS);
+	states = (unsigned char *)(slots + workers);
+	covermap = states + MAXSNAPS * statesize;
+	gb_save_state(states, statesize);
+	snaps[0].parent = -1;
+	snaps[0].frames = warm;
+	snaps[0].ready = 1;
+	fz->nsnaps = 1;
+	gb_cover(covermap);
+
+	fflush(stdout);
+	for (;;)
+	{
+		for (i = 0; i < workers; i++)
+		{
+			if (pid[i] > 0) continue;
+			if ((pid[i] = fork()) < 0)
+			{
+				perror("fork");
+				exit(1);
+			}
+			if (!pid[i]) fuzzer(i, dir, rom);
+		}
+		if (micros() - start >= seconds * 1000000L) break;
+		usleep(100000);
+		while ((status = waitpid(-1, &i, WNOHANG)) > 0)
+		{
+			/* a worker only ever stops by dying */
+			for (i = 0; i < workers && pid[i] != status; i++);
+			if (i == workers) continue;
+			pid[i] = 0;
+			fz->crashes++;
+			/* it died in the frame after the last it finished */
+			slots[i].frames++;
+			found(dir, rom, "crash", &slots[i]);
+		}
+	}
+	for (i = 0; i < workers; i++)
+		kill(pid[i], SIGKILL);
+	while (wait(&status) > 0);
+	for (i = 0; i < gb_cover_size(); i++)
+		covered += covermap[i];
+	fprintf(stderr, "%lld runs, %lld frames, %d snapshots, %d bytes of code, "
+		"%d crashes, %d hangs, %ld ms\n", fz->runs, fz->frames,
+		fz->nsnaps, covered, fz->crashes, fz->hangs,
+		(micros() - start) / 1000);
+	exit(fz->crashes || fz->hangs);
+}
+
+/*
+ * With -d port the job file is dealt out over tcp instead, to
+ * machines running -w host:port, and the results come back here to
+ * be printed as above. Each worker process on those machines asks
+ * for a job at a time with "next\n", and is told
+ *
+ *   job n frames rom inputs state path
+ *
+ * where rom, inputs and state name the files' contents by a 64 bit
+ * FNV-1a hash, "-" for none, and path is the rom's name here, for
+ * the result line. It fetches the files it doesn't already have in
+ * its cache directory (-C, /tmp/gnuboy-batch by default) with
+ * "get hash\n", which is answered with "hash length\n" and the bytes,
+ * runs the job in a fresh process, as here, and sends back
+ *
+ *   done n failed line
+ *
+ * "wait\n" means every job is out, but some may come back: a job
+ * whose worker goes away before it's done is dealt again. "none\n"
+ * means they're all done. Since a job runs from the same bytes with
+ * the same buttons wherever it is, the hashes it ends with are the
+ * same whichever machine ran it; only fps says where.
+ */
+
+#define MAXCONNS 256
+
+struct conn
+{
+	int fd, job, len;
+	char buf[MAXLINE];
+};
+
+/* what a file a job names hashes to, or -1 if it can't be read */
+static int hashfile(char *fn, char *hash)
+{
+	void *data;
+	int len;
+
+	if (!fn)
+	{
+		strcpy(hash, "-");
+		return 0;
+	}
+	if (!(data = loadfile(fn, &len))) return -1;
+	sprintf(hash, "%016llx", fnv64(data, len));
+	free(data);
+	return 0;
+}
+
+static void sendfile(int fd, char *hash)
+{
+	char h[24], line[64], *files[3];
+	void *data = 0;
+	int i, k, len = -1;
+
+	for (i = 0; i < njobs && !data; i++)
+	{
+		files[0] = jobs[i].rom;
+		files[1] = jobs[i].inputs;
+		files[2] = jobs[i].state;
+		for (k = 0; k < 3 && !data; k++)
+			if (files[k] && !hashfile(files[k], h) && !strcmp(h, hash))
+				data = loadfile(files[k], &len);
+	}
+	sprintf(line, "%s %d\n", hash, data ? len : -1);
+	if (!writeall(fd, line, strlen(line)) && data)
+		writeall(fd, data, len);
+	free(data);
+}
+
+static int listento(char *port)
+{
+	struct addrinfo hints, *ai;
+	int s, on = 1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(0, port, &hints, &ai))
+	{
+		fprintf(stderr, "%s: bad port\n", port);
+		exit(1);
+	}
+	if ((s = socket(ai->ai_family, SOCK_STREAM, 0)) < 0
+		|| setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0
+		|| bind(s, ai->ai_addr, ai->ai_addrlen) < 0
+		|| listen(s, 64) < 0)
+	{
+		perror(port);
+		exit(1);
+	}
+	freeaddrinfo(ai);
+	return s;
+}
+
+static void deal(char *port, char *jobfile)
+{
+	struct pollfd pf[MAXCONNS + 1];
+	struct conn c[MAXCONNS];
+	char *state = 0, *line, *p, rom[24], in[24], st[24], out[MAXLINE * 2];
+	int n = 0, done = 0, failed = 0, i, k, r, j;
+	long start;
+
+	loadjobs(jobfile);
+	if (njobs && !(state = calloc(njobs, 1))) exit(1);
+	pf[0].fd = listento(port);
+	pf[0].events = POLLIN;
+	/* a worker that goes away mid write mustn't take us with it */
+	signal(SIGPIPE, SIG_IGN);
+	start = micros();
+	/* once they're all done, until every worker has been told so */
+	while (done < njobs || n)
+	{
+		for (i = 0; i < n; i++)
+		{
+			pf[i+1].fd = c[i].fd;
+			pf[i+1].events = POLLIN;
+		}
+		if (poll(pf, n + 1, -1) < 0) continue;
+		if ((pf[0].revents & POLLIN) && n < MAXCONNS
+			&& (c[n].fd = accept(pf[0].fd, 0, 0)) >= 0)
+		{
+			c[n].job = -1;
+			c[n].len = 0;
+			pf[++n].revents = 0;
+		}
+		for (i = 0; i < n; i++)
+		{
+			if (!(pf[i+1].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+			r = read(c[i].fd, c[i].buf + c[i].len, sizeof c[i].buf - 1 - c[i].len);
+			if (r > 0) c[i].len += r;
+			c[i].buf[c[i].len] = 0;
+			while (r > 0 && (p = strchr(c[i].buf, '\n')))
+			{
+				*p = 0;
+				line = c[i].buf;
+				if (!strcmp(line, "next"))
+				{
+					for (j = 0; j < njobs && state[j]; j++);
+					if (j == njobs)
+						sprintf(out, done == njobs ? "none\n" : "wait\n");
+					else if (hashfile(jobs[j].rom, rom) || hashfile(jobs[j].inputs, in)
+						|| hashfile(jobs[j].state, st))
+					{
+						report("%d %s error cannot read its files\n", j+1, jobs[j].rom);
+						state[j] = 2;
+						done++;
+						failed++;
+						sprintf(out, "wait\n");
+					}
+					else
+					{
+						snprintf(out, sizeof out, "job %d %d %s %s %s %s %s\n",
+							j+1, jobs[j].frames, rom, in, st, jobs[j].rom,
+							jobs[j].until ? jobs[j].until : "");
+						state[j] = 1;
+						c[i].job = j;
+					}
+					if (writeall(c[i].fd, out, strlen(out))) r = 0;
+				}
+				else if (!strncmp(line, "get ", 4))
+					sendfile(c[i].fd, line + 4);
+				else if (sscanf(line, "done %d %d %n", &j, &k, &r) == 2
+					&& j == c[i].job + 1 && state[j-1] == 1)
+				{
+					report("%s\n", line + r);
+					state[j-1] = 2;
+					c[i].job = -1;
+					done++;
+					failed += k != 0;
+					r = 1;
+				}
+				else r = 0;
+				c[i].len -= p + 1 - c[i].buf;
+				memmove(c[i].buf, p + 1, c[i].len + 1);
+			}
+			if (r > 0 && c[i].len < (int)sizeof c[i].buf - 1) continue;
+			/* gone, or talking nonsense: its job goes back in the queue */
+			close(c[i].fd);
+			if (c[i].job >= 0 && state[c[i].job] == 1)
+				state[c[i].job] = 0;
+			c[i] = c[--n];
+			pf[i+1].revents = pf[n+1].revents;
+			i--;
+		}
+	}
+	fprintf(stderr, "%d jobs, %d failed, %ld ms\n", njobs, failed,
+		(micros() - start) / 1000);
+	exit(failed ? 1 : 0);
+}
+
+/* the cached copy of the file hash names, fetched if it isn't there */
+static char *fetch(int s, FILE *in, char *hash)
+{
+	static char fn[3][MAXLINE + 32];
+	static int k;
+	char line[MAXLINE], tmp[MAXLINE + 48], *buf;
+	struct stat st;
+	FILE *f;
+	int len;
+
+	if (!strcmp(hash, "-")) return 0;
+	k = (k + 1) % 3;
+	snprintf(fn[k], sizeof fn[k], "%s/%s", cachedir, hash);
+	if (!stat(fn[k], &st)) return fn[k];
+	snprintf(line, sizeof line, "get %s\n", hash);
+	if (writeall(s, line, strlen(line)) || !fgets(line, sizeof line, in)
+		|| sscanf(line, "%*s %d", &len) != 1 || len < 0
+		|| !(buf = malloc(len + 1)))
+		return 0;
+	if (fread(buf, 1, len, in) != (size_t)len)
+	{
+		free(buf);
+		return 0;
+	}
+	/* others here may be fetching it too; see rom_cachestore */
+	snprintf(tmp, sizeof tmp, "%s.%d", fn[k], (int)getpid());
+	if ((f = fopen(tmp, "wb")))
+	{
+		len = fwrite(buf, 1, len, f) == (size_t)len;
+		if (fclose(f) || !len || rename(tmp, fn[k])) remove(tmp);
+	}
+	free(buf);
+	return stat(fn[k], &st) ? 0 : fn[k];
+}
+
+/* one worker process on a -w machine: jobs until there are none */
+static int worker(char *addr)
+{
+	struct addrinfo hints, *ai;
+	char host[MAXLINE], *port, line[MAXLINE * 2], out[MAXLINE * 2 + 32];
+	char rom[24], in[24], st[24], path[MAXLINE], tag[MAXLINE + 16];
+	char *romfn, *infn, *stfn, *until;
+	int s, n, frames, fd[2], len, r, status, at;
+	pid_t pid;
+	FILE *f;
+
+	snprintf(host, sizeof host, "%s", addr);
+	if (!(port = strrchr(host, ':'))) return 1;
+	*(port++) = 0;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai)) return 1;
+	if ((s = socket(ai->ai_family, SOCK_STREAM, 0)) < 0
+		|| connect(s, ai->ai_addr, ai->ai_addrlen) < 0
+		|| !(f = fdopen(s, "r")))
+	{
+		perror(addr);
+		return 1;
+	}
+	freeaddrinfo(ai);
+	for (;;)
+	{
+		if (writeall(s, "next\n", 5) || !fgets(line, sizeof line, f))
+			return 1;
+		if (!strcmp(line, "none\n")) return 0;
+		if (!strcmp(line, "wait\n"))
+		{
+			sleep(1);
+			continue;
+		}
+		if (sscanf(line, "job %d %d %23s %23s %23s %1023s %n", &n, &frames,
+			rom, in, st, path, &at) != 6)
+			return 1;
+		/* whatever's left are its stop conditions */
+		until = line + at;
+		until[strcspn(until, "\n")] = 0;
+		sprintf(tag, "%d %s", n, path);
+		romfn = fetch(s, f, rom);
+		infn = fetch(s, f, in);
+		stfn = fetch(s, f, st);
+		if (!romfn || (!infn && strcmp(in, "-")) || (!stfn && strcmp(st, "-")))
+		{
+			snprintf(out, sizeof out, "done %d 1 %s error cannot fetch its files\n", n, tag);
+			if (writeall(s, out, strlen(out))) return 1;
+			continue;
+		}
+		if (pipe(fd) < 0) return 1;
+		fflush(stdout);
+		if (!(pid = fork()))
+		{
+			close(fd[0]);
+			dup2(fd[1], 1);
+			r = job(tag, romfn, frames, infn, stfn, until, -1);
+			gb_diag_flush();
+			_exit(r);
+		}
+		close(fd[1]);
+		for (len = 0; (r = read(fd[0], line + len, sizeof line - 1 - len)) > 0; len += r);
+		line[len] = 0;
+		close(fd[0]);
+		if (pid < 0 || waitpid(pid, &status, 0) < 0) return 1;
+		/* what it said on stderr stays here, so say something */
+		if (!len && WIFSIGNALED(status))
+			len = sprintf(line, "%s error signal %d\n", tag, WTERMSIG(status));
+		else if (!len)
+			len = sprintf(line, "%s error exit %d\n", tag, WEXITSTATUS(status));
+		if (line[len-1] != '\n') strcpy(line + len, "\n");
+		snprintf(out, sizeof out, "done %d %d %s", n,
+			!WIFEXITED(status) || WEXITSTATUS(status), line);
+		if (writeall(s, out, strlen(out))) return 1;
+	}
+}
+
+static void work(char *addr, int workers)
+{
+	int i, failed = 0, status;
+
+	if (!cachedir) cachedir = "/tmp/gnuboy-batch";
+	mkdir(cachedir, 0777);
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < workers; i++)
+		if (!fork())
+		{
+			pin(i);
+			_exit(worker(addr));
+		}
+	while (wait(&status) > 0)
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+	exit(failed);
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-m host:port] [-j workers] [-a ahead] [-p] [-c file] [-C dir] [-P pack] [-k dir [-K frames]] [-u conditions] jobfile\n", name);
+	fprintf(stderr, "       %s [-m host:port] -s socket rom [frames]\n", name);
+	fprintf(stderr, "       %s [-j workers] [-p] [-t seconds] [-l frames] -f dir rom [frames]\n", name);
+	fprintf(stderr, "       %s -d port jobfile\n", name);
+	fprintf(stderr, "       %s [-j workers] [-p] [-C dir] [-P pack] [-k dir [-K frames]] [-u conditions] -w host:port\n", name);
+	fprintf(stderr, "       %s -M pack rom...\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int workers = 0, running = 0, next = 0, started = 0, failed = 0;
+	int prefetch = -1, status, c, w;
+	int seconds = 60, pinned = 0;
+	char *sock = 0, *opfile = 0, *dir = 0, *port = 0, *coord = 0, *make = 0;
+	unsigned long long *hashes;
+	pid_t pid, *onslot;
+	long start;
+
+	while ((c = getopt(argc, argv, "j:a:s:m:c:f:t:l:d:w:C:P:M:k:K:u:p")) != -1)
+	{
+		if (c == 'j') workers = atoi(optarg);
+		else if (c == 'a') prefetch = atoi(optarg);
+		else if (c == 's') sock = optarg;
+		else if (c == 'f') dir = optarg;
+		else if (c == 't') seconds = atoi(optarg);
+		else if (c == 'l') runlen = atoi(optarg);
+		else if (c == 'd') port = optarg;
+		else if (c == 'w') coord = optarg;
+		else if (c == 'C') cachedir = optarg;
+		else if (c == 'P') packfile = optarg;
+		else if (c == 'M') make = optarg;
+		else if (c == 'k') ckdir = optarg;
+		else if (c == 'K' && atoi(optarg) > 0) ckevery = atoi(optarg);
+		else if (c == 'u') untilall = optarg;
+		else if (c == 'p') pinned = 1;
+		else if (c == 'm') statsd_open(optarg);
+		else if (c == 'c') opfile = optarg;
+		else usage(argv[0]);
+	}
+	if (make)
+	{
+		if (optind == argc) usage(argv[0]);
+		gb_init(0);
+		if (!(hashes = calloc(argc - optind, sizeof *hashes))
+			|| gb_rom_pack_make(make, argv + optind, argc - optind, hashes))
+		{
+			fprintf(stderr, "%s", hashes ? gb_error() : "out of memory\n");
+			exit(1);
+		}
+		for (c = optind; c < argc; c++)
+			printf("%016llx %s\n", hashes[c - optind], argv[c]);
+		exit(0);
+	}
+	/* mapped here, so every worker forked from now on has it */
+	if (packfile)
+	{
+		gb_init(0);
+		if (gb_rom_pack(packfile))
+		{
+			fprintf(stderr, "%s", gb_error());
+			exit(1);
+		}
+	}
+	if (sock)
+	{
+		if (optind != argc - 1 && optind != argc - 2) usage(argv[0]);
+		serve(sock, argv[optind],
+			optind == argc - 2 ? atoi(argv[optind+1]) : 0);
+	}
+	if (pinned) findcores();
+	if (packfile) copypack();
+	if (workers <= 0) workers = ncores ? ncores : sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0) workers = 1;
+	if (coord)
+	{
+		if (optind != argc) usage(argv[0]);
+		work(coord, workers);
+	}
+	if (port)
+	{
+		if (optind != argc - 1) usage(argv[0]);
+		deal(port, argv[optind]);
+	}
+	if (dir)
+	{
+		if ((optind != argc - 1 && optind != argc - 2) || runlen <= 0)
+			usage(argv[0]);
+		fuzz(dir, argv[optind], optind == argc - 2 ? atoi(argv[optind+1]) : 0,
+			workers, seconds);
+	}
+	if (optind != argc - 1) usage(argv[0]);
+	loadjobs(argv[optind]);
+	if (njobs && (!(pids = calloc(njobs, sizeof *pids))
+		|| !(gofd = malloc(njobs * sizeof *gofd))))
+		exit(1);
+	for (c = 0; c < njobs; c++) gofd[c] = -1;
+	if (prefetch < 0) prefetch = workers;
+	/* a job that failed to load may be gone before it's told to go */
+	signal(SIGPIPE, SIG_IGN);
+	if (!(onslot = calloc(workers, sizeof *onslot))) exit(1);
+	if (opfile && (opshared = mmap(0, GB_OPCOUNTS * sizeof *opshared,
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+
+	start = micros();
+	while (started < njobs || running)
+	{
+		if (next < njobs && next - started < prefetch + workers - running)
+		{
+			if ((pid = ahead(next, started)) >= 0)
+			{
+				pids[next++] = pid;
+				continue;
+			}
+			perror("fork");
+			if (!running && started == next) exit(1);
+			/* no more than are going already, from now on */
+			workers = running ? running : 1;
+			prefetch = next - started - workers + running;
+			if (prefetch < 0) prefetch = 0;
+		}
+		if (started < next && running < workers)
+		{
+			/* one that failed to load has already been and gone */
+			if (gofd[started] < 0)
+			{
+				started++;
+				continue;
+			}
+			for (w = 0; onslot[w]; w++);
+			for (c = w; nnodes > 1 && c < workers; c++)
+				if (!onslot[c] && nodeof[c % ncores] == started % nnodes)
+				{
+					w = c;
+					break;
+				}
+			if (write(gofd[started], &w, sizeof w) == sizeof w)
+			{
+				onslot[w] = pids[started];
+				running++;
+			}
+			close(gofd[started]);
+			gofd[started++] = -1;
+			continue;
+		}
+		if ((pid = wait(&status)) < 0) break;
+		for (w = 0; w < workers && onslot[w] != pid; w++);
+		if (w < workers)
+		{
+			onslot[w] = 0;
+			running--;
+		}
+		else
+		{
+			for (c = started; c < next && pids[c] != pid; c++);
+			if (c < next && gofd[c] >= 0)
+			{
+				close(gofd[c]);
+				gofd[c] = -1;
+			}
+		}
+		ended(!WIFEXITED(status) || WEXITSTATUS(status));
+		if (WIFEXITED(status) && !WEXITSTATUS(status)) continue;
+		failed++;
+		/* a worker that died can't have said so itself */
+		if (!WIFSIGNALED(status)) continue;
+		for (c = 0; c < next && pids[c] != pid; c++);
+		if (c < next)
+			report("%d %s error signal %d\n", c+1, jobs[c].rom,
+				WTERMSIG(status));
+	}
+	fprintf(stderr, "%d jobs, %d failed, %ld ms\n", njobs, failed,
+		(micros() - start) / 1000);
+	if (opfile)
+	{
+		memcpy(gb_op_counts(), opshared, GB_OPCOUNTS * sizeof *opshared);
+		if (gb_op_dump(opfile))
+		{
+			fprintf(stderr, "%s: nothing counted or cannot write\n", opfile);
+			failed++;
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,645 @@
+/*
+ * microbench.c
+ *
+ * gnuboy-microbench: times the hot kernels of the core one at a time
+ * on synthetic input, so that a slowdown shows up in the kernel that
+ * caused it rather than somewhere in a whole game's fps. It's built
+ * on libgnuboy: a small generated rom is loaded and run for a few
+ * frames, then vram, oam and the palettes are filled with random but
+ * plausible contents (every tile used, a window halfway down, all 40
+ * sprites on screen) and each kernel is called directly, over and
+ * over, until it has taken long enough to time.
+ *
+ *   gnuboy-microbench [-c] [-m] [name ...]
+ *
+ * runs the named benchmarks, or all of them; -c does it in cgb mode.
+ * -m adds the level 1 data cache and last level cache misses each
+ * call took, from the cpu's counters, on linux where the kernel lets
+ * a process count its own; elsewhere it says they can't be had.
+ * The decompression benchmarks need gzip and xz on the path to make
+ * their input and are skipped without them. "make bench" builds and
+ * runs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "defs.h"
+#include "regs.h"
+#include "hw.h"
+#include "cpu.h"
+#include "mem.h"
+#include "lcd.h"
+#include "fb.h"
+#include "pcm.h"
+#include "sound.h"
+#include "save.h"
+#include "sys.h"
+#include "fastmem.h"
+#include "refresh.h"
+#include "scaler.h"
+#include "../lib/gnuboy.h"
+
+/* each benchmark runs at least this long */
+#define MINTIME 200000
+
+static un32 seed = 1;
+
+static un32 rnd()
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* a rom that turns on the lcd with background, window and sprites
+   and then waits in halt, so the state around the kernels is one the
+   core really gets into. cgb says what to put in the header */
+static byte *mkrom(int size, int cgb)
+{
+	static const byte code[] =
+	{
+		0x3E, 0xE3, 0xE0, 0x40, /* ld a,$e3; ldh (LCDC),a */
+		0x3E, 0x40, 0xE0, 0x4A, /* ld a,$40; ldh (WY),a */
+		0x3E, 0x57, 0xE0, 0x4B, /* ld a,$57; ldh (WX),a */
+		0x3E, 0x80, 0xE0, 0x26, /* ld a,$80; ldh (NR52),a */
+		0x3E, 0xFF, 0xE0, 0x25, /* ld a,$ff; ldh (NR51),a */
+		0x3E, 0x01, 0xE0, 0xFF, /* ld a,$01; ldh (IE),a */
+		0xFB,                   /* ei */
+		0x76, 0x18, 0xFD,       /* halt; jr -3 */
+	};
+	/* for cpu_loop: a copy loop and a poll, made of the pairs of
+	   instructions cpu.c fuses with NEXT2 and one it doesn't */
+	static const byte loop[] =
+	{
+		0xAF, 0xE0, 0x40,       /* xor a; ldh (LCDC),a */
+		0xE0, 0x26,             /* ldh (NR52),a */
+		0x21, 0x00, 0xC0,       /* ld hl,$c000 */
+		0x11, 0x00, 0xD0,       /* ld de,$d000 */
+		0x06, 0x40,             /* ld b,$40 */
+		0x2A, 0x12, 0x13,       /* loop: ld a,(hl+); ld (de),a; inc de */
+		0xFE, 0x07, 0x20, 0x01, /* cp 7; jr nz,+1 */
+		0x3C,                   /* inc a */
+		0x05, 0x20, 0xF5,       /* dec b; jr nz,loop */
+		0xF0, 0x44, 0xE6, 0x03, /* ldh a,(LY); and 3 */
+		0x18, 0xE7,             /* jr $205 */
+	};
+	/* for cpu_copy: the copy and fill loops cpu.c runs in bulk */
+	static const byte copy[] =
+	{
+		0xAF, 0xE0, 0x40,       /* xor a; ldh (LCDC),a */
+		0xE0, 0x26,             /* ldh (NR52),a */
+		0x21, 0x00, 0xC0,       /* ld hl,$c000 */
+		0x11, 0x00, 0xD0,       /* ld de,$d000 */
+		0x01, 0x00, 0x08,       /* ld bc,$800 */
+		0x2A, 0x12, 0x13, 0x0B, /* copy: ld a,(hl+); ld (de),a; inc de; dec bc */
+		0x78, 0xB1, 0x20, 0xF8, /* ld a,b; or c; jr nz,copy */
+		0x21, 0x00, 0xC8,       /* ld hl,$c800 */
+		0x06, 0x00,             /* ld b,0 */
+		0x22, 0x05, 0x20, 0xFC, /* fill: ld (hl+),a; dec b; jr nz,fill */
+		0x18, 0xE4,             /* jr $245 */
+	};
+	byte *rom = malloc(size);
+	int i;
+
+	/* code-like filler: short runs of a few common opcodes with
+	   some random operands, so it compresses about as well as a
+	   real rom does */
+	for (i = 0; i < size; i++)
+		rom[i] = (rnd() & 7) ? "\x3E\xE0\x21\x2A\x22\xC9\xCD\x18"[rnd() & 7]
+			: rnd();
+	memset(rom + 0x40, 0xD9, 8); /* vblank: reti */
+	memcpy(rom + 0x100, "\x00\xC3\x50\x01", 4);
+	memset(rom + 0x104, 0, 0x4C);
+	memcpy(rom + 0x134, "MICROBENCH", 10);
+	rom[0x143] = cgb ? 0x80 : 0;
+	rom[0x147] = 0x19; /* mbc5 */
+	for (i = 0; 32768 << i < size; i++);
+	rom[0x148] = i;
+	memcpy(rom + 0x150, code, sizeof code);
+	memcpy(rom + 0x200, loop, sizeof loop);
+	memcpy(rom + 0x240, copy, sizeof copy);
+	return rom;
+}
+
+static void fill()
+{
+	int i;
+
+	for (i = 0; i < 0x1800; i++)
+		lcd.vbank[0][i] = lcd.vbank[1][i] = rnd();
+	for (i = 0x1800; i < 0x2000; i++)
+	{
+		lcd.vbank[0][i] = rnd();
+		lcd.vbank[1][i] = rnd() & 0xEF;
+	}
+	for (i = 0; i < 40; i++)
+	{
+		lcd.oam.obj[i].y = 16 + rnd() % 144;
+		lcd.oam.obj[i].x = 8 + rnd() % 160;
+		lcd.oam.obj[i].pat = rnd();
+		lcd.oam.obj[i].flags = rnd();
+	}
+	for (i = 0; i < 128; i++)
+		lcd.pal[i] = rnd();
+	R_BGP = 0xE4;
+	R_OBP0 = 0xD2;
+	R_OBP1 = 0x1B;
+	R_SCX = 13;
+	R_SCY = 37;
+	vram_dirty();
+	pal_dirty();
+	oam_dirty();
+	updatepatpix();
+}
+
+/* what refreshline sets up before drawing line l */
+static void setline(int l)
+{
+	scan.l = l;
+	scan.x = R_SCX;
+	scan.y = (R_SCY + l) & 0xff;
+	scan.s = scan.x >> 3;
+	scan.t = scan.y >> 3;
+	scan.u = scan.x & 7;
+	scan.v = scan.y & 7;
+	scan.wy = R_WY;
+	scan.wx = l >= R_WY ? R_WX - 7 : 160;
+	scan.wt = (l - R_WY) >> 3;
+	scan.wv = (l - R_WY) & 7;
+}
+
+
+static void b_updatepatpix()
+{
+	vram_dirty();
+	updatepatpix();
+}
+
+static void b_spr_enum()
+{
+	int l;
+
+	for (l = 0; l < 144; l++)
+	{
+		setline(l);
+		spr_enum();
+	}
+}
+
+static void b_tilebuf()
+{
+	int l;
+
+	for (l = 0; l < 144; l++)
+	{
+		setline(l);
+		tilebuf();
+	}
+}
+
+static void b_bg_scan()
+{
+	int l;
+
+	for (l = 0; l < 144; l++)
+	{
+		setline(l);
+		tilebuf();
+		if (hw.cgb)
+		{
+			bg_scan_color();
+			wnd_scan_color();
+		}
+		else
+		{
+			bg_scan();
+			wnd_scan();
+		}
+	}
+}
+
+static void b_bg_scan_pri()
+{
+	int l;
+
+	for (l = 0; l < 144; l++)
+	{
+		setline(l);
+		tilebuf();
+		bg_scan_pri();
+		wnd_scan_pri();
+	}
+}
+
+static void b_spr_scan()
+{
+	int l;
+
+	for (l = 0; l < 144; l++)
+	{
+		setline(l);
+		spr_enum();
+		spr_scan();
+	}
+}
+
+/* the scalers, a frame's worth of 144 lines from one line of real
+   output; pal is big enough for any pixel size */
+static un32 pal[256];
+static byte out[160*4*4];
+
+#define REFRESH(f) static void b_##f() { \
+	int l; \
+	for (l = 0; l < 144; l++) f(out, scan.buf, pal, 160); }
+
+REFRESH(refresh_1)
+REFRESH(refresh_2)
+REFRESH(refresh_3)
+REFRESH(refresh_4)
+REFRESH(refresh_1_2x)
+REFRESH(refresh_2_2x)
+REFRESH(refresh_3_2x)
+REFRESH(refresh_4_2x)
+REFRESH(refresh_2_3x)
+REFRESH(refresh_3_3x)
+REFRESH(refresh_4_3x)
+REFRESH(refresh_3_4x)
+REFRESH(refresh_4_4x)
+
+/* fb.yuv 2, as yuy2 */
+#define YUV(n) static void b_yuv_##n##x() { \
+	int l; \
+	for (l = 0; l < 144; l++) \
+		refresh_yuv(out, scan.buf, pal, 160, n, 0xff, 0xff0000); }
+
+YUV(1)
+YUV(2)
+YUV(3)
+
+/* xbr over a whole frame in one band, from a picture of blocks and
+   diagonals in a few colors, the kind of thing it finds edges in */
+static un32 pic[144][160], big[144*4][160*4];
+static un16 scratch[SCALER_TMP];
+
+static void mkpic()
+{
+	int x, y;
+
+	for (y = 0; y < 144; y++)
+		for (x = 0; x < 160; x++)
+			pic[y][x] = pal[(((x ^ y) >> 2) + (x * y >> 6)) & 7] & 0xffffff;
+}
+
+#define XBR(n) static void b_xbr_##n##x() { \
+	scaler_band(big, sizeof big[0], pic, sizeof pic[0], n, 0, 144, scratch); }
+
+XBR(2)
+XBR(3)
+XBR(4)
+
+/* a frame of sound with all four channels going */
+static void b_sound_mix()
+{
+	pcm.pos = 0;
+	sound_advance(35112);
+	sound_mix();
+}
+
+/* a thousand accesses spread like a game's: mostly rom and wram,
+   some hram and the odd io register */
+static int addrs[1000];
+
+static void mkaddrs()
+{
+	int i, r;
+
+	for (i = 0; i < 1000; i++)
+	{
+		r = rnd() % 100;
+		if (r < 45) addrs[i] = rnd() & 0x7FFF;
+		else if (r < 80) addrs[i] = 0xC000 + (rnd() & 0x1FFF);
+		else if (r < 95) addrs[i] = 0xFF80 + rnd() % 0x7F;
+		else addrs[i] = 0xFF40 + rnd() % 12;
+	}
+}
+
+static volatile int sink;
+
+static void b_readb()
+{
+	int i, s = 0;
+
+	for (i = 0; i < 1000; i++) s += readb(addrs[i]);
+	sink = s;
+}
+
+static void b_readw()
+{
+	int i, s = 0;
+
+	for (i = 0; i < 1000; i++) s += readw(addrs[i]);
+	sink = s;
+}
+
+/* writes go to wram and hram only; rom writes are bank switches */
+static void b_writeb()
+{
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		writeb(addrs[i] < 0x8000 ? 0xC000 | addrs[i] >> 2
+			: addrs[i] >= 0xFF40 && addrs[i] < 0xFF80 ? 0xFF90
+			: addrs[i], i);
+}
+
+static void b_mem_updatemap()
+{
+	mem_updatemap();
+}
+
+static byte *state;
+static int statelen;
+
+static void b_savestate()
+{
+	savestate_to_buffer(state, statelen);
+}
+
+static void b_loadstate()
+{
+	loadstate_from_buffer(state, statelen);
+	vram_dirty();
+	pal_dirty();
+	sound_dirty();
+	mem_updatemap();
+}
+
+/* a frame's worth of cycles of the interpreter itself, on one of the
+   loops mkrom puts in, with interrupts, the lcd and sound off so that
+   nothing else is timed with it */
+static void cpu_at(int pc)
+{
+	cpu.pc.w[LO] = pc;
+	cpu.halt = 0;
+	cpu.ime = cpu.ima = 0;
+	cpu_emulate(70224);
+}
+
+static void b_cpu_loop()
+{
+	cpu_at(0x200);
+}
+
+static void b_cpu_copy()
+{
+	cpu_at(0x240);
+}
+
+/* compressed roms, made with the real tools */
+static byte *zrom[2];
+static int zlen[2];
+
+static byte *compress(char *cmd, byte *data, int len, int *outlen)
+{
+	char tmp[] = "/tmp/gnuboy-microbenchXXXXXX", *line;
+	FILE *f;
+	byte *out;
+	int fd;
+
+	if ((fd = mkstemp(tmp)) < 0) return 0;
+	close(fd);
+	line = malloc(strlen(cmd) + strlen(tmp) + 32);
+	sprintf(line, "%s > %s 2>/dev/null", cmd, tmp);
+	f = popen(line, "w");
+	free(line);
+	out = 0;
+	if (f && fwrite(data, 1, len, f) == len && !pclose(f)
+		&& (f = fopen(tmp, "rb")))
+	{
+		fseek(f, 0, SEEK_END);
+		*outlen = ftell(f);
+		rewind(f);
+		out = malloc(*outlen);
+		if (*outlen <= 0 || fread(out, 1, *outlen, f) != *outlen)
+		{
+			free(out);
+			out = 0;
+		}
+		fclose(f);
+	}
+	remove(tmp);
+	return out;
+}
+
+static void b_gunzip()
+{
+	gb_load_rom_mem(zrom[0], zlen[0]);
+}
+
+static void b_unxz()
+{
+	gb_load_rom_mem(zrom[1], zlen[1]);
+}
+
+static struct
+{
+	char *name;
+	void (*fn)();
+	char *unit;
+} benches[] =
+{
+	{ "updatepatpix", b_updatepatpix, "all tiles" },
+	{ "spr_enum", b_spr_enum, "frame" },
+	{ "tilebuf", b_tilebuf, "frame" },
+	{ "bg_scan", b_bg_scan, "frame" },
+	{ "bg_scan_pri", b_bg_scan_pri, "frame" },
+	{ "spr_scan", b_spr_scan, "frame" },
+	{ "refresh_1", b_refresh_1, "frame" },
+	{ "refresh_2", b_refresh_2, "frame" },
+	{ "refresh_3", b_refresh_3, "frame" },
+	{ "refresh_4", b_refresh_4, "frame" },
+	{ "refresh_1_2x", b_refresh_1_2x, "frame" },
+	{ "refresh_2_2x", b_refresh_2_2x, "frame" },
+	{ "refresh_3_2x", b_refresh_3_2x, "frame" },
+	{ "refresh_4_2x", b_refresh_4_2x, "frame" },
+	{ "refresh_2_3x", b_refresh_2_3x, "frame" },
+	{ "refresh_3_3x", b_refresh_3_3x, "frame" },
+	{ "refresh_4_3x", b_refresh_4_3x, "frame" },
+	{ "refresh_3_4x", b_refresh_3_4x, "frame" },
+	{ "refresh_4_4x", b_refresh_4_4x, "frame" },
+	{ "yuv_1x", b_yuv_1x, "frame" },
+	{ "yuv_2x", b_yuv_2x, "frame" },
+	{ "yuv_3x", b_yuv_3x, "frame" },
+	{ "xbr_2x", b_xbr_2x, "frame" },
+	{ "xbr_3x", b_xbr_3x, "frame" },
+	{ "xbr_4x", b_xbr_4x, "frame" },
+	{ "sound_mix", b_sound_mix, "frame" },
+	{ "readb", b_readb, "1000" },
+	{ "readw", b_readw, "1000" },
+	{ "writeb", b_writeb, "1000" },
+	{ "mem_updatemap", b_mem_updatemap, "call" },
+	{ "savestate", b_savestate, "state" },
+	{ "loadstate", b_loadstate, "state" },
+	{ "cpu_loop", b_cpu_loop, "frame" },
+	{ "cpu_copy", b_cpu_copy, "frame" },
+	{ "gunzip", b_gunzip, "1MB rom" },
+	{ "unxz", b_unxz, "1MB rom" },
+	{ 0 }
+};
+
+/* l1d read misses and last level misses, -1 where there's no counter */
+static int counters[2] = { -1, -1 };
+
+static void countmisses()
+{
+#ifdef __linux__
+	static const unsigned long long config[2] =
+	{
+		PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+			| PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+		PERF_COUNT_HW_CACHE_MISSES
+	};
+	struct perf_event_attr a;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		memset(&a, 0, sizeof a);
+		a.size = sizeof a;
+		a.type = i ? PERF_TYPE_HARDWARE : PERF_TYPE_HW_CACHE;
+		a.config = config[i];
+		a.disabled = 1;
+		a.exclude_kernel = 1;
+		a.exclude_hv = 1;
+		counters[i] = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+	}
+#endif
+	if (counters[0] < 0 && counters[1] < 0)
+		fprintf(stderr, "microbench: no cache miss counters here\n");
+}
+
+static void counting(int on)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (counters[i] < 0) continue;
+		if (on) ioctl(counters[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counters[i], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+	}
+#endif
+}
+
+static double misses(int i, long n)
+{
+	long long v;
+
+	if (counters[i] < 0 || read(counters[i], &v, sizeof v) != sizeof v)
+		return -1;
+	return (double)v / n;
+}
+
+static void run(int i)
+{
+	void *timer;
+	long n, k, us;
+
+	benches[i].fn();
+	timer = sys_timer();
+	for (n = 1;; n *= 2)
+	{
+		counting(1);
+		sys_elapsed(timer);
+		for (k = 0; k < n; k++) benches[i].fn();
+		us = sys_elapsed(timer);
+		counting(0);
+		if (us >= MINTIME) break;
+	}
+	printf("%-14s %12.1f ns per %s", benches[i].name,
+		us * 1000.0 / n, benches[i].unit);
+	if (counters[0] >= 0) printf(", %.1f l1d", misses(0, n));
+	if (counters[1] >= 0) printf(", %.1f llc", misses(1, n));
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, cgb = 0, all;
+	byte *rom;
+	const int romsize = 1 << 20;
+
+	for (; argc > 1 && *argv[1] == '-'; argc--, argv++)
+	{
+		if (!strcmp(argv[1], "-c")) cgb = 1;
+		else if (!strcmp(argv[1], "-m")) countmisses();
+		else
+		{
+			fprintf(stderr, "usage: microbench [-c] [-m] [name ...]\n");
+			return 1;
+		}
+	}
+	gb_init(44100);
+	rom = mkrom(romsize, cgb);
+	zrom[0] = compress("gzip -9", rom, romsize, &zlen[0]);
+	zrom[1] = compress("xz", rom, romsize, &zlen[1]);
+	if (gb_load_rom_mem(rom, romsize))
+	{
+		fprintf(stderr, "microbench: %s\n", gb_error());
+		return 1;
+	}
+	for (i = 0; i < 10; i++) gb_run_frame();
+
+	seed = 1;
+	fill();
+	mkaddrs();
+	for (i = 0; i < 256; i++) pal[i] = rnd();
+	mkpic();
+	setline(72);
+	tilebuf();
+	hw.cgb ? bg_scan_color() : bg_scan();
+	statelen = savestate_size();
+	state = malloc(statelen);
+	savestate_to_buffer(state, statelen);
+
+	printf("%s mode\n", hw.cgb ? "cgb" : "dmg");
+	all = argc < 2;
+	for (i = 0; benches[i].name; i++)
+	{
+		for (j = 1; j < argc && strcmp(argv[j], benches[i].name); j++);
+		if (!all && j == argc) continue;
+		if ((benches[i].fn == b_gunzip && !zrom[0])
+			|| (benches[i].fn == b_unxz && !zrom[1]))
+		{
+			printf("%-14s skipped, no compressor\n", benches[i].name);
+			continue;
+		}
+		/* these run the game on from where the rest expect it */
+		if (benches[i].fn == b_cpu_loop || benches[i].fn == b_cpu_copy)
+		{
+			run(i);
+			b_loadstate();
+			continue;
+		}
+		/* the decompression ones reload the rom */
+		if (benches[i].fn == b_gunzip || benches[i].fn == b_unxz)
+		{
+			run(i);
+			gb_load_rom_mem(rom, romsize);
+			gb_run_frame();
+			seed = 1;
+			fill();
+			continue;
+		}
+		run(i);
+	}
+	return 0;
+}
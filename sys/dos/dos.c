@@ -11,6 +11,7 @@ char *strdup();
 #include <stdarg.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <time.h>
 
@@ -37,6 +38,41 @@ int sys_elapsed(uclock_t *cl)
 	return usecs;
 }
 
+unsigned sys_micros()
+{
+	return US(uclock());
+}
+
+int sys_thread(void (*fn)(void *), void *arg)
+{
+	return -1;
+}
+
+void sys_onfork(void (*child)())
+{
+}
+
+/* there's only the one cpu and nothing else to run on it */
+int sys_pin(int cpu, int prio)
+{
+	return cpu > 0 || prio > 0 ? -1 : 0;
+}
+
+int sys_node(int cpu)
+{
+	return cpu < 0;
+}
+
+int sys_pin_node(int node)
+{
+	return node > 0 ? -1 : 0;
+}
+
+char *sys_nodecopy(char *fn, int node)
+{
+	return 0;
+}
+
 void sys_sleep(int us)
 {
 	uclock_t start;
@@ -45,6 +81,51 @@ void sys_sleep(int us)
 	while(US(uclock()-start) < us);
 }
 
+void sys_nap(int us)
+{
+	sys_sleep(us);
+}
+
+int sys_sampler(void (*fn)(), int us)
+{
+	return -1;
+}
+
+/* no sockets; gdbport and linkport do nothing */
+int sys_listen(int port)
+{
+	return -1;
+}
+
+int sys_recv(int fd, int wait)
+{
+	return -1;
+}
+
+int sys_send(int fd, char *buf, int len)
+{
+	return -1;
+}
+
+void sys_hangup(int fd)
+{
+}
+
+int sys_udp(int port, char *host, int peerport)
+{
+	return -1;
+}
+
+int sys_udprecv(int fd, char *buf, int len, int us)
+{
+	return -1;
+}
+
+int sys_udpsend(int fd, char *buf, int len)
+{
+	return -1;
+}
+
 void sys_checkdir(char *path, int wr)
 {
 }
@@ -78,6 +159,37 @@ void sys_sanitize(char *s)
 		if (s[i] == '\\') s[i] = '/';
 }
 
+/* no mmap here, the loader falls back to reading the file */
+void *sys_mapfile(char *fn, int *len, int size, int fill)
+{
+	return 0;
+}
+
+void sys_unmapfile(void *p, int size)
+{
+}
+
+int sys_putfile(char *fn, void *data, int len)
+{
+	char *tmp = malloc(strlen(fn) + 32);
+	int fd, ok = 0;
+
+	if (!tmp) return -1;
+	sprintf(tmp, "%s.%lu.%08lx", fn, (unsigned long)getpid(),
+		(unsigned long)time(0));
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0644)) >= 0)
+	{
+		ok = write(fd, data, len) == len;
+		if (close(fd) || !ok || rename(tmp, fn))
+		{
+			remove(tmp);
+			ok = 0;
+		}
+	}
+	free(tmp);
+	return ok ? 0 : -1;
+}
+
 
 
 
@@ -0,0 +1,355 @@
+/*
+ * drm.c
+ *
+ * Video through the kernel's mode setting (drm/kms), for the console
+ * with no X or SDL, where fbdev is gone or tears. The frame goes
+ * straight into a dumb buffer at the mode's size, scaled by the lcd
+ * code the way it scales into a framebuffer, and that buffer is
+ * scanned out as it is; buffers change over with a page flip at
+ * vblank, so nothing is ever shown half drawn.
+ *
+ * With three buffers (the default) the emulator never waits for the
+ * display: a finished frame is flipped to at the next vblank, and one
+ * finished while the last flip is still waiting (fast forward, say)
+ * is simply never shown. With two, vid_end waits for each flip before
+ * drawing on, which paces the game to the display.
+ *
+ * Input is the console keyboard, as with fbdev (see kb.c).
+ */
+
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+#include <string.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "defs.h"
+#include "fb.h"
+#include "rc.h"
+#include "sys.h"
+
+struct fb fb;
+
+
+#define DRM_DEVICE "/dev/dri/card0"
+static char *drm_device;
+static int drm_buffers = 3;
+static int vmode[3];
+
+rcvar_t vid_exports[] =
+{
+	RCV_VECTOR("vmode", &vmode, 3, "video mode: w h bpp"),
+	RCV_STRING("drm_device", &drm_device, "drm device"),
+	RCV_INT("drm_buffers", &drm_buffers, "buffers to flip between, 2 or 3"),
+	RCV_END
+};
+
+
+static int fd = -1;
+static unsigned conn, crtc;
+static drmModeModeInfo mode;
+static drmModeCrtc *saved;
+static int master = 1;
+
+static struct buf
+{
+	unsigned handle, id, pitch;
+	unsigned long long size;
+	byte *map;
+	int dirty;
+} bufs[3];
+static int nbufs;
+
+/* front is on the screen, pending has a flip waiting on it, back is
+   the one being drawn */
+static int front, pending = -1, back;
+
+
+static int flip(int i)
+{
+	if (drmModePageFlip(fd, crtc, bufs[i].id, DRM_MODE_PAGE_FLIP_EVENT, 0))
+	{
+		/* can't flip now (a vt switch, say): it'll go up with the
+		   next one */
+		front = i;
+		return -1;
+	}
+	pending = i;
+	return 0;
+}
+
+static void flipped(int fd, unsigned seq, unsigned s, unsigned us, void *data)
+{
+	front = pending;
+	pending = -1;
+}
+
+/* the flips that have happened, waiting up to ms for one */
+static void events(int ms)
+{
+	static drmEventContext ctx =
+	{
+		.version = 2,
+		.page_flip_handler = flipped,
+	};
+	struct pollfd p = { fd, POLLIN, 0 };
+
+	while (poll(&p, 1, ms) > 0)
+	{
+		drmHandleEvent(fd, &ctx);
+		ms = 0;
+	}
+}
+
+static int newbuf(struct buf *b, int w, int h)
+{
+	struct drm_mode_create_dumb cr;
+	struct drm_mode_map_dumb mp;
+
+	memset(&cr, 0, sizeof cr);
+	cr.width = w;
+	cr.height = h;
+	cr.bpp = 32;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &cr)) return -1;
+	b->handle = cr.handle;
+	b->pitch = cr.pitch;
+	b->size = cr.size;
+	if (drmModeAddFB(fd, w, h, 24, 32, b->pitch, b->handle, &b->id))
+		return -1;
+	memset(&mp, 0, sizeof mp);
+	mp.handle = b->handle;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mp)) return -1;
+	b->map = mmap(0, b->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, mp.offset);
+	if (b->map == MAP_FAILED)
+	{
+		b->map = 0;
+		return -1;
+	}
+	memset(b->map, 0, b->size);
+	return 0;
+}
+
+static void freebuf(struct buf *b)
+{
+	struct drm_mode_destroy_dumb d;
+
+	if (b->map) munmap(b->map, b->size);
+	if (b->id) drmModeRmFB(fd, b->id);
+	memset(&d, 0, sizeof d);
+	d.handle = b->handle;
+	if (b->handle) drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &d);
+	memset(b, 0, sizeof *b);
+}
+
+/* the first connected output, its crtc, and the mode asked for with
+   vmode or else the one it prefers */
+static void output()
+{
+	drmModeRes *res;
+	drmModeConnector *c = 0;
+	drmModeEncoder *e;
+	int i, j, m;
+
+	if (!(res = drmModeGetResources(fd)))
+		die("%s can't set modes\n", drm_device);
+	for (i = 0; i < res->count_connectors; i++)
+	{
+		c = drmModeGetConnector(fd, res->connectors[i]);
+		if (c && c->connection == DRM_MODE_CONNECTED && c->count_modes)
+			break;
+		drmModeFreeConnector(c);
+		c = 0;
+	}
+	if (!c) die("nothing connected to %s\n", drm_device);
+	conn = c->connector_id;
+	for (m = 0, i = 0; i < c->count_modes; i++)
+	{
+		if (vmode[0] && vmode[1])
+		{
+			if (c->modes[i].hdisplay == vmode[0]
+				&& c->modes[i].vdisplay == vmode[1])
+			{
+				m = i;
+				break;
+			}
+		}
+		else if (c->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+		{
+			m = i;
+			break;
+		}
+	}
+	mode = c->modes[m];
+
+	crtc = 0;
+	if (c->encoder_id && (e = drmModeGetEncoder(fd, c->encoder_id)))
+	{
+		crtc = e->crtc_id;
+		drmModeFreeEncoder(e);
+	}
+	for (i = 0; !crtc && i < c->count_encoders; i++)
+	{
+		if (!(e = drmModeGetEncoder(fd, c->encoders[i]))) continue;
+		for (j = 0; j < res->count_crtcs; j++)
+			if (e->possible_crtcs & (1 << j))
+			{
+				crtc = res->crtcs[j];
+				break;
+			}
+		drmModeFreeEncoder(e);
+	}
+	drmModeFreeConnector(c);
+	drmModeFreeResources(res);
+	if (!crtc) die("no crtc for the output on %s\n", drm_device);
+}
+
+void vid_init()
+{
+	int i;
+
+	kb_init();
+
+	if (!drm_device) drm_device = strdup(DRM_DEVICE);
+	fd = open(drm_device, O_RDWR | O_CLOEXEC);
+	if (fd < 0) die("cannot open %s\n", drm_device);
+	output();
+
+	nbufs = drm_buffers < 3 ? 2 : 3;
+	for (i = 0; i < nbufs; i++)
+		if (newbuf(&bufs[i], mode.hdisplay, mode.vdisplay))
+			die("cannot make a %dx%d buffer on %s\n",
+				mode.hdisplay, mode.vdisplay, drm_device);
+
+	saved = drmModeGetCrtc(fd, crtc);
+	if (drmModeSetCrtc(fd, crtc, bufs[0].id, 0, 0, &conn, 1, &mode))
+		die("cannot set mode %s on %s (is something else using it?)\n",
+			mode.name, drm_device);
+	front = 0;
+	back = 1;
+
+	fb.w = mode.hdisplay;
+	fb.h = mode.vdisplay;
+	fb.pelsize = 4;
+	fb.pitch = bufs[back].pitch;
+	fb.indexed = 0;
+	/* xrgb8888 */
+	fb.cc[0].r = fb.cc[1].r = fb.cc[2].r = 0;
+	fb.cc[0].l = 16;
+	fb.cc[1].l = 8;
+	fb.cc[2].l = 0;
+	fb.ptr = bufs[back].map;
+	fb.dirty = 0;
+	fb.enabled = 1;
+}
+
+void vid_close()
+{
+	int i;
+
+	fb.enabled = 0;
+	if (fd < 0) return;
+	if (pending >= 0) events(100);
+	if (saved)
+	{
+		drmModeSetCrtc(fd, saved->crtc_id, saved->buffer_id,
+			saved->x, saved->y, &conn, 1, &saved->mode);
+		drmModeFreeCrtc(saved);
+		saved = 0;
+	}
+	for (i = 0; i < nbufs; i++)
+		freebuf(&bufs[i]);
+	close(fd);
+	fd = -1;
+	kb_close();
+}
+
+void vid_preinit()
+{
+}
+
+void vid_settitle(char *title)
+{
+}
+
+void vid_setpal(int i, int r, int g, int b)
+{
+}
+
+/* switched away from our vt and back: kb.c turns fb.enabled off and
+   on, and whoever has the console meanwhile needs to set modes */
+static void vt()
+{
+	int i;
+
+	if (fb.enabled == master) return;
+	if (!fb.enabled)
+	{
+		drmDropMaster(fd);
+		master = 0;
+		return;
+	}
+	if (drmSetMaster(fd)) return;
+	master = 1;
+	pending = -1;
+	drmModeSetCrtc(fd, crtc, bufs[front].id, 0, 0, &conn, 1, &mode);
+	for (i = 0; i < nbufs; i++)
+		bufs[i].dirty = 1;
+	fb.dirty = 1;
+}
+
+void vid_begin()
+{
+	int i;
+
+	vt();
+	/* the border needs clearing; the lcd does it in the one it's
+	   drawing to, the rest get it when their turn comes */
+	if (fb.dirty)
+		for (i = 0; i < nbufs; i++)
+			if (i != back) bufs[i].dirty = 1;
+}
+
+void vid_end()
+{
+	int i;
+
+	if (!fb.enabled || !fb.drawn) return;
+	fb.drawn = 0;
+	events(0);
+	/* the last flip hasn't happened yet: with a third buffer this
+	   frame is dropped and the next drawn over it, rather than wait */
+	if (pending >= 0 && nbufs > 2) return;
+	if (pending >= 0) events(100);
+	if (pending >= 0) front = pending, pending = -1;
+	flip(back);
+	for (;;)
+	{
+		for (i = 0; i < nbufs; i++)
+			if (i != front && i != pending)
+				break;
+		if (i < nbufs) break;
+		/* two buffers: the other one is still on the screen */
+		events(100);
+		if (pending >= 0) front = pending, pending = -1;
+	}
+	back = i;
+	if (bufs[back].dirty) fb.dirty = 1;
+	bufs[back].dirty = 0;
+	fb.ptr = bufs[back].map;
+	fb.pitch = bufs[back].pitch;
+}
+
+void ev_poll(int wait)
+{
+	(void) wait;
+	if (fd >= 0) events(0);
+	kb_poll();
+	joy_poll();
+}
@@ -33,6 +33,11 @@ int pcm_submit()
 	return 0;
 }
 
+int pcm_queued()
+{
+	return -1;
+}
+
 void pcm_pause(int dopause)
 {
 }
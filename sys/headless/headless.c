@@ -0,0 +1,265 @@
+/*
+ * headless.c
+ *
+ * Video, input and sound for running with nothing attached: nothing
+ * is drawn unless asked for with "drawevery", and since pcm_submit
+ * claims the frame was paced, emu_run never sleeps either. The game
+ * runs as fast as the cpu allows. Without "sound" there is no sound
+ * buffer, so sound_mix only keeps the channel state up to date; with
+ * it the sound is made, for wavdump to have, and thrown away.
+ *
+ * With "hashlog" set, every frame gets a line in that file (- for
+ * stdout): the frame number, a hash of the picture, and the bytes at
+ * the addresses in "hashprobe" in hex, one after another. The
+ * addresses are hex too, single ones or ranges like c000-c00f, with
+ * anything else between them; on the command line, where spaces and
+ * commas split a value, that's c000-c00f+ff80. The picture is hashed as it comes
+ * out of the scanner, before any palette lookup or drawing (see
+ * lcd_framehash), so frames not drawn cost little more than nothing;
+ * regression checks compare these lines to ones known to be good.
+ *
+ * "audiohash" does the same for the sound, which it makes whether or
+ * not "sound" is set: each second of it, as it's handed to
+ * pcm_submit, gets a line in that file with the second's number and
+ * a hash of its samples, and the end of the run one more, "all", with
+ * the hash of the whole of it and how many samples there were. A
+ * nightly check keeps only these; a second that doesn't match is
+ * looked into by running that far again with "wavdump" set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "lcd.h"
+#include "fb.h"
+#include "pcm.h"
+#include "rc.h"
+#include "sys.h"
+#include "debug.h"
+
+struct fb fb;
+struct pcm pcm;
+
+static byte fbbuf[160*144*4];
+static byte pcmbuf[4096];
+
+static int drawevery;
+static char *hashlog, *hashprobe;
+
+rcvar_t vid_exports[] =
+{
+	RCV_INT("drawevery", &drawevery, "draw every this many frames into memory, 0 = never"),
+	RCV_STRING("hashlog", &hashlog, "file to log every frame's hash to, - for stdout"),
+	RCV_STRING("hashprobe", &hashprobe, "addresses to log with the hash, in hex"),
+	RCV_END
+};
+
+static FILE *log;
+static int frame;
+/* the probes, as first and last address */
+static int probes[64][2], nprobes;
+
+static void hashinit()
+{
+	char *p = hashprobe, *e;
+	int a, b;
+
+	if (!hashlog) return;
+	if (!strcmp(hashlog, "-")) log = stdout;
+	else if (!(log = fopen(hashlog, "w")))
+		die("cannot write %s\n", hashlog);
+	while (p && *p && nprobes < 64)
+	{
+		a = strtol(p, &e, 16);
+		if (e == p)
+		{
+			p++;
+			continue;
+		}
+		b = a;
+		if (*e == '-') b = strtol(e + 1, &e, 16);
+		probes[nprobes][0] = a & 0xffff;
+		probes[nprobes][1] = b < a ? a : b & 0xffff;
+		nprobes++;
+		p = e;
+	}
+	lcd_hash(1);
+}
+
+static void hashframe()
+{
+	int i, a, b;
+
+	fprintf(log, "%d %08x ", ++frame, lcd_framehash());
+	for (i = 0; i < nprobes; i++)
+		for (a = probes[i][0]; a <= probes[i][1]; a++)
+			if ((b = debug_peek(a)) >= 0) fprintf(log, "%02x", b);
+			else fputs("--", log);
+	fputc('\n', log);
+}
+
+static int sound;
+static int samplerate = 44100;
+static char *audiohash;
+
+rcvar_t pcm_exports[] =
+{
+	RCV_BOOL("sound", &sound, "make sound, for wavdump"),
+	RCV_INT("samplerate", &samplerate, "sample rate"),
+	RCV_STRING("audiohash", &audiohash, "file to log a hash of every second of sound to, - for stdout"),
+	RCV_END
+};
+
+/* FNV-1a, of the second so far and of all of it, and the bytes in each */
+static FILE *alog;
+static un32 ahash, aall;
+static int abytes, aseconds;
+static long long atotal;
+
+static void audioinit()
+{
+	if (!audiohash) return;
+	if (!strcmp(audiohash, "-")) alog = stdout;
+	else if (!(alog = fopen(audiohash, "w")))
+		die("cannot write %s\n", audiohash);
+	ahash = aall = 2166136261u;
+	abytes = aseconds = 0;
+	atotal = 0;
+}
+
+static void audiosecond()
+{
+	fprintf(alog, "%d %08x\n", ++aseconds, ahash);
+	ahash = 2166136261u;
+	abytes = 0;
+}
+
+static void hashaudio(byte *p, int n)
+{
+	int second = pcm.hz * 4, i, k;
+
+	atotal += n;
+	while (n > 0)
+	{
+		k = n < second - abytes ? n : second - abytes;
+		for (i = 0; i < k; i++)
+		{
+			ahash = (ahash ^ p[i]) * 16777619u;
+			aall = (aall ^ p[i]) * 16777619u;
+		}
+		p += k;
+		n -= k;
+		if ((abytes += k) == second) audiosecond();
+	}
+}
+
+static void audioclose()
+{
+	if (!alog) return;
+	if (abytes) audiosecond();
+	fprintf(alog, "all %08x %lld\n", aall, atotal / 4);
+	if (alog != stdout) fclose(alog);
+	else fflush(alog);
+	alog = 0;
+}
+
+
+void vid_preinit()
+{
+}
+
+void vid_init()
+{
+	fb.w = 160;
+	fb.h = 144;
+	fb.pelsize = 4;
+	fb.pitch = 160*4;
+	fb.ptr = fbbuf;
+	fb.indexed = 0;
+	fb.cc[0].r = fb.cc[1].r = fb.cc[2].r = 0;
+	fb.cc[0].l = 16;
+	fb.cc[1].l = 8;
+	fb.cc[2].l = 0;
+	fb.enabled = 0;
+	fb.dirty = 0;
+	hashinit();
+}
+
+void vid_close()
+{
+	fb.enabled = 0;
+	if (!log) return;
+	lcd_hash(0);
+	if (log != stdout) fclose(log);
+	else fflush(log);
+	log = 0;
+}
+
+void vid_settitle(char *title)
+{
+}
+
+void vid_setpal(int i, int r, int g, int b)
+{
+}
+
+/* decide whether the frame about to start gets drawn; the lcd code
+   doesn't touch fb.ptr at all while fb.enabled is 0 */
+void vid_begin()
+{
+	static int frames;
+
+	if (drawevery <= 0)
+	{
+		fb.enabled = 0;
+		return;
+	}
+	if (++frames >= drawevery) frames = 0;
+	fb.enabled = !frames;
+}
+
+void vid_end()
+{
+	if (log) hashframe();
+}
+
+void ev_poll(int wait)
+{
+}
+
+
+void pcm_init()
+{
+	memset(&pcm, 0, sizeof pcm);
+	audioinit();
+	if (!sound && !alog) return;
+	pcm.hz = samplerate;
+	pcm.stereo = 1;
+	pcm.bits = 16;
+	pcm.buf = pcmbuf;
+	pcm.len = sizeof pcmbuf;
+}
+
+void pcm_close()
+{
+	audioclose();
+	memset(&pcm, 0, sizeof pcm);
+}
+
+int pcm_submit()
+{
+	if (alog) hashaudio(pcm.buf, pcm.pos);
+	pcm.pos = 0;
+	return 1;
+}
+
+int pcm_queued()
+{
+	return -1;
+}
+
+void pcm_pause(int dopause)
+{
+}
@@ -0,0 +1,331 @@
+#ifndef GNUBOY_H
+#define GNUBOY_H
+
+/*
+ * gnuboy.h
+ *
+ * Interface of libgnuboy, for programs that drive the emulator
+ * themselves. Nothing here sleeps, reads config files or touches a
+ * window or sound device: gb_run_frame runs one frame as fast as it
+ * can, and the picture and sound it made are left in buffers inside
+ * the library for the caller to read. There is one emulator per
+ * process, or two joined by a link cable (gb_link), or many of the
+ * same game in lanes (gb_lanes) or as instances run one at a time
+ * (gb_instance_new); see context.h in the source tree for running
+ * them other ways.
+ */
+
+/* button bits for gb_set_input, the same as PAD_* in hw.h */
+#define GB_RIGHT  0x01
+#define GB_LEFT   0x02
+#define GB_UP     0x04
+#define GB_DOWN   0x08
+#define GB_A      0x10
+#define GB_B      0x20
+#define GB_SELECT 0x40
+#define GB_START  0x80
+
+#define GB_WIDTH  160
+#define GB_HEIGHT 144
+
+/* samplerate is for gb_audio; 0 means no sound is made at all.
+   cartridge ram starts out zeroed, so runs are repeatable */
+void gb_init(int samplerate);
+/* keep the calling thread to one cpu, unless cpu is -1, and with
+   prio above 0 give it that real-time priority; -1 if either can't be
+   done. for hosts that run an emulator to a thread or process */
+int gb_pin(int cpu, int prio);
+/* numa, for hosts that spread workers over a machine with several
+   memory nodes: with cpu -1 how many nodes there are (1 where that
+   can't be told), otherwise the node cpu is on. gb_pin_node keeps the
+   calling thread to node's cpus, or to none in particular with -1,
+   and moves the memory the process has to itself over to the node;
+   -1 if that can't be done. gb_node_copy copies the file at path
+   into node's memory and gives a path to the copy, good in this
+   process and those it forks, for a rom pack every worker on the
+   node reads; 0 if there's no way to */
+int gb_node(int cpu);
+int gb_pin_node(int node);
+char *gb_node_copy(const char *path, int node);
+
+/* rom images may be gzip, zip or xz compressed; the library keeps its
+   own copy. returns 0 on success, -1 with a message in gb_error() */
+int gb_load_rom_mem(const void *data, int len);
+/* the same, but an uncompressed image is used where it is rather
+   than copied, so it must stay there unchanged until gb_unload or the
+   next load; every instance (and every process mapping the same
+   file) running it then shares the one image */
+int gb_load_rom_shared(const void *data, int len);
+/* from a file; an uncompressed one is mapped read-only rather than
+   read, so processes running the same rom share its pages */
+int gb_load_rom_file(const char *path);
+/* a directory gb_load_rom_file keeps decompressed copies of the
+   compressed roms it loads in, so that loading one again maps the
+   copy; 0 for none, as at first. the directory has to exist, and
+   this has to come after gb_init */
+void gb_rom_cache(const char *dir);
+/* a rom pack (see loader.c) for gb_load_rom_file to load "pack:hash"
+   roms from, mapped now; a process that calls this before forking
+   shares the mapping with its children, which call it again after
+   their gb_init to use it. after gb_init, like gb_rom_cache; -1 with
+   a message in gb_error() if it isn't a pack */
+int gb_rom_pack(const char *path);
+/* writes the roms in files, compressed or not, to out as a pack, and
+   puts each one's hash in hashes, if that isn't 0 */
+int gb_rom_pack_make(const char *out, char **files, int n,
+	unsigned long long *hashes);
+void gb_unload();
+char *gb_error();
+
+/* gb_run_frame is 0, or -1 with nothing loaded, in lanes, or when
+   the game has stopped somewhere it can't go on from (an invalid
+   opcode, say; the message goes to stderr). a stopped game runs no
+   further until gb_reset, gb_load_state or another rom, and the
+   same goes for gb_run_until and gb_run_lanes; see gb_dead */
+void gb_reset();
+int gb_run_frame();
+void gb_set_input(int buttons);
+
+/* finer than a frame, for keeping instances or machines in step.
+   gb_clock is how many cycles the selected instance has run since it
+   was made, 2097152 a second (35112 a frame) at either cpu speed; it
+   never wraps and isn't saved in states. gb_run_until runs on to
+   cycle t, stopping at the first instruction boundary at or after it
+   (instructions are never split), with the timers, lcd and sound
+   brought up to that cycle, and returns the cycle it stopped at.
+   passing vblank does what gb_run_frame does there, and gb_audio
+   then holds the call's sound, as much as fits. -1, running nothing,
+   while linked or in lanes */
+unsigned long long gb_clock();
+long long gb_run_until(unsigned long long t);
+
+/* the last frame, GB_WIDTH x GB_HEIGHT pixels of 0x00RRGGBB, rows
+   one after another; the pointer stays the same until gb_link,
+   gb_select or gb_instance_select */
+const unsigned *gb_framebuffer();
+
+/* the sound of the last frame, *n stereo pairs of signed 16 bit
+   samples, left first; valid until the next gb_run_frame */
+void gb_audio(const short **samples, int *n);
+
+/* how much the mixer spends on that sound: GB_SOUND_OFF (silence, the
+   channels only kept in step), GB_SOUND_FAST, GB_SOUND_STANDARD, the
+   default, or GB_SOUND_HIGH; the soundquality rcvar, but kept per
+   instance, so a server can give each the tier it needs. q < 0 only
+   asks; returns what it was */
+#define GB_SOUND_OFF 0
+#define GB_SOUND_FAST 1
+#define GB_SOUND_STANDARD 2
+#define GB_SOUND_HIGH 3
+int gb_sound_quality(int q);
+
+/* how closely the cpu follows the hardware: GB_ACCURACY_FAST, the
+   default, GB_ACCURACY_BALANCED, where dma takes the cpu's time, or
+   GB_ACCURACY_ACCURATE, where vram and oam are shut to it while the
+   lcd uses them, for test roms. each is its own build of the
+   interpreter, so one costs the others nothing. the accuracy rcvar,
+   kept per instance; a new one starts with the current one's. a < 0
+   only asks; returns what it was. see cpu.c */
+#define GB_ACCURACY_FAST 0
+#define GB_ACCURACY_BALANCED 1
+#define GB_ACCURACY_ACCURATE 2
+int gb_accuracy(int a);
+
+/* conditions for stopping early, any number of them separated by
+   spaces: pc=[bank:]addr, the cpu runs the instruction there; ram=
+   addr:val, the byte at addr reads val; serial=text, what gb_serial
+   has holds text (\xNN for odd bytes); hash=xxxxxxxx, the frame's
+   hash, as the headless hashlog has it; static=n, the picture hasn't
+   changed for n frames. numbers in hex but n. gb_until sets them, 0
+   for none, and returns 0 or -1 if they don't make sense, when there
+   are then none. gb_until_met is the one that came true in the last
+   gb_run_frame, as written, or 0; the caller decides what to do
+   about it. see until.c */
+int gb_until(const char *conds);
+const char *gb_until_met();
+
+/* the trace, watch and break lines and the loader's complaints are
+   written by a thread of their own (see diag.c); this waits for what
+   there is to be out. exit does it, but _exit, in a forked child,
+   doesn't */
+void gb_diag_flush();
+
+/* observations for agents that learn to play, made from the lines as
+   the lcd makes them, before anything is drawn (see observe.c). a
+   plane is GB_WIDTH/shrink x GB_HEIGHT/shrink bytes, shrink 1, 2 or
+   4: GB_OBS_GRAY gives each block's average brightness, 0 black to
+   255 white, GB_OBS_INDEX the palette index, 0-63, of its top left
+   pixel. gb_observe_setup gives the kind, shrink and a ring of depth
+   planes, one after another, that the caller owns, for stacking
+   frames; 0 or -1. gb_observe arms the next frame gb_run_frame or
+   gb_run_until runs into vblank: its lines go into the ring's next
+   plane as they're made, and frames not armed cost nothing. then
+   gb_observed is one more, so the newest plane is number
+   (gb_observed() - 1) % depth. gb_observe_ram sets up to
+   GB_OBS_MAXRAM addresses, as gb_peek takes them, and gb_gather puts
+   their bytes in out, 0xff for any there's no such memory at, and
+   returns how many, -1 with no rom loaded; gb_observe_ram returns 0
+   or -1. not in lanes */
+#define GB_OBS_GRAY 0
+#define GB_OBS_INDEX 1
+#define GB_OBS_MAXRAM 4096
+int gb_observe_setup(int kind, int shrink, unsigned char *ring, int depth);
+void gb_observe();
+int gb_observed();
+int gb_observe_ram(const int *addrs, int n);
+int gb_gather(unsigned char *out);
+
+/* every byte the game has sent out of the link port since the last
+   reset or rom load, *len of them; test roms report results this way.
+   valid until the next gb_run_frame */
+const unsigned char *gb_serial(int *len);
+
+/* save states, in the plain layout the emulator keeps in memory.
+   gb_save_state returns the bytes used, or -1 if len is less than
+   gb_state_size(); gb_load_state takes those or the emulator's own
+   .sav files, which are packed, and returns 0 or -1 */
+int gb_state_size();
+int gb_save_state(void *buf, int len);
+int gb_load_state(const void *buf, int len);
+/* the same in the packed .sav layout, mostly a tenth of the size or
+   less, for keeping; gb_state_packsize() is the most it can take */
+int gb_state_packsize();
+int gb_pack_state(void *buf, int len);
+
+/* a hash of what gb_save_state would save, the same on any machine
+   for the same state; cheap enough to check every frame that two
+   runs are still in step */
+unsigned long long gb_state_hash();
+
+/* gb_link(1) copies the running game into a second instance joined
+   to it by a link cable, for trading and battles; gb_run_frame then
+   runs both a frame, in lockstep, and everything else here acts on
+   the one picked with gb_select(0 or 1), at first 0. load a state
+   into the second to give it a save of its own. gb_link(0), loading
+   a rom or gb_unload leave just instance 0. returns 0 or -1 */
+int gb_link(int on);
+void gb_select(int n);
+
+/* instances are more copies of the loaded game, each with its own
+   state, pad, picture and sound, for hosting many in one process;
+   only the selected one runs, and everything else here acts on it.
+   gb_instance_new copies the selected one into a new instance and
+   returns its number, or -1; gb_reset it for one from power on. the
+   game that was loaded is instance 0. gb_instance_select parks the
+   selected one and picks n instead, which costs a copy of the
+   machine's state, some tens of kilobytes, each way; it returns 0 or
+   -1. gb_instance_free(n) throws away any but the selected one.
+   gb_instance_sleep(n) packs any but the selected one, state and
+   picture, into a few kilobytes until it's selected again, when it
+   carries on exactly where it was, having lost only the last frame's
+   sound; for the many a server keeps waiting. 0 or -1.
+   loading a rom or gb_unload leave the selected one as the only one,
+   numbered 0. there are no instances while linked or in lanes, nor
+   links or lanes while there are instances */
+int gb_instance_new();
+int gb_instance_select(int n);
+void gb_instance_free(int n);
+int gb_instance_sleep(int n);
+
+/* gb_lanes(n) copies the running game into n lanes, for running
+   many copies of it with different buttons, as training does;
+   gb_run_lanes then runs every lane a frame with buttons[lane], in
+   place of gb_run_frame. lanes in the same state given the same
+   buttons are run just once for all of them, so n lanes cost about
+   as much as gb_lane_groups() instances. gb_lane_framebuffer is a
+   lane's last frame, until the next gb_run_lanes. gb_lane_select
+   loads a lane so the rest of this interface acts on it; without
+   alone, anything changed goes for the lanes run with it too.
+   gb_merge_lanes joins lanes whose states have come out the same
+   again and returns gb_lane_groups(); it compares every group with
+   every other, so call it every so often rather than every frame.
+   there's no sound per lane: gb_audio has the last group run's.
+   gb_lanes(0), loading a rom or gb_unload leave lane 0 running. the
+   rest return 0 or -1, which for gb_run_lanes means no memory for
+   the lanes that split off, and nothing was run, or a lane stopped
+   (see gb_run_frame) */
+int gb_lanes(int n);
+int gb_run_lanes(const int *buttons);
+const unsigned *gb_lane_framebuffer(int n);
+int gb_lane_select(int n, int alone);
+int gb_lane_groups();
+int gb_merge_lanes();
+
+/* callbacks from inside gb_run_frame and gb_run_lanes, for looking
+   at a frame as it's made; each comes with its own arg, and a null
+   fn takes it away again. gb_on_line's is called as each of the 144
+   visible lines is finished, with its number, and gb_on_frame's as
+   the last one is, at the start of vblank, with gb_framebuffer()
+   complete. gb_watch's is called on every read (how 1), write (2) or
+   either (3) of the len bytes from a as it happens, with the byte
+   read or written; a null fn stops watching them, and there's one fn
+   for everything watched, the last given. only the 4k pages with
+   something watched in them are read and written the slow way. all
+   of these are called midway through emulation, for whichever
+   instance or lane is running: gb_peek is safe there, anything that
+   runs, loads or saves isn't. gb_watch returns 0 or -1 */
+void gb_on_frame(void (*fn)(void *arg), void *arg);
+void gb_on_line(void (*fn)(int line, void *arg), void *arg);
+int gb_watch(int a, int len, int how,
+	void (*fn)(int a, int val, int write, void *arg), void *arg);
+/* the byte at a as the cpu would read it, without setting off
+   gb_watch; or -1 */
+int gb_peek(int a);
+
+/* memory as arrays, for reading much of it at once from a callback
+   rather than a byte at a time: a script that's handed these can look
+   at the whole of ram every frame for next to nothing. they're the
+   emulator's own, read-only and live, so copy what has to stay put;
+   they show whichever instance or lane is running or selected, and
+   stay where they are until the next rom load. gb_memory gives the
+   one asked for and its length in *len, or 0 */
+#define GB_WRAM 0 /* work ram, 4k banks: c000 is 0, d000 the one in svbk */
+#define GB_HRAM 1 /* ff00-ffff, io registers and high ram */
+#define GB_SRAM 2 /* cartridge ram, 8k banks, a000 the one mapped */
+#define GB_VRAM 3 /* 8k banks, 8000 the one in vbk */
+#define GB_OAM  4 /* fe00-fe9f */
+const unsigned char *gb_memory(int region, int *len);
+
+/* the battery save, for a frontend keeping it itself rather than in
+   the emulator's .sav and .rtc files. gb_set_sram fills cartridge ram
+   from len bytes at sram, as loading a .sav would; -1 if there's less
+   ram than that. gb_rtc puts the cartridge clock in v as a .rtc file
+   has it, carry, stop, days, hours, minutes, seconds and sixtieths,
+   and gives -1 if there's no clock; gb_set_rtc puts one back, run on
+   (if syncrtc is set) for the time since then, a time() from when it
+   was taken, or 0 */
+int gb_set_sram(const void *sram, int len);
+int gb_rtc(int *v);
+int gb_set_rtc(const int *v, long long then);
+
+/* for fuzzing. gb_cover gives the core a map of gb_cover_size()
+   bytes, one for each byte of the rom and then one for each address
+   outside it, and from then on every instruction run sets the byte
+   for where it is to 1; the map may be shared by several processes.
+   gb_cover_new says how many bytes this process has been the first
+   to set since it was last called. this runs the cpu the slow way
+   round, as the profiler does; a null map turns it off. while it's
+   on, gb_pc_span is how many bytes of the map lie between the
+   lowest and highest place run since it was last called: a game
+   going round a few instructions and nothing else, waiting for
+   something that won't come, keeps it small. gb_dead is 1 if the cpu
+   has halted with every interrupt disabled, so nothing will ever
+   wake it, or the game has stopped (see gb_run_frame) */
+int gb_cover_size();
+void gb_cover(unsigned char *map);
+int gb_cover_new();
+int gb_pc_span();
+int gb_dead();
+
+/* counting the instructions run, by opcode: 256 plain opcodes, then
+   256 after cb, then each opcode by the one run before it, 256 * 256
+   of them with the earlier one high. counting slows emulation right
+   down; the counts keep going across roms until gb_count_ops(1) is
+   called again. gb_op_dump writes them out sorted, to stdout for a
+   null path, and returns 0 or -1 */
+#define GB_OPCOUNTS (512 + 65536)
+void gb_count_ops(int on);
+unsigned long long *gb_op_counts();
+int gb_op_dump(const char *path);
+
+#endif
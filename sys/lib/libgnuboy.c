@@ -0,0 +1,892 @@
+/*
+ * libgnuboy.c
+ *
+ * The sys/ side of libgnuboy: video and sound go to buffers the
+ * caller reads through gb_framebuffer and gb_audio, there are no
+ * events, and the frame loop is emu_run without the pacing. See
+ * gnuboy.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "defs.h"
+#include "regs.h"
+#include "hw.h"
+#include "cpu.h"
+#include "mem.h"
+#include "lcd.h"
+#include "lcdc.h"
+#include "rtc.h"
+#include "fb.h"
+#include "pcm.h"
+#include "rc.h"
+#include "sound.h"
+#include "emu.h"
+#include "loader.h"
+#include "exports.h"
+#include "save.h"
+#include "link.h"
+#include "lockstep.h"
+#include "context.h"
+#include "lz.h"
+#include "profile.h"
+#include "debug.h"
+#include "until.h"
+#include "diag.h"
+#include "observe.h"
+#include "alloccheck.h"
+#include "sys.h"
+#include "bench.h"
+#include "gnuboy.h"
+
+struct fb fb;
+struct pcm pcm;
+
+static un32 fbbuf[GB_WIDTH * GB_HEIGHT];
+/* a frame at 48000 Hz is 3216 bytes; this leaves room for long ones */
+static n16 pcmbuf[8192];
+static int loaded;
+/* stopped is set when the game gets somewhere it can't go on from, an
+   invalid opcode say; die, which would end the program, comes back to
+   escape instead while running is set */
+static int stopped, running;
+static jmp_buf escape;
+
+/* the instances, with a picture and a sound buffer each; the one
+   running is parked in its context only while another is selected.
+   one asleep has neither context nor buffers, only packed, its
+   context and picture lz'd. ninst is 0 until there's more than the
+   first */
+static struct instance
+{
+	struct context *ctx;
+	un32 *fb;
+	n16 *pcm;
+	int pos, quality, accuracy, stopped;
+	byte *packed;
+	int ctxlen, packlen;
+} *inst;
+static int ninst, curinst;
+/* what gb_run_frame found true, for gb_until_met */
+static char *met;
+
+static void (*framefn)(void *), (*linefn)(int, void *);
+static void (*watchfn)(int, int, int, void *);
+static void *framearg, *linearg, *watcharg;
+
+rcvar_t vid_exports[] =
+{
+	RCV_END
+};
+
+rcvar_t pcm_exports[] =
+{
+	RCV_END
+};
+
+
+void vid_preinit()
+{
+}
+
+void vid_init()
+{
+	fb.w = GB_WIDTH;
+	fb.h = GB_HEIGHT;
+	fb.pelsize = 4;
+	fb.pitch = GB_WIDTH * 4;
+	fb.ptr = (byte *)fbbuf;
+	fb.indexed = 0;
+	fb.cc[0].r = fb.cc[1].r = fb.cc[2].r = 0;
+	fb.cc[0].l = 16;
+	fb.cc[1].l = 8;
+	fb.cc[2].l = 0;
+	fb.enabled = 1;
+	fb.dirty = 0;
+}
+
+void vid_close()
+{
+}
+
+void vid_settitle(char *title)
+{
+}
+
+void vid_setpal(int i, int r, int g, int b)
+{
+}
+
+void vid_begin()
+{
+}
+
+void vid_end()
+{
+}
+
+void ev_poll(int wait)
+{
+}
+
+void pcm_init()
+{
+}
+
+void pcm_close()
+{
+}
+
+/* only reached if a frame overflows pcmbuf, which then keeps just
+   the end of it */
+int pcm_submit()
+{
+	pcm.pos = 0;
+	return 1;
+}
+
+int pcm_queued()
+{
+	return -1;
+}
+
+void pcm_pause(int dopause)
+{
+}
+
+void doevents()
+{
+}
+
+void die(char *fmt, ...)
+{
+	va_list ap;
+
+	diag_flush();
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (!running) exit(1);
+	running = 0;
+	stopped = 1;
+	longjmp(escape, 1);
+}
+
+/* what die leaves half done when it jumps out of a run: the slice
+   emu_step was cutting, cycles not yet synced, the lcd or sound
+   marked busy, and the peer link_frame had selected */
+static void unwind(int link, int bench)
+{
+	cpu.cut = 0;
+	cpu.evcnt = 0;
+	bench_in = bench;
+	if (link_linked()) link_select(link);
+}
+
+/* the menu's rom browser; the caller's own loading goes through
+   gb_load_rom_mem */
+int load_rom_and_rc(char *rom)
+{
+	gb_unload();
+	/* the loader keeps it and frees it on unload */
+	if (!(rom = strdup(rom)) || loader_init(rom)) return -1;
+	loaded = 1;
+	emu_reset();
+	return 0;
+}
+
+
+void gb_init(int samplerate)
+{
+	init_exports();
+	/* there's no save file to fill cartridge ram from, and leaving it
+	   to malloc makes otherwise identical runs differ */
+	rc_command("set memfill 0");
+	vid_init();
+	memset(&pcm, 0, sizeof pcm);
+	if (samplerate <= 0) return;
+	pcm.hz = samplerate;
+	pcm.stereo = 1;
+	pcm.bits = 16;
+	pcm.buf = (byte *)pcmbuf;
+	pcm.len = sizeof pcmbuf;
+}
+
+int gb_load_rom_mem(const void *data, int len)
+{
+	gb_unload();
+	if (rom_load_mem(data, len)) return -1;
+	bootrom_load();
+	loaded = 1;
+	emu_reset();
+	return 0;
+}
+
+int gb_load_rom_shared(const void *data, int len)
+{
+	gb_unload();
+	if (rom_load_shared(data, len)) return -1;
+	bootrom_load();
+	loaded = 1;
+	emu_reset();
+	return 0;
+}
+
+int gb_load_rom_file(const char *path)
+{
+	gb_unload();
+	if (rom_load_file(path)) return -1;
+	bootrom_load();
+	loaded = 1;
+	emu_reset();
+	return 0;
+}
+
+int gb_pin(int cpu, int prio)
+{
+	return sys_pin(cpu, prio);
+}
+
+int gb_node(int cpu)
+{
+	return sys_node(cpu);
+}
+
+int gb_pin_node(int node)
+{
+	return sys_pin_node(node);
+}
+
+char *gb_node_copy(const char *path, int node)
+{
+	return sys_nodecopy((char *)path, node);
+}
+
+void gb_rom_cache(const char *dir)
+{
+	char *v[1];
+
+	v[0] = (char *)(dir ? dir : "");
+	rc_setvar("romcache", 1, v);
+}
+
+int gb_rom_pack(const char *path)
+{
+	char *v[1];
+
+	v[0] = (char *)path;
+	rc_setvar("rompack", 1, v);
+	return rom_pack_open();
+}
+
+int gb_rom_pack_make(const char *out, char **files, int n,
+	unsigned long long *hashes)
+{
+	return rom_pack_make((char *)out, files, n, hashes);
+}
+
+static void instances_stop();
+
+void gb_unload()
+{
+	if (!loaded) return;
+	instances_stop();
+	link_stop();
+	lockstep_stop();
+	loader_unload();
+	loaded = stopped = 0;
+}
+
+char *gb_error()
+{
+	return loader_get_error();
+}
+
+void gb_reset()
+{
+	if (!loaded) return;
+	emu_reset();
+	stopped = 0;
+}
+
+void gb_set_input(int buttons)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		pad_set(1 << i, buttons & (1 << i));
+}
+
+/* what gb_run_frame does at vblank, for each linked instance; only
+   the selected one is heard */
+static void vblank(int i)
+{
+	int pos = pcm.pos;
+
+	lcd_flush();
+	if (i == link_selected()) observe_frame();
+	rtc_tick();
+	sound_mix();
+	if (i != link_selected()) pcm.pos = pos;
+}
+
+/* emu_run's loop, once, minus vid_*, pacing and events */
+static void frame()
+{
+	cpu_emulate(2280);
+	while (R_LY > 0 && R_LY < 144)
+		emu_step();
+	lcd_flush();
+	observe_frame();
+	rtc_tick();
+	sound_mix();
+	if (!(R_LCDC & 0x80))
+		cpu_emulate(32832);
+	while (R_LY > 0)
+		emu_step();
+}
+
+int gb_run_frame()
+{
+	unsigned long am = ALLOC_MARK();
+	int link = link_selected(), bench = bench_in;
+
+	if (!loaded || stopped || lockstep_lanes()) return -1;
+	pcm.pos = 0;
+	if (setjmp(escape)) { unwind(link, bench); return -1; }
+	running = 1;
+	if (link_linked()) link_frame(vblank);
+	else frame();
+	running = 0;
+	met = until_frame();
+	ALLOC_CHECK(am, "gb_run_frame");
+	return 0;
+}
+
+int gb_until(const char *conds)
+{
+	met = 0;
+	return until_set((char *)conds);
+}
+
+const char *gb_until_met()
+{
+	return met;
+}
+
+void gb_diag_flush()
+{
+	diag_flush();
+}
+
+int gb_observe_setup(int kind, int shrink, unsigned char *ring, int depth)
+{
+	return observe_setup(kind, shrink, ring, depth);
+}
+
+void gb_observe()
+{
+	observe_arm();
+}
+
+int gb_observed()
+{
+	return observe_count();
+}
+
+int gb_observe_ram(const int *addrs, int n)
+{
+	return observe_ram(addrs, n);
+}
+
+int gb_gather(unsigned char *out)
+{
+	return loaded ? observe_gather(out) : -1;
+}
+
+unsigned long long gb_clock()
+{
+	return cpu.clock;
+}
+
+/* emu_step's way, one lcdc event at a time so vblank isn't missed,
+   but no further than t */
+long long gb_run_until(unsigned long long t)
+{
+	int ly, step, bench = bench_in;
+
+	if (!loaded || stopped || lockstep_lanes() || link_linked())
+		return -1;
+	pcm.pos = 0;
+	if (setjmp(escape)) { unwind(link_selected(), bench); return -1; }
+	running = 1;
+	while (cpu.clock < t)
+	{
+		ly = R_LY;
+		step = cpu.lcdc > 0 ? cpu.lcdc : 1;
+		if (t - cpu.clock < (unsigned long long)step)
+			step = t - cpu.clock;
+		cpu_emulate(step);
+		cpu_sync();
+		if (R_LY == 144 && ly != 144)
+		{
+			lcd_flush();
+			observe_frame();
+			rtc_tick();
+		}
+	}
+	running = 0;
+	sound_mix();
+	return cpu.clock;
+}
+
+const unsigned *gb_framebuffer()
+{
+	return (unsigned *)fb.ptr;
+}
+
+void gb_audio(const short **samples, int *n)
+{
+	*samples = (short *)(pcm.buf ? pcm.buf : (byte *)pcmbuf);
+	*n = pcm.pos / 4;
+}
+
+/* the selected instance's is the rcvar's; the others keep theirs in
+   inst until they're selected */
+int gb_sound_quality(int q)
+{
+	return sound_quality(q);
+}
+
+/* the same for the accuracy tier */
+int gb_accuracy(int a)
+{
+	return cpu_accuracy(a);
+}
+
+const unsigned char *gb_serial(int *len)
+{
+	return hw_serial_output(len);
+}
+
+int gb_state_size()
+{
+	return savestate_size();
+}
+
+int gb_save_state(void *buf, int len)
+{
+	if (!loaded) return -1;
+	return savestate_to_buffer(buf, len);
+}
+
+int gb_state_packsize()
+{
+	return savestate_packsize();
+}
+
+int gb_pack_state(void *buf, int len)
+{
+	if (!loaded) return -1;
+	return savestate_pack(buf, len);
+}
+
+int gb_load_state(const void *buf, int len)
+{
+	if (!loaded || loadstate_delta((byte *)buf, len, 0) < 0)
+		return -1;
+	stopped = 0;
+	sound_dirty();
+	mem_updatemap();
+	return 0;
+}
+
+unsigned long long gb_state_hash()
+{
+	return loaded ? state_hash() : 0;
+}
+
+int gb_link(int on)
+{
+	if (!on) link_stop();
+	else if (!loaded || ninst || lockstep_lanes() || link_start())
+		return -1;
+	return 0;
+}
+
+void gb_select(int n)
+{
+	link_select(n);
+}
+
+int gb_lanes(int n)
+{
+	lockstep_stop();
+	if (n <= 1) return 0;
+	if (!loaded || ninst || link_linked() || lockstep_start(n)) return -1;
+	return 0;
+}
+
+/* only the selected instance is left, as instance 0, with the
+   library's own buffers */
+static void instances_stop()
+{
+	int i;
+
+	if (!ninst) return;
+	memcpy(fbbuf, fb.ptr, sizeof fbbuf);
+	fb.ptr = (byte *)fbbuf;
+	if (pcm.buf) pcm.buf = (byte *)pcmbuf;
+	for (i = 0; i < ninst; i++)
+	{
+		if (inst[i].ctx) context_free(inst[i].ctx);
+		if (inst[i].fb != fbbuf) free(inst[i].fb);
+		if (inst[i].pcm != pcmbuf) free(inst[i].pcm);
+		free(inst[i].packed);
+	}
+	free(inst);
+	inst = 0;
+	ninst = curinst = 0;
+}
+
+int gb_instance_new()
+{
+	struct instance *p;
+	int n;
+
+	if (!loaded || link_linked() || lockstep_lanes()) return -1;
+	if (!ninst)
+	{
+		if (!(inst = calloc(1, sizeof *inst))
+			|| !(inst[0].ctx = context_new()))
+		{
+			free(inst);
+			inst = 0;
+			return -1;
+		}
+		inst[0].fb = fbbuf;
+		inst[0].pcm = pcmbuf;
+		ninst = 1;
+	}
+	for (n = 0; n < ninst && (inst[n].ctx || inst[n].packed); n++);
+	if (n == ninst)
+	{
+		if (!(p = realloc(inst, (ninst + 1) * sizeof *inst))) return -1;
+		inst = p;
+		memset(inst + ninst++, 0, sizeof *inst);
+	}
+	p = &inst[n];
+	p->ctx = context_new();
+	p->fb = malloc(sizeof fbbuf);
+	p->pcm = malloc(sizeof pcmbuf);
+	if (!p->ctx || !p->fb || !p->pcm)
+	{
+		if (p->ctx) context_free(p->ctx);
+		free(p->fb);
+		free(p->pcm);
+		memset(p, 0, sizeof *p);
+		return -1;
+	}
+	context_save(p->ctx);
+	memcpy(p->fb, fb.ptr, sizeof fbbuf);
+	p->quality = sound_quality(-1);
+	p->accuracy = cpu_accuracy(-1);
+	p->stopped = stopped;
+	return n;
+}
+
+/* n asleep woken, still parked; -1 if there's no memory for it */
+static int wake(int n)
+{
+	struct instance *p = &inst[n];
+	struct context *c;
+	un32 *f = 0;
+	n16 *s = 0;
+
+	if (!p->packed) return 0;
+	if (!(c = context_unpack(p->packed, p->ctxlen)))
+		return -1;
+	if ((p->fb || (f = malloc(sizeof fbbuf)))
+		&& (p->pcm || (s = malloc(sizeof pcmbuf))))
+	{
+		if (f) lz_unpack((byte *)f, sizeof fbbuf, p->packed + p->ctxlen,
+			p->packlen - p->ctxlen);
+		if (!p->fb) p->fb = f;
+		if (!p->pcm) p->pcm = s;
+		p->ctx = c;
+		p->pos = 0;
+		free(p->packed);
+		p->packed = 0;
+		return 0;
+	}
+	free(f);
+	context_free(c);
+	return -1;
+}
+
+int gb_instance_sleep(int n)
+{
+	struct instance *p;
+	byte *ctx, *out, *q;
+	int len, fblen = 0;
+
+	if (n < 0 || n >= ninst || n == curinst) return -1;
+	p = &inst[n];
+	if (p->packed) return 0;
+	if (!p->ctx) return -1;
+	if (!(out = malloc(LZ_BOUND(sizeof fbbuf)))) return -1;
+	/* the library's own buffers are there anyway */
+	if (p->fb != fbbuf) fblen = lz_pack(out, (byte *)p->fb, sizeof fbbuf);
+	if (!(ctx = context_pack(p->ctx, &len)))
+	{
+		free(out);
+		return -1;
+	}
+	p->ctx = 0;
+	/* without room for the picture too, it stays as it is */
+	if ((q = realloc(ctx, len + fblen)))
+	{
+		ctx = q;
+		memcpy(ctx + len, out, fblen);
+	}
+	else fblen = 0;
+	free(out);
+	p->packed = ctx;
+	p->ctxlen = len;
+	p->packlen = len + fblen;
+	if (fblen)
+	{
+		free(p->fb);
+		p->fb = 0;
+	}
+	if (p->pcm != pcmbuf)
+	{
+		free(p->pcm);
+		p->pcm = 0;
+	}
+	return 0;
+}
+
+int gb_instance_select(int n)
+{
+	unsigned long am;
+
+	if (n < 0 || n >= (ninst ? ninst : 1)
+		|| (ninst && !inst[n].ctx && !inst[n].packed))
+		return -1;
+	if (n == curinst) return 0;
+	if (wake(n)) return -1;
+	am = ALLOC_MARK();
+	context_save(inst[curinst].ctx);
+	context_load(inst[n].ctx);
+	fb.ptr = (byte *)inst[n].fb;
+	inst[curinst].pos = pcm.pos;
+	pcm.pos = inst[n].pos;
+	inst[curinst].quality = sound_quality(inst[n].quality);
+	inst[curinst].accuracy = cpu_accuracy(inst[n].accuracy);
+	inst[curinst].stopped = stopped;
+	stopped = inst[n].stopped;
+	if (pcm.buf) pcm.buf = (byte *)inst[n].pcm;
+	curinst = n;
+	ALLOC_CHECK(am, "gb_instance_select");
+	return 0;
+}
+
+void gb_instance_free(int n)
+{
+	if (n < 0 || n >= ninst || n == curinst
+		|| (!inst[n].ctx && !inst[n].packed))
+		return;
+	if (inst[n].ctx) context_free(inst[n].ctx);
+	if (inst[n].fb != fbbuf) free(inst[n].fb);
+	if (inst[n].pcm != pcmbuf) free(inst[n].pcm);
+	free(inst[n].packed);
+	memset(&inst[n], 0, sizeof inst[n]);
+}
+
+static void lane(int i, int buttons)
+{
+	gb_set_input(buttons);
+	pcm.pos = 0;
+	frame();
+}
+
+int gb_run_lanes(const int *buttons)
+{
+	unsigned long am = ALLOC_MARK();
+	int n, bench = bench_in;
+
+	if (stopped) return -1;
+	if (setjmp(escape)) { unwind(link_selected(), bench); return -1; }
+	running = 1;
+	n = lockstep_frame(buttons, lane);
+	running = 0;
+	ALLOC_CHECK(am, "gb_run_lanes");
+	return n;
+}
+
+const unsigned *gb_lane_framebuffer(int n)
+{
+	return (unsigned *)lockstep_fb(n);
+}
+
+int gb_lane_select(int n, int alone)
+{
+	return lockstep_select(n, alone);
+}
+
+int gb_lane_groups()
+{
+	return lockstep_groups();
+}
+
+int gb_merge_lanes()
+{
+	return lockstep_merge();
+}
+
+static void framehook()
+{
+	framefn(framearg);
+}
+
+static void linehook(int line)
+{
+	linefn(line, linearg);
+}
+
+static void watchhook(int a, byte b, int write)
+{
+	watchfn(a, b, write, watcharg);
+}
+
+void gb_on_frame(void (*fn)(void *arg), void *arg)
+{
+	framefn = fn;
+	framearg = arg;
+	lcdc_framehook = fn ? framehook : 0;
+}
+
+void gb_on_line(void (*fn)(int line, void *arg), void *arg)
+{
+	linefn = fn;
+	linearg = arg;
+	lcdc_linehook = fn ? linehook : 0;
+}
+
+int gb_watch(int a, int len, int how,
+	void (*fn)(int a, int val, int write, void *arg), void *arg)
+{
+	if (a < 0 || len <= 0 || a + len > 0x10000 || how < 1 || how > 3)
+		return -1;
+	debug_setwatch(a, len, how, fn != 0);
+	if (!fn) return 0;
+	if (!debug_watching(a, (how & 2) != 0)) return -1;
+	watchfn = fn;
+	watcharg = arg;
+	debug_watchhook = watchhook;
+	return 0;
+}
+
+int gb_peek(int a)
+{
+	return loaded ? debug_peek(a & 0xffff) : -1;
+}
+
+const unsigned char *gb_memory(int region, int *len)
+{
+	*len = 0;
+	if (!loaded) return 0;
+	switch (region)
+	{
+	case GB_WRAM:
+		*len = WRAMBANKS << 12;
+		return ram.ibank[0];
+	case GB_HRAM:
+		*len = sizeof ram.hi;
+		return ram.hi;
+	case GB_SRAM:
+		if (!ram.sbank) return 0;
+		*len = mbc.ramsize << 13;
+		return ram.sbank[0];
+	case GB_VRAM:
+		*len = sizeof lcd.vbank;
+		return lcd.vbank[0];
+	case GB_OAM:
+		*len = sizeof lcd.oam.mem;
+		return lcd.oam.mem;
+	}
+	return 0;
+}
+
+int gb_set_sram(const void *sram, int len)
+{
+	if (!loaded || !ram.sbank || len < 0 || len > mbc.ramsize << 13)
+		return -1;
+	memcpy(ram.sbank, sram, len);
+	mem_alldirty();
+	return 0;
+}
+
+int gb_rtc(int *v)
+{
+	if (!loaded || !rtc.batt) return -1;
+	rtc_get(v);
+	return 0;
+}
+
+int gb_set_rtc(const int *v, long long then)
+{
+	int c[7];
+
+	if (!loaded || !rtc.batt) return -1;
+	memcpy(c, v, sizeof c);
+	rtc_set(c, then);
+	return 0;
+}
+
+int gb_cover_size()
+{
+	return loaded ? prof_coversize() : 0;
+}
+
+void gb_cover(unsigned char *map)
+{
+	prof_cover(map);
+	profiling = map != 0;
+}
+
+int gb_cover_new()
+{
+	return prof_covered();
+}
+
+int gb_pc_span()
+{
+	return prof_span();
+}
+
+int gb_dead()
+{
+	return loaded && (stopped || (cpu.halt && !(R_IE & 0x1f)));
+}
+
+void gb_count_ops(int on)
+{
+	if (on) memset(prof_opcounts(), 0, OPCOUNTS * sizeof(unsigned long long));
+	opcounting = on;
+}
+
+unsigned long long *gb_op_counts()
+{
+	return prof_opcounts();
+}
+
+int gb_op_dump(const char *path)
+{
+	return prof_opdump((char *)path);
+}
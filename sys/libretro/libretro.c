@@ -0,0 +1,231 @@
+/*
+ * libretro.c
+ *
+ * gnuboy as a libretro core, on top of libgnuboy, for frontends that
+ * bring their own shaders, run-ahead and audio. Built with "make
+ * libretro", which needs libretro.h from the libretro SDK where
+ * LIBRETRO_INCS points.
+ *
+ * retro_run is one gb_run_frame. The lcd draws straight into the
+ * library's framebuffer, which is already 0x00RRGGBB rows, XRGB8888
+ * as libretro has it, so that's the buffer handed to the frontend and
+ * the picture is never copied; a frontend that won't take XRGB8888
+ * doesn't get the game. The frame's sound goes out in one
+ * audio_sample_batch, just as gb_audio has it.
+ *
+ * States are gb_save_state's plain layout, whose size is fixed once a
+ * rom is loaded (it goes by the rom's ram and whether it's a color
+ * game, never by what's in the machine), so retro_serialize_size
+ * answers the same all through a game and run-ahead and rewind in the
+ * frontend work. Cartridge ram is given to the frontend as it is in
+ * the emulator, for it to save and fill in again after loading.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libretro.h"
+#include "../lib/gnuboy.h"
+#include "../../Version"
+
+#define SAMPLERATE 44100
+/* 4194304 Hz over 70224 cycles a frame */
+#define FPS 59.7275
+
+static retro_environment_t environ_cb;
+static retro_video_refresh_t video_cb;
+static retro_audio_sample_t audio_cb;
+static retro_audio_sample_batch_t audio_batch_cb;
+static retro_input_poll_t poll_cb;
+static retro_input_state_t input_cb;
+
+static int loaded;
+
+/* libretro's joypad ids to the GB_ bits */
+static const struct { unsigned id; int bit; } pad[] =
+{
+	{ RETRO_DEVICE_ID_JOYPAD_RIGHT, GB_RIGHT },
+	{ RETRO_DEVICE_ID_JOYPAD_LEFT, GB_LEFT },
+	{ RETRO_DEVICE_ID_JOYPAD_UP, GB_UP },
+	{ RETRO_DEVICE_ID_JOYPAD_DOWN, GB_DOWN },
+	{ RETRO_DEVICE_ID_JOYPAD_A, GB_A },
+	{ RETRO_DEVICE_ID_JOYPAD_B, GB_B },
+	{ RETRO_DEVICE_ID_JOYPAD_SELECT, GB_SELECT },
+	{ RETRO_DEVICE_ID_JOYPAD_START, GB_START },
+};
+
+void retro_set_environment(retro_environment_t cb)
+{
+	environ_cb = cb;
+}
+
+void retro_set_video_refresh(retro_video_refresh_t cb)
+{
+	video_cb = cb;
+}
+
+void retro_set_audio_sample(retro_audio_sample_t cb)
+{
+	audio_cb = cb;
+}
+
+void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb)
+{
+	audio_batch_cb = cb;
+}
+
+void retro_set_input_poll(retro_input_poll_t cb)
+{
+	poll_cb = cb;
+}
+
+void retro_set_input_state(retro_input_state_t cb)
+{
+	input_cb = cb;
+}
+
+unsigned retro_api_version()
+{
+	return RETRO_API_VERSION;
+}
+
+void retro_init()
+{
+	gb_init(SAMPLERATE);
+}
+
+void retro_deinit()
+{
+	gb_unload();
+	loaded = 0;
+}
+
+void retro_get_system_info(struct retro_system_info *info)
+{
+	memset(info, 0, sizeof *info);
+	info->library_name = "gnuboy";
+	info->library_version = VERSION;
+	info->valid_extensions = "gb|gbc|cgb|sgb|zip|gz|xz";
+	info->need_fullpath = 0;
+	info->block_extract = 1;
+}
+
+void retro_get_system_av_info(struct retro_system_av_info *info)
+{
+	memset(info, 0, sizeof *info);
+	info->geometry.base_width = info->geometry.max_width = GB_WIDTH;
+	info->geometry.base_height = info->geometry.max_height = GB_HEIGHT;
+	info->geometry.aspect_ratio = (float)GB_WIDTH / GB_HEIGHT;
+	info->timing.fps = FPS;
+	info->timing.sample_rate = SAMPLERATE;
+}
+
+void retro_set_controller_port_device(unsigned port, unsigned device)
+{
+}
+
+void retro_reset()
+{
+	gb_reset();
+}
+
+void retro_run()
+{
+	const short *samples;
+	int i, buttons = 0, n;
+
+	poll_cb();
+	for (i = 0; i < (int)(sizeof pad / sizeof *pad); i++)
+		if (input_cb(0, RETRO_DEVICE_JOYPAD, 0, pad[i].id))
+			buttons |= pad[i].bit;
+	gb_set_input(buttons);
+	gb_run_frame();
+	video_cb(gb_framebuffer(), GB_WIDTH, GB_HEIGHT, GB_WIDTH * 4);
+	gb_audio(&samples, &n);
+	if (n) audio_batch_cb(samples, n);
+}
+
+size_t retro_serialize_size()
+{
+	return loaded ? gb_state_size() : 0;
+}
+
+bool retro_serialize(void *data, size_t size)
+{
+	return loaded && gb_save_state(data, size) >= 0;
+}
+
+bool retro_unserialize(const void *data, size_t size)
+{
+	return loaded && !gb_load_state(data, size);
+}
+
+/* nothing here takes codes; a frontend's own cheats poke system ram */
+void retro_cheat_reset()
+{
+}
+
+void retro_cheat_set(unsigned index, bool enabled, const char *code)
+{
+}
+
+bool retro_load_game(const struct retro_game_info *game)
+{
+	enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+
+	if (!game || !game->data) return 0;
+	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+	{
+		fprintf(stderr, "gnuboy: the frontend won't take XRGB8888\n");
+		return 0;
+	}
+	if (gb_load_rom_mem(game->data, game->size))
+	{
+		fprintf(stderr, "gnuboy: %s", gb_error());
+		return 0;
+	}
+	loaded = 1;
+	return 1;
+}
+
+bool retro_load_game_special(unsigned type,
+	const struct retro_game_info *info, size_t num)
+{
+	return 0;
+}
+
+void retro_unload_game()
+{
+	gb_unload();
+	loaded = 0;
+}
+
+unsigned retro_get_region()
+{
+	return RETRO_REGION_NTSC;
+}
+
+/* the emulator's own arrays; libgnuboy means them to be read, but
+   the frontend writes a game's save into cartridge ram after it's
+   loaded, which is exactly what reading the .sav file would do */
+void *retro_get_memory_data(unsigned id)
+{
+	int len;
+
+	if (!loaded) return 0;
+	if (id == RETRO_MEMORY_SAVE_RAM)
+		return (void *)gb_memory(GB_SRAM, &len);
+	if (id == RETRO_MEMORY_SYSTEM_RAM)
+		return (void *)gb_memory(GB_WRAM, &len);
+	return 0;
+}
+
+size_t retro_get_memory_size(unsigned id)
+{
+	int len = 0;
+
+	if (!loaded) return 0;
+	if (id == RETRO_MEMORY_SAVE_RAM) gb_memory(GB_SRAM, &len);
+	else if (id == RETRO_MEMORY_SYSTEM_RAM) gb_memory(GB_WRAM, &len);
+	return len;
+}
@@ -94,18 +94,18 @@ static void overlay_switch()
 	wrio4(BESA2ORG, base);
 	wrio4(BESB1ORG, base);
 	wrio4(BESB2ORG, base);
-	wrio4(BESPITCH, 320);
+	wrio4(BESPITCH, 160);
 	
 	/* dest */
 	a = (vi.xres - vmode[0])>>1;
 	b = vi.xres - a - 1;
 	wrio4(BESHCOORD,  (a << 16) | (b - 1));
 	
-	/* scale horiz */
-	wrio4(BESHISCAL,   320*131072/(b-a) & 0x001ffffc);
+	/* scale horiz, from the 160 pixels drawn */
+	wrio4(BESHISCAL,   160*131072/(b-a) & 0x001ffffc);
 	wrio4(BESHSRCST,   0 << 16);
-	wrio4(BESHSRCEND,  320 << 16);
-	wrio4(BESHSRCLST,  319 << 16);
+	wrio4(BESHSRCEND,  160 << 16);
+	wrio4(BESHSRCLST,  159 << 16);
 
 	/* dest */
 	a = (vi.yres - vmode[1])>>1;
@@ -143,11 +143,13 @@ static void overlay_init()
 	default:
 		return;
 	}
+	/* packed 4:2:2 a pixel at a time, which halves what goes over
+	   the bus from drawing each pixel as a pair of its own */
 	fb.w = 160;
 	fb.h = 144;
-	fb.pitch = 640;
-	fb.pelsize = 4;
-	fb.yuv = 1;
+	fb.pitch = 320;
+	fb.pelsize = 2;
+	fb.yuv = 2;
 	fb.cc[0].r = fb.cc[1].r = fb.cc[2].r = fb.cc[3].r = 0;
 	fb.cc[0].l = 0;
 	fb.cc[1].l = 24;
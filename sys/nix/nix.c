@@ -16,16 +16,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "../../defs.h"
 #include "../../rc.h"
+#include "../../diag.h"
 
 #define DOTDIR ".gnuboy"
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 #ifndef HAVE_USLEEP
 static void my_usleep(unsigned int us)
 {
@@ -36,36 +56,456 @@ static void my_usleep(unsigned int us)
 }
 #endif
 
+/* timers and sleeps go by the monotonic clock where there is one, so
+   pacing doesn't jump when the wall clock is set. sys_sleep sleeps
+   until an absolute deadline SPIN microseconds short of the end and
+   busy waits the rest; the kernel routinely wakes us up
+   late by tens of microseconds to a millisecond, and that shows up
+   as uneven frame times */
+#define SPIN 500
+
+#if defined(CLOCK_MONOTONIC)
+
+typedef struct timespec stamp;
+
+static void now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static long long usdiff(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000LL
+		+ (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void usadd(struct timespec *ts, int us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000L;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+#else
+
+typedef struct timeval stamp;
+
+static void now(struct timeval *tv)
+{
+	gettimeofday(tv, NULL);
+}
+
+static long long usdiff(struct timeval *a, struct timeval *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000LL + (a->tv_usec - b->tv_usec);
+}
+
+static void usadd(struct timeval *tv, int us)
+{
+	tv->tv_sec += us / 1000000;
+	tv->tv_usec += us % 1000000;
+	if (tv->tv_usec >= 1000000)
+	{
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+#endif
+
 void *sys_timer()
 {
-	struct timeval *tv;
+	stamp *ts;
 	
-	tv = malloc(sizeof(struct timeval));
-	gettimeofday(tv, NULL);
-	return tv;
+	ts = malloc(sizeof(stamp));
+	now(ts);
+	return ts;
 }
 
-int sys_elapsed(struct timeval *prev)
+/* microseconds since the last call, or since sys_timer */
+int sys_elapsed(void *prev)
 {
-	struct timeval tv;
-	int secs, usecs;
+	stamp ts;
+	long long us;
 	
-	gettimeofday(&tv, NULL);
-	secs = tv.tv_sec - prev->tv_sec;
-	usecs = tv.tv_usec - prev->tv_usec;
-	*prev = tv;
-	if (!secs) return usecs;
-	return 1000000 + usecs;
+	now(&ts);
+	us = usdiff(&ts, prev);
+	*(stamp *)prev = ts;
+	if (us < 0) return 0;
+	return us > INT_MAX ? INT_MAX : us;
+}
+
+struct thread
+{
+	void (*fn)(void *);
+	void *arg;
+};
+
+/* a thread writing to a pipe whose reader has gone gets an error,
+   rather than the SIGPIPE that would end the program */
+static void *thread(void *p)
+{
+	struct thread t = *(struct thread *)p;
+	sigset_t set;
+
+	free(p);
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, 0);
+	t.fn(t.arg);
+	diag_done();
+	return 0;
+}
+
+int sys_thread(void (*fn)(void *), void *arg)
+{
+	struct thread *t = malloc(sizeof *t);
+	pthread_attr_t a;
+	pthread_t id;
+	int err;
+
+	if (!t) return -1;
+	t->fn = fn;
+	t->arg = arg;
+	pthread_attr_init(&a);
+	pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&id, &a, thread, t);
+	pthread_attr_destroy(&a);
+	if (err) free(t);
+	return err ? -1 : 0;
+}
+
+void sys_onfork(void (*child)())
+{
+	pthread_atfork(0, 0, child);
+}
+
+int sys_pin(int cpu, int prio)
+{
+	int err = 0;
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (cpu >= 0 && cpu < CPU_SETSIZE)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		err |= pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	}
+	else if (cpu >= 0) err = -1;
+#else
+	if (cpu >= 0) err = -1;
+#endif
+#ifdef SCHED_FIFO
+	if (prio > 0)
+	{
+		struct sched_param sp;
+		int max = sched_get_priority_max(SCHED_FIFO);
+
+		memset(&sp, 0, sizeof sp);
+		sp.sched_priority = prio > max ? max : prio;
+		err |= pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	}
+#else
+	if (prio > 0) err = -1;
+#endif
+	return err ? -1 : 0;
+}
+
+#ifdef __linux__
+/* the cpus of numa node n, as sysfs lists them ("0-7,16-23"); -1 if
+   there's no such node */
+static int nodecpus(int n, cpu_set_t *set)
+{
+	char fn[64], buf[1024], *s;
+	int a, b;
+	FILE *f;
+
+	sprintf(fn, "/sys/devices/system/node/node%d/cpulist", n);
+	if (!(f = fopen(fn, "r"))) return -1;
+	s = fgets(buf, sizeof buf, f);
+	fclose(f);
+	if (!s) return -1;
+	CPU_ZERO(set);
+	while (*s >= '0' && *s <= '9')
+	{
+		a = b = strtol(s, &s, 10);
+		if (*s == '-') b = strtol(s + 1, &s, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++) CPU_SET(a, set);
+		if (*s++ != ',') break;
+	}
+	return 0;
+}
+
+/* the calling thread to the cpus of node, or to any cpu at all with
+   node -1 */
+static int setnode(int node)
+{
+	cpu_set_t set;
+	int i;
+
+	if (node >= 0 && nodecpus(node, &set)) return -1;
+	if (node < 0)
+	{
+		CPU_ZERO(&set);
+		for (i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof set, &set) ? -1 : 0;
+}
+#endif
+
+int sys_node(int cpu)
+{
+	int n = 0;
+#ifdef __linux__
+	cpu_set_t set;
+
+	for (; !nodecpus(n, &set); n++)
+		if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set))
+			return n;
+#endif
+	if (cpu >= 0) return 0;
+	return n ? n : 1;
+}
+
+int sys_pin_node(int node)
+{
+#ifdef __linux__
+	unsigned long from, to;
+	int n = sys_node(-1);
+
+	if (setnode(node)) return -1;
+#ifdef SYS_migrate_pages
+	/* pages shared with other processes stay where they are, unless
+	   we're allowed to move other people's pages, which is as well */
+	if (node >= 0 && n > 1 && node < (int)sizeof to * 8)
+	{
+		from = (n < (int)sizeof from * 8 ? (1UL << n) - 1 : ~0UL) & ~(1UL << node);
+		to = 1UL << node;
+		syscall(SYS_migrate_pages, 0, sizeof to * 8 + 1, &from, &to);
+	}
+#endif
+	return 0;
+#else
+	return node > 0 ? -1 : 0;
+#endif
+}
+
+char *sys_nodecopy(char *fn, int node)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+	cpu_set_t was;
+	char buf[65536], *path = 0;
+	int in, fd, n = 0;
+
+	if ((in = open(fn, O_RDONLY)) < 0) return 0;
+	if ((fd = syscall(SYS_memfd_create, "gnuboy-nodecopy", 0)) < 0)
+	{
+		close(in);
+		return 0;
+	}
+	/* tmpfs pages go on the node of whoever first writes them */
+	pthread_getaffinity_np(pthread_self(), sizeof was, &was);
+	if (!setnode(node))
+		while ((n = read(in, buf, sizeof buf)) > 0 && write(fd, buf, n) == n);
+	pthread_setaffinity_np(pthread_self(), sizeof was, &was);
+	close(in);
+	if (n || !(path = malloc(32)))
+	{
+		close(fd);
+		return 0;
+	}
+	sprintf(path, "/proc/self/fd/%d", fd);
+	return path;
+#else
+	return 0;
+#endif
+}
+
+unsigned sys_micros()
+{
+	stamp ts, zero;
+
+	now(&ts);
+	memset(&zero, 0, sizeof zero);
+	return usdiff(&ts, &zero);
 }
 
 void sys_sleep(int us)
 {
+	stamp end, ts;
+
+	if (us <= 0) return;
+	now(&ts);
+	end = ts;
+	usadd(&end, us);
+	if (us > SPIN)
+	{
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+		usadd(&ts, us - SPIN);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#elif defined(HAVE_USLEEP)
+		usleep(us - SPIN);
+#else
+		my_usleep(us - SPIN);
+#endif
+	}
+	do now(&ts);
+	while (usdiff(&end, &ts) > 0);
+}
+
+void sys_nap(int us)
+{
+	struct timespec ts;
+
 	if (us <= 0) return;
-#ifdef HAVE_USLEEP
-	usleep(us);
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000L;
+	nanosleep(&ts, NULL);
+}
+
+static void (*sampler)();
+
+static void onsample(int s)
+{
+	if (sampler) sampler();
+}
+
+int sys_sampler(void (*fn)(), int us)
+{
+#ifdef ITIMER_PROF
+	struct itimerval it;
+
+	memset(&it, 0, sizeof it);
+	sampler = fn;
+	if (fn)
+	{
+		signal(SIGPROF, onsample);
+		it.it_interval.tv_sec = it.it_value.tv_sec = us / 1000000;
+		it.it_interval.tv_usec = it.it_value.tv_usec = us % 1000000;
+	}
+	return setitimer(ITIMER_PROF, &it, 0);
 #else
-	my_usleep(us);
+	return -1;
+#endif
+}
+
+/* one client at a time, and only from this machine */
+int sys_listen(int port)
+{
+	struct sockaddr_in sa;
+	int s, c, on = 1;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(s, 1) < 0)
+	{
+		close(s);
+		return -1;
+	}
+	c = accept(s, 0, 0);
+	close(s);
+	if (c >= 0) setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	return c;
+}
+
+int sys_recv(int fd, int wait)
+{
+	unsigned char b;
+	int n;
+
+	do n = recv(fd, &b, 1, wait ? 0 : MSG_DONTWAIT);
+	while (n < 0 && errno == EINTR);
+	if (n == 1) return b;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -2;
+	return -1;
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
 #endif
+
+int sys_send(int fd, char *buf, int len)
+{
+	int n;
+
+	while (len > 0)
+	{
+		if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void sys_hangup(int fd)
+{
+	close(fd);
+}
+
+int sys_udp(int port, char *host, int peerport)
+{
+	struct sockaddr_in sa;
+	struct addrinfo hints, *ai;
+	char service[16];
+	int s;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	sprintf(service, "%d", peerport);
+	if (getaddrinfo(host, service, &hints, &ai)) return -1;
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		freeaddrinfo(ai);
+		return -1;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(s, (struct sockaddr *)&sa, sizeof sa) < 0
+		|| connect(s, ai->ai_addr, ai->ai_addrlen) < 0)
+	{
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(ai);
+	return s;
+}
+
+int sys_udprecv(int fd, char *buf, int len, int us)
+{
+	struct pollfd p;
+	int n;
+
+	p.fd = fd;
+	p.events = POLLIN;
+	if (us && poll(&p, 1, (us + 999) / 1000) <= 0) return -2;
+	do n = recv(fd, buf, len, MSG_DONTWAIT);
+	while (n < 0 && errno == EINTR);
+	/* nothing listening at the other end yet isn't the end */
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+		|| errno == ECONNREFUSED))
+		return -2;
+	return n;
+}
+
+int sys_udpsend(int fd, char *buf, int len)
+{
+	return send(fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
 }
 
 void sys_checkdir(char *path, int wr)
@@ -107,6 +547,74 @@ void sys_sanitize(char *s)
 {
 }
 
+/* map fn read-only. *len gets the file size; if size is larger, the
+   mapping is extended to size bytes and everything past the end of the
+   file reads as fill. the whole pages of the file stay backed by the
+   file itself so they can be shared with other processes. */
+void *sys_mapfile(char *fn, int *len, int size, int fill)
+{
+	struct stat st;
+	byte *p = 0;
+	int fd, whole;
+
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+		|| st.st_size <= 0 || st.st_size > INT_MAX)
+		goto done;
+	*len = st.st_size;
+	if (size < *len) size = *len;
+	if (size == *len)
+	{
+		p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) p = 0;
+		goto done;
+	}
+#ifdef MAP_ANONYMOUS
+	p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) { p = 0; goto done; }
+	whole = *len - *len % sysconf(_SC_PAGESIZE);
+	if ((whole && mmap(p, whole, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0)
+		== MAP_FAILED) || lseek(fd, whole, SEEK_SET) != whole
+		|| read(fd, p + whole, *len - whole) != *len - whole)
+	{
+		munmap(p, size);
+		p = 0;
+		goto done;
+	}
+	memset(p + *len, fill, size - *len);
+	mprotect(p + whole, size - whole, PROT_READ);
+#endif
+done:
+	close(fd);
+	return p;
+}
+
+void sys_unmapfile(void *p, int size)
+{
+	munmap(p, size);
+}
+
+int sys_putfile(char *fn, void *data, int len)
+{
+	char *tmp = malloc(strlen(fn) + 32);
+	int fd, ok = 0;
+
+	if (!tmp) return -1;
+	sprintf(tmp, "%s.%lu.%08lx", fn, (unsigned long)getpid(),
+		(unsigned long)time(0));
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0644)) >= 0)
+	{
+		ok = write(fd, data, len) == len;
+		if (close(fd) || !ok || rename(tmp, fn))
+		{
+			unlink(tmp);
+			ok = 0;
+		}
+	}
+	free(tmp);
+	return ok ? 0 : -1;
+}
+
 
 
 
@@ -105,6 +105,19 @@ int pcm_submit()
 	return 1;
 }
 
+int pcm_queued()
+{
+#ifdef SNDCTL_DSP_GETODELAY
+	int n;
+
+	if (dsp < 0 || paused || ioctl(dsp, SNDCTL_DSP_GETODELAY, &n) < 0)
+		return -1;
+	return n * 1000000LL / (pcm.hz * (pcm.stereo + 1));
+#else
+	return -1;
+#endif
+}
+
 void pcm_pause(int dopause)
 {
 	paused = dopause;
@@ -14,6 +14,7 @@
 
 #include "rc.h"
 #include "pcm.h"
+#include "emu.h"
 
 
 struct pcm pcm;
@@ -36,6 +37,10 @@ rcvar_t pcm_exports[] =
 
 static void audio_callback(void *blah, byte *stream, int len)
 {
+	static int pinned;
+
+	if (!pinned) emu_pin(PIN_AUDIO);
+	pinned = 1;
 	memcpy(stream, pcm.buf, len);
 	audio_done = 1;
 }
@@ -86,6 +91,11 @@ int pcm_submit()
 	return 1;
 }
 
+int pcm_queued()
+{
+	return -1;
+}
+
 void pcm_close()
 {
 	if (sound) SDL_CloseAudio();
@@ -167,15 +167,20 @@ void ev_poll(int wait)
 {
 	event_t ev;
 	SDL_Event event;
-	(void) wait;
+
+	if (wait && SDL_WaitEvent(&event)) goto process_evt;
 
 	while (SDL_PollEvent(&event))
 	{
+	process_evt:;
 		switch(event.type)
 		{
 		case SDL_ACTIVEEVENT:
 			if (event.active.state == SDL_APPACTIVE)
+			{
 				fb.enabled = event.active.gain;
+				fb.hidden = !event.active.gain;
+			}
 			break;
 		case SDL_KEYDOWN:
 			if ((event.key.keysym.sym == SDLK_RETURN) && (event.key.keysym.mod & KMOD_ALT))
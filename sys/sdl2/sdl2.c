@@ -11,12 +11,17 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <SDL2/SDL.h>
 
 #include "fb.h"
 #include "input.h"
 #include "rc.h"
+#include "scaler.h"
+#include "lcd.h"
+#include "gpu.h"
+#include "emu.h"
 
 extern void sdljoy_process_event(SDL_Event *event);
 
@@ -25,6 +30,9 @@ struct fb fb;
 static int fullscreen = 0;
 static int use_altenter = 1;
 static int vsync;
+static int vidthread;
+static int xbr, xbrthreads;
+static int gpurender;
 
 static SDL_Window *win;
 static SDL_Renderer *renderer;
@@ -32,9 +40,68 @@ static SDL_Texture *texture;
 
 static int vmode[3] = { 0, 0, 32 };
 
+static int fmt, scale;
+
+/* the core draws into pixels; shown is what the texture holds, so
+   vid_end can upload just the rows that changed, and skip presenting
+   at all when a frame comes out the same as the last one */
+static byte pixels[144][160*4], shown[144][160*4];
+static SDL_atomic_t redraw;
+
+/*
+ * With vidthread, the renderer belongs to a thread of its own and
+ * vid_end never waits for it. The core draws into frames[back]; at
+ * the end of a frame that buffer is swapped with ready, the newest
+ * finished frame, and the presenter swaps ready with the one it
+ * showed last. READY marks a frame in ready the presenter hasn't
+ * taken yet. With three buffers neither side ever waits for the
+ * other; frames the display has no time for are simply never shown.
+ */
+
+#define READY 4
+
+static byte frames[3][144][160*4];
+static int back;
+static SDL_atomic_t ready, quit;
+static SDL_sem *wake;
+static SDL_Thread *presenter;
+static char thread_err[256];
+
+/*
+ * With xbr, the texture holds the picture smoothed to xbr times its
+ * size, in big. It's done after the frame is finished, by whichever
+ * thread presents, a band of rows per thread: that one does the first
+ * band itself and hands each of the rest to a helper waiting on its
+ * own semaphore, then waits for them all to post done. With vidthread
+ * the lot goes on while the core emulates the next frame.
+ */
+
+#define MAXBANDS 16
+
+static struct band
+{
+	SDL_Thread *thread;
+	SDL_sem *go;
+	un16 *tmp;
+} bands[MAXBANDS];
+static int nbands, busy;
+static SDL_sem *banddone;
+static SDL_atomic_t bandquit;
+static un32 *big;
+static byte (*bandsrc)[160*4];
+static int bandy0, bandy1;
+
+/* with gpurender the core's lines come here as batches, see gpu.c,
+   one frame's worth in each of these, kept like frames */
+static struct gpuframe gframes[3];
+
 rcvar_t vid_exports[] =
 {
 	RCV_BOOL("vsync", &vsync, "enforce vsync (slow)"),
+	RCV_BOOL("vidthread", &vidthread, "present frames from a separate thread"),
+	RCV_INT("xbr", &xbr, "smooth the picture with xbr at 2, 3 or 4 times, 0 = off"),
+	RCV_INT("xbrthreads", &xbrthreads, "threads to share xbr among, 0 = one per cpu but one"),
+	RCV_BOOL("gpurender", &gpurender, "draw the picture with an opengl compute shader"),
 	RCV_VECTOR("vmode", &vmode, 3, "video mode: w h bpp"),
 	RCV_BOOL("fullscreen", &fullscreen, "start in fullscreen mode"),
 	RCV_BOOL("altenter", &use_altenter, "alt-enter can toggle fullscreen"),
@@ -62,16 +129,242 @@ static int mapscancode(SDL_Keycode sym)
 
 
 
+/* the renderer and texture, made and used by whichever thread
+   presents; returns 0 or -1 */
+static int mkrenderer()
+{
+	SDL_RendererInfo info;
+
+	/* warning: using vsync causes much higher CPU usage in the XServer
+	   you may want to turn it off using by setting the environment
+	   variable SDL_RENDER_VSYNC to "0" or "false", which activates
+	   SDL_HINT_RENDER_VSYNC (yes, the env var lacks "HINT") */
+	renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED|vsync*SDL_RENDERER_PRESENTVSYNC);
+	if (!renderer) {
+		fprintf(stderr, "warning: fallback to software renderer\n");
+		renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_SOFTWARE|vsync*SDL_RENDERER_PRESENTVSYNC);
+	}
+	if (!renderer) return -1;
+
+	SDL_GetRendererInfo(renderer, &info);
+	fprintf(stdout, "using renderer %s\n", info.name);
+
+	SDL_RenderSetScale(renderer, scale, scale);
+
+	if (big)
+	{
+		texture = SDL_CreateTexture(renderer, fmt,
+				SDL_TEXTUREACCESS_STREAMING, 160 * xbr, 144 * xbr);
+		SDL_UpdateTexture(texture, NULL, big, 160 * 4 * xbr);
+		return 0;
+	}
+	texture = SDL_CreateTexture(renderer, fmt,
+			SDL_TEXTUREACCESS_STREAMING, 160, 144);
+	SDL_UpdateTexture(texture, NULL, shown[0], sizeof shown[0]);
+	return 0;
+}
+
+static void rmrenderer()
+{
+	SDL_DestroyTexture(texture);
+	SDL_DestroyRenderer(renderer);
+}
+
+static void runband(int k)
+{
+	int h = bandy1 - bandy0;
+
+	scaler_band(big, 160 * 4 * xbr, bandsrc, sizeof bandsrc[0], xbr,
+		bandy0 + h * k / busy, bandy0 + h * (k + 1) / busy, bands[k].tmp);
+}
+
+static int band_thread(void *arg)
+{
+	struct band *b = arg;
+
+	for (;;)
+	{
+		SDL_SemWait(b->go);
+		if (SDL_AtomicGet(&bandquit)) break;
+		runband(b - bands);
+		SDL_SemPost(banddone);
+	}
+	return 0;
+}
+
+/* smooth rows y0 to y1 of p into big */
+static void smooth(byte (*p)[160*4], int y0, int y1)
+{
+	int k;
+
+	bandsrc = p;
+	bandy0 = y0;
+	bandy1 = y1;
+	/* a few rows aren't worth waking anyone for */
+	busy = (y1 - y0) / 16;
+	if (busy > nbands) busy = nbands;
+	if (busy < 1) busy = 1;
+	for (k = 1; k < busy; k++) SDL_SemPost(bands[k].go);
+	runband(0);
+	for (k = 1; k < busy; k++) SDL_SemWait(banddone);
+}
+
+static void startbands()
+{
+	int k;
+
+	nbands = xbrthreads > 0 ? xbrthreads : SDL_GetCPUCount() - 1;
+	if (nbands > MAXBANDS) nbands = MAXBANDS;
+	if (nbands < 1) nbands = 1;
+	if (!(big = calloc(160 * xbr * 144 * xbr, sizeof *big))
+		|| !(banddone = SDL_CreateSemaphore(0)))
+		die("SDL2: out of memory for xbr\n");
+	SDL_AtomicSet(&bandquit, 0);
+	for (k = 0; k < nbands; k++)
+	{
+		if (!(bands[k].tmp = malloc(SCALER_TMP * sizeof *bands[k].tmp)))
+			die("SDL2: out of memory for xbr\n");
+		if (k && (!(bands[k].go = SDL_CreateSemaphore(0))
+			|| !(bands[k].thread = SDL_CreateThread(band_thread, "xbr", &bands[k]))))
+			die("SDL2: can't start xbr threads: %s\n", SDL_GetError());
+	}
+}
+
+static void stopbands()
+{
+	int k;
+
+	SDL_AtomicSet(&bandquit, 1);
+	for (k = 0; k < nbands; k++)
+	{
+		if (k)
+		{
+			SDL_SemPost(bands[k].go);
+			SDL_WaitThread(bands[k].thread, 0);
+			SDL_DestroySemaphore(bands[k].go);
+		}
+		free(bands[k].tmp);
+	}
+	SDL_DestroySemaphore(banddone);
+	free(big);
+	big = 0;
+}
+
+/* show p, uploading only the rows that differ from what the texture
+   already has */
+static void present(byte (*p)[160*4])
+{
+	SDL_Rect r;
+	int top, bot, n = 160 * fb.pelsize;
+
+	for (top = 0; top < 144 && !memcmp(p[top], shown[top], n); top++);
+	for (bot = 144; bot > top && !memcmp(p[bot-1], shown[bot-1], n); bot--);
+	if (top < bot && big)
+	{
+		/* xbr looks two rows either way */
+		top = top > 2 ? top - 2 : 0;
+		bot = bot < 142 ? bot + 2 : 144;
+		smooth(p, top, bot);
+		r.x = 0;
+		r.y = top * xbr;
+		r.w = 160 * xbr;
+		r.h = (bot - top) * xbr;
+		SDL_UpdateTexture(texture, &r, big + r.y * r.w, r.w * 4);
+		memcpy(shown[top], p[top], (bot - top) * sizeof p[0]);
+	}
+	else if (top < bot)
+	{
+		r.x = 0;
+		r.y = top;
+		r.w = 160;
+		r.h = bot - top;
+		SDL_UpdateTexture(texture, &r, p[top], sizeof p[0]);
+		memcpy(shown[top], p[top], (bot - top) * sizeof p[0]);
+	}
+	else if (!SDL_AtomicGet(&redraw)) return;
+	SDL_AtomicSet(&redraw, 0);
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
+static int offload(struct lcdline *lines, int n, int sort)
+{
+	return gpu_add(&gframes[back], lines, n, sort);
+}
+
+/* after mkrenderer, in the same thread */
+static void startgpu()
+{
+	if (!gpurender) return;
+	if (gpu_init(texture))
+		fprintf(stderr, "warning: no opengl 4.3 compute shaders, drawing on the cpu\n");
+	else lcd_offload = offload;
+}
+
+static void stopgpu()
+{
+	int i;
+
+	lcd_offload = 0;
+	gpu_close();
+	for (i = 0; i < 3; i++)
+	{
+		free(gframes[i].b);
+		memset(&gframes[i], 0, sizeof gframes[i]);
+	}
+}
+
+/* show what the shader draws from f's batches; a frame with none,
+   being skipped, isn't presented again */
+static void present_gpu(struct gpuframe *f)
+{
+	if (f->n) gpu_draw(f);
+	else if (!SDL_AtomicGet(&redraw)) return;
+	SDL_AtomicSet(&redraw, 0);
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
+static int present_thread(void *arg)
+{
+	int front = 1;
+
+	emu_pin(PIN_PRESENT);
+	if (mkrenderer())
+	{
+		/* SDL keeps the error per thread */
+		snprintf(thread_err, sizeof thread_err, "%s", SDL_GetError());
+		SDL_SemPost(wake);
+		return -1;
+	}
+	startgpu();
+	SDL_SemPost(wake);
+	for (;;)
+	{
+		SDL_SemWait(wake);
+		if (SDL_AtomicGet(&quit)) break;
+		if (SDL_AtomicGet(&ready) & READY)
+			front = SDL_AtomicSet(&ready, front) & 3;
+		if (lcd_offload) present_gpu(&gframes[front]);
+		else present(frames[front]);
+	}
+	stopgpu();
+	rmrenderer();
+	return 0;
+}
+
+static void wantredraw()
+{
+	SDL_AtomicSet(&redraw, 1);
+	if (presenter) SDL_SemPost(wake);
+}
+
 void vid_init()
 {
 	int flags;
-	int scale = rc_getint("scale");
-	int pitch = 0;
-	int fmt = 0;
-	void *pixels = 0;
 	SDL_PixelFormat *format;
-	SDL_RendererInfo info;
 
+	scale = rc_getint("scale");
 	if (!vmode[0] || !vmode[1])
 	{
 		if (scale < 1) scale = 1;
@@ -84,6 +377,20 @@ void vid_init()
 		fmt = SDL_PIXELFORMAT_BGR565;
 	else
 		die("vmode pixel format not supported, choose 16 or 32");
+	if (xbr > 4) xbr = 4;
+	if (xbr < 2) xbr = 0;
+	if ((xbr || gpurender) && vmode[2] != 32)
+	{
+		fprintf(stderr, "warning: xbr and gpurender need 32 bit color, turning them off\n");
+		xbr = gpurender = 0;
+	}
+	/* the shader draws straight into the texture, with no pixels on
+	   this side for xbr to work from */
+	if (xbr && gpurender)
+	{
+		fprintf(stderr, "warning: xbr doesn't go with gpurender, turning it off\n");
+		xbr = 0;
+	}
 
 	flags = SDL_WINDOW_OPENGL;
 
@@ -101,39 +408,40 @@ void vid_init()
 
 	/* for SDL2, which uses OpenGL, we internally use scale 1 and
 	   render everything into a 32bit high color buffer, and let the
-	   hardware do the scaling; thus "fb.delegate_scaling" */
-
-	/* warning: using vsync causes much higher CPU usage in the XServer
-	   you may want to turn it off using by setting the environment
-	   variable SDL_RENDER_VSYNC to "0" or "false", which activates
-	   SDL_HINT_RENDER_VSYNC (yes, the env var lacks "HINT") */
-	renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED|vsync*SDL_RENDERER_PRESENTVSYNC);
-	if (!renderer) {
-		fprintf(stderr, "warning: fallback to software renderer\n");
-		renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_SOFTWARE|vsync*SDL_RENDERER_PRESENTVSYNC);
-	}
-	if (!renderer) die("SDL2: can't create renderer: %s\n", SDL_GetError());
+	   hardware do the scaling; thus "fb.delegate_scaling".
+	   the palette lookup stays on our side unless gpurender hands
+	   the whole picture to a shader (see gpu.c): at scale 1
+	   refresh_4 costs next to nothing, since the colour filter is
+	   applied once per palette entry when it changes, not per pixel */
 
-	SDL_GetRendererInfo(renderer, &info);
-	fprintf(stdout, "using renderer %s\n", info.name);
+	if (xbr) startbands();
 
-	SDL_RenderSetScale(renderer, scale, scale);
-
-	texture = SDL_CreateTexture(renderer, fmt,
-			SDL_TEXTUREACCESS_STREAMING, 160, 144);
+	if (vidthread)
+	{
+		back = 0;
+		SDL_AtomicSet(&ready, 2);
+		SDL_AtomicSet(&quit, 0);
+		if (!(wake = SDL_CreateSemaphore(0))
+			|| !(presenter = SDL_CreateThread(present_thread, "present", 0)))
+			die("SDL2: can't start presenter thread: %s\n", SDL_GetError());
+		SDL_SemWait(wake);
+		if (!renderer) die("SDL2: can't create renderer: %s\n", thread_err);
+	}
+	else if (mkrenderer())
+		die("SDL2: can't create renderer: %s\n", SDL_GetError());
+	else startgpu();
 
 	SDL_ShowCursor(0);
 
 	format = SDL_AllocFormat(fmt);
-	SDL_LockTexture(texture, NULL, &pixels, &pitch);
 
 	fb.delegate_scaling = 1;
 	fb.w = 160;
 	fb.h = 144;
 	fb.pelsize = vmode[2]/8;
-	fb.pitch = pitch;
+	fb.pitch = sizeof pixels[0];
 	fb.indexed = 0;
-	fb.ptr = pixels;
+	fb.ptr = vidthread ? frames[back][0] : pixels[0];
 
 	fb.cc[0].r = format->Rloss;
 	fb.cc[0].l = format->Rshift;
@@ -142,11 +450,11 @@ void vid_init()
 	fb.cc[2].r = format->Bloss;
 	fb.cc[2].l = format->Bshift;
 
-	SDL_UnlockTexture(texture);
 	SDL_FreeFormat(format);
 
 	fb.enabled = 1;
 	fb.dirty = 0;
+	wantredraw();
 }
 
 void ev_poll(int wait)
@@ -166,16 +474,25 @@ void ev_poll(int wait)
 			switch(event.window.event) {
 			case SDL_WINDOWEVENT_MINIMIZED:
 			case SDL_WINDOWEVENT_HIDDEN:
-				fb.enabled = 0; break;
+				fb.enabled = 0;
+				fb.hidden = 1;
+				break;
 			case SDL_WINDOWEVENT_SHOWN:
 			case SDL_WINDOWEVENT_RESTORED:
-				fb.enabled = 1; break;
+				fb.enabled = 1;
+				fb.hidden = 0;
+				wantredraw();
+				break;
+			case SDL_WINDOWEVENT_EXPOSED:
+			case SDL_WINDOWEVENT_SIZE_CHANGED:
+				wantredraw(); break;
 			}
 			break;
 		case SDL_KEYDOWN:
 			if ((event.key.keysym.sym == SDLK_RETURN) && (event.key.keysym.mod & KMOD_ALT)) {
 				SDL_SetWindowFullscreen(win, fullscreen ? 0 : SDL_WINDOW_FULLSCREEN);
 				fullscreen = !fullscreen;
+				wantredraw();
 			}
 			ev.type = EV_PRESS;
 			ev.code = mapscancode(event.key.keysym.sym);
@@ -213,9 +530,20 @@ void vid_preinit()
 
 void vid_close()
 {
-	SDL_UnlockTexture(texture);
-	SDL_DestroyTexture(texture);
-	SDL_DestroyRenderer(renderer);
+	if (presenter)
+	{
+		SDL_AtomicSet(&quit, 1);
+		SDL_SemPost(wake);
+		SDL_WaitThread(presenter, 0);
+		SDL_DestroySemaphore(wake);
+		presenter = 0;
+	}
+	else
+	{
+		stopgpu();
+		rmrenderer();
+	}
+	if (big) stopbands();
 	SDL_DestroyWindow(win);
 	SDL_Quit();
 	fb.enabled = 0;
@@ -228,25 +556,28 @@ void vid_settitle(char *title)
 
 void vid_begin()
 {
-	void *p = 0;
-	int pitch;
-	SDL_LockTexture(texture, NULL, &p, &pitch);
-	fb.ptr = p;
 }
 
 void vid_end()
 {
-	SDL_UnlockTexture(texture);
-	if (fb.enabled) {
-		SDL_RenderCopy(renderer, texture, NULL, NULL);
-		SDL_RenderPresent(renderer);
+	int done = back;
+
+	if (!fb.enabled) return;
+	if (!presenter)
+	{
+		if (lcd_offload) present_gpu(&gframes[0]);
+		else present(pixels);
+		return;
 	}
+	back = SDL_AtomicSet(&ready, back | READY) & 3;
+	/* the presenter is done with this one, or never got to it; then
+	   the tiles it carried go again with the next frame (the one
+	   just handed over may show them old, for a frame) */
+	gpu_drop(&gframes[back]);
+	/* a frame that's skipped draws nothing, so start from the last
+	   one; that way it comes out the same and isn't presented again */
+	if (!lcd_offload)
+		memcpy(frames[back], frames[done], sizeof frames[0]);
+	fb.ptr = frames[back][0];
+	SDL_SemPost(wake);
 }
-
-
-
-
-
-
-
-
@@ -0,0 +1,489 @@
+/*
+ * journal.c
+ *
+ * gnuboy-server's battery saves. Thousands of instances each writing
+ * a .sav and a .rtc of their own, whole, every so often, make for a
+ * storm of small synchronous writes; instead every worker maps one
+ * file, the journal, and appends to it a record for each 4k page of
+ * cartridge ram, and for the clock, that differs from the newest
+ * record of it. Appending is a memcpy under a lock on the file, and
+ * nothing waits on the disk as it goes: journal_commit writes out
+ * everything appended since the last commit at once, whoever's it
+ * was, so a second of records from every instance of every worker
+ * costs one sync.
+ *
+ * The newest record of a page is the page. Once the journal is three
+ * quarters full, journal_compact keeps only those and slides them down
+ * to the front, with the lock held to keep the other workers out.
+ * What it keeps is written to path.new and synced first, so a crash
+ * while it slides leaves the lot there for journal_create to put back
+ * in place. A record torn by a crash is found by its checksum, which
+ * journal_create looks at and nothing else needs to, as everything
+ * appended since went in whole under the lock.
+ *
+ * A save is known by the name its instance was given. journal_export
+ * writes one out as name.sav and name.rtc, the files the emulator
+ * itself would read with that savename.
+ *
+ * The file is a 4k header and then the records, each a 64 byte header
+ * and what it holds, a multiple of 64 bytes in all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define HEAD 4096
+#define PAGE 4096
+#define ALIGN(n) (((n) + 63) & ~63)
+#define MAGIC "GbJrnl1"
+/* what of two clocks is compared: the clock, not when it was taken */
+#define CLOCKCMP offsetof(struct jclock, pad)
+#define AT(ofs) ((struct rec *)(base + (ofs)))
+
+struct head
+{
+	char magic[8];
+	unsigned size, tail;
+	/* the tail at the last commit, and compactions so far, from 1 */
+	unsigned synced, gen;
+};
+
+/* sum is of everything from kind on */
+struct rec
+{
+	char magic[4];
+	unsigned len, sum, kind, page, pad;
+	char name[JNAME];
+};
+
+/* what a record holds; 0 for one a crash tore */
+enum { SRAM = 1, CLOCK };
+
+static char *file;
+static int fd = -1;
+static unsigned char *base;
+static struct head *head;
+
+
+static unsigned sum(struct rec *r)
+{
+	unsigned char *p = (unsigned char *)&r->kind;
+	unsigned char *e = (unsigned char *)r + r->len;
+	unsigned h = 2166136261u;
+
+	for (; p < e; p++) h = (h ^ *p) * 16777619;
+	return h;
+}
+
+/* the record at ofs, below end, and in *next where the one after it
+   starts; 0 and 0 if there's no record there. with check, 0 too for
+   one that isn't whole, with *next still set */
+static struct rec *rec(unsigned ofs, unsigned end, unsigned *next, int check)
+{
+	struct rec *r = AT(ofs);
+
+	*next = 0;
+	if (ofs + sizeof *r > end || memcmp(r->magic, "GbJr", 4)
+		|| r->len < sizeof *r || (r->len & 63) || r->len > end - ofs)
+		return 0;
+	*next = ofs + r->len;
+	return check && r->sum != sum(r) ? 0 : r;
+}
+
+/* records of the same page or clock of the same save */
+static int same(struct rec *a, struct rec *b)
+{
+	return a->kind == b->kind && a->page == b->page
+		&& !strncmp(a->name, b->name, JNAME);
+}
+
+static unsigned key(struct rec *r)
+{
+	unsigned h = 2166136261u ^ r->kind;
+	int i;
+
+	for (i = 0; i < JNAME && r->name[i]; i++)
+		h = (h ^ (unsigned char)r->name[i]) * 16777619;
+	return (h ^ r->page) * 16777619;
+}
+
+static char *newname(char *path)
+{
+	char *s = malloc(strlen(path) + 5);
+
+	if (s) sprintf(s, "%s.new", path);
+	return s;
+}
+
+static void unmap()
+{
+	if (base) munmap(base, head->size);
+	if (fd >= 0) close(fd);
+	base = 0;
+	head = 0;
+	fd = -1;
+}
+
+static int map(char *path)
+{
+	struct stat st;
+	void *p;
+
+	unmap();
+	free(file);
+	if (!(file = strdup(path)) || (fd = open(path, O_RDWR)) < 0) return -1;
+	if (fstat(fd, &st) || st.st_size < HEAD + PAGE || (st.st_size & (PAGE - 1))
+		|| (p = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))
+			== MAP_FAILED)
+	{
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	base = p;
+	head = p;
+	if (memcmp(head->magic, MAGIC, 8) || head->size != st.st_size
+		|| head->tail < HEAD || head->tail > head->size)
+	{
+		munmap(p, st.st_size);
+		base = 0;
+		head = 0;
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* the newest records of s's pages and clock, with the lock held */
+static void find(struct jsave *s)
+{
+	struct rec *r;
+	unsigned ofs, next;
+
+	memset(s->at, 0, sizeof s->at);
+	s->clock = 0;
+	for (ofs = HEAD; ofs < head->tail; ofs = next)
+	{
+		if (!(r = rec(ofs, head->tail, &next, 0))) break;
+		if (strncmp(r->name, s->name, JNAME)) continue;
+		if (r->kind == SRAM && r->page < JPAGES) s->at[r->page] = ofs;
+		else if (r->kind == CLOCK) s->clock = ofs;
+	}
+	s->gen = head->gen;
+}
+
+int journal_create(char *path, int size)
+{
+	struct head h;
+	unsigned ofs, next;
+	char *new = newname(path);
+	int f;
+
+	if (!new) return -1;
+	/* a compaction cut short; what it wrote is whole once its header
+	   is there, and then it's what the journal should be */
+	if ((f = open(new, O_RDONLY)) >= 0)
+	{
+		if (read(f, &h, sizeof h) == sizeof h && !memcmp(h.magic, MAGIC, 8))
+		{
+			if (rename(new, path) || truncate(path, h.size))
+			{
+				close(f);
+				free(new);
+				return -1;
+			}
+		}
+		else unlink(new);
+		close(f);
+	}
+	free(new);
+
+	if ((f = open(path, O_RDWR|O_CREAT|O_EXCL, 0644)) >= 0)
+	{
+		memset(&h, 0, sizeof h);
+		memcpy(h.magic, MAGIC, 8);
+		h.size = (size + PAGE - 1) & ~(PAGE - 1);
+		if (h.size < HEAD + PAGE) h.size = HEAD + PAGE;
+		h.tail = h.synced = HEAD;
+		h.gen = 1;
+		if (ftruncate(f, h.size) || pwrite(f, &h, sizeof h, 0) != sizeof h
+			|| fsync(f))
+		{
+			close(f);
+			unlink(path);
+			return -1;
+		}
+		close(f);
+	}
+	if (map(path)) return -1;
+
+	/* after a crash: the records from where the tail was last written
+	   out are as whole as the disk got them, and anything torn is let
+	   be, and what's past the last one cleared, so no older record
+	   turns up after a newer one once the tail has gone by */
+	for (ofs = HEAD; ofs < head->size; ofs = next)
+		if (!rec(ofs, head->size, &next, 1))
+		{
+			if (!next) break;
+			AT(ofs)->kind = 0;
+		}
+	if (ofs != head->tail || (ofs + 64 <= head->size
+		&& memcmp(base + ofs, "\0\0\0\0", 4)))
+	{
+		memset(base + ofs, 0, head->size - ofs);
+		head->tail = ofs;
+		head->synced = 0;
+	}
+	return journal_commit();
+}
+
+int journal_open(char *path)
+{
+	return map(path);
+}
+
+/* which of s's pages differ from its newest records of them, and bit
+   JPAGES for the clock; with the lock held */
+static unsigned long long differ(struct jsave *s, const unsigned char *sram,
+	int pages, const struct jclock *clock)
+{
+	unsigned long long d = 0;
+	int p;
+
+	if (s->gen != head->gen) find(s);
+	for (p = 0; p < pages; p++)
+		if (!s->at[p] || memcmp(AT(s->at[p]) + 1, sram + p * PAGE, PAGE))
+			d |= 1ULL << p;
+	if (clock && (!s->clock || memcmp(AT(s->clock) + 1, clock, CLOCKCMP)))
+		d |= 1ULL << JPAGES;
+	return d;
+}
+
+/* a record of s appended, with the lock held; -1 if there's no room */
+static int put(struct jsave *s, int kind, int page, const void *data, int len)
+{
+	struct rec *r;
+	unsigned n = ALIGN(sizeof *r + len), ofs = head->tail;
+
+	if (n > head->size - ofs) return -1;
+	r = AT(ofs);
+	memset(r, 0, n);
+	memcpy(r->magic, "GbJr", 4);
+	r->len = n;
+	r->kind = kind;
+	r->page = page;
+	memcpy(r->name, s->name, strnlen(s->name, JNAME - 1));
+	memcpy(r + 1, data, len);
+	r->sum = sum(r);
+	if (kind == SRAM) s->at[page] = ofs;
+	else s->clock = ofs;
+	head->tail = ofs + n;
+	return 0;
+}
+
+int journal_keep(struct jsave *s, const unsigned char *sram, int len,
+	const struct jclock *clock)
+{
+	unsigned long long d;
+	int pages = len / PAGE, p, n = 0;
+
+	if (!base) return -1;
+	if (pages > JPAGES) pages = JPAGES;
+	/* mostly nothing has changed, and finding that out only needs
+	   the lock shared */
+	flock(fd, LOCK_SH);
+	if ((d = differ(s, sram, pages, clock)))
+	{
+		/* not in one step; someone may compact in between */
+		flock(fd, LOCK_EX);
+		d = differ(s, sram, pages, clock);
+		for (p = 0; p <= JPAGES && n >= 0; p++)
+		{
+			if (!((d >> p) & 1)) continue;
+			if (p < JPAGES ? put(s, SRAM, p, sram + p * PAGE, PAGE)
+				: put(s, CLOCK, 0, clock, sizeof *clock))
+				n = -1;
+			else n++;
+		}
+	}
+	flock(fd, LOCK_UN);
+	return n;
+}
+
+int journal_load(struct jsave *s, unsigned char *sram, int len,
+	struct jclock *clock)
+{
+	int p, got = 0;
+
+	if (!base) return 0;
+	flock(fd, LOCK_SH);
+	find(s);
+	for (p = 0; p < JPAGES && (p + 1) * PAGE <= len; p++)
+	{
+		if (!s->at[p]) continue;
+		memcpy(sram + p * PAGE, AT(s->at[p]) + 1, PAGE);
+		got |= 1;
+	}
+	if (s->clock)
+	{
+		memcpy(clock, AT(s->clock) + 1, sizeof *clock);
+		got |= 2;
+	}
+	flock(fd, LOCK_UN);
+	return got;
+}
+
+int journal_commit()
+{
+	unsigned t;
+
+	if (!base) return -1;
+	if ((t = head->tail) == head->synced) return 0;
+	if (msync(base, (t + PAGE - 1) & ~(PAGE - 1), MS_SYNC)) return -1;
+	head->synced = t;
+	return 0;
+}
+
+int journal_compact(int force)
+{
+	struct head h;
+	struct rec *r;
+	unsigned *slot = 0, *keep = 0, ofs, next, end, dst, len;
+	char *new = 0;
+	int n = 0, k = 0, nslots, i, f = -1, ok = -1;
+
+	if (!base) return -1;
+	flock(fd, LOCK_EX);
+	end = head->tail;
+	if (!force && end - HEAD < (head->size - HEAD) / 4 * 3)
+	{
+		ok = 0;
+		goto done;
+	}
+	for (ofs = HEAD; ofs < end && rec(ofs, end, &next, 0); ofs = next) n++;
+	for (nslots = 64; nslots < 2 * n; nslots <<= 1);
+	if (!(slot = calloc(nslots, sizeof *slot))
+		|| !(keep = malloc((n + 1) * sizeof *keep))
+		|| !(new = newname(file)))
+		goto done;
+
+	/* the newest of each page and clock, the later taking the slot */
+	for (ofs = HEAD; ofs < end && (r = rec(ofs, end, &next, 0)); ofs = next)
+	{
+		if (r->kind != SRAM && r->kind != CLOCK) continue;
+		for (i = key(r) & (nslots - 1); slot[i] && !same(AT(slot[i]), r);
+			i = (i + 1) & (nslots - 1));
+		slot[i] = ofs;
+	}
+	for (ofs = HEAD; ofs < end && (r = rec(ofs, end, &next, 0)); ofs = next)
+	{
+		if (r->kind != SRAM && r->kind != CLOCK) continue;
+		for (i = key(r) & (nslots - 1); !same(AT(slot[i]), r);
+			i = (i + 1) & (nslots - 1));
+		if (slot[i] == ofs) keep[k++] = ofs;
+	}
+
+	/* written out and synced before anything here is touched, the
+	   header last, so it's only taken for the journal once it's whole */
+	if ((f = open(new, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) goto done;
+	for (i = 0, dst = HEAD; i < k; i++, dst += len)
+	{
+		len = AT(keep[i])->len;
+		if (pwrite(f, AT(keep[i]), len, dst) != (ssize_t)len) goto done;
+	}
+	h = *head;
+	h.tail = h.synced = dst;
+	h.gen++;
+	if (fsync(f) || pwrite(f, &h, sizeof h, 0) != sizeof h || fsync(f))
+		goto done;
+	close(f);
+	f = -1;
+
+	/* oldest first, so each only ever moves down over what's gone */
+	for (i = 0, dst = HEAD; i < k; i++, dst += len)
+	{
+		len = AT(keep[i])->len;
+		memmove(base + dst, base + keep[i], len);
+	}
+	memset(base + dst, 0, end - dst);
+	head->tail = dst;
+	head->gen++;
+	if (msync(base, head->size, MS_SYNC))
+	{
+		/* path.new still has it right, for the next start */
+		free(new);
+		new = 0;
+		goto done;
+	}
+	head->synced = dst;
+	ok = 0;
+done:
+	if (f >= 0) close(f);
+	if (new) unlink(new);
+	flock(fd, LOCK_UN);
+	free(slot);
+	free(keep);
+	free(new);
+	return ok;
+}
+
+int journal_export(char *name, char *dir)
+{
+	struct jsave s;
+	struct jclock c;
+	unsigned char *sram;
+	char *path;
+	FILE *f;
+	int got, pages = 0, p, r = 0;
+
+	memset(&s, 0, sizeof s);
+	strncpy(s.name, name, JNAME - 1);
+	sram = calloc(JPAGES, PAGE);
+	path = malloc(strlen(dir) + strlen(name) + 6);
+	if (!sram || !path || !(got = journal_load(&s, sram, JPAGES * PAGE, &c)))
+	{
+		free(sram);
+		free(path);
+		return -1;
+	}
+	for (p = 0; p < JPAGES; p++)
+		if (s.at[p]) pages = p + 1;
+	/* cartridge ram is in 8k banks */
+	pages = (pages + 1) & ~1;
+	if (got & 1)
+	{
+		sprintf(path, "%s/%s.sav", dir, name);
+		if (!(f = fopen(path, "wb"))) r = -1;
+		else
+		{
+			if (fwrite(sram, PAGE, pages, f) != (size_t)pages) r = -1;
+			if (fclose(f)) r = -1;
+		}
+	}
+	if (got & 2)
+	{
+		/* as rtc_save_internal writes it */
+		sprintf(path, "%s/%s.rtc", dir, name);
+		if (!(f = fopen(path, "wb"))) r = -1;
+		else
+		{
+			fprintf(f, "%d %d %d %02d %02d %02d %02d\n%ld\n",
+				c.v[0], c.v[1], c.v[2], c.v[3], c.v[4], c.v[5], c.v[6],
+				(long)c.when);
+			if (fclose(f)) r = -1;
+		}
+	}
+	free(sram);
+	free(path);
+	return r;
+}
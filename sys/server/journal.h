@@ -0,0 +1,54 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/* longest save name, with its terminating 0, and the most 4k pages
+   of cartridge ram one can have */
+#define JNAME 40
+#define JPAGES 32
+
+/* the cartridge clock as gb_rtc gives it, and the time() it was
+   taken at */
+struct jclock
+{
+	int v[7];
+	int pad;
+	long long when;
+};
+
+/* one battery save's place in the journal: where the newest record of
+   each page and of the clock is, 0 for none, as of compaction gen;
+   gen 0 until it's first been looked for */
+struct jsave
+{
+	char name[JNAME];
+	unsigned gen;
+	unsigned at[JPAGES], clock;
+};
+
+/* journal_create makes the journal at path size bytes long if it
+   isn't there, puts it right after a crash if it is, and maps it;
+   journal_open maps one made already, in a worker. both -1 if they
+   can't */
+int journal_create(char *path, int size);
+int journal_open(char *path);
+
+/* len bytes of cartridge ram at sram, and the clock if there's one,
+   recorded for s where they differ from its newest records; the number
+   of records made, or -1 if there wasn't room for them all */
+int journal_keep(struct jsave *s, const unsigned char *sram, int len,
+	const struct jclock *clock);
+/* s's newest records put into len bytes at sram and *clock; 1 if any
+   page was there, 2 if the clock was, or both */
+int journal_load(struct jsave *s, unsigned char *sram, int len,
+	struct jclock *clock);
+
+/* everything recorded so far written out to disk */
+int journal_commit();
+/* with force, or once the journal is three quarters full, only the
+   newest record of each page and clock kept */
+int journal_compact(int force);
+/* the save name as dir/name.sav and, if it has a clock, dir/name.rtc,
+   the emulator's own files */
+int journal_export(char *name, char *dir);
+
+#endif
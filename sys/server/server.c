@@ -0,0 +1,1014 @@
+/*
+ * server.c
+ *
+ * gnuboy-server: hosts many emulators in a few processes and lets
+ * clients drive them over a socket, instead of a process each. Every
+ * rom gets one worker process, forked the first time a client asks
+ * for it, and all the instances of that rom live in it as
+ * gb_instance_new copies, sharing the rom, the code and the tables; an
+ * instance costs its machine state, its picture and its sound, a few
+ * hundred kilobytes, where a process of its own costs some megabytes
+ * and a context switch every frame. Instances run one at a time in
+ * their worker, but the workers for different roms run at once.
+ *
+ *   gnuboy-server [-r samplerate] [-q cycles] [-z secs] [-p] [-C dir] [-P pack]
+ *       [-J journal] [-k ms] socket
+ *
+ * listens on the unix socket at that path, or on that tcp port if
+ * it's a number. A client's first line is
+ *
+ *   rom path
+ *
+ * and the connection is then handed to the worker for path, so every
+ * client of a rom sees its instances. After that it sends one command
+ * a line and gets back "ok", with anything the command gives after it
+ * on the same line, or "error" and why:
+ *
+ *   new                 an instance at power on; ok n
+ *   copy n              an instance in the state n is in; ok m
+ *   free n              throws n away
+ *   input n buttons     the pad, GB_* of gnuboy.h in hex, from now on
+ *   run n frames        runs n that many frames; error stopped if
+ *                       the game got somewhere it can't go on from
+ *   speed n how         from now on n runs by itself, in real time
+ *                       (how 1) or as fast as it can (-1), or not (0)
+ *   frame n             ok len, then len bytes: n's last picture, as
+ *                       gb_framebuffer has it
+ *   ram n               ok len, then work ram and ff80-ffff, as the
+ *                       ram of shmgb.h
+ *   audio n             ok len, then the last frame's sound
+ *   save n              ok len, then n's save state
+ *   load n len          followed by len bytes of save state for n
+ *   shm path            maps path, made by the client, to put each
+ *                       instance's frames in without asking
+ *   battery n name      n's cartridge ram and clock are kept in the
+ *                       journal as name from now on, after being
+ *                       filled from it; ok 1 if it had them, ok 0 if
+ *                       n starts out as it was
+ *   export name dir     writes name's battery save out of the journal
+ *                       as dir/name.sav and dir/name.rtc
+ *
+ * Instance 0 is the game as loaded. Once a client has given shm, the
+ * worker writes every frame run of instance n into the n'th struct
+ * shmgb_output in the file, if it's big enough to have one, as
+ * shmgnuboy does (see sys/shm/shmgb.h), so big outputs never go
+ * through the socket at all.
+ *
+ * Instances given a speed take turns on the worker's one thread
+ * between commands, each running on to where it should be (as far
+ * as the clock says for real time, without end for as fast as it
+ * can) no more than a slice at a time, -q cycles of gb_run_until,
+ * 8778 or a quarter of a frame by default. So each has the cache to
+ * itself for a while, none waits for the rest for more than a pass
+ * of slices, and thousands cost no threads at all. Their frames go
+ * to shm as they're made, with the sound run since the last one, a
+ * slice late at most.
+ *
+ * With -z, an instance no command has touched for that many seconds,
+ * and that isn't running by itself, is put to sleep with
+ * gb_instance_sleep, packed into a few kilobytes of memory instead of
+ * a few hundred; the next command for it wakes it, in well under a
+ * millisecond. A worker whose rom won't load says so
+ * to each client and goes away. With -P, "pack:hash" roms come out of
+ * that rom pack (see gnuboy-batch -M), mapped once here and shared by
+ * every worker.
+ *
+ * With -p, on a machine with several numa nodes, each worker is kept
+ * to the cpus of one node, the one with the fewest workers when it's
+ * forked, before it loads anything, so its instances are all in that
+ * node's memory; and with -P each node gets a copy of the pack in its
+ * own memory, for its workers' roms, as long as it's under PACKCOPY.
+ *
+ * With -J, battery saves are kept in the one journal file for every
+ * worker (see journal.c) rather than a .sav and .rtc for each game.
+ * Every -k ms, 1000 by default, each worker records the pages of
+ * cartridge ram and the clocks of the instances given names with
+ * "battery" that have been used since, where they've changed, and
+ * has the journal written out, one sync for the lot; likewise before
+ * an instance is freed or a worker goes. An instance isn't put to
+ * sleep until its save has been kept. Names are letters, digits and
+ * "-_.", not starting with a dot, and under JNAME long; export writes
+ * a save out as the files the emulator itself would read with that
+ * name for its savename, as of its last keeping.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <ctype.h>
+
+#include "../lib/gnuboy.h"
+#include "../shm/shmgb.h"
+#include "journal.h"
+
+#define MAXLINE 1024
+#define MAXCONNS 256
+#define MAXWORKERS 64
+/* cycles a second as gb_clock counts them, and a frame */
+#define CLOCKHZ 2097152
+#define FRAME 35112
+/* how far behind real time an instance may fall before it gives up
+   catching up */
+#define MAXLAG (4 * FRAME)
+/* the most a pack can be to be copied to each node */
+#define PACKCOPY (1 << 30)
+/* how big a new journal is made */
+#define JOURNALSIZE (64 << 20)
+
+static int samplerate = 44100;
+static int slice = FRAME / 4;
+static int idle;
+static char *cachedir;
+static char *packfile;
+static int nnodes = 1;
+static char **packcopy;
+static char *journal;
+static int keepms = 1000;
+
+
+static int writeall(int fd, const void *buf, int len)
+{
+	const char *p = buf;
+	int n;
+
+	while (len > 0)
+	{
+		if ((n = write(fd, p, len)) <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int listento(char *where)
+{
+	struct sockaddr_un sa;
+	struct addrinfo hints, *ai;
+	int s, on = 1;
+
+	if (!where[strspn(where, "0123456789")])
+	{
+		memset(&hints, 0, sizeof hints);
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if (getaddrinfo(0, where, &hints, &ai))
+		{
+			fprintf(stderr, "%s: bad port\n", where);
+			exit(1);
+		}
+		if ((s = socket(ai->ai_family, SOCK_STREAM, 0)) < 0
+			|| setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0
+			|| bind(s, ai->ai_addr, ai->ai_addrlen) < 0
+			|| listen(s, 64) < 0)
+		{
+			perror(where);
+			exit(1);
+		}
+		freeaddrinfo(ai);
+		return s;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	if (strlen(where) >= sizeof sa.sun_path)
+	{
+		fprintf(stderr, "%s: socket path too long\n", where);
+		exit(1);
+	}
+	strcpy(sa.sun_path, where);
+	unlink(where);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+		|| bind(s, (struct sockaddr *)&sa, sizeof sa) < 0
+		|| listen(s, 64) < 0)
+	{
+		perror(where);
+		exit(1);
+	}
+	return s;
+}
+
+/* handing a connection to a worker, and taking it there */
+static int passfd(int over, int fd)
+{
+	struct msghdr m;
+	struct cmsghdr *c;
+	struct iovec v;
+	char b = 0, ctl[CMSG_SPACE(sizeof fd)];
+
+	memset(&m, 0, sizeof m);
+	memset(ctl, 0, sizeof ctl);
+	v.iov_base = &b;
+	v.iov_len = 1;
+	m.msg_iov = &v;
+	m.msg_iovlen = 1;
+	m.msg_control = ctl;
+	m.msg_controllen = sizeof ctl;
+	c = CMSG_FIRSTHDR(&m);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof fd);
+	memcpy(CMSG_DATA(c), &fd, sizeof fd);
+	return sendmsg(over, &m, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int takefd(int over)
+{
+	struct msghdr m;
+	struct cmsghdr *c;
+	struct iovec v;
+	char b, ctl[CMSG_SPACE(sizeof(int))];
+	int fd;
+
+	memset(&m, 0, sizeof m);
+	v.iov_base = &b;
+	v.iov_len = 1;
+	m.msg_iov = &v;
+	m.msg_iovlen = 1;
+	m.msg_control = ctl;
+	m.msg_controllen = sizeof ctl;
+	if (recvmsg(over, &m, 0) != 1) return -1;
+	if (!(c = CMSG_FIRSTHDR(&m)) || c->cmsg_type != SCM_RIGHTS) return -1;
+	memcpy(&fd, CMSG_DATA(c), sizeof fd);
+	return fd;
+}
+
+
+/*
+ * The worker's side: one rom, its instances, and every client of it.
+ */
+
+struct conn
+{
+	int fd;
+	char *buf;
+	int len, max;
+	struct shmgb_output *shm;
+	int slots;
+	size_t shmlen;
+};
+
+struct inst
+{
+	unsigned pad;
+	unsigned frames;
+	int speed; /* 0 still, 1 real time, -1 flat out */
+	/* real time: the clock at start us, and since then */
+	unsigned long long base;
+	long long start;
+	/* the sound since the last frame published */
+	short audio[SHMGB_SAMPLES * 2];
+	int samples;
+	long long used; /* when a command last had it */
+	/* its battery save's name and place in the journal, if it has
+	   one, and whether it's been used since it was last kept */
+	struct jsave *save;
+	int touched;
+};
+
+static struct conn conns[MAXCONNS];
+static int nconns;
+static struct inst *insts;
+static int ninsts;
+/* when the journal was last brought up to date */
+static long long kept;
+/* the instance in a slice now, for onframe; -1 if none */
+static int slicing = -1;
+
+static void reply(struct conn *c, char *fmt, ...)
+{
+	char line[MAXLINE];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof line - 1, fmt, ap);
+	va_end(ap);
+	strcat(line, "\n");
+	writeall(c->fd, line, strlen(line));
+}
+
+static void payload(struct conn *c, const void *data, int len)
+{
+	reply(c, "ok %d", len);
+	writeall(c->fd, data, len);
+}
+
+static long long now();
+
+/* n, as the instance running now; -1 if there's no such one */
+static int pick(int n)
+{
+	if (n < 0 || n >= ninsts || gb_instance_select(n)) return -1;
+	insts[n].used = now();
+	insts[n].touched = 1;
+	return 0;
+}
+
+/* n's battery save into the journal, where it's changed; n is the one
+   running after */
+static void keep(int n)
+{
+	struct inst *p = &insts[n];
+	struct jclock clock;
+	const unsigned char *sram;
+	int len, have;
+
+	if (!p->save || gb_instance_select(n)) return;
+	p->touched = 0;
+	sram = gb_memory(GB_SRAM, &len);
+	memset(&clock, 0, sizeof clock);
+	clock.when = time(0);
+	have = !gb_rtc(clock.v);
+	if (journal_keep(p->save, sram, len, have ? &clock : 0) < 0
+		&& (journal_compact(1)
+		|| journal_keep(p->save, sram, len, have ? &clock : 0) < 0))
+		fprintf(stderr, "%s: full, %s not kept\n", journal, p->save->name);
+}
+
+/* with -J, every keepms, or now with force, the saves of every
+   instance used since kept and the journal written out; returns how
+   long until the next time, in ms, or -1 */
+static int keepall(int force)
+{
+	long long t = now(), left = kept + keepms * 1000LL - t;
+	int n;
+
+	if (!journal) return -1;
+	if (!force && left > 0) return (left + 999) / 1000;
+	for (n = 0; n < ninsts; n++)
+		if (insts[n].save && insts[n].touched) keep(n);
+	journal_commit();
+	journal_compact(0);
+	kept = t;
+	return keepms;
+}
+
+/* save names end up in file names */
+static int okname(char *s)
+{
+	int i;
+
+	if (!*s || *s == '.' || strlen(s) >= JNAME) return 0;
+	for (i = 0; s[i]; i++)
+		if (!isalnum((unsigned char)s[i]) && !strchr("-_.", s[i]))
+			return 0;
+	return 1;
+}
+
+/* the running instance n's save from now on is the one called name,
+   as the journal has it if it has it */
+static void battery(struct conn *c, int n, char *name)
+{
+	struct inst *p = &insts[n];
+	struct jclock clock;
+	const unsigned char *sram;
+	unsigned char *buf;
+	int len, got;
+
+	if (!journal)
+	{
+		reply(c, "error no journal");
+		return;
+	}
+	if (!okname(name))
+	{
+		reply(c, "error bad name %s", name);
+		return;
+	}
+	sram = gb_memory(GB_SRAM, &len);
+	if (!(buf = malloc(len + 1))
+		|| (!p->save && !(p->save = malloc(sizeof *p->save))))
+	{
+		free(buf);
+		reply(c, "error no room");
+		return;
+	}
+	memset(p->save, 0, sizeof *p->save);
+	strcpy(p->save->name, name);
+	if (len) memcpy(buf, sram, len);
+	got = journal_load(p->save, buf, len, &clock);
+	if (got & 1) gb_set_sram(buf, len);
+	if (got & 2) gb_set_rtc(clock.v, clock.when);
+	free(buf);
+	reply(c, "ok %d", got != 0);
+}
+
+/* puts to sleep whatever has been idle for long enough; returns how
+   long until the next will have been, in ms, or -1 */
+static int doze()
+{
+	long long t, wait = -1, left;
+	int n;
+
+	if (!idle) return -1;
+	t = now();
+	for (n = 0; n < ninsts; n++)
+	{
+		if (insts[n].speed || insts[n].used < 0) continue;
+		/* keepall gets to it first */
+		if (insts[n].save && insts[n].touched) continue;
+		left = insts[n].used + idle * 1000000LL - t;
+		if (left <= 0)
+		{
+			if (!gb_instance_sleep(n)) insts[n].used = -1;
+		}
+		else if (wait < 0 || left < wait) wait = left;
+	}
+	return wait < 0 ? -1 : (wait + 999) / 1000;
+}
+
+static int made(int n)
+{
+	struct inst *p;
+
+	if (n >= ninsts)
+	{
+		if (!(p = realloc(insts, (n + 1) * sizeof *p))) return -1;
+		insts = p;
+		memset(insts + ninsts, 0, (n + 1 - ninsts) * sizeof *p);
+		ninsts = n + 1;
+	}
+	free(insts[n].save);
+	memset(&insts[n], 0, sizeof insts[n]);
+	insts[n].used = now();
+	return 0;
+}
+
+static void getram(unsigned char *out)
+{
+	const unsigned char *p;
+	int len;
+
+	memset(out, 0, SHMGB_RAM);
+	if ((p = gb_memory(GB_WRAM, &len)))
+		memcpy(out, p, len < 0x8000 ? len : 0x8000);
+	if ((p = gb_memory(GB_HRAM, &len)))
+		memcpy(out + 0x8000, p + 0x80, 0x80);
+}
+
+/* frame's outputs, with count pairs of samples, into the n'th slot of
+   every client's shared file */
+static void publish(int n, const short *samples, int count)
+{
+	struct shmgb_output *o;
+	int i;
+
+	if (count > SHMGB_SAMPLES) count = SHMGB_SAMPLES;
+	for (i = 0; i < nconns; i++)
+	{
+		if (!conns[i].shm || n >= conns[i].slots) continue;
+		o = &conns[i].shm[n];
+		__atomic_store_n(&o->seq, o->seq | 1, __ATOMIC_RELEASE);
+		o->frame = insts[n].frames;
+		o->pad = insts[n].pad;
+		memcpy(o->pixels, gb_framebuffer(), sizeof o->pixels);
+		memcpy(o->audio, samples, count * 4);
+		o->samples = count;
+		getram(o->ram);
+		__atomic_store_n(&o->seq, o->seq + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static long long now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* gb_on_frame's, at vblank in a slice */
+static void onframe(void *arg)
+{
+	struct inst *p;
+
+	if (slicing < 0) return;
+	p = &insts[slicing];
+	p->frames++;
+	publish(slicing, p->audio, p->samples);
+	p->samples = 0;
+}
+
+/* the cycle n should get to by now, in *to; -1 if it doesn't run by
+   itself */
+static int due(int n, long long t, unsigned long long *to)
+{
+	struct inst *p = &insts[n];
+	unsigned long long at;
+
+	if (!p->speed || pick(n)) return -1;
+	at = gb_clock();
+	if (p->speed < 0)
+	{
+		*to = at + slice;
+		return 0;
+	}
+	*to = p->base + (t - p->start) * CLOCKHZ / 1000000;
+	if (*to > at + MAXLAG)
+	{
+		p->base = *to = at;
+		p->start = t;
+	}
+	return 0;
+}
+
+/* one pass: a slice for every instance that's behind; returns how
+   long poll may wait before the next, in ms, or -1 for as long as it
+   likes */
+static int schedule()
+{
+	struct inst *p;
+	const short *samples;
+	unsigned long long to, at;
+	long long t = now(), wait = -1, us;
+	int n, count, stopped;
+
+	for (n = 0; n < ninsts; n++)
+	{
+		if (due(n, t, &to)) continue;
+		p = &insts[n];
+		at = gb_clock();
+		if (to >= at + slice)
+		{
+			slicing = n;
+			stopped = gb_run_until(at + slice) < 0;
+			slicing = -1;
+			if (stopped)
+			{
+				/* it waits for a load now */
+				p->speed = 0;
+				continue;
+			}
+			gb_audio(&samples, &count);
+			if (count > SHMGB_SAMPLES - p->samples)
+				count = SHMGB_SAMPLES - p->samples;
+			memcpy(p->audio + p->samples * 2, samples, count * 4);
+			p->samples += count;
+			at = gb_clock();
+		}
+		if (p->speed < 0 || to >= at + slice) wait = 0;
+		else
+		{
+			us = (at + slice - to) * 1000000 / CLOCKHZ;
+			if (wait < 0 || us < wait) wait = us;
+		}
+	}
+	return wait < 0 ? -1 : (wait + 999) / 1000;
+}
+
+static void mapshm(struct conn *c, char *path)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (c->shm) munmap(c->shm, c->shmlen);
+	c->shm = 0;
+	c->slots = 0;
+	if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st) < 0
+		|| st.st_size < (off_t)sizeof *c->shm)
+	{
+		if (fd >= 0) close(fd);
+		reply(c, "error cannot map %s", path);
+		return;
+	}
+	p = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		reply(c, "error cannot map %s", path);
+		return;
+	}
+	c->shm = p;
+	c->shmlen = st.st_size;
+	c->slots = st.st_size / sizeof *c->shm;
+	reply(c, "ok %d", c->slots);
+}
+
+/* one command from c, whose line is len bytes of its buffer and
+   whose state, for load, follows it; returns what it took up, or 0
+   if the state hasn't all come yet */
+static int command(struct conn *c, char *line, int len)
+{
+	char cmd[16], arg[MAXLINE];
+	const short *samples;
+	unsigned char ram[SHMGB_RAM];
+	void *state;
+	int n = -1, m = 0, k;
+
+	*arg = 0;
+	k = sscanf(line, "%15s %d %d", cmd, &n, &m);
+	if (k < 1) return len;
+	if (!strcmp(cmd, "load"))
+	{
+		if (k < 3 || m < 0) reply(c, "error bad request");
+		else if (c->len - len < m) return 0;
+		else if (pick(n)) reply(c, "error no instance %d", n);
+		else if (gb_load_state(c->buf + len, m))
+			reply(c, "error bad state");
+		else reply(c, "ok");
+		return len + (m > 0 ? m : 0);
+	}
+	if (!strcmp(cmd, "new") || !strcmp(cmd, "copy"))
+	{
+		if (*cmd == 'c' && pick(n))
+			reply(c, "error no instance %d", n);
+		else if ((m = gb_instance_new()) < 0 || made(m))
+			reply(c, "error no room");
+		else
+		{
+			if (*cmd == 'n')
+			{
+				gb_instance_select(m);
+				gb_reset();
+			}
+			reply(c, "ok %d", m);
+		}
+		return len;
+	}
+	if (!strcmp(cmd, "shm"))
+	{
+		sscanf(line, "%*s %1023s", arg);
+		mapshm(c, arg);
+		return len;
+	}
+	if (!strcmp(cmd, "export"))
+	{
+		char name[JNAME];
+
+		if (sscanf(line, "%*s %39s %1023s", name, arg) != 2 || !okname(name))
+			reply(c, "error bad request");
+		else
+		{
+			for (m = 0; m < ninsts; m++)
+				if (insts[m].save && insts[m].touched
+					&& !strcmp(insts[m].save->name, name))
+					keep(m);
+			if (journal_export(name, arg))
+				reply(c, "error cannot export %s", name);
+			else reply(c, "ok");
+		}
+		return len;
+	}
+	if (k < 2 || pick(n))
+	{
+		reply(c, "error no instance %d", n);
+		return len;
+	}
+	if (!strcmp(cmd, "free"))
+	{
+		/* the one selected can't go, so pick another first */
+		keep(n);
+		for (m = 0; m < ninsts && (m == n || pick(m)); m++);
+		if (m == ninsts) reply(c, "error %d is the last one", n);
+		else
+		{
+			gb_instance_free(n);
+			insts[n].speed = 0;
+			insts[n].used = -1;
+			free(insts[n].save);
+			insts[n].save = 0;
+			reply(c, "ok");
+		}
+	}
+	else if (!strcmp(cmd, "input"))
+	{
+		sscanf(line, "%*s %*d %x", &insts[n].pad);
+		gb_set_input(insts[n].pad);
+		reply(c, "ok");
+	}
+	else if (!strcmp(cmd, "run"))
+	{
+		for (; m > 0; m--)
+		{
+			if (gb_run_frame() < 0) break;
+			insts[n].frames++;
+			gb_audio(&samples, &k);
+			publish(n, samples, k);
+		}
+		reply(c, m > 0 ? "error stopped" : "ok");
+	}
+	else if (!strcmp(cmd, "speed"))
+	{
+		if (k < 3 || m < -1 || m > 1) reply(c, "error bad request");
+		else
+		{
+			insts[n].speed = m;
+			insts[n].base = gb_clock();
+			insts[n].start = now();
+			insts[n].samples = 0;
+			reply(c, "ok");
+		}
+	}
+	else if (!strcmp(cmd, "frame"))
+		payload(c, gb_framebuffer(), GB_WIDTH * GB_HEIGHT * 4);
+	else if (!strcmp(cmd, "ram"))
+	{
+		getram(ram);
+		payload(c, ram, sizeof ram);
+	}
+	else if (!strcmp(cmd, "audio"))
+	{
+		gb_audio(&samples, &m);
+		payload(c, samples, m * 4);
+	}
+	else if (!strcmp(cmd, "battery"))
+	{
+		sscanf(line, "%*s %*d %1023s", arg);
+		battery(c, n, arg);
+	}
+	else if (!strcmp(cmd, "save"))
+	{
+		if ((state = malloc(gb_state_size()))
+			&& (m = gb_save_state(state, gb_state_size())) >= 0)
+			payload(c, state, m);
+		else reply(c, "error no room");
+		free(state);
+	}
+	else reply(c, "error what is %s", cmd);
+	return len;
+}
+
+static void hangup(int i)
+{
+	close(conns[i].fd);
+	free(conns[i].buf);
+	if (conns[i].shm) munmap(conns[i].shm, conns[i].shmlen);
+	conns[i] = conns[--nconns];
+}
+
+/* reads what's come on connection i and acts on every command that
+   has all come; -1 once it's gone */
+static int serve(int i)
+{
+	struct conn *c = &conns[i];
+	char *p, *nl;
+	int n, used;
+
+	if (c->max - c->len < MAXLINE)
+	{
+		if (!(p = realloc(c->buf, c->max + (c->max ? c->max : MAXLINE))))
+			return -1;
+		c->buf = p;
+		c->max += c->max ? c->max : MAXLINE;
+	}
+	if ((n = read(c->fd, c->buf + c->len, c->max - c->len)) <= 0)
+		return -1;
+	c->len += n;
+	for (;;)
+	{
+		if (!(nl = memchr(c->buf, '\n', c->len)))
+		{
+			if (c->len >= MAXLINE) return -1;
+			return 0;
+		}
+		*nl = 0;
+		/* a state still coming in; the buffer grows as it does */
+		if (!(used = command(c, c->buf, nl - c->buf + 1)))
+		{
+			*nl = '\n';
+			return 0;
+		}
+		memmove(c->buf, c->buf + used, c->len - used);
+		c->len -= used;
+	}
+}
+
+static void worker(char *rom, int ctl)
+{
+	struct pollfd pf[MAXCONNS + 1];
+	struct conn no;
+	int i, fd, failed = 0, wait = -1, w;
+	char *why = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	gb_init(samplerate);
+	if (cachedir) gb_rom_cache(cachedir);
+	if (packfile) gb_rom_pack(packfile);
+	if (gb_load_rom_file(rom))
+	{
+		failed = 1;
+		why = gb_error();
+	}
+	else made(0);
+	if (journal && journal_open(journal))
+	{
+		fprintf(stderr, "%s: cannot map it\n", journal);
+		journal = 0;
+	}
+	kept = now();
+	gb_on_frame(onframe, 0);
+	for (;;)
+	{
+		pf[0].fd = ctl;
+		pf[0].events = POLLIN;
+		for (i = 0; i < nconns; i++)
+		{
+			pf[i + 1].fd = conns[i].fd;
+			pf[i + 1].events = POLLIN;
+		}
+		if (poll(pf, nconns + 1, wait) < 0) continue;
+		if (pf[0].revents)
+		{
+			if ((fd = takefd(ctl)) < 0)
+			{
+				keepall(1);
+				_exit(0);
+			}
+			if (failed)
+			{
+				no.fd = fd;
+				reply(&no, "error %s: %s", rom, why ? why : "cannot load");
+				close(fd);
+				_exit(1);
+			}
+			if (nconns == MAXCONNS) close(fd);
+			else
+			{
+				memset(&conns[nconns], 0, sizeof conns[nconns]);
+				conns[nconns++].fd = fd;
+				reply(&conns[nconns - 1], "ok");
+			}
+		}
+		/* backwards, since a hangup moves the last one down */
+		for (i = nconns - 1; i >= 0; i--)
+			if (pf[i + 1].revents && serve(i) < 0)
+				hangup(i);
+		wait = schedule();
+		if ((w = doze()) >= 0 && (wait < 0 || w < wait)) wait = w;
+		if ((w = keepall(0)) >= 0 && (wait < 0 || w < wait)) wait = w;
+	}
+}
+
+
+/*
+ * The parent's side: deals connections out to the workers.
+ */
+
+static struct
+{
+	char *rom;
+	int ctl, node;
+	pid_t pid;
+} workers[MAXWORKERS];
+static int nworkers;
+
+/* the node with the fewest workers on it */
+static int quietest()
+{
+	int n[MAXWORKERS], i, k = 0;
+
+	for (i = 0; i < nnodes && i < MAXWORKERS; i++) n[i] = 0;
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].node < MAXWORKERS) n[workers[i].node]++;
+	for (i = 1; i < nnodes && i < MAXWORKERS; i++)
+		if (n[i] < n[k]) k = i;
+	return k;
+}
+
+static int spawn(char *rom)
+{
+	int sv[2], i, node = quietest();
+	pid_t pid;
+
+	if (nworkers == MAXWORKERS) return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+	if ((pid = fork()) < 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (!pid)
+	{
+		close(sv[0]);
+		for (i = 0; i < nworkers; i++) close(workers[i].ctl);
+		if (nnodes > 1)
+		{
+			gb_pin_node(node);
+			if (packcopy) packfile = packcopy[node];
+		}
+		worker(rom, sv[1]);
+	}
+	close(sv[1]);
+	workers[nworkers].rom = strdup(rom);
+	workers[nworkers].ctl = sv[0];
+	workers[nworkers].pid = pid;
+	workers[nworkers].node = node;
+	return nworkers++;
+}
+
+static void reap()
+{
+	pid_t pid;
+	int i, status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		for (i = 0; i < nworkers; i++)
+			if (workers[i].pid == pid)
+			{
+				close(workers[i].ctl);
+				free(workers[i].rom);
+				workers[i] = workers[--nworkers];
+				break;
+			}
+}
+
+static void dispatch(int c)
+{
+	char line[MAXLINE], rom[MAXLINE];
+	int n = 0, w;
+
+	while (n < MAXLINE - 1 && read(c, line + n, 1) == 1)
+		if (line[n++] == '\n') break;
+	line[n] = 0;
+	if (sscanf(line, "rom %1023[^\n]", rom) != 1)
+	{
+		writeall(c, "error say rom first\n", 20);
+		return;
+	}
+	reap();
+	for (w = 0; w < nworkers && strcmp(workers[w].rom, rom); w++);
+	if (w == nworkers && (w = spawn(rom)) < 0)
+	{
+		writeall(c, "error no more workers\n", 22);
+		return;
+	}
+	if (passfd(workers[w].ctl, c))
+		writeall(c, "error worker gone\n", 18);
+}
+
+/* a copy of the pack in each node's memory, for -p */
+static void copypack()
+{
+	struct stat st;
+	int k;
+
+	if (stat(packfile, &st) || st.st_size > PACKCOPY
+		|| !(packcopy = malloc(nnodes * sizeof *packcopy)))
+		return;
+	for (k = 0; k < nnodes; k++)
+		if (!(packcopy[k] = gb_node_copy(packfile, k)))
+			packcopy[k] = packfile;
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-r samplerate] [-q cycles] [-z secs] [-p] [-C dir] [-P pack] [-J journal] [-k ms] socket|port\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int s, c, pinned = 0;
+
+	while ((c = getopt(argc, argv, "r:q:z:pC:P:J:k:")) != -1)
+	{
+		if (c == 'r') samplerate = atoi(optarg);
+		else if (c == 'q' && atoi(optarg) > 0) slice = atoi(optarg);
+		else if (c == 'z') idle = atoi(optarg);
+		else if (c == 'p') pinned = 1;
+		else if (c == 'C') cachedir = optarg;
+		else if (c == 'P') packfile = optarg;
+		else if (c == 'J') journal = optarg;
+		else if (c == 'k' && atoi(optarg) > 0) keepms = atoi(optarg);
+		else usage(argv[0]);
+	}
+	if (optind != argc - 1) usage(argv[0]);
+	if (packfile)
+	{
+		gb_init(0);
+		if (gb_rom_pack(packfile))
+		{
+			fprintf(stderr, "%s", gb_error());
+			exit(1);
+		}
+	}
+	if (journal && journal_create(journal, JOURNALSIZE))
+	{
+		fprintf(stderr, "%s: cannot make a journal there\n", journal);
+		exit(1);
+	}
+	if (pinned) nnodes = gb_node(-1);
+	if (nnodes > 1 && packfile) copypack();
+	s = listento(argv[optind]);
+	signal(SIGPIPE, SIG_IGN);
+	for (;;)
+	{
+		if ((c = accept(s, 0, 0)) < 0) continue;
+		dispatch(c);
+		close(c);
+	}
+}
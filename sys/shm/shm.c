@@ -0,0 +1,244 @@
+/*
+ * shm.c
+ *
+ * Video, input and sound through shared memory, for a program that
+ * drives the emulator from outside (an agent, a test script) without
+ * screen grabs, fake key presses or sockets. The picture and the
+ * sound are made straight into the output slot for the frame, and
+ * the pad comes from the driver's input slots; the layout and the
+ * protocol are in shmgb.h. Like headlessgnuboy it never sleeps: the
+ * game runs as fast as it can, or with lockstep as fast as the driver
+ * hands it pads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "defs.h"
+#include "hw.h"
+#include "mem.h"
+#include "fb.h"
+#include "pcm.h"
+#include "rc.h"
+#include "sys.h"
+#include "shmgb.h"
+
+struct fb fb;
+struct pcm pcm;
+
+static char *shm_file;
+static int shm_lockstep;
+static int sound = 1;
+static int samplerate = 44100;
+
+rcvar_t vid_exports[] =
+{
+	RCV_STRING("shm_file", &shm_file, "file to share with the driver"),
+	RCV_BOOL("shm_lockstep", &shm_lockstep, "start out waiting for the driver's pad every frame"),
+	RCV_END
+};
+
+rcvar_t pcm_exports[] =
+{
+	RCV_BOOL("sound", &sound, "enable sound"),
+	RCV_INT("samplerate", &samplerate, "sample rate"),
+	RCV_END
+};
+
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static struct shmgb *shm;
+/* the slot being written; frames left on the pad we took last, and
+   the frame we took it after */
+static struct shmgb_output *cur;
+static unsigned held, taken;
+
+#ifdef __linux__
+
+static void wake(unsigned *p)
+{
+	syscall(SYS_futex, p, FUTEX_WAKE, 1 << 30, 0, 0, 0);
+}
+
+/* until *p isn't v, but not forever, so quit and lockstep are seen
+   even by a driver that never wakes us */
+static void waitfor(unsigned *p, unsigned v)
+{
+	struct timespec ts = { 0, 100000000 };
+
+	syscall(SYS_futex, p, FUTEX_WAIT, v, &ts, 0, 0);
+}
+
+#else
+
+static void wake(unsigned *p)
+{
+}
+
+static void waitfor(unsigned *p, unsigned v)
+{
+	sys_sleep(100);
+}
+
+#endif
+
+
+void vid_preinit()
+{
+}
+
+void vid_init()
+{
+	int fd;
+
+	if (!shm_file) shm_file = strdup("/dev/shm/gnuboy");
+	fd = open(shm_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, sizeof *shm) < 0)
+		die("cannot make %s\n", shm_file);
+	shm = mmap(0, sizeof *shm, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) die("cannot map %s\n", shm_file);
+	shm->version = SHMGB_VERSION;
+	shm->size = sizeof *shm;
+	shm->lockstep = shm_lockstep;
+	STORE(&shm->magic, SHMGB_MAGIC);
+
+	fb.w = SHMGB_WIDTH;
+	fb.h = SHMGB_HEIGHT;
+	fb.pelsize = 4;
+	fb.pitch = SHMGB_WIDTH * 4;
+	fb.indexed = 0;
+	fb.cc[0].r = fb.cc[1].r = fb.cc[2].r = 0;
+	fb.cc[0].l = 16;
+	fb.cc[1].l = 8;
+	fb.cc[2].l = 0;
+	fb.enabled = 1;
+	fb.dirty = 0;
+	cur = &shm->out[0];
+	fb.ptr = (byte *)cur->pixels;
+}
+
+void vid_close()
+{
+	fb.enabled = 0;
+	if (!shm) return;
+	munmap(shm, sizeof *shm);
+	shm = 0;
+}
+
+void vid_settitle(char *title)
+{
+}
+
+void vid_setpal(int i, int r, int g, int b)
+{
+}
+
+/* the next frame goes straight into its slot */
+void vid_begin()
+{
+	if (!shm) return;
+	cur = &shm->out[shm->frames % SHMGB_OUTPUTS];
+	STORE(&cur->seq, cur->seq | 1);
+	fb.ptr = (byte *)cur->pixels;
+	fb.drawn = 0;
+	if (pcm.hz)
+	{
+		pcm.buf = (byte *)cur->audio;
+		pcm.pos = 0;
+	}
+}
+
+void vid_end()
+{
+}
+
+/* after each frame: the pad for the next, waiting for it with
+   lockstep. there's only one a frame, however often this is called */
+void ev_poll(int wait)
+{
+	struct shmgb_input *in;
+	int i;
+
+	if (!shm || taken == shm->frames) return;
+	if (LOAD(&shm->quit)) exit(0);
+	if (held > 1)
+	{
+		held--;
+		taken = shm->frames;
+		return;
+	}
+	while (LOAD(&shm->inhead) == shm->intail)
+	{
+		if (!LOAD(&shm->lockstep)) return;
+		waitfor(&shm->inhead, shm->intail);
+		if (LOAD(&shm->quit)) exit(0);
+	}
+	in = &shm->in[shm->intail % SHMGB_INPUTS];
+	for (i = 1; i < 256; i <<= 1)
+		if ((hw.pad ^ in->pad) & i)
+			pad_set(i, in->pad & i);
+	held = in->frames;
+	STORE(&shm->intail, shm->intail + 1);
+	taken = shm->frames;
+}
+
+
+void pcm_init()
+{
+	memset(&pcm, 0, sizeof pcm);
+	if (!sound) return;
+	/* a frame's sound has to fit its slot */
+	if (samplerate > 96000) samplerate = 96000;
+	pcm.hz = samplerate;
+	pcm.stereo = 1;
+	pcm.bits = 16;
+	pcm.len = sizeof cur->audio;
+	if (shm) shm->hz = pcm.hz;
+}
+
+void pcm_close()
+{
+	memset(&pcm, 0, sizeof pcm);
+}
+
+/* the end of the frame, whether it was drawn or not: a skipped one
+   (frameskip, runahead) has the last picture again */
+int pcm_submit()
+{
+	struct shmgb_output *last;
+
+	if (!shm) return 1;
+	last = &shm->out[(shm->frames + SHMGB_OUTPUTS - 1) % SHMGB_OUTPUTS];
+	if (!fb.drawn && last != cur)
+		memcpy(cur->pixels, last->pixels, sizeof cur->pixels);
+	memcpy(cur->ram, ram.ibank, WRAMBANKS << 12);
+	memcpy(cur->ram + 0x8000, ram.hi + 0x80, 0x80);
+	cur->samples = pcm.buf == (byte *)cur->audio ? pcm.pos / 4 : 0;
+	cur->pad = hw.pad;
+	cur->frame = shm->frames + 1;
+	STORE(&cur->seq, cur->seq + 1);
+	STORE(&shm->frames, shm->frames + 1);
+	wake(&shm->frames);
+	pcm.pos = 0;
+	return 1;
+}
+
+int pcm_queued()
+{
+	return -1;
+}
+
+void pcm_pause(int dopause)
+{
+}
@@ -0,0 +1,101 @@
+#ifndef SHMGB_H
+#define SHMGB_H
+
+/*
+ * shmgb.h
+ *
+ * The layout of the shared memory shmgnuboy runs through, for the
+ * program on the other side of it (an agent, a test script) to
+ * include. The emulator makes the file, "shm_file", zeroed, and sets
+ * magic last; a driver maps the whole of it shared and waits for
+ * magic before looking at anything else.
+ *
+ * Counters only ever go up, and wrap. The driver puts pads in
+ * in[inhead % SHMGB_INPUTS] and then moves inhead on; the emulator
+ * takes one after each frame it finishes and moves intail on. A slot
+ * holds for its frames count of frames (0 is 1), and once the slots
+ * run out the last pad stays held. So inhead - intail is how many are
+ * waiting, and a driver shouldn't let that reach SHMGB_INPUTS.
+ *
+ * Frame n (counting from 1) goes in out[(n - 1) % SHMGB_OUTPUTS],
+ * written in place while it runs: the picture, the sound, and after
+ * it a copy of the ram. seq is odd while a slot is being written and
+ * goes on to even when it's done, and only then does frames become n.
+ * A reader that wants to be sure takes seq, reads what it wants,
+ * and checks seq is still the same, even value afterwards; one that
+ * keeps up with frames never sees a slot change under it.
+ *
+ * With lockstep set, the emulator waits after each frame until there
+ * is a pad for the next one, so a driver steps it one frame (or one
+ * slot's frames) at a time. On linux both counters are futexes: the
+ * emulator wakes anyone waiting on frames, and waits on inhead, for
+ * which a driver should wake it after moving inhead on. Setting quit
+ * makes the emulator exit.
+ *
+ * Everything is in the host's byte order.
+ */
+
+#define SHMGB_MAGIC 0x6273676e
+#define SHMGB_VERSION 1
+
+#define SHMGB_WIDTH 160
+#define SHMGB_HEIGHT 144
+#define SHMGB_INPUTS 64
+#define SHMGB_OUTPUTS 4
+/* stereo pairs a frame may have: 1608 at 96000 Hz */
+#define SHMGB_SAMPLES 2048
+/* all of work ram, the eight cgb banks of it, then ff80 to ffff */
+#define SHMGB_RAM (0x8000 + 0x80)
+
+/* pad bits, the same as PAD_* in hw.h */
+#define SHMGB_RIGHT  0x01
+#define SHMGB_LEFT   0x02
+#define SHMGB_UP     0x04
+#define SHMGB_DOWN   0x08
+#define SHMGB_A      0x10
+#define SHMGB_B      0x20
+#define SHMGB_SELECT 0x40
+#define SHMGB_START  0x80
+
+struct shmgb_input
+{
+	unsigned pad;
+	unsigned frames;
+};
+
+struct shmgb_output
+{
+	unsigned seq;
+	/* which frame this is, the pad it ran with, and the stereo pairs
+	   of sound it made */
+	unsigned frame;
+	unsigned pad;
+	unsigned samples;
+	/* 0x00RRGGBB, rows one after another */
+	unsigned pixels[SHMGB_WIDTH * SHMGB_HEIGHT];
+	short audio[SHMGB_SAMPLES * 2];
+	unsigned char ram[SHMGB_RAM];
+};
+
+struct shmgb
+{
+	unsigned magic, version, size;
+	/* sample rate, 0 with no sound */
+	unsigned hz;
+	char gap0[48];
+
+	/* written by the driver */
+	unsigned lockstep;
+	unsigned quit;
+	unsigned inhead;
+	char gap1[52];
+	struct shmgb_input in[SHMGB_INPUTS];
+
+	/* written by the emulator */
+	unsigned intail;
+	unsigned frames;
+	char gap2[56];
+	struct shmgb_output out[SHMGB_OUTPUTS];
+};
+
+#endif
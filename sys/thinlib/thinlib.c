@@ -167,6 +167,11 @@ int pcm_submit()
 	return 1;
 }
 
+int pcm_queued()
+{
+	return -1;
+}
+
 void pcm_pause(int dopause)
 {
 	sound_paused = dopause;
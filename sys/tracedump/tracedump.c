@@ -0,0 +1,82 @@
+/*
+ * tracedump.c
+ *
+ * gnuboy-tracedump: disassembles a binary trace written by gnuboy
+ * with "bintrace" set (see debug.c for the format), one instruction
+ * a line, using the same mnemonics as the "trace" output:
+ *
+ *   gnuboy-tracedump [-n count] file
+ *
+ * -n shows only the last count instructions. Each line has the
+ * cycle, bank:PC, the instruction bytes and mnemonic, then the
+ * registers and flags as they were before it ran.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "debug.h"
+
+static un32 get(byte *p, int n)
+{
+	un32 v = 0;
+
+	while (n--) v = (v << 8) | p[n];
+	return v;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	byte hdr[8], r[22];
+	char mnemonic[32];
+	unsigned long count, skip = 0, i;
+	int n, j, af;
+	char *name;
+
+	if (argc == 4 && !strcmp(argv[1], "-n"))
+	{
+		skip = strtoul(argv[2], 0, 10);
+		name = argv[3];
+	}
+	else if (argc == 2) name = argv[1];
+	else
+	{
+		fprintf(stderr, "usage: %s [-n count] file\n", argv[0]);
+		return 1;
+	}
+	if (!(f = fopen(name, "rb")))
+	{
+		perror(name);
+		return 1;
+	}
+	if (fread(hdr, 8, 1, f) != 1 || memcmp(hdr, "GBtr", 4))
+	{
+		fprintf(stderr, "%s: not a gnuboy binary trace\n", name);
+		return 1;
+	}
+	count = get(hdr + 4, 4);
+	skip = skip && skip < count ? count - skip : 0;
+	if (skip) fseek(f, 22 * skip, SEEK_CUR);
+
+	for (i = skip; i < count && fread(r, 22, 1, f) == 1; i++)
+	{
+		n = debug_mnemonic(mnemonic, r + 18);
+		af = get(r + 8, 2);
+		printf("%10lu %02X:%04X ", (unsigned long)get(r, 4),
+			get(r + 6, 2), get(r + 4, 2));
+		for (j = 0; j < 3; j++)
+			if (j < n) printf("%02X ", r[18+j]);
+			else printf("   ");
+		printf("%-16.16s AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X %c%c%c%c%c\n",
+			mnemonic, af, get(r + 10, 2), get(r + 12, 2),
+			get(r + 14, 2), get(r + 16, 2),
+			r[21] ? 'I' : '-',
+			af & 0x80 ? 'Z' : '-', af & 0x40 ? 'N' : '-',
+			af & 0x20 ? 'H' : '-', af & 0x10 ? 'C' : '-');
+	}
+	fclose(f);
+	return 0;
+}
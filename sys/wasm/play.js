@@ -0,0 +1,164 @@
+// play.js
+//
+// The page's half of the wasm port: loads gnuboy.js, draws its
+// framebuffer with webgl, plays its sound through worklet.js, and
+// calls wasm_step once per requestAnimationFrame. Keys are those
+// main.c binds by default: arrows, d for A, s for B, enter for start
+// and space or tab for select; a gamepad works too.
+
+'use strict';
+
+const RING = 8192;	// sample pairs the worklet's ring holds
+
+const KEYS = {
+	ArrowRight: 0x01, ArrowLeft: 0x02, ArrowUp: 0x04, ArrowDown: 0x08,
+	KeyD: 0x10, KeyS: 0x20, Space: 0x40, Tab: 0x40, Enter: 0x80,
+};
+
+let gb, gl, tex, node, sab = null, pos = null, ring = null;
+let actx = null, keys = 0, queued = 0, last = 0, looping = false;
+
+// the framebuffer is 0x00RRGGBB words, that is b, g, r, 0 bytes; they
+// go up as rgba and the shader puts them the right way round
+function video(canvas) {
+	gl = canvas.getContext('webgl', { alpha: false, antialias: false,
+		preserveDrawingBuffer: false });
+	const vs = 'attribute vec2 p; varying vec2 t;' +
+		'void main() { t = vec2(p.x + 1.0, 1.0 - p.y) * 0.5;' +
+		' gl_Position = vec4(p, 0.0, 1.0); }';
+	const fs = 'precision mediump float; varying vec2 t; uniform sampler2D s;' +
+		'void main() { gl_FragColor = vec4(texture2D(s, t).bgr, 1.0); }';
+	const prog = gl.createProgram();
+	for (const [type, src] of [[gl.VERTEX_SHADER, vs], [gl.FRAGMENT_SHADER, fs]]) {
+		const sh = gl.createShader(type);
+		gl.shaderSource(sh, src);
+		gl.compileShader(sh);
+		gl.attachShader(prog, sh);
+	}
+	gl.linkProgram(prog);
+	gl.useProgram(prog);
+	gl.bindBuffer(gl.ARRAY_BUFFER, gl.createBuffer());
+	gl.bufferData(gl.ARRAY_BUFFER,
+		new Float32Array([-1, -1, 1, -1, -1, 1, 1, 1]), gl.STATIC_DRAW);
+	gl.enableVertexAttribArray(0);
+	gl.vertexAttribPointer(0, 2, gl.FLOAT, false, 0, 0);
+	tex = gl.createTexture();
+	gl.bindTexture(gl.TEXTURE_2D, tex);
+	gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MIN_FILTER, gl.NEAREST);
+	gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MAG_FILTER, gl.NEAREST);
+	gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_S, gl.CLAMP_TO_EDGE);
+	gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_T, gl.CLAMP_TO_EDGE);
+	gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGBA, 160, 144, 0, gl.RGBA,
+		gl.UNSIGNED_BYTE, null);
+}
+
+function draw() {
+	const p = gb._wasm_framebuffer();
+	gl.viewport(0, 0, gl.canvas.width, gl.canvas.height);
+	gl.texSubImage2D(gl.TEXTURE_2D, 0, 0, 0, 160, 144, gl.RGBA,
+		gl.UNSIGNED_BYTE, gb.HEAPU8.subarray(p, p + 160 * 144 * 4));
+	gl.drawArrays(gl.TRIANGLE_STRIP, 0, 4);
+}
+
+// browsers only let sound start from a click or a key, so until then
+// wasm_step is told there's none and keeps time by the clock
+async function audio(ctx) {
+	await ctx.audioWorklet.addModule('worklet.js');
+	if (self.crossOriginIsolated) {
+		sab = new SharedArrayBuffer(8 + RING * 8);
+		pos = new Int32Array(sab, 0, 2);
+		ring = new Float32Array(sab, 8, RING * 2);
+	}
+	node = new AudioWorkletNode(ctx, 'gnuboy', {
+		numberOfInputs: 0, outputChannelCount: [2],
+		processorOptions: { size: RING, sab: sab },
+	});
+	if (!sab) node.port.onmessage = (e) => { queued = e.data; };
+	node.connect(ctx.destination);
+	for (const ev of ['keydown', 'pointerdown'])
+		addEventListener(ev, () => ctx.resume(), { once: true });
+}
+
+function pending(ctx) {
+	if (!node || ctx.state !== 'running') return -1;
+	if (!pos) return queued;
+	return (Atomics.load(pos, 0) - Atomics.load(pos, 1) + RING) % RING;
+}
+
+function send() {
+	const n = gb._wasm_audiolen();
+	if (!n || !node) return;
+	const p = gb._wasm_audio() >> 2;
+	const s = gb.HEAPF32.subarray(p, p + n);
+	if (!pos) {
+		node.port.postMessage(s.slice());
+		queued += n >> 1;
+		return;
+	}
+	let w = Atomics.load(pos, 0);
+	const rd = Atomics.load(pos, 1);
+	for (let i = 0; i < n >> 1; i++) {
+		if ((w + 1) % RING === rd) break;	// full; the rest is dropped
+		ring[w * 2] = s[i * 2];
+		ring[w * 2 + 1] = s[i * 2 + 1];
+		w = (w + 1) % RING;
+	}
+	Atomics.store(pos, 0, w);
+}
+
+function pad() {
+	let b = 0;
+	for (const g of navigator.getGamepads ? navigator.getGamepads() : []) {
+		if (!g || g.mapping !== 'standard') continue;
+		const on = (i) => g.buttons[i] && g.buttons[i].pressed;
+		if (on(15) || g.axes[0] > 0.5) b |= 0x01;
+		if (on(14) || g.axes[0] < -0.5) b |= 0x02;
+		if (on(12) || g.axes[1] < -0.5) b |= 0x04;
+		if (on(13) || g.axes[1] > 0.5) b |= 0x08;
+		if (on(1)) b |= 0x10;
+		if (on(0)) b |= 0x20;
+		if (on(8)) b |= 0x40;
+		if (on(9)) b |= 0x80;
+	}
+	return b;
+}
+
+function tick(ctx, now) {
+	const us = last ? Math.min((now - last) * 1000, 1000000) : 0;
+	last = now;
+	if (gb._wasm_step(us | 0, pending(ctx), keys | pad())) {
+		send();
+		draw();
+	}
+	requestAnimationFrame((t) => tick(ctx, t));
+}
+
+async function start(canvas, file) {
+	const data = new Uint8Array(await file.arrayBuffer());
+	if (!gb) {
+		const ctx = new AudioContext({ latencyHint: 'interactive' });
+		gb = await gnuboy();
+		gb._wasm_init(ctx.sampleRate);
+		video(canvas);
+		try { await audio(ctx); } catch (e) { node = null; }
+		addEventListener('keydown', (e) => {
+			if (!(e.code in KEYS)) return;
+			keys |= KEYS[e.code];
+			e.preventDefault();
+		});
+		addEventListener('keyup', (e) => {
+			if (e.code in KEYS) keys &= ~KEYS[e.code];
+		});
+		actx = ctx;
+	}
+	const p = gb._malloc(data.length);
+	gb.HEAPU8.set(data, p);
+	const err = gb._wasm_load(p, data.length);
+	gb._free(p);
+	if (err) {
+		alert(gb.UTF8ToString(gb._wasm_error()));
+		return;
+	}
+	if (!looping) requestAnimationFrame((t) => tick(actx, t));
+	looping = true;
+}
@@ -0,0 +1,118 @@
+/*
+ * wasm.c
+ *
+ * gnuboy in a web page, built with emscripten (see Makefile.wasm) on
+ * top of libgnuboy. Nothing here loops, sleeps or waits: the page
+ * (play.js) calls wasm_step from requestAnimationFrame, and it runs
+ * however many frames are due, often none on a fast display. The
+ * picture is left in gb_framebuffer for the page to give webgl as it
+ * is, and the sound is made into floats in a buffer of our own for
+ * the page to put in the ring the AudioWorklet (worklet.js) plays
+ * from.
+ *
+ * With sound, the sound card keeps time: frames are run until there
+ * is AHEAD of it queued, so the game keeps to the audio clock however
+ * unevenly frames are drawn. Without, it's the time between calls.
+ * Either way no more than MAXFRAMES are run in one call, so a tab
+ * coming back from the background carries on where it was rather
+ * than racing to catch up.
+ *
+ * Built with -msimd128 -msse2, the sse2 kernels in asm/simd become
+ * wasm simd, and clang vectorizes sound.c's output loops and the
+ * conversion below on its own.
+ */
+
+#include <stdlib.h>
+#include <emscripten.h>
+
+#include "../lib/gnuboy.h"
+
+/* a frame's length in us, 70224 cycles at 4194304 Hz */
+#define FRAMEUS 16743
+#define MAXFRAMES 4
+/* the sound to keep queued, in 1/AHEAD of a second */
+#define AHEAD 20
+
+static int hz, owed;
+/* a frame's sound is at most 4096 pairs, as libgnuboy keeps it */
+static float out[MAXFRAMES * 4096 * 2];
+static int nout;
+
+EMSCRIPTEN_KEEPALIVE
+void wasm_init(int samplerate)
+{
+	hz = samplerate;
+	gb_init(samplerate);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int wasm_load(const void *data, int len)
+{
+	owed = 0;
+	return gb_load_rom_mem(data, len);
+}
+
+EMSCRIPTEN_KEEPALIVE
+char *wasm_error()
+{
+	return gb_error();
+}
+
+EMSCRIPTEN_KEEPALIVE
+const unsigned *wasm_framebuffer()
+{
+	return gb_framebuffer();
+}
+
+/* the sound of the frames the last wasm_step ran, wasm_audiolen()
+   floats, left and right in turn */
+EMSCRIPTEN_KEEPALIVE
+float *wasm_audio()
+{
+	return out;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int wasm_audiolen()
+{
+	return nout;
+}
+
+static void frame()
+{
+	const short *s;
+	int n, i;
+
+	gb_run_frame();
+	gb_audio(&s, &n);
+	n *= 2;
+	if (n > (int)(sizeof out / sizeof *out) - nout)
+		n = sizeof out / sizeof *out - nout;
+	for (i = 0; i < n; i++)
+		out[nout + i] = s[i] * (1.0f / 32768);
+	nout += n;
+}
+
+/* us since the last call, and how many sample pairs the worklet still
+   has to play, or -1 if it isn't playing (the page hasn't been
+   clicked yet, say); returns the frames run */
+EMSCRIPTEN_KEEPALIVE
+int wasm_step(int us, int queued, int buttons)
+{
+	int n = 0;
+
+	nout = 0;
+	gb_set_input(buttons);
+	if (hz && queued >= 0)
+	{
+		owed = 0;
+		for (; n < MAXFRAMES && queued + nout / 2 < hz / AHEAD; n++)
+			frame();
+		return n;
+	}
+	owed += us;
+	if (owed > MAXFRAMES * FRAMEUS) owed = MAXFRAMES * FRAMEUS;
+	for (; owed >= FRAMEUS; owed -= FRAMEUS, n++)
+		frame();
+	return n;
+}
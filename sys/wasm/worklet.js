@@ -0,0 +1,54 @@
+// worklet.js
+//
+// The AudioWorkletProcessor play.js feeds. Samples come in a ring of
+// float pairs: shared with the page when it can have a
+// SharedArrayBuffer (the page is cross-origin isolated), posted to us
+// otherwise. What isn't there yet is played as silence rather than
+// waited for; the page keeps enough queued that it seldom happens.
+
+class GnuboyProcessor extends AudioWorkletProcessor {
+	constructor(options) {
+		super();
+		const o = options.processorOptions;
+		this.size = o.size;
+		if (o.sab) {
+			// [0] is where the page writes next, [1] where we read
+			this.pos = new Int32Array(o.sab, 0, 2);
+			this.ring = new Float32Array(o.sab, 8, this.size * 2);
+		} else {
+			this.pos = new Int32Array(2);
+			this.ring = new Float32Array(this.size * 2);
+			this.port.onmessage = (e) => this.put(e.data);
+		}
+	}
+
+	// what's posted, as play.js would have written it into a shared ring
+	put(s) {
+		let w = this.pos[0], n = s.length >> 1, i;
+		for (i = 0; i < n; i++) {
+			this.ring[w * 2] = s[i * 2];
+			this.ring[w * 2 + 1] = s[i * 2 + 1];
+			w = (w + 1) % this.size;
+			// too much: drop the oldest
+			if (w === this.pos[1]) this.pos[1] = (w + 1) % this.size;
+		}
+		this.pos[0] = w;
+		this.port.postMessage((w - this.pos[1] + this.size) % this.size);
+	}
+
+	process(inputs, outputs) {
+		const l = outputs[0][0], r = outputs[0][1] || l;
+		const w = Atomics.load(this.pos, 0);
+		let rd = Atomics.load(this.pos, 1), i;
+		for (i = 0; i < l.length && rd !== w; i++) {
+			l[i] = this.ring[rd * 2];
+			r[i] = this.ring[rd * 2 + 1];
+			rd = (rd + 1) % this.size;
+		}
+		for (; i < l.length; i++) l[i] = r[i] = 0;
+		Atomics.store(this.pos, 1, rd);
+		return true;
+	}
+}
+
+registerProcessor('gnuboy', GnuboyProcessor);
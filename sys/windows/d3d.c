@@ -0,0 +1,521 @@
+/*
+ * d3d.c
+ *
+ * Video through Direct3D 11 on Windows, for machines where SDL's GDI
+ * blits cost a copy on our side and another in the compositor. The
+ * core draws at 1x into memory, as with SDL2; vid_end copies that
+ * into a dynamic texture and a quad scales it to the window on the
+ * gpu, nearest or, with "d3d_filter", bilinear, kept at 160:144 with
+ * black either side.
+ *
+ * The swap chain is a flip model one (dxgi hands the back buffer to
+ * the compositor rather than copying it) with a waitable object and
+ * a frame latency of one. With "vsync" vid_begin waits on that
+ * object, so a frame is started just as the display can take it, not
+ * a few frames ahead of it; without, a frame finished while the last
+ * one is still queued is dropped, and nothing waits. Windows 7, with
+ * no flip model, gets an ordinary swap chain that Present paces.
+ * "fullscreen" is a borderless window over the whole monitor, which
+ * the compositor can flip to directly; alt-enter toggles it.
+ *
+ * Keys come from the window's messages (see keymap.c). Sound is
+ * SDL's, and there is no joystick.
+ */
+
+#define COBJMACROS
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include <initguid.h>
+#include <d3d11.h>
+#include <dxgi1_3.h>
+#include <d3dcompiler.h>
+
+#include "defs.h"
+#include "fb.h"
+#include "input.h"
+#include "rc.h"
+#include "sys.h"
+
+
+struct fb fb;
+
+static int vmode[3];
+static int vsync = 1;
+static int d3d_filter;
+static int fullscreen;
+static int use_altenter = 1;
+
+rcvar_t vid_exports[] =
+{
+	RCV_VECTOR("vmode", &vmode, 3, "window size: w h"),
+	RCV_BOOL("vsync", &vsync, "start each frame when the display can take it"),
+	RCV_BOOL("d3d_filter", &d3d_filter, "scale bilinear rather than nearest"),
+	RCV_BOOL("fullscreen", &fullscreen, "a borderless window over the whole monitor"),
+	RCV_BOOL("altenter", &use_altenter, "alt-enter can toggle fullscreen"),
+	RCV_END
+};
+
+static const char *shader =
+	"struct v { float4 pos : SV_Position; float2 uv : TEXCOORD0; };\n"
+	"Texture2D t : register(t0);\n"
+	"SamplerState s : register(s0);\n"
+	"\n"
+	/* a strip of 4 makes the quad, with no vertex buffer */
+	"v vs(uint id : SV_VertexID)\n"
+	"{\n"
+	"	v o;\n"
+	"	o.uv = float2(id & 1, id >> 1);\n"
+	"	o.pos = float4(o.uv.x * 2 - 1, 1 - o.uv.y * 2, 0, 1);\n"
+	"	return o;\n"
+	"}\n"
+	"\n"
+	"float4 ps(v i) : SV_Target\n"
+	"{\n"
+	"	return float4(t.Sample(s, i.uv).rgb, 1);\n"
+	"}\n";
+
+/* keymap - mappings of the form { vkey, localcode } - from windows/keymap.c */
+extern int keymap[][2];
+
+static HWND win;
+static ID3D11Device *dev;
+static ID3D11DeviceContext *ctx;
+static IDXGISwapChain1 *chain;
+static UINT chainflags;
+static HANDLE waitable;
+static ID3D11RenderTargetView *target;
+static ID3D11Texture2D *tex;
+static ID3D11ShaderResourceView *view;
+static ID3D11SamplerState *sampler;
+static ID3D11VertexShader *vs;
+static ID3D11PixelShader *ps;
+
+static int width, height, resized;
+/* the waitable object has been waited on for the next present */
+static int ready;
+static RECT windowed;
+
+static byte pixels[144][160 * 4];
+
+
+static int mapvkey(WPARAM k)
+{
+	int i;
+
+	for (i = 0; keymap[i][0]; i++)
+		if (keymap[i][0] == (int)k)
+			return keymap[i][1];
+	if (k >= '0' && k <= '9')
+		return k;
+	if (k >= 'A' && k <= 'Z')
+		return k - 'A' + 'a';
+	return 0;
+}
+
+static void setfullscreen(int on)
+{
+	MONITORINFO mi;
+	RECT *r = &windowed;
+
+	if (on)
+	{
+		GetWindowRect(win, &windowed);
+		mi.cbSize = sizeof mi;
+		GetMonitorInfo(MonitorFromWindow(win, MONITOR_DEFAULTTONEAREST), &mi);
+		r = &mi.rcMonitor;
+	}
+	SetWindowLongPtr(win, GWL_STYLE,
+		(on ? WS_POPUP : WS_OVERLAPPEDWINDOW) | WS_VISIBLE);
+	SetWindowPos(win, HWND_TOP, r->left, r->top,
+		r->right - r->left, r->bottom - r->top, SWP_FRAMECHANGED);
+	fullscreen = on;
+}
+
+static LRESULT CALLBACK winproc(HWND w, UINT msg, WPARAM wp, LPARAM lp)
+{
+	event_t ev;
+
+	switch (msg)
+	{
+	case WM_KEYDOWN:
+	case WM_SYSKEYDOWN:
+		/* held keys repeat; only the first is a press */
+		if (lp & (1 << 30)) return 0;
+		if (wp == VK_RETURN && msg == WM_SYSKEYDOWN && use_altenter)
+		{
+			setfullscreen(!fullscreen);
+			return 0;
+		}
+		ev.type = EV_PRESS;
+		ev.code = mapvkey(wp);
+		ev_postevent(&ev);
+		/* alt-f4 still closes the window */
+		if (wp == VK_F4 && msg == WM_SYSKEYDOWN) break;
+		return 0;
+	case WM_KEYUP:
+	case WM_SYSKEYUP:
+		ev.type = EV_RELEASE;
+		ev.code = mapvkey(wp);
+		ev_postevent(&ev);
+		return 0;
+	case WM_SIZE:
+		fb.hidden = wp == SIZE_MINIMIZED;
+		fb.enabled = !fb.hidden;
+		if (fb.hidden) return 0;
+		width = LOWORD(lp);
+		height = HIWORD(lp);
+		resized = 1;
+		return 0;
+	case WM_CLOSE:
+		exit(1);
+	}
+	return DefWindowProc(w, msg, wp, lp);
+}
+
+static void mktarget()
+{
+	ID3D11Texture2D *buf;
+
+	if (FAILED(IDXGISwapChain1_GetBuffer(chain, 0, &IID_ID3D11Texture2D,
+		(void **)&buf)))
+		die("d3d: no back buffer\n");
+	if (FAILED(ID3D11Device_CreateRenderTargetView(dev,
+		(ID3D11Resource *)buf, NULL, &target)))
+		die("d3d: can't render to the back buffer\n");
+	ID3D11Texture2D_Release(buf);
+}
+
+/* flip discard is windows 10, flip sequential 8, and the waitable
+   object 8.1; 7 gets a plain blit swap chain */
+static const struct
+{
+	DXGI_SWAP_EFFECT effect;
+	UINT flags, buffers;
+} chains[] =
+{
+	{ DXGI_SWAP_EFFECT_FLIP_DISCARD,
+		DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT, 2 },
+	{ DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL,
+		DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT, 2 },
+	{ DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL, 0, 2 },
+	{ DXGI_SWAP_EFFECT_DISCARD, 0, 1 },
+};
+
+static void mkchain()
+{
+	IDXGIDevice *dxdev;
+	IDXGIAdapter *adapter;
+	IDXGIFactory2 *factory;
+	IDXGISwapChain2 *chain2;
+	DXGI_SWAP_CHAIN_DESC1 d;
+	int i;
+
+	if (FAILED(ID3D11Device_QueryInterface(dev, &IID_IDXGIDevice,
+		(void **)&dxdev)))
+		die("d3d: no dxgi device\n");
+	IDXGIDevice_GetAdapter(dxdev, &adapter);
+	if (FAILED(IDXGIAdapter_GetParent(adapter, &IID_IDXGIFactory2,
+		(void **)&factory)))
+		die("d3d: dxgi 1.2 is needed (windows 7 platform update)\n");
+	IDXGIAdapter_Release(adapter);
+	IDXGIDevice_Release(dxdev);
+
+	memset(&d, 0, sizeof d);
+	d.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+	d.SampleDesc.Count = 1;
+	d.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+	d.Scaling = DXGI_SCALING_STRETCH;
+	d.AlphaMode = DXGI_ALPHA_MODE_IGNORE;
+	for (i = 0; i < (int)(sizeof chains / sizeof chains[0]); i++)
+	{
+		d.SwapEffect = chains[i].effect;
+		d.Flags = chains[i].flags;
+		d.BufferCount = chains[i].buffers;
+		if (SUCCEEDED(IDXGIFactory2_CreateSwapChainForHwnd(factory,
+			(IUnknown *)dev, win, &d, NULL, NULL, &chain)))
+			break;
+	}
+	if (!chain) die("d3d: can't make a swap chain\n");
+	chainflags = d.Flags;
+	/* alt-enter is ours, not dxgi's exclusive mode */
+	IDXGIFactory2_MakeWindowAssociation(factory, win, DXGI_MWA_NO_ALT_ENTER);
+	IDXGIFactory2_Release(factory);
+
+	if (chainflags && SUCCEEDED(IDXGISwapChain1_QueryInterface(chain,
+		&IID_IDXGISwapChain2, (void **)&chain2)))
+	{
+		IDXGISwapChain2_SetMaximumFrameLatency(chain2, 1);
+		waitable = IDXGISwapChain2_GetFrameLatencyWaitableObject(chain2);
+		IDXGISwapChain2_Release(chain2);
+	}
+	mktarget();
+}
+
+/* d3dcompiler comes and goes with the windows version; it's looked
+   up rather than linked, as the gl functions are in sys/sdl2/gpu.c */
+static void mkshaders()
+{
+	HMODULE lib;
+	pD3DCompile compile;
+	ID3DBlob *code, *err;
+
+	if (!(lib = LoadLibraryA("d3dcompiler_47.dll"))
+		&& !(lib = LoadLibraryA("d3dcompiler_43.dll")))
+		die("d3d: no d3dcompiler dll\n");
+	if (!(compile = (pD3DCompile)GetProcAddress(lib, "D3DCompile")))
+		die("d3d: no D3DCompile\n");
+
+	if (FAILED(compile(shader, strlen(shader), "d3d.c", NULL, NULL,
+		"vs", "vs_4_0", 0, 0, &code, &err)))
+		die("d3d: %s\n", (char *)ID3D10Blob_GetBufferPointer(err));
+	ID3D11Device_CreateVertexShader(dev, ID3D10Blob_GetBufferPointer(code),
+		ID3D10Blob_GetBufferSize(code), NULL, &vs);
+	ID3D10Blob_Release(code);
+
+	if (FAILED(compile(shader, strlen(shader), "d3d.c", NULL, NULL,
+		"ps", "ps_4_0", 0, 0, &code, &err)))
+		die("d3d: %s\n", (char *)ID3D10Blob_GetBufferPointer(err));
+	ID3D11Device_CreatePixelShader(dev, ID3D10Blob_GetBufferPointer(code),
+		ID3D10Blob_GetBufferSize(code), NULL, &ps);
+	ID3D10Blob_Release(code);
+
+	FreeLibrary(lib);
+	if (!vs || !ps) die("d3d: can't make shaders\n");
+}
+
+static void mktexture()
+{
+	D3D11_TEXTURE2D_DESC t;
+	D3D11_SAMPLER_DESC s;
+
+	memset(&t, 0, sizeof t);
+	t.Width = 160;
+	t.Height = 144;
+	t.MipLevels = 1;
+	t.ArraySize = 1;
+	t.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+	t.SampleDesc.Count = 1;
+	t.Usage = D3D11_USAGE_DYNAMIC;
+	t.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	t.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	if (FAILED(ID3D11Device_CreateTexture2D(dev, &t, NULL, &tex))
+		|| FAILED(ID3D11Device_CreateShaderResourceView(dev,
+			(ID3D11Resource *)tex, NULL, &view)))
+		die("d3d: can't make the texture\n");
+
+	memset(&s, 0, sizeof s);
+	s.Filter = d3d_filter ? D3D11_FILTER_MIN_MAG_MIP_LINEAR
+		: D3D11_FILTER_MIN_MAG_MIP_POINT;
+	s.AddressU = s.AddressV = s.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+	s.MaxLOD = D3D11_FLOAT32_MAX;
+	if (FAILED(ID3D11Device_CreateSamplerState(dev, &s, &sampler)))
+		die("d3d: can't make the sampler\n");
+}
+
+static void resize()
+{
+	resized = 0;
+	if (!chain || !width || !height) return;
+	ID3D11DeviceContext_OMSetRenderTargets(ctx, 0, NULL, NULL);
+	ID3D11RenderTargetView_Release(target);
+	if (FAILED(IDXGISwapChain1_ResizeBuffers(chain, 0, width, height,
+		DXGI_FORMAT_UNKNOWN, chainflags)))
+		die("d3d: can't resize the swap chain\n");
+	mktarget();
+}
+
+static void upload()
+{
+	D3D11_MAPPED_SUBRESOURCE m;
+	int y;
+
+	if (FAILED(ID3D11DeviceContext_Map(ctx, (ID3D11Resource *)tex, 0,
+		D3D11_MAP_WRITE_DISCARD, 0, &m)))
+		return;
+	for (y = 0; y < 144; y++)
+		memcpy((byte *)m.pData + y * m.RowPitch, pixels[y], sizeof pixels[0]);
+	ID3D11DeviceContext_Unmap(ctx, (ID3D11Resource *)tex, 0);
+}
+
+/* whether a present now is within the frame latency, waiting for
+   nothing */
+static int ours()
+{
+	if (waitable && !ready)
+		ready = WaitForSingleObject(waitable, 0) == WAIT_OBJECT_0;
+	return !waitable || ready;
+}
+
+static void draw()
+{
+	static const float black[4] = { 0, 0, 0, 1 };
+	D3D11_VIEWPORT vp;
+	HRESULT hr;
+	int w, h;
+
+	/* the biggest 160:144 that fits, in the middle */
+	w = width;
+	h = width * 144 / 160;
+	if (h > height)
+	{
+		h = height;
+		w = height * 160 / 144;
+	}
+	vp.TopLeftX = (width - w) / 2;
+	vp.TopLeftY = (height - h) / 2;
+	vp.Width = w;
+	vp.Height = h;
+	vp.MinDepth = 0;
+	vp.MaxDepth = 1;
+
+	/* the flip model unbinds the target at each present */
+	ID3D11DeviceContext_OMSetRenderTargets(ctx, 1, &target, NULL);
+	ID3D11DeviceContext_ClearRenderTargetView(ctx, target, black);
+	ID3D11DeviceContext_RSSetViewports(ctx, 1, &vp);
+	ID3D11DeviceContext_IASetPrimitiveTopology(ctx,
+		D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+	ID3D11DeviceContext_VSSetShader(ctx, vs, NULL, 0);
+	ID3D11DeviceContext_PSSetShader(ctx, ps, NULL, 0);
+	ID3D11DeviceContext_PSSetShaderResources(ctx, 0, 1, &view);
+	ID3D11DeviceContext_PSSetSamplers(ctx, 0, 1, &sampler);
+	ID3D11DeviceContext_Draw(ctx, 4, 0);
+	hr = IDXGISwapChain1_Present(chain, vsync, 0);
+	if (hr == DXGI_ERROR_DEVICE_REMOVED || hr == DXGI_ERROR_DEVICE_RESET)
+		die("d3d: the display device has gone\n");
+}
+
+void vid_preinit()
+{
+}
+
+void vid_init()
+{
+	WNDCLASSA wc;
+	RECT r;
+	D3D_FEATURE_LEVEL level;
+	int scale;
+
+	if (!vmode[0] || !vmode[1])
+	{
+		scale = rc_getint("scale");
+		if (scale < 1) scale = 1;
+		vmode[0] = 160 * scale;
+		vmode[1] = 144 * scale;
+	}
+
+	memset(&wc, 0, sizeof wc);
+	wc.lpfnWndProc = winproc;
+	wc.hInstance = GetModuleHandle(NULL);
+	wc.hCursor = LoadCursor(NULL, IDC_ARROW);
+	wc.lpszClassName = "gnuboy";
+	RegisterClassA(&wc);
+	r.left = r.top = 0;
+	r.right = vmode[0];
+	r.bottom = vmode[1];
+	AdjustWindowRect(&r, WS_OVERLAPPEDWINDOW, FALSE);
+	if (!(win = CreateWindowA("gnuboy", "gnuboy", WS_OVERLAPPEDWINDOW,
+		CW_USEDEFAULT, CW_USEDEFAULT, r.right - r.left, r.bottom - r.top,
+		NULL, NULL, wc.hInstance, NULL)))
+		die("d3d: can't make a window\n");
+	GetClientRect(win, &r);
+	width = r.right;
+	height = r.bottom;
+
+	if (FAILED(D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL,
+		D3D11_CREATE_DEVICE_BGRA_SUPPORT, NULL, 0, D3D11_SDK_VERSION,
+		&dev, &level, &ctx)))
+		die("d3d: no direct3d 11 device\n");
+	mkchain();
+	mkshaders();
+	mktexture();
+
+	ShowWindow(win, SW_SHOW);
+	if (fullscreen) setfullscreen(1);
+	ShowCursor(FALSE);
+
+	fb.delegate_scaling = 1;
+	fb.w = 160;
+	fb.h = 144;
+	fb.pelsize = 4;
+	fb.pitch = sizeof pixels[0];
+	fb.indexed = 0;
+	fb.ptr = pixels[0];
+	fb.cc[0].r = fb.cc[1].r = fb.cc[2].r = 0;
+	fb.cc[0].l = 16;
+	fb.cc[1].l = 8;
+	fb.cc[2].l = 0;
+	fb.enabled = 1;
+	fb.dirty = 0;
+}
+
+void vid_close()
+{
+	if (!win) return;
+	if (ctx) ID3D11DeviceContext_ClearState(ctx);
+	if (sampler) ID3D11SamplerState_Release(sampler);
+	if (view) ID3D11ShaderResourceView_Release(view);
+	if (tex) ID3D11Texture2D_Release(tex);
+	if (vs) ID3D11VertexShader_Release(vs);
+	if (ps) ID3D11PixelShader_Release(ps);
+	if (target) ID3D11RenderTargetView_Release(target);
+	if (waitable) CloseHandle(waitable);
+	if (chain) IDXGISwapChain1_Release(chain);
+	if (ctx) ID3D11DeviceContext_Release(ctx);
+	if (dev) ID3D11Device_Release(dev);
+	DestroyWindow(win);
+	sampler = 0, view = 0, tex = 0, vs = 0, ps = 0, target = 0;
+	waitable = 0, chain = 0, ctx = 0, dev = 0, win = 0;
+	fb.enabled = 0;
+}
+
+void vid_settitle(char *title)
+{
+	SetWindowTextA(win, title);
+}
+
+void vid_setpal(int i, int r, int g, int b)
+{
+}
+
+void vid_begin()
+{
+	/* a frame skipped or dropped still has its wait to come */
+	if (vsync && waitable && !ready && fb.enabled)
+		ready = WaitForSingleObjectEx(waitable, 100, TRUE)
+			== WAIT_OBJECT_0;
+}
+
+void vid_end()
+{
+	if (!fb.enabled || !fb.drawn) return;
+	fb.drawn = 0;
+	upload();
+	/* the last frame is still queued: this one's dropped, though it's
+	   in the texture for a resize to show */
+	if (!ours()) return;
+	ready = 0;
+	draw();
+}
+
+/* with wait, sleeps until there's a message, but not so long that
+   nothing else gets looked at */
+void ev_poll(int wait)
+{
+	MSG m;
+
+	if (wait) MsgWaitForMultipleObjects(0, NULL, FALSE, 100, QS_ALLINPUT);
+	while (PeekMessage(&m, NULL, 0, 0, PM_REMOVE))
+		DispatchMessage(&m);
+	if (resized)
+	{
+		resize();
+		if (fb.enabled && ours())
+		{
+			ready = 0;
+			draw();
+		}
+	}
+	joy_poll();
+}
@@ -0,0 +1,81 @@
+/*
+ * keymap.c
+ *
+ * Mappings from windows virtual keys to local key codes, for d3d.c.
+ * Letters and digits are their own ascii and aren't listed.
+ */
+
+#include <windows.h>
+#include "../../input.h"
+
+int keymap[][2] =
+{
+	{ VK_SHIFT, K_SHIFT },
+	{ VK_CONTROL, K_CTRL },
+	{ VK_MENU, K_ALT },
+	{ VK_LWIN, K_ALT },
+	{ VK_RWIN, K_ALT },
+
+	{ VK_UP, K_UP },
+	{ VK_DOWN, K_DOWN },
+	{ VK_RIGHT, K_RIGHT },
+	{ VK_LEFT, K_LEFT },
+	{ VK_RETURN, K_ENTER },
+	{ VK_SPACE, K_SPACE },
+	{ VK_TAB, K_TAB },
+	{ VK_BACK, K_BS },
+	{ VK_DELETE, K_DEL },
+	{ VK_INSERT, K_INS },
+	{ VK_HOME, K_HOME },
+	{ VK_END, K_END },
+	{ VK_PRIOR, K_PRIOR },
+	{ VK_NEXT, K_NEXT },
+	{ VK_ESCAPE, K_ESC },
+	{ VK_PAUSE, K_PAUSE },
+	{ VK_CAPITAL, K_CAPS },
+	{ VK_NUMLOCK, K_NUMLOCK },
+	{ VK_SCROLL, K_SCROLL },
+
+	{ VK_OEM_MINUS, K_MINUS },
+	{ VK_OEM_PLUS, K_EQUALS },
+	{ VK_OEM_3, K_TILDE },
+	{ VK_OEM_2, K_SLASH },
+	{ VK_OEM_5, K_BSLASH },
+	{ VK_OEM_1, K_SEMI },
+	{ VK_OEM_7, K_QUOTE },
+	{ VK_OEM_4, '[' },
+	{ VK_OEM_6, ']' },
+	{ VK_OEM_COMMA, ',' },
+	{ VK_OEM_PERIOD, '.' },
+
+	{ VK_F1, K_F1 },
+	{ VK_F2, K_F2 },
+	{ VK_F3, K_F3 },
+	{ VK_F4, K_F4 },
+	{ VK_F5, K_F5 },
+	{ VK_F6, K_F6 },
+	{ VK_F7, K_F7 },
+	{ VK_F8, K_F8 },
+	{ VK_F9, K_F9 },
+	{ VK_F10, K_F10 },
+	{ VK_F11, K_F11 },
+	{ VK_F12, K_F12 },
+
+	{ VK_NUMPAD0, K_NUM0 },
+	{ VK_NUMPAD1, K_NUM1 },
+	{ VK_NUMPAD2, K_NUM2 },
+	{ VK_NUMPAD3, K_NUM3 },
+	{ VK_NUMPAD4, K_NUM4 },
+	{ VK_NUMPAD5, K_NUM5 },
+	{ VK_NUMPAD6, K_NUM6 },
+	{ VK_NUMPAD7, K_NUM7 },
+	{ VK_NUMPAD8, K_NUM8 },
+	{ VK_NUMPAD9, K_NUM9 },
+	{ VK_ADD, K_NUMPLUS },
+	{ VK_SUBTRACT, K_NUMMINUS },
+	{ VK_MULTIPLY, K_NUMMUL },
+	{ VK_DIVIDE, K_NUMDIV },
+	{ VK_DECIMAL, K_NUMDOT },
+
+	{ 0, 0 }
+};
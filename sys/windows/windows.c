@@ -12,6 +12,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <windows.h>
 char *strdup();
 
 #ifdef HAVE_SDL2_SDL_H
@@ -20,32 +26,195 @@ char *strdup();
 #include <SDL/SDL.h>
 #endif
 
+#include "../../diag.h"
+
+/* timers count QueryPerformanceCounter ticks. sys_sleep waits on a
+   high resolution waitable timer where windows has them (10 1803 and
+   up) and an ordinary one otherwise, set to go off SPIN microseconds
+   early, and busy waits the rest; even the high resolution timer
+   can be late by a fraction of a millisecond */
+#define SPIN 500
+
+static LONGLONG freq;
+static HANDLE waiter;
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+static LONGLONG now()
+{
+	LARGE_INTEGER c;
+
+	if (!freq)
+	{
+		QueryPerformanceFrequency(&c);
+		freq = c.QuadPart;
+	}
+	QueryPerformanceCounter(&c);
+	return c.QuadPart;
+}
+
 void *sys_timer()
 {
-	Uint32 *tv;
+	LONGLONG *tv;
 	
 	tv = malloc(sizeof *tv);
-	*tv = SDL_GetTicks() * 1000;
+	*tv = now();
 	return tv;
 }
 
-int sys_elapsed(Uint32 *cl)
+int sys_elapsed(LONGLONG *cl)
+{
+	LONGLONG t, us;
+
+	t = now();
+	us = (t - *cl) * 1000000 / freq;
+	*cl = t;
+	if (us < 0) return 0;
+	return us > INT_MAX ? INT_MAX : (int)us;
+}
+
+struct thread
+{
+	void (*fn)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI thread(LPVOID p)
+{
+	struct thread t = *(struct thread *)p;
+
+	free(p);
+	t.fn(t.arg);
+	diag_done();
+	return 0;
+}
+
+int sys_thread(void (*fn)(void *), void *arg)
+{
+	struct thread *t = malloc(sizeof *t);
+	HANDLE h;
+
+	if (!t) return -1;
+	t->fn = fn;
+	t->arg = arg;
+	if (!(h = CreateThread(NULL, 0, thread, t, 0, NULL)))
+	{
+		free(t);
+		return -1;
+	}
+	CloseHandle(h);
+	return 0;
+}
+
+/* there's no fork */
+void sys_onfork(void (*child)())
+{
+}
+
+int sys_pin(int cpu, int prio)
+{
+	int err = 0;
+
+	if (cpu >= 0)
+		err |= cpu >= (int)sizeof(DWORD_PTR) * 8
+			|| !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+	if (prio > 0)
+		err |= !SetThreadPriority(GetCurrentThread(),
+			THREAD_PRIORITY_TIME_CRITICAL);
+	return err ? -1 : 0;
+}
+
+/* numa placement is left to windows */
+int sys_node(int cpu)
+{
+	return cpu < 0;
+}
+
+int sys_pin_node(int node)
+{
+	return node > 0 ? -1 : 0;
+}
+
+char *sys_nodecopy(char *fn, int node)
+{
+	return 0;
+}
+
+unsigned sys_micros()
 {
-	Uint32 now;
-	Uint32 usecs;
+	LONGLONG t = now();
 
-	now = SDL_GetTicks() * 1000;
-	usecs = now - *cl;
-	*cl = now;
-	return usecs;
+	return (t / freq) * 1000000 + (t % freq) * 1000000 / freq;
 }
 
 void sys_sleep(int us)
 {
-	/* dbk: for some reason 2000 works..
-	   maybe its just compensation for the time it takes for SDL_Delay to
-	   execute, or maybe sys_timer is too slow */
-	SDL_Delay(us/1000);
+	LARGE_INTEGER due;
+	LONGLONG end;
+
+	if (us <= 0) return;
+	end = now() + us * freq / 1000000;
+	if (!waiter)
+		waiter = CreateWaitableTimerExW(NULL, NULL,
+			CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (!waiter)
+		waiter = CreateWaitableTimer(NULL, TRUE, NULL);
+	if (us > SPIN && waiter)
+	{
+		/* negative means relative, in 100ns units */
+		due.QuadPart = -10LL * (us - SPIN);
+		if (SetWaitableTimer(waiter, &due, 0, NULL, NULL, FALSE))
+			WaitForSingleObject(waiter, INFINITE);
+	}
+	while (now() < end);
+}
+
+void sys_nap(int us)
+{
+	if (us > 0) Sleep((us + 999) / 1000);
+}
+
+/* no profiling timer; --bench gives no time split */
+int sys_sampler(void (*fn)(), int us)
+{
+	return -1;
+}
+
+/* no sockets; gdbport and linkport do nothing */
+int sys_listen(int port)
+{
+	return -1;
+}
+
+int sys_recv(int fd, int wait)
+{
+	return -1;
+}
+
+int sys_send(int fd, char *buf, int len)
+{
+	return -1;
+}
+
+void sys_hangup(int fd)
+{
+}
+
+int sys_udp(int port, char *host, int peerport)
+{
+	return -1;
+}
+
+int sys_udprecv(int fd, char *buf, int len, int us)
+{
+	return -1;
+}
+
+int sys_udpsend(int fd, char *buf, int len)
+{
+	return -1;
 }
 
 void sys_sanitize(char *s)
@@ -55,6 +224,40 @@ void sys_sanitize(char *s)
 		if (s[i] == '\\') s[i] = '/';
 }
 
+/* no mmap here, the loader falls back to reading the file */
+void *sys_mapfile(char *fn, int *len, int size, int fill)
+{
+	return 0;
+}
+
+void sys_unmapfile(void *p, int size)
+{
+}
+
+/* rename won't replace a file here, MoveFileEx will */
+int sys_putfile(char *fn, void *data, int len)
+{
+	char *tmp = malloc(strlen(fn) + 32);
+	int fd, ok = 0;
+
+	if (!tmp) return -1;
+	sprintf(tmp, "%s.%lu.%08lx", fn, (unsigned long)GetCurrentProcessId(),
+		(unsigned long)time(0));
+	if ((fd = _open(tmp, _O_WRONLY|_O_CREAT|_O_EXCL|_O_BINARY,
+		_S_IREAD|_S_IWRITE)) >= 0)
+	{
+		ok = _write(fd, data, len) == len;
+		if (_close(fd) || !ok
+			|| !MoveFileEx(tmp, fn, MOVEFILE_REPLACE_EXISTING))
+		{
+			remove(tmp);
+			ok = 0;
+		}
+	}
+	free(tmp);
+	return ok ? 0 : -1;
+}
+
 void sys_initpath(char *exe)
 {
 	char *buf, *home, *p;
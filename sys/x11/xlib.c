@@ -3,6 +3,14 @@
  *
  * Xlib interface.
  * dist under gnu gpl
+ *
+ * With MIT-SHM there are up to three shared images, drawn into in
+ * turn: each frame goes into one the server has finished with, and
+ * is put with a completion event, or presented at the next vblank
+ * with the Present extension where there is one (that frees it with
+ * an idle event instead). Nothing here waits for a reply; with three
+ * images, a frame finished while the other two are still the
+ * server's is dropped and the next one drawn over it.
  */
 #include <ctype.h>
 #include "../../sys.h"
@@ -17,6 +25,11 @@
 #define USE_XSHM  /* assume we have shm if no config.h - is this ok? */
 #endif
 
+#if defined(USE_XSHM) && defined(HAVE_LIBXPRESENT) \
+ && defined(HAVE_X11_EXTENSIONS_XPRESENT_H)
+#define USE_XPRESENT
+#endif
+
 #ifdef USE_XSHM
 /* make sure ipc.h and shm.h will work! */
 #define _SVID_SOURCE
@@ -25,6 +38,7 @@
 #endif
 
 #include <stdlib.h>
+#include <poll.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -36,6 +50,10 @@
 #include <sys/shm.h>
 #endif
 
+#ifdef USE_XPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+
 #include "fb.h"
 #include "input.h"
 #include "rc.h"
@@ -45,11 +63,15 @@ struct fb fb;
 
 static int vmode[3] = { 0, 0, 0 };
 static int x_shmsync = 1;
+static int x_shmbufs = 3;
+static int x_present = 1;
 
 rcvar_t vid_exports[] =
 {
 	RCV_VECTOR("vmode", &vmode, 3, "advisory video mode, w h bpp"),
 	RCV_BOOL("x_shmsync", &x_shmsync, "use shm sync"),
+	RCV_INT("x_shmbufs", &x_shmbufs, "shared images drawn into in turn, 1-3"),
+	RCV_BOOL("x_present", &x_present, "show frames at vblank with the Present extension"),
 	RCV_END
 };
 
@@ -99,14 +121,29 @@ static XSizeHints x_size;
 static XWMHints x_wmhints;
 /*static XClassHint x_class;*/
 
+#define MAXBUFS 3
+
 #ifdef USE_XSHM
-static XShmSegmentInfo x_shm;
+static XShmSegmentInfo x_shm[MAXBUFS];
+#endif
+
+#ifdef USE_XPRESENT
+static int x_usepresent;
+static int x_presentop;
+static Pixmap x_pixmap[MAXBUFS];
+static unsigned x_serial;
 #endif
 
 static int x_useshm;
 static int x_shmevent;
-static int x_shmdone;
-static XImage *x_image;
+static XImage *x_image[MAXBUFS];
+static int x_nbufs;
+/* the image drawn into, the one last put (which an expose needs
+   again), and those the server hasn't finished with */
+static int x_cur, x_shown;
+static int x_busy[MAXBUFS];
+/* images whose border wants clearing when their turn comes */
+static int x_dirty[MAXBUFS];
 static int x_byteswap;
 
 static XEvent x_ev;
@@ -116,70 +153,118 @@ static XEvent x_ev;
 
 static void freescreen()
 {
-	if (!initok || !x_image) return;
-	if ((char *)fb.ptr != (char *)x_image->data)
+	int i;
+
+	if (!initok || !x_image[0]) return;
+	if ((char *)fb.ptr != (char *)x_image[x_cur]->data)
 		free(fb.ptr);
 #ifdef USE_XSHM
 	if (x_useshm)
 	{
 		/* FIXME - is this the right way to free shared mem? */
 		XSync(x_display, False);
-		if (!XShmDetach(x_display, &x_shm))
-			die ("XShmDetach failed\n");
+		for (i = 0; i < x_nbufs; i++)
+		{
+#ifdef USE_XPRESENT
+			if (x_pixmap[i]) XFreePixmap(x_display, x_pixmap[i]);
+			x_pixmap[i] = 0;
+#endif
+			if (!XShmDetach(x_display, &x_shm[i]))
+				die ("XShmDetach failed\n");
+		}
 		XSync(x_display, False);
-		shmdt(x_shm.shmaddr);
-		shmctl(x_shm.shmid, IPC_RMID, 0);
-		x_image->data = NULL;
+		for (i = 0; i < x_nbufs; i++)
+		{
+			shmdt(x_shm[i].shmaddr);
+			shmctl(x_shm[i].shmid, IPC_RMID, 0);
+			x_image[i]->data = NULL;
+		}
 	}
 #endif
-	free(x_image);
-	x_image = NULL;
+	for (i = 0; i < x_nbufs; i++)
+	{
+		free(x_image[i]);
+		x_image[i] = NULL;
+	}
 	fb.ptr = NULL;
 }
 
+#ifdef USE_XSHM
+/* 0 if the server won't make shared images */
+static int shmimage(int i)
+{
+	XImage *img;
+
+	img = XShmCreateImage(
+		x_display, x_vis, x_bits, ZPixmap, 0,
+		&x_shm[i], x_width, x_height);
+	if (!img) return 0;
+	x_shm[i].shmid = shmget(
+		IPC_PRIVATE,
+		img->bytes_per_line * img->height,
+		IPC_CREAT | 0777);
+	if (x_shm[i].shmid < 0)
+		die("shmget failed\n");
+	img->data = x_shm[i].shmaddr =
+		shmat(x_shm[i].shmid, 0, 0);
+	if (!img->data)
+		die("shmat failed\n");
+	x_shm[i].readOnly = False;
+	if (!XShmAttach(x_display, &x_shm[i]))
+		die("XShmAttach failed\n");
+#ifdef USE_XPRESENT
+	if (x_usepresent)
+		x_pixmap[i] = XShmCreatePixmap(
+			x_display, x_win, img->data, &x_shm[i],
+			x_width, x_height, x_bits);
+#endif
+	x_image[i] = img;
+	return 1;
+}
+#endif
+
 static void allocscreen()
 {
+	int i;
+
 	if (initok) freescreen();
+	x_nbufs = 1;
+	x_cur = 0;
+	x_shown = -1;
+	for (i = 0; i < MAXBUFS; i++)
+		x_busy[i] = x_dirty[i] = 0;
 #ifdef USE_XSHM
 	if (x_useshm)
 	{
-		x_image = XShmCreateImage(
-			x_display, x_vis, x_bits, ZPixmap, 0,
-			&x_shm, x_width, x_height);
-		if (x_image)
+		x_nbufs = x_shmbufs < 1 ? 1
+			: x_shmbufs > MAXBUFS ? MAXBUFS : x_shmbufs;
+		for (i = 0; i < x_nbufs && shmimage(i); i++);
+		x_nbufs = i;
+		if (x_nbufs)
 		{
-			x_shm.shmid = shmget(
-				IPC_PRIVATE,
-				x_image->bytes_per_line * x_image->height,
-				IPC_CREAT | 0777);
-			if (x_shm.shmid < 0)
-				die("shmget failed\n");
-			x_image->data = x_shm.shmaddr =
-				shmat(x_shm.shmid, 0, 0);
-			if (!x_image->data)
-				die("shmat failed\n");
-			if (!XShmAttach(x_display, &x_shm))
-				die("XShmAttach failed\n");
 			XSync(x_display, False);
-			x_shmdone = 1;
-			fb.pitch = x_image->bytes_per_line;
+			fb.pitch = x_image[0]->bytes_per_line;
 		}
 		else
 		{
 			x_useshm = 0;
+			x_nbufs = 1;
+#ifdef USE_XPRESENT
+			x_usepresent = 0;
+#endif
 		}
 	}
 #endif
 	if (!x_useshm)
 	{
-		x_image = XCreateImage(
+		x_image[0] = XCreateImage(
 			x_display, x_vis, x_bits, ZPixmap, 0,
 			malloc(x_width*x_height*x_bytes),
 			x_width, x_height, x_bits, x_width*x_bytes);
-		if (!x_image)
+		if (!x_image[0])
 			die("XCreateImage failed\n");
 	}
-	x_byteswap = x_image->byte_order ==
+	x_byteswap = x_image[0]->byte_order ==
 #ifdef IS_LITTLE_ENDIAN
 		MSBFirst
 #else
@@ -187,9 +272,9 @@ static void allocscreen()
 #endif
 		;
 	if (x_byteswap && x_bytes > 1)
-		fb.ptr = malloc(x_image->bytes_per_line * x_image->height);
+		fb.ptr = malloc(x_image[0]->bytes_per_line * x_image[0]->height);
 	else
-		fb.ptr = (byte *)x_image->data;
+		fb.ptr = (byte *)x_image[0]->data;
 }
 
 
@@ -260,6 +345,10 @@ static int vid_check_depth(int start)
 void vid_init()
 {
 	int i, dd;
+#ifdef USE_XPRESENT
+	int major, minor, evbase, errbase;
+	Bool pixmaps;
+#endif
 
 	if (initok) return;
 
@@ -293,7 +382,7 @@ void vid_init()
 
 	x_wattrmask = CWEventMask | CWBorderPixel | CWColormap;
 	x_wattr.event_mask = KeyPressMask | KeyReleaseMask | ExposureMask
-		| FocusChangeMask;
+		| FocusChangeMask | StructureNotifyMask;
 	x_wattr.border_pixel = 0;
 	x_wattr.colormap = x_cmap;
 
@@ -357,6 +446,18 @@ void vid_init()
 		x_shmevent = XShmGetEventBase(x_display) + ShmCompletion;
 	}
 #endif
+#ifdef USE_XPRESENT
+	/* presenting wants the images as pixmaps as well */
+	if (x_useshm && x_present
+		&& XShmQueryVersion(x_display, &major, &minor, &pixmaps)
+		&& pixmaps && XShmPixmapFormat(x_display) == ZPixmap
+		&& XPresentQueryExtension(x_display, &x_presentop,
+			&evbase, &errbase))
+	{
+		x_usepresent = 1;
+		XPresentSelectInput(x_display, x_win, PresentIdleNotifyMask);
+	}
+#endif
 
 	colorshifts();
 	allocscreen();
@@ -402,7 +503,67 @@ static int mapxkeycode(int xkeycode)
 }
 
 
-void vid_end();
+/* the server's done with an image */
+static void idle(int i)
+{
+	if (i < x_nbufs) x_busy[i] = 0;
+}
+
+/* the window needs the last frame again */
+static void expose()
+{
+	if (x_shown < 0) return;
+#ifdef USE_XPRESENT
+	if (x_usepresent)
+	{
+		XCopyArea(x_display, x_pixmap[x_shown], x_win, x_gc,
+			0, 0, x_width, x_height, 0, 0);
+		return;
+	}
+#endif
+#ifdef USE_XSHM
+	if (x_useshm)
+	{
+		XShmPutImage(x_display, x_win, x_gc, x_image[x_shown],
+			0, 0, 0, 0, x_width, x_height, False);
+		return;
+	}
+#endif
+	XPutImage(x_display, x_win, x_gc, x_image[0],
+		0, 0, 0, 0, x_width, x_height);
+}
+
+static void extevent()
+{
+#if defined(USE_XSHM)
+	int i;
+
+	if (x_ev.type == x_shmevent)
+	{
+		for (i = 0; i < x_nbufs; i++)
+			if (x_shm[i].shmseg
+				== ((XShmCompletionEvent *)&x_ev)->shmseg)
+				break;
+		idle(i);
+	}
+#endif
+#ifdef USE_XPRESENT
+	if (x_ev.type == GenericEvent
+		&& x_ev.xcookie.extension == x_presentop
+		&& XGetEventData(x_display, &x_ev.xcookie))
+	{
+		if (x_ev.xcookie.evtype == PresentIdleNotify)
+		{
+			for (i = 0; i < x_nbufs; i++)
+				if (x_pixmap[i] == ((XPresentIdleNotifyEvent *)
+					x_ev.xcookie.data)->pixmap)
+					break;
+			idle(i);
+		}
+		XFreeEventData(x_display, &x_ev.xcookie);
+	}
+#endif
+}
 
 static int nextevent(int sync)
 {
@@ -423,11 +584,17 @@ static int nextevent(int sync)
 		ev.code = mapxkeycode(x_ev.xkey.keycode);
 		break;
 	case Expose:
-		vid_end();
+		expose();
 		return 1;
 		break;
+	case UnmapNotify:
+		fb.hidden = 1;
+		return 1;
+	case MapNotify:
+		fb.hidden = 0;
+		return 1;
 	default:
-		if (x_ev.type == x_shmevent) x_shmdone = 1;
+		extevent();
 		return 1;
 		break;
 	}
@@ -436,9 +603,18 @@ static int nextevent(int sync)
 
 
 
+/* with wait, sleeps until the server has something for us, but not
+   so long that the joystick goes unread */
 void ev_poll(int wait)
 {
-	(void) wait;
+	struct pollfd p;
+
+	if (wait && initok && !XPending(x_display))
+	{
+		p.fd = ConnectionNumber(x_display);
+		p.events = POLLIN;
+		poll(&p, 1, 100);
+	}
 	if (initok) while (nextevent(0));
 	joy_poll();
 }
@@ -464,29 +640,53 @@ void vid_setpal(int i, int r, int g, int b)
 	}
 }
 
+/* the next frame goes into an image the server's done with, other
+   than the one on the screen; only with every one still busy, and
+   x_shmsync, does this wait. a frame that wasn't put is drawn over.
+   with byteswapping, or while lockstep or link has fb.ptr pointed at
+   a buffer of its own, the images still take turns but fb.ptr stays */
 void vid_begin()
 {
-	if (!x_useshm) return;
+	int i, mine;
 
-	/* XSync(x_display, False); */
-	while (!x_shmdone && x_shmsync)
+	if (!x_useshm) return;
+	while (nextevent(0));
+	if (fb.dirty)
+		for (i = 0; i < x_nbufs; i++)
+			if (i != x_cur) x_dirty[i] = 1;
+	if (x_cur != x_shown && !x_busy[x_cur]) return;
+	for (;;)
+	{
+		for (i = 0; i < x_nbufs; i++)
+			if (!x_busy[i] && (i != x_shown || x_nbufs == 1))
+				break;
+		if (i < x_nbufs || !x_shmsync) break;
 		nextevent(1);
+	}
+	/* without x_shmsync a busy one is drawn into anyway, and isn't
+	   put again until it's free */
+	if (i == x_nbufs) return;
+	mine = (char *)fb.ptr == (char *)x_image[x_cur]->data;
+	x_cur = i;
+	if (mine) fb.ptr = (byte *)x_image[i]->data;
+	if (x_dirty[i]) fb.dirty = 1;
+	x_dirty[i] = 0;
 }
 
-static void endianswap()
+static void endianswap(XImage *img)
 {
 	int cnt;
 	un16 t16;
 	un32 t32;
 	un16 *src16 = (void *)fb.ptr;
-	un16 *dst16 = (void *)x_image->data;
+	un16 *dst16 = (void *)img->data;
 	un32 *src32 = (void *)fb.ptr;
-	un32 *dst32 = (void *)x_image->data;
+	un32 *dst32 = (void *)img->data;
 	
 	switch (x_bytes)
 	{
 	case 2:
-		cnt = (x_image->bytes_per_line * x_image->height)>>1;
+		cnt = (img->bytes_per_line * img->height)>>1;
 		while (cnt--)
 		{
 			t16 = *(src16++);
@@ -494,7 +694,7 @@ static void endianswap()
 		}
 		break;
 	case 4:
-		cnt = (x_image->bytes_per_line * x_image->height)>>2;
+		cnt = (img->bytes_per_line * img->height)>>2;
 		while (cnt--)
 		{
 			t32 = *(src32++);
@@ -508,28 +708,40 @@ static void endianswap()
 
 void vid_end()
 {
-	if (!initok) return;
+	int i, n;
 
-	if (x_byteswap) endianswap();
-	if (x_useshm)
-	{
-		if (!x_shmdone) return;
-#ifdef USE_XSHM
-		if (!XShmPutImage(
-			x_display, x_win, x_gc, x_image,
-			0, 0, 0, 0, x_width, x_height, True))
-			die("XShmPutImage failed\n");
-#endif
-		x_shmdone = 0;
-	}
-	else
+	if (!initok || !fb.drawn) return;
+	fb.drawn = 0;
+	if (!x_useshm)
 	{
-		XPutImage(x_display, x_win, x_gc, x_image,
+		if (x_byteswap) endianswap(x_image[0]);
+		XPutImage(x_display, x_win, x_gc, x_image[0],
 			  0, 0, 0, 0, x_width, x_height);
+		x_shown = 0;
+		return;
 	}
+	while (nextevent(0));
+	if (x_busy[x_cur]) return;
+	/* with a third image, rather than have nothing to draw the next
+	   frame into, this one's dropped and the next drawn over it */
+	for (i = n = 0; i < x_nbufs; i++)
+		if (i != x_cur && !x_busy[i]) n++;
+	if (!n && x_nbufs > 2) return;
+	if (x_byteswap) endianswap(x_image[x_cur]);
+#ifdef USE_XPRESENT
+	if (x_usepresent)
+		XPresentPixmap(x_display, x_win, x_pixmap[x_cur], ++x_serial,
+			None, None, 0, 0, None, None, None, PresentOptionNone,
+			0, 0, 0, NULL, 0);
+	else
+#endif
+#ifdef USE_XSHM
+	if (!XShmPutImage(
+		x_display, x_win, x_gc, x_image[x_cur],
+		0, 0, 0, 0, x_width, x_height, True))
+		die("XShmPutImage failed\n");
+#endif
+	x_busy[x_cur] = 1;
+	x_shown = x_cur;
+	XFlush(x_display);
 }
-
-
-
-
-
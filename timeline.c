@@ -0,0 +1,94 @@
+/*
+ * timeline.c
+ *
+ * Frame timeline tracing. With "timeline" set to a number of events, the
+ * main loop marks the start and end of everything a frame spends its
+ * time on (emulation, drawing, presenting, mixing, handing sound over,
+ * sleeping and input) in a ring of that many entries, allocated once.
+ * When the ring is full the oldest entries go. "timelinedump", or exit,
+ * writes what's in it out in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev both open, so a stutter can be
+ * pinned on whatever took too long in the frame it happened in.
+ * Timestamps are microseconds of sys_timer time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "rc.h"
+#include "sys.h"
+#include "timeline.h"
+
+int timeline;
+static char *timelinefile;
+
+rcvar_t timeline_exports[] =
+{
+	RCV_INT("timeline", &timeline, "frame timeline events to keep, 0 = off"),
+	RCV_STRING("timelinefile", &timelinefile, "file timelinedump writes to"),
+	RCV_END
+};
+
+static const char *names[TL_N] =
+{
+	"cpu_emulate", "lcd_flush", "vid_end", "sound_mix",
+	"pcm_submit", "sys_sleep", "doevents"
+};
+
+static struct ent
+{
+	un32 ts;
+	byte what, end;
+} *ring;
+static int size, head, count;
+static void *timer;
+static un32 now;
+
+
+void timeline_mark(int what, int end)
+{
+	struct ent *e;
+
+	if (size != timeline)
+	{
+		free(ring);
+		size = (ring = malloc(timeline * sizeof *ring)) ? timeline : 0;
+		head = count = 0;
+		if (!size) return;
+	}
+	if (!timer) timer = sys_timer();
+	now += sys_elapsed(timer);
+	e = ring + head;
+	e->ts = now;
+	e->what = what;
+	e->end = end;
+	if (++head == size) head = 0;
+	if (count < size) count++;
+}
+
+/* write the ring out to name, or timelinefile if name is 0. an end whose
+   beginning has already been dropped from the ring is left out */
+int timeline_dump(char *name)
+{
+	FILE *f;
+	struct ent *e;
+	int i, open[TL_N] = { 0 }, first = 1;
+
+	if (!count) return 0;
+	if (!name) name = timelinefile && *timelinefile ? timelinefile : "gnuboy-timeline.json";
+	if (!(f = fopen(name, "w"))) return -1;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (i = 0; i < count; i++)
+	{
+		e = ring + (head - count + i + size) % size;
+		if (e->end && !open[e->what]) continue;
+		open[e->what] += e->end ? -1 : 1;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu,\"pid\":1,\"tid\":1}",
+			first ? "" : ",", names[e->what], e->end ? 'E' : 'B',
+			(unsigned long)e->ts);
+		first = 0;
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) ? -1 : 0;
+}
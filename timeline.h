@@ -0,0 +1,26 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+/* the spans the frame timeline is made of, see timeline.c */
+enum
+{
+	TL_CPU,
+	TL_LCD,
+	TL_VID,
+	TL_MIX,
+	TL_SUBMIT,
+	TL_SLEEP,
+	TL_EVENTS,
+	TL_N
+};
+
+extern int timeline;
+
+void timeline_mark(int what, int end);
+int timeline_dump(char *name);
+
+/* with tracing off these cost a test of one global */
+#define TL_BEGIN(w) (timeline > 0 ? timeline_mark((w), 0) : (void)0)
+#define TL_END(w) (timeline > 0 ? timeline_mark((w), 1) : (void)0)
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * unity.c
+ *
+ * The modules the cpu loop calls into all the time, as one
+ * translation unit, so the compiler can inline mem_read, ioreg_write,
+ * lcdc_trans and the rest into it rather than calling across files.
+ * "make unity" builds with this in place of the objects it includes
+ * (HOT_OBJS in Rules); see INSTALL.
+ *
+ * The shorthand lcdc.c and lcd.c define for themselves is undefined
+ * again after each, since it would otherwise clash with cpuregs.h in
+ * the files that come after. cpu.c, with the most macros of all,
+ * comes last.
+ */
+
+#include "lcdc.c"
+#undef C
+
+#include "lcd.c"
+#undef BG
+#undef WND
+#undef BUF
+#undef PRI
+#undef PAL1
+#undef PAL2
+#undef PAL4
+#undef VS
+#undef NS
+#undef L
+#undef X
+#undef Y
+#undef S
+#undef T
+#undef U
+#undef V
+#undef WX
+#undef WY
+#undef WT
+#undef WV
+#undef WL
+
+#include "rtc.c"
+#include "sound.c"
+#include "hw.c"
+#include "mem.c"
+#include "cpu.c"
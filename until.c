@@ -0,0 +1,267 @@
+/*
+ * until.c
+ *
+ * Conditions for ending a run early. Test roms and regression runs
+ * mostly know how they came out long before "framecount" is up, so
+ * "until" lists what to look for, and the first of them to come true
+ * ends the run at the end of that frame:
+ *
+ *   pc=[bank:]addr   the cpu runs the instruction at addr, in that rom
+ *                    bank if one is given
+ *   ram=addr:val     the byte at addr reads val, looked at once a frame
+ *   serial=text      what the game has sent out of the link port holds
+ *                    text, \xNN for a byte that isn't printable
+ *   hash=xxxxxxxx    the frame just finished has this hash, as the
+ *                    headless hashlog shows them (lcd_framehash)
+ *   static=n         the picture has been the same for n frames
+ *
+ * Numbers are hex but for static's. They're separated by spaces or
+ * by +, for the command line, where spaces and commas split a value.
+ *
+ * Everything but pc is looked at in until_frame, which costs next to
+ * nothing: a peek, a length compared, a hash the lcd works out as it
+ * goes. pc is a read watch on the address (see debug.c), so only that
+ * 4k page runs the slow way; every fetch from it is looked at when
+ * it's made, and any other read of that one byte counts as well.
+ * A debugger watch on the very same byte goes when "until" changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "defs.h"
+#include "mem.h"
+#include "hw.h"
+#include "lcd.h"
+#include "rc.h"
+#include "debug.h"
+#include "until.h"
+
+static char *until;
+
+rcvar_t until_exports[] =
+{
+	RCV_STRING("until", &until, "end the run when any of these holds, see docs/CONFIG"),
+	RCV_END
+};
+
+#define MAXCOND 16
+#define MAXTEXT 64
+
+enum { PC, RAM, SERIAL, HASH, STATIC };
+
+static struct cond
+{
+	int kind, bank, addr, val, len;
+	byte text[MAXTEXT];
+	char name[MAXTEXT + 8];
+} conds[MAXCOND];
+static int nconds;
+
+/* a copy of what the conditions were parsed from, to tell when
+   "until" is set again; whether any needs the picture's hash, the pc
+   fetched and how far static and serial have got */
+static char *parsed;
+static int hashes, fetched = -1, same, seen;
+static un32 last;
+
+static int hex(char *s, char **e, int *v)
+{
+	*v = strtol(s, e, 16);
+	return *e == s;
+}
+
+static int text(struct cond *c, char *s)
+{
+	int v;
+
+	for (c->len = 0; *s; c->len++)
+	{
+		if (c->len == MAXTEXT) return -1;
+		if (s[0] == '\\' && s[1] == 'x' && isxdigit(s[2]) && isxdigit(s[3]))
+		{
+			sscanf(s + 2, "%2x", &v);
+			c->text[c->len] = v;
+			s += 4;
+		}
+		else c->text[c->len] = *s++;
+	}
+	return c->len ? 0 : -1;
+}
+
+static int cond(struct cond *c, char *s)
+{
+	char *v = strchr(s, '='), *e;
+	int a;
+
+	snprintf(c->name, sizeof c->name, "%s", s);
+	if (!v) return -1;
+	*v++ = 0;
+	if (!strcmp(s, "pc"))
+	{
+		c->kind = PC;
+		c->bank = -1;
+		if (hex(v, &e, &a)) return -1;
+		if (*e == ':')
+		{
+			c->bank = a;
+			if (hex(e + 1, &e, &a)) return -1;
+		}
+		c->addr = a & 0xffff;
+		return *e ? -1 : 0;
+	}
+	if (!strcmp(s, "ram"))
+	{
+		c->kind = RAM;
+		if (hex(v, &e, &c->addr) || *e != ':' || hex(e + 1, &e, &c->val))
+			return -1;
+		return *e ? -1 : 0;
+	}
+	if (!strcmp(s, "serial"))
+	{
+		c->kind = SERIAL;
+		return text(c, v);
+	}
+	if (!strcmp(s, "hash"))
+	{
+		c->kind = HASH;
+		c->val = strtoul(v, &e, 16);
+		return *e || e == v ? -1 : 0;
+	}
+	if (!strcmp(s, "static"))
+	{
+		c->kind = STATIC;
+		c->val = strtol(v, &e, 10);
+		return *e || c->val < 1 ? -1 : 0;
+	}
+	return -1;
+}
+
+static void unwatch()
+{
+	int i;
+
+	for (i = 0; i < nconds; i++)
+		if (conds[i].kind == PC) debug_setwatch(conds[i].addr, 1, 1, 0);
+	nconds = 0;
+}
+
+/* "until" again, after it's been set; -1 if any of it won't parse,
+   and then nothing is looked for */
+static int parse()
+{
+	char *s, *w;
+	int i, r = 0;
+
+	unwatch();
+	free(parsed);
+	parsed = until ? strdup(until) : 0;
+	hashes = same = seen = 0;
+	fetched = -1;
+	if (!until || !(s = strdup(until))) return 0;
+	for (w = strtok(s, " \t+"); w; w = strtok(0, " \t+"))
+	{
+		if (nconds == MAXCOND || cond(&conds[nconds], w))
+		{
+			fprintf(stderr, "until: cannot make sense of %s\n",
+				nconds < MAXCOND ? conds[nconds].name : w);
+			r = -1;
+			break;
+		}
+		nconds++;
+	}
+	free(s);
+	if (r) nconds = 0;
+	for (i = 0; i < nconds; i++)
+	{
+		if (conds[i].kind == PC) debug_setwatch(conds[i].addr, 1, 1, 1);
+		else if (conds[i].kind == HASH || conds[i].kind == STATIC)
+			hashes = 1;
+	}
+	if (hashes) lcd_hash(1);
+	return r;
+}
+
+/* from emu_reset, so a pc the game gets to straight away is watched
+   from the start, and a new rom doesn't inherit anything */
+void until_reset()
+{
+	parse();
+}
+
+/* "until" set to s, for libgnuboy; -1 as for parse */
+int until_set(char *s)
+{
+	char *v[1];
+
+	v[0] = s ? s : "";
+	rc_setvar("until", 1, v);
+	return parse();
+}
+
+/* debug.c's, for a read of a watched byte; 1 if it's one of ours */
+int until_fetch(int a, int bank)
+{
+	int i, ours = 0;
+
+	for (i = 0; i < nconds; i++)
+	{
+		if (conds[i].kind != PC || conds[i].addr != a) continue;
+		ours = 1;
+		if (fetched < 0 && (conds[i].bank < 0 || conds[i].bank == bank))
+			fetched = i;
+	}
+	return ours;
+}
+
+static int contains(byte *p, int len, byte *s, int n)
+{
+	for (; len >= n; p++, len--)
+		if (!memcmp(p, s, n)) return 1;
+	return 0;
+}
+
+/* once a frame, when it's done: the condition that came true, as it
+   was written, or 0 */
+char *until_frame()
+{
+	struct cond *c;
+	byte *out;
+	un32 h = 0;
+	int i, len;
+
+	if (!until != !parsed || (until && strcmp(until, parsed))) parse();
+	if (!nconds) return 0;
+	if (fetched >= 0) return conds[fetched].name;
+	if (hashes)
+	{
+		h = lcd_framehash();
+		same = h == last ? same + 1 : 0;
+		last = h;
+	}
+	out = hw_serial_output(&len);
+	for (i = 0; i < nconds; i++)
+	{
+		c = &conds[i];
+		switch (c->kind)
+		{
+		case RAM:
+			if (debug_peek(c->addr) == c->val) return c->name;
+			break;
+		case SERIAL:
+			if (len != seen && contains(out, len, c->text, c->len))
+				return c->name;
+			break;
+		case HASH:
+			if (h == (un32)c->val) return c->name;
+			break;
+		case STATIC:
+			if (same >= c->val) return c->name;
+			break;
+		}
+	}
+	seen = len;
+	return 0;
+}
@@ -13,6 +13,16 @@
 /* Uncomment to enable CRC64 support. */
 #define XZ_USE_CRC64
 
+/*
+ * How many CRC tables to keep: eight for the slice-by-8 loops, or one,
+ * byte at a time, for gnuboy's LOWMEM builds (24 KiB less).
+ */
+#ifdef LOWMEM
+#	define XZ_CRC_SLICES 1
+#else
+#	define XZ_CRC_SLICES 8
+#endif
+
 /* Uncomment as needed to enable BCJ filter decoders. */
 #if 0
 #define XZ_DEC_X86
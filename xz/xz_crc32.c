@@ -9,23 +9,20 @@
  */
 
 /*
- * This is not the fastest implementation, but it is pretty compact.
- * The fastest versions of xz_crc32() on modern CPUs without hardware
- * accelerated CRC instruction are 3-5 times as fast as this version,
- * but they are bigger and use more memory for the lookup table.
+ * This is the slice-by-8 variant: eight lookup tables (8 KiB) let the
+ * inner loop consume eight bytes per iteration instead of one, which
+ * is several times faster than the compact byte-at-a-time version.
+ * The input is assembled byte by byte, so it is endian-neutral and has
+ * no alignment requirements.
  */
 
 #include "xz_private.h"
 
-/*
- * STATIC_RW_DATA is used in the pre-boot environment on some architectures.
- * See <linux/decompress/mm.h> for details.
- */
 #ifndef STATIC_RW_DATA
 #	define STATIC_RW_DATA static
 #endif
 
-STATIC_RW_DATA uint32_t xz_crc32_table[256];
+STATIC_RW_DATA uint32_t xz_crc32_table[XZ_CRC_SLICES][256];
 
 XZ_EXTERN void xz_crc32_init(void)
 {
@@ -40,7 +37,15 @@ XZ_EXTERN void xz_crc32_init(void)
 		for (j = 0; j < 8; ++j)
 			r = (r >> 1) ^ (poly & ~((r & 1) - 1));
 
-		xz_crc32_table[i] = r;
+		xz_crc32_table[0][i] = r;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		r = xz_crc32_table[0][i];
+		for (j = 1; j < XZ_CRC_SLICES; ++j) {
+			r = (r >> 8) ^ xz_crc32_table[0][r & 0xFF];
+			xz_crc32_table[j][i] = r;
+		}
 	}
 
 	return;
@@ -50,8 +55,26 @@ XZ_EXTERN uint32_t xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 {
 	crc = ~crc;
 
+#if XZ_CRC_SLICES == 8
+	while (size >= 8) {
+		crc ^= (uint32_t)buf[0] | ((uint32_t)buf[1] << 8)
+				| ((uint32_t)buf[2] << 16)
+				| ((uint32_t)buf[3] << 24);
+		crc = xz_crc32_table[7][crc & 0xFF]
+				^ xz_crc32_table[6][(crc >> 8) & 0xFF]
+				^ xz_crc32_table[5][(crc >> 16) & 0xFF]
+				^ xz_crc32_table[4][crc >> 24]
+				^ xz_crc32_table[3][buf[4]]
+				^ xz_crc32_table[2][buf[5]]
+				^ xz_crc32_table[1][buf[6]]
+				^ xz_crc32_table[0][buf[7]];
+		buf += 8;
+		size -= 8;
+	}
+#endif
+
 	while (size != 0) {
-		crc = xz_crc32_table[*buf++ ^ (crc & 0xFF)] ^ (crc >> 8);
+		crc = xz_crc32_table[0][*buf++ ^ (crc & 0xFF)] ^ (crc >> 8);
 		--size;
 	}
 
@@ -16,7 +16,7 @@
 #	define STATIC_RW_DATA static
 #endif
 
-STATIC_RW_DATA uint64_t xz_crc64_table[256];
+STATIC_RW_DATA uint64_t xz_crc64_table[XZ_CRC_SLICES][256];
 
 XZ_EXTERN void xz_crc64_init(void)
 {
@@ -31,7 +31,15 @@ XZ_EXTERN void xz_crc64_init(void)
 		for (j = 0; j < 8; ++j)
 			r = (r >> 1) ^ (poly & ~((r & 1) - 1));
 
-		xz_crc64_table[i] = r;
+		xz_crc64_table[0][i] = r;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		r = xz_crc64_table[0][i];
+		for (j = 1; j < XZ_CRC_SLICES; ++j) {
+			r = (r >> 8) ^ xz_crc64_table[0][r & 0xFF];
+			xz_crc64_table[j][i] = r;
+		}
 	}
 
 	return;
@@ -41,8 +49,30 @@ XZ_EXTERN uint64_t xz_crc64(const uint8_t *buf, size_t size, uint64_t crc)
 {
 	crc = ~crc;
 
+#if XZ_CRC_SLICES == 8
+	while (size >= 8) {
+		crc ^= (uint64_t)buf[0] | ((uint64_t)buf[1] << 8)
+				| ((uint64_t)buf[2] << 16)
+				| ((uint64_t)buf[3] << 24)
+				| ((uint64_t)buf[4] << 32)
+				| ((uint64_t)buf[5] << 40)
+				| ((uint64_t)buf[6] << 48)
+				| ((uint64_t)buf[7] << 56);
+		crc = xz_crc64_table[7][crc & 0xFF]
+				^ xz_crc64_table[6][(crc >> 8) & 0xFF]
+				^ xz_crc64_table[5][(crc >> 16) & 0xFF]
+				^ xz_crc64_table[4][(crc >> 24) & 0xFF]
+				^ xz_crc64_table[3][(crc >> 32) & 0xFF]
+				^ xz_crc64_table[2][(crc >> 40) & 0xFF]
+				^ xz_crc64_table[1][(crc >> 48) & 0xFF]
+				^ xz_crc64_table[0][crc >> 56];
+		buf += 8;
+		size -= 8;
+	}
+#endif
+
 	while (size != 0) {
-		crc = xz_crc64_table[*buf++ ^ (crc & 0xFF)] ^ (crc >> 8);
+		crc = xz_crc64_table[0][*buf++ ^ (crc & 0xFF)] ^ (crc >> 8);
 		--size;
 	}
 